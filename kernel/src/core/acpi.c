@@ -2,6 +2,7 @@
 #include <limine.h>
 #include <utils/mem.h>
 #include <mm/vmm.h>
+#include <core/smp.h>
 
 extern volatile struct limine_rsdp_request rsdp_request;
 static struct acpi_rsdp* rsdp = NULL;
@@ -10,6 +11,26 @@ static struct acpi_header* xsdt = NULL;
 static struct acpi_madt* madt = NULL;
 static bool acpi_initialized = false;
 
+// NUMA topology parsed from SRAT/SLIT
+struct numa_range {
+    uint64_t base;
+    uint64_t length;
+    uint32_t node;
+};
+
+struct numa_cpu {
+    uint32_t apic_id;
+    uint32_t node;
+};
+
+static uint32_t numa_domains[ACPI_MAX_NUMA_NODES];  // Proximity domain of each node
+static uint32_t numa_node_count = 0;
+static struct numa_range numa_ranges[ACPI_MAX_NUMA_RANGES];
+static uint32_t numa_range_count = 0;
+static struct numa_cpu numa_cpus[MAX_CPUS];
+static uint32_t numa_cpu_count = 0;
+static struct acpi_slit* slit = NULL;
+
 static bool validate_table(struct acpi_header* table) {
     if (!table) return false;
 
@@ -60,6 +81,69 @@ static void* find_table_rsdt(const char* signature) {
     return NULL;
 }
 
+// Map a proximity domain to a dense node id, allocating one on first sight
+static uint32_t numa_node_for_domain(uint32_t domain) {
+    for (uint32_t i = 0; i < numa_node_count; i++) {
+        if (numa_domains[i] == domain) return i;
+    }
+    if (numa_node_count == ACPI_MAX_NUMA_NODES) return 0;
+
+    numa_domains[numa_node_count] = domain;
+    return numa_node_count++;
+}
+
+static void numa_add_cpu(uint32_t apic_id, uint32_t domain) {
+    if (numa_cpu_count == MAX_CPUS) return;
+    numa_cpus[numa_cpu_count].apic_id = apic_id;
+    numa_cpus[numa_cpu_count].node = numa_node_for_domain(domain);
+    numa_cpu_count++;
+}
+
+static void parse_srat(void) {
+    struct acpi_srat* srat = (struct acpi_srat*)acpi_find_table(ACPI_SRAT_SIGNATURE);
+    if (!srat) return;
+
+    uint8_t* entry = srat->entries;
+    uint8_t* end = (uint8_t*)srat + srat->header.length;
+
+    while (entry + sizeof(struct srat_entry_header) <= end) {
+        struct srat_entry_header* header = (struct srat_entry_header*)entry;
+        if (header->length == 0) break;
+
+        if (header->type == SRAT_TYPE_PROCESSOR_AFFINITY) {
+            struct srat_processor_affinity* cpu = (struct srat_processor_affinity*)entry;
+            if (cpu->flags & SRAT_FLAG_ENABLED) {
+                uint32_t domain = cpu->proximity_domain_low |
+                                  ((uint32_t)cpu->proximity_domain_high[0] << 8) |
+                                  ((uint32_t)cpu->proximity_domain_high[1] << 16) |
+                                  ((uint32_t)cpu->proximity_domain_high[2] << 24);
+                numa_add_cpu(cpu->apic_id, domain);
+            }
+        } else if (header->type == SRAT_TYPE_X2APIC_AFFINITY) {
+            struct srat_x2apic_affinity* cpu = (struct srat_x2apic_affinity*)entry;
+            if (cpu->flags & SRAT_FLAG_ENABLED) {
+                numa_add_cpu(cpu->x2apic_id, cpu->proximity_domain);
+            }
+        } else if (header->type == SRAT_TYPE_MEMORY_AFFINITY) {
+            struct srat_memory_affinity* mem = (struct srat_memory_affinity*)entry;
+            if ((mem->flags & SRAT_FLAG_ENABLED) && mem->length &&
+                numa_range_count < ACPI_MAX_NUMA_RANGES) {
+                numa_ranges[numa_range_count].base = mem->base_address;
+                numa_ranges[numa_range_count].length = mem->length;
+                numa_ranges[numa_range_count].node = numa_node_for_domain(mem->proximity_domain);
+                numa_range_count++;
+            }
+        }
+        entry += header->length;
+    }
+
+    slit = (struct acpi_slit*)acpi_find_table(ACPI_SLIT_SIGNATURE);
+    if (slit && slit->header.length < sizeof(struct acpi_slit) +
+                                      slit->locality_count * slit->locality_count) {
+        slit = NULL;
+    }
+}
+
 void acpi_init(void) {
     if (acpi_initialized) return;
 
@@ -92,6 +176,8 @@ void acpi_init(void) {
     madt = (struct acpi_madt*)acpi_find_table(ACPI_MADT_SIGNATURE);
 
     acpi_initialized = true;
+
+    parse_srat();
 }
 
 bool acpi_is_initialized(void) {
@@ -109,14 +195,21 @@ struct acpi_header* acpi_find_table(const char* signature) {
     return find_table_rsdt(signature);
 }
 
-void* acpi_get_mcfg_base(void) {
+bool acpi_get_mcfg(uint16_t segment, uint64_t* base, uint8_t* start_bus, uint8_t* end_bus) {
     struct acpi_mcfg* mcfg = (struct acpi_mcfg*)acpi_find_table(ACPI_MCFG_SIGNATURE);
     if (!mcfg || mcfg->header.length < sizeof(struct acpi_mcfg)) {
-        return NULL;
+        return false;
     }
 
-    // Return base address of first PCI segment
-    return (void*)(uintptr_t)mcfg->configurations[0].base_address;
+    uint32_t count = (mcfg->header.length - sizeof(struct acpi_mcfg)) / sizeof(mcfg->configurations[0]);
+    for (uint32_t i = 0; i < count; i++) {
+        if (mcfg->configurations[i].pci_segment != segment) continue;
+        *base = mcfg->configurations[i].base_address;
+        *start_bus = mcfg->configurations[i].start_bus;
+        *end_bus = mcfg->configurations[i].end_bus;
+        return true;
+    }
+    return false;
 }
 
 struct acpi_madt* acpi_get_madt(void) {
@@ -171,4 +264,42 @@ struct madt_io_apic* acpi_get_io_apic(uint8_t io_apic_id) {
     }
 
     return NULL;
+}
+
+uint32_t acpi_numa_node_count(void) {
+    return numa_node_count ? numa_node_count : 1;
+}
+
+uint32_t acpi_numa_range_count(void) {
+    return numa_range_count;
+}
+
+bool acpi_numa_range(uint32_t index, uint64_t* base, uint64_t* length, uint32_t* node) {
+    if (index >= numa_range_count) return false;
+
+    *base = numa_ranges[index].base;
+    *length = numa_ranges[index].length;
+    *node = numa_ranges[index].node;
+    return true;
+}
+
+uint32_t acpi_numa_node_for_apic(uint32_t apic_id) {
+    for (uint32_t i = 0; i < numa_cpu_count; i++) {
+        if (numa_cpus[i].apic_id == apic_id) return numa_cpus[i].node;
+    }
+    return 0;
+}
+
+// Relative access cost between nodes, 10 meaning local
+uint8_t acpi_numa_distance(uint32_t from, uint32_t to) {
+    if (from >= numa_node_count || to >= numa_node_count) {
+        return from == to ? ACPI_NUMA_LOCAL_DISTANCE : ACPI_NUMA_REMOTE_DISTANCE;
+    }
+
+    uint64_t a = numa_domains[from];
+    uint64_t b = numa_domains[to];
+    if (!slit || a >= slit->locality_count || b >= slit->locality_count) {
+        return from == to ? ACPI_NUMA_LOCAL_DISTANCE : ACPI_NUMA_REMOTE_DISTANCE;
+    }
+    return slit->entries[a * slit->locality_count + b];
 }
\ No newline at end of file
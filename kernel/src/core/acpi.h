@@ -11,6 +11,8 @@
 #define ACPI_FADT_SIGNATURE "FACP"
 #define ACPI_MCFG_SIGNATURE "MCFG"
 #define ACPI_MADT_SIGNATURE "APIC"
+#define ACPI_SRAT_SIGNATURE "SRAT"
+#define ACPI_SLIT_SIGNATURE "SLIT"
 
 // MADT Entry Types
 #define MADT_TYPE_LOCAL_APIC        0x0
@@ -23,6 +25,19 @@
 #define MADT_TYPE_LOCAL_SAPIC      0x7
 #define MADT_TYPE_PLATFORM_INT_SRC  0x8
 
+// SRAT Entry Types
+#define SRAT_TYPE_PROCESSOR_AFFINITY 0x0
+#define SRAT_TYPE_MEMORY_AFFINITY    0x1
+#define SRAT_TYPE_X2APIC_AFFINITY    0x2
+
+#define SRAT_FLAG_ENABLED           (1 << 0)
+
+// NUMA limits; extra proximity domains fold into node 0
+#define ACPI_MAX_NUMA_NODES  8
+#define ACPI_MAX_NUMA_RANGES 32
+#define ACPI_NUMA_LOCAL_DISTANCE  10
+#define ACPI_NUMA_REMOTE_DISTANCE 20
+
 // ACPI table structures
 struct acpi_rsdp {
     char signature[8];
@@ -104,11 +119,63 @@ struct madt_local_apic_nmi {
     uint8_t lint;
 } __attribute__((packed));
 
+// SRAT (System Resource Affinity Table) structures
+struct acpi_srat {
+    struct acpi_header header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+    uint8_t entries[];
+} __attribute__((packed));
+
+struct srat_entry_header {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct srat_processor_affinity {
+    struct srat_entry_header header;
+    uint8_t proximity_domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct srat_memory_affinity {
+    struct srat_entry_header header;
+    uint32_t proximity_domain;
+    uint16_t reserved1;
+    uint64_t base_address;
+    uint64_t length;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed));
+
+struct srat_x2apic_affinity {
+    struct srat_entry_header header;
+    uint16_t reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed));
+
+// SLIT (System Locality Information Table): a count x count distance matrix
+struct acpi_slit {
+    struct acpi_header header;
+    uint64_t locality_count;
+    uint8_t entries[];
+} __attribute__((packed));
+
 // Function declarations
 void acpi_init(void);
 bool acpi_is_initialized(void);
 struct acpi_header* acpi_find_table(const char* signature);
-void* acpi_get_mcfg_base(void);
+// ECAM window for a PCI segment; base is where bus 0 would be
+bool acpi_get_mcfg(uint16_t segment, uint64_t* base, uint8_t* start_bus, uint8_t* end_bus);
 
 // MADT-specific functions
 struct acpi_madt* acpi_get_madt(void);
@@ -117,4 +184,12 @@ struct madt_io_apic* acpi_get_io_apic(uint8_t io_apic_id);
 void* acpi_get_local_apic_address(void);
 uint32_t acpi_get_madt_flags(void);
 
+// NUMA topology from SRAT/SLIT, with proximity domains renumbered to dense
+// node ids. Without an SRAT everything is node 0.
+uint32_t acpi_numa_node_count(void);
+uint32_t acpi_numa_range_count(void);
+bool acpi_numa_range(uint32_t index, uint64_t* base, uint64_t* length, uint32_t* node);
+uint32_t acpi_numa_node_for_apic(uint32_t apic_id);
+uint8_t acpi_numa_distance(uint32_t from, uint32_t to);
+
 #endif // ACPI_H
\ No newline at end of file
@@ -31,4 +31,10 @@ __attribute__((section(".limine_requests")))
 volatile struct limine_kernel_address_request kernel_address_request = {
     .id = LIMINE_KERNEL_ADDRESS_REQUEST,
     .revision = 0
+};
+
+__attribute__((section(".limine_requests")))
+volatile struct limine_module_request module_request = {
+    .id = LIMINE_MODULE_REQUEST,
+    .revision = 0
 };
\ No newline at end of file
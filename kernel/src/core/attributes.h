@@ -13,5 +13,6 @@ extern volatile struct limine_memmap_request memmap_request;
 extern volatile struct limine_hhdm_request hhdm_request;
 extern volatile struct limine_rsdp_request rsdp_request;
 extern volatile struct limine_kernel_address_request kernel_address_request;
+extern volatile struct limine_module_request module_request;
 
 #endif
\ No newline at end of file
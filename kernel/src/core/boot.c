@@ -0,0 +1,177 @@
+#include <core/boot.h>
+#include <core/process.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <utils/asm.h>
+#include <utils/log.h>
+#include <utils/str.h>
+
+struct boot_mark {
+    const char* message;
+    uint64_t tsc;
+};
+
+// Only kmain() marks, on the BSP
+static struct boot_mark marks[BOOT_MAX_MARKS];
+static uint32_t mark_count = 0;
+
+static struct boot_step* steps = NULL;
+static uint32_t step_count = 0;
+static spinlock_t boot_lock = SPINLOCK_INIT;
+static volatile uint32_t outstanding = 0;   // Steps boot_run() waits for
+
+void boot_mark(const char* message) {
+    uint64_t tsc = rdtsc();
+    log_string(LOG_LEVEL_INFO, message);
+    if (mark_count < BOOT_MAX_MARKS) {
+        marks[mark_count].message = message;
+        marks[mark_count].tsc = tsc;
+        mark_count++;
+    }
+}
+
+static struct boot_step* find_step(const char* name) {
+    for (uint32_t i = 0; i < step_count; i++) {
+        if (strcmp(steps[i].name, name) == 0) return &steps[i];
+    }
+    return NULL;
+}
+
+static inline bool finished(const struct boot_step* step) {
+    uint32_t state = __atomic_load_n(&step->state, __ATOMIC_ACQUIRE);
+    return state == BOOT_DONE || state == BOOT_FAILED;
+}
+
+static bool deps_finished(const struct boot_step* step) {
+    for (uint32_t i = 0; i < BOOT_MAX_DEPS && step->deps[i]; i++) {
+        struct boot_step* dep = find_step(step->deps[i]);
+        if (dep && !finished(dep)) return false;
+    }
+    return true;
+}
+
+static inline uint64_t tsc_to_us(uint64_t tsc) {
+    uint64_t hz = time_clock_params()->tsc_hz;
+    return hz ? tsc * 1000000 / hz : 0;
+}
+
+static void step_work(struct work* work);
+
+// Queue every step whose dependencies are through; boot_lock held
+static void dispatch_locked(void) {
+    for (uint32_t i = 0; i < step_count; i++) {
+        struct boot_step* step = &steps[i];
+        if (step->state != BOOT_PENDING || (step->flags & BOOT_DEFERRED) || !deps_finished(step)) continue;
+        step->state = BOOT_QUEUED;
+        work_schedule(&step->work);
+    }
+}
+
+static void run_step(struct boot_step* step) {
+    step->cpu = smp_get_current_cpu();
+    step->start_tsc = rdtsc();
+    bool ok = step->init();
+    step->end_tsc = rdtsc();
+
+    if (ok) {
+        log_info("boot: %s up in %dus on cpu %d", step->name,
+                 (int)tsc_to_us(step->end_tsc - step->start_tsc), (int)step->cpu);
+    } else {
+        log_info("boot: %s not available", step->name);
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&boot_lock);
+    __atomic_store_n(&step->state, ok ? BOOT_DONE : BOOT_FAILED, __ATOMIC_RELEASE);
+    if (!(step->flags & BOOT_DEFERRED)) outstanding--;
+    dispatch_locked();
+    spinlock_release_irqrestore(&boot_lock, flags);
+}
+
+static void step_work(struct work* work) {
+    struct boot_step* step = container_of(work, struct boot_step, work);
+    step->state = BOOT_RUNNING;
+    run_step(step);
+}
+
+void boot_run(struct boot_step* table, uint32_t count) {
+    steps = table;
+    step_count = count;
+
+    // Whatever a boot step depends on cannot wait for first use either
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t i = 0; i < count; i++) {
+            if (table[i].flags & BOOT_DEFERRED) continue;
+            for (uint32_t d = 0; d < BOOT_MAX_DEPS && table[i].deps[d]; d++) {
+                struct boot_step* dep = find_step(table[i].deps[d]);
+                if (dep && (dep->flags & BOOT_DEFERRED)) {
+                    dep->flags &= ~BOOT_DEFERRED;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&boot_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        work_init(&table[i].work, step_work);
+        table[i].state = BOOT_PENDING;
+        if (!(table[i].flags & BOOT_DEFERRED)) outstanding++;
+    }
+    dispatch_locked();
+    spinlock_release_irqrestore(&boot_lock, flags);
+
+    // This CPU's worker only runs when the idle context schedules it; no
+    // halting, as nothing would wake it when the last step finishes
+    while (__atomic_load_n(&outstanding, __ATOMIC_ACQUIRE)) {
+        schedule();
+        asm volatile("pause");
+    }
+}
+
+bool boot_require(const char* name) {
+    struct boot_step* step = find_step(name);
+    if (!step) return false;
+
+    if (!finished(step)) {
+        uint64_t flags = spinlock_acquire_irqsave(&boot_lock);
+        bool claimed = step->state == BOOT_PENDING;
+        if (claimed) step->state = BOOT_RUNNING;
+        spinlock_release_irqrestore(&boot_lock, flags);
+
+        if (claimed) {
+            for (uint32_t i = 0; i < BOOT_MAX_DEPS && step->deps[i]; i++) {
+                boot_require(step->deps[i]);
+            }
+            run_step(step);
+        } else {
+            // Queued or running elsewhere; steps are short
+            while (!finished(step)) asm volatile("pause");
+        }
+    }
+    return step->state == BOOT_DONE;
+}
+
+void boot_timeline(void) {
+    if (!mark_count) return;
+    uint64_t origin = marks[0].tsc;
+
+    uint64_t previous = origin;
+    for (uint32_t i = 0; i < mark_count; i++) {
+        log_info("boot: at %dus took %dus: %s", (int)tsc_to_us(marks[i].tsc - origin),
+                 (int)tsc_to_us(marks[i].tsc - previous), marks[i].message);
+        previous = marks[i].tsc;
+    }
+
+    for (uint32_t i = 0; i < step_count; i++) {
+        struct boot_step* step = &steps[i];
+        if (!finished(step)) {
+            log_info("boot: %s deferred", step->name);
+            continue;
+        }
+        log_info("boot: at %dus took %dus on cpu %d: %s%s", (int)tsc_to_us(step->start_tsc - origin),
+                 (int)tsc_to_us(step->end_tsc - step->start_tsc), (int)step->cpu, step->name,
+                 step->state == BOOT_FAILED ? " (not available)" : "");
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/workqueue.h>
+
+// Boot timeline and dependency-ordered init. The serial part of kmain()
+// marks each step as it completes. Steps that can wait for SMP go in a
+// table and run on the workqueue, spread over the CPUs, as soon as their
+// dependencies have finished. Deferred steps only run on first use.
+#define BOOT_MAX_DEPS    4
+#define BOOT_MAX_MARKS   64
+
+#define BOOT_DEFERRED    (1 << 0)   // Until the first boot_require()
+
+typedef enum {
+    BOOT_PENDING,
+    BOOT_QUEUED,
+    BOOT_RUNNING,
+    BOOT_DONE,
+    BOOT_FAILED
+} boot_state_t;
+
+struct boot_step {
+    const char* name;
+    bool (*init)(void);             // false if the device or feature is not there
+    uint32_t flags;
+    const char* deps[BOOT_MAX_DEPS]; // Steps that must have finished, failed or not
+
+    // Filled in as it runs
+    volatile uint32_t state;
+    uint32_t cpu;
+    uint64_t start_tsc;
+    uint64_t end_tsc;
+    struct work work;
+};
+
+// Log message and note the time; the serial step before it ends here
+void boot_mark(const char* message);
+
+// Run the table, returning once every step that is not deferred has
+// finished. The calling CPU keeps scheduling, so steps run on it too.
+void boot_run(struct boot_step* steps, uint32_t count);
+
+// Run a deferred step, after its dependencies, unless it already has;
+// false if it failed or there is no such step
+bool boot_require(const char* name);
+
+// Log marks and steps with their start and duration since the first mark
+void boot_timeline(void);
+
+#endif // BOOT_H
@@ -2,6 +2,10 @@
 section .text
 
 global context_switch
+global process_start
+extern scheduler_finish_switch
+extern sys_exit
+
 context_switch:
     ; Save old context if exists (rdi contains old_state)
     cmp rdi, 0
@@ -31,7 +35,8 @@ context_switch:
     pushfq
     pop rax
     mov [rdi + 0x88], rax
-    mov [rdi + 0x90], rsp
+    lea rax, [rsp + 8]     ; Stack pointer after returning to the caller
+    mov [rdi + 0x90], rax
     mov [rdi + 0x98], ss
 
 .load_new:
@@ -43,13 +48,12 @@ context_switch:
     mov rax, [rsi + 0x78]  ; Get new instruction pointer
     push rax               ; Push for ret
 
-    ; Restore all registers
+    ; Restore all registers, rsi last since it holds the state pointer
     mov rax, [rsi + 0x00]
     mov rbx, [rsi + 0x08]
     mov rcx, [rsi + 0x10]
     mov rdx, [rsi + 0x18]
     mov rdi, [rsi + 0x20]
-    mov rsi, [rsi + 0x28]
     mov rbp, [rsi + 0x30]
     mov r8,  [rsi + 0x38]
     mov r9,  [rsi + 0x40]
@@ -59,6 +63,17 @@ context_switch:
     mov r13, [rsi + 0x60]
     mov r14, [rsi + 0x68]
     mov r15, [rsi + 0x70]
+    mov rsi, [rsi + 0x28]
 
     ; Jump to new process
-    ret
\ No newline at end of file
+    ret
+
+; First code run by a new process: finish the switch that got us here with
+; interrupts still off, then call the process entry at rbx and exit when
+; it returns
+process_start:
+    call scheduler_finish_switch
+    sti
+    call rbx
+    xor edi, edi
+    call sys_exit
\ No newline at end of file
@@ -0,0 +1,174 @@
+#include <core/counter.h>
+#include <core/smp.h>
+#include <core/syscalls.h>
+#include <fs/vfs.h>
+#include <fs/file.h>
+#include <utils/mem.h>
+#include <utils/log.h>
+
+#define COUNTER_LINE_MAX 96
+
+// Registered counters by slot; slot 0 is the sink and stays empty
+static struct counter* counters[CPU_COUNTERS];
+static spinlock_t counter_lock = SPINLOCK_INIT;
+
+bool counter_register(struct counter* counter) {
+    uint64_t flags = spinlock_acquire_irqsave(&counter_lock);
+    uint32_t slot = 1;
+    while (slot < CPU_COUNTERS && counters[slot]) slot++;
+    if (slot < CPU_COUNTERS) {
+        // A slot given up earlier may still hold the last owner's counts
+        for (uint32_t cpu = 0; cpu < smp_get_cpu_count(); cpu++) {
+            smp_get_cpu_data(cpu)->counters[slot] = 0;
+        }
+        counters[slot] = counter;
+        __atomic_store_n(&counter->slot, slot, __ATOMIC_RELEASE);
+    }
+    spinlock_release_irqrestore(&counter_lock, flags);
+    return slot < CPU_COUNTERS;
+}
+
+void counter_unregister(struct counter* counter) {
+    uint64_t flags = spinlock_acquire_irqsave(&counter_lock);
+    if (counter->slot && counters[counter->slot] == counter) counters[counter->slot] = NULL;
+    counter->slot = 0;
+    spinlock_release_irqrestore(&counter_lock, flags);
+}
+
+static uint64_t fold(uint32_t slot) {
+    uint64_t sum = 0;
+    for (uint32_t cpu = 0; cpu < smp_get_cpu_count(); cpu++) {
+        sum += __atomic_load_n(&smp_get_cpu_data(cpu)->counters[slot], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+uint64_t counter_read(const struct counter* counter) {
+    return counter->slot ? fold(counter->slot) : 0;
+}
+
+void counter_reset(struct counter* counter) {
+    if (!counter->slot) return;
+    for (uint32_t cpu = 0; cpu < smp_get_cpu_count(); cpu++) {
+        __atomic_store_n(&smp_get_cpu_data(cpu)->counters[counter->slot], 0, __ATOMIC_RELAXED);
+    }
+}
+
+static char* append(char* p, char* end, const char* str) {
+    while (*str && p < end) *p++ = *str++;
+    return p;
+}
+
+static char* append_number(char* p, char* end, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n && p < end) *p++ = digits[--n];
+    return p;
+}
+
+// Format the counter in slot as one line, without the newline; returns its
+// length, 0 for an empty slot. Called with counter_lock held, which keeps
+// the group and name strings alive.
+static size_t format_line(uint32_t slot, char* line) {
+    const struct counter* counter = counters[slot];
+    if (!counter) return 0;
+
+    char* end = line + COUNTER_LINE_MAX - 1;
+    char* p = append(line, end, "counter ");
+    p = append(p, end, counter->group);
+    p = append(p, end, ".");
+    p = append(p, end, counter->name);
+    p = append(p, end, " ");
+    p = append_number(p, end, fold(slot));
+    *p = '\0';
+    return (size_t)(p - line);
+}
+
+void counters_dump(void) {
+    char line[COUNTER_LINE_MAX];
+    for (uint32_t slot = 1; slot < CPU_COUNTERS; slot++) {
+        uint64_t flags = spinlock_acquire_irqsave(&counter_lock);
+        size_t len = format_line(slot, line);
+        spinlock_release_irqrestore(&counter_lock, flags);
+        if (len) log_string(LOG_LEVEL_RAW, line);
+    }
+}
+
+// What a /proc/counters reader sees, formatted once at open
+struct counter_text {
+    size_t len;
+    char text[];
+};
+
+static ssize_t counters_readv(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    struct counter_text* snapshot = file->private_data;
+    if (offset >= snapshot->len) return 0;
+
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    return (ssize_t)iov_copy_to_iter(&iter, snapshot->text + offset, snapshot->len - offset);
+}
+
+static ssize_t counters_writev(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    (void)file; (void)iov; (void)iovcnt; (void)offset;
+    return -EBADF;
+}
+
+static uint64_t counters_size(struct file* file) {
+    return ((struct counter_text*)file->private_data)->len;
+}
+
+static void counters_release(struct file* file) {
+    free(file->private_data);
+}
+
+static const struct file_ops counters_file_ops = {
+    .readv = counters_readv,
+    .writev = counters_writev,
+    .size = counters_size,
+};
+
+static int counters_open(void* data, const char* path, int flags, mode_t mode, struct file* file) {
+    (void)data; (void)mode;
+    if (*path) return -ENOENT;
+    if (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)) return -EACCES;
+
+    // Sized for every slot in use; lines cut at COUNTER_LINE_MAX
+    struct counter_text* snapshot = malloc(sizeof(struct counter_text) + CPU_COUNTERS * COUNTER_LINE_MAX);
+    if (!snapshot) return -ENOMEM;
+
+    snapshot->len = 0;
+    for (uint32_t slot = 1; slot < CPU_COUNTERS; slot++) {
+        uint64_t irq = spinlock_acquire_irqsave(&counter_lock);
+        size_t len = format_line(slot, snapshot->text + snapshot->len);
+        spinlock_release_irqrestore(&counter_lock, irq);
+        if (len) {
+            snapshot->len += len;
+            snapshot->text[snapshot->len++] = '\n';
+        }
+    }
+
+    file->inode = 0;
+    file->private_data = snapshot;
+    file->ops = &counters_file_ops;
+    file->release = counters_release;
+    return 0;
+}
+
+static int counters_unlink(void* data, const char* path) {
+    (void)data; (void)path;
+    return -EACCES;
+}
+
+static const struct vfs_ops counters_vfs_ops = {
+    .open = counters_open,
+    .unlink = counters_unlink,
+};
+
+bool counters_mount(const char* path) {
+    return vfs_mount(path, &counters_vfs_ops, NULL);
+}
@@ -0,0 +1,50 @@
+#ifndef COUNTER_H
+#define COUNTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <core/smp.h>
+
+// Per-CPU statistics counters. Every CPU adds to its own copy in its
+// cpu_data with a single GS-relative add, so an update takes no lock, no
+// atomic and no shared cache line, and interrupts and migration cannot tear
+// it. Reads fold the copies of every CPU. Registered counters are listed by
+// name in counters_dump() and in /proc/counters.
+
+struct counter {
+    const char* group;      // Subsystem or device, must outlive the registration
+    const char* name;
+    uint32_t slot;          // Column in cpu_data.counters; 0 until registered
+};
+
+// Counts made before registration, or that found the table full, go to
+// slot 0 and are never listed
+#define COUNTER_INIT(group, name) { (group), (name), 0 }
+
+// Give counter a slot, starting from zero; false when all CPU_COUNTERS
+// are taken, and it then counts into nothing
+bool counter_register(struct counter* counter);
+void counter_unregister(struct counter* counter);
+
+static inline __attribute__((always_inline)) void counter_add(struct counter* counter, uint64_t n) {
+    uint64_t offset = offsetof(struct cpu_data, counters) + (uint64_t)counter->slot * sizeof(uint64_t);
+    asm volatile ("add qword ptr gs:[%0], %1" : : "r"(offset), "r"(n) : "memory", "cc");
+}
+
+static inline __attribute__((always_inline)) void counter_inc(struct counter* counter) {
+    counter_add(counter, 1);
+}
+
+// Sum over every CPU. Not a snapshot: adds on other CPUs while it runs
+// may or may not be included.
+uint64_t counter_read(const struct counter* counter);
+// Zero every CPU's copy; an add racing it on another CPU may survive
+void counter_reset(struct counter* counter);
+
+// Log every registered counter, one "counter group.name value" line each
+void counters_dump(void);
+// Serve the same lines from a read-only file at path
+bool counters_mount(const char* path);
+
+#endif // COUNTER_H
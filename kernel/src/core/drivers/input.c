@@ -0,0 +1,91 @@
+#include <core/drivers/input.h>
+#include <core/wait.h>
+#include <core/time.h>
+
+#define INPUT_RING_MASK (INPUT_RING_SIZE - 1)
+
+// A bounded MPMC queue: a cell at position pos is free while its sequence
+// is pos and full while it is pos + 1. Sequences are stored less the cell
+// index, so a zeroed ring starts out with every cell free.
+struct input_cell {
+    uint64_t sequence;
+    struct input_event event;
+};
+
+static struct input_cell cells[INPUT_RING_SIZE];
+static uint64_t enqueue_pos;
+static uint64_t dequeue_pos;
+static uint64_t dropped;
+static struct wait_queue readers = WAIT_QUEUE_INIT;
+
+static inline uint64_t cell_sequence(uint64_t pos) {
+    return __atomic_load_n(&cells[pos & INPUT_RING_MASK].sequence, __ATOMIC_ACQUIRE) + (pos & INPUT_RING_MASK);
+}
+
+static inline void cell_publish(uint64_t pos, uint64_t sequence) {
+    __atomic_store_n(&cells[pos & INPUT_RING_MASK].sequence, sequence - (pos & INPUT_RING_MASK), __ATOMIC_RELEASE);
+}
+
+bool input_report(uint16_t type, uint16_t code, int32_t value) {
+    uint64_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        int64_t diff = (int64_t)(cell_sequence(pos) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return false;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    struct input_event* event = &cells[pos & INPUT_RING_MASK].event;
+    event->timestamp_ns = ktime_get_ns();
+    event->type = type;
+    event->code = code;
+    event->value = value;
+    cell_publish(pos, pos + 1);
+
+    if (type == INPUT_EV_SYN) wait_queue_wake_all(&readers);
+    return true;
+}
+
+bool input_read(struct input_event* out) {
+    uint64_t pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        int64_t diff = (int64_t)(cell_sequence(pos) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *out = cells[pos & INPUT_RING_MASK].event;
+    cell_publish(pos, pos + INPUT_RING_SIZE);
+    return true;
+}
+
+bool input_pending(void) {
+    uint64_t pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+    return cell_sequence(pos) == pos + 1;
+}
+
+void input_read_wait(struct input_event* out) {
+    // The condition has to be free of side effects, as wait_event may
+    // evaluate it more than once
+    while (!input_read(out)) {
+        wait_event(&readers, input_pending());
+    }
+}
+
+uint64_t input_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,42 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Input events from every keyboard and pointer, in one ring that drivers
+// fill from interrupt context without locks. A report becomes a few
+// events closed by INPUT_EV_SYN, and readers are woken once per report.
+#define INPUT_RING_SIZE         256     // A power of two
+
+#define INPUT_EV_SYN            0       // End of one report
+#define INPUT_EV_KEY            1       // code: HID usage or INPUT_BTN_*; value 1 down, 0 up
+#define INPUT_EV_REL            2       // code: INPUT_REL_*; value the movement
+
+#define INPUT_REL_X             0
+#define INPUT_REL_Y             1
+#define INPUT_REL_WHEEL         2
+#define INPUT_REL_HWHEEL        3
+
+#define INPUT_BTN_LEFT          0x110
+#define INPUT_BTN_RIGHT         0x111
+#define INPUT_BTN_MIDDLE        0x112
+
+struct input_event {
+    uint64_t timestamp_ns;
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+// Any CPU, any context; false, and counted as dropped, when the ring is full
+bool input_report(uint16_t type, uint16_t code, int32_t value);
+
+// The oldest event into out; false if there is none
+bool input_read(struct input_event* out);
+// The same, sleeping until there is one
+void input_read_wait(struct input_event* out);
+bool input_pending(void);
+uint64_t input_dropped(void);
+
+#endif // INPUT_H
@@ -0,0 +1,334 @@
+#include <core/drivers/irq.h>
+#include <core/drivers/lapic.h>
+#include <core/idt.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <core/workqueue.h>
+#include <utils/asm.h>
+#include <utils/log.h>
+
+#define IRQ_COUNT (IRQ_VECTOR_LAST - IRQ_VECTOR_FIRST + 1)
+
+// Balancer: at most this many moves a pass, and only for a gap of at
+// least this many interrupts and a quarter of the busiest CPU's
+#define IRQ_BALANCE_MOVES   4
+#define IRQ_BALANCE_MIN     256
+
+#define MSI_ADDRESS(apic)   (0xFEE00000U | ((uint32_t)(apic) << 12))
+
+// Where a vector's messages come from
+enum irq_source {
+    IRQ_SOURCE_NONE,
+    IRQ_SOURCE_MSI,
+    IRQ_SOURCE_MSIX,
+};
+
+struct irq_desc {
+    irq_handler_t handler;      // NULL while free
+    void* data;
+    const char* name;
+    struct pci_device* dev;
+    volatile uint32_t* msix_slot;
+    uint8_t source;
+    uint8_t flags;
+    volatile bool masked;       // Also stops MSI without per-vector masking
+    uint32_t cpu;
+    volatile uint64_t count;    // Delivered, ever
+    uint64_t seen;              // count at the last balancer pass
+};
+
+// Delivered per CPU, each written only by its own CPU
+struct irq_cpu {
+    uint64_t count;
+} __attribute__((aligned(64)));
+
+static struct irq_desc irqs[IRQ_COUNT];
+static struct irq_cpu irq_cpus[MAX_CPUS];
+static spinlock_t irq_lock = SPINLOCK_INIT;
+
+static bool balancing = false;
+static volatile uint64_t balance_deadline = 0;
+static spinlock_t balance_lock = SPINLOCK_INIT;
+static uint64_t balance_load[MAX_CPUS];
+static uint64_t balance_delta[IRQ_COUNT];
+
+static void balance_work_func(struct work* work) {
+    (void)work;
+    irq_balance();
+}
+static struct work balance_work = WORK_INIT(balance_work_func);
+
+static bool cpu_online(uint32_t cpu) {
+    // Before smp_init() only the BSP runs
+    struct cpu_data* data = smp_get_cpu_data(cpu);
+    if (!data) return cpu == 0;
+    return (data->state & CPU_STATE_ONLINE) != 0;
+}
+
+static uint32_t cpu_apic_id(uint32_t cpu) {
+    struct cpu_data* data = smp_get_cpu_data(cpu);
+    return data ? data->apic_id : lapic_get_id();
+}
+
+static struct irq_desc* irq_desc(uint8_t vector) {
+    if (vector < IRQ_VECTOR_FIRST || vector > IRQ_VECTOR_LAST) return NULL;
+    struct irq_desc* desc = &irqs[vector - IRQ_VECTOR_FIRST];
+    return desc->handler ? desc : NULL;
+}
+
+static void irq_dispatch(struct interrupt_frame* frame) {
+    // The stub's vector number sits just below the error code slot
+    uint8_t vector = interrupt_frame_vector((struct interrupt_frame_error*)((uint64_t*)frame - 1));
+    struct irq_desc* desc = &irqs[vector - IRQ_VECTOR_FIRST];
+    irq_handler_t handler = __atomic_load_n(&desc->handler, __ATOMIC_ACQUIRE);
+
+    if (handler && !desc->masked) {
+        uint64_t count = __atomic_add_fetch(&desc->count, 1, __ATOMIC_RELAXED);
+        irq_cpus[this_cpu()->cpu_number].count++;
+        handler(desc->data);
+
+        // Busy vectors clock the balancer; quiet ones need no balancing
+        if ((count & 255) == 0 && balancing && rdtsc() >= balance_deadline) {
+            work_schedule(&balance_work);
+        }
+    }
+    lapic_eoi();
+}
+
+// MSI registers after the address: 64-bit functions have an upper address dword
+static uint8_t msi_data_reg(struct pci_device* dev) {
+    return dev->msi_cap + (dev->msi_64bit ? 0x0C : 0x08);
+}
+
+static uint8_t msi_mask_reg(struct pci_device* dev) {
+    return dev->msi_cap + (dev->msi_64bit ? 0x10 : 0x0C);
+}
+
+static void msi_set_mask(struct pci_device* dev, bool mask) {
+    if (!dev->msi_maskable) return;
+    uint32_t bits = pci_read_config(dev->bus, dev->slot, dev->func, msi_mask_reg(dev));
+    bits = mask ? bits | 1 : bits & ~1U;
+    pci_write_config(dev->bus, dev->slot, dev->func, msi_mask_reg(dev), bits);
+}
+
+// Aim the source at desc->cpu, masked meanwhile so no message goes out
+// half written; lock held
+static void irq_program(struct irq_desc* desc, uint8_t vector) {
+    uint32_t address = MSI_ADDRESS(cpu_apic_id(desc->cpu));
+    struct pci_device* dev = desc->dev;
+
+    if (desc->source == IRQ_SOURCE_MSIX) {
+        volatile uint32_t* slot = desc->msix_slot;
+        uint32_t control = slot[3];
+        slot[3] = control | 1;
+        slot[0] = address;
+        slot[1] = 0;
+        slot[2] = vector;       // Fixed delivery, edge triggered
+        slot[3] = desc->masked ? control | 1 : control & ~1U;
+    } else if (desc->source == IRQ_SOURCE_MSI) {
+        msi_set_mask(dev, true);
+        pci_write_config(dev->bus, dev->slot, dev->func, dev->msi_cap + 4, address);
+        if (dev->msi_64bit) pci_write_config(dev->bus, dev->slot, dev->func, dev->msi_cap + 8, 0);
+        pci_write_config(dev->bus, dev->slot, dev->func, msi_data_reg(dev), vector);
+        msi_set_mask(dev, desc->masked);
+    }
+}
+
+static uint8_t irq_claim(const char* name, irq_handler_t handler, void* data, uint32_t cpu,
+                         uint32_t flags, uint8_t source, struct pci_device* dev,
+                         volatile uint32_t* msix_slot) {
+    if (!handler) return 0;
+
+    // A CPU that is not up yet gets its interrupts on one that is
+    if (!cpu_online(cpu)) {
+        uint32_t cpus = smp_get_cpu_count();
+        cpu = cpus ? cpu % cpus : 0;
+        if (!cpu_online(cpu)) cpu = 0;
+    }
+
+    uint64_t irq_flags = spinlock_acquire_irqsave(&irq_lock);
+    for (uint32_t i = 0; i < IRQ_COUNT; i++) {
+        struct irq_desc* desc = &irqs[i];
+        if (desc->handler) continue;
+
+        uint8_t vector = (uint8_t)(IRQ_VECTOR_FIRST + i);
+        desc->data = data;
+        desc->name = name;
+        desc->dev = dev;
+        desc->msix_slot = msix_slot;
+        desc->source = source;
+        desc->flags = (uint8_t)flags;
+        desc->masked = (flags & IRQ_MASKED) != 0;
+        desc->cpu = cpu;
+        desc->seen = desc->count;
+        register_interrupt_handler(vector, irq_dispatch);
+        irq_program(desc, vector);
+        __atomic_store_n(&desc->handler, handler, __ATOMIC_RELEASE);
+        spinlock_release_irqrestore(&irq_lock, irq_flags);
+        return vector;
+    }
+    spinlock_release_irqrestore(&irq_lock, irq_flags);
+
+    log_error("IRQ: out of vectors for %s", name);
+    return 0;
+}
+
+uint8_t irq_alloc(const char* name, irq_handler_t handler, void* data, uint32_t cpu, uint32_t flags) {
+    return irq_claim(name, handler, data, cpu, flags, IRQ_SOURCE_NONE, NULL, NULL);
+}
+
+uint8_t irq_setup_msix(struct pci_device* dev, volatile uint32_t* table, uint32_t entry,
+                       const char* name, irq_handler_t handler, void* data, uint32_t cpu, uint32_t flags) {
+    if (!dev || !table || entry >= dev->msix_entries) return 0;
+    return irq_claim(name, handler, data, cpu, flags, IRQ_SOURCE_MSIX, dev,
+                     table + entry * PCI_MSIX_ENTRY_DWORDS);
+}
+
+uint8_t irq_setup_msi(struct pci_device* dev, const char* name, irq_handler_t handler, void* data,
+                      uint32_t cpu, uint32_t flags) {
+    if (!dev || !dev->msi_cap) return 0;
+
+    uint8_t vector = irq_claim(name, handler, data, cpu, flags, IRQ_SOURCE_MSI, dev, NULL);
+    if (!vector) return 0;
+
+    // One message: enable with Multiple Message Enable left at zero, and INTx off
+    uint32_t control = pci_read_config(dev->bus, dev->slot, dev->func, dev->msi_cap);
+    control = (control & ~(0x7U << 20)) | (1U << 16);
+    pci_write_config(dev->bus, dev->slot, dev->func, dev->msi_cap, control);
+    uint32_t cmd = pci_read_config(dev->bus, dev->slot, dev->func, PCI_COMMAND);
+    pci_write_config(dev->bus, dev->slot, dev->func, PCI_COMMAND, cmd | (1 << 10));
+    return vector;
+}
+
+// Quiesce the device first: a message already on its way still runs the handler
+void irq_free(uint8_t vector) {
+    uint64_t flags = spinlock_acquire_irqsave(&irq_lock);
+    struct irq_desc* desc = irq_desc(vector);
+    if (desc) {
+        desc->masked = true;
+        irq_program(desc, vector);
+        if (desc->source == IRQ_SOURCE_MSI) {
+            struct pci_device* dev = desc->dev;
+            uint32_t control = pci_read_config(dev->bus, dev->slot, dev->func, dev->msi_cap);
+            pci_write_config(dev->bus, dev->slot, dev->func, dev->msi_cap, control & ~(1U << 16));
+        }
+        __atomic_store_n(&desc->handler, NULL, __ATOMIC_RELEASE);
+    }
+    spinlock_release_irqrestore(&irq_lock, flags);
+}
+
+static void irq_set_masked(uint8_t vector, bool masked) {
+    uint64_t flags = spinlock_acquire_irqsave(&irq_lock);
+    struct irq_desc* desc = irq_desc(vector);
+    if (desc && desc->masked != masked) {
+        desc->masked = masked;
+        irq_program(desc, vector);
+    }
+    spinlock_release_irqrestore(&irq_lock, flags);
+}
+
+void irq_mask(uint8_t vector) {
+    irq_set_masked(vector, true);
+}
+
+void irq_unmask(uint8_t vector) {
+    irq_set_masked(vector, false);
+}
+
+bool irq_set_affinity(uint8_t vector, uint32_t cpu) {
+    if (!cpu_online(cpu)) return false;
+
+    uint64_t flags = spinlock_acquire_irqsave(&irq_lock);
+    struct irq_desc* desc = irq_desc(vector);
+    if (desc && desc->cpu != cpu) {
+        desc->cpu = cpu;
+        irq_program(desc, vector);
+    }
+    spinlock_release_irqrestore(&irq_lock, flags);
+    return desc != NULL;
+}
+
+uint32_t irq_get_affinity(uint8_t vector) {
+    struct irq_desc* desc = irq_desc(vector);
+    return desc ? desc->cpu : 0;
+}
+
+static uint64_t balance_period(void) {
+    return time_clock_params()->tsc_hz / 1000 * IRQ_BALANCE_MS;
+}
+
+void irq_balance_init(void) {
+    balance_deadline = rdtsc() + balance_period();
+    __atomic_store_n(&balancing, smp_get_cpu_count() > 1, __ATOMIC_RELEASE);
+}
+
+// Interrupts since the last pass stand for load. Each move takes the
+// busiest movable vector off the busiest CPU that still narrows the gap to
+// the least busy one, so nothing ping-pongs between two CPUs.
+void irq_balance(void) {
+    if (!spinlock_try_acquire(&balance_lock)) return;
+    balance_deadline = rdtsc() + balance_period();
+
+    uint32_t cpus = smp_get_cpu_count();
+    if (cpus > MAX_CPUS) cpus = MAX_CPUS;
+    for (uint32_t c = 0; c < cpus; c++) balance_load[c] = 0;
+
+    uint64_t flags = spinlock_acquire_irqsave(&irq_lock);
+    for (uint32_t i = 0; i < IRQ_COUNT; i++) {
+        struct irq_desc* desc = &irqs[i];
+        balance_delta[i] = 0;
+        if (!desc->handler) continue;
+        uint64_t count = desc->count;
+        balance_delta[i] = count - desc->seen;
+        desc->seen = count;
+        if (desc->cpu < cpus) balance_load[desc->cpu] += balance_delta[i];
+    }
+
+    for (uint32_t moves = 0; moves < IRQ_BALANCE_MOVES; moves++) {
+        uint32_t busiest = 0, idlest = 0;
+        bool found = false;
+        for (uint32_t c = 0; c < cpus; c++) {
+            if (!cpu_online(c)) continue;
+            if (!found || balance_load[c] > balance_load[busiest]) busiest = c;
+            if (!found || balance_load[c] < balance_load[idlest]) idlest = c;
+            found = true;
+        }
+        if (!found) break;
+
+        uint64_t gap = balance_load[busiest] - balance_load[idlest];
+        if (gap < IRQ_BALANCE_MIN || gap < balance_load[busiest] / 4) break;
+
+        int best = -1;
+        for (uint32_t i = 0; i < IRQ_COUNT; i++) {
+            struct irq_desc* desc = &irqs[i];
+            if (!desc->handler || !(desc->flags & IRQ_BALANCE) || desc->cpu != busiest) continue;
+            if (!balance_delta[i] || balance_delta[i] >= gap) continue;
+            if (best < 0 || balance_delta[i] > balance_delta[best]) best = (int)i;
+        }
+        if (best < 0) break;
+
+        struct irq_desc* desc = &irqs[best];
+        desc->cpu = idlest;
+        irq_program(desc, (uint8_t)(IRQ_VECTOR_FIRST + best));
+        balance_load[busiest] -= balance_delta[best];
+        balance_load[idlest] += balance_delta[best];
+    }
+    spinlock_release_irqrestore(&irq_lock, flags);
+    spinlock_release(&balance_lock);
+}
+
+void irq_dump(void) {
+    for (uint32_t i = 0; i < IRQ_COUNT; i++) {
+        struct irq_desc* desc = &irqs[i];
+        if (!desc->handler) continue;
+        log_info("IRQ 0x%x %s: CPU %d, %d interrupts%s",
+                   (int)(IRQ_VECTOR_FIRST + i), desc->name ? desc->name : "?", (int)desc->cpu,
+                   (int)desc->count, (desc->flags & IRQ_BALANCE) ? ", balanced" : "");
+    }
+
+    uint32_t cpus = smp_get_cpu_count();
+    if (cpus > MAX_CPUS) cpus = MAX_CPUS;
+    for (uint32_t c = 0; c < cpus; c++) {
+        log_info("IRQ CPU %d: %d interrupts", (int)c, (int)irq_cpus[c].count);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/drivers/pci.h>
+
+// Device interrupts outside the legacy PIC lines: vectors are handed out
+// from one pool, delivered through MSI or MSI-X straight to a local APIC,
+// and can be moved between CPUs while the device runs.
+
+// Allocatable vectors, between the PIC lines and the LAPIC/IPI block
+#define IRQ_VECTOR_FIRST    0x30
+#define IRQ_VECTOR_LAST     0xEF
+
+// Setup flags
+#define IRQ_BALANCE         (1 << 0)    // The CPU is a hint the balancer may change
+#define IRQ_MASKED          (1 << 1)    // Stay masked until irq_unmask()
+
+// Runs in interrupt context; the EOI is sent after it returns
+typedef void (*irq_handler_t)(void* data);
+
+// A vector for handler aimed at cpu, without a message source: the caller
+// programs the device. 0 if the pool is empty.
+uint8_t irq_alloc(const char* name, irq_handler_t handler, void* data, uint32_t cpu, uint32_t flags);
+
+// Take a vector and program MSI-X entry of the table pci_msix_enable()
+// returned, unmasking it unless IRQ_MASKED; 0 if out of vectors
+uint8_t irq_setup_msix(struct pci_device* dev, volatile uint32_t* table, uint32_t entry,
+                       const char* name, irq_handler_t handler, void* data, uint32_t cpu, uint32_t flags);
+
+// The same for a single MSI message; enables MSI and turns INTx off.
+// 0 without the capability or out of vectors.
+uint8_t irq_setup_msi(struct pci_device* dev, const char* name, irq_handler_t handler, void* data,
+                      uint32_t cpu, uint32_t flags);
+
+// Mask the source and give the vector back
+void irq_free(uint8_t vector);
+
+void irq_mask(uint8_t vector);
+void irq_unmask(uint8_t vector);
+
+// Deliver vector to another online CPU from the next message on; false if
+// the CPU is not online or the vector is not allocated
+bool irq_set_affinity(uint8_t vector, uint32_t cpu);
+uint32_t irq_get_affinity(uint8_t vector);
+
+// Let the balancer run, once SMP and the workqueues are up. Every
+// IRQ_BALANCE_MS it moves IRQ_BALANCE vectors off the CPUs taking the most
+// interrupts onto the ones taking the fewest.
+#define IRQ_BALANCE_MS      1000
+void irq_balance_init(void);
+void irq_balance(void);
+
+// Per-vector counts and targets, then per-CPU totals
+void irq_dump(void);
+
+#endif // IRQ_H
@@ -3,12 +3,16 @@
 #include <mm/vmm.h>
 #include <utils/io.h>
 #include <utils/asm.h>
+#include <core/pit.h>
 #include <limine.h>
 
 extern volatile struct limine_hhdm_request hhdm_request;
 
 static volatile uint32_t* lapic_base = NULL;
 
+// Timer counts per 10ms at divider 16, from lapic_timer_calibrate()
+static uint32_t timer_counts_10ms = 0;
+
 static inline void lapic_write(uint32_t reg, uint32_t value) {
     if (!lapic_base) return;
     lapic_base[reg / 4] = value;
@@ -123,18 +127,50 @@ void lapic_send_ipi(uint32_t cpu_id, uint32_t vector) {
         ;
 }
 
-void lapic_timer_init(uint32_t frequency) {
+void lapic_timer_init(uint8_t vector, uint32_t count) {
     // Set divider
     lapic_write(LAPIC_TDCR, 0x3);
 
     // Set periodic mode and vector
-    lapic_write(LAPIC_TIMER, LAPIC_TIMER_PERIODIC | 32);
+    lapic_write(LAPIC_TIMER, LAPIC_TIMER_PERIODIC | vector);
+
+    // Set initial count, see lapic_timer_count()
+    lapic_write(LAPIC_TICR, count);
+}
+
+// Measure the timer against the PIT. All CPUs share the bus clock, so
+// the BSP's measurement works everywhere.
+void lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_TDCR, 0x3);
+    lapic_write(LAPIC_TIMER, LAPIC_ICR_MASKED);
+    lapic_write(LAPIC_TICR, 0xFFFFFFFF);
 
-    // Set initial count (calibration would be needed for precise frequency)
-    lapic_write(LAPIC_TICR, frequency);
+    pit_wait(10);
+
+    timer_counts_10ms = 0xFFFFFFFF - lapic_read(LAPIC_TCCR);
+    lapic_write(LAPIC_TICR, 0);
+}
+
+// Initial count for an interval, needs lapic_timer_calibrate()
+uint32_t lapic_timer_count(uint64_t us) {
+    uint64_t count = (uint64_t)timer_counts_10ms * us / 10000;
+    if (count > 0xFFFFFFFF) return 0xFFFFFFFF;
+    return count ? (uint32_t)count : 1;
+}
+
+// Fire vector once on this CPU after us microseconds, replacing any
+// pending expiry
+void lapic_timer_oneshot(uint8_t vector, uint64_t us) {
+    lapic_write(LAPIC_TDCR, 0x3);
+    lapic_write(LAPIC_TIMER, LAPIC_TIMER_ONESHOT | vector);
+    lapic_write(LAPIC_TICR, lapic_timer_count(us));
 }
 
 void lapic_timer_stop(void) {
     lapic_write(LAPIC_TIMER, LAPIC_ICR_MASKED);
     lapic_write(LAPIC_TICR, 0);
+}
+
+void lapic_perf_nmi(bool enable) {
+    lapic_write(LAPIC_PERF, enable ? LAPIC_DELIVER_MODE_NMI : LAPIC_ICR_MASKED);
 }
\ No newline at end of file
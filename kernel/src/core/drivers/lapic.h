@@ -78,7 +78,14 @@ void lapic_disable(void);
 void lapic_eoi(void);
 uint32_t lapic_get_id(void);
 void lapic_send_ipi(uint32_t cpu_id, uint32_t vector);
-void lapic_timer_init(uint32_t frequency);
+void lapic_timer_init(uint8_t vector, uint32_t count);
+void lapic_timer_calibrate(void);
+uint32_t lapic_timer_count(uint64_t us);
+void lapic_timer_oneshot(uint8_t vector, uint64_t us);
 void lapic_timer_stop(void);
 
+// Deliver this CPU's performance counter overflows as NMIs, or mask them.
+// The APIC masks the entry on each delivery, so the handler unmasks it again.
+void lapic_perf_nmi(bool enable);
+
 #endif // LAPIC_H
\ No newline at end of file
@@ -6,19 +6,43 @@
 #include <utils/io.h>
 #include <utils/mem.h>
 #include <core/idt.h>
+#include <core/drivers/pic.h>
+#include <core/drivers/irq.h>
+#include <core/workqueue.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <core/wait.h>
+#include <net/net.h>
+#include <net/pkbuf.h>
+#include <net/checksum.h>
+
+// How long a full ring may hold a sender up before frames are dropped
+#define E1000_TX_TIMEOUT_NS 10000000ULL
 
 // Structure for E1000-specific data
 struct e1000_data {
     volatile uint32_t* mmio_base;
     struct e1000_rx_desc* rx_descriptors;
     struct e1000_tx_desc* tx_descriptors;
-    void* rx_buffers[E1000_NUM_RX_DESC];
+    struct pkbuf* rx_pkbufs[E1000_NUM_RX_DESC];     // The NIC DMAs into these
     void* tx_buffers[E1000_NUM_TX_DESC];
     uint16_t rx_cur;
-    uint16_t tx_cur;
+    uint16_t tx_cur;            // Next descriptor to fill
+    uint16_t tx_clean;          // Oldest descriptor the NIC may still own
+    uint16_t tx_pending;        // Queued and not yet reclaimed
+    spinlock_t tx_lock;
+    struct wait_queue tx_wait;  // Senders held up by a full ring
     struct pci_device* pci_dev;
+    uint8_t irq;                // Legacy line, when there is no MSI vector
+    uint8_t vector;             // MSI, 0 without
+    struct netdev* netdev;      // As registered, once attached
+    spinlock_t rx_lock;         // The RX ring, between the poller and receive()
+    uint64_t rx_scheduled_ns;   // When the bottom half was asked for, 0 once it ran
 };
 
+// The IRQ carries no context, so the one device is kept here
+static struct e1000_data* e1000_device = NULL;
+
 // Helper function to read from MMIO
 static inline uint32_t e1000_read_reg(struct e1000_data* data, uint32_t reg) {
     return data->mmio_base[reg / 4];
@@ -52,9 +76,9 @@ static bool init_rx_descriptors(struct e1000_data* data) {
 
     // Allocate buffers for each descriptor
     for (int i = 0; i < E1000_NUM_RX_DESC; i++) {
-        data->rx_buffers[i] = pmm_alloc_page();
-        if (!data->rx_buffers[i]) return false;
-        data->rx_descriptors[i].addr = (uint64_t)data->rx_buffers[i];
+        data->rx_pkbufs[i] = pkbuf_alloc();
+        if (!data->rx_pkbufs[i]) return false;
+        data->rx_descriptors[i].addr = pkbuf_phys(data->rx_pkbufs[i]);
         data->rx_descriptors[i].status = 0;
     }
 
@@ -93,10 +117,169 @@ static bool init_tx_descriptors(struct e1000_data* data) {
     return true;
 }
 
-// Interrupt handler
+// The frame at rx_cur, if the NIC has filled it. Lock held.
+static bool e1000_rx_peek(struct e1000_data* data, void** frame, uint16_t* length) {
+    struct e1000_rx_desc* desc = &data->rx_descriptors[data->rx_cur];
+    if (!(desc->status & 0x1)) return false;
+
+    *frame = data->rx_pkbufs[data->rx_cur]->data;
+    *length = desc->length > E1000_BUFFER_SIZE ? E1000_BUFFER_SIZE : desc->length;
+    return true;
+}
+
+// Give the descriptor at rx_cur back to the ring, without telling the NIC
+// yet; returns its index for the tail. Lock held.
+static uint16_t e1000_rx_release(struct e1000_data* data) {
+    uint16_t index = data->rx_cur;
+    data->rx_descriptors[index].status = 0;
+    data->rx_cur = (data->rx_cur + 1) % E1000_NUM_RX_DESC;
+    return index;
+}
+
+static void e1000_rx_work_func(struct work* work);
+static struct work e1000_rx_work = WORK_INIT(e1000_rx_work_func);
+
+// Swap the filled buffer at rx_cur for a fresh one and return it, NULL if
+// none could be had and the frame stays put to be dropped. Lock held.
+static struct pkbuf* e1000_rx_detach(struct e1000_data* data, uint16_t length) {
+    struct pkbuf* fresh = pkbuf_alloc();
+    if (!fresh) return NULL;
+
+    struct pkbuf* pb = data->rx_pkbufs[data->rx_cur];
+    struct e1000_rx_desc* desc = &data->rx_descriptors[data->rx_cur];
+    pb->len = length;
+
+    // Checked by the NIC, so the stack need not read the payload for it
+    uint8_t checked = E1000_RXD_STAT_IPCS | E1000_RXD_STAT_TCPCS;
+    bool verified = !(desc->status & E1000_RXD_STAT_IXSM) && (desc->status & checked) == checked &&
+                    !(desc->errors & (E1000_RXD_ERR_IPE | E1000_RXD_ERR_TCPE));
+    pb->csum = verified ? PKBUF_CSUM_VERIFIED : PKBUF_CSUM_NONE;
+    data->rx_pkbufs[data->rx_cur] = fresh;
+    data->rx_descriptors[data->rx_cur].addr = pkbuf_phys(fresh);
+    return pb;
+}
+
+// Bottom half, with RX interrupts masked: take up to a budget of frames
+// off the ring and pass their buffers up, then either go again later or,
+// once drained, unmask
+static void e1000_rx_work_func(struct work* work) {
+    (void)work;
+    struct e1000_data* data = e1000_device;
+    if (!data) return;
+
+    uint32_t done = 0;
+    bool more;
+    uint64_t flags = spinlock_acquire_irqsave(&data->rx_lock);
+    struct netdev_queue_stats* queue = data->netdev ? &data->netdev->rx_queue[0] : NULL;
+    if (queue) {
+        uint64_t scheduled = data->rx_scheduled_ns;
+        if (scheduled) netdev_queue_latency(queue, ktime_get_ns() - scheduled);
+
+        // Frames the NIC had no descriptor for, and ones it found corrupt
+        uint32_t missed = e1000_read_reg(data, E1000_MPC);
+        queue->full += missed;
+        queue->dropped += missed;
+        netdev_count(data->netdev, NETDEV_RX_DROPPED, missed);
+        netdev_count(data->netdev, NETDEV_RX_ERRORS, e1000_read_reg(data, E1000_CRCERRS));
+    }
+    data->rx_scheduled_ns = 0;
+    void* frame;
+    uint16_t length;
+    int32_t tail = -1;
+    while (done < E1000_RX_BUDGET && e1000_rx_peek(data, &frame, &length)) {
+        struct pkbuf* pb = data->netdev ? e1000_rx_detach(data, length) : NULL;
+        if (pb) {
+            netdev_count(data->netdev, NETDEV_RX_PACKETS, 1);
+            netdev_count(data->netdev, NETDEV_RX_BYTES, length);
+            queue->packets++;
+            queue->bytes += length;
+            netdev_receive_pkbuf(data->netdev, pb);
+        } else if (data->netdev) {
+            netdev_count(data->netdev, NETDEV_RX_DROPPED, 1);
+            queue->dropped++;
+        }
+        tail = e1000_rx_release(data);
+        done++;
+    }
+    // One tail write for the whole batch
+    if (tail >= 0) e1000_write_reg(data, E1000_RDT, (uint32_t)tail);
+
+    if (done == E1000_RX_BUDGET) {
+        more = true;
+    } else {
+        // A frame landing after the last peek would raise no interrupt
+        // while masked, so look once more after unmasking
+        e1000_write_reg(data, E1000_IMS, E1000_ICR_RX);
+        more = e1000_rx_peek(data, &frame, &length);
+        if (more) e1000_write_reg(data, E1000_IMC, E1000_ICR_RX);
+    }
+    spinlock_release_irqrestore(&data->rx_lock, flags);
+
+    net_process_packets();
+    if (more) {
+        data->rx_scheduled_ns = ktime_get_ns();
+        work_schedule(&e1000_rx_work);
+    }
+}
+
+// Top half: reading ICR acknowledges the interrupt. RX stays masked
+// until the poller has drained the ring; TXDW is only unmasked while a
+// sender waits for room.
+static void e1000_msi_handler(void* context) {
+    struct e1000_data* data = context;
+    uint32_t cause = e1000_read_reg(data, E1000_ICR);
+    if (cause & E1000_ICR_TXDW) {
+        e1000_write_reg(data, E1000_IMC, E1000_ICR_TXDW);
+        wait_queue_wake_all(&data->tx_wait);
+    }
+    if (cause & E1000_ICR_RX) {
+        e1000_write_reg(data, E1000_IMC, E1000_ICR_RX);
+        if (!data->rx_scheduled_ns) data->rx_scheduled_ns = ktime_get_ns();
+        work_schedule(&e1000_rx_work);
+    }
+}
+
 static void e1000_interrupt_handler(struct interrupt_frame* frame) {
-    // TODO: Get device context from somewhere
     (void)frame;
+    struct e1000_data* data = e1000_device;
+    if (!data) return;
+    e1000_msi_handler(data);
+    pic_send_eoi(data->irq);
+}
+
+void e1000_attach(struct netdev* dev) {
+    if (e1000_device && dev && dev->priv == e1000_device) e1000_device->netdev = dev;
+}
+
+// Read or write a PHY register; false if the PHY does not answer
+static bool e1000_phy_access(struct e1000_data* data, uint32_t reg, uint32_t op, uint16_t* value) {
+    uint32_t mdic = op | E1000_MDIC_PHY_ADDR | (reg << 16);
+    if (op == E1000_MDIC_OP_WRITE) mdic |= *value;
+    e1000_write_reg(data, E1000_MDIC, mdic);
+
+    for (int i = 0; i < 100000; i++) {
+        mdic = e1000_read_reg(data, E1000_MDIC);
+        if (mdic & E1000_MDIC_READY) {
+            if (mdic & E1000_MDIC_ERROR) return false;
+            *value = (uint16_t)mdic;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool e1000_set_loopback(struct netdev* dev, bool enable) {
+    struct e1000_data* data = dev ? dev->priv : NULL;
+    if (!data || data != e1000_device) return false;
+
+    uint16_t ctrl;
+    if (!e1000_phy_access(data, E1000_PHY_CTRL, E1000_MDIC_OP_READ, &ctrl)) return false;
+    if (enable) {
+        ctrl |= E1000_PHY_CTRL_LOOPBACK;
+    } else {
+        ctrl &= ~E1000_PHY_CTRL_LOOPBACK;
+    }
+    return e1000_phy_access(data, E1000_PHY_CTRL, E1000_MDIC_OP_WRITE, &ctrl);
 }
 
 // Initialize the E1000 NIC
@@ -104,10 +287,15 @@ bool e1000_init(struct netdev* dev) {
     struct e1000_data* data = (struct e1000_data*)malloc(sizeof(struct e1000_data));
     if (!data) return false;
     memset(data, 0, sizeof(struct e1000_data));
+    wait_queue_init(&data->tx_wait);
 
     // Find the E1000 PCI device
-    data->pci_dev = pci_scan_for_class(0x02, 0x00);  // Network Controller
-    if (!data->pci_dev || data->pci_dev->vendor_id != E1000_VENDOR_ID) {
+    static const struct pci_device_id e1000_ids[] = {
+        { E1000_VENDOR_ID, PCI_ANY_ID, 0x02, 0x00, PCI_ANY_ID },    // Ethernet controller
+        { 0 }
+    };
+    data->pci_dev = pci_next_match(e1000_ids, NULL);
+    if (!data->pci_dev) {
         free(data);
         return false;
     }
@@ -149,6 +337,9 @@ bool e1000_init(struct netdev* dev) {
     rctl |= E1000_RCTL_SECRC;           // Strip CRC
     e1000_write_reg(data, E1000_RCTL, rctl);
 
+    // Validate IP and TCP/UDP checksums on receive
+    e1000_write_reg(data, E1000_RXCSUM, E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL);
+
     // Setup transmit control register
     uint32_t tctl = E1000_TCTL_EN;      // Enable transmitter
     tctl |= E1000_TCTL_PSP;             // Pad short packets
@@ -159,40 +350,244 @@ bool e1000_init(struct netdev* dev) {
     // Store private data
     dev->priv = data;
 
+    // MSI where the part has it, for any CPU the balancer picks;
+    // otherwise the legacy INTx line routed through the PIC
+    e1000_device = data;
+    data->vector = irq_setup_msi(data->pci_dev, "e1000", e1000_msi_handler, data, 0, IRQ_BALANCE);
+    uint8_t line = data->pci_dev->irq_line;
+    if (data->vector || line < 16) {
+        if (!data->vector) {
+            data->irq = line;
+            register_interrupt_handler(IRQ0 + line, e1000_interrupt_handler);
+        }
+        e1000_read_reg(data, E1000_ICR);
+        e1000_write_reg(data, E1000_ITR, E1000_ITR_INTERVAL);
+        e1000_write_reg(data, E1000_IMS, E1000_ICR_RX | E1000_ICR_LSC);
+        if (!data->vector) pic_clear_mask(line);
+    }
+
     return true;
 }
 
-// Send a packet
-bool e1000_send_packet(struct netdev* dev, const void* data, uint16_t length) {
+// Take back descriptors the NIC has finished with. Lock held.
+static void e1000_tx_reclaim(struct e1000_data* priv) {
+    while (priv->tx_pending && (priv->tx_descriptors[priv->tx_clean].status & E1000_TXD_STAT_DD)) {
+        priv->tx_clean = (priv->tx_clean + 1) % E1000_NUM_TX_DESC;
+        priv->tx_pending--;
+    }
+}
+
+// Whether a waiting sender should look again: the oldest descriptor is
+// done, or another sender took some back
+static bool e1000_tx_progress(struct e1000_data* priv, uint32_t needed) {
+    uint16_t clean = __atomic_load_n(&priv->tx_clean, __ATOMIC_RELAXED);
+    return (priv->tx_descriptors[clean].status & E1000_TXD_STAT_DD) ||
+           __atomic_load_n(&priv->tx_pending, __ATOMIC_RELAXED) + needed < E1000_NUM_TX_DESC;
+}
+
+// Wait for needed free descriptors, publishing what is queued since the
+// NIC has to send it for room to appear; false once the deadline passes.
+// One descriptor stays empty, as tail == head means an idle ring. Lock
+// held, though dropped while waiting. Callers that had interrupts on
+// sleep until a write-back interrupt; the rest spin.
+static bool e1000_tx_room(struct e1000_data* priv, uint32_t needed, uint64_t* flags, uint16_t* published,
+                          uint64_t* deadline) {
+    if (needed > E1000_NUM_TX_DESC - 1) return false;
+    for (;;) {
+        e1000_tx_reclaim(priv);
+        if (priv->tx_pending + needed < E1000_NUM_TX_DESC) return true;
+
+        if (*published != priv->tx_cur) {
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            e1000_write_reg(priv, E1000_TDT, priv->tx_cur);
+            *published = priv->tx_cur;
+        }
+        uint64_t now = ktime_get_ns();
+        if (!*deadline) *deadline = now + E1000_TX_TIMEOUT_NS;
+        if (now > *deadline) return false;
+        spinlock_release_irqrestore(&priv->tx_lock, *flags);
+        if ((*flags & (1 << 9)) && (priv->vector || priv->irq)) {
+            e1000_write_reg(priv, E1000_IMS, E1000_ICR_TXDW);
+            wait_event_deadline(&priv->tx_wait, e1000_tx_progress(priv, needed), *deadline);
+        } else {
+            __asm__ volatile("pause");
+        }
+        *flags = spinlock_acquire_irqsave(&priv->tx_lock);
+    }
+}
+
+// Queue 0's share of a send; a nonzero deadline means the ring was full
+// and the sender waited from E1000_TX_TIMEOUT_NS before it. Lock held, as
+// the queue's fields are plain adds.
+static void e1000_tx_account(struct netdev* dev, uint64_t deadline, uint32_t packets, uint64_t bytes,
+                             uint32_t dropped) {
+    struct netdev_queue_stats* queue = &dev->tx_queue[0];
+    queue->packets += packets;
+    queue->bytes += bytes;
+    queue->dropped += dropped;
+    if (deadline) {
+        queue->full++;
+        netdev_queue_latency(queue, ktime_get_ns() - (deadline - E1000_TX_TIMEOUT_NS));
+    }
+}
+
+// With offload, the NIC finishes the checksum it describes. Lock held.
+static void e1000_tx_fill(struct e1000_data* priv, uint64_t addr, uint16_t length,
+                          const struct netdev_tx_offload* offload) {
+    struct e1000_tx_desc* desc = &priv->tx_descriptors[priv->tx_cur];
+    desc->addr = addr;
+    desc->length = length;
+    desc->cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS;
+    desc->css = 0;
+    desc->cso = 0;
+    if (offload && offload->csum_start) {
+        desc->cmd |= E1000_TXD_CMD_IC;
+        desc->css = (uint8_t)offload->csum_start;
+        desc->cso = (uint8_t)(offload->csum_start + offload->csum_offset);
+    }
+    desc->status = 0;
+    priv->tx_cur = (priv->tx_cur + 1) % E1000_NUM_TX_DESC;
+    priv->tx_pending++;
+}
+
+// Queue up to count frames and ring the doorbell once; the number queued.
+// A full ring is reclaimed lazily, waiting at most E1000_TX_TIMEOUT_NS.
+static uint32_t e1000_send_copies(struct netdev* dev, const void* const* frames, const uint16_t* lengths,
+                                  uint32_t count, const struct netdev_tx_offload* offload) {
     struct e1000_data* priv = (struct e1000_data*)dev->priv;
-    if (!priv || !priv->tx_descriptors || length > E1000_BUFFER_SIZE) {
-        return false;
+    if (!priv || !priv->tx_descriptors) return 0;
+
+    uint32_t queued = 0;
+    uint64_t deadline = 0;
+    uint64_t flags = spinlock_acquire_irqsave(&priv->tx_lock);
+    uint16_t published = priv->tx_cur;
+    while (queued < count) {
+        if (!frames[queued] || !lengths[queued] || lengths[queued] > E1000_BUFFER_SIZE) break;
+        if (!e1000_tx_room(priv, 1, &flags, &published, &deadline)) break;
+
+        memcpy(priv->tx_buffers[priv->tx_cur], frames[queued], lengths[queued]);
+        e1000_tx_fill(priv, (uint64_t)priv->tx_buffers[priv->tx_cur], lengths[queued], offload);
+        queued++;
     }
 
-    // Wait for a free descriptor
-    while (!(priv->tx_descriptors[priv->tx_cur].status & E1000_TXD_STAT_DD)) {
-        // Could add timeout here
+    // One tail write for the batch; descriptors are in memory before it
+    if (published != priv->tx_cur) {
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        e1000_write_reg(priv, E1000_TDT, priv->tx_cur);
     }
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < queued; i++) bytes += lengths[i];
+    e1000_tx_account(dev, deadline, queued, bytes, count - queued);
+    spinlock_release_irqrestore(&priv->tx_lock, flags);
+
+    netdev_count(dev, NETDEV_TX_BYTES, bytes);
+    netdev_count(dev, NETDEV_TX_PACKETS, queued);
+    netdev_count(dev, NETDEV_TX_DROPPED, count - queued);
+    return queued;
+}
 
-    // Copy data to buffer
-    memcpy(priv->tx_buffers[priv->tx_cur], data, length);
+uint32_t e1000_send_batch(struct netdev* dev, const void* const* frames, const uint16_t* lengths, uint32_t count) {
+    return e1000_send_copies(dev, frames, lengths, count, NULL);
+}
+
+// A context descriptor for the headers, then the frame a page per data
+// descriptor. The NIC rewrites the IP length and ID and both checksums in
+// each segment, so the copy gets a TCP checksum seeded without the length.
+static bool e1000_send_tso(struct netdev* dev, const uint8_t* frame, uint32_t length,
+                           const struct netdev_tx_offload* offload) {
+    struct e1000_data* priv = (struct e1000_data*)dev->priv;
+    uint32_t l3 = NETDEV_ETH_HLEN;
+    uint32_t l4 = offload->csum_start;
+    uint32_t hdr_len = offload->hdr_len;
+    if (!priv || !priv->tx_descriptors || offload->gso_type != NETDEV_GSO_TCPV4 || !offload->gso_size ||
+        l4 < l3 + 20 || hdr_len < l4 + 20 || hdr_len > 0xFF || hdr_len >= length) {
+        netdev_count(dev, NETDEV_TX_ERRORS, 1);
+        return false;
+    }
 
-    // Setup the descriptor
-    priv->tx_descriptors[priv->tx_cur].length = length;
-    priv->tx_descriptors[priv->tx_cur].cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS;
-    priv->tx_descriptors[priv->tx_cur].status = 0;
+    uint32_t chunks = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t deadline = 0;
+    uint64_t flags = spinlock_acquire_irqsave(&priv->tx_lock);
+    uint16_t published = priv->tx_cur;
+    if (!e1000_tx_room(priv, chunks + 1, &flags, &published, &deadline)) {
+        e1000_tx_account(dev, deadline, 0, 0, 1);
+        spinlock_release_irqrestore(&priv->tx_lock, flags);
+        netdev_count(dev, NETDEV_TX_DROPPED, 1);
+        return false;
+    }
 
-    // Update tail pointer to start transmission
-    uint16_t old_tail = priv->tx_cur;
+    struct e1000_tx_context_desc* ctx = (struct e1000_tx_context_desc*)&priv->tx_descriptors[priv->tx_cur];
+    ctx->ipcss = (uint8_t)l3;
+    ctx->ipcso = (uint8_t)(l3 + 10);
+    ctx->ipcse = (uint16_t)(l4 - 1);
+    ctx->tucss = (uint8_t)l4;
+    ctx->tucso = (uint8_t)(l4 + offload->csum_offset);
+    ctx->tucse = 0;
+    ctx->paylen = (length - hdr_len) |
+                  (uint32_t)(E1000_TXD_TUCMD_TCP | E1000_TXD_TUCMD_IP | E1000_TXD_DCMD_TSE |
+                             E1000_TXD_CMD_RS | E1000_TXD_DCMD_DEXT) << 24;
+    ctx->status = 0;
+    ctx->hdrlen = (uint8_t)hdr_len;
+    ctx->mss = offload->gso_size;
     priv->tx_cur = (priv->tx_cur + 1) % E1000_NUM_TX_DESC;
+    priv->tx_pending++;
+
+    for (uint32_t offset = 0; offset < length; offset += PAGE_SIZE) {
+        uint32_t chunk = length - offset < PAGE_SIZE ? length - offset : PAGE_SIZE;
+        uint8_t* buffer = priv->tx_buffers[priv->tx_cur];
+        memcpy(buffer, frame + offset, chunk);
+        if (!offset) {
+            // Per-segment fields are the NIC's to fill
+            uint32_t saddr, daddr;
+            memcpy(&saddr, buffer + l3 + 12, 4);
+            memcpy(&daddr, buffer + l3 + 16, 4);
+            memset(buffer + l3 + 2, 0, 2);
+            memset(buffer + l3 + 10, 0, 2);
+            uint16_t seed = (uint16_t)~csum_fold(csum_pseudo(saddr, daddr, 0, 6, 0));
+            memcpy(buffer + l4 + offload->csum_offset, &seed, 2);
+        }
+
+        struct e1000_tx_data_desc* desc = (struct e1000_tx_data_desc*)&priv->tx_descriptors[priv->tx_cur];
+        uint8_t cmd = E1000_TXD_DCMD_DEXT | E1000_TXD_DCMD_TSE | E1000_TXD_CMD_RS;
+        if (offset + chunk == length) cmd |= E1000_TXD_CMD_EOP;
+        desc->addr = (uint64_t)buffer;
+        desc->lower = chunk | E1000_TXD_DTYP_D | (uint32_t)cmd << 24;
+        desc->status = 0;
+        desc->popts = E1000_TXD_POPTS_IXSM | E1000_TXD_POPTS_TXSM;
+        desc->special = 0;
+        priv->tx_cur = (priv->tx_cur + 1) % E1000_NUM_TX_DESC;
+        priv->tx_pending++;
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
     e1000_write_reg(priv, E1000_TDT, priv->tx_cur);
+    uint32_t segments = (length - hdr_len + offload->gso_size - 1) / offload->gso_size;
+    e1000_tx_account(dev, deadline, segments, length, 0);
+    spinlock_release_irqrestore(&priv->tx_lock, flags);
+
+    netdev_count(dev, NETDEV_TX_PACKETS, segments);
+    netdev_count(dev, NETDEV_TX_BYTES, length);
+    return true;
+}
+
+bool e1000_send_offload(struct netdev* dev, const void* data, uint32_t length,
+                        const struct netdev_tx_offload* offload) {
+    if (offload && offload->gso_type != NETDEV_GSO_NONE) return e1000_send_tso(dev, data, length, offload);
 
-    // Wait for transmission to complete
-    while (!(priv->tx_descriptors[old_tail].status & E1000_TXD_STAT_DD)) {
-        // Could add timeout here
+    // css and cso are byte fields
+    if (length > E1000_BUFFER_SIZE ||
+        (offload && ((uint32_t)offload->csum_start + offload->csum_offset + 2 > length ||
+                     offload->csum_start + offload->csum_offset > 0xFF))) {
+        netdev_count(dev, NETDEV_TX_ERRORS, 1);
+        return false;
     }
+    uint16_t frame_length = (uint16_t)length;
+    return e1000_send_copies(dev, &data, &frame_length, 1, offload) == 1;
+}
 
-    return true;
+// Send a packet
+bool e1000_send_packet(struct netdev* dev, const void* data, uint16_t length) {
+    return e1000_send_batch(dev, &data, &length, 1) == 1;
 }
 
 // Receive a packet
@@ -203,28 +598,19 @@ bool e1000_receive_packet(struct netdev* dev, void* buffer, uint16_t* length) {
     }
 
     // Check if we have a packet
-    if (!(priv->rx_descriptors[priv->rx_cur].status & 0x1)) {
+    void* frame;
+    uint64_t flags = spinlock_acquire_irqsave(&priv->rx_lock);
+    if (!e1000_rx_peek(priv, &frame, length)) {
+        spinlock_release_irqrestore(&priv->rx_lock, flags);
         return false;  // No packet available
     }
-
-    // Get packet length and copy data
-    *length = priv->rx_descriptors[priv->rx_cur].length;
-    if (*length > E1000_BUFFER_SIZE) {
-        *length = E1000_BUFFER_SIZE;
-    }
-    memcpy(buffer, priv->rx_buffers[priv->rx_cur], *length);
-
-    // Reset descriptor
-    priv->rx_descriptors[priv->rx_cur].status = 0;
-
-    // Update tail pointer
-    uint16_t old_rx_cur = priv->rx_cur;
-    priv->rx_cur = (priv->rx_cur + 1) % E1000_NUM_RX_DESC;
-    e1000_write_reg(priv, E1000_RDT, old_rx_cur);
+    memcpy(buffer, frame, *length);
+    e1000_write_reg(priv, E1000_RDT, e1000_rx_release(priv));
+    spinlock_release_irqrestore(&priv->rx_lock, flags);
 
     // Update statistics
-    dev->stats.rx_packets++;
-    dev->stats.rx_bytes += *length;
+    netdev_count(dev, NETDEV_RX_PACKETS, 1);
+    netdev_count(dev, NETDEV_RX_BYTES, *length);
 
     return true;
 }
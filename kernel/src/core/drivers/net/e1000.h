@@ -15,8 +15,10 @@
 #define E1000_STATUS      0x0008  // Device Status
 #define E1000_EECD        0x0010  // EEPROM/Flash Control/Data
 #define E1000_EERD        0x0014  // EEPROM Read
+#define E1000_MDIC        0x0020  // MDI Control, for PHY registers
 #define E1000_ICR         0x00C0  // Interrupt Cause Read
 #define E1000_IMS         0x00D0  // Interrupt Mask Set
+#define E1000_ITR         0x00C4  // Interrupt Throttling
 #define E1000_IMC         0x00D8  // Interrupt Mask Clear
 #define E1000_RCTL        0x0100  // Receive Control
 #define E1000_TCTL        0x0400  // Transmit Control
@@ -30,9 +32,31 @@
 #define E1000_TDLEN       0x3808  // TX Descriptor Length
 #define E1000_TDH         0x3810  // TX Descriptor Head
 #define E1000_TDT         0x3818  // TX Descriptor Tail
+#define E1000_CRCERRS     0x4000  // CRC Error Count, clear on read
+#define E1000_MPC         0x4010  // Missed Packets Count, clear on read
+#define E1000_RXCSUM      0x5000  // Receive Checksum Control
 #define E1000_RAL         0x5400  // Receive Address Low
 #define E1000_RAH         0x5404  // Receive Address High
 
+// MDI Control bits
+#define E1000_MDIC_PHY_ADDR   (1 << 21)   // The internal PHY
+#define E1000_MDIC_OP_WRITE   (1 << 26)
+#define E1000_MDIC_OP_READ    (2 << 26)
+#define E1000_MDIC_READY      (1 << 28)
+#define E1000_MDIC_ERROR      (1 << 30)
+
+// PHY registers
+#define E1000_PHY_CTRL            0
+#define E1000_PHY_CTRL_LOOPBACK   0x4000
+
+// Interrupt Cause bits
+#define E1000_ICR_TXDW    0x00000001  // Transmit Descriptor Written Back
+#define E1000_ICR_LSC     0x00000004  // Link Status Change
+#define E1000_ICR_RXDMT0  0x00000010  // RX Descriptor Minimum Threshold
+#define E1000_ICR_RXO     0x00000040  // Receiver Overrun
+#define E1000_ICR_RXT0    0x00000080  // Receiver Timer Interrupt
+#define E1000_ICR_RX      (E1000_ICR_RXDMT0 | E1000_ICR_RXO | E1000_ICR_RXT0)
+
 // Control Register bits
 #define E1000_CTRL_FD     0x00000001  // Full Duplex
 #define E1000_CTRL_ASDE   0x00000020  // Auto-Speed Detection Enable
@@ -57,16 +81,43 @@
 #define E1000_TCTL_CT     0x00000100  // Collision Threshold
 #define E1000_TCTL_COLD   0x00040000  // Collision Distance
 
+// Receive Checksum Control bits
+#define E1000_RXCSUM_IPOFL   0x00000100  // IP checksum offload
+#define E1000_RXCSUM_TUOFL   0x00000200  // TCP/UDP checksum offload
+
+// Receive Descriptor bits
+#define E1000_RXD_STAT_DD    0x01        // Descriptor Done
+#define E1000_RXD_STAT_IXSM  0x04        // Ignore checksum indication
+#define E1000_RXD_STAT_TCPCS 0x20        // TCP/UDP checksum calculated
+#define E1000_RXD_STAT_IPCS  0x40        // IP checksum calculated
+#define E1000_RXD_ERR_TCPE   0x20        // TCP/UDP checksum error
+#define E1000_RXD_ERR_IPE    0x40        // IP checksum error
+
 // Transmit Descriptor bits
 #define E1000_TXD_STAT_DD    0x00000001  // Descriptor Done
 #define E1000_TXD_CMD_EOP    0x00000001  // End of Packet
+#define E1000_TXD_CMD_IC     0x00000004  // Insert Checksum at cso, summed from css
 #define E1000_TXD_CMD_RS     0x00000008  // Report Status
 
+// Extended descriptors, for TCP segmentation: a context descriptor
+// describes the headers, data descriptors carry the frame
+#define E1000_TXD_DTYP_D     0x00100000  // Data descriptor type, in lower
+#define E1000_TXD_DCMD_TSE   0x04        // TCP Segmentation Enable
+#define E1000_TXD_DCMD_DEXT  0x20        // Extended descriptor
+#define E1000_TXD_POPTS_IXSM 0x01        // Insert IP checksum
+#define E1000_TXD_POPTS_TXSM 0x02        // Insert TCP/UDP checksum
+#define E1000_TXD_TUCMD_TCP  0x01        // Context is TCP
+#define E1000_TXD_TUCMD_IP   0x02        // Context is IPv4
+
 // Buffer Sizes
 #define E1000_BUFFER_SIZE 2048
 #define E1000_NUM_RX_DESC 32
 #define E1000_NUM_TX_DESC 32
 
+// RX interrupt moderation and polling
+#define E1000_ITR_INTERVAL 488    // 256 ns units, about 8000 interrupts/s
+#define E1000_RX_BUDGET    16     // Packets per poll before yielding the worker
+
 // Descriptor structure for receive and transmit
 struct e1000_rx_desc {
     uint64_t addr;       // Buffer Address
@@ -87,9 +138,39 @@ struct e1000_tx_desc {
     uint16_t special;    // Special field
 } __attribute__((packed));
 
+struct e1000_tx_context_desc {
+    uint8_t ipcss;       // IP header start
+    uint8_t ipcso;       // IP checksum field
+    uint16_t ipcse;      // IP header end, inclusive
+    uint8_t tucss;       // TCP header start
+    uint8_t tucso;       // TCP checksum field
+    uint16_t tucse;      // 0: to the end of the frame
+    uint32_t paylen;     // Payload length in bits 0-19, TUCMD in 24-31
+    uint8_t status;
+    uint8_t hdrlen;      // Headers repeated in each segment
+    uint16_t mss;
+} __attribute__((packed));
+
+struct e1000_tx_data_desc {
+    uint64_t addr;
+    uint32_t lower;      // Length in bits 0-19, DTYP in 20-23, DCMD in 24-31
+    uint8_t status;
+    uint8_t popts;
+    uint16_t special;
+} __attribute__((packed));
+
 // Driver functions
 bool e1000_init(struct netdev* dev);
 bool e1000_send_packet(struct netdev* dev, const void* data, uint16_t length);
+uint32_t e1000_send_batch(struct netdev* dev, const void* const* frames, const uint16_t* lengths, uint32_t count);
+// Checksum insertion, or TCP/IPv4 segmentation of frames up to 64K
+bool e1000_send_offload(struct netdev* dev, const void* data, uint32_t length,
+                        const struct netdev_tx_offload* offload);
 bool e1000_receive_packet(struct netdev* dev, void* buffer, uint16_t* length);
+// The registered device, which interrupt-driven RX hands frames up through
+void e1000_attach(struct netdev* dev);
+// PHY loopback: frames sent come straight back in, for benchmarks. False
+// if dev is not the e1000 or its PHY does not answer.
+bool e1000_set_loopback(struct netdev* dev, bool enable);
 
 #endif // E1000_H
\ No newline at end of file
@@ -1,12 +1,25 @@
 #include <core/drivers/net/ip.h>
+#include <core/drivers/net/netdev.h>
 #include <core/drivers/pci.h>
 #include <utils/mem.h>
 #include <utils/io.h>
+#include <core/rcu.h>
+#include <core/smp.h>
+#include <core/counter.h>
+#include <mm/slab.h>
+#include <utils/asm.h>
+#include <net/checksum.h>
+#include <net/arp.h>
 
 // Configuration Constants
 #define MAX_IP_INTERFACES 8
 #define MAX_IP_ROUTES 32
-#define MAX_IP_CONNECTIONS 128
+#define IP_ROUTE_CACHE_BITS 8
+#define IP_ROUTE_NODES (2 * MAX_IP_ROUTES + 1)
+#define IP_DEFAULT_METRIC 100
+#define MAX_IP_CONNECTIONS 262144       // Tracked at once, to bound memory
+#define IP_CONN_BUCKETS_INITIAL 64
+#define IP_LISTEN_BUCKETS 64
 #define PACKET_BUFFER_SIZE 8192
 
 // IP Connection States
@@ -36,12 +49,23 @@ typedef struct {
 typedef struct {
     uint32_t network;
     uint32_t netmask;
-    uint32_t gateway;
+    uint32_t gateway;       // 0 for a directly connected network
+    uint32_t metric;        // Lowest wins among equal prefixes
     ip_interface* interface;
 } ip_route;
 
+// Path-compressed binary trie over route prefixes. Each node stands for
+// the top len bits of prefix; children branch on the bit after those, and
+// may skip any number of bits below it.
+struct route_node {
+    uint32_t prefix;
+    uint8_t len;
+    int16_t route;          // Best route for exactly this prefix, -1 if none
+    int16_t child[2];       // -1 if none
+};
+
 // IP Connection Tracking
-typedef struct {
+typedef struct ip_connection {
     uint32_t local_ip;
     uint32_t remote_ip;
     uint16_t local_port;
@@ -50,8 +74,16 @@ typedef struct {
     uint8_t protocol;
     uint32_t sequence_number;
     uint32_t acknowledgement_number;
+    struct ip_connection* hash_next;
 } ip_connection;
 
+// A local address accepting connections; local_ip 0 for any
+struct ip_listener {
+    uint32_t local_ip;
+    uint16_t local_port;
+    struct ip_listener* hash_next;
+};
+
 // ICMP Header
 struct icmp_header {
     uint8_t type;
@@ -67,20 +99,6 @@ struct icmp_header {
     uint8_t payload[];
 } __attribute__((packed));
 
-// TCP Header
-struct tcp_header {
-    uint16_t source_port;
-    uint16_t destination_port;
-    uint32_t sequence_number;
-    uint32_t acknowledgement_number;
-    uint8_t data_offset;
-    uint8_t flags;
-    uint16_t window_size;
-    uint16_t checksum;
-    uint16_t urgent_pointer;
-    uint8_t payload[];
-} __attribute__((packed));
-
 // UDP Header
 struct udp_header {
     uint16_t source_port;
@@ -91,15 +109,83 @@ struct udp_header {
 } __attribute__((packed));
 
 // Global Data Structures
-static ip_interface ip_interfaces[MAX_IP_INTERFACES];
-static ip_route ip_routing_table[MAX_IP_ROUTES];
-static ip_connection ip_connections[MAX_IP_CONNECTIONS];
+// Interfaces and routes are replaced as a whole: a new table is built,
+// published, and the old one freed after a grace period. Routes point into
+// the interfaces of the same table.
+// The trie is built along with the table. The route cache is the one part
+// written after publishing: each slot packs a destination and the route
+// it resolved to, so lookups store and load it whole without locking.
+struct ip_config {
+    ip_interface interfaces[MAX_IP_INTERFACES];
+    ip_route routes[MAX_IP_ROUTES];
+    struct route_node nodes[IP_ROUTE_NODES];
+    int16_t root;
+    uint16_t node_count;
+    uint64_t route_cache[1U << IP_ROUTE_CACHE_BITS];
+};
+static struct ip_config* ip_config = NULL;
+static spinlock_t ip_config_lock = SPINLOCK_INIT;  // Writers replacing ip_config
+
+// Connections by 4-tuple and listeners by port, under conn_lock. The
+// connection table doubles once chains average two entries; the hash is
+// seeded at boot so remote peers cannot aim flows at one chain.
+static ip_connection** conn_buckets = NULL;
+static uint32_t conn_nbuckets = 0;      // Power of two
+static uint32_t conn_count = 0;
+static struct ip_listener* listen_buckets[IP_LISTEN_BUCKETS];
+static uint64_t conn_seed = 0;
+static struct kmem_cache* conn_cache = NULL;
+static spinlock_t conn_lock = SPINLOCK_INIT;
 static uint32_t packet_sequence = 0;
 
+// Per-CPU counters behind ip_get_stats(), registered by ip_init(); both
+// structs hold nothing but counters, so they can be walked as arrays
+struct ip_protocol_counters {
+    struct counter rx_packets;
+    struct counter rx_bytes;
+    struct counter rx_errors;
+    struct counter rx_dropped;
+    struct counter tx_packets;
+    struct counter tx_bytes;
+    struct counter tx_dropped;
+};
+
+#define IP_PROTOCOL_COUNTERS_INIT(group)                                           \
+    { COUNTER_INIT(group, "rx_packets"), COUNTER_INIT(group, "rx_bytes"),          \
+      COUNTER_INIT(group, "rx_errors"), COUNTER_INIT(group, "rx_dropped"),         \
+      COUNTER_INIT(group, "tx_packets"), COUNTER_INIT(group, "tx_bytes"),          \
+      COUNTER_INIT(group, "tx_dropped") }
+
+static struct {
+    struct counter rx_header_errors;
+    struct counter rx_not_local;
+    struct counter rx_unknown_protocol;
+    struct counter tx_no_route;
+    struct ip_protocol_counters protocols[IP_STATS_PROTOCOLS];
+} ip_counters = {
+    COUNTER_INIT("ip", "rx_header_errors"),
+    COUNTER_INIT("ip", "rx_not_local"),
+    COUNTER_INIT("ip", "rx_unknown_protocol"),
+    COUNTER_INIT("ip", "tx_no_route"),
+    {
+        [IP_STATS_ICMP] = IP_PROTOCOL_COUNTERS_INIT("icmp"),
+        [IP_STATS_TCP] = IP_PROTOCOL_COUNTERS_INIT("tcp"),
+        [IP_STATS_UDP] = IP_PROTOCOL_COUNTERS_INIT("udp"),
+        [IP_STATS_OTHER] = IP_PROTOCOL_COUNTERS_INIT("ip_other"),
+    },
+};
+
+#define IP_COUNTER_COUNT (sizeof(ip_counters) / sizeof(struct counter))
+
 // Static Function Prototypes
-static ip_interface* find_interface_for_destination(uint32_t destination_ip);
-static ip_route* find_route(uint32_t destination_ip);
-static ip_connection* allocate_connection(void);
+static ip_interface* find_interface_for_destination(struct ip_config* config, uint32_t destination_ip);
+static ip_route* find_route(struct ip_config* config, uint32_t destination_ip);
+static void ip_config_publish(struct ip_config* config);
+static ip_interface* interface_for_network(struct ip_config* config, uint32_t ip);
+static ip_connection* allocate_connection(uint32_t local_ip, uint32_t remote_ip,
+                                          uint16_t local_port, uint16_t remote_port);
+static void free_connection(ip_connection* conn);
+static bool find_listener(uint32_t local_ip, uint16_t local_port);
 static ip_connection* find_connection(uint32_t local_ip, uint32_t remote_ip,
                                       uint16_t local_port, uint16_t remote_port);
 
@@ -125,39 +211,41 @@ uint32_t ip_string_to_int(const char* ip_str) {
 }
 
 // Checksum Calculation
-uint16_t ip_calculate_checksum(const void* data, uint16_t length) {
-    uint32_t sum = 0;
-    const uint16_t* words = (const uint16_t*)data;
+uint16_t ip_calculate_checksum(const void* data, size_t length) {
+    return csum_fold(csum_partial(data, length, 0));
+}
 
-    for (uint16_t i = 0; i < length / 2; i++) {
-        sum += words[i];
-    }
+// IP Initialization
+int ip_init(void) {
+    struct ip_config* config = malloc(sizeof(struct ip_config));
+    if (!config) return 0;
+    memset(config, 0, sizeof(struct ip_config));
 
-    if (length & 1) {
-        const uint8_t* last_byte = (const uint8_t*)data + length - 1;
-        sum += *last_byte << 8;
+    if (!ip_counters.rx_header_errors.slot) {
+        struct counter* all = (struct counter*)&ip_counters;
+        for (size_t i = 0; i < IP_COUNTER_COUNT; i++) counter_register(&all[i]);
     }
 
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+    // Connection tables survive a second call
+    if (!conn_buckets) {
+        conn_cache = kmem_cache_create("ip_conn", sizeof(ip_connection), 8, NULL);
+        conn_buckets = malloc(IP_CONN_BUCKETS_INITIAL * sizeof(ip_connection*));
+        if (!conn_cache || !conn_buckets) {
+            free(config);
+            return 0;
+        }
+        memset(conn_buckets, 0, IP_CONN_BUCKETS_INITIAL * sizeof(ip_connection*));
+        conn_nbuckets = IP_CONN_BUCKETS_INITIAL;
+        conn_seed = rdtsc() * 0x9E3779B97F4A7C15ULL;
     }
 
-    return ~sum;
-}
-
-// IP Initialization
-int ip_init(void) {
-    memset(ip_interfaces, 0, sizeof(ip_interfaces));
-    memset(ip_routing_table, 0, sizeof(ip_routing_table));
-    memset(ip_connections, 0, sizeof(ip_connections));
-
     // Automatically detect network devices
     struct pci_device* network_device = NULL;
     int interface_count = 0;
 
-    while ((network_device = pci_scan_for_class(PCI_CLASS_NETWORK, 0)) &&
+    while ((network_device = pci_next_for_class(PCI_CLASS_NETWORK, 0, network_device)) &&
            interface_count < MAX_IP_INTERFACES) {
-        ip_interface* interface = &ip_interfaces[interface_count];
+        ip_interface* interface = &config->interfaces[interface_count];
 
         // Default private network configuration
         interface->ip_address = ip_string_to_int("192.168.1.100") + interface_count;
@@ -166,55 +254,313 @@ int ip_init(void) {
         interface->network_device = network_device;
         interface->is_active = true;
 
-        // Create default route
-        ip_route* route = &ip_routing_table[interface_count];
+        // Route to the connected network
+        ip_route* route = &config->routes[interface_count];
         route->network = interface->ip_address & interface->subnet_mask;
         route->netmask = interface->subnet_mask;
-        route->gateway = interface->gateway;
+        route->gateway = 0;
+        route->metric = 0;
         route->interface = interface;
 
         interface_count++;
     }
 
+    // Everything else through the first interface's gateway
+    if (interface_count > 0 && interface_count < MAX_IP_ROUTES) {
+        ip_route* route = &config->routes[interface_count];
+        route->gateway = config->interfaces[0].gateway;
+        route->metric = IP_DEFAULT_METRIC;
+        route->interface = &config->interfaces[0];
+    }
+
+    spinlock_acquire(&ip_config_lock);
+    ip_config_publish(config);
+
     return interface_count;
 }
 
-// Find Interface for Destination IP
-static ip_interface* find_interface_for_destination(uint32_t destination_ip) {
-    ip_route* route = find_route(destination_ip);
+// Find Interface for Destination IP, inside an RCU read section
+static ip_interface* find_interface_for_destination(struct ip_config* config, uint32_t destination_ip) {
+    ip_route* route = find_route(config, destination_ip);
     return route ? route->interface : NULL;
 }
 
-// Find Route for IP
-static ip_route* find_route(uint32_t destination_ip) {
-    for (int i = 0; i < MAX_IP_ROUTES; i++) {
-        ip_route* route = &ip_routing_table[i];
-        if (route->interface &&
-            (destination_ip & route->netmask) == route->network) {
-            return route;
+static inline uint32_t prefix_mask(uint32_t len) {
+    return len ? 0xFFFFFFFFU << (32 - len) : 0;
+}
+
+// The bit after the top len, which picks a child
+static inline int prefix_bit(uint32_t ip, uint32_t len) {
+    return (ip >> (31 - len)) & 1;
+}
+
+static int16_t route_node_new(struct ip_config* config, uint32_t prefix, uint8_t len, int16_t route) {
+    int16_t n = (int16_t)config->node_count++;
+    config->nodes[n] = (struct route_node){ prefix, len, route, { -1, -1 } };
+    return n;
+}
+
+static void route_trie_insert(struct ip_config* config, int16_t index) {
+    const ip_route* route = &config->routes[index];
+    uint8_t len = (uint8_t)__builtin_popcount(route->netmask);
+    uint32_t prefix = route->network & prefix_mask(len);
+
+    int16_t* link = &config->root;
+    while (*link >= 0) {
+        struct route_node* node = &config->nodes[*link];
+        uint32_t limit = len < node->len ? len : node->len;
+        uint32_t differ = prefix ^ node->prefix;
+        uint32_t common = differ ? (uint32_t)__builtin_clz(differ) : 32;
+        if (common > limit) common = limit;
+
+        if (common < node->len) {
+            // Diverges inside this node's skipped bits: split above it
+            int16_t below = *link;
+            if (common == len) {
+                int16_t n = route_node_new(config, prefix, len, index);
+                config->nodes[n].child[prefix_bit(node->prefix, len)] = below;
+                *link = n;
+            } else {
+                int16_t n = route_node_new(config, prefix & prefix_mask(common), (uint8_t)common, -1);
+                config->nodes[n].child[prefix_bit(node->prefix, common)] = below;
+                config->nodes[n].child[prefix_bit(prefix, common)] = route_node_new(config, prefix, len, index);
+                *link = n;
+            }
+            return;
+        }
+        if (node->len == len) {
+            if (node->route < 0 || route->metric < config->routes[node->route].metric) node->route = index;
+            return;
         }
+        link = &node->child[prefix_bit(prefix, node->len)];
     }
-    return NULL;
+    *link = route_node_new(config, prefix, len, index);
+}
+
+// Before the table is published, after any change to its routes
+static void route_trie_build(struct ip_config* config) {
+    config->root = -1;
+    config->node_count = 0;
+    for (int16_t i = 0; i < MAX_IP_ROUTES; i++) {
+        if (config->routes[i].interface) route_trie_insert(config, i);
+    }
+    memset(config->route_cache, 0, sizeof(config->route_cache));
+}
+
+// Longest matching prefix, -1 if none
+static int16_t route_trie_lookup(const struct ip_config* config, uint32_t destination_ip) {
+    int16_t best = -1;
+    int16_t n = config->root;
+    while (n >= 0) {
+        const struct route_node* node = &config->nodes[n];
+        if ((destination_ip & prefix_mask(node->len)) != node->prefix) break;
+        if (node->route >= 0) best = node->route;
+        if (node->len == 32) break;
+        n = node->child[prefix_bit(destination_ip, node->len)];
+    }
+    return best;
+}
+
+static inline uint32_t route_cache_slot(uint32_t destination_ip) {
+    return (destination_ip * 0x9E3779B1U) >> (32 - IP_ROUTE_CACHE_BITS);
 }
 
-// Allocate Connection
-static ip_connection* allocate_connection(void) {
-    for (int i = 0; i < MAX_IP_CONNECTIONS; i++) {
-        if (ip_connections[i].state == IP_CONN_CLOSED) {
-            ip_connections[i].state = IP_CONN_LISTEN;
-            return &ip_connections[i];
+// Find Route for IP: the cached answer for this destination, or the trie's
+static ip_route* find_route(struct ip_config* config, uint32_t destination_ip) {
+    if (!config) return NULL;
+
+    // Low word: 0 for an empty slot, else the route index + 2, 1 meaning none
+    uint64_t* slot = &config->route_cache[route_cache_slot(destination_ip)];
+    uint64_t entry = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    int16_t index;
+    if ((uint32_t)entry && (uint32_t)(entry >> 32) == destination_ip) {
+        index = (int16_t)((uint32_t)entry - 2);
+    } else {
+        index = route_trie_lookup(config, destination_ip);
+        __atomic_store_n(slot, (uint64_t)destination_ip << 32 | (uint32_t)(index + 2), __ATOMIC_RELAXED);
+    }
+    return index >= 0 ? &config->routes[index] : NULL;
+}
+
+// The interface whose network holds ip, in config; NULL if none
+static ip_interface* interface_for_network(struct ip_config* config, uint32_t ip) {
+    for (int i = 0; config && i < MAX_IP_INTERFACES; i++) {
+        ip_interface* interface = &config->interfaces[i];
+        if (interface->is_active && (ip & interface->subnet_mask) == (interface->ip_address & interface->subnet_mask)) {
+            return interface;
         }
     }
     return NULL;
 }
 
-// Find Existing Connection
+// Copy of the published table to modify, routes pointing into the copy.
+// ip_config_lock held.
+static struct ip_config* ip_config_copy(void) {
+    struct ip_config* config = malloc(sizeof(struct ip_config));
+    if (!config) return NULL;
+    if (!ip_config) {
+        memset(config, 0, sizeof(struct ip_config));
+        return config;
+    }
+
+    memcpy(config, ip_config, sizeof(struct ip_config));
+    for (int i = 0; i < MAX_IP_ROUTES; i++) {
+        ip_route* route = &config->routes[i];
+        if (route->interface) route->interface = config->interfaces + (route->interface - ip_config->interfaces);
+    }
+    return config;
+}
+
+// Rebuild and publish, then drop ip_config_lock before waiting out the
+// readers of the old table and freeing it. ip_config_lock held.
+static void ip_config_publish(struct ip_config* config) {
+    route_trie_build(config);
+    struct ip_config* old = ip_config;
+    rcu_assign_pointer(ip_config, config);
+    spinlock_release(&ip_config_lock);
+
+    synchronize_rcu();
+    if (old) free(old);
+}
+
+int ip_route_add(uint32_t network, uint32_t netmask, uint32_t gateway, uint32_t metric) {
+    spinlock_acquire(&ip_config_lock);
+    struct ip_config* config = ip_config_copy();
+    if (!config) {
+        spinlock_release(&ip_config_lock);
+        return -1;
+    }
+
+    // The gateway, or a connected destination, picks the interface
+    ip_interface* interface = interface_for_network(config, gateway ? gateway : network);
+    ip_route* slot = NULL;
+    for (int i = 0; i < MAX_IP_ROUTES && !slot; i++) {
+        if (!config->routes[i].interface) slot = &config->routes[i];
+    }
+    if (!interface || !slot) {
+        spinlock_release(&ip_config_lock);
+        free(config);
+        return -1;
+    }
+
+    slot->network = network & netmask;
+    slot->netmask = netmask;
+    slot->gateway = gateway;
+    slot->metric = metric;
+    slot->interface = interface;
+    ip_config_publish(config);
+    return 0;
+}
+
+int ip_route_delete(uint32_t network, uint32_t netmask, uint32_t gateway) {
+    spinlock_acquire(&ip_config_lock);
+    struct ip_config* config = ip_config_copy();
+    if (!config) {
+        spinlock_release(&ip_config_lock);
+        return -1;
+    }
+
+    bool found = false;
+    for (int i = 0; i < MAX_IP_ROUTES; i++) {
+        ip_route* route = &config->routes[i];
+        if (route->interface && route->network == (network & netmask) &&
+            route->netmask == netmask && route->gateway == gateway) {
+            memset(route, 0, sizeof(ip_route));
+            found = true;
+        }
+    }
+    if (!found) {
+        spinlock_release(&ip_config_lock);
+        free(config);
+        return -1;
+    }
+
+    ip_config_publish(config);
+    return 0;
+}
+
+static inline uint32_t conn_hash(uint32_t local_ip, uint32_t remote_ip,
+                                 uint16_t local_port, uint16_t remote_port) {
+    uint64_t key = ((uint64_t)local_ip << 32 | remote_ip) ^ conn_seed;
+    key ^= ((uint64_t)local_port << 16 | remote_port) * 0x9E3779B97F4A7C15ULL;
+    key ^= key >> 31;
+    key *= 0xBF58476D1CE4E5B9ULL;
+    key ^= key >> 29;
+    return (uint32_t)key;
+}
+
+static inline uint32_t conn_bucket(const ip_connection* conn) {
+    return conn_hash(conn->local_ip, conn->remote_ip, conn->local_port, conn->remote_port) & (conn_nbuckets - 1);
+}
+
+static inline uint32_t listen_bucket(uint16_t local_port) {
+    return (uint32_t)(((local_port ^ conn_seed) * 0x9E3779B97F4A7C15ULL) >> 32) & (IP_LISTEN_BUCKETS - 1);
+}
+
+// Double the buckets once the chains average two entries. conn_lock held;
+// a failed allocation just leaves the chains longer.
+static void conn_hash_grow(void) {
+    uint32_t size = conn_nbuckets * 2;
+    ip_connection** buckets = malloc(size * sizeof(ip_connection*));
+    if (!buckets) return;
+    memset(buckets, 0, size * sizeof(ip_connection*));
+
+    ip_connection** old = conn_buckets;
+    uint32_t old_size = conn_nbuckets;
+    conn_buckets = buckets;
+    conn_nbuckets = size;
+    for (uint32_t i = 0; i < old_size; i++) {
+        while (old[i]) {
+            ip_connection* conn = old[i];
+            old[i] = conn->hash_next;
+            ip_connection** bucket = &buckets[conn_bucket(conn)];
+            conn->hash_next = *bucket;
+            *bucket = conn;
+        }
+    }
+    free(old);
+}
+
+// Allocate Connection, keyed and hashed, in IP_CONN_LISTEN. conn_lock held.
+static ip_connection* allocate_connection(uint32_t local_ip, uint32_t remote_ip,
+                                          uint16_t local_port, uint16_t remote_port) {
+    if (!conn_buckets || conn_count >= MAX_IP_CONNECTIONS) return NULL;
+    ip_connection* conn = kmem_cache_alloc(conn_cache);
+    if (!conn) return NULL;
+
+    memset(conn, 0, sizeof(ip_connection));
+    conn->local_ip = local_ip;
+    conn->remote_ip = remote_ip;
+    conn->local_port = local_port;
+    conn->remote_port = remote_port;
+    conn->state = IP_CONN_LISTEN;
+
+    ip_connection** bucket = &conn_buckets[conn_bucket(conn)];
+    conn->hash_next = *bucket;
+    *bucket = conn;
+    if (++conn_count > conn_nbuckets * 2) conn_hash_grow();
+    return conn;
+}
+
+// Unhash and free. conn_lock held.
+static void free_connection(ip_connection* conn) {
+    for (ip_connection** link = &conn_buckets[conn_bucket(conn)]; *link; link = &(*link)->hash_next) {
+        if (*link == conn) {
+            *link = conn->hash_next;
+            conn_count--;
+            kmem_cache_free(conn_cache, conn);
+            return;
+        }
+    }
+}
+
+// Find Existing Connection. conn_lock held.
 static ip_connection* find_connection(uint32_t local_ip, uint32_t remote_ip,
                                       uint16_t local_port, uint16_t remote_port) {
-    for (int i = 0; i < MAX_IP_CONNECTIONS; i++) {
-        ip_connection* conn = &ip_connections[i];
-        if (conn->state != IP_CONN_CLOSED &&
-            conn->local_ip == local_ip &&
+    if (!conn_buckets) return NULL;
+    uint32_t bucket = conn_hash(local_ip, remote_ip, local_port, remote_port) & (conn_nbuckets - 1);
+    for (ip_connection* conn = conn_buckets[bucket]; conn; conn = conn->hash_next) {
+        if (conn->local_ip == local_ip &&
             conn->remote_ip == remote_ip &&
             conn->local_port == local_port &&
             conn->remote_port == remote_port) {
@@ -224,15 +570,148 @@ static ip_connection* find_connection(uint32_t local_ip, uint32_t remote_ip,
     return NULL;
 }
 
+// Whether anyone accepts connections to this address. conn_lock held.
+static bool find_listener(uint32_t local_ip, uint16_t local_port) {
+    for (struct ip_listener* l = listen_buckets[listen_bucket(local_port)]; l; l = l->hash_next) {
+        if (l->local_port == local_port && (l->local_ip == 0 || l->local_ip == local_ip)) return true;
+    }
+    return false;
+}
+
+int ip_listen(uint32_t local_ip, uint16_t local_port) {
+    struct ip_listener* listener = malloc(sizeof(struct ip_listener));
+    if (!listener) return -1;
+    listener->local_ip = local_ip;
+    listener->local_port = local_port;
+
+    spinlock_acquire(&conn_lock);
+    struct ip_listener** bucket = &listen_buckets[listen_bucket(local_port)];
+    listener->hash_next = *bucket;
+    *bucket = listener;
+    spinlock_release(&conn_lock);
+    return 0;
+}
+
+void ip_unlisten(uint32_t local_ip, uint16_t local_port) {
+    struct ip_listener* found = NULL;
+    spinlock_acquire(&conn_lock);
+    for (struct ip_listener** link = &listen_buckets[listen_bucket(local_port)]; *link; link = &(*link)->hash_next) {
+        if ((*link)->local_ip == local_ip && (*link)->local_port == local_port) {
+            found = *link;
+            *link = found->hash_next;
+            break;
+        }
+    }
+    spinlock_release(&conn_lock);
+    if (found) free(found);
+}
+
+// Source address for a destination, 0 if unroutable
+uint32_t ip_source_address(uint32_t destination_ip) {
+    uint64_t flags = rcu_read_lock();
+    ip_interface* interface = find_interface_for_destination(rcu_dereference(ip_config), destination_ip);
+    uint32_t source_ip = interface ? interface->ip_address : 0;
+    rcu_read_unlock(flags);
+    return source_ip;
+}
+
+// Whether ip is one of our interface addresses
+bool ip_is_local(uint32_t ip) {
+    uint64_t flags = rcu_read_lock();
+    struct ip_config* config = rcu_dereference(ip_config);
+    bool local = false;
+    for (int i = 0; config && i < MAX_IP_INTERFACES && !local; i++) {
+        local = config->interfaces[i].is_active && config->interfaces[i].ip_address == ip;
+    }
+    rcu_read_unlock(flags);
+    return local;
+}
+
+static struct ip_protocol_counters* protocol_stats(uint8_t protocol) {
+    switch (protocol) {
+        case IP_PROTOCOL_ICMP: return &ip_counters.protocols[IP_STATS_ICMP];
+        case IP_PROTOCOL_TCP: return &ip_counters.protocols[IP_STATS_TCP];
+        case IP_PROTOCOL_UDP: return &ip_counters.protocols[IP_STATS_UDP];
+        default: return &ip_counters.protocols[IP_STATS_OTHER];
+    }
+}
+
+void ip_get_stats(struct ip_stats* stats) {
+    if (!stats) return;
+    stats->rx_header_errors = counter_read(&ip_counters.rx_header_errors);
+    stats->rx_not_local = counter_read(&ip_counters.rx_not_local);
+    stats->rx_unknown_protocol = counter_read(&ip_counters.rx_unknown_protocol);
+    stats->tx_no_route = counter_read(&ip_counters.tx_no_route);
+    for (int i = 0; i < IP_STATS_PROTOCOLS; i++) {
+        const struct ip_protocol_counters* from = &ip_counters.protocols[i];
+        struct ip_protocol_stats* to = &stats->protocols[i];
+        to->rx_packets = counter_read(&from->rx_packets);
+        to->rx_bytes = counter_read(&from->rx_bytes);
+        to->rx_errors = counter_read(&from->rx_errors);
+        to->rx_dropped = counter_read(&from->rx_dropped);
+        to->tx_packets = counter_read(&from->tx_packets);
+        to->tx_bytes = counter_read(&from->tx_bytes);
+        to->tx_dropped = counter_read(&from->tx_dropped);
+    }
+}
+
+void ip_reset_stats(void) {
+    struct counter* all = (struct counter*)&ip_counters;
+    for (size_t i = 0; i < IP_COUNTER_COUNT; i++) counter_reset(&all[i]);
+}
+
+void ip_stats_rx_error(uint8_t protocol) {
+    counter_inc(&protocol_stats(protocol)->rx_errors);
+}
+
+// Hand a finished IP packet to the link layer, which takes the buffer over.
+// frame has NETDEV_ETH_HLEN bytes of headroom before the packet; offload
+// says what the device, or netdev_transmit_offload() on its behalf, still
+// has to do. Interfaces are not bound to devices yet, so all of them go out
+// of the default one.
+static int ip_output(uint8_t* frame, uint16_t length, uint32_t next_hop, const struct netdev_tx_offload* offload) {
+    struct netdev* dev = netdev_get_default();
+    int result = arp_output(dev, next_hop, frame, NETDEV_ETH_HLEN + (uint32_t)length, offload);
+    if (dev) netdev_put(dev);
+    return result;
+}
+
 // Send IP Packet
 int ip_send_packet(uint32_t destination_ip, uint8_t protocol, const void* data, uint16_t data_length) {
-    ip_interface* source_interface = find_interface_for_destination(destination_ip);
-    if (!source_interface) return -1;
+    return ip_send_gso(destination_ip, protocol, data, data_length, 0);
+}
+
+int ip_send_gso(uint32_t destination_ip, uint8_t protocol, const void* data, uint16_t data_length,
+                uint16_t gso_size) {
+    if ((uint32_t)data_length + sizeof(struct ip_packet) > 0xFFFF) return -1;
+    if (gso_size && (protocol != IP_PROTOCOL_TCP || data_length < sizeof(struct tcp_header))) return -1;
+
+    // Only the source address and next hop are needed past the read section.
+    // Broadcasts go to ARP_BROADCAST, which needs no resolving.
+    uint64_t flags = rcu_read_lock();
+    ip_route* route = find_route(rcu_dereference(ip_config), destination_ip);
+    uint32_t source_ip = route ? route->interface->ip_address : 0;
+    uint32_t next_hop = route && route->gateway ? route->gateway : destination_ip;
+    if (destination_ip == ARP_BROADCAST ||
+        (route && !route->gateway && (destination_ip | route->interface->subnet_mask) == 0xFFFFFFFF)) {
+        next_hop = ARP_BROADCAST;
+    }
+    rcu_read_unlock(flags);
+    struct ip_protocol_counters* stats = protocol_stats(protocol);
+    if (!route) {
+        counter_inc(&ip_counters.tx_no_route);
+        counter_inc(&stats->tx_dropped);
+        return -1;
+    }
 
-    // Allocate packet buffer
+    // Allocate packet buffer, with room for the Ethernet header
     uint16_t total_length = sizeof(struct ip_packet) + data_length;
-    struct ip_packet* packet = malloc(total_length);
-    if (!packet) return -1;
+    uint8_t* frame = malloc(NETDEV_ETH_HLEN + (uint32_t)total_length);
+    if (!frame) {
+        counter_inc(&stats->tx_dropped);
+        return -1;
+    }
+    struct ip_packet* packet = (struct ip_packet*)(frame + NETDEV_ETH_HLEN);
 
     // Populate IP Header
     packet->version_ihl = 0x45;  // IPv4, 20-byte header
@@ -242,7 +721,7 @@ int ip_send_packet(uint32_t destination_ip, uint8_t protocol, const void* data,
     packet->flags_fragment = 0;
     packet->time_to_live = 64;
     packet->protocol = protocol;
-    packet->source_ip = source_interface->ip_address;
+    packet->source_ip = source_ip;
     packet->destination_ip = destination_ip;
 
     // Copy payload
@@ -252,10 +731,25 @@ int ip_send_packet(uint32_t destination_ip, uint8_t protocol, const void* data,
     packet->header_checksum = 0;
     packet->header_checksum = ip_calculate_checksum(packet, sizeof(struct ip_packet));
 
-    // Simulate packet transmission (replace with actual device transmission)
-    int result = 0;
-
-    free(packet);
+    // A super-segment leaves as gso_size pieces of its payload, each with
+    // the IP and TCP headers and its own checksums
+    struct netdev_tx_offload offload;
+    memset(&offload, 0, sizeof(offload));
+    if (gso_size) {
+        const struct tcp_header* tcp = (const struct tcp_header*)data;
+        offload.csum_start = NETDEV_ETH_HLEN + sizeof(struct ip_packet);
+        offload.csum_offset = __builtin_offsetof(struct tcp_header, checksum);
+        offload.hdr_len = offload.csum_start + (tcp->data_offset >> 4) * 4;
+        offload.gso_size = gso_size;
+        offload.gso_type = NETDEV_GSO_TCPV4;
+    }
+    int result = ip_output(frame, total_length, next_hop, gso_size ? &offload : NULL);
+    if (result < 0) {
+        counter_inc(&stats->tx_dropped);
+    } else {
+        counter_inc(&stats->tx_packets);
+        counter_add(&stats->tx_bytes, total_length);
+    }
     return result;
 }
 
@@ -266,6 +760,7 @@ int ip_receive_packet(const void* packet_data, uint16_t packet_length) {
     // Validate IP packet
     if ((packet->version_ihl & 0xF0) != 0x40 ||
         ((packet->version_ihl & 0x0F) * 4) != 20) {
+        counter_inc(&ip_counters.rx_header_errors);
         return -1;
     }
 
@@ -276,18 +771,28 @@ int ip_receive_packet(const void* packet_data, uint16_t packet_length) {
     uint16_t calculated_checksum = ip_calculate_checksum(packet, sizeof(struct ip_packet));
 
     if (original_checksum != calculated_checksum) {
+        counter_inc(&ip_counters.rx_header_errors);
         return -1;
     }
 
     // Find destination interface
-    ip_interface* dest_interface = find_interface_for_destination(packet->destination_ip);
-    if (!dest_interface) {
+    uint64_t flags = rcu_read_lock();
+    bool local = interface_for_network(rcu_dereference(ip_config), packet->destination_ip) != NULL;
+    rcu_read_unlock(flags);
+    if (!local) {
+        counter_inc(&ip_counters.rx_not_local);
         return -1;  // Packet not for this host
     }
 
     // Extract payload
     uint16_t payload_length = packet->total_length - sizeof(struct ip_packet);
     const uint8_t* payload = packet->payload;
+    struct ip_protocol_counters* stats = protocol_stats(packet->protocol);
+    if (packet->protocol == IP_PROTOCOL_ICMP || packet->protocol == IP_PROTOCOL_TCP ||
+        packet->protocol == IP_PROTOCOL_UDP) {
+        counter_inc(&stats->rx_packets);
+        counter_add(&stats->rx_bytes, packet->total_length);
+    }
 
     // Protocol-specific handling
     switch (packet->protocol) {
@@ -297,15 +802,20 @@ int ip_receive_packet(const void* packet_data, uint16_t packet_length) {
             // Echo Request handling
             if (icmp->type == 8) {  // Echo Request
                 struct icmp_header* reply = malloc(payload_length);
-                if (!reply) return -1;
+                if (!reply) {
+                    counter_inc(&stats->rx_dropped);
+                    return -1;
+                }
 
                 // Copy original payload
                 memcpy(reply, icmp, payload_length);
 
-                // Modify for echo reply
+                // Modify for echo reply; only the type word changes
+                uint16_t request_word = *(const uint16_t*)reply;
+                uint16_t checksum = reply->checksum;
                 reply->type = 0;  // Echo Reply
-                reply->checksum = 0;
-                reply->checksum = ip_calculate_checksum(reply, payload_length);
+                csum_replace2(&checksum, request_word, *(const uint16_t*)reply);
+                reply->checksum = checksum;
 
                 // Send reply
                 ip_send_packet(packet->source_ip, IP_PROTOCOL_ICMP,
@@ -318,43 +828,30 @@ int ip_receive_packet(const void* packet_data, uint16_t packet_length) {
 
         case IP_PROTOCOL_TCP: {
             struct tcp_header* tcp = (struct tcp_header*)payload;
+            uint8_t flags = tcp->flags & 0x17;  // SYN, FIN, RST, ACK flags
 
-            // Find or create connection
+            // Find the connection, or create one for a SYN someone listens for
+            spinlock_acquire(&conn_lock);
             ip_connection* conn = find_connection(
                 packet->destination_ip, packet->source_ip,
                 tcp->destination_port, tcp->source_port
             );
-
-            if (!conn) {
-                conn = allocate_connection();
-                if (!conn) return -1;
+            bool wanted = !conn && flags == 0x02 && find_listener(packet->destination_ip, tcp->destination_port);
+            if (wanted) {
+                conn = allocate_connection(packet->destination_ip, packet->source_ip,
+                                           tcp->destination_port, tcp->source_port);
+                if (!conn) {
+                    spinlock_release(&conn_lock);
+                    counter_inc(&stats->rx_dropped);
+                    return -1;
+                }
             }
 
             // Connection state management
-            switch (tcp->flags & 0x17) {  // SYN, FIN, ACK flags
-                case 0x02: {  // SYN: New connection request
-                    conn->local_ip = packet->destination_ip;
-                    conn->remote_ip = packet->source_ip;
-                    conn->local_port = tcp->destination_port;
-                    conn->remote_port = tcp->source_port;
+            switch (conn ? flags : 0) {
+                case 0x02: {  // SYN: New connection request; net/tcp.c answers it
                     conn->state = IP_CONN_SYN_RECEIVED;
                     conn->sequence_number = packet_sequence++;
-
-                    // Prepare SYN-ACK response
-                    struct tcp_header* syn_ack = malloc(sizeof(struct tcp_header));
-                    if (!syn_ack) return -1;
-
-                    syn_ack->source_port = tcp->destination_port;
-                    syn_ack->destination_port = tcp->source_port;
-                    syn_ack->sequence_number = conn->sequence_number;
-                    syn_ack->acknowledgement_number = tcp->sequence_number + 1;
-                    syn_ack->flags = 0x12;  // SYN-ACK
-                    syn_ack->window_size = 65535;
-
-                    ip_send_packet(packet->source_ip, IP_PROTOCOL_TCP,
-                                   syn_ack, sizeof(struct tcp_header));
-
-                    free(syn_ack);
                     break;
                 }
 
@@ -367,7 +864,14 @@ int ip_receive_packet(const void* packet_data, uint16_t packet_length) {
                     conn->state = IP_CONN_CLOSE_WAIT;
                     break;
                 }
+
+                case 0x04:
+                case 0x14: {  // RST: Connection gone
+                    free_connection(conn);
+                    break;
+                }
             }
+            spinlock_release(&conn_lock);
             break;
         }
 
@@ -390,6 +894,7 @@ int ip_receive_packet(const void* packet_data, uint16_t packet_length) {
         }
 
         default:
+            counter_inc(&ip_counters.rx_unknown_protocol);
             return -1;  // Unsupported protocol
     }
 
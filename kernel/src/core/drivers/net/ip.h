@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 // IP packet structure
 struct ip_packet {
@@ -19,12 +20,51 @@ struct ip_packet {
     uint8_t payload[];       // Payload data
 } __attribute__((packed));
 
+// TCP header; net/tcp.c builds and parses these
+struct tcp_header {
+    uint16_t source_port;
+    uint16_t destination_port;
+    uint32_t sequence_number;
+    uint32_t acknowledgement_number;
+    uint8_t data_offset;     // Header length in words, upper 4 bits
+    uint8_t flags;
+    uint16_t window_size;
+    uint16_t checksum;
+    uint16_t urgent_pointer;
+    uint8_t payload[];
+} __attribute__((packed));
+
 // IP protocol constants
 #define IP_PROTOCOL_ICMP 1
 #define IP_PROTOCOL_TCP  6
 #define IP_PROTOCOL_UDP  17
 #define IP_PROTOCOL_RAW  255
 
+// Per-protocol counters, indexed by IP_STATS_*
+#define IP_STATS_ICMP       0
+#define IP_STATS_TCP        1
+#define IP_STATS_UDP        2
+#define IP_STATS_OTHER      3
+#define IP_STATS_PROTOCOLS  4
+
+struct ip_protocol_stats {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_errors;         // Transport checksum
+    uint64_t rx_dropped;        // No memory or connection slot to handle it
+    uint64_t tx_packets;        // A GSO super-segment counts once
+    uint64_t tx_bytes;
+    uint64_t tx_dropped;        // No route, no memory, or refused by the link
+};
+
+struct ip_stats {
+    uint64_t rx_header_errors;  // Version, header length or checksum
+    uint64_t rx_not_local;
+    uint64_t rx_unknown_protocol;
+    uint64_t tx_no_route;
+    struct ip_protocol_stats protocols[IP_STATS_PROTOCOLS];
+};
+
 // IP address manipulation functions
 uint32_t ip_string_to_int(const char* ip_str);
 void ip_int_to_string(uint32_t ip, char* ip_str);
@@ -34,12 +74,36 @@ int ip_init(void);
 int ip_send_packet(uint32_t destination_ip, uint8_t protocol,
                    const void* data, uint16_t data_length);
 int ip_receive_packet(const void* packet, uint16_t packet_length);
+// Send a TCP segment of up to 64K as gso_size pieces, cut by the NIC where
+// it can and in software otherwise. Its checksum field holds the
+// pseudo-header sum, as for checksum offload.
+int ip_send_gso(uint32_t destination_ip, uint8_t protocol, const void* data, uint16_t data_length,
+                uint16_t gso_size);
+// The address packets to destination_ip leave from, 0 if unroutable
+uint32_t ip_source_address(uint32_t destination_ip);
+bool ip_is_local(uint32_t ip);
+
+// Routing: the longest matching prefix wins, then the lowest metric. A zero
+// gateway means the network is directly connected; 0/0 is the default route.
+int ip_route_add(uint32_t network, uint32_t netmask, uint32_t gateway, uint32_t metric);
+int ip_route_delete(uint32_t network, uint32_t netmask, uint32_t gateway);
+
+// TCP connections are only tracked for addresses someone listens on;
+// local_ip 0 for any
+int ip_listen(uint32_t local_ip, uint16_t local_port);
+void ip_unlisten(uint32_t local_ip, uint16_t local_port);
 
 // IP fragmentation and reassembly
 int ip_fragment_packet(const void* packet, uint16_t packet_length);
 int ip_reassemble_packet(const void* fragment, uint16_t fragment_length);
 
+// Statistics
+void ip_get_stats(struct ip_stats* stats);
+void ip_reset_stats(void);
+// A packet ip_receive_packet() accepted whose transport checksum was bad
+void ip_stats_rx_error(uint8_t protocol);
+
 // Checksum calculation
-uint16_t ip_calculate_checksum(const void* data, uint16_t length);
+uint16_t ip_calculate_checksum(const void* data, size_t length);
 
 #endif // IP_DRIVER_H
\ No newline at end of file
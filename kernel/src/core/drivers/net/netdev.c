@@ -1,10 +1,38 @@
 #include <core/drivers/net/netdev.h>
 #include <core/drivers/net/e1000.h>
+#include <core/drivers/net/virtio_net.h>
+#include <net/net.h>
+#include <net/pkbuf.h>
+#include <net/arp.h>
+#include <net/checksum.h>
+#include <net/capture.h>
 #include <utils/mem.h>
 #include <utils/str.h>
+#include <core/rcu.h>
+#include <core/smp.h>
 
-static struct netdev net_devices[MAX_NET_DEVICES];
-static int num_net_devices = 0;
+static const char* const netdev_counter_names[NETDEV_COUNTERS] = {
+    [NETDEV_RX_PACKETS] = "rx_packets",
+    [NETDEV_TX_PACKETS] = "tx_packets",
+    [NETDEV_RX_BYTES] = "rx_bytes",
+    [NETDEV_TX_BYTES] = "tx_bytes",
+    [NETDEV_RX_ERRORS] = "rx_errors",
+    [NETDEV_TX_ERRORS] = "tx_errors",
+    [NETDEV_RX_DROPPED] = "rx_dropped",
+    [NETDEV_TX_DROPPED] = "tx_dropped",
+    [NETDEV_RX_BACKLOG_FULL] = "rx_backlog_full",
+    [NETDEV_RX_UNKNOWN_TYPE] = "rx_unknown_type",
+};
+
+// Registered devices. Lookups read the published table without locking;
+// changes replace it under netdev_lock.
+struct netdev_table {
+    int count;
+    struct netdev* devices[MAX_NET_DEVICES];
+};
+
+static struct netdev_table* netdev_table = NULL;
+static spinlock_t netdev_lock = SPINLOCK_INIT;
 
 // E1000 device wrapper functions
 static bool e1000_init_wrap(struct netdev* dev) {
@@ -15,6 +43,16 @@ static bool e1000_transmit_wrap(struct netdev* dev, const void* data, uint16_t l
     return e1000_send_packet(dev, data, len);
 }
 
+static uint32_t e1000_transmit_batch_wrap(struct netdev* dev, const void* const* frames,
+                                          const uint16_t* lens, uint32_t count) {
+    return e1000_send_batch(dev, frames, lens, count);
+}
+
+static bool e1000_transmit_offload_wrap(struct netdev* dev, const void* data, uint32_t len,
+                                        const struct netdev_tx_offload* offload) {
+    return e1000_send_offload(dev, data, len, offload);
+}
+
 static bool e1000_receive_wrap(struct netdev* dev, void* data, uint16_t* len) {
     return e1000_receive_packet(dev, data, len);
 }
@@ -24,64 +62,311 @@ static struct netdev_ops e1000_ops = {
     .init = e1000_init_wrap,
     .transmit = e1000_transmit_wrap,
     .receive = e1000_receive_wrap,
+    .transmit_batch = e1000_transmit_batch_wrap,
+    .transmit_offload = e1000_transmit_offload_wrap,
     .start = NULL,  // Not implemented yet
     .stop = NULL,   // Not implemented yet
     .get_mac = NULL // Not implemented yet
 };
 
+// Copy of the current table for a writer holding netdev_lock
+static struct netdev_table* netdev_table_copy(void) {
+    struct netdev_table* table = malloc(sizeof(struct netdev_table));
+    if (!table) return NULL;
+
+    if (netdev_table) {
+        memcpy(table, netdev_table, sizeof(struct netdev_table));
+    } else {
+        memset(table, 0, sizeof(struct netdev_table));
+    }
+    return table;
+}
+
+// Publish a new table and free the old one once no reader can see it
+static void netdev_table_publish(struct netdev_table* table) {
+    struct netdev_table* old = netdev_table;
+    rcu_assign_pointer(netdev_table, table);
+    synchronize_rcu();
+    if (old) free(old);
+}
+
 void netdev_init(void) {
-    memset(net_devices, 0, sizeof(net_devices));
+    pkbuf_init();
 
     // Create E1000 network device
-    struct netdev *e1000_dev = &net_devices[num_net_devices];
-    memcpy(e1000_dev->name, "eth0", 5);
-    e1000_dev->ops = &e1000_ops;
-    memset(&e1000_dev->stats, 0, sizeof(struct netdev_stats));
+    struct netdev e1000_dev;
+    memset(&e1000_dev, 0, sizeof(e1000_dev));
+    memcpy(e1000_dev.name, "eth0", 5);
+    e1000_dev.ops = &e1000_ops;
+    e1000_dev.features = NETDEV_F_TX_CSUM | NETDEV_F_TSO4;
 
     // Initialize the device
-    if (e1000_dev->ops->init(e1000_dev)) {
-        e1000_dev->active = true;
-        num_net_devices++;
+    if (e1000_dev.ops->init(&e1000_dev)) {
+        e1000_dev.active = true;
+        // The driver keeps the reference
+        if (netdev_register(&e1000_dev)) e1000_attach(netdev_get_by_name(e1000_dev.name));
     }
+
+    // Named after whatever came first
+    virtio_net_init();
 }
 
 bool netdev_register(struct netdev *dev) {
-    if (num_net_devices >= MAX_NET_DEVICES) {
-        return false;
+    struct netdev* copy = malloc(sizeof(struct netdev));
+    if (!copy) return false;
+    memcpy(copy, dev, sizeof(struct netdev));
+    copy->refs = 1;
+
+    // The totals are listed under the name of the copy, which they live in
+    for (int i = 0; i < NETDEV_COUNTERS; i++) {
+        copy->counters[i] = (struct counter)COUNTER_INIT(copy->name, netdev_counter_names[i]);
+        counter_register(&copy->counters[i]);
     }
 
-    memcpy(&net_devices[num_net_devices], dev, sizeof(struct netdev));
-    num_net_devices++;
+    spinlock_acquire(&netdev_lock);
+    struct netdev_table* table = netdev_table_copy();
+    if (!table || table->count >= MAX_NET_DEVICES) {
+        spinlock_release(&netdev_lock);
+        if (table) free(table);
+        for (int i = 0; i < NETDEV_COUNTERS; i++) counter_unregister(&copy->counters[i]);
+        free(copy);
+        return false;
+    }
+    table->devices[table->count++] = copy;
+    netdev_table_publish(table);
+    spinlock_release(&netdev_lock);
     return true;
 }
 
 void netdev_unregister(struct netdev *dev) {
-    for (int i = 0; i < num_net_devices; i++) {
-        if (&net_devices[i] == dev) {
-            if (dev->priv) {
-                free(dev->priv);
-            }
+    spinlock_acquire(&netdev_lock);
+    struct netdev_table* table = netdev_table_copy();
+    if (!table) {
+        spinlock_release(&netdev_lock);
+        return;
+    }
+
+    bool found = false;
+    for (int i = 0; i < table->count; i++) {
+        if (table->devices[i] == dev) {
             // Move remaining devices down
-            memmove(&net_devices[i], &net_devices[i + 1],
-                    (num_net_devices - i - 1) * sizeof(struct netdev));
-            num_net_devices--;
+            memmove(&table->devices[i], &table->devices[i + 1],
+                    (table->count - i - 1) * sizeof(struct netdev*));
+            table->count--;
+            found = true;
             break;
         }
     }
+
+    if (!found) {
+        spinlock_release(&netdev_lock);
+        free(table);
+        return;
+    }
+
+    // Lookups are done taking references once the grace period is over
+    netdev_table_publish(table);
+    spinlock_release(&netdev_lock);
+    netdev_put(dev);
+}
+
+void netdev_get(struct netdev *dev) {
+    __atomic_add_fetch(&dev->refs, 1, __ATOMIC_RELAXED);
+}
+
+void netdev_put(struct netdev *dev) {
+    if (__atomic_sub_fetch(&dev->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    for (int i = 0; i < NETDEV_COUNTERS; i++) counter_unregister(&dev->counters[i]);
+    if (dev->priv) {
+        free(dev->priv);
+    }
+    free(dev);
 }
 
 struct netdev *netdev_get_by_name(const char *name) {
-    for (int i = 0; i < num_net_devices; i++) {
-        if (strcmp(net_devices[i].name, name) == 0) {
-            return &net_devices[i];
+    struct netdev* found = NULL;
+    uint64_t flags = rcu_read_lock();
+    struct netdev_table* table = rcu_dereference(netdev_table);
+    for (int i = 0; table && i < table->count; i++) {
+        if (strcmp(table->devices[i]->name, name) == 0) {
+            found = table->devices[i];
+            netdev_get(found);
+            break;
         }
     }
-    return NULL;
+    rcu_read_unlock(flags);
+    return found;
 }
 
 struct netdev *netdev_get_default(void) {
-    if (num_net_devices > 0) {
-        return &net_devices[0];
+    struct netdev* found = NULL;
+    uint64_t flags = rcu_read_lock();
+    struct netdev_table* table = rcu_dereference(netdev_table);
+    if (table && table->count > 0) {
+        found = table->devices[0];
+        netdev_get(found);
     }
-    return NULL;
-}
\ No newline at end of file
+    rcu_read_unlock(flags);
+    return found;
+}
+// Offsets into an Ethernet frame carrying IPv4, and into its TCP header
+#define GSO_IP_TOTAL_LENGTH 2
+#define GSO_IP_ID           4
+#define GSO_IP_CHECKSUM     10
+#define GSO_IP_SOURCE       12
+#define GSO_IP_DESTINATION  16
+#define GSO_TCP_SEQUENCE    4
+#define GSO_TCP_FLAGS       13
+#define GSO_TCP_FIN_PSH     0x09
+#define GSO_IP_PROTO_TCP    6
+
+static inline uint16_t gso_load16(const uint8_t* p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+static inline void gso_store16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+// Cut a TCP/IPv4 super-segment into frames with their checksums done, for
+// devices without TSO, and queue them with one doorbell
+static bool netdev_gso_segment(struct netdev* dev, const uint8_t* frame, uint32_t len,
+                               const struct netdev_tx_offload* offload) {
+    uint32_t l3 = NETDEV_ETH_HLEN;
+    uint32_t l4 = offload->csum_start;
+    uint32_t hdr_len = offload->hdr_len;
+    uint32_t mss = offload->gso_size;
+    uint32_t count = mss && len > hdr_len ? (len - hdr_len + mss - 1) / mss : 0;
+    if (offload->gso_type != NETDEV_GSO_TCPV4 || l4 < l3 + 20 || hdr_len < l4 + 20 || hdr_len > len ||
+        !count || count > NETDEV_GSO_MAX_SEGS || hdr_len + mss > 0xFFFF) {
+        netdev_count(dev, NETDEV_TX_ERRORS, 1);
+        return false;
+    }
+
+    uint32_t stride = hdr_len + mss;
+    uint8_t* segments = malloc(count * stride);
+    if (!segments) {
+        netdev_count(dev, NETDEV_TX_DROPPED, 1);
+        return false;
+    }
+
+    const void* frames[NETDEV_GSO_MAX_SEGS];
+    uint16_t lengths[NETDEV_GSO_MAX_SEGS];
+    uint16_t id = gso_load16(frame + l3 + GSO_IP_ID);
+    uint32_t seq = (uint32_t)gso_load16(frame + l4 + GSO_TCP_SEQUENCE) << 16 |
+                   gso_load16(frame + l4 + GSO_TCP_SEQUENCE + 2);
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t* seg = segments + i * stride;
+        uint32_t offset = i * mss;
+        uint32_t chunk = len - hdr_len - offset < mss ? len - hdr_len - offset : mss;
+        memcpy(seg, frame, hdr_len);
+        memcpy(seg + hdr_len, frame + hdr_len + offset, chunk);
+
+        uint8_t* ip = seg + l3;
+        gso_store16(ip + GSO_IP_TOTAL_LENGTH, (uint16_t)(hdr_len - l3 + chunk));
+        gso_store16(ip + GSO_IP_ID, (uint16_t)(id + i));
+        memset(ip + GSO_IP_CHECKSUM, 0, 2);
+        uint16_t ip_csum = csum_fold(csum_partial(ip, l4 - l3, 0));
+        memcpy(ip + GSO_IP_CHECKSUM, &ip_csum, 2);
+
+        uint8_t* tcp = seg + l4;
+        gso_store16(tcp + GSO_TCP_SEQUENCE, (uint16_t)((seq + offset) >> 16));
+        gso_store16(tcp + GSO_TCP_SEQUENCE + 2, (uint16_t)(seq + offset));
+        if (i + 1 < count) tcp[GSO_TCP_FLAGS] &= (uint8_t)~GSO_TCP_FIN_PSH;
+        uint32_t saddr, daddr;
+        memcpy(&saddr, ip + GSO_IP_SOURCE, 4);
+        memcpy(&daddr, ip + GSO_IP_DESTINATION, 4);
+        memset(tcp + offload->csum_offset, 0, 2);
+        uint32_t tcp_len = hdr_len - l4 + chunk;
+        uint32_t sum = csum_pseudo(saddr, daddr, (uint16_t)tcp_len, GSO_IP_PROTO_TCP, 0);
+        uint16_t tcp_csum = csum_fold(csum_partial(tcp, tcp_len, sum));
+        memcpy(tcp + offload->csum_offset, &tcp_csum, 2);
+
+        frames[i] = seg;
+        lengths[i] = (uint16_t)(hdr_len + chunk);
+    }
+
+    uint32_t sent = 0;
+    if (dev->ops->transmit_batch) {
+        sent = dev->ops->transmit_batch(dev, frames, lengths, count);
+    } else {
+        while (sent < count && dev->ops->transmit(dev, frames[sent], lengths[sent])) sent++;
+    }
+    free(segments);
+    return sent == count;
+}
+
+bool netdev_transmit_offload(struct netdev *dev, const void *frame, uint32_t len,
+                             const struct netdev_tx_offload *offload) {
+    if (!dev || !frame || !len) return false;
+    net_capture_packet(dev->name, NET_CAPTURE_TX, frame, len);
+    bool gso = offload && offload->gso_type != NETDEV_GSO_NONE;
+    uint32_t needed = 0;
+    if (gso) needed = offload->gso_type == NETDEV_GSO_TCPV6 ? NETDEV_F_TSO6 : NETDEV_F_TSO4;
+    else if (offload && offload->csum_start) needed = NETDEV_F_TX_CSUM;
+
+    if (needed && dev->ops->transmit_offload && (dev->features & needed) == needed) {
+        return dev->ops->transmit_offload(dev, frame, len, offload);
+    }
+    if (gso) return netdev_gso_segment(dev, frame, len, offload);
+    if (len > 0xFFFF) return false;
+    if (!needed) return dev->ops->transmit(dev, frame, (uint16_t)len);
+
+    // The checksum, on a copy
+    uint32_t at = (uint32_t)offload->csum_start + offload->csum_offset;
+    if (at + 2 > len) return false;
+    uint8_t* copy = malloc(len);
+    if (!copy) return false;
+    memcpy(copy, frame, len);
+    uint16_t csum = csum_fold(csum_partial(copy + offload->csum_start, len - offload->csum_start, 0));
+    memcpy(copy + at, &csum, 2);
+    bool sent = dev->ops->transmit(dev, copy, (uint16_t)len);
+    free(copy);
+    return sent;
+}
+
+void netdev_receive_pkbuf(struct netdev *dev, struct pkbuf *pb) {
+    net_capture_packet(dev->name, NET_CAPTURE_RX, pb->data, pb->len);
+    const uint8_t* eth = pb->data;
+    uint16_t type = pb->len > NETDEV_ETH_HLEN ? (uint16_t)(eth[12] << 8 | eth[13]) : 0;
+    if (type == NETDEV_ETH_P_ARP) {
+        pkbuf_pull(pb, NETDEV_ETH_HLEN);
+        arp_receive(dev, pb);
+        return;
+    }
+    if (type != NETDEV_ETH_P_IP) {
+        netdev_count(dev, NETDEV_RX_UNKNOWN_TYPE, 1);
+        pkbuf_put(pb);
+        return;
+    }
+
+    pkbuf_pull(pb, NETDEV_ETH_HLEN);
+    if (!net_ingress(pb)) {
+        netdev_count(dev, NETDEV_RX_BACKLOG_FULL, 1);
+        netdev_count(dev, NETDEV_RX_DROPPED, 1);
+    }
+}
+
+// Counters are bumped without locks, so a copy may be mid-update by a
+// packet or two; nothing needs them closer than that
+void netdev_get_stats(struct netdev *dev, struct netdev_stats *stats) {
+    if (!dev || !stats) return;
+    stats->rx_packets = counter_read(&dev->counters[NETDEV_RX_PACKETS]);
+    stats->tx_packets = counter_read(&dev->counters[NETDEV_TX_PACKETS]);
+    stats->rx_bytes = counter_read(&dev->counters[NETDEV_RX_BYTES]);
+    stats->tx_bytes = counter_read(&dev->counters[NETDEV_TX_BYTES]);
+    stats->rx_errors = counter_read(&dev->counters[NETDEV_RX_ERRORS]);
+    stats->tx_errors = counter_read(&dev->counters[NETDEV_TX_ERRORS]);
+    stats->rx_dropped = counter_read(&dev->counters[NETDEV_RX_DROPPED]);
+    stats->tx_dropped = counter_read(&dev->counters[NETDEV_TX_DROPPED]);
+    stats->rx_backlog_full = counter_read(&dev->counters[NETDEV_RX_BACKLOG_FULL]);
+    stats->rx_unknown_type = counter_read(&dev->counters[NETDEV_RX_UNKNOWN_TYPE]);
+    memcpy(stats->rx_queue, dev->rx_queue, sizeof(stats->rx_queue));
+    memcpy(stats->tx_queue, dev->tx_queue, sizeof(stats->tx_queue));
+}
+
+void netdev_reset_stats(struct netdev *dev) {
+    if (!dev) return;
+    for (int i = 0; i < NETDEV_COUNTERS; i++) counter_reset(&dev->counters[i]);
+    memset(dev->rx_queue, 0, sizeof(dev->rx_queue));
+    memset(dev->tx_queue, 0, sizeof(dev->tx_queue));
+}
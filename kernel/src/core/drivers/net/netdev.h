@@ -3,13 +3,60 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <core/counter.h>
 
 #define MAX_NET_DEVICES 4
+#define NETDEV_MAX_FRAME 2048   // Receive buffers must hold this much
+#define NETDEV_ETH_HLEN  14
+#define NETDEV_ETH_P_IP  0x0800
+#define NETDEV_ETH_P_ARP 0x0806
+
+// Offloads a device takes on through transmit_offload
+#define NETDEV_F_TX_CSUM    (1U << 0)   // Finishes a partial checksum
+#define NETDEV_F_TSO4       (1U << 1)   // Segments TCP over IPv4
+#define NETDEV_F_TSO6       (1U << 2)   // Segments TCP over IPv6
+
+#define NETDEV_GSO_NONE     0
+#define NETDEV_GSO_TCPV4    1
+#define NETDEV_GSO_TCPV6    4
+#define NETDEV_GSO_MAX_SEGS 64      // Software segmentation's limit per frame
 
 // Forward declare netdev struct
 struct netdev;
+struct pkbuf;
+
+#define NETDEV_MAX_QUEUES 4     // Drivers with one ring per direction use queue 0
 
-// Network device statistics
+// One hardware queue. Latency is what the queue added: for RX, interrupt
+// to the bottom half taking the frames; for TX, how long a sender waited
+// for ring space.
+struct netdev_queue_stats {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t dropped;
+    uint64_t full;              // Times the ring had no room
+    uint64_t latency_ns;        // Sum over latency_samples
+    uint64_t latency_samples;
+    uint64_t latency_max_ns;
+};
+
+// Per-CPU totals of a registered device, listed as "<name>.rx_packets"
+// and so on; see netdev_count()
+enum netdev_counter {
+    NETDEV_RX_PACKETS,
+    NETDEV_TX_PACKETS,
+    NETDEV_RX_BYTES,
+    NETDEV_TX_BYTES,
+    NETDEV_RX_ERRORS,
+    NETDEV_TX_ERRORS,
+    NETDEV_RX_DROPPED,
+    NETDEV_TX_DROPPED,
+    NETDEV_RX_BACKLOG_FULL,
+    NETDEV_RX_UNKNOWN_TYPE,
+    NETDEV_COUNTERS
+};
+
+// Network device statistics, as netdev_get_stats() folds them
 struct netdev_stats {
     uint64_t rx_packets;
     uint64_t tx_packets;
@@ -19,6 +66,30 @@ struct netdev_stats {
     uint64_t tx_errors;
     uint64_t rx_dropped;
     uint64_t tx_dropped;
+    uint64_t rx_backlog_full;   // Frames dropped because the stack's ingress queue was full
+    uint64_t rx_unknown_type;   // Neither IPv4 nor ARP
+    struct netdev_queue_stats rx_queue[NETDEV_MAX_QUEUES];
+    struct netdev_queue_stats tx_queue[NETDEV_MAX_QUEUES];
+};
+
+static inline void netdev_queue_latency(struct netdev_queue_stats* queue, uint64_t ns) {
+    queue->latency_ns += ns;
+    queue->latency_samples++;
+    if (ns > queue->latency_max_ns) queue->latency_max_ns = ns;
+}
+
+// Per-packet transmit offloads. With csum_start nonzero the checksum from
+// there to the end, seeded with the pseudo-header sum already in place, is
+// stored at csum_start + csum_offset. gso_size splits the payload past
+// hdr_len into segments of that many bytes, each with the headers, its own
+// lengths, IP ID, sequence number and checksums, and FIN and PSH only on
+// the last; the seed then covers the whole frame.
+struct netdev_tx_offload {
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint8_t gso_type;
 };
 
 // Network device operations
@@ -29,6 +100,12 @@ struct netdev_ops {
     bool (*transmit)(struct netdev *dev, const void *data, uint16_t len);
     bool (*receive)(struct netdev *dev, void *data, uint16_t *len);
     void (*get_mac)(struct netdev *dev, uint8_t mac[6]);
+    // Optional. Queue frames with a single doorbell; the number taken, in order
+    uint32_t (*transmit_batch)(struct netdev *dev, const void *const *frames,
+                               const uint16_t *lens, uint32_t count);
+    // Optional, for devices with features; len may exceed the MTU with TSO
+    bool (*transmit_offload)(struct netdev *dev, const void *data, uint32_t len,
+                             const struct netdev_tx_offload *offload);
 };
 
 // Network device structure
@@ -36,16 +113,40 @@ struct netdev {
     char name[16];
     uint8_t mac[6];
     bool active;
+    uint32_t features;  // NETDEV_F_*
     void *priv;  // Private driver data
     struct netdev_ops *ops;
-    struct netdev_stats stats;
+    volatile uint32_t refs;  // The device table and each lookup
+    struct counter counters[NETDEV_COUNTERS];
+    // Each written only by whoever owns the queue
+    struct netdev_queue_stats rx_queue[NETDEV_MAX_QUEUES];
+    struct netdev_queue_stats tx_queue[NETDEV_MAX_QUEUES];
 };
 
+// Add n to one of the device's totals, from any CPU without locking
+static inline void netdev_count(struct netdev *dev, enum netdev_counter counter, uint64_t n) {
+    counter_add(&dev->counters[counter], n);
+}
+
 // Function declarations
 void netdev_init(void);
 bool netdev_register(struct netdev *dev);
 void netdev_unregister(struct netdev *dev);
+// Lookups return the device with a reference taken, so it stays valid
+// outside the read section; drop it with netdev_put()
 struct netdev *netdev_get_by_name(const char *name);
 struct netdev *netdev_get_default(void);
+void netdev_get(struct netdev *dev);
+void netdev_put(struct netdev *dev);
+// Send a frame with offloads, doing in software what the device cannot:
+// segmentation without TSO, checksums without NETDEV_F_TX_CSUM
+bool netdev_transmit_offload(struct netdev *dev, const void *frame, uint32_t len,
+                             const struct netdev_tx_offload *offload);
+// Pass a received Ethernet frame up the stack, for drivers that push;
+// takes the driver's reference
+void netdev_receive_pkbuf(struct netdev *dev, struct pkbuf *pb);
+// A consistent copy of the device's counters
+void netdev_get_stats(struct netdev *dev, struct netdev_stats *stats);
+void netdev_reset_stats(struct netdev *dev);
 
 #endif // NETDEV_H
\ No newline at end of file
@@ -0,0 +1,415 @@
+#include <core/drivers/net/virtio_net.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <mm/heap.h>
+#include <mm/slab.h>
+#include <utils/mem.h>
+#include <utils/str.h>
+#include <utils/log.h>
+#include <net/checksum.h>
+#include <net/net.h>
+#include <net/pkbuf.h>
+
+// Device configuration offsets
+#define VIRTIO_NET_CFG_MAC          0
+#define VIRTIO_NET_CFG_MAX_PAIRS    8
+
+// Control queue: set the number of queue pairs in use
+#define VIRTIO_NET_CTRL_MQ             4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_OK                  0
+
+#define VIRTIO_NET_TX_TIMEOUT_NS    10000000ULL
+#define VIRTIO_NET_CTRL_TIMEOUT_NS  100000000ULL
+
+static uint32_t num_virtio_net_devices = 0;
+static struct kmem_cache* rx_buf_cache = NULL;
+
+// Ones' complement sum from start to the end, stored at start + offset;
+// the field already holds the pseudo-header sum
+static void virtio_net_finish_csum(uint8_t* frame, uint32_t len, uint16_t start, uint16_t offset) {
+    if ((uint32_t)start + offset + 2 > len) return;
+
+    uint16_t csum = csum_fold(csum_partial(frame + start, len - start, 0));
+    memcpy(frame + start + offset, &csum, sizeof(csum));
+}
+
+// Hand one RX buffer to the device; false if it could not be queued
+static bool virtio_net_post_rx(struct virtqueue* vq, void* buf) {
+    struct virtio_buf desc = { buf, VIRTIO_NET_RX_BUF_SIZE };
+    return virtqueue_add(vq, &desc, 0, 1, buf);
+}
+
+// Fill the ring; buffers come back to it as packets are consumed
+static void virtio_net_fill_rx(struct virtqueue* vq) {
+    while (vq->num_free) {
+        void* buf = kmem_cache_alloc(rx_buf_cache);
+        if (!buf) break;
+        if (!virtio_net_post_rx(vq, buf)) {
+            kmem_cache_free(rx_buf_cache, buf);
+            break;
+        }
+    }
+    virtqueue_kick(vq);
+}
+
+// Free what the device has finished sending
+static void virtio_net_reclaim_tx(struct virtqueue* vq) {
+    void* buf;
+    while ((buf = virtqueue_get(vq, NULL)) != NULL) free(buf);
+}
+
+static bool virtio_net_send(struct netdev* dev, const void* data, uint32_t len,
+                            const struct netdev_tx_offload* offload) {
+    struct virtio_net_device* vdev = dev->priv;
+    if (!vdev || !data || !len) return false;
+    uint32_t q = smp_get_current_cpu() % vdev->num_pairs;
+    struct virtqueue* vq = &vdev->tx[q];
+    struct netdev_queue_stats* queue = &dev->tx_queue[q % NETDEV_MAX_QUEUES];
+
+    struct virtio_net_hdr* hdr = malloc(sizeof(struct virtio_net_hdr) + len);
+    if (!hdr) {
+        netdev_count(dev, NETDEV_TX_DROPPED, 1);
+        queue->dropped++;
+        return false;
+    }
+    memset(hdr, 0, sizeof(*hdr));
+    uint8_t* frame = (uint8_t*)(hdr + 1);
+    memcpy(frame, data, len);
+
+    if (offload && offload->gso_type != NETDEV_GSO_NONE) {
+        uint32_t needed = offload->gso_type == NETDEV_GSO_TCPV6 ? NETDEV_F_TSO6 : NETDEV_F_TSO4;
+        if (!(dev->features & needed) || !offload->gso_size || !offload->csum_start) {
+            free(hdr);
+            netdev_count(dev, NETDEV_TX_ERRORS, 1);
+            return false;
+        }
+        hdr->gso_type = offload->gso_type;
+        hdr->gso_size = offload->gso_size;
+        hdr->hdr_len = offload->hdr_len;
+    }
+    if (offload && offload->csum_start) {
+        // Devices without checksum offload get it done here
+        if (dev->features & NETDEV_F_TX_CSUM) {
+            hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            hdr->csum_start = offload->csum_start;
+            hdr->csum_offset = offload->csum_offset;
+        } else {
+            virtio_net_finish_csum(frame, len, offload->csum_start, offload->csum_offset);
+        }
+    }
+
+    // Reclaim lazily; only a full ring makes the sender wait, and not for long
+    struct virtio_buf buf = { hdr, sizeof(struct virtio_net_hdr) + len };
+    virtio_net_reclaim_tx(vq);
+    uint64_t deadline = 0;
+    uint64_t waited_since = 0;
+    while (!virtqueue_add(vq, &buf, 1, 0, hdr)) {
+        uint64_t now = ktime_get_ns();
+        if (!deadline) {
+            deadline = now + VIRTIO_NET_TX_TIMEOUT_NS;
+            waited_since = now;
+            queue->full++;
+        }
+        if (vq->num_free == vq->size || now > deadline) {
+            free(hdr);
+            netdev_count(dev, NETDEV_TX_DROPPED, 1);
+            queue->dropped++;
+            netdev_queue_latency(queue, now - waited_since);
+            return false;
+        }
+        virtqueue_kick(vq);
+        __asm__ volatile("pause");
+        virtio_net_reclaim_tx(vq);
+    }
+    virtqueue_kick(vq);
+    if (waited_since) netdev_queue_latency(queue, ktime_get_ns() - waited_since);
+
+    netdev_count(dev, NETDEV_TX_PACKETS, 1);
+    netdev_count(dev, NETDEV_TX_BYTES, len);
+    queue->packets++;
+    queue->bytes += len;
+    return true;
+}
+
+static bool virtio_net_transmit(struct netdev* dev, const void* data, uint16_t len) {
+    return virtio_net_send(dev, data, len, NULL);
+}
+
+static bool virtio_net_transmit_offload(struct netdev* dev, const void* data, uint32_t len,
+                                        const struct netdev_tx_offload* offload) {
+    return virtio_net_send(dev, data, len, offload);
+}
+
+// Take one packet off vq into data, putting its buffers straight back on
+// the ring. 0 if there is none, -1 if one was dropped.
+static int virtio_net_receive_one(struct netdev* dev, struct virtqueue* vq, struct netdev_queue_stats* queue,
+                                  uint8_t* data, uint16_t* len) {
+    uint32_t used;
+    uint8_t* buf = virtqueue_get(vq, &used);
+    if (!buf) return 0;
+
+    struct virtio_net_hdr hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    uint16_t buffers = virtio_has_feature(vq->dev, VIRTIO_NET_F_MRG_RXBUF) ? hdr.num_buffers : 1;
+    uint32_t total = 0;
+    bool dropped = used < sizeof(hdr) || !buffers;
+    uint32_t offset = sizeof(hdr);
+
+    // With mergeable buffers the rest of the packet follows in the next ones
+    for (uint16_t i = 0; buf; i++) {
+        if (!dropped && used > offset) {
+            uint32_t chunk = used - offset;
+            if (total + chunk > NETDEV_MAX_FRAME) dropped = true;
+            else memcpy(data + total, buf + offset, chunk);
+            total += chunk;
+        }
+        if (!virtio_net_post_rx(vq, buf)) kmem_cache_free(rx_buf_cache, buf);
+
+        buf = NULL;
+        offset = 0;
+        if (i + 1 < buffers) {
+            buf = virtqueue_get(vq, &used);
+            if (!buf) dropped = true;
+        }
+    }
+    virtqueue_kick(vq);
+
+    if (dropped || !total) {
+        netdev_count(dev, NETDEV_RX_DROPPED, 1);
+        queue->dropped++;
+        return -1;
+    }
+    if (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        virtio_net_finish_csum(data, total, hdr.csum_start, hdr.csum_offset);
+    }
+    *len = (uint16_t)total;
+    netdev_count(dev, NETDEV_RX_PACKETS, 1);
+    netdev_count(dev, NETDEV_RX_BYTES, total);
+    queue->packets++;
+    queue->bytes += total;
+    return 1;
+}
+
+// Polls every RX queue, starting after the one served last
+static bool virtio_net_receive(struct netdev* dev, void* data, uint16_t* len) {
+    struct virtio_net_device* vdev = dev->priv;
+    if (!vdev || !data || !len) return false;
+
+    bool found = false;
+    uint64_t flags = spinlock_acquire_irqsave(&vdev->rx_lock);
+    for (uint32_t n = 0; n < vdev->num_pairs && !found; n++) {
+        uint32_t q = (vdev->rx_next + n) % vdev->num_pairs;
+        int result;
+        struct netdev_queue_stats* queue = &dev->rx_queue[q % NETDEV_MAX_QUEUES];
+        while ((result = virtio_net_receive_one(dev, &vdev->rx[q], queue, data, len)) < 0) {}
+        if (result) {
+            vdev->rx_next = q + 1;
+            found = true;
+        }
+    }
+    spinlock_release_irqrestore(&vdev->rx_lock, flags);
+    return found;
+}
+
+// Bottom half: pass up to a budget of packets to the stack, then either go
+// again or turn the interrupts back on, polling once more if that finds
+// packets already in
+static void virtio_net_rx_work(struct work* work) {
+    struct virtio_net_device* vdev = container_of(work, struct virtio_net_device, rx_work);
+    struct netdev* dev = vdev->netdev;
+    if (!dev) return;
+
+    uint32_t done = 0;
+    while (done < VIRTIO_NET_RX_BUDGET) {
+        struct pkbuf* pb = pkbuf_alloc();
+        if (!pb) break;
+        uint16_t len;
+        if (!virtio_net_receive(dev, pb->data, &len)) {
+            pkbuf_put(pb);
+            break;
+        }
+        pb->len = len;
+        netdev_receive_pkbuf(dev, pb);
+        done++;
+    }
+
+    bool more = done == VIRTIO_NET_RX_BUDGET;
+    if (!more) {
+        for (uint32_t q = 0; q < vdev->num_pairs; q++) {
+            if (!virtqueue_enable_cb(&vdev->rx[q])) more = true;
+        }
+    }
+    net_process_packets();
+    if (more) work_schedule(&vdev->rx_work);
+}
+
+// Top half: the rest waits for the worker
+static void virtio_net_rx_interrupt(struct virtqueue* vq) {
+    struct virtio_net_device* vdev = vq->private_data;
+    virtqueue_disable_cb(vq);
+    work_schedule(&vdev->rx_work);
+}
+
+static void virtio_net_get_mac(struct netdev* dev, uint8_t mac[6]) {
+    struct virtio_net_device* vdev = dev->priv;
+    memcpy(mac, vdev->mac, 6);
+}
+
+static struct netdev_ops virtio_net_ops = {
+    .init = NULL,
+    .start = NULL,
+    .stop = NULL,
+    .transmit = virtio_net_transmit,
+    .receive = virtio_net_receive,
+    .get_mac = virtio_net_get_mac,
+    .transmit_offload = virtio_net_transmit_offload,
+};
+
+// Enable pairs queue pairs through the control queue; only the first is
+// active until this succeeds
+static bool virtio_net_set_pairs(struct virtio_net_device* vdev, uint16_t pairs) {
+    struct {
+        uint8_t class;
+        uint8_t cmd;
+        uint16_t pairs;
+        uint8_t ack;
+    } __attribute__((packed)) *msg = malloc(5);
+    if (!msg) return false;
+    msg->class = VIRTIO_NET_CTRL_MQ;
+    msg->cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+    msg->pairs = pairs;
+    msg->ack = 0xFF;
+
+    struct virtio_buf bufs[3] = { { msg, 2 }, { &msg->pairs, 2 }, { &msg->ack, 1 } };
+    bool ok = virtqueue_add(&vdev->ctrl, bufs, 2, 1, msg);
+    if (ok) {
+        virtqueue_kick(&vdev->ctrl);
+        uint64_t deadline = ktime_get_ns() + VIRTIO_NET_CTRL_TIMEOUT_NS;
+        while (!virtqueue_get(&vdev->ctrl, NULL)) {
+            if (ktime_get_ns() > deadline) {
+                // The device still owns the buffer
+                return false;
+            }
+            __asm__ volatile("pause");
+        }
+        ok = msg->ack == VIRTIO_NET_OK;
+    }
+    free(msg);
+    return ok;
+}
+
+static bool virtio_net_setup(struct virtio_net_device* vdev, struct pci_device* pci_dev) {
+    struct virtio_device* virtio = &vdev->virtio;
+    if (!virtio_pci_init(virtio, pci_dev)) return false;
+    // Large receive is left out, so frames fit NETDEV_MAX_FRAME
+    uint64_t wanted = VIRTIO_FEATURE(VIRTIO_NET_F_CSUM) | VIRTIO_FEATURE(VIRTIO_NET_F_GUEST_CSUM) |
+                      VIRTIO_FEATURE(VIRTIO_NET_F_MAC) | VIRTIO_FEATURE(VIRTIO_NET_F_HOST_TSO4) |
+                      VIRTIO_FEATURE(VIRTIO_NET_F_HOST_TSO6) | VIRTIO_FEATURE(VIRTIO_NET_F_MRG_RXBUF) |
+                      VIRTIO_FEATURE(VIRTIO_NET_F_CTRL_VQ) | VIRTIO_FEATURE(VIRTIO_NET_F_MQ) |
+                      VIRTIO_FEATURE(VIRTIO_F_INDIRECT_DESC) | VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX);
+    if (!virtio_negotiate(virtio, wanted)) {
+        virtio_fail(virtio);
+        return false;
+    }
+
+    volatile uint8_t* config = virtio->config;
+    if (config && virtio_has_feature(virtio, VIRTIO_NET_F_MAC)) {
+        for (int i = 0; i < 6; i++) vdev->mac[i] = config[VIRTIO_NET_CFG_MAC + i];
+    }
+
+    // Queues come in RX/TX pairs, with the control queue after the device's last
+    uint16_t device_pairs = 1;
+    bool mq = config && virtio_has_feature(virtio, VIRTIO_NET_F_CTRL_VQ) &&
+              virtio_has_feature(virtio, VIRTIO_NET_F_MQ);
+    if (mq) device_pairs = *(volatile uint16_t*)(config + VIRTIO_NET_CFG_MAX_PAIRS);
+    uint32_t wanted_pairs = device_pairs < VIRTIO_NET_MAX_PAIRS ? device_pairs : VIRTIO_NET_MAX_PAIRS;
+
+    // RX interrupts, each pair's on a CPU of its own; TX buffers are
+    // reclaimed on the next send, so that side does not interrupt
+    work_init(&vdev->rx_work, virtio_net_rx_work);
+    while (vdev->num_pairs < wanted_pairs) {
+        uint32_t p = vdev->num_pairs;
+        if (!virtqueue_setup(virtio, &vdev->rx[p], (uint16_t)(2 * p), VIRTIO_NET_QUEUE_SIZE,
+                             virtio_net_rx_interrupt, p % smp_get_cpu_count()) ||
+            !virtqueue_setup(virtio, &vdev->tx[p], (uint16_t)(2 * p + 1), VIRTIO_NET_QUEUE_SIZE, NULL, 0)) {
+            break;
+        }
+        vdev->rx[p].private_data = vdev;
+        vdev->num_pairs++;
+    }
+    if (mq && !virtqueue_setup(virtio, &vdev->ctrl, (uint16_t)(2 * device_pairs), 16, NULL, 0)) mq = false;
+    if (!vdev->num_pairs) {
+        virtio_fail(virtio);
+        return false;
+    }
+
+    for (uint32_t p = 0; p < vdev->num_pairs; p++) virtio_net_fill_rx(&vdev->rx[p]);
+    virtio_driver_ok(virtio);
+    if (vdev->num_pairs > 1 && (!mq || !virtio_net_set_pairs(vdev, (uint16_t)vdev->num_pairs))) {
+        vdev->num_pairs = 1;
+    }
+
+    struct netdev dev;
+    memset(&dev, 0, sizeof(dev));
+    memcpy(dev.name, "eth0", 5);
+    for (struct netdev* taken; (taken = netdev_get_by_name(dev.name)); dev.name[3]++) {
+        netdev_put(taken);
+        if (dev.name[3] >= '0' + MAX_NET_DEVICES) break;
+    }
+    memcpy(dev.mac, vdev->mac, 6);
+    dev.active = true;
+    dev.priv = vdev;
+    dev.ops = &virtio_net_ops;
+    if (virtio_has_feature(virtio, VIRTIO_NET_F_CSUM)) {
+        dev.features |= NETDEV_F_TX_CSUM;
+        if (virtio_has_feature(virtio, VIRTIO_NET_F_HOST_TSO4)) dev.features |= NETDEV_F_TSO4;
+        if (virtio_has_feature(virtio, VIRTIO_NET_F_HOST_TSO6)) dev.features |= NETDEV_F_TSO6;
+    }
+    if (!netdev_register(&dev)) {
+        virtio_fail(virtio);
+        return false;
+    }
+
+    // Interrupts before this found no device to hand packets to
+    vdev->netdev = netdev_get_by_name(dev.name);
+    work_schedule(&vdev->rx_work);
+
+    log_info("virtio-net: %s, %d queue pairs", dev.name, (int)vdev->num_pairs);
+    return true;
+}
+
+// The netdev owns the state from here on, as priv
+static bool virtio_net_probe(struct pci_device* pci_dev, const struct pci_device_id* id) {
+    (void)id;
+    if (num_virtio_net_devices >= VIRTIO_NET_MAX_DEVICES) return false;
+    struct virtio_net_device* vdev = malloc(sizeof(struct virtio_net_device));
+    if (!vdev) return false;
+    memset(vdev, 0, sizeof(*vdev));
+
+    if (!virtio_net_setup(vdev, pci_dev)) {
+        // Queues a failed device had set up stay with it
+        if (!vdev->num_pairs) free(vdev);
+        return false;
+    }
+    num_virtio_net_devices++;
+    return true;
+}
+
+static const struct pci_device_id virtio_net_ids[] = {
+    PCI_DEVICE(VIRTIO_PCI_VENDOR, VIRTIO_PCI_MODERN_BASE + VIRTIO_ID_NET),
+    PCI_DEVICE(VIRTIO_PCI_VENDOR, VIRTIO_PCI_TRANS_NET),
+    { 0 }
+};
+
+static struct pci_driver virtio_net_driver = { "virtio-net", virtio_net_ids, virtio_net_probe };
+
+uint32_t virtio_net_init(void) {
+    if (!rx_buf_cache) {
+        rx_buf_cache = kmem_cache_create("virtio_net_rx", VIRTIO_NET_RX_BUF_SIZE, VIRTIO_NET_RX_BUF_SIZE, NULL);
+        if (!rx_buf_cache) return 0;
+    }
+
+    pci_register_driver(&virtio_net_driver);
+    return num_virtio_net_devices;
+}
@@ -0,0 +1,58 @@
+#ifndef VIRTIO_NET_H
+#define VIRTIO_NET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/drivers/virtio.h>
+#include <core/drivers/net/netdev.h>
+#include <core/workqueue.h>
+
+#define VIRTIO_NET_MAX_DEVICES  2
+#define VIRTIO_NET_MAX_PAIRS    4       // RX/TX queue pairs used per device
+#define VIRTIO_NET_QUEUE_SIZE   256
+#define VIRTIO_NET_RX_BUF_SIZE  2048
+#define VIRTIO_NET_RX_BUDGET    64      // Packets per bottom-half run
+
+// Device feature bits
+#define VIRTIO_NET_F_CSUM        0      // Device finishes partial checksums on TX
+#define VIRTIO_NET_F_GUEST_CSUM  1      // RX packets may carry partial checksums
+#define VIRTIO_NET_F_MAC         5
+#define VIRTIO_NET_F_HOST_TSO4   11
+#define VIRTIO_NET_F_HOST_TSO6   12
+#define VIRTIO_NET_F_MRG_RXBUF   15     // A packet may span several RX buffers
+#define VIRTIO_NET_F_STATUS      16
+#define VIRTIO_NET_F_CTRL_VQ     17
+#define VIRTIO_NET_F_MQ          22
+
+// Prepended to every packet, both ways
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM  1
+#define VIRTIO_NET_HDR_F_DATA_VALID  2
+
+struct virtio_net_hdr {
+    uint8_t flags;
+    uint8_t gso_type;           // NETDEV_GSO_*, the values are virtio's
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers;       // RX buffers the packet spans
+} __attribute__((packed));
+
+struct virtio_net_device {
+    struct virtio_device virtio;
+    struct virtqueue rx[VIRTIO_NET_MAX_PAIRS];
+    struct virtqueue tx[VIRTIO_NET_MAX_PAIRS];
+    struct virtqueue ctrl;
+    uint32_t num_pairs;
+    uint32_t rx_next;           // Queue receive() starts from, for fairness
+    spinlock_t rx_lock;         // Keeps a packet's buffers together
+    struct work rx_work;        // Bottom half of the RX interrupts
+    struct netdev* netdev;      // As registered, with a reference held
+    uint8_t mac[6];
+};
+
+// Probe virtio-net PCI functions and register each as a netdev; the
+// number registered
+uint32_t virtio_net_init(void);
+
+#endif // VIRTIO_NET_H
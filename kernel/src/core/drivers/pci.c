@@ -2,81 +2,185 @@
 #include <core/acpi.h>
 #include <utils/io.h>
 #include <utils/mem.h>
+#include <utils/log.h>
+#include <mm/vmm.h>
+#include <core/smp.h>
 
 // Maximum values for PCI bus/device/function
 #define PCI_MAX_BUS    256
 #define PCI_MAX_SLOT   32
 #define PCI_MAX_FUNC   8
 
-// Array to store found PCI devices
-#define MAX_PCI_DEVICES 32
+#define PCI_ECAM_BUS_SIZE   (1 << 20)   // 32 slots of 8 functions of 4 KiB
+
+// Every function, found once by pci_init() and kept with its
+// capabilities, so drivers never go back to the bus to look
+#define MAX_PCI_DEVICES 128
 static struct pci_device pci_devices[MAX_PCI_DEVICES];
 static int num_pci_devices = 0;
 
-// MMIO base for PCI config space
-static volatile uint8_t* pci_mcfg_base = NULL;
+// ECAM window of each bus segment 0 has in the MCFG, mapped as the bus is
+// scanned; NULL for port I/O
+static uint64_t ecam_base = 0;
+static uint8_t ecam_start_bus = 0;
+static uint8_t ecam_end_bus = 0;
+static volatile uint8_t* ecam_buses[PCI_MAX_BUS];
+static uint8_t scanned_buses[PCI_MAX_BUS / 8];
+
+// CF8 and CFC are one address/data pair for everyone; drivers probe in parallel
+static spinlock_t pci_port_lock = SPINLOCK_INIT;
+
+// Uncached, through the HHDM, which only covers RAM
+static volatile void* map_device_memory(uint64_t phys, uint64_t len) {
+    uint64_t base = phys & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t virt = (uint64_t)pmm_phys_to_virt((void*)base);
+    if (!vmm_map_range(virt, base, phys + len - base,
+                       PTE_PRESENT | PTE_WRITABLE | PTE_NOCACHE | PTE_NX)) {
+        return NULL;
+    }
+    return (volatile void*)(virt + (phys - base));
+}
+
+static void ecam_map_bus(uint8_t bus) {
+    if (!ecam_base || bus < ecam_start_bus || bus > ecam_end_bus || ecam_buses[bus]) return;
+    // The MCFG base is where bus 0 would be, whatever the first bus
+    ecam_buses[bus] = map_device_memory(ecam_base + ((uint64_t)bus << 20), PCI_ECAM_BUS_SIZE);
+}
 
 // Helper function to get MMIO address for PCI config space
-static void* get_device_addr(uint8_t bus, uint8_t slot, uint8_t func) {
-    if (!pci_mcfg_base) return NULL;
-    return (void*)(pci_mcfg_base + ((bus << 20) | (slot << 15) | (func << 12)));
+static volatile uint8_t* get_device_addr(uint8_t bus, uint8_t slot, uint8_t func) {
+    volatile uint8_t* window = ecam_buses[bus];
+    if (!window) return NULL;
+    return window + ((slot << 15) | (func << 12));
 }
 
 uint32_t pci_read_config(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
     // Try MCFG (memory-mapped) access first
-    void* addr = get_device_addr(bus, slot, func);
+    volatile uint8_t* addr = get_device_addr(bus, slot, func);
     if (addr) {
-        return *(volatile uint32_t*)((uintptr_t)addr + offset);
+        return *(volatile uint32_t*)(addr + (offset & 0xFC));
     }
 
     // Fall back to legacy I/O ports if no MCFG
     uint32_t address = 0x80000000 | (bus << 16) | (slot << 11) |
                       (func << 8) | (offset & 0xFC);
+    uint64_t flags = spinlock_acquire_irqsave(&pci_port_lock);
     outl(0xCF8, address);
-    return inl(0xCFC);
+    uint32_t value = inl(0xCFC);
+    spinlock_release_irqrestore(&pci_port_lock, flags);
+    return value;
 }
 
 void pci_write_config(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
-    void* addr = get_device_addr(bus, slot, func);
+    volatile uint8_t* addr = get_device_addr(bus, slot, func);
     if (addr) {
-        *(volatile uint32_t*)((uintptr_t)addr + offset) = value;
+        *(volatile uint32_t*)(addr + (offset & 0xFC)) = value;
     } else {
         uint32_t address = 0x80000000 | (bus << 16) | (slot << 11) |
                           (func << 8) | (offset & 0xFC);
+        uint64_t flags = spinlock_acquire_irqsave(&pci_port_lock);
         outl(0xCF8, address);
         outl(0xCFC, value);
+        spinlock_release_irqrestore(&pci_port_lock, flags);
     }
 }
 
+static inline uint32_t dev_read(struct pci_device* dev, uint8_t offset) {
+    return pci_read_config(dev->bus, dev->slot, dev->func, offset);
+}
+
+// Walk the capability list once and keep what drivers ask about
+static void pci_parse_capabilities(struct pci_device* dev) {
+    // Status bit 4: capabilities list present
+    if (!(dev_read(dev, PCI_COMMAND) & (1 << 20))) return;
+
+    uint8_t offset = dev_read(dev, PCI_CAPABILITIES) & 0xFC;
+    for (int hops = 0; offset && hops < 48; hops++) {
+        uint32_t header = dev_read(dev, offset);
+        uint16_t control = header >> 16;
+
+        switch (header & 0xFF) {
+            case PCI_CAP_ID_MSI:
+                if (dev->msi_cap) break;
+                dev->msi_cap = offset;
+                dev->msi_vectors = 1 << ((control >> 1) & 7);
+                dev->msi_64bit = (control & (1 << 7)) != 0;
+                dev->msi_maskable = (control & (1 << 8)) != 0;
+                break;
+
+            case PCI_CAP_ID_MSIX: {
+                if (dev->msix_cap) break;
+                // Table and PBA: offset, with the BAR in the low three bits
+                uint32_t table = dev_read(dev, offset + 4);
+                uint32_t pba = dev_read(dev, offset + 8);
+                dev->msix_cap = offset;
+                dev->msix_entries = (control & 0x7FF) + 1;
+                dev->msix_table_bar = table & 0x7;
+                dev->msix_table_offset = table & ~0x7U;
+                dev->msix_pba_bar = pba & 0x7;
+                dev->msix_pba_offset = pba & ~0x7U;
+                break;
+            }
+
+            case PCI_CAP_ID_PCIE: {
+                if (dev->pcie_cap) break;
+                uint32_t device_caps = dev_read(dev, offset + 4);
+                uint32_t link_status = dev_read(dev, offset + 0x10) >> 16;
+                dev->pcie_cap = offset;
+                dev->pcie_type = (control >> 4) & 0xF;
+                dev->pcie_max_payload = 128 << (device_caps & 7);
+                dev->pcie_link_speed = link_status & 0xF;
+                dev->pcie_link_width = (link_status >> 4) & 0x3F;
+                break;
+            }
+        }
+        offset = (header >> 8) & 0xFC;
+    }
+}
+
+static void pci_scan_bus(uint8_t bus);
+
 static void pci_scan_function(uint8_t bus, uint8_t slot, uint8_t func) {
     uint32_t vendor_device = pci_read_config(bus, slot, func, 0);
     uint16_t vendor = vendor_device & 0xFFFF;
     uint16_t device = (vendor_device >> 16) & 0xFFFF;
 
     if (vendor == 0xFFFF) return;  // Invalid vendor
-    if (num_pci_devices >= MAX_PCI_DEVICES) return;
-
-    struct pci_device* dev = &pci_devices[num_pci_devices];
-    dev->vendor_id = vendor;
-    dev->device_id = device;
 
-    // Read class info
     uint32_t class_info = pci_read_config(bus, slot, func, 0x8);
-    dev->class_code = (class_info >> 24) & 0xFF;
-    dev->subclass = (class_info >> 16) & 0xFF;
-    dev->prog_if = (class_info >> 8) & 0xFF;
-    dev->revision = class_info & 0xFF;
+    uint8_t header_type = (pci_read_config(bus, slot, func, 0xC) >> 16) & 0x7F;
 
-    dev->bus = bus;
-    dev->slot = slot;
-    dev->func = func;
+    if (num_pci_devices < MAX_PCI_DEVICES) {
+        struct pci_device* dev = &pci_devices[num_pci_devices];
+        dev->vendor_id = vendor;
+        dev->device_id = device;
 
-    // Read BARs
-    for (int i = 0; i < 6; i++) {
-        dev->bar[i] = pci_read_config(bus, slot, func, PCI_BAR0 + (i * 4));
+        // Read class info
+        dev->class_code = (class_info >> 24) & 0xFF;
+        dev->subclass = (class_info >> 16) & 0xFF;
+        dev->prog_if = (class_info >> 8) & 0xFF;
+        dev->revision = class_info & 0xFF;
+        dev->header_type = header_type;
+
+        dev->bus = bus;
+        dev->slot = slot;
+        dev->func = func;
+        dev->irq_line = pci_read_config(bus, slot, func, 0x3C) & 0xFF;
+
+        // Read BARs, two on a bridge
+        for (int i = 0; i < (header_type == 0 ? 6 : 2); i++) {
+            dev->bar[i] = pci_read_config(bus, slot, func, PCI_BAR0 + (i * 4));
+        }
+
+        pci_parse_capabilities(dev);
+        num_pci_devices++;
     }
 
-    num_pci_devices++;
+    // A PCI-to-PCI bridge leads to its secondary bus
+    if (header_type == 1 && ((class_info >> 16) & 0xFFFF) == 0x0604) {
+        uint8_t secondary = (pci_read_config(bus, slot, func, 0x18) >> 8) & 0xFF;
+        if (secondary) pci_scan_bus(secondary);
+    }
 }
 
 static void pci_scan_slot(uint8_t bus, uint8_t slot) {
@@ -86,34 +190,70 @@ static void pci_scan_slot(uint8_t bus, uint8_t slot) {
     pci_scan_function(bus, slot, 0);
 
     // Check if multi-function device
-    uint32_t header_type = pci_read_config(bus, slot, 0, PCI_HEADER_TYPE);
+    uint32_t header_type = pci_read_config(bus, slot, 0, 0xC) >> 16;
     if ((header_type & 0x80) != 0) {
         for (uint8_t func = 1; func < PCI_MAX_FUNC; func++) {
-            vendor_device = pci_read_config(bus, slot, func, 0);
-            if ((vendor_device & 0xFFFF) != 0xFFFF) {
-                pci_scan_function(bus, slot, func);
-            }
+            pci_scan_function(bus, slot, func);
         }
     }
 }
 
+static void pci_scan_bus(uint8_t bus) {
+    // Misconfigured bridges could send us round in circles
+    if (scanned_buses[bus / 8] & (1 << (bus % 8))) return;
+    scanned_buses[bus / 8] |= 1 << (bus % 8);
+
+    ecam_map_bus(bus);
+    for (uint8_t slot = 0; slot < PCI_MAX_SLOT; slot++) {
+        pci_scan_slot(bus, slot);
+    }
+}
+
 void pci_init(void) {
     num_pci_devices = 0;
     memset(pci_devices, 0, sizeof(pci_devices));
+    memset(ecam_buses, 0, sizeof(ecam_buses));
+    memset(scanned_buses, 0, sizeof(scanned_buses));
 
-    // Try to get MCFG base from ACPI
-    pci_mcfg_base = acpi_get_mcfg_base();
+    // Memory-mapped config space where the firmware describes it
+    if (!acpi_get_mcfg(0, &ecam_base, &ecam_start_bus, &ecam_end_bus)) ecam_base = 0;
 
-    // Scan all PCI buses
-    for (uint16_t bus = 0; bus < PCI_MAX_BUS; bus++) {
-        for (uint8_t slot = 0; slot < PCI_MAX_SLOT; slot++) {
-            pci_scan_slot(bus, slot);
+    // The first host bridge and the buses its bridges lead to, in order. A
+    // multi-function host bridge has one root bus per function.
+    uint32_t header_type = pci_read_config(0, 0, 0, 0xC) >> 16;
+    if (!(header_type & 0x80)) {
+        pci_scan_bus(0);
+    } else {
+        for (uint8_t func = 0; func < PCI_MAX_FUNC; func++) {
+            if ((pci_read_config(0, 0, func, 0) & 0xFFFF) != 0xFFFF) pci_scan_bus(func);
         }
     }
+
+    // Further host bridges have root buses no bridge leads to, anywhere in
+    // the segment's range. Other segments stay out of reach, as config
+    // access only knows segment 0.
+    uint32_t first = ecam_base ? ecam_start_bus : 0;
+    uint32_t last = ecam_base ? ecam_end_bus : PCI_MAX_BUS - 1;
+    for (uint32_t bus = first; bus <= last; bus++) pci_scan_bus((uint8_t)bus);
+
+    log_info("PCI: %d functions through %s", num_pci_devices, ecam_base ? "ECAM" : "port I/O");
 }
 
 struct pci_device* pci_scan_for_class(uint8_t class, uint8_t subclass) {
-    for (int i = 0; i < num_pci_devices; i++) {
+    return pci_next_for_class(class, subclass, NULL);
+}
+
+struct pci_device* pci_next_for_id(uint16_t vendor, uint16_t device, struct pci_device* prev) {
+    for (int i = prev ? (int)(prev - pci_devices) + 1 : 0; i < num_pci_devices; i++) {
+        if (pci_devices[i].vendor_id == vendor && pci_devices[i].device_id == device) {
+            return &pci_devices[i];
+        }
+    }
+    return NULL;
+}
+
+struct pci_device* pci_next_for_class(uint8_t class, uint8_t subclass, struct pci_device* prev) {
+    for (int i = prev ? (int)(prev - pci_devices) + 1 : 0; i < num_pci_devices; i++) {
         if (pci_devices[i].class_code == class &&
             pci_devices[i].subclass == subclass) {
             return &pci_devices[i];
@@ -122,6 +262,52 @@ struct pci_device* pci_scan_for_class(uint8_t class, uint8_t subclass) {
     return NULL;
 }
 
+static inline bool id_field_matches(uint16_t want, uint16_t have) {
+    return want == PCI_ANY_ID || want == have;
+}
+
+const struct pci_device_id* pci_match_id(const struct pci_device_id* ids, const struct pci_device* dev) {
+    for (; ids && ids->vendor; ids++) {
+        if (id_field_matches(ids->vendor, dev->vendor_id) &&
+            id_field_matches(ids->device, dev->device_id) &&
+            id_field_matches(ids->class_code, dev->class_code) &&
+            id_field_matches(ids->subclass, dev->subclass) &&
+            id_field_matches(ids->prog_if, dev->prog_if)) {
+            return ids;
+        }
+    }
+    return NULL;
+}
+
+struct pci_device* pci_next_match(const struct pci_device_id* ids, struct pci_device* prev) {
+    for (int i = prev ? (int)(prev - pci_devices) + 1 : 0; i < num_pci_devices; i++) {
+        if (pci_match_id(ids, &pci_devices[i])) return &pci_devices[i];
+    }
+    return NULL;
+}
+
+uint32_t pci_register_driver(struct pci_driver* driver) {
+    uint32_t bound = 0;
+    for (int i = 0; i < num_pci_devices; i++) {
+        struct pci_device* dev = &pci_devices[i];
+        const struct pci_device_id* id = pci_match_id(driver->ids, dev);
+        if (!id) continue;
+
+        // Drivers register in parallel; the first to claim a device probes it
+        struct pci_driver* expected = NULL;
+        if (!__atomic_compare_exchange_n(&dev->driver, &expected, driver, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        if (driver->probe(dev, id)) {
+            bound++;
+        } else {
+            __atomic_store_n(&dev->driver, NULL, __ATOMIC_RELEASE);
+        }
+    }
+    return bound;
+}
+
 uint32_t pci_get_bar(struct pci_device* dev, int bar_num) {
     if (!dev || bar_num >= 6) return 0;
 
@@ -132,4 +318,73 @@ uint32_t pci_get_bar(struct pci_device* dev, int bar_num) {
         return bar & 0xFFFFFFFC;  // I/O BAR
     }
     return bar & 0xFFFFFFF0;  // Memory BAR
-}
\ No newline at end of file
+}
+
+uint8_t pci_find_capability(struct pci_device* dev, uint8_t id) {
+    if (!dev) return 0;
+
+    // Parsed by pci_init()
+    switch (id) {
+        case PCI_CAP_ID_MSI: return dev->msi_cap;
+        case PCI_CAP_ID_MSIX: return dev->msix_cap;
+        case PCI_CAP_ID_PCIE: return dev->pcie_cap;
+    }
+    return pci_next_capability(dev, id, 0);
+}
+
+uint8_t pci_next_capability(struct pci_device* dev, uint8_t id, uint8_t after) {
+    if (!dev) return 0;
+
+    // Status bit 4: capabilities list present
+    uint32_t status = dev_read(dev, PCI_COMMAND);
+    if (!(status & (1 << 20))) return 0;
+
+    uint8_t offset = dev_read(dev, PCI_CAPABILITIES) & 0xFC;
+    bool passed = after == 0;
+    for (int hops = 0; offset && hops < 48; hops++) {
+        uint32_t header = dev_read(dev, offset);
+        if (passed && (header & 0xFF) == id) return offset;
+        if (offset == after) passed = true;
+        offset = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+uint64_t pci_get_bar64(struct pci_device* dev, int bar_num) {
+    if (!dev || bar_num >= 6 || (dev->bar[bar_num] & 1)) return 0;
+
+    // Type 2 in bits 2:1 takes the next BAR as the high half
+    uint64_t addr = dev->bar[bar_num] & 0xFFFFFFF0;
+    if (((dev->bar[bar_num] >> 1) & 3) == 2 && bar_num < 5) {
+        addr |= (uint64_t)dev->bar[bar_num + 1] << 32;
+    }
+    return addr;
+}
+
+volatile void* pci_map_bar(struct pci_device* dev, int bar_num, uint64_t offset, uint64_t len) {
+    uint64_t bar = pci_get_bar64(dev, bar_num);
+    if (!bar || !len) return NULL;
+    return map_device_memory(bar + offset, len);
+}
+
+volatile uint32_t* pci_msix_enable(struct pci_device* dev, uint32_t* entries) {
+    if (!dev || !dev->msix_cap) return NULL;
+
+    uint8_t cap = dev->msix_cap;
+    uint32_t count = dev->msix_entries;
+    volatile uint32_t* table = pci_map_bar(dev, dev->msix_table_bar, dev->msix_table_offset,
+                                           count * PCI_MSIX_ENTRY_DWORDS * 4);
+    if (!table) return NULL;
+
+    for (uint32_t i = 0; i < count; i++) {
+        table[i * PCI_MSIX_ENTRY_DWORDS + 3] = 1;
+    }
+
+    // Message control bit 15 enables MSI-X; INTx goes off with it
+    uint32_t control = dev_read(dev, cap);
+    pci_write_config(dev->bus, dev->slot, dev->func, cap, control | (1U << 31));
+    uint32_t cmd = dev_read(dev, PCI_COMMAND);
+    pci_write_config(dev->bus, dev->slot, dev->func, PCI_COMMAND, cmd | (1 << 10));
+    *entries = count;
+    return table;
+}
@@ -23,6 +23,16 @@
 #define PCI_BAR3                0x1C
 #define PCI_BAR4                0x20
 #define PCI_BAR5                0x24
+#define PCI_CAPABILITIES        0x34
+
+// Capability IDs
+#define PCI_CAP_ID_MSI          0x05
+#define PCI_CAP_ID_VENDOR       0x09
+#define PCI_CAP_ID_PCIE         0x10
+#define PCI_CAP_ID_MSIX         0x11
+
+// MSI-X table entries: address low, address high, data, vector control
+#define PCI_MSIX_ENTRY_DWORDS   4
 
 // Device classes
 #define PCI_CLASS_UNCLASSIFIED  0x00
@@ -44,6 +54,30 @@
 #define PCI_CLASS_SIGNAL_PROC   0x11
 #define PCI_CLASS_UNDEFINED     0xFF
 
+// Device ID table entry; PCI_ANY_ID matches anything, and an entry with
+// vendor 0 ends the table
+#define PCI_ANY_ID              0xFFFF
+
+struct pci_device_id {
+    uint16_t vendor;
+    uint16_t device;
+    uint16_t class_code;
+    uint16_t subclass;
+    uint16_t prog_if;
+};
+
+#define PCI_DEVICE(vendor, device) { (vendor), (device), PCI_ANY_ID, PCI_ANY_ID, PCI_ANY_ID }
+#define PCI_DEVICE_CLASS(class_code, subclass) { PCI_ANY_ID, PCI_ANY_ID, (class_code), (subclass), PCI_ANY_ID }
+
+struct pci_device;
+
+struct pci_driver {
+    const char* name;
+    const struct pci_device_id* ids;
+    // Take a matching device; false leaves it to other drivers
+    bool (*probe)(struct pci_device* dev, const struct pci_device_id* id);
+};
+
 struct pci_device {
     uint16_t vendor_id;
     uint16_t device_id;
@@ -51,17 +85,58 @@ struct pci_device {
     uint8_t subclass;
     uint8_t prog_if;
     uint8_t revision;
+    uint8_t header_type;        // Without the multi-function bit
     uint8_t bus;
     uint8_t slot;
     uint8_t func;
+    uint8_t irq_line;
     uint32_t bar[6];
+    struct pci_driver* driver;  // Bound by pci_register_driver()
+
+    // Capabilities, parsed at enumeration; offsets are 0 if absent
+    uint8_t msi_cap;
+    uint8_t msi_vectors;        // Multiple Message Capable
+    bool msi_64bit;
+    bool msi_maskable;          // Per-vector masking
+    uint8_t msix_cap;
+    uint16_t msix_entries;
+    uint8_t msix_table_bar;
+    uint8_t msix_pba_bar;
+    uint32_t msix_table_offset;
+    uint32_t msix_pba_offset;
+    uint8_t pcie_cap;
+    uint8_t pcie_type;          // Device/port type
+    uint8_t pcie_link_speed;    // Negotiated, 1 for 2.5 GT/s and up
+    uint8_t pcie_link_width;
+    uint16_t pcie_max_payload;  // Bytes, as supported
 };
 
 // Function declarations
+// Enumerate the buses once, through ECAM when the MCFG describes it
 void pci_init(void);
 uint32_t pci_read_config(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 void pci_write_config(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
 struct pci_device* pci_scan_for_class(uint8_t class, uint8_t subclass);
+// The next match after prev, the first if prev is NULL
+struct pci_device* pci_next_for_class(uint8_t class, uint8_t subclass, struct pci_device* prev);
+struct pci_device* pci_next_for_id(uint16_t vendor, uint16_t device, struct pci_device* prev);
+struct pci_device* pci_next_match(const struct pci_device_id* ids, struct pci_device* prev);
+// The entry of ids dev matches, NULL if none does
+const struct pci_device_id* pci_match_id(const struct pci_device_id* ids, const struct pci_device* dev);
+// Probe every matching device no other driver has taken; how many it took
+uint32_t pci_register_driver(struct pci_driver* driver);
 uint32_t pci_get_bar(struct pci_device* dev, int bar_num);
+// Physical address of a memory BAR, both halves of a 64-bit one
+uint64_t pci_get_bar64(struct pci_device* dev, int bar_num);
+// Map len bytes at offset into a memory BAR, uncached, through the HHDM
+volatile void* pci_map_bar(struct pci_device* dev, int bar_num, uint64_t offset, uint64_t len);
+// Config space offset of a capability, 0 if the device has none
+uint8_t pci_find_capability(struct pci_device* dev, uint8_t id);
+// The next capability with this ID after offset after, 0 if there is none
+uint8_t pci_next_capability(struct pci_device* dev, uint8_t id, uint8_t after);
+
+// Enable MSI-X with every entry masked, and INTx off. Returns the mapped
+// table and its size, or NULL without MSI-X; irq_setup_msix() routes entries.
+volatile uint32_t* pci_msix_enable(struct pci_device* dev, uint32_t* entries);
 
 #endif // PCI_H
\ No newline at end of file
@@ -28,12 +28,13 @@ static void keyboard_handler(struct interrupt_frame* frame) {
     if (scancode < sizeof(scancode_to_ascii) && scancode_to_ascii[scancode]) {
         char c = scancode_to_ascii[scancode];
         draw_char(global_framebuffer, c, x, y, 0xFFFFFF);
-        x += 12;
+        display_flush(global_framebuffer);
+        x += DISPLAY_GLYPH_WIDTH;
 
         // Basic line wrapping
-        if (x >= global_framebuffer->width - 12) {
+        if (x > global_framebuffer->width - DISPLAY_GLYPH_WIDTH) {
             x = 0;
-            y += 16;
+            y += DISPLAY_GLYPH_HEIGHT;
         }
     }
 
@@ -1,4 +1,7 @@
 #include <core/drivers/serial/serial.h>
+#include <core/drivers/pic.h>
+#include <core/idt.h>
+#include <core/wait.h>
 #include <utils/io.h>
 
 // Register offsets
@@ -15,9 +18,62 @@
 #define LSR_DATA_READY  0x01
 #define LSR_THR_EMPTY   0x20
 
+// Interrupt enable flags
+#define IER_RX_AVAILABLE 0x01
+#define IER_THR_EMPTY    0x02
+
+// Interrupt identification, read from the FIFO control offset
+#define IIR_NONE         0x01
+#define IIR_ID_MASK      0x0E
+#define IIR_MODEM        0x00
+#define IIR_THR_EMPTY    0x02
+#define IIR_RX_AVAILABLE 0x04
+#define IIR_LINE_STATUS  0x06
+#define IIR_RX_TIMEOUT   0x0C
+#define MODEM_STATUS_REG 0x6
+
+#define SERIAL_RX_BUFFER_SIZE 256  // Must be a power of 2
+#define SERIAL_FIFO_SIZE      16   // 16550A transmit FIFO
+
+// Receive ring filled from the IRQ handler, and the transmit source the
+// THRE interrupt pulls from
+struct serial_port {
+    uint16_t port;
+    uint8_t irq;
+    bool enabled;
+    volatile uint32_t head;   // Written by the IRQ handler
+    volatile uint32_t tail;   // Written by readers
+    uint8_t buffer[SERIAL_RX_BUFFER_SIZE];
+    struct wait_queue wait;
+
+    serial_tx_fill_t tx_fill;
+    bool tx_active;           // THRE interrupt armed
+    uint8_t ier;
+    spinlock_t tx_lock;       // Transmitter and IER
+};
+
+static struct serial_port ports[] = {
+    { .port = COM1, .irq = 4, .wait = WAIT_QUEUE_INIT, .tx_lock = SPINLOCK_INIT },
+    { .port = COM2, .irq = 3, .wait = WAIT_QUEUE_INIT, .tx_lock = SPINLOCK_INIT },
+};
+
+static spinlock_t rx_lock = SPINLOCK_INIT;  // Serializes readers
+
+static struct serial_port* find_port(uint16_t port) {
+    for (uint32_t i = 0; i < sizeof(ports) / sizeof(ports[0]); i++) {
+        if (ports[i].port == port) return &ports[i];
+    }
+    return NULL;
+}
+
 void serial_init(uint16_t port) {
     // Disable interrupts
     outb(port + INT_ENABLE_REG, 0x00);
+    struct serial_port* p = find_port(port);
+    if (p) {
+        p->ier = 0;
+        p->tx_active = false;
+    }
 
     // Enable DLAB to set baud rate
     outb(port + LINE_CTRL_REG, 0x80);
@@ -37,13 +93,153 @@ void serial_init(uint16_t port) {
 }
 
 void serial_write_char(uint16_t port, char c) {
+    // Kept off the FIFO while the THRE interrupt is filling it
+    struct serial_port* p = find_port(port);
+    uint64_t flags = (p && p->tx_fill) ? spinlock_acquire_irqsave(&p->tx_lock) : 0;
+    serial_write_char_unlocked(port, c);
+    if (p && p->tx_fill) spinlock_release_irqrestore(&p->tx_lock, flags);
+}
+
+void serial_write_char_unlocked(uint16_t port, char c) {
     while ((inb(port + LINE_STATUS_REG) & LSR_THR_EMPTY) == 0);
     outb(port, c);
 }
 
 char serial_read_char(uint16_t port) {
-    while ((inb(port + LINE_STATUS_REG) & LSR_DATA_READY) == 0);
-    return inb(port);
+    struct serial_port* rx = find_port(port);
+    if (!rx || !rx->enabled) {
+        while ((inb(port + LINE_STATUS_REG) & LSR_DATA_READY) == 0);
+        return inb(port);
+    }
+
+    for (;;) {
+        wait_event(&rx->wait, rx->head != rx->tail);
+
+        // Another reader may have taken the byte first
+        uint64_t flags = spinlock_acquire_irqsave(&rx_lock);
+        if (rx->head != rx->tail) {
+            char c = (char)rx->buffer[rx->tail & (SERIAL_RX_BUFFER_SIZE - 1)];
+            rx->tail++;
+            spinlock_release_irqrestore(&rx_lock, flags);
+            return c;
+        }
+        spinlock_release_irqrestore(&rx_lock, flags);
+    }
+}
+
+static void serial_rx_handler(struct serial_port* rx) {
+    bool any = false;
+    while (inb(rx->port + LINE_STATUS_REG) & LSR_DATA_READY) {
+        uint8_t c = inb(rx->port);
+        // Drop input when the buffer is full
+        if (rx->enabled && rx->head - rx->tail < SERIAL_RX_BUFFER_SIZE) {
+            rx->buffer[rx->head & (SERIAL_RX_BUFFER_SIZE - 1)] = c;
+            rx->head++;
+            any = true;
+        }
+    }
+    if (any) wait_queue_wake_all(&rx->wait);
+}
+
+// The FIFO is empty: refill it in one go, or disarm the interrupt when
+// there is nothing left to send. tx_lock held.
+static void serial_tx_refill(struct serial_port* p) {
+    if (!p->tx_fill || !(inb(p->port + LINE_STATUS_REG) & LSR_THR_EMPTY)) return;
+
+    uint8_t chunk[SERIAL_FIFO_SIZE];
+    uint32_t count = p->tx_fill(chunk, SERIAL_FIFO_SIZE);
+    for (uint32_t i = 0; i < count; i++) {
+        outb(p->port, chunk[i]);
+    }
+    if (!count && p->tx_active) {
+        p->tx_active = false;
+        p->ier &= ~IER_THR_EMPTY;
+        outb(p->port + INT_ENABLE_REG, p->ier);
+    }
+}
+
+// One IRQ line serves receive and transmit; take every cause it has
+static void serial_interrupt(struct serial_port* p) {
+    for (;;) {
+        uint8_t iir = inb(p->port + FIFO_CTRL_REG);
+        if (iir & IIR_NONE) break;
+
+        switch (iir & IIR_ID_MASK) {
+            case IIR_THR_EMPTY: {
+                uint64_t flags = spinlock_acquire_irqsave(&p->tx_lock);
+                serial_tx_refill(p);
+                spinlock_release_irqrestore(&p->tx_lock, flags);
+                break;
+            }
+            case IIR_RX_AVAILABLE:
+            case IIR_RX_TIMEOUT:
+                serial_rx_handler(p);
+                break;
+            case IIR_LINE_STATUS:
+                inb(p->port + LINE_STATUS_REG);
+                break;
+            default:
+                inb(p->port + MODEM_STATUS_REG);
+                break;
+        }
+    }
+    pic_send_eoi(p->irq);
+}
+
+static void com1_interrupt_handler(struct interrupt_frame* frame) {
+    (void)frame;
+    serial_interrupt(&ports[0]);
+}
+
+static void com2_interrupt_handler(struct interrupt_frame* frame) {
+    (void)frame;
+    serial_interrupt(&ports[1]);
+}
+
+static void serial_install_irq(struct serial_port* p) {
+    // serial_init() already set OUT2, which gates the IRQ line
+    register_interrupt_handler(IRQ0 + p->irq, p->port == COM1 ? com1_interrupt_handler : com2_interrupt_handler);
+    pic_clear_mask(p->irq);
+}
+
+bool serial_enable_rx_interrupt(uint16_t port) {
+    struct serial_port* rx = find_port(port);
+    if (!rx) return false;
+
+    serial_install_irq(rx);
+    rx->enabled = true;
+
+    uint64_t flags = spinlock_acquire_irqsave(&rx->tx_lock);
+    rx->ier |= IER_RX_AVAILABLE;
+    outb(port + INT_ENABLE_REG, rx->ier);
+    spinlock_release_irqrestore(&rx->tx_lock, flags);
+    return true;
+}
+
+bool serial_enable_tx_interrupt(uint16_t port, serial_tx_fill_t fill) {
+    struct serial_port* p = find_port(port);
+    if (!p || !fill) return false;
+
+    serial_install_irq(p);
+    uint64_t flags = spinlock_acquire_irqsave(&p->tx_lock);
+    p->tx_fill = fill;
+    spinlock_release_irqrestore(&p->tx_lock, flags);
+    serial_tx_kick(port);
+    return true;
+}
+
+void serial_tx_kick(uint16_t port) {
+    struct serial_port* p = find_port(port);
+    if (!p || !p->tx_fill) return;
+
+    // Arming THRE with the FIFO already empty raises the interrupt at once
+    uint64_t flags = spinlock_acquire_irqsave(&p->tx_lock);
+    if (!p->tx_active) {
+        p->tx_active = true;
+        p->ier |= IER_THR_EMPTY;
+        outb(port + INT_ENABLE_REG, p->ier);
+    }
+    spinlock_release_irqrestore(&p->tx_lock, flags);
 }
 
 bool serial_can_read(uint16_t port) {
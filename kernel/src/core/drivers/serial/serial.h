@@ -15,8 +15,21 @@ void serial_init(uint16_t port);
 
 // Basic I/O for debug purposes
 void serial_write_char(uint16_t port, char c);
+// Polled and lock-free, for panics; may interleave with the THRE interrupt
+void serial_write_char_unlocked(uint16_t port, char c);
 char serial_read_char(uint16_t port);
 bool serial_can_read(uint16_t port);
 bool serial_can_write(uint16_t port);
 
+// Buffer received bytes from the port's IRQ so serial_read_char() sleeps
+// instead of polling. COM1 and COM2 only.
+bool serial_enable_rx_interrupt(uint16_t port);
+
+// Transmit from the THRE interrupt. fill is asked for up to room bytes
+// each time the FIFO empties and returns how many it gave; 0 disarms the
+// interrupt until serial_tx_kick() says there is more. COM1 and COM2 only.
+typedef uint32_t (*serial_tx_fill_t)(uint8_t* buffer, uint32_t room);
+bool serial_enable_tx_interrupt(uint16_t port, serial_tx_fill_t fill);
+void serial_tx_kick(uint16_t port);
+
 #endif // SERIAL_H
\ No newline at end of file
@@ -0,0 +1,202 @@
+#include <core/drivers/storage/blockdev.h>
+#include <core/smp.h>
+#include <core/wait.h>
+#include <mm/pmm.h>
+
+// Requests a CPU has queued but not yet dispatched
+struct blk_queue {
+    spinlock_t lock;
+    struct blk_request* head;
+    struct blk_request* tail;
+    uint32_t depth;
+    uint32_t plugs;
+};
+
+static struct blk_queue queues[MAX_CPUS];
+
+// Synchronous submitters, woken on every synchronous completion
+static struct wait_queue sync_wait = WAIT_QUEUE_INIT;
+
+struct sync_io {
+    volatile bool done;
+    bool success;
+};
+
+void blk_complete(struct blk_request* req, bool success) {
+    while (req) {
+        struct blk_request* merged = req->merged;
+        req->done(req, success);
+        req = merged;
+    }
+}
+
+// req may continue the merged run from head to tail: next on disk, same
+// direction, within the device's limit, and with a buffer the driver can
+// describe, either carrying straight on or meeting it at a page boundary
+static bool can_merge(struct blk_request* head, struct blk_request* tail, struct blk_request* req) {
+    struct block_device* dev = head->dev;
+    if (req->dev != dev || !dev->submit || req->write != head->write) return false;
+    if (head->lba + head->total != req->lba || head->total + req->count > dev->max_sectors) return false;
+
+    uintptr_t end = (uintptr_t)tail->buffer + (uintptr_t)tail->count * dev->block_size;
+    uintptr_t start = (uintptr_t)req->buffer;
+    return end == start || (!(end & (PAGE_SIZE - 1)) && !(start & (PAGE_SIZE - 1)));
+}
+
+static bool request_before(struct blk_request* a, struct blk_request* b) {
+    if (a->dev != b->dev) return (uintptr_t)a->dev < (uintptr_t)b->dev;
+    if (a->write != b->write) return !a->write;
+    return a->lba < b->lba;
+}
+
+// Insertion sort; lists are at most a plug's worth
+static struct blk_request* sort_requests(struct blk_request* list) {
+    struct blk_request* sorted = NULL;
+    while (list) {
+        struct blk_request* req = list;
+        list = list->next;
+
+        struct blk_request** link = &sorted;
+        while (*link && !request_before(req, *link)) link = &(*link)->next;
+        req->next = *link;
+        *link = req;
+    }
+    return sorted;
+}
+
+static void dispatch_batch(struct block_device* dev, struct blk_request* batch) {
+    if (dev->submit) {
+        if (dev->submit(dev, batch)) return;
+        while (batch) {
+            struct blk_request* next = batch->next;
+            blk_complete(batch, false);
+            batch = next;
+        }
+        return;
+    }
+
+    // Nothing merges for these, so each request stands alone
+    while (batch) {
+        struct blk_request* next = batch->next;
+        bool success = batch->write ? dev->write(dev, batch->lba, batch->count, batch->buffer)
+                                    : dev->read(dev, batch->lba, batch->count, batch->buffer);
+        blk_complete(batch, success);
+        batch = next;
+    }
+}
+
+// Sort, merge neighbours, then give each device its share in one call
+static void dispatch(struct blk_request* list) {
+    list = sort_requests(list);
+
+    struct blk_request* heads = NULL;
+    struct blk_request** link = &heads;
+    struct blk_request* head = NULL;
+    struct blk_request* tail = NULL;
+    while (list) {
+        struct blk_request* req = list;
+        list = list->next;
+        req->next = NULL;
+
+        if (head && can_merge(head, tail, req)) {
+            tail->merged = req;
+            tail = req;
+            head->total += req->count;
+            continue;
+        }
+        *link = req;
+        link = &req->next;
+        head = tail = req;
+    }
+
+    while (heads) {
+        struct blk_request* end = heads;
+        while (end->next && end->next->dev == heads->dev) end = end->next;
+        struct blk_request* batch = heads;
+        heads = end->next;
+        end->next = NULL;
+        dispatch_batch(batch->dev, batch);
+    }
+}
+
+// Lock held; empties the queue
+static struct blk_request* take_queue(struct blk_queue* queue) {
+    struct blk_request* list = queue->head;
+    queue->head = queue->tail = NULL;
+    queue->depth = 0;
+    return list;
+}
+
+static void queue_request(struct blk_request* req, bool now) {
+    req->next = NULL;
+    req->merged = NULL;
+    req->driver_data = NULL;
+    req->total = req->count;
+
+    struct blk_queue* queue = &queues[smp_get_current_cpu()];
+    uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+    if (queue->tail) queue->tail->next = req;
+    else queue->head = req;
+    queue->tail = req;
+    queue->depth++;
+
+    struct blk_request* list = NULL;
+    if (now || !queue->plugs || queue->depth >= BLOCKDEV_PLUG_MAX) list = take_queue(queue);
+    spinlock_release_irqrestore(&queue->lock, flags);
+    if (list) dispatch(list);
+}
+
+void blk_submit(struct blk_request* req) {
+    queue_request(req, false);
+}
+
+uint32_t blk_plug(void) {
+    uint32_t cpu = smp_get_current_cpu();
+    uint64_t flags = spinlock_acquire_irqsave(&queues[cpu].lock);
+    queues[cpu].plugs++;
+    spinlock_release_irqrestore(&queues[cpu].lock, flags);
+    return cpu;
+}
+
+// The token names the CPU plugged, in case the caller has moved since
+void blk_unplug(uint32_t token) {
+    struct blk_queue* queue = &queues[token];
+    uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+    struct blk_request* list = NULL;
+    if (queue->plugs && --queue->plugs == 0) list = take_queue(queue);
+    spinlock_release_irqrestore(&queue->lock, flags);
+    if (list) dispatch(list);
+}
+
+void blk_poll(struct block_device* dev) {
+    if (dev && dev->poll) dev->poll(dev);
+}
+
+bool blk_flush(struct block_device* dev) {
+    if (!dev) return false;
+    return dev->flush ? dev->flush(dev) : true;
+}
+
+static void sync_done(struct blk_request* req, bool success) {
+    struct sync_io* io = req->private_data;
+    io->success = success;
+    __atomic_store_n(&io->done, true, __ATOMIC_RELEASE);
+    // io may be gone once done is seen; the wait queue is not
+    wait_queue_wake_all(&sync_wait);
+}
+
+bool blk_io(struct block_device* dev, uint64_t lba, uint32_t count, void* buffer, bool write) {
+    if (!dev || !buffer) return false;
+    if (!count) return true;
+
+    struct sync_io io = { false, false };
+    struct blk_request req = {
+        .dev = dev, .lba = lba, .count = count, .write = write,
+        .buffer = buffer, .done = sync_done, .private_data = &io,
+    };
+
+    // Sent at once with whatever is plugged here, as nothing else will
+    queue_request(&req, true);
+    wait_event(&sync_wait, (blk_poll(dev), __atomic_load_n(&io.done, __ATOMIC_ACQUIRE)));
+    return io.success;
+}
@@ -0,0 +1,70 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BLOCKDEV_SECTOR_SIZE 512    // Smallest logical block size
+#define BLOCKDEV_PLUG_MAX    32     // Requests a CPU queues before dispatching anyway
+
+struct block_device;
+struct blk_request;
+
+// Called once per request, possibly from an interrupt handler
+typedef void (*blk_done_t)(struct blk_request* req, bool success);
+
+// An asynchronous transfer. Adjacent requests reach the driver merged: the
+// head carries the others on its merged chain and total covers them all.
+struct blk_request {
+    struct block_device* dev;
+    uint64_t lba;
+    uint32_t count;             // Logical blocks
+    bool write;
+    void* buffer;
+    blk_done_t done;
+    void* private_data;         // The submitter's
+    void* driver_data;          // The driver's, while the request is with it
+    struct blk_request* next;   // Software queue, then the driver's batch
+    struct blk_request* merged; // Requests continuing this one on disk
+    uint32_t total;             // Blocks of this request and its merged chain
+};
+
+// A disk as the block cache sees it: transfers in logical blocks of
+// block_size bytes, however the device is formatted. Calls may come from
+// several CPUs at once.
+struct block_device {
+    const char* name;
+    uint32_t block_size;    // A power of two, at least BLOCKDEV_SECTOR_SIZE
+    uint64_t sectors;       // Logical blocks, 0 if the size is not known
+    bool (*read)(struct block_device* dev, uint64_t lba, uint32_t count, void* buffer);
+    bool (*write)(struct block_device* dev, uint64_t lba, uint32_t count, const void* buffer);
+    // Optional. Take a batch of requests linked by next, completing each
+    // with blk_complete(); false if none could be queued. Devices without
+    // it are served synchronously through read and write.
+    bool (*submit)(struct block_device* dev, struct blk_request* batch);
+    // Optional. Reap completions for drivers that may not interrupt.
+    void (*poll)(struct block_device* dev);
+    // Optional. Make completed writes durable; devices without it have
+    // nothing cached on their side.
+    bool (*flush)(struct block_device* dev);
+    uint32_t max_sectors;   // Merge limit; 0 never merges
+    void* private_data;
+};
+
+// Queue a request on this CPU; it is dispatched at once unless plugged
+void blk_submit(struct blk_request* req);
+// Hold this CPU's requests back to batch and merge them; pass the token to
+// blk_unplug(), which dispatches them once the last plug is gone
+uint32_t blk_plug(void);
+void blk_unplug(uint32_t token);
+// Reap completions of a polled device
+void blk_poll(struct block_device* dev);
+// Write back the device's own cache
+bool blk_flush(struct block_device* dev);
+// For drivers: finish a request and everything merged into it
+void blk_complete(struct blk_request* req, bool success);
+
+// Synchronous transfer through the request queues
+bool blk_io(struct block_device* dev, uint64_t lba, uint32_t count, void* buffer, bool write);
+
+#endif // BLOCKDEV_H
@@ -4,7 +4,10 @@
 #include <mm/vmm.h>
 #include <mm/heap.h>
 #include <utils/mem.h>
-#include <core/idt.h>
+#include <core/time.h>
+#include <core/timer.h>
+#include <core/drivers/irq.h>
+#include <utils/log.h>
 
 // Global NVMe devices array
 static nvme_device_t nvme_devices[NVME_MAX_DEVICES];
@@ -35,59 +38,543 @@ static uint32_t num_nvme_devices = 0;
 #define NVME_REG_SQ0TDT     0x1000  // Submission Queue 0 Tail Doorbell
 #define NVME_REG_CQ0HDT     0x1004  // Completion Queue 0 Head Doorbell
 
-// Allocate memory for NVMe queues
-static void* nvme_alloc_queue(size_t size) {
-    void* queue = pmm_alloc_page();
-    if (!queue) return NULL;
-    memset(queue, 0, PAGE_SIZE);
-    return queue;
+// Command slot states
+#define SLOT_FREE       0
+#define SLOT_PENDING    1   // Submitted, submitter waiting
+#define SLOT_DONE       2   // Completed, status not yet collected
+#define SLOT_ABANDONED  3   // Timed out; freed when it completes after all
+
+#define NVME_CAP_MQES(cap)   ((uint32_t)((cap) & 0xFFFF) + 1)
+#define NVME_CAP_DSTRD(cap)  ((uint32_t)((cap) >> 32) & 0xF)
+#define NVME_CAP_MPSMIN(cap) ((uint32_t)((cap) >> 48) & 0xF)
+#define NVME_CAP_TO(cap)     ((uint32_t)((cap) >> 24) & 0xFF)    // Ready timeout, 500 ms units
+#define NVME_READY_POLL_NS   1000000ULL
+#define NVME_FEAT_COALESCING 0x08
+#define NVME_FEAT_NUM_QUEUES 0x07
+#define NVME_NSID_LIST_MAX   1024    // Entries in an active namespace list page
+
+// Largest transfer a single PRP list page can describe
+#define NVME_PRP_MAX_BYTES   ((PAGE_SIZE / sizeof(uint64_t)) * PAGE_SIZE)
+
+// Doorbells for queue pair qid
+#define NVME_SQ_DOORBELL(device, qid) (0x1000 + (2 * (qid)) * (device)->doorbell_stride)
+#define NVME_CQ_DOORBELL(device, qid) (0x1000 + (2 * (qid) + 1) * (device)->doorbell_stride)
+
+// Physically contiguous, zeroed pages for a queue; returns the physical address
+static uint64_t nvme_alloc_queue(size_t size) {
+    size_t order = pmm_order_for_pages((size + PAGE_SIZE - 1) / PAGE_SIZE);
+    void* phys = pmm_alloc_pages(order);
+    if (phys) {
+        memset(pmm_phys_to_virt(phys), 0, PAGE_SIZE << order);
+    }
+    return (uint64_t)phys;
 }
 
-// Submit an NVMe command
-static nvme_result_t nvme_submit_command(nvme_device_t* device, nvme_sq_entry_t* cmd) {
-    nvme_queue_t* sq = &device->admin_sq;
-    nvme_queue_t* cq = &device->admin_cq;
-
-    // Copy command to submission queue
-    nvme_sq_entry_t* sq_entry = (nvme_sq_entry_t*)sq->sq_base + sq->sq_tail;
-    memcpy(sq_entry, cmd, sizeof(nvme_sq_entry_t));
-
-    // Update submission queue tail
-    sq->sq_tail = (sq->sq_tail + 1) % sq->queue_size;
-    NVME_WRITE_REG32(device, NVME_REG_SQ0TDT, sq->sq_tail);
-
-    // Wait for completion (simplistic approach)
-    uint64_t timeout = 100000;
-    while (timeout--) {
-        nvme_cq_entry_t* cq_entry = (nvme_cq_entry_t*)cq->cq_base + cq->cq_head;
-
-        // Check if command is complete
-        if (cq_entry->status != 0) {
-            // Check for successful completion
-            if ((cq_entry->status & 0x7F00) == 0) {
-                // Clear completion queue head
-                cq->cq_head = (cq->cq_head + 1) % cq->queue_size;
-                NVME_WRITE_REG32(device, NVME_REG_CQ0HDT, cq->cq_head);
-                return NVME_SUCCESS;
+static void nvme_free_queue(uint64_t phys, size_t size) {
+    if (phys) {
+        pmm_free_pages((void*)phys, pmm_order_for_pages((size + PAGE_SIZE - 1) / PAGE_SIZE));
+    }
+}
+
+// Allocate the memory of a queue pair; the controller is told separately
+static bool nvme_queue_alloc(nvme_queue_t* queue, uint16_t qid, uint16_t depth) {
+    memset(queue, 0, sizeof(nvme_queue_t));
+    queue->sq_phys = nvme_alloc_queue(depth * sizeof(nvme_sq_entry_t));
+    queue->cq_phys = nvme_alloc_queue(depth * sizeof(nvme_cq_entry_t));
+    queue->slots = malloc(depth * sizeof(nvme_command_slot_t));
+    queue->done_cids = malloc(depth * sizeof(uint16_t));
+    if (!queue->sq_phys || !queue->cq_phys || !queue->slots || !queue->done_cids) {
+        nvme_free_queue(queue->sq_phys, depth * sizeof(nvme_sq_entry_t));
+        nvme_free_queue(queue->cq_phys, depth * sizeof(nvme_cq_entry_t));
+        if (queue->slots) free(queue->slots);
+        if (queue->done_cids) free(queue->done_cids);
+        queue->slots = NULL;
+        queue->done_cids = NULL;
+        return false;
+    }
+    memset(queue->slots, 0, depth * sizeof(nvme_command_slot_t));
+
+    queue->sq = pmm_phys_to_virt((void*)queue->sq_phys);
+    queue->cq = pmm_phys_to_virt((void*)queue->cq_phys);
+    queue->qid = qid;
+    queue->depth = depth;
+    queue->phase = 1;
+    spinlock_init(&queue->lock);
+    wait_queue_init(&queue->wait);
+    return true;
+}
+
+static void nvme_queue_free(nvme_queue_t* queue) {
+    nvme_free_queue(queue->sq_phys, queue->depth * sizeof(nvme_sq_entry_t));
+    nvme_free_queue(queue->cq_phys, queue->depth * sizeof(nvme_cq_entry_t));
+    if (queue->slots) free(queue->slots);
+    if (queue->done_cids) free(queue->done_cids);
+    memset(queue, 0, sizeof(nvme_queue_t));
+}
+
+#if NVME_STATS
+// Bucket b holds [2^(b-1), 2^b) ns
+static inline uint32_t latency_bucket(uint64_t ns) {
+    uint32_t bucket = ns ? 64 - (uint32_t)__builtin_clzll(ns) : 0;
+    return bucket < NVME_STATS_BUCKETS ? bucket : NVME_STATS_BUCKETS - 1;
+}
+#endif
+
+// Lock held; start timing an I/O command just placed in the queue
+static void nvme_stats_submit(nvme_device_t* device, nvme_queue_t* queue,
+                              nvme_command_slot_t* slot, nvme_sq_entry_t* cmd) {
+    slot->stat_kind = NVME_STAT_NONE;
+#if NVME_STATS
+    // Admin opcodes overlap the I/O ones
+    uint8_t opcode = cmd->cdw0 & 0xFF;
+    if (!queue->qid) return;
+    if (opcode == NVME_CMD_READ) slot->stat_kind = NVME_STAT_READ;
+    else if (opcode == NVME_CMD_WRITE) slot->stat_kind = NVME_STAT_WRITE;
+    else if (opcode == NVME_CMD_FLUSH) slot->stat_kind = NVME_STAT_FLUSH;
+    else return;
+
+    slot->ns = nvme_get_namespace(device, cmd->nsid);
+    slot->bytes = slot->stat_kind == NVME_STAT_FLUSH || !slot->ns ? 0
+                : ((cmd->cdw12 & 0xFFFF) + 1) * slot->ns->block_size;
+    slot->submit_ns = ktime_get_ns();
+
+    nvme_io_stats_t* stats = &queue->stats;
+    if (++stats->inflight > stats->max_inflight) stats->max_inflight = stats->inflight;
+    nvme_io_stats_t* ns = slot->ns ? &slot->ns->stats : NULL;
+    if (ns) {
+        uint32_t inflight = __atomic_add_fetch(&ns->inflight, 1, __ATOMIC_RELAXED);
+        uint32_t max = __atomic_load_n(&ns->max_inflight, __ATOMIC_RELAXED);
+        while (inflight > max && !__atomic_compare_exchange_n(&ns->max_inflight, &max, inflight, true,
+                                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    }
+#else
+    (void)device; (void)queue; (void)cmd;
+#endif
+}
+
+// Lock held; *now is read from the clock once per reap
+static void nvme_stats_complete(nvme_queue_t* queue, nvme_command_slot_t* slot,
+                                uint16_t status, uint64_t* now) {
+#if NVME_STATS
+    if (slot->stat_kind == NVME_STAT_NONE) return;
+    uint32_t kind = slot->stat_kind;
+    slot->stat_kind = NVME_STAT_NONE;
+    if (!*now) *now = ktime_get_ns();
+    uint32_t bucket = latency_bucket(*now - slot->submit_ns);
+    bool failed = (status & 0x7FF) != 0;
+
+    nvme_io_stats_t* stats = &queue->stats;
+    stats->inflight--;
+    stats->ops[kind]++;
+    stats->bytes[kind] += slot->bytes;
+    stats->hist[kind][bucket]++;
+    if (failed) stats->errors++;
+
+    nvme_io_stats_t* ns = slot->ns ? &slot->ns->stats : NULL;
+    if (ns) {
+        __atomic_sub_fetch(&ns->inflight, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ns->ops[kind], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ns->bytes[kind], slot->bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ns->hist[kind][bucket], 1, __ATOMIC_RELAXED);
+        if (failed) __atomic_add_fetch(&ns->errors, 1, __ATOMIC_RELAXED);
+    }
+#else
+    (void)queue; (void)slot; (void)status; (void)now;
+#endif
+}
+
+// Lock held; requests that rode along in one command
+static void nvme_stats_merged(nvme_queue_t* queue, nvme_namespace_t* ns, uint32_t merges) {
+#if NVME_STATS
+    if (!merges) return;
+    queue->stats.merges += merges;
+    __atomic_add_fetch(&ns->stats.merges, merges, __ATOMIC_RELAXED);
+#else
+    (void)queue; (void)ns; (void)merges;
+#endif
+}
+
+// Consume every new completion entry; lock held. True if any arrived, in
+// which case the caller wakes the queue's sleepers once the lock is dropped.
+static bool nvme_queue_reap(nvme_device_t* device, nvme_queue_t* queue) {
+    bool reaped = false;
+    uint64_t now = 0;
+    for (;;) {
+        nvme_cq_entry_t* cq_entry = &queue->cq[queue->cq_head];
+        uint16_t status = __atomic_load_n(&cq_entry->status, __ATOMIC_ACQUIRE);
+        if ((status & 1) != queue->phase) break;
+
+        queue->sq_head = cq_entry->sq_head;
+        uint16_t cid = cq_entry->command_id;
+        if (cid < queue->depth) {
+            nvme_command_slot_t* slot = &queue->slots[cid];
+            if (slot->state == SLOT_PENDING || slot->state == SLOT_ABANDONED) {
+                nvme_stats_complete(queue, slot, status >> 1, &now);
             }
-            return NVME_ERR_IO;
+            if (slot->state == SLOT_PENDING) {
+                slot->status = status >> 1;
+                slot->result = cq_entry->result;
+                if (slot->callback) queue->done_cids[queue->done_count++] = cid;
+                __atomic_store_n(&slot->state, SLOT_DONE, __ATOMIC_RELEASE);
+            } else if (slot->state == SLOT_ABANDONED) {
+                slot->state = SLOT_FREE;
+            }
+        }
+
+        // The phase tag flips on each pass over the ring
+        if (++queue->cq_head == queue->depth) {
+            queue->cq_head = 0;
+            queue->phase ^= 1;
+        }
+        reaped = true;
+    }
+    if (reaped) {
+        NVME_WRITE_REG32(device, NVME_CQ_DOORBELL(device, queue->qid), queue->cq_head);
+    }
+    return reaped;
+}
+
+// Run the callbacks of completed asynchronous commands, with the lock
+// dropped so they may submit more
+static void nvme_queue_run_callbacks(nvme_queue_t* queue) {
+    while (__atomic_load_n(&queue->done_count, __ATOMIC_ACQUIRE)) {
+        uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+        if (!queue->done_count) {
+            spinlock_release_irqrestore(&queue->lock, flags);
+            return;
+        }
+        nvme_command_slot_t* slot = &queue->slots[queue->done_cids[--queue->done_count]];
+        nvme_callback_t callback = slot->callback;
+        void* ctx = slot->ctx;
+        uint16_t status = slot->status;
+        slot->callback = NULL;
+        slot->state = SLOT_FREE;
+        spinlock_release_irqrestore(&queue->lock, flags);
+        callback(ctx, status);
+    }
+}
+
+// Reap, wake waiters and run callbacks; true if anything completed
+static bool nvme_queue_service(nvme_device_t* device, nvme_queue_t* queue) {
+    uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+    bool reaped = nvme_queue_reap(device, queue);
+    spinlock_release_irqrestore(&queue->lock, flags);
+    if (reaped) {
+        if (queue->vector) wait_queue_wake_all(&queue->wait);
+        nvme_queue_run_callbacks(queue);
+    }
+    return reaped;
+}
+
+// Completion wait condition; reaps too, so a missed interrupt or interrupts
+// still being off during boot cannot strand a submitter
+static bool nvme_slot_done(nvme_device_t* device, nvme_queue_t* queue, nvme_command_slot_t* slot) {
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == SLOT_DONE) return true;
+    nvme_queue_service(device, queue);
+    return __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == SLOT_DONE;
+}
+
+static void nvme_interrupt_handler(void* data) {
+    nvme_queue_t* queue = data;
+    nvme_queue_service(queue->device, queue);
+}
+
+// Free command ID with room in the submission queue, or -1; lock held
+static int nvme_queue_reserve(nvme_queue_t* queue) {
+    if ((uint16_t)((queue->sq_tail + 1) % queue->depth) == queue->sq_head) return -1;
+    for (uint16_t i = 0; i < queue->depth; i++) {
+        uint16_t cid = (queue->next_cid + i) % queue->depth;
+        if (queue->slots[cid].state == SLOT_FREE) {
+            queue->next_cid = (cid + 1) % queue->depth;
+            return cid;
+        }
+    }
+    return -1;
+}
+
+// Submit a command to a queue pair and wait for its completion. Other
+// submitters may have commands of their own in flight on the same pair.
+static nvme_result_t nvme_queue_submit(nvme_device_t* device, nvme_queue_t* queue,
+                                       nvme_sq_entry_t* cmd, uint32_t* result) {
+    uint64_t deadline = ktime_get_ns() + (uint64_t)NVME_TIMEOUT_MS * 1000000;
+
+    // Wait for a free slot; completions are reaped by whoever holds the lock
+    uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+    int cid;
+    while ((cid = nvme_queue_reserve(queue)) < 0) {
+        nvme_queue_reap(device, queue);
+        if ((cid = nvme_queue_reserve(queue)) >= 0) break;
+        spinlock_release_irqrestore(&queue->lock, flags);
+        if (ktime_get_ns() > deadline) return NVME_ERR_QUEUE_FULL;
+        __asm__ volatile("pause");
+        flags = spinlock_acquire_irqsave(&queue->lock);
+    }
+
+    nvme_command_slot_t* slot = &queue->slots[cid];
+    slot->state = SLOT_PENDING;
+    cmd->cdw0 = (cmd->cdw0 & 0xFFFF) | ((uint32_t)cid << 16);
+    memcpy(&queue->sq[queue->sq_tail], cmd, sizeof(nvme_sq_entry_t));
+    queue->sq_tail = (queue->sq_tail + 1) % queue->depth;
+    nvme_stats_submit(device, queue, slot, cmd);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    NVME_WRITE_REG32(device, NVME_SQ_DOORBELL(device, queue->qid), queue->sq_tail);
+    spinlock_release_irqrestore(&queue->lock, flags);
+
+    nvme_completion_mode_t mode = queue->vector ? device->completion_mode : NVME_COMPLETION_POLL;
+    if (mode == NVME_COMPLETION_HYBRID) {
+        // Most fast completions land within the spin
+        uint64_t spin_until = ktime_get_ns() + NVME_HYBRID_POLL_NS;
+        while (!nvme_slot_done(device, queue, slot) && ktime_get_ns() < spin_until) {
+            __asm__ volatile("pause");
+        }
+    }
+
+    bool done;
+    if (mode == NVME_COMPLETION_POLL) {
+        while (!(done = nvme_slot_done(device, queue, slot)) && ktime_get_ns() <= deadline) {
+            __asm__ volatile("pause");
         }
+    } else {
+        done = wait_event_deadline(&queue->wait, nvme_slot_done(device, queue, slot), deadline);
     }
+    if (!done) {
+        flags = spinlock_acquire_irqsave(&queue->lock);
+        if (slot->state != SLOT_DONE) {
+            slot->state = SLOT_ABANDONED;
+            spinlock_release_irqrestore(&queue->lock, flags);
+            return NVME_ERR_TIMEOUT;
+        }
+        spinlock_release_irqrestore(&queue->lock, flags);
+    }
+
+    flags = spinlock_acquire_irqsave(&queue->lock);
+    uint16_t status = slot->status;
+    if (result) *result = slot->result;
+    slot->state = SLOT_FREE;
+    spinlock_release_irqrestore(&queue->lock, flags);
+
+    // Status code and type; the retry and more bits do not mean failure
+    return (status & 0x7FF) ? NVME_ERR_IO : NVME_SUCCESS;
+}
+
+// Place a command with a completion callback in the queue without ringing
+// the doorbell; the caller rings once for the whole batch. Lock held on
+// entry and exit. While the queue is full, what is queued so far is rung
+// and reaped with the lock dropped.
+static bool nvme_queue_push(nvme_device_t* device, nvme_queue_t* queue, nvme_sq_entry_t* cmd,
+                            nvme_callback_t callback, void* ctx, uint64_t* flags) {
+    uint64_t deadline = ktime_get_ns() + (uint64_t)NVME_TIMEOUT_MS * 1000000;
+    int cid;
+    while ((cid = nvme_queue_reserve(queue)) < 0) {
+        NVME_WRITE_REG32(device, NVME_SQ_DOORBELL(device, queue->qid), queue->sq_tail);
+        nvme_queue_reap(device, queue);
+        if ((cid = nvme_queue_reserve(queue)) >= 0) break;
+        spinlock_release_irqrestore(&queue->lock, *flags);
+        nvme_queue_run_callbacks(queue);
+        bool expired = ktime_get_ns() > deadline;
+        if (!expired) __asm__ volatile("pause");
+        *flags = spinlock_acquire_irqsave(&queue->lock);
+        if (expired) return false;
+    }
+
+    nvme_command_slot_t* slot = &queue->slots[cid];
+    slot->state = SLOT_PENDING;
+    slot->callback = callback;
+    slot->ctx = ctx;
+    cmd->cdw0 = (cmd->cdw0 & 0xFFFF) | ((uint32_t)cid << 16);
+    memcpy(&queue->sq[queue->sq_tail], cmd, sizeof(nvme_sq_entry_t));
+    queue->sq_tail = (queue->sq_tail + 1) % queue->depth;
+    nvme_stats_submit(device, queue, slot, cmd);
+    return true;
+}
+
+// Submit an NVMe admin command
+static nvme_result_t nvme_submit_command(nvme_device_t* device, nvme_sq_entry_t* cmd) {
+    return nvme_queue_submit(device, &device->admin_queue, cmd, NULL);
+}
+
+// Enable MSI-X with every entry masked; entries are unmasked as queue pairs
+// take them. Without it the device polls.
+static void nvme_msix_init(nvme_device_t* device) {
+    device->msix_table = pci_msix_enable(device->pci_dev, &device->msix_entries);
+}
+
+// Point MSI-X entry qid at the CPU the pair belongs to, masked until the
+// pair exists; false if out of entries or vectors, and the pair is polled
+// instead. The balancer may move it if that CPU takes too many.
+static bool nvme_msix_route(nvme_device_t* device, nvme_queue_t* queue) {
+    if (!device->msix_table) return false;
 
-    return NVME_ERR_TIMEOUT;
+    queue->device = device;
+    queue->vector = irq_setup_msix(device->pci_dev, device->msix_table, queue->qid, "nvme",
+                                   nvme_interrupt_handler, queue, queue->qid - 1u,
+                                   IRQ_BALANCE | IRQ_MASKED);
+    return queue->vector != 0;
 }
 
+// Create queue pair qid on the controller and publish it for I/O
+static bool nvme_create_io_queue(nvme_device_t* device, uint16_t qid) {
+    uint32_t cap_depth = NVME_CAP_MQES(device->capabilities);
+    uint16_t depth = cap_depth < NVME_QUEUE_DEPTH ? (uint16_t)cap_depth : NVME_QUEUE_DEPTH;
+    nvme_queue_t* queue = &device->io_queues[qid - 1];
+    if (!nvme_queue_alloc(queue, qid, depth)) return false;
+    bool interrupts = nvme_msix_route(device, queue);
+
+    // Completion queue first: physically contiguous, interrupting through
+    // MSI-X entry qid when it has one
+    nvme_sq_entry_t cmd = {0};
+    cmd.cdw0 = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = queue->cq_phys;
+    cmd.cdw10 = ((uint32_t)(depth - 1) << 16) | qid;
+    cmd.cdw11 = interrupts ? ((uint32_t)qid << 16) | (1 << 1) | 1 : 1;
+    if (nvme_submit_command(device, &cmd) != NVME_SUCCESS) {
+        if (interrupts) irq_free(queue->vector);
+        nvme_queue_free(queue);
+        return false;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = queue->sq_phys;
+    cmd.cdw10 = ((uint32_t)(depth - 1) << 16) | qid;
+    cmd.cdw11 = ((uint32_t)qid << 16) | 1;
+    if (nvme_submit_command(device, &cmd) != NVME_SUCCESS) {
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.cdw0 = NVME_ADMIN_DELETE_CQ;
+        cmd.cdw10 = qid;
+        nvme_submit_command(device, &cmd);
+        if (interrupts) irq_free(queue->vector);
+        nvme_queue_free(queue);
+        return false;
+    }
+
+    if (interrupts) irq_unmask(queue->vector);
+    queue->initialized = true;
+    __atomic_store_n(&device->num_io_queues, qid, __ATOMIC_RELEASE);
+    return true;
+}
+
+// The calling CPU's queue pair, NULL if none could be created
+static nvme_queue_t* nvme_io_queue(nvme_device_t* device) {
+    uint32_t count = __atomic_load_n(&device->num_io_queues, __ATOMIC_ACQUIRE);
+    if (!count) return NULL;
+    return &device->io_queues[smp_get_current_cpu() % count];
+}
+
+static const struct pci_device_id nvme_ids[] = {
+    PCI_DEVICE_CLASS(PCI_CLASS_STORAGE, 0x08),      // Non-volatile memory controller
+    { 0 }
+};
+
+static bool nvme_pci_probe(struct pci_device* dev, const struct pci_device_id* id) {
+    (void)id;
+    return nvme_probe_device(dev) == NVME_SUCCESS;
+}
+
+static struct pci_driver nvme_driver = { "nvme", nvme_ids, nvme_pci_probe };
+
 // Initialize NVMe subsystem
 nvme_result_t nvme_init(void) {
-    struct pci_device* dev;
-    while ((dev = pci_scan_for_class(PCI_CLASS_STORAGE, 0x08)) != NULL) {
-        nvme_result_t result = nvme_probe_device(dev);
-        if (result != NVME_SUCCESS) {
+    pci_register_driver(&nvme_driver);
+    return num_nvme_devices > 0 ? NVME_SUCCESS : NVME_ERR_NOT_FOUND;
+}
+
+// Issue Identify into a scratch page and copy the first size bytes out
+static nvme_result_t nvme_identify(nvme_device_t* device, uint32_t cns, uint32_t nsid,
+                                   void* data, size_t size) {
+    void* page = pmm_alloc_page();
+    if (!page) {
+        return NVME_ERR_INITIALIZATION;
+    }
+
+    nvme_sq_entry_t cmd = {0};
+    cmd.cdw0 = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = (uint64_t)page;  // Use physical address directly
+    cmd.cdw10 = cns;
+    nvme_result_t result = nvme_submit_command(device, &cmd);
+    if (result == NVME_SUCCESS) {
+        memcpy(data, pmm_phys_to_virt(page), size);
+    }
+
+    // A timed out command may still write the page; leave it be
+    if (result != NVME_ERR_TIMEOUT) pmm_free_page(page);
+    return result;
+}
+
+nvme_result_t nvme_identify_controller(nvme_device_t* device, nvme_controller_info_t* info) {
+    return nvme_identify(device, NVME_IDENTIFY_CONTROLLER, 0, info, sizeof(nvme_controller_info_t));
+}
+
+nvme_result_t nvme_identify_namespace(nvme_device_t* device, uint32_t nsid,
+                                      nvme_namespace_info_t* info) {
+    return nvme_identify(device, NVME_IDENTIFY_NAMESPACE, nsid, info, sizeof(nvme_namespace_info_t));
+}
+
+// Record the active namespaces the driver can address: a power-of-two
+// block size and no metadata interleaved with the data
+static void nvme_discover_namespaces(nvme_device_t* device) {
+    uint32_t* nsids = malloc(NVME_NSID_LIST_MAX * sizeof(uint32_t));
+    nvme_namespace_info_t* info = malloc(sizeof(nvme_namespace_info_t));
+    if (!nsids || !info) {
+        if (nsids) free(nsids);
+        if (info) free(info);
+        return;
+    }
+
+    // The active list came with NVMe 1.1; before it every NSID up to NN is tried
+    uint32_t count = 0;
+    if (device->controller_info.version >= 0x10100 &&
+        nvme_identify(device, NVME_IDENTIFY_ACTIVE_NSIDS, 0, nsids,
+                      NVME_NSID_LIST_MAX * sizeof(uint32_t)) == NVME_SUCCESS) {
+        while (count < NVME_NSID_LIST_MAX && nsids[count]) count++;
+    } else {
+        uint32_t nn = device->controller_info.nn;
+        while (count < nn && count < NVME_MAX_NAMESPACES) {
+            nsids[count] = count + 1;
+            count++;
+        }
+    }
+
+    for (uint32_t i = 0; i < count && device->num_namespaces < NVME_MAX_NAMESPACES; i++) {
+        if (nvme_identify_namespace(device, nsids[i], info) != NVME_SUCCESS || !info->nsize) {
+            continue;
+        }
+
+        uint8_t format = info->flbas & 0xF;
+        uint32_t shift = (info->lbaf[format] >> 16) & 0xFF;
+        uint16_t metadata = (uint16_t)(info->lbaf[format] & 0xFFFF);
+        uint32_t max_blocks = shift < 32 ? device->max_data_transfer >> shift : 0;
+        if (shift < 9 || !max_blocks || ((info->flbas & 0x10) && metadata)) {
+            log_error("nvme: namespace %d has an unsupported LBA format", (int)nsids[i]);
             continue;
         }
+
+        nvme_namespace_t* ns = &device->namespaces[device->num_namespaces++];
+        ns->device = device;
+        ns->nsid = nsids[i];
+        ns->blocks = info->nsize;
+        ns->block_size = 1U << shift;
+        ns->metadata_size = metadata;
+        ns->lba_format = format;
+        ns->max_blocks = max_blocks;
+        log_info("nvme: namespace %d, %d MiB in %d-byte blocks", (int)ns->nsid,
+                 (int)((ns->blocks << shift) >> 20), (int)ns->block_size);
     }
+    free(nsids);
+    free(info);
+}
 
-    return num_nvme_devices > 0 ? NVME_SUCCESS : NVME_ERR_NOT_FOUND;
+// Until CSTS.RDY reads ready, sleeping between reads; false once CAP.TO
+// runs out
+static bool nvme_wait_ready(nvme_device_t* device, bool ready) {
+    uint32_t units = NVME_CAP_TO(device->capabilities);
+    uint64_t deadline = ktime_get_ns() + (uint64_t)(units ? units : 1) * 500000000ULL;
+    while (((NVME_READ_REG32(device, NVME_REG_CSTS) & 0x1) != 0) != ready) {
+        if (ktime_get_ns() >= deadline) return false;
+        timer_sleep_ns(NVME_READY_POLL_NS);
+    }
+    return true;
 }
 
 // Probe and initialize a single NVMe device
@@ -120,88 +607,87 @@ nvme_result_t nvme_probe_device(struct pci_device* pci_dev) {
    // Map MMIO space
    device->mmio_base = (volatile void*)vmm_get_phys_addr(mmio_base);
 
+   // Queue depth limit, doorbell spacing and how long CSTS.RDY may take
+   device->capabilities = NVME_READ_REG64(device, NVME_REG_CAP);
+
    // Reset the controller
    NVME_WRITE_REG32(device, NVME_REG_CC, 0);
 
    // Wait for controller to become disabled
-   uint64_t timeout = 100000;
-   while ((NVME_READ_REG32(device, NVME_REG_CSTS) & 0x1) && timeout--) {
-       for (int i = 0; i < 1000; i++) {
-           __asm__ volatile("pause");
-       }
+   if (!nvme_wait_ready(device, false)) {
+       return NVME_ERR_TIMEOUT;
    }
 
-   // Allocate admin submission queue
-   device->admin_sq.sq_base = nvme_alloc_queue(PAGE_SIZE);
-   if (!device->admin_sq.sq_base) {
-       return NVME_ERR_INITIALIZATION;
-   }
+   device->doorbell_stride = 4U << NVME_CAP_DSTRD(device->capabilities);
+   uint32_t admin_depth = NVME_CAP_MQES(device->capabilities);
+   if (admin_depth > NVME_ADMIN_DEPTH) admin_depth = NVME_ADMIN_DEPTH;
 
-   // Allocate admin completion queue
-   device->admin_cq.cq_base = nvme_alloc_queue(PAGE_SIZE);
-   if (!device->admin_cq.cq_base) {
+   // Allocate the admin queue pair
+   if (!nvme_queue_alloc(&device->admin_queue, 0, (uint16_t)admin_depth)) {
        return NVME_ERR_INITIALIZATION;
    }
 
-   // Allocate page-aligned physical buffer for controller identify data
-   void* identify_buffer = pmm_alloc_page();
-   if (!identify_buffer) {
-       return NVME_ERR_INITIALIZATION;
-   }
-
-   // Configure queue parameters
-   device->admin_sq.queue_size = NVME_QUEUE_DEPTH;
-   device->admin_cq.queue_size = NVME_QUEUE_DEPTH;
-
    // Set queue base addresses
-   NVME_WRITE_REG64(device, NVME_REG_ASQ, (uint64_t)device->admin_sq.sq_base);
-   NVME_WRITE_REG64(device, NVME_REG_ACQ, (uint64_t)device->admin_cq.cq_base);
+   NVME_WRITE_REG64(device, NVME_REG_ASQ, device->admin_queue.sq_phys);
+   NVME_WRITE_REG64(device, NVME_REG_ACQ, device->admin_queue.cq_phys);
 
    // Set queue attributes
-   uint32_t aqa = ((device->admin_sq.queue_size - 1) << 16) |
-                  (device->admin_cq.queue_size - 1);
+   uint32_t aqa = ((admin_depth - 1) << 16) | (admin_depth - 1);
    NVME_WRITE_REG32(device, NVME_REG_AQA, aqa);
 
    // Enable controller
-   uint32_t cc = (3 << 14) |   // CSS: NVMe command set
+   uint32_t cc = (4 << 20) |   // IOCQES: 16-byte completion entries
+                 (6 << 16) |   // IOSQES: 64-byte submission entries
                  (0 << 11) |   // AMS: Round Robin
-                 (6 << 7)  |   // MPS: Page Size
+                 (0 << 7)  |   // MPS: 4KiB pages
                  (0 << 4)  |   // CSS: NVMe command set
                  (1 << 0);     // Enable
    NVME_WRITE_REG32(device, NVME_REG_CC, cc);
 
    // Wait for controller to become ready
-   timeout = 100000;
-   while (!(NVME_READ_REG32(device, NVME_REG_CSTS) & 0x1) && timeout--) {
-       for (int i = 0; i < 1000; i++) {
-           __asm__ volatile("pause");
-       }
+   if (!nvme_wait_ready(device, true)) {
+       nvme_queue_free(&device->admin_queue);
+       return NVME_ERR_TIMEOUT;
    }
 
-   // Check if controller initialization timed out
-   if (timeout == 0) {
-       pmm_free_page(identify_buffer);
-       return NVME_ERR_TIMEOUT;
+   // Identify the controller
+   if (nvme_identify_controller(device, &device->controller_info) != NVME_SUCCESS) {
+       nvme_queue_free(&device->admin_queue);
+       return NVME_ERR_INITIALIZATION;
    }
+   device->volatile_write_cache = device->controller_info.vwc & 1;
 
-   // Prepare Identify command
-   nvme_sq_entry_t identify_cmd = {0};
-   identify_cmd.cdw0 = (NVME_ADMIN_IDENTIFY << 16);
-   identify_cmd.dptr = (uint64_t)identify_buffer;  // Use physical address directly
-   identify_cmd.cdw10 = NVME_IDENTIFY_CONTROLLER;
+   // MDTS is a power of two in units of the minimum page size, 0 for no limit
+   device->page_size = PAGE_SIZE;
+   device->max_data_transfer = NVME_PRP_MAX_BYTES;
+   if (device->controller_info.mdts) {
+       uint64_t mdts = (uint64_t)PAGE_SIZE << NVME_CAP_MPSMIN(device->capabilities)
+                       << device->controller_info.mdts;
+       if (mdts < device->max_data_transfer) device->max_data_transfer = (uint32_t)mdts;
+   }
+   nvme_discover_namespaces(device);
 
-   // Submit Identify command
-   nvme_result_t result = nvme_submit_command(device, &identify_cmd);
-   if (result != NVME_SUCCESS) {
-       pmm_free_page(identify_buffer);
+   // Ask for a queue pair per possible CPU; counts are 0-based both ways
+   nvme_sq_entry_t features_cmd = {0};
+   features_cmd.cdw0 = NVME_ADMIN_SET_FEATURES;
+   features_cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+   features_cmd.cdw11 = ((NVME_MAX_QUEUES - 1) << 16) | (NVME_MAX_QUEUES - 1);
+   uint32_t granted = 0;
+   if (nvme_queue_submit(device, &device->admin_queue, &features_cmd, &granted) != NVME_SUCCESS) {
+       nvme_queue_free(&device->admin_queue);
        return NVME_ERR_INITIALIZATION;
    }
+   uint32_t sqs = (granted & 0xFFFF) + 1;
+   uint32_t cqs = (granted >> 16) + 1;
+   device->max_io_queues = sqs < cqs ? sqs : cqs;
+   if (device->max_io_queues > NVME_MAX_QUEUES) device->max_io_queues = NVME_MAX_QUEUES;
 
-   // Copy identify data to controller_info
-   memcpy(&device->controller_info, identify_buffer, sizeof(nvme_controller_info_t));
-
-   // Free the temporary buffer
-   pmm_free_page(identify_buffer);
+   // One pair for boot-time I/O; the rest follow in nvme_init_cpu_queues()
+   nvme_msix_init(device);
+   if (!nvme_create_io_queue(device, 1)) {
+       nvme_queue_free(&device->admin_queue);
+       return NVME_ERR_INITIALIZATION;
+   }
 
    // Mark device as initialized
    device->initialized = true;
@@ -210,43 +696,397 @@ nvme_result_t nvme_probe_device(struct pci_device* pci_dev) {
    return NVME_SUCCESS;
 }
 
-// Read from NVMe Namespace
-nvme_result_t nvme_read(nvme_device_t* device, uint32_t nsid,
-                        uint64_t lba, uint32_t blocks, void* buffer) {
-    if (!device || !device->initialized || !buffer) {
+// Fill in the data pointer for len bytes at buffer: PRP1 for the first
+// page, PRP2 for the second or a list of the rest. *list is the list page
+// to free once the command is done, if one was needed.
+static nvme_result_t nvme_build_prps(nvme_sq_entry_t* cmd, uint64_t buffer, uint32_t len, void** list) {
+    *list = NULL;
+    uint64_t phys = vmm_get_phys_addr(buffer);
+    if (!phys || (buffer & 3)) {
+        return NVME_ERR_INVALID_PARAM;
+    }
+    cmd->prp1 = phys;
+
+    // Pages after the first start on page boundaries
+    uint32_t first = PAGE_SIZE - (uint32_t)(buffer & (PAGE_SIZE - 1));
+    if (len <= first) return NVME_SUCCESS;
+    uint32_t pages = (len - first + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t next = buffer + first;
+
+    if (pages == 1) {
+        cmd->prp2 = vmm_get_phys_addr(next);
+        return cmd->prp2 ? NVME_SUCCESS : NVME_ERR_INVALID_PARAM;
+    }
+
+    // One list page; nvme_rw() splits transfers that would need more
+    *list = pmm_alloc_page();
+    if (!*list) {
+        return NVME_ERR_INITIALIZATION;
+    }
+    uint64_t* entries = pmm_phys_to_virt(*list);
+    for (uint32_t i = 0; i < pages; i++) {
+        entries[i] = vmm_get_phys_addr(next + (uint64_t)i * PAGE_SIZE);
+        if (!entries[i]) {
+            pmm_free_page(*list);
+            *list = NULL;
+            return NVME_ERR_INVALID_PARAM;
+        }
+    }
+    cmd->prp2 = (uint64_t)*list;
+    return NVME_SUCCESS;
+}
+
+// Read or write, in as few commands as MDTS and a one-page PRP list allow.
+// Each page is translated on its own, so the buffer need not be physically
+// contiguous.
+static nvme_result_t nvme_rw(nvme_device_t* device, uint8_t opcode, uint32_t nsid,
+                             uint64_t lba, uint32_t blocks, uint64_t buffer) {
+    if (!device || !device->initialized || !buffer || !blocks) {
         return NVME_ERR_INVALID_PARAM;
     }
 
-    nvme_sq_entry_t read_cmd = {0};
-    read_cmd.cdw0 = (NVME_CMD_READ << 16);
-    read_cmd.nsid = nsid;
-    read_cmd.dptr = (uint64_t)buffer;
-    read_cmd.cdw10 = (uint32_t)lba;
-    read_cmd.cdw11 = (uint32_t)(lba >> 32);
-    read_cmd.cdw12 = blocks - 1;
+    nvme_namespace_t* ns = nvme_get_namespace(device, nsid);
+    if (!ns) {
+        return NVME_ERR_INVALID_PARAM;
+    }
+
+    nvme_queue_t* queue = nvme_io_queue(device);
+    if (!queue) {
+        return NVME_ERR_INITIALIZATION;
+    }
+
+    uint32_t max_blocks = ns->max_blocks;
+    while (blocks) {
+        uint32_t count = blocks < max_blocks ? blocks : max_blocks;
+
+        nvme_sq_entry_t cmd = {0};
+        cmd.cdw0 = opcode;
+        cmd.nsid = nsid;
+        cmd.cdw10 = (uint32_t)lba;
+        cmd.cdw11 = (uint32_t)(lba >> 32);
+        cmd.cdw12 = count - 1;
+
+        void* list;
+        nvme_result_t result = nvme_build_prps(&cmd, buffer, count * ns->block_size, &list);
+        if (result != NVME_SUCCESS) {
+            return result;
+        }
+        result = nvme_queue_submit(device, queue, &cmd, NULL);
+
+        // A timed out command may still read its list; leave it be
+        if (list && result != NVME_ERR_TIMEOUT) pmm_free_page(list);
+        if (result != NVME_SUCCESS) {
+            return result;
+        }
 
-    return nvme_submit_command(device, &read_cmd);
+        lba += count;
+        blocks -= count;
+        buffer += (uint64_t)count * ns->block_size;
+    }
+    return NVME_SUCCESS;
+}
+
+// Read from NVMe Namespace
+nvme_result_t nvme_read(nvme_device_t* device, uint32_t nsid,
+                        uint64_t lba, uint32_t blocks, void* buffer) {
+    return nvme_rw(device, NVME_CMD_READ, nsid, lba, blocks, (uint64_t)buffer);
 }
 
 // Write to NVMe Namespace
 nvme_result_t nvme_write(nvme_device_t* device, uint32_t nsid,
                          uint64_t lba, uint32_t blocks, const void* buffer) {
-    if (!device || !device->initialized || !buffer) {
+    return nvme_rw(device, NVME_CMD_WRITE, nsid, lba, blocks, (uint64_t)buffer);
+}
+
+// Flush the namespace's volatile write cache, if it has one
+nvme_result_t nvme_flush(nvme_device_t* device, uint32_t nsid) {
+    if (!device || !device->initialized) {
         return NVME_ERR_INVALID_PARAM;
     }
 
-    nvme_sq_entry_t write_cmd = {0};
-    write_cmd.cdw0 = (NVME_CMD_WRITE << 16);
-    write_cmd.nsid = nsid;
-    write_cmd.dptr = (uint64_t)buffer;
-    write_cmd.cdw10 = (uint32_t)lba;
-    write_cmd.cdw11 = (uint32_t)(lba >> 32);
-    write_cmd.cdw12 = blocks - 1;
+    nvme_queue_t* queue = nvme_io_queue(device);
+    if (!queue) {
+        return NVME_ERR_INITIALIZATION;
+    }
+
+    nvme_sq_entry_t cmd = {0};
+    cmd.cdw0 = NVME_CMD_FLUSH;
+    cmd.nsid = nsid;
+    return nvme_queue_submit(device, queue, &cmd, NULL);
+}
+
+// Create I/O queue pairs up to one per online CPU, as far as the
+// controller allows
+void nvme_init_cpu_queues(void) {
+    uint32_t cpus = smp_get_cpu_count();
+    for (uint32_t i = 0; i < num_nvme_devices; i++) {
+        nvme_device_t* device = &nvme_devices[i];
+        uint32_t wanted = cpus < device->max_io_queues ? cpus : device->max_io_queues;
+        while (device->num_io_queues < wanted) {
+            if (!nvme_create_io_queue(device, (uint16_t)(device->num_io_queues + 1))) break;
+        }
+    }
+}
 
-    return nvme_submit_command(device, &write_cmd);
+void nvme_set_completion_mode(nvme_device_t* device, nvme_completion_mode_t mode) {
+    if (device) device->completion_mode = mode;
+}
+
+nvme_result_t nvme_set_coalescing(nvme_device_t* device, uint8_t threshold, uint8_t time_100us) {
+    if (!device || !device->initialized) {
+        return NVME_ERR_INVALID_PARAM;
+    }
+
+    // The threshold field is 0-based
+    nvme_sq_entry_t cmd = {0};
+    cmd.cdw0 = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_COALESCING;
+    cmd.cdw11 = ((uint32_t)time_100us << 8) | (uint8_t)(threshold ? threshold - 1 : 0);
+    return nvme_submit_command(device, &cmd);
 }
 
 // Get NVMe Device by Index
 nvme_device_t* nvme_get_device(uint32_t index) {
     return (index < num_nvme_devices) ? &nvme_devices[index] : NULL;
-}
\ No newline at end of file
+}
+
+nvme_namespace_t* nvme_get_namespace(nvme_device_t* device, uint32_t nsid) {
+    if (!device) return NULL;
+    for (uint32_t i = 0; i < device->num_namespaces; i++) {
+        if (device->namespaces[i].nsid == nsid) return &device->namespaces[i];
+    }
+    return NULL;
+}
+
+// A block device is one namespace, in its own block size
+static bool nvme_block_read(struct block_device* dev, uint64_t lba, uint32_t count, void* buffer) {
+    nvme_namespace_t* ns = dev->private_data;
+    return nvme_read(ns->device, ns->nsid, lba, count, buffer) == NVME_SUCCESS;
+}
+
+static bool nvme_block_write(struct block_device* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    nvme_namespace_t* ns = dev->private_data;
+    return nvme_write(ns->device, ns->nsid, lba, count, buffer) == NVME_SUCCESS;
+}
+
+// Only needed when the controller caches writes
+static bool nvme_block_flush(struct block_device* dev) {
+    nvme_namespace_t* ns = dev->private_data;
+    if (!ns->device->volatile_write_cache) return true;
+    return nvme_flush(ns->device, ns->nsid) == NVME_SUCCESS;
+}
+
+// Add the pages of [start, end) to a request's PRPs. The first two stay in
+// the command; the list page is only allocated for a third.
+static bool nvme_prp_add(nvme_sq_entry_t* cmd, void** list, uint32_t* count,
+                         uint64_t start, uint64_t end) {
+    if (start & 3) return false;
+    for (uint64_t addr = start; addr < end; addr = (addr & ~(uint64_t)(PAGE_SIZE - 1)) + PAGE_SIZE) {
+        uint64_t phys = vmm_get_phys_addr(addr);
+        if (!phys || *count > NVME_PRP_MAX_BYTES / PAGE_SIZE) return false;
+
+        if (*count == 0) {
+            cmd->prp1 = phys;
+        } else if (*count == 1) {
+            cmd->prp2 = phys;
+        } else {
+            if (*count == 2) {
+                *list = pmm_alloc_page();
+                if (!*list) return false;
+                ((uint64_t*)pmm_phys_to_virt(*list))[0] = cmd->prp2;
+                cmd->prp2 = (uint64_t)*list;
+            }
+            ((uint64_t*)pmm_phys_to_virt(*list))[*count - 1] = phys;
+        }
+        (*count)++;
+    }
+    return true;
+}
+
+// PRPs for a merged run. Buffers that carry straight on are joined first;
+// blk_request merging leaves only page aligned breaks between the rest.
+static bool nvme_build_request_prps(nvme_sq_entry_t* cmd, struct blk_request* req, void** list) {
+    *list = NULL;
+    uint32_t count = 0;
+    uint64_t start = (uint64_t)req->buffer;
+    uint64_t end = start + (uint64_t)req->count * req->dev->block_size;
+    for (struct blk_request* seg = req->merged; seg; seg = seg->merged) {
+        uint64_t buffer = (uint64_t)seg->buffer;
+        if (buffer != end) {
+            if (!nvme_prp_add(cmd, list, &count, start, end)) goto fail;
+            start = buffer;
+        }
+        end = buffer + (uint64_t)seg->count * req->dev->block_size;
+    }
+    if (nvme_prp_add(cmd, list, &count, start, end)) return true;
+
+fail:
+    if (*list) pmm_free_page(*list);
+    *list = NULL;
+    return false;
+}
+
+static void nvme_block_done(void* ctx, uint16_t status) {
+    struct blk_request* req = ctx;
+    if (req->driver_data) pmm_free_page(req->driver_data);
+    blk_complete(req, !(status & 0x7FF));
+}
+
+// Queue the whole batch on this CPU's queue pair behind one doorbell write
+static bool nvme_block_submit(struct block_device* dev, struct blk_request* batch) {
+    nvme_namespace_t* ns = dev->private_data;
+    nvme_device_t* device = ns->device;
+    nvme_queue_t* queue = device->initialized ? nvme_io_queue(device) : NULL;
+    if (!queue) return false;
+
+    struct blk_request* failed = NULL;
+    uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+    while (batch) {
+        struct blk_request* req = batch;
+        batch = batch->next;
+
+        nvme_sq_entry_t cmd = {0};
+        cmd.cdw0 = req->write ? NVME_CMD_WRITE : NVME_CMD_READ;
+        cmd.nsid = ns->nsid;
+        cmd.cdw10 = (uint32_t)req->lba;
+        cmd.cdw11 = (uint32_t)(req->lba >> 32);
+        cmd.cdw12 = req->total - 1;
+
+        void* list;
+        if (!req->total || !nvme_build_request_prps(&cmd, req, &list)) {
+            req->next = failed;
+            failed = req;
+            continue;
+        }
+        req->driver_data = list;
+        if (!nvme_queue_push(device, queue, &cmd, nvme_block_done, req, &flags)) {
+            if (list) pmm_free_page(list);
+            req->next = failed;
+            failed = req;
+            continue;
+        }
+
+        uint32_t merges = 0;
+        for (struct blk_request* seg = req->merged; seg; seg = seg->merged) merges++;
+        nvme_stats_merged(queue, ns, merges);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    NVME_WRITE_REG32(device, NVME_SQ_DOORBELL(device, queue->qid), queue->sq_tail);
+    spinlock_release_irqrestore(&queue->lock, flags);
+
+    nvme_queue_run_callbacks(queue);
+    while (failed) {
+        struct blk_request* next = failed->next;
+        blk_complete(failed, false);
+        failed = next;
+    }
+    return true;
+}
+
+static void nvme_block_poll(struct block_device* dev) {
+    nvme_device_t* device = ((nvme_namespace_t*)dev->private_data)->device;
+    for (uint32_t i = 0; i < device->num_io_queues; i++) {
+        nvme_queue_service(device, &device->io_queues[i]);
+    }
+}
+
+struct block_device* nvme_namespace_block_device(nvme_namespace_t* ns) {
+    if (!ns) return NULL;
+
+    struct block_device* dev = &ns->block_dev;
+    dev->name = "nvme";
+    dev->block_size = ns->block_size;
+    dev->sectors = ns->blocks;
+    dev->read = nvme_block_read;
+    dev->write = nvme_block_write;
+    dev->submit = nvme_block_submit;
+    dev->poll = nvme_block_poll;
+    dev->flush = nvme_block_flush;
+    dev->max_sectors = ns->max_blocks;
+    dev->private_data = ns;
+    return dev;
+}
+
+// Get NVMe Device by Index as a block device
+struct block_device* nvme_get_block_device(uint32_t index) {
+    nvme_device_t* device = nvme_get_device(index);
+    if (!device || !device->num_namespaces) return NULL;
+    return nvme_namespace_block_device(&device->namespaces[0]);
+}
+
+#if NVME_STATS
+static const char* const stat_names[NVME_STAT_KINDS] = { "read", "write", "flush" };
+
+static void nvme_stats_log(uint32_t index, const char* what, uint32_t id, nvme_io_stats_t* stats) {
+    uint64_t ops = 0;
+    for (uint32_t kind = 0; kind < NVME_STAT_KINDS; kind++) ops += stats->ops[kind];
+    if (!ops && !stats->inflight) return;
+
+    // log_printf only formats 32-bit values, so bytes go out in KiB
+    log_info("nvme%d %s %d: %d reads (%d KiB), %d writes (%d KiB), %d flushes, %d merges, %d errors, %d in flight (max %d)",
+             (int)index, what, (int)id,
+             (int)stats->ops[NVME_STAT_READ], (int)(stats->bytes[NVME_STAT_READ] / 1024),
+             (int)stats->ops[NVME_STAT_WRITE], (int)(stats->bytes[NVME_STAT_WRITE] / 1024),
+             (int)stats->ops[NVME_STAT_FLUSH], (int)stats->merges, (int)stats->errors,
+             (int)stats->inflight, (int)stats->max_inflight);
+    for (uint32_t kind = 0; kind < NVME_STAT_KINDS; kind++) {
+        for (uint32_t b = 0; b < NVME_STATS_BUCKETS; b++) {
+            if (stats->hist[kind][b]) {
+                log_info("nvme%d %s %d:   %s < 2^%d ns: %d", (int)index, what, (int)id,
+                         stat_names[kind], (int)b, (int)stats->hist[kind][b]);
+            }
+        }
+    }
+}
+
+// Queue pairs show where submission queues back up, namespaces what the
+// device itself takes; a large gap between them is time spent in software
+void nvme_stats_dump(void) {
+    for (uint32_t i = 0; i < num_nvme_devices; i++) {
+        nvme_device_t* device = &nvme_devices[i];
+        for (uint32_t q = 0; q < device->num_io_queues; q++) {
+            nvme_queue_t* queue = &device->io_queues[q];
+            nvme_io_stats_t stats;
+            uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+            memcpy(&stats, &queue->stats, sizeof(stats));
+            spinlock_release_irqrestore(&queue->lock, flags);
+            nvme_stats_log(i, "queue", queue->qid, &stats);
+        }
+
+        // Read unlocked; a dump racing a completion may be off by one
+        for (uint32_t n = 0; n < device->num_namespaces; n++) {
+            nvme_stats_log(i, "ns", device->namespaces[n].nsid, &device->namespaces[n].stats);
+        }
+    }
+}
+
+// Commands in flight stay counted, so their completions still balance
+void nvme_stats_reset(void) {
+    for (uint32_t i = 0; i < num_nvme_devices; i++) {
+        nvme_device_t* device = &nvme_devices[i];
+        for (uint32_t q = 0; q < device->num_io_queues; q++) {
+            nvme_queue_t* queue = &device->io_queues[q];
+            uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+            uint32_t inflight = queue->stats.inflight;
+            memset(&queue->stats, 0, sizeof(nvme_io_stats_t));
+            queue->stats.inflight = queue->stats.max_inflight = inflight;
+            spinlock_release_irqrestore(&queue->lock, flags);
+        }
+        for (uint32_t n = 0; n < device->num_namespaces; n++) {
+            nvme_io_stats_t* stats = &device->namespaces[n].stats;
+            uint32_t inflight = __atomic_load_n(&stats->inflight, __ATOMIC_RELAXED);
+            memset(stats->ops, 0, sizeof(stats->ops));
+            memset(stats->bytes, 0, sizeof(stats->bytes));
+            memset(stats->hist, 0, sizeof(stats->hist));
+            stats->errors = stats->merges = 0;
+            __atomic_store_n(&stats->max_inflight, inflight, __ATOMIC_RELAXED);
+        }
+    }
+}
+#else
+void nvme_stats_dump(void) {
+    log_info("nvme: statistics compiled out");
+}
+
+void nvme_stats_reset(void) {}
+#endif
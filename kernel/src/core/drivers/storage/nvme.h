@@ -4,12 +4,23 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <core/drivers/pci.h>
+#include <core/drivers/storage/blockdev.h>
+#include <core/smp.h>
+#include <core/wait.h>
 
 // Maximum number of NVMe devices and queues
 #define NVME_MAX_DEVICES     16
 #define NVME_MAX_NAMESPACES  32
-#define NVME_MAX_QUEUES      64
-#define NVME_QUEUE_DEPTH     256
+#define NVME_MAX_QUEUES      64      // I/O queue pairs, one per CPU up to this
+
+// I/O counters and latency histograms per queue pair and per namespace,
+// see nvme_stats_dump()
+#define NVME_STATS           1
+#define NVME_STATS_BUCKETS   32      // Log2 nanosecond buckets, the last open-ended
+#define NVME_QUEUE_DEPTH     256     // I/O queue entries, capped by CAP.MQES
+#define NVME_ADMIN_DEPTH     32
+#define NVME_TIMEOUT_MS      5000    // Before a polled command is given up on
+#define NVME_HYBRID_POLL_NS  20000   // Spin before sleeping in hybrid mode
 
 // NVMe Command Opcodes
 typedef enum {
@@ -56,6 +67,8 @@ typedef struct {
     uint8_t nmic;       // Namespace Multipath
     uint8_t rescap;     // Reservation Capabilities
     uint8_t fpi;        // Format Progress Indicator
+    uint8_t rsvd[95];   // Up to the LBA formats
+    uint32_t lbaf[16];  // LBA Formats: MS [15:0], LBADS [23:16], RP [25:24]
 } __attribute__((packed)) nvme_namespace_info_t;
 
 // NVMe Controller Attributes
@@ -71,35 +84,116 @@ typedef struct {
     uint8_t mdts;       // Maximum Data Transfer Size
     uint16_t cntlid;    // Controller ID
     uint32_t version;   // Version
+    uint8_t rsvd[432];  // Up to the NVM command set attributes
+    uint32_t nn;        // Number of Namespaces, the highest valid NSID
+    uint16_t oncs;      // Optional NVM Command Support
+    uint16_t fuses;     // Fused Operation Support
+    uint8_t fna;        // Format NVM Attributes
+    uint8_t vwc;        // Volatile Write Cache, present if bit 0 is set
 } __attribute__((packed)) nvme_controller_info_t;
 
-// NVMe Queue Structure
+// Runs once an asynchronous command completes, outside the queue lock
+typedef void (*nvme_callback_t)(void* ctx, uint16_t status);
+
+typedef enum {
+    NVME_STAT_READ = 0,
+    NVME_STAT_WRITE,
+    NVME_STAT_FLUSH,
+    NVME_STAT_KINDS,
+    NVME_STAT_NONE = 0xFF,  // Admin and other commands, not counted
+} nvme_stat_kind_t;
+
 typedef struct {
-    void* sq_base;      // Submission Queue Base Address
-    void* cq_base;      // Completion Queue Base Address
-    uint16_t sq_head;   // Submission Queue Head Pointer
+    uint64_t ops[NVME_STAT_KINDS];
+    uint64_t bytes[NVME_STAT_KINDS];
+    uint64_t errors;
+    uint64_t merges;        // Block requests carried by another's command
+    uint32_t inflight;      // Commands with the device right now
+    uint32_t max_inflight;
+    uint32_t hist[NVME_STAT_KINDS][NVME_STATS_BUCKETS];   // Submit to reap
+} nvme_io_stats_t;
+
+// Per command ID state of a queue pair
+typedef struct {
+    volatile uint8_t state;
+    uint16_t status;    // Completion status, phase bit dropped
+    uint32_t result;    // Completion dword 0
+    nvme_callback_t callback;   // NULL while a submitter waits instead
+    void* ctx;
+    uint8_t stat_kind;          // nvme_stat_kind_t
+    struct nvme_namespace* ns;  // Charged with the command's statistics
+    uint32_t bytes;
+    uint64_t submit_ns;
+} nvme_command_slot_t;
+
+// NVMe Queue Pair, a submission queue and the completion queue it posts to
+typedef struct {
+    struct nvme_sq_entry* sq;       // Submission Queue, through the HHDM
+    struct nvme_cq_entry* cq;       // Completion Queue, through the HHDM
+    uint64_t sq_phys;
+    uint64_t cq_phys;
+    nvme_command_slot_t* slots;     // Indexed by command ID
+    uint16_t* done_cids;            // Completed with callbacks still to run
+    uint16_t done_count;
+    spinlock_t lock;
+    struct wait_queue wait;         // Submitters sleeping on a completion
+    struct nvme_device* device;     // Owner, for the interrupt handler
+    uint8_t vector;     // MSI-X vector, 0 if the queue is only polled
+    uint16_t qid;       // 0 for the admin queue
+    uint16_t depth;     // Entries in each queue
+    uint16_t sq_head;   // Submission Queue Head, as last reported
     uint16_t sq_tail;   // Submission Queue Tail Pointer
     uint16_t cq_head;   // Completion Queue Head Pointer
-    uint16_t queue_size;// Queue Depth
+    uint16_t next_cid;  // Where the search for a free command ID starts
+    uint8_t phase;      // Phase tag of the next new completion
     bool initialized;   // Queue Initialization Status
+    nvme_io_stats_t stats;          // Under the lock
 } nvme_queue_t;
 
+// How submitters learn of completions. Queues without a vector always poll.
+typedef enum {
+    NVME_COMPLETION_IRQ = 0,    // Sleep until the queue's interrupt
+    NVME_COMPLETION_POLL,       // Spin on the completion queue
+    NVME_COMPLETION_HYBRID,     // Spin for NVME_HYBRID_POLL_NS, then sleep
+} nvme_completion_mode_t;
+
+// An active namespace, with the LBA format it is currently formatted in
+typedef struct nvme_namespace {
+    struct nvme_device* device;
+    uint32_t nsid;
+    uint64_t blocks;            // Size in logical blocks
+    uint32_t block_size;        // Bytes per logical block
+    uint16_t metadata_size;     // Separate metadata bytes per block, never transferred
+    uint8_t lba_format;         // Index into the identify data's formats
+    uint32_t max_blocks;        // Per command, from MDTS
+    struct block_device block_dev;
+    nvme_io_stats_t stats;      // Updated atomically, from every queue pair
+} nvme_namespace_t;
+
 // NVMe Device Structure
-typedef struct {
+typedef struct nvme_device {
     struct pci_device* pci_dev;     // PCI Device Information
     volatile void* mmio_base;       // Memory-Mapped I/O Base Address
 
     // Controller Information
     nvme_controller_info_t controller_info;
 
-    // Namespace Information
-    nvme_namespace_info_t namespaces[NVME_MAX_NAMESPACES];
+    // Active namespaces in NSID order, the first NVME_MAX_NAMESPACES of them
+    nvme_namespace_t namespaces[NVME_MAX_NAMESPACES];
     uint32_t num_namespaces;
+    bool volatile_write_cache;      // Writes need a flush to be durable
 
-    // Queues
-    nvme_queue_t admin_sq;          // Admin Submission Queue
-    nvme_queue_t admin_cq;          // Admin Completion Queue
+    // Queues; CPU n submits I/O to io_queues[n % num_io_queues]
+    nvme_queue_t admin_queue;
     nvme_queue_t io_queues[NVME_MAX_QUEUES];
+    volatile uint32_t num_io_queues;
+    uint32_t max_io_queues;         // Granted by the controller
+    uint32_t doorbell_stride;       // Bytes between doorbell registers
+
+    // MSI-X table, entry n serving queue pair n
+    volatile uint32_t* msix_table;
+    uint32_t msix_entries;
+    volatile nvme_completion_mode_t completion_mode;
 
     // Capabilities
     uint64_t capabilities;
@@ -112,12 +206,13 @@ typedef struct {
 } nvme_device_t;
 
 // NVMe Command Submission Structures
-typedef struct {
+typedef struct nvme_sq_entry {
     uint32_t cdw0;      // Command Dword 0 (Opcode, Flag, Command ID)
     uint32_t nsid;      // Namespace ID
     uint64_t rsvd;      // Reserved
     uint64_t mptr;      // Metadata Pointer
-    uint64_t dptr;      // Data Pointer
+    uint64_t prp1;      // Data Pointer, first PRP entry
+    uint64_t prp2;      // Data Pointer, second PRP entry or PRP list
     uint32_t cdw10;     // Command Dword 10
     uint32_t cdw11;     // Command Dword 11
     uint32_t cdw12;     // Command Dword 12
@@ -126,7 +221,7 @@ typedef struct {
     uint32_t cdw15;     // Command Dword 15
 } __attribute__((packed)) nvme_sq_entry_t;
 
-typedef struct {
+typedef struct nvme_cq_entry {
     uint32_t result;    // Command-specific result
     uint32_t rsvd;      // Reserved
     uint16_t sq_head;   // Submission Queue Head Pointer
@@ -149,14 +244,31 @@ typedef enum {
 // Public API Function Declarations
 nvme_result_t nvme_init(void);
 nvme_device_t* nvme_get_device(uint32_t index);
+// The device's namespace with this NSID, NULL if it is not active
+nvme_namespace_t* nvme_get_namespace(nvme_device_t* device, uint32_t nsid);
+// A namespace as a block device, in the namespace's own block size
+struct block_device* nvme_namespace_block_device(nvme_namespace_t* ns);
+// The first active namespace of device index as a block device
+struct block_device* nvme_get_block_device(uint32_t index);
 nvme_result_t nvme_read(nvme_device_t* device, uint32_t nsid,
                         uint64_t lba, uint32_t blocks, void* buffer);
 nvme_result_t nvme_write(nvme_device_t* device, uint32_t nsid,
                          uint64_t lba, uint32_t blocks, const void* buffer);
+nvme_result_t nvme_flush(nvme_device_t* device, uint32_t nsid);
 nvme_result_t nvme_identify_namespace(nvme_device_t* device, uint32_t nsid,
                                       nvme_namespace_info_t* info);
 nvme_result_t nvme_identify_controller(nvme_device_t* device,
                                        nvme_controller_info_t* info);
 nvme_result_t nvme_probe_device(struct pci_device* pci_dev);
+// Create the remaining per-CPU I/O queue pairs, once the APs are up
+void nvme_init_cpu_queues(void);
+void nvme_set_completion_mode(nvme_device_t* device, nvme_completion_mode_t mode);
+// Interrupt once threshold completions are pending or the oldest has waited
+// time_100us hundred microseconds; 1, 0 interrupts on every completion
+nvme_result_t nvme_set_coalescing(nvme_device_t* device, uint8_t threshold, uint8_t time_100us);
+
+// Log every queue pair and namespace that has seen I/O since the last reset
+void nvme_stats_dump(void);
+void nvme_stats_reset(void);
 
 #endif // NVME_H
\ No newline at end of file
@@ -0,0 +1,46 @@
+#include <core/drivers/storage/ramdisk.h>
+#include <core/attributes.h>
+#include <utils/mem.h>
+#include <utils/str.h>
+#include <utils/log.h>
+
+static struct block_device ramdisk;
+
+static bool ramdisk_read(struct block_device* dev, uint64_t lba, uint32_t count, void* buffer) {
+    if (lba > dev->sectors || count > dev->sectors - lba) return false;
+    memcpy(buffer, (uint8_t*)dev->private_data + lba * BLOCKDEV_SECTOR_SIZE,
+           (size_t)count * BLOCKDEV_SECTOR_SIZE);
+    return true;
+}
+
+static bool ramdisk_write(struct block_device* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    if (lba > dev->sectors || count > dev->sectors - lba) return false;
+    memcpy((uint8_t*)dev->private_data + lba * BLOCKDEV_SECTOR_SIZE, buffer,
+           (size_t)count * BLOCKDEV_SECTOR_SIZE);
+    return true;
+}
+
+struct block_device* ramdisk_init(void) {
+    struct limine_module_response* response = module_request.response;
+    if (!response || !response->module_count) return NULL;
+
+    struct limine_file* module = response->modules[0];
+    for (uint64_t i = 0; i < response->module_count; i++) {
+        const char* cmdline = response->modules[i]->cmdline;
+        if (cmdline && strcmp(cmdline, RAMDISK_CMDLINE) == 0) {
+            module = response->modules[i];
+            break;
+        }
+    }
+    // Already mapped through the HHDM; a trailing partial sector is ignored
+    if (!module->address || module->size < BLOCKDEV_SECTOR_SIZE) return NULL;
+
+    ramdisk.name = "ramdisk";
+    ramdisk.block_size = BLOCKDEV_SECTOR_SIZE;
+    ramdisk.sectors = module->size / BLOCKDEV_SECTOR_SIZE;
+    ramdisk.read = ramdisk_read;
+    ramdisk.write = ramdisk_write;
+    ramdisk.private_data = module->address;
+    log_info("ramdisk: %s, %d KiB", module->path, (int)(module->size / 1024));
+    return &ramdisk;
+}
@@ -0,0 +1,13 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <core/drivers/storage/blockdev.h>
+
+// A Limine module served as a disk, written in place; changes are lost at
+// reboot. Picks the module whose cmdline is RAMDISK_CMDLINE, else the first.
+#define RAMDISK_CMDLINE "rootfs"
+
+// NULL if the bootloader loaded no module
+struct block_device* ramdisk_init(void);
+
+#endif // RAMDISK_H
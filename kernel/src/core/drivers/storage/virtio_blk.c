@@ -0,0 +1,314 @@
+#include <core/drivers/storage/virtio_blk.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <core/wait.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <utils/mem.h>
+#include <utils/log.h>
+
+// Request types and status
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_S_OK         0
+
+// Device configuration offsets
+#define VIRTIO_BLK_CFG_CAPACITY     0   // 512-byte sectors, whatever blk_size is
+#define VIRTIO_BLK_CFG_BLK_SIZE     20
+#define VIRTIO_BLK_CFG_NUM_QUEUES   34
+
+#define VIRTIO_BLK_SUBMIT_TIMEOUT_NS 1000000000ULL
+
+struct virtio_blk_header {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed));
+
+// One request in flight: the header the device reads and the status it
+// writes back. Small and aligned, so neither crosses a page.
+struct virtio_blk_cmd {
+    struct virtio_blk_header header;
+    volatile uint8_t status;
+    volatile bool done;                 // Requests without req, which are waited on
+    struct blk_request* req;
+};
+
+static struct virtio_blk_device virtio_blk_devices[VIRTIO_BLK_MAX_DEVICES];
+static uint32_t num_virtio_blk_devices = 0;
+static struct kmem_cache* cmd_cache = NULL;
+
+// Flushes waiting on their command
+static struct wait_queue cmd_wait = WAIT_QUEUE_INIT;
+
+static uint32_t config_read32(struct virtio_blk_device* vdev, uint32_t offset) {
+    return *(volatile uint32_t*)((volatile uint8_t*)vdev->virtio.config + offset);
+}
+
+static uint16_t config_read16(struct virtio_blk_device* vdev, uint32_t offset) {
+    return *(volatile uint16_t*)((volatile uint8_t*)vdev->virtio.config + offset);
+}
+
+// 64-bit fields are read in halves, so retry if the device changed them meanwhile
+static uint64_t config_read64(struct virtio_blk_device* vdev, uint32_t offset) {
+    uint8_t generation;
+    uint64_t value;
+    do {
+        generation = vdev->virtio.common->config_generation;
+        value = config_read32(vdev, offset) | ((uint64_t)config_read32(vdev, offset + 4) << 32);
+    } while (generation != vdev->virtio.common->config_generation);
+    return value;
+}
+
+// Finish everything the device has handed back on vq
+static void virtio_blk_service(struct virtqueue* vq) {
+    struct virtio_blk_cmd* cmd;
+    while ((cmd = virtqueue_get(vq, NULL)) != NULL) {
+        bool success = cmd->status == VIRTIO_BLK_S_OK;
+        if (cmd->req) {
+            struct blk_request* req = cmd->req;
+            kmem_cache_free(cmd_cache, cmd);
+            blk_complete(req, success);
+        } else {
+            // The waiter frees it
+            __atomic_store_n(&cmd->done, true, __ATOMIC_RELEASE);
+            wait_queue_wake_all(&cmd_wait);
+        }
+    }
+}
+
+// Reap until the device is caught up with interrupts back on
+static void virtio_blk_interrupt(struct virtqueue* vq) {
+    virtqueue_disable_cb(vq);
+    do {
+        virtio_blk_service(vq);
+    } while (!virtqueue_enable_cb(vq));
+}
+
+static struct virtqueue* virtio_blk_queue(struct virtio_blk_device* vdev) {
+    return &vdev->queues[smp_get_current_cpu() % vdev->num_queues];
+}
+
+// Add a command, making room when the ring is full by letting the device
+// see what is queued and reaping. False if it can never fit.
+static bool virtio_blk_add(struct virtqueue* vq, struct virtio_buf* bufs, uint32_t out, uint32_t in,
+                           struct virtio_blk_cmd* cmd) {
+    uint64_t deadline = 0;
+    while (!virtqueue_add(vq, bufs, out, in, cmd)) {
+        if (vq->num_free == vq->size) return false;
+        uint64_t now = ktime_get_ns();
+        if (!deadline) deadline = now + VIRTIO_BLK_SUBMIT_TIMEOUT_NS;
+        else if (now > deadline) return false;
+
+        virtqueue_kick(vq);
+        virtio_blk_service(vq);
+        __asm__ volatile("pause");
+    }
+    return true;
+}
+
+// Header, the data of the whole merged run, then the status byte. Buffers
+// either continue each other or meet at a page boundary, so the run takes
+// no more pieces than pages.
+static uint32_t virtio_blk_build(struct virtio_blk_device* vdev, struct virtio_blk_cmd* cmd,
+                                 struct blk_request* req, struct virtio_buf* bufs) {
+    uint32_t n = 0;
+    bufs[n].addr = &cmd->header;
+    bufs[n++].len = sizeof(cmd->header);
+    for (struct blk_request* seg = req; seg; seg = seg->merged) {
+        uint32_t len = seg->count * vdev->block_size;
+        if (n > 1 && (uint8_t*)bufs[n - 1].addr + bufs[n - 1].len == (uint8_t*)seg->buffer) {
+            bufs[n - 1].len += len;
+            continue;
+        }
+        if (n == VIRTIO_INDIRECT_MAX - 1) return 0;
+        bufs[n].addr = seg->buffer;
+        bufs[n++].len = len;
+    }
+    bufs[n].addr = (void*)&cmd->status;
+    bufs[n++].len = 1;
+    return n;
+}
+
+static bool virtio_blk_submit(struct block_device* dev, struct blk_request* batch) {
+    struct virtio_blk_device* vdev = dev->private_data;
+    if (!vdev->num_queues) return false;
+    struct virtqueue* vq = virtio_blk_queue(vdev);
+    uint32_t sector_shift = __builtin_ctz(vdev->block_size / BLOCKDEV_SECTOR_SIZE);
+
+    struct blk_request* failed = NULL;
+    while (batch) {
+        struct blk_request* req = batch;
+        batch = batch->next;
+
+        struct virtio_blk_cmd* cmd = kmem_cache_alloc(cmd_cache);
+        struct virtio_buf bufs[VIRTIO_INDIRECT_MAX];
+        uint32_t count = 0;
+        if (cmd) {
+            cmd->header.type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+            cmd->header.reserved = 0;
+            cmd->header.sector = req->lba << sector_shift;
+            cmd->status = 0xFF;
+            cmd->req = req;
+            count = req->total ? virtio_blk_build(vdev, cmd, req, bufs) : 0;
+        }
+
+        // Writes give the device the data to read, reads the data to fill
+        uint32_t out = req->write ? count - 1 : 1;
+        if (!count || !virtio_blk_add(vq, bufs, out, count - out, cmd)) {
+            if (cmd) kmem_cache_free(cmd_cache, cmd);
+            req->next = failed;
+            failed = req;
+        }
+    }
+    virtqueue_kick(vq);
+
+    while (failed) {
+        struct blk_request* next = failed->next;
+        blk_complete(failed, false);
+        failed = next;
+    }
+    return true;
+}
+
+static void virtio_blk_poll(struct block_device* dev) {
+    struct virtio_blk_device* vdev = dev->private_data;
+    for (uint32_t i = 0; i < vdev->num_queues; i++) {
+        virtio_blk_service(&vdev->queues[i]);
+    }
+}
+
+static bool virtio_blk_read(struct block_device* dev, uint64_t lba, uint32_t count, void* buffer) {
+    return blk_io(dev, lba, count, buffer, false);
+}
+
+static bool virtio_blk_write(struct block_device* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    return blk_io(dev, lba, count, (void*)buffer, true);
+}
+
+// Only offered when the device caches writes
+static bool virtio_blk_flush(struct block_device* dev) {
+    struct virtio_blk_device* vdev = dev->private_data;
+    if (!virtio_has_feature(&vdev->virtio, VIRTIO_BLK_F_FLUSH)) return true;
+
+    struct virtio_blk_cmd* cmd = kmem_cache_alloc(cmd_cache);
+    if (!cmd) return false;
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->header.type = VIRTIO_BLK_T_FLUSH;
+    cmd->status = 0xFF;
+
+    struct virtio_buf bufs[2] = {
+        { &cmd->header, sizeof(cmd->header) },
+        { (void*)&cmd->status, 1 },
+    };
+    struct virtqueue* vq = virtio_blk_queue(vdev);
+    if (!virtio_blk_add(vq, bufs, 1, 1, cmd)) {
+        kmem_cache_free(cmd_cache, cmd);
+        return false;
+    }
+    virtqueue_kick(vq);
+
+    wait_event(&cmd_wait, (virtio_blk_poll(dev), __atomic_load_n(&cmd->done, __ATOMIC_ACQUIRE)));
+    bool success = cmd->status == VIRTIO_BLK_S_OK;
+    kmem_cache_free(cmd_cache, cmd);
+    return success;
+}
+
+static bool virtio_blk_probe(struct pci_device* pci_dev, const struct pci_device_id* id) {
+    (void)id;
+    if (num_virtio_blk_devices >= VIRTIO_BLK_MAX_DEVICES) return false;
+    struct virtio_blk_device* vdev = &virtio_blk_devices[num_virtio_blk_devices];
+    memset(vdev, 0, sizeof(*vdev));
+
+    struct virtio_device* virtio = &vdev->virtio;
+    if (!virtio_pci_init(virtio, pci_dev)) return false;
+    uint64_t wanted = VIRTIO_FEATURE(VIRTIO_BLK_F_BLK_SIZE) | VIRTIO_FEATURE(VIRTIO_BLK_F_FLUSH) |
+                      VIRTIO_FEATURE(VIRTIO_BLK_F_MQ) | VIRTIO_FEATURE(VIRTIO_F_INDIRECT_DESC) |
+                      VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX);
+    if (!virtio->config || !virtio_negotiate(virtio, wanted)) {
+        virtio_fail(virtio);
+        return false;
+    }
+
+    // The logical block size, if reported and usable
+    vdev->block_size = BLOCKDEV_SECTOR_SIZE;
+    if (virtio_has_feature(virtio, VIRTIO_BLK_F_BLK_SIZE)) {
+        uint32_t size = config_read32(vdev, VIRTIO_BLK_CFG_BLK_SIZE);
+        if (size > BLOCKDEV_SECTOR_SIZE && !(size & (size - 1))) vdev->block_size = size;
+    }
+    vdev->blocks = config_read64(vdev, VIRTIO_BLK_CFG_CAPACITY) / (vdev->block_size / BLOCKDEV_SECTOR_SIZE);
+
+    uint32_t wanted_queues = 1;
+    if (virtio_has_feature(virtio, VIRTIO_BLK_F_MQ)) {
+        wanted_queues = config_read16(vdev, VIRTIO_BLK_CFG_NUM_QUEUES);
+    }
+    if (wanted_queues > VIRTIO_BLK_MAX_QUEUES) wanted_queues = VIRTIO_BLK_MAX_QUEUES;
+    if (wanted_queues > virtio_queue_count(virtio)) wanted_queues = virtio_queue_count(virtio);
+
+    // Every queue exists before DRIVER_OK; all start on the BSP
+    while (vdev->num_queues < wanted_queues) {
+        struct virtqueue* vq = &vdev->queues[vdev->num_queues];
+        if (!virtqueue_setup(virtio, vq, (uint16_t)vdev->num_queues, VIRTIO_BLK_QUEUE_SIZE,
+                             virtio_blk_interrupt, 0)) {
+            break;
+        }
+        vq->private_data = vdev;
+        vdev->num_queues++;
+    }
+    if (!vdev->num_queues || !vdev->blocks) {
+        virtio_fail(virtio);
+        return false;
+    }
+    virtio_driver_ok(virtio);
+
+    struct block_device* dev = &vdev->block_dev;
+    dev->name = "virtio-blk";
+    dev->block_size = vdev->block_size;
+    dev->sectors = vdev->blocks;
+    dev->read = virtio_blk_read;
+    dev->write = virtio_blk_write;
+    dev->submit = virtio_blk_submit;
+    dev->poll = virtio_blk_poll;
+    dev->flush = virtio_blk_flush;
+    dev->max_sectors = (VIRTIO_INDIRECT_MAX - 3) * PAGE_SIZE / vdev->block_size;
+    dev->private_data = vdev;
+
+    log_info("virtio-blk: %d blocks of %d bytes, %d queues", (int)vdev->blocks,
+             (int)vdev->block_size, (int)vdev->num_queues);
+    num_virtio_blk_devices++;
+    return true;
+}
+
+static const struct pci_device_id virtio_blk_ids[] = {
+    PCI_DEVICE(VIRTIO_PCI_VENDOR, VIRTIO_PCI_MODERN_BASE + VIRTIO_ID_BLOCK),
+    PCI_DEVICE(VIRTIO_PCI_VENDOR, VIRTIO_PCI_TRANS_BLOCK),
+    { 0 }
+};
+
+static struct pci_driver virtio_blk_driver = { "virtio-blk", virtio_blk_ids, virtio_blk_probe };
+
+uint32_t virtio_blk_init(void) {
+    if (!cmd_cache) {
+        cmd_cache = kmem_cache_create("virtio_blk_cmd", sizeof(struct virtio_blk_cmd), 32, NULL);
+        if (!cmd_cache) return 0;
+    }
+
+    pci_register_driver(&virtio_blk_driver);
+    return num_virtio_blk_devices;
+}
+
+struct block_device* virtio_blk_get_device(uint32_t index) {
+    return index < num_virtio_blk_devices ? &virtio_blk_devices[index].block_dev : NULL;
+}
+
+void virtio_blk_init_cpu_queues(void) {
+    uint32_t cpus = smp_get_cpu_count();
+    if (!cpus) return;
+    for (uint32_t i = 0; i < num_virtio_blk_devices; i++) {
+        struct virtio_blk_device* vdev = &virtio_blk_devices[i];
+        for (uint32_t q = 0; q < vdev->num_queues; q++) {
+            virtqueue_set_affinity(&vdev->queues[q], q % cpus);
+        }
+    }
+}
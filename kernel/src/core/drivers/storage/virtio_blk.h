@@ -0,0 +1,34 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/drivers/virtio.h>
+#include <core/drivers/storage/blockdev.h>
+
+#define VIRTIO_BLK_MAX_DEVICES  4
+#define VIRTIO_BLK_MAX_QUEUES   8       // Request queues per device, one per CPU up to this
+#define VIRTIO_BLK_QUEUE_SIZE   128
+
+// Device feature bits
+#define VIRTIO_BLK_F_BLK_SIZE   6
+#define VIRTIO_BLK_F_FLUSH      9
+#define VIRTIO_BLK_F_MQ         12
+
+struct virtio_blk_device {
+    struct virtio_device virtio;
+    struct virtqueue queues[VIRTIO_BLK_MAX_QUEUES];
+    uint32_t num_queues;
+    uint32_t block_size;
+    uint64_t blocks;
+    struct block_device block_dev;
+};
+
+// Probe virtio-blk PCI functions; the number found
+uint32_t virtio_blk_init(void);
+// NULL past the last device
+struct block_device* virtio_blk_get_device(uint32_t index);
+// Spread queue interrupts over the CPUs, once smp_init() has run
+void virtio_blk_init_cpu_queues(void);
+
+#endif // VIRTIO_BLK_H
@@ -1,23 +1,146 @@
 #include <core/drivers/tty/pipe.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
 #include <mm/heap.h>
 #include <utils/mem.h>
 
+// Segments handed to one file_readv()/file_writev() by splice
+#define PIPE_SPLICE_PAGES   16
+
+static inline uint8_t* page_data(uint64_t page) {
+    return pmm_phys_to_virt((void*)page);
+}
+
+static inline struct pipe_buffer* pipe_slot(pipe_t* pipe, uint32_t index) {
+    return &pipe->bufs[index & (pipe->slots - 1)];
+}
+
+static inline bool pipe_full(pipe_t* pipe) {
+    return pipe->head - pipe->tail >= pipe->slots;
+}
+
+// The wait condition cannot take the lock itself: it is evaluated again
+// after a wakeup, and a second exchange would see our own hold
+static void pipe_lock(pipe_t* pipe) {
+    while (__atomic_exchange_n(&pipe->locked, true, __ATOMIC_ACQUIRE)) {
+        wait_event(&pipe->lock_wait, !__atomic_load_n(&pipe->locked, __ATOMIC_RELAXED));
+    }
+}
+
+static void pipe_unlock(pipe_t* pipe) {
+    __atomic_store_n(&pipe->locked, false, __ATOMIC_RELEASE);
+    wait_queue_wake_one(&pipe->lock_wait);
+}
+
+// Lower address first, so two splices in opposite directions cannot deadlock
+static void pipe_lock_pair(pipe_t* a, pipe_t* b) {
+    if (a > b) {
+        pipe_t* t = a;
+        a = b;
+        b = t;
+    }
+    pipe_lock(a);
+    pipe_lock(b);
+}
+
+static void pipe_unlock_pair(pipe_t* a, pipe_t* b) {
+    pipe_unlock(a);
+    pipe_unlock(b);
+}
+
+static void wake_readers(pipe_t* pipe) {
+    wait_queue_wake_all(&pipe->read_wait);
+    poll_notify(&pipe->poll, EPOLLIN);
+}
+
+static void wake_writers(pipe_t* pipe) {
+    wait_queue_wake_all(&pipe->write_wait);
+    poll_notify(&pipe->poll, EPOLLOUT);
+}
+
+static uint64_t page_alloc(pipe_t* pipe) {
+    uint64_t page = pipe->spare;
+    if (page) {
+        pipe->spare = 0;
+        return page;
+    }
+    return (uint64_t)pmm_alloc_page();
+}
+
+// Borrowed pages go back to their other owners; one of our own is kept
+static void buffer_release(pipe_t* pipe, struct pipe_buffer* buf) {
+    if (!(buf->flags & PIPE_BUF_BORROWED) && !pipe->spare) {
+        pipe->spare = buf->page;
+    } else {
+        pmm_page_put((void*)buf->page);
+    }
+}
+
+// Drop n bytes from the front of the ring
+static void pipe_consume(pipe_t* pipe, size_t n) {
+    while (n) {
+        struct pipe_buffer* buf = pipe_slot(pipe, pipe->tail);
+        uint32_t take = buf->len < n ? buf->len : (uint32_t)n;
+        buf->offset += take;
+        buf->len -= take;
+        pipe->bytes -= take;
+        n -= take;
+        if (!buf->len) {
+            buffer_release(pipe, buf);
+            pipe->tail++;
+        }
+    }
+}
+
+// Bytes a write can add right now: free slots plus the rest of the last page
+static size_t pipe_room(pipe_t* pipe) {
+    size_t room = (size_t)(pipe->slots - (pipe->head - pipe->tail)) * PAGE_SIZE;
+    if (pipe->head != pipe->tail) {
+        struct pipe_buffer* last = pipe_slot(pipe, pipe->head - 1);
+        if (!(last->flags & PIPE_BUF_BORROWED)) room += PAGE_SIZE - last->offset - last->len;
+    }
+    return room;
+}
+
+// Called with the lock held, returned with it held again
+static void wait_for_data(pipe_t* pipe) {
+    pipe_unlock(pipe);
+    wait_event(&pipe->read_wait, pipe->bytes || !pipe->writers);
+    pipe_lock(pipe);
+}
+
+static void wait_for_room(pipe_t* pipe) {
+    pipe_unlock(pipe);
+    wait_event(&pipe->write_wait, !pipe_full(pipe) || !pipe->readers);
+    pipe_lock(pipe);
+}
+
+// 1 once there is data, 0 at EOF, -EAGAIN instead of waiting
+static ssize_t wait_readable(pipe_t* pipe, bool nonblock) {
+    while (!pipe->bytes) {
+        if (!pipe->writers) return 0;
+        if (nonblock) return -EAGAIN;
+        wait_for_data(pipe);
+    }
+    return 1;
+}
+
 pipe_t* pipe_create(void) {
     pipe_t* pipe = malloc(sizeof(pipe_t));
     if (!pipe) return NULL;
+    memset(pipe, 0, sizeof(pipe_t));
 
-    pipe->buffer = malloc(PIPE_BUFFER_SIZE);
-    if (!pipe->buffer) {
+    pipe->bufs = malloc(PIPE_DEFAULT_PAGES * sizeof(struct pipe_buffer));
+    if (!pipe->bufs) {
         free(pipe);
         return NULL;
     }
+    pipe->slots = PIPE_DEFAULT_PAGES;
 
-    pipe->read_pos = 0;
-    pipe->write_pos = 0;
-    pipe->count = 0;
-    pipe->state = PIPE_STATE_OPEN | PIPE_STATE_READABLE | PIPE_STATE_WRITABLE;
-    pipe->readers = 0;
-    pipe->writers = 0;
+    wait_queue_init(&pipe->lock_wait);
+    wait_queue_init(&pipe->read_wait);
+    wait_queue_init(&pipe->write_wait);
+    poll_head_init(&pipe->poll);
 
     return pipe;
 }
@@ -25,107 +148,386 @@ pipe_t* pipe_create(void) {
 void pipe_destroy(pipe_t* pipe) {
     if (!pipe) return;
 
-    if (pipe->buffer) {
-        free(pipe->buffer);
+    for (uint32_t i = pipe->tail; i != pipe->head; i++) {
+        pmm_page_put((void*)pipe_slot(pipe, i)->page);
     }
+    if (pipe->spare) pmm_free_page((void*)pipe->spare);
+    free(pipe->bufs);
     free(pipe);
 }
 
+ssize_t pipe_readv(pipe_t* pipe, struct iov_iter* iter, size_t count, bool nonblock) {
+    if (!count) return 0;
+
+    pipe_lock(pipe);
+    ssize_t result = wait_readable(pipe, nonblock);
+    if (result > 0) {
+        size_t done = 0;
+        while (done < count && pipe->bytes) {
+            struct pipe_buffer* buf = pipe_slot(pipe, pipe->tail);
+            size_t n = buf->len < count - done ? buf->len : count - done;
+            iov_copy_to_iter(iter, page_data(buf->page) + buf->offset, n);
+            pipe_consume(pipe, n);
+            done += n;
+        }
+        result = done;
+    }
+    pipe_unlock(pipe);
+
+    if (result > 0) wake_writers(pipe);
+    return result;
+}
+
+ssize_t pipe_writev(pipe_t* pipe, struct iov_iter* iter, size_t count, bool nonblock) {
+    if (!count) return 0;
+
+    // A small write waits for room for all of it, so it lands in one piece
+    size_t need = count <= PIPE_ATOMIC_BYTES ? count : 1;
+    size_t done = 0;
+    ssize_t error = 0;
+
+    pipe_lock(pipe);
+    while (done < count) {
+        if (!pipe->readers) {
+            error = -EPIPE;
+            break;
+        }
+        if (pipe_room(pipe) < (done ? 1 : need)) {
+            if (nonblock) {
+                error = -EAGAIN;
+                break;
+            }
+            // Let readers drain what is in already
+            if (done) wake_readers(pipe);
+            wait_for_room(pipe);
+            continue;
+        }
+
+        struct pipe_buffer* last = pipe->head != pipe->tail ? pipe_slot(pipe, pipe->head - 1) : NULL;
+        size_t n = count - done;
+        if (last && !(last->flags & PIPE_BUF_BORROWED) && last->offset + last->len < PAGE_SIZE) {
+            uint32_t end = last->offset + last->len;
+            if (n > PAGE_SIZE - end) n = PAGE_SIZE - end;
+            iov_copy_from_iter(iter, page_data(last->page) + end, n);
+            last->len += n;
+        } else {
+            uint64_t page = page_alloc(pipe);
+            if (!page) {
+                error = -ENOMEM;
+                break;
+            }
+            if (n > PAGE_SIZE) n = PAGE_SIZE;
+            iov_copy_from_iter(iter, page_data(page), n);
+            *pipe_slot(pipe, pipe->head) = (struct pipe_buffer){ page, 0, (uint32_t)n, 0 };
+            pipe->head++;
+        }
+        pipe->bytes += n;
+        done += n;
+    }
+    pipe_unlock(pipe);
+
+    if (done) wake_readers(pipe);
+    return done ? (ssize_t)done : error;
+}
+
 ssize_t pipe_read(pipe_t* pipe, void* buf, size_t count) {
-    if (!pipe || !buf || !(pipe->state & PIPE_STATE_READABLE)) {
-        return -1;
+    struct iovec iov = { buf, count };
+    struct iov_iter iter;
+    iov_iter_init(&iter, &iov, 1);
+    return pipe_readv(pipe, &iter, count, false);
+}
+
+ssize_t pipe_write(pipe_t* pipe, const void* buf, size_t count) {
+    struct iovec iov = { (void*)buf, count };
+    struct iov_iter iter;
+    iov_iter_init(&iter, &iov, 1);
+    return pipe_writev(pipe, &iter, count, false);
+}
+
+// Both locked, src has data and dst a free slot
+static size_t pipe_move_locked(pipe_t* src, pipe_t* dst, size_t len) {
+    size_t moved = 0;
+    while (moved < len && src->bytes && !pipe_full(dst)) {
+        struct pipe_buffer* buf = pipe_slot(src, src->tail);
+        struct pipe_buffer* out = pipe_slot(dst, dst->head);
+        size_t n = buf->len < len - moved ? buf->len : len - moved;
+        if (n == buf->len) {
+            // The whole page changes hands
+            *out = *buf;
+            src->tail++;
+        } else {
+            // Both pipes keep part of the page, so neither may append to it
+            pmm_page_get((void*)buf->page);
+            *out = (struct pipe_buffer){ buf->page, buf->offset, (uint32_t)n, PIPE_BUF_BORROWED };
+            buf->offset += n;
+            buf->len -= n;
+            buf->flags |= PIPE_BUF_BORROWED;
+        }
+        dst->head++;
+        src->bytes -= n;
+        dst->bytes += n;
+        moved += n;
     }
+    return moved;
+}
 
-    // Block if pipe empty and has writers
-    while (pipe->count == 0) {
-        if (pipe->writers == 0 || (pipe->state & PIPE_STATE_EOF)) {
-            return 0; // EOF
+static ssize_t pipe_move(pipe_t* src, pipe_t* dst, size_t len, bool nonblock) {
+    if (src == dst) return -EINVAL;
+
+    ssize_t result = 0;
+    pipe_lock_pair(src, dst);
+    for (;;) {
+        if (!src->bytes && !src->writers) break;
+        if (!dst->readers) {
+            result = -EPIPE;
+            break;
+        }
+        if (src->bytes && !pipe_full(dst)) {
+            result = pipe_move_locked(src, dst, len);
+            break;
+        }
+        if (nonblock) {
+            result = -EAGAIN;
+            break;
+        }
+        bool empty = !src->bytes;
+        pipe_unlock_pair(src, dst);
+        if (empty) {
+            wait_event(&src->read_wait, src->bytes || !src->writers);
+        } else {
+            wait_event(&dst->write_wait, !pipe_full(dst) || !dst->readers);
         }
-        // Would normally sleep here
+        pipe_lock_pair(src, dst);
     }
+    pipe_unlock_pair(src, dst);
 
-    size_t bytes_read = 0;
-    uint8_t* dest = buf;
+    if (result > 0) {
+        wake_writers(src);
+        wake_readers(dst);
+    }
+    return result;
+}
 
-    // Read either requested bytes or available bytes, whichever is smaller
-    size_t to_read = (count < pipe->count) ? count : pipe->count;
+ssize_t pipe_splice_to(pipe_t* pipe, struct file* out, size_t len, off_t pos, bool nonblock) {
+    if (!len) return 0;
+    if (out->type == FD_TYPE_PIPE) return pipe_move(pipe, out->private_data, len, nonblock);
 
-    while (bytes_read < to_read) {
-        dest[bytes_read++] = pipe->buffer[pipe->read_pos];
-        pipe->read_pos = (pipe->read_pos + 1) & (PIPE_BUFFER_SIZE - 1);
-        pipe->count--;
+    pipe_lock(pipe);
+    ssize_t result = wait_readable(pipe, nonblock);
+    if (result > 0) {
+        // The buffered pages themselves are the source
+        struct iovec runs[PIPE_SPLICE_PAGES];
+        int count = 0;
+        size_t total = 0;
+        for (uint32_t i = pipe->tail; i != pipe->head && count < PIPE_SPLICE_PAGES && total < len; i++) {
+            struct pipe_buffer* buf = pipe_slot(pipe, i);
+            size_t n = buf->len < len - total ? buf->len : len - total;
+            runs[count].iov_base = page_data(buf->page) + buf->offset;
+            runs[count].iov_len = n;
+            count++;
+            total += n;
+        }
+        result = file_writev(out, runs, count, total, pos);
+        if (result > 0) pipe_consume(pipe, result);
     }
+    pipe_unlock(pipe);
 
-    return bytes_read;
+    if (result > 0) wake_writers(pipe);
+    return result;
 }
 
-ssize_t pipe_write(pipe_t* pipe, const void* buf, size_t count) {
-    if (!pipe || !buf || !(pipe->state & PIPE_STATE_WRITABLE)) {
-        return -1;
+ssize_t pipe_splice_from(pipe_t* pipe, struct file* in, size_t len, off_t pos, bool nonblock) {
+    if (!len) return 0;
+    if (in->type == FD_TYPE_PIPE) return pipe_move(in->private_data, pipe, len, nonblock);
+
+    ssize_t result = 0;
+    pipe_lock(pipe);
+    for (;;) {
+        if (!pipe->readers) {
+            result = -EPIPE;
+            break;
+        }
+        if (!pipe_full(pipe)) break;
+        if (nonblock) {
+            result = -EAGAIN;
+            break;
+        }
+        wait_for_room(pipe);
     }
 
-    // Check if anyone is reading
-    if (pipe->readers == 0) {
-        // SIGPIPE would be sent here
-        return -1;
+    if (!result) {
+        // Read straight into fresh pages for as many free slots as len needs
+        uint64_t pages[PIPE_SPLICE_PAGES];
+        struct iovec runs[PIPE_SPLICE_PAGES];
+        uint32_t free_slots = pipe->slots - (pipe->head - pipe->tail);
+        uint32_t count = 0;
+        size_t total = 0;
+        while (count < PIPE_SPLICE_PAGES && count < free_slots && total < len) {
+            uint64_t page = page_alloc(pipe);
+            if (!page) break;
+            size_t n = len - total < PAGE_SIZE ? len - total : PAGE_SIZE;
+            pages[count] = page;
+            runs[count].iov_base = page_data(page);
+            runs[count].iov_len = n;
+            count++;
+            total += n;
+        }
+
+        if (!count) {
+            result = -ENOMEM;
+        } else {
+            result = file_readv(in, runs, (int)count, total, pos);
+            size_t left = result > 0 ? (size_t)result : 0;
+            for (uint32_t i = 0; i < count; i++) {
+                size_t n = left < runs[i].iov_len ? left : runs[i].iov_len;
+                if (n) {
+                    *pipe_slot(pipe, pipe->head) = (struct pipe_buffer){ pages[i], 0, (uint32_t)n, 0 };
+                    pipe->head++;
+                    pipe->bytes += n;
+                    left -= n;
+                } else if (!pipe->spare) {
+                    pipe->spare = pages[i];
+                } else {
+                    pmm_free_page((void*)pages[i]);
+                }
+            }
+        }
     }
+    pipe_unlock(pipe);
+
+    if (result > 0) wake_readers(pipe);
+    return result;
+}
 
-    const uint8_t* src = buf;
-    size_t bytes_written = 0;
+ssize_t pipe_vmsplice(pipe_t* pipe, const struct iovec* iov, int iovcnt, bool nonblock) {
+    size_t done = 0;
+    ssize_t error = 0;
 
-    while (bytes_written < count) {
-        // Block if pipe is full
-        while (pipe->count == PIPE_BUFFER_SIZE) {
-            if (pipe->readers == 0) {
-                return bytes_written > 0 ? bytes_written : -1;
+    pipe_lock(pipe);
+    for (int i = 0; i < iovcnt && !error; i++) {
+        uint64_t addr = (uint64_t)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left) {
+            if (!pipe->readers) {
+                error = -EPIPE;
+                break;
             }
-            // Would normally sleep here
+            if (pipe_full(pipe)) {
+                if (nonblock) {
+                    error = -EAGAIN;
+                    break;
+                }
+                if (done) wake_readers(pipe);
+                wait_for_room(pipe);
+                continue;
+            }
+            if (addr >= KERNEL_HALF_BASE) {
+                error = -EFAULT;
+                break;
+            }
+
+            // One buffer per page the segment touches
+            size_t n = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+            if (n > left) n = left;
+
+            // Fault the page in as a read would, then share the frame
+            (void)*(volatile uint8_t*)addr;
+            uint64_t frame = vmm_share_user_page(addr);
+            if (!frame) {
+                error = -EFAULT;
+                break;
+            }
+            *pipe_slot(pipe, pipe->head) = (struct pipe_buffer){
+                frame, (uint32_t)(addr & (PAGE_SIZE - 1)), (uint32_t)n, PIPE_BUF_BORROWED
+            };
+            pipe->head++;
+            pipe->bytes += n;
+            done += n;
+            addr += n;
+            left -= n;
         }
+    }
+    pipe_unlock(pipe);
+
+    if (done) wake_readers(pipe);
+    return done ? (ssize_t)done : error;
+}
+
+size_t pipe_get_size(pipe_t* pipe) {
+    return (size_t)pipe->slots * PAGE_SIZE;
+}
+
+ssize_t pipe_set_size(pipe_t* pipe, size_t bytes) {
+    uint32_t pages = 1;
+    while ((size_t)pages * PAGE_SIZE < bytes && pages < PIPE_MAX_PAGES) pages <<= 1;
+    if ((size_t)pages * PAGE_SIZE < bytes) return -EPERM;
 
-        // Write data
-        pipe->buffer[pipe->write_pos] = src[bytes_written++];
-        pipe->write_pos = (pipe->write_pos + 1) & (PIPE_BUFFER_SIZE - 1);
-        pipe->count++;
+    struct pipe_buffer* bufs = malloc(pages * sizeof(struct pipe_buffer));
+    if (!bufs) return -ENOMEM;
+
+    pipe_lock(pipe);
+    uint32_t used = pipe->head - pipe->tail;
+    if (used > pages) {
+        pipe_unlock(pipe);
+        free(bufs);
+        return -EBUSY;
+    }
+    for (uint32_t i = 0; i < used; i++) {
+        bufs[i] = *pipe_slot(pipe, pipe->tail + i);
     }
+    free(pipe->bufs);
+    pipe->bufs = bufs;
+    pipe->slots = pages;
+    pipe->tail = 0;
+    pipe->head = used;
+    pipe_unlock(pipe);
 
-    return bytes_written;
+    wake_writers(pipe);
+    return (ssize_t)pages * PAGE_SIZE;
 }
 
 void pipe_add_reader(pipe_t* pipe) {
-    if (!pipe) return;
+    pipe_lock(pipe);
     pipe->readers++;
-    pipe->state |= PIPE_STATE_READABLE;
+    __atomic_add_fetch(&pipe->ends, 1, __ATOMIC_ACQ_REL);
+    pipe_unlock(pipe);
 }
 
 void pipe_add_writer(pipe_t* pipe) {
-    if (!pipe) return;
+    pipe_lock(pipe);
     pipe->writers++;
-    pipe->state |= PIPE_STATE_WRITABLE;
+    __atomic_add_fetch(&pipe->ends, 1, __ATOMIC_ACQ_REL);
+    pipe_unlock(pipe);
 }
 
-void pipe_remove_reader(pipe_t* pipe) {
-    if (!pipe || pipe->readers == 0) return;
-    pipe->readers--;
-    if (pipe->readers == 0) {
-        pipe->state &= ~PIPE_STATE_READABLE;
+// The peers are told while the lock still pins the pipe; it is freed only
+// after our unlock, once nobody else can be inside it
+static void pipe_drop_end(pipe_t* pipe, volatile uint32_t* count, struct wait_queue* peers, uint32_t event) {
+    pipe_lock(pipe);
+    if (*count && !--*count) {
+        wait_queue_wake_all(peers);
+        poll_notify(&pipe->poll, event);
     }
+    pipe_unlock(pipe);
+    if (__atomic_sub_fetch(&pipe->ends, 1, __ATOMIC_ACQ_REL) == 0) pipe_destroy(pipe);
 }
 
-void pipe_remove_writer(pipe_t* pipe) {
-    if (!pipe || pipe->writers == 0) return;
-    pipe->writers--;
-    if (pipe->writers == 0) {
-        pipe->state &= ~PIPE_STATE_WRITABLE;
-        pipe->state |= PIPE_STATE_EOF;
-    }
+void pipe_remove_reader(pipe_t* pipe) {
+    // Writers fail with -EPIPE from here on
+    pipe_drop_end(pipe, &pipe->readers, &pipe->write_wait, EPOLLERR);
 }
 
-bool pipe_is_readable(pipe_t* pipe) {
-    return pipe && (pipe->state & PIPE_STATE_READABLE) &&
-           (pipe->count > 0 || pipe->writers > 0);
+void pipe_remove_writer(pipe_t* pipe) {
+    // Readers see EOF once the data is gone
+    pipe_drop_end(pipe, &pipe->writers, &pipe->read_wait, EPOLLHUP);
 }
 
-bool pipe_is_writable(pipe_t* pipe) {
-    return pipe && (pipe->state & PIPE_STATE_WRITABLE) &&
-           pipe->readers > 0 && pipe->count < PIPE_BUFFER_SIZE;
-}
\ No newline at end of file
+uint32_t pipe_poll(pipe_t* pipe, bool writer) {
+    if (writer) {
+        if (!pipe->readers) return EPOLLERR;
+        return pipe_full(pipe) ? 0 : EPOLLOUT;
+    }
+    uint32_t events = pipe->bytes ? EPOLLIN : 0;
+    if (!pipe->writers) events |= EPOLLHUP;
+    return events;
+}
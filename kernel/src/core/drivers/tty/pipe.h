@@ -5,55 +5,87 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <core/syscalls.h>
+#include <core/wait.h>
+#include <fs/epoll.h>
+#include <fs/file.h>
 
-// Pipe buffer size (must be power of 2)
-#define PIPE_BUFFER_SIZE 4096
-
-// Pipe states
-#define PIPE_STATE_OPEN     0x1
-#define PIPE_STATE_READABLE 0x2
-#define PIPE_STATE_WRITABLE 0x4
-#define PIPE_STATE_EOF      0x8
-
-// Pipe structure
-typedef struct {
-    uint8_t* buffer;           // Circular buffer
-    uint32_t read_pos;         // Read position
-    uint32_t write_pos;        // Write position
-    uint32_t count;            // Number of bytes in buffer
-    uint32_t state;            // Pipe state flags
-    uint32_t readers;          // Number of reading processes
-    uint32_t writers;          // Number of writing processes
+// A pipe is a ring of page buffers. Writers fill the newest page and start
+// another while the ring has room; readers copy out and drop each page as
+// it empties. splice() and vmsplice() move whole pages in and out without
+// copying them.
+
+#define PIPE_DEFAULT_PAGES  16      // 64 KiB
+#define PIPE_MAX_PAGES      256     // Largest F_SETPIPE_SZ, 1 MiB
+
+// Writes up to this size are never interleaved with other writers'
+#define PIPE_ATOMIC_BYTES   4096
+
+// The page is shared with a user mapping or another pipe: read it, never append to it
+#define PIPE_BUF_BORROWED   (1 << 0)
+
+struct pipe_buffer {
+    uint64_t page;              // Physical frame, one reference held
+    uint32_t offset;            // First unread byte
+    uint32_t len;               // Unread bytes
+    uint32_t flags;
+};
+
+typedef struct pipe {
+    // The ring and counts are changed only under this sleeping lock, as
+    // copies to and from user memory may fault
+    volatile bool locked;
+    struct wait_queue lock_wait;
+
+    struct pipe_buffer* bufs;  // Ring of slots, a power of two
+    uint32_t slots;
+    volatile uint32_t head;    // Next slot to fill; head - tail are in use
+    volatile uint32_t tail;
+    volatile size_t bytes;     // Unread, in every slot
+    uint64_t spare;            // An emptied page kept for the next write
+    volatile uint32_t readers; // Open read ends
+    volatile uint32_t writers; // Open write ends
+    volatile uint32_t ends;    // Both together; dropping the last frees the pipe
+    struct wait_queue read_wait;   // Readers waiting for data or EOF
+    struct wait_queue write_wait;  // Writers waiting for a free slot
+    struct poll_head poll;         // Epoll watchers, told on every state change
 } pipe_t;
 
-// Create a new pipe
+// A pipe with no ends; the last pipe_remove_*() frees it
 pipe_t* pipe_create(void);
-
-// Destroy a pipe and free its resources
 void pipe_destroy(pipe_t* pipe);
 
-// Read from pipe
-ssize_t pipe_read(pipe_t* pipe, void* buf, size_t count);
+// Copy into or out of the pipe through an iterator over count bytes. Reads
+// wait for data and return 0 at EOF; writes wait for room and fail with
+// -EPIPE once nobody reads. nonblock gives -EAGAIN instead of waiting.
+ssize_t pipe_readv(pipe_t* pipe, struct iov_iter* iter, size_t count, bool nonblock);
+ssize_t pipe_writev(pipe_t* pipe, struct iov_iter* iter, size_t count, bool nonblock);
 
-// Write to pipe
+// The same from a flat kernel or user buffer, blocking
+ssize_t pipe_read(pipe_t* pipe, void* buf, size_t count);
 ssize_t pipe_write(pipe_t* pipe, const void* buf, size_t count);
 
-// Add reader to pipe
-void pipe_add_reader(pipe_t* pipe);
+// Write buffered pages straight to out at pos (-1 for its offset), or read
+// from in straight into new pages, at most len bytes. Between two pipes the
+// pages themselves move.
+ssize_t pipe_splice_to(pipe_t* pipe, struct file* out, size_t len, off_t pos, bool nonblock);
+ssize_t pipe_splice_from(pipe_t* pipe, struct file* in, size_t len, off_t pos, bool nonblock);
 
-// Add writer to pipe
-void pipe_add_writer(pipe_t* pipe);
+// Hand the user pages behind iov to the pipe without copying them. They
+// turn copy-on-write for the caller, so later writes to the buffers do not
+// change what the reader sees.
+ssize_t pipe_vmsplice(pipe_t* pipe, const struct iovec* iov, int iovcnt, bool nonblock);
 
-// Remove reader from pipe
-void pipe_remove_reader(pipe_t* pipe);
+// Capacity in bytes; setting rounds up to a power of two pages, and fails
+// with -EBUSY if more is buffered than would fit
+size_t pipe_get_size(pipe_t* pipe);
+ssize_t pipe_set_size(pipe_t* pipe, size_t bytes);
 
-// Remove writer from pipe
+void pipe_add_reader(pipe_t* pipe);
+void pipe_add_writer(pipe_t* pipe);
+void pipe_remove_reader(pipe_t* pipe);
 void pipe_remove_writer(pipe_t* pipe);
 
-// Check if pipe is readable
-bool pipe_is_readable(pipe_t* pipe);
-
-// Check if pipe is writable
-bool pipe_is_writable(pipe_t* pipe);
+// EPOLL* events for the read or the write end
+uint32_t pipe_poll(pipe_t* pipe, bool writer);
 
-#endif // TTY_PIPE_H
\ No newline at end of file
+#endif // TTY_PIPE_H
@@ -11,26 +11,50 @@ extern struct limine_framebuffer* global_framebuffer;
 static tty_device_t tty_devices[TTY_MAX_DEVICES];
 static uint32_t tty_count = 0;
 
-// Wrapper functions to match function pointer signatures
-static void console_write_char(char c) {
-    draw_char(global_framebuffer, c,
-             global_framebuffer->width / 8 * (c % 80),  // Basic wrapping
-             global_framebuffer->height / 16 * ((c / 80) % 25),
-             WHITE);
+// Framebuffer console: cells are glyphs, scrolling moves the back buffer
+static void console_draw_span(tty_device_t* tty, uint32_t x, uint32_t y, const char* cells, uint32_t count) {
+    (void)tty;
+    for (uint32_t i = 0; i < count; i++) {
+        draw_glyph(global_framebuffer, cells[i], (x + i) * DISPLAY_GLYPH_WIDTH, y * DISPLAY_GLYPH_HEIGHT,
+                   WHITE, BLACK);
+    }
+}
+
+static void console_scroll(tty_device_t* tty, uint32_t lines) {
+    (void)tty;
+    display_scroll(global_framebuffer, lines * DISPLAY_GLYPH_HEIGHT, BLACK);
+}
+
+static void console_flush(tty_device_t* tty) {
+    (void)tty;
+    display_flush(global_framebuffer);
 }
 
 static char console_read_char(void) {
     return serial_read_char(COM1);
 }
 
-static void serial_write_wrapper(char c) {
-    serial_write_char(COM1, c);
+static void serial_write_raw(const char* buf, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        serial_write_char(COM1, buf[i]);
+    }
 }
 
 static char serial_read_wrapper(void) {
     return serial_read_char(COM1);
 }
 
+static const struct tty_backend console_backend = {
+    .draw_span = console_draw_span,
+    .scroll = console_scroll,
+    .flush = console_flush,
+};
+
+// The terminal on the other end does its own parsing
+static const struct tty_backend serial_backend = {
+    .write_raw = serial_write_raw,
+};
+
 // Initialize TTY subsystem
 void tty_init(void) {
     memset(tty_devices, 0, sizeof(tty_devices));
@@ -39,12 +63,17 @@ void tty_init(void) {
     // Initialize console TTY
     tty_device_t* console = tty_create("console");
     if (console) {
-        console->rows = global_framebuffer->height / 16; // Assuming 16px font height
-        console->cols = global_framebuffer->width / 8;   // Assuming 8px font width
+        console->rows = global_framebuffer->height / DISPLAY_GLYPH_HEIGHT;
+        console->cols = global_framebuffer->width / DISPLAY_GLYPH_WIDTH;
         console->flags = TTY_FLAG_ECHO | TTY_FLAG_CANONICAL;
 
-        // Set up console callbacks with wrapper functions
-        console->write_char = console_write_char;
+        // The screen and its scrollback, blank
+        console->lines = console->rows + TTY_SCROLLBACK;
+        console->cells = malloc((size_t)console->lines * console->cols);
+        if (console->cells) {
+            memset(console->cells, ' ', (size_t)console->lines * console->cols);
+            console->backend = &console_backend;
+        }
         console->read_char = console_read_char;
     }
 
@@ -55,8 +84,7 @@ void tty_init(void) {
         serial->cols = 80;
         serial->flags = TTY_FLAG_ECHO | TTY_FLAG_CANONICAL;
 
-        // Set up serial callbacks with wrapper functions
-        serial->write_char = serial_write_wrapper;
+        serial->backend = &serial_backend;
         serial->read_char = serial_read_wrapper;
     }
 }
@@ -71,6 +99,7 @@ tty_device_t* tty_create(const char* name) {
     memset(tty, 0, sizeof(tty_device_t));
 
     strncpy(tty->name, name, TTY_NAME_MAX - 1);
+    spinlock_init(&tty->lock);
     tty->state = TTY_STATE_ACTIVE;
 
     return tty;
@@ -83,28 +112,218 @@ void tty_destroy(tty_device_t* tty) {
     // Clear buffers
     memset(tty->input_buffer, 0, TTY_BUFFER_SIZE);
     memset(tty->output_buffer, 0, TTY_BUFFER_SIZE);
+    if (tty->cells) {
+        free(tty->cells);
+        tty->cells = NULL;
+    }
 
     tty->state = TTY_STATE_UNUSED;
 }
 
+// Screen row y of the cell ring
+static inline char* tty_row(tty_device_t* tty, uint32_t y) {
+    return tty->cells + (size_t)((tty->line_start + y) % tty->lines) * tty->cols;
+}
+
+// Cells changed on screen are drawn unless the view is back in history
+static inline void tty_draw(tty_device_t* tty, uint32_t x, uint32_t y, uint32_t count) {
+    if (count && !tty->view_offset) tty->backend->draw_span(tty, x, y, tty_row(tty, y) + x, count);
+}
+
+// Blank columns x0 to x1 (exclusive) of screen row y
+static void tty_erase(tty_device_t* tty, uint32_t y, uint32_t x0, uint32_t x1) {
+    if (x1 > tty->cols) x1 = tty->cols;
+    if (y >= tty->rows || x0 >= x1) return;
+    memset(tty_row(tty, y) + x0, ' ', x1 - x0);
+    tty_draw(tty, x0, y, x1 - x0);
+}
+
+// Show the screen as the view has it, scrolled back or not
+static void tty_redraw(tty_device_t* tty) {
+    for (uint32_t y = 0; y < tty->rows; y++) {
+        uint32_t line = (tty->line_start + tty->lines - tty->view_offset + y) % tty->lines;
+        tty->backend->draw_span(tty, 0, y, tty->cells + (size_t)line * tty->cols, tty->cols);
+    }
+}
+
+// Up the screen by lines: the ring's start moves, the new bottom lines are
+// blanked, and the backend moves its picture the same way. Lock held.
+static void tty_scroll_locked(tty_device_t* tty, uint32_t lines) {
+    if (lines > tty->rows) lines = tty->rows;
+    tty->line_start = (tty->line_start + lines) % tty->lines;
+    tty->history += lines;
+    if (tty->history > tty->lines - tty->rows) tty->history = tty->lines - tty->rows;
+
+    for (uint32_t y = tty->rows - lines; y < tty->rows; y++) {
+        memset(tty_row(tty, y), ' ', tty->cols);
+    }
+    if (!tty->view_offset) tty->backend->scroll(tty, lines);
+}
+
+static void tty_newline(tty_device_t* tty) {
+    tty->cursor_x = 0;
+    tty->cursor_y++;
+    if (tty->cursor_y >= tty->rows) {
+        tty_scroll_locked(tty, 1);
+        tty->cursor_y = tty->rows - 1;
+    }
+}
+
+// Printable bytes into the cells from the cursor, wrapping as needed, each
+// piece on a line going to the backend in one call
+static void tty_put_run(tty_device_t* tty, const char* buf, size_t count) {
+    while (count) {
+        if (tty->cursor_x >= tty->cols) tty_newline(tty);
+
+        uint32_t run = tty->cols - tty->cursor_x;
+        if (run > count) run = (uint32_t)count;
+        memcpy(tty_row(tty, tty->cursor_y) + tty->cursor_x, buf, run);
+        tty_draw(tty, tty->cursor_x, tty->cursor_y, run);
+
+        tty->cursor_x += run;
+        buf += run;
+        count -= run;
+    }
+}
+
+static inline uint32_t esc_param(tty_device_t* tty, uint32_t i, uint32_t fallback) {
+    return (i < tty->esc_count && tty->esc_params[i]) ? tty->esc_params[i] : fallback;
+}
+
+// Act on a complete CSI sequence ending in final
+static void tty_csi(tty_device_t* tty, char final) {
+    uint32_t n = esc_param(tty, 0, 1);
+    switch (final) {
+        case 'A':  // Cursor up
+            tty->cursor_y = n > tty->cursor_y ? 0 : tty->cursor_y - n;
+            break;
+
+        case 'B':  // Cursor down
+            tty->cursor_y = (tty->cursor_y + n >= tty->rows) ? tty->rows - 1 : tty->cursor_y + n;
+            break;
+
+        case 'C':  // Cursor right
+            tty->cursor_x = (tty->cursor_x + n >= tty->cols) ? tty->cols - 1 : tty->cursor_x + n;
+            break;
+
+        case 'D':  // Cursor left
+            if (tty->cursor_x > tty->cols - 1) tty->cursor_x = tty->cols - 1;
+            tty->cursor_x = n > tty->cursor_x ? 0 : tty->cursor_x - n;
+            break;
+
+        case 'H':  // Position, 1-based row;column
+        case 'f':
+            tty_set_cursor(tty, esc_param(tty, 1, 1) - 1, esc_param(tty, 0, 1) - 1);
+            break;
+
+        case 'J':  // Erase display: 0 to the end, 1 from the start, 2 all
+            switch (esc_param(tty, 0, 0)) {
+                case 0:
+                    tty_erase(tty, tty->cursor_y, tty->cursor_x, tty->cols);
+                    for (uint32_t y = tty->cursor_y + 1; y < tty->rows; y++) tty_erase(tty, y, 0, tty->cols);
+                    break;
+                case 1:
+                    for (uint32_t y = 0; y < tty->cursor_y; y++) tty_erase(tty, y, 0, tty->cols);
+                    tty_erase(tty, tty->cursor_y, 0, tty->cursor_x + 1);
+                    break;
+                default:
+                    // Pushed into the scrollback rather than lost
+                    tty_scroll_locked(tty, tty->rows);
+                    break;
+            }
+            break;
+
+        case 'K':  // Erase line, the same way
+            switch (esc_param(tty, 0, 0)) {
+                case 0: tty_erase(tty, tty->cursor_y, tty->cursor_x, tty->cols); break;
+                case 1: tty_erase(tty, tty->cursor_y, 0, tty->cursor_x + 1); break;
+                default: tty_erase(tty, tty->cursor_y, 0, tty->cols); break;
+            }
+            break;
+
+        default:
+            // Attributes and the rest are accepted and ignored
+            break;
+    }
+}
+
+// One byte of an escape sequence; the parser keeps its place between
+// calls, so sequences may be any length and split across writes
+static void tty_escape_byte(tty_device_t* tty, char c) {
+    if (c == '\033') {
+        tty->esc_state = TTY_ESC_START;
+        return;
+    }
+    if (c == 0x18 || c == 0x1A) {  // CAN and SUB abandon the sequence
+        tty->esc_state = TTY_ESC_NONE;
+        return;
+    }
+
+    if (tty->esc_state == TTY_ESC_START) {
+        if (c == '[') {
+            tty->esc_state = TTY_ESC_CSI;
+            tty->esc_count = 0;
+            memset(tty->esc_params, 0, sizeof(tty->esc_params));
+        } else {
+            if (c == 'c') {  // Reset
+                tty_scroll_locked(tty, tty->rows);
+                tty->cursor_x = tty->cursor_y = 0;
+            }
+            tty->esc_state = TTY_ESC_NONE;
+        }
+        return;
+    }
+
+    if (c >= '0' && c <= '9') {
+        if (!tty->esc_count) tty->esc_count = 1;
+        uint16_t* param = &tty->esc_params[tty->esc_count - 1];
+        if (*param < 10000) *param = *param * 10 + (c - '0');
+    } else if (c == ';') {
+        if (!tty->esc_count) tty->esc_count = 1;
+        if (tty->esc_count < TTY_ESC_MAX_PARAMS) tty->esc_count++;
+    } else if (c >= 0x40 && c <= 0x7E) {
+        tty_csi(tty, c);
+        tty->esc_state = TTY_ESC_NONE;
+    }
+    // Private markers and intermediates are skipped
+}
+
 // Write to TTY
 int tty_write(tty_device_t* tty, const char* buf, size_t count) {
-    if (!tty || !buf || tty->state != TTY_STATE_ACTIVE) {
+    if (!tty || !buf || tty->state != TTY_STATE_ACTIVE || !tty->backend) {
         return -1;
     }
 
-    size_t written = 0;
-    for (size_t i = 0; i < count; i++) {
-        char c = buf[i];
+    if (!tty->backend->draw_span) {
+        tty->backend->write_raw(buf, count);
+        return count;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&tty->lock);
+    if (tty->view_offset) {
+        tty->view_offset = 0;
+        tty_redraw(tty);
+    }
+
+    size_t i = 0;
+    while (i < count) {
+        if (tty->esc_state != TTY_ESC_NONE) {
+            tty_escape_byte(tty, buf[i++]);
+            continue;
+        }
+
+        // A run of printable bytes goes out in one piece per line
+        size_t run = i;
+        while (run < count && (unsigned char)buf[run] >= 0x20 && buf[run] != 0x7F) run++;
+        if (run > i) {
+            tty_put_run(tty, buf + i, run - i);
+            i = run;
+            continue;
+        }
 
-        // Handle special characters
+        char c = buf[i++];
         if (c == '\n') {
-            tty->cursor_x = 0;
-            tty->cursor_y++;
-            if (tty->cursor_y >= tty->rows) {
-                tty_scroll(tty, 1);
-                tty->cursor_y = tty->rows - 1;
-            }
+            tty_newline(tty);
         } else if (c == '\r') {
             tty->cursor_x = 0;
         } else if (c == '\b') {
@@ -113,41 +332,15 @@ int tty_write(tty_device_t* tty, const char* buf, size_t count) {
             }
         } else if (c == '\t') {
             tty->cursor_x = (tty->cursor_x + 8) & ~7;
+            if (tty->cursor_x > tty->cols) tty->cursor_x = tty->cols;
         } else if (c == '\033') {
-            // Handle escape sequences
-            if (i + 1 < count) {
-                size_t seq_len = 0;
-                while (i + 1 + seq_len < count && buf[i + 1 + seq_len] != '\033') {
-                    seq_len++;
-                }
-                if (seq_len > 0) {
-                    char seq[32];
-                    memcpy(seq, buf + i + 1, seq_len);
-                    seq[seq_len] = '\0';
-                    tty_process_escape_sequence(tty, seq);
-                    i += seq_len;
-                }
-            }
-        } else {
-            // Regular character
-            if (tty->write_char) {
-                tty->write_char(c);
-                written++;
-            }
-
-            tty->cursor_x++;
-            if (tty->cursor_x >= tty->cols) {
-                tty->cursor_x = 0;
-                tty->cursor_y++;
-                if (tty->cursor_y >= tty->rows) {
-                    tty_scroll(tty, 1);
-                    tty->cursor_y = tty->rows - 1;
-                }
-            }
+            tty_escape_byte(tty, c);
         }
     }
 
-    return written;
+    if (tty->backend->flush) tty->backend->flush(tty);
+    spinlock_release_irqrestore(&tty->lock, flags);
+    return count;
 }
 
 // Read from TTY
@@ -164,9 +357,7 @@ int tty_read(tty_device_t* tty, char* buf, size_t count) {
             if (!c) break;
 
             if (tty->flags & TTY_FLAG_ECHO) {
-                if (tty->write_char) {
-                    tty->write_char(c);
-                }
+                tty_write(tty, &c, 1);
             }
 
             if (c == '\n') {
@@ -224,6 +415,15 @@ void tty_input_putc(tty_device_t* tty, char c) {
     tty->input_buffer[tty->input_tail] = c;
     tty->input_tail = (tty->input_tail + 1) % TTY_BUFFER_SIZE;
     tty->input_count++;
+
+    // Only the first byte makes the TTY readable
+    if (tty->input_count == 1) poll_notify(&tty->poll, EPOLLIN);
+}
+
+uint32_t tty_poll(tty_device_t* tty) {
+    if (!tty || tty->state != TTY_STATE_ACTIVE) return EPOLLHUP;
+    return (tty->input_count ? EPOLLIN : 0) |
+           (tty->output_count < TTY_BUFFER_SIZE ? EPOLLOUT : 0);
 }
 
 char tty_input_getc(tty_device_t* tty) {
@@ -258,9 +458,11 @@ char tty_output_getc(tty_device_t* tty) {
 void tty_clear(tty_device_t* tty) {
     if (!tty) return;
 
-    // Clear screen using framebuffer
-    if (global_framebuffer) {
-        clear_screen(global_framebuffer);
+    if (tty->cells) {
+        uint64_t flags = spinlock_acquire_irqsave(&tty->lock);
+        tty_scroll_locked(tty, tty->rows);
+        if (tty->backend->flush) tty->backend->flush(tty);
+        spinlock_release_irqrestore(&tty->lock, flags);
     }
 
     tty->cursor_x = 0;
@@ -275,59 +477,35 @@ void tty_set_cursor(tty_device_t* tty, uint32_t x, uint32_t y) {
 }
 
 void tty_scroll(tty_device_t* tty, int lines) {
-    if (!tty || lines <= 0) return;
-
-    if (global_framebuffer) {
-        // Scroll framebuffer content up
-        uint32_t line_height = 16;  // Assuming 16px font height
-        uint32_t scroll_size = lines * line_height;
-
-        if (scroll_size < global_framebuffer->height) {
-            memmove((void*)global_framebuffer->address,
-                   (void*)(global_framebuffer->address + scroll_size * global_framebuffer->pitch),
-                   (global_framebuffer->height - scroll_size) * global_framebuffer->pitch);
-
-            // Clear new lines at bottom
-            memset((void*)(global_framebuffer->address +
-                   (global_framebuffer->height - scroll_size) * global_framebuffer->pitch),
-                   0,
-                   scroll_size * global_framebuffer->pitch);
-        }
-    }
+    if (!tty || lines <= 0 || !tty->cells) return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&tty->lock);
+    tty_scroll_locked(tty, (uint32_t)lines);
+    if (tty->backend->flush) tty->backend->flush(tty);
+    spinlock_release_irqrestore(&tty->lock, flags);
 }
 
 void tty_process_escape_sequence(tty_device_t* tty, const char* seq) {
-    if (!tty || !seq) return;
-
-    // Handle basic VT100 escape sequences
-    if (seq[0] == '[') {
-        char cmd = seq[strlen(seq) - 1];
-        switch (cmd) {
-            case 'H':  // Home
-                tty_set_cursor(tty, 0, 0);
-                break;
-
-            case 'J':  // Clear screen
-                if (seq[1] == '2') {
-                    tty_clear(tty);
-                }
-                break;
-
-            case 'A':  // Cursor up
-                if (tty->cursor_y > 0) tty->cursor_y--;
-                break;
-
-            case 'B':  // Cursor down
-                if (tty->cursor_y < tty->rows - 1) tty->cursor_y++;
-                break;
+    if (!tty || !seq || !tty->cells) return;
 
-            case 'C':  // Cursor right
-                if (tty->cursor_x < tty->cols - 1) tty->cursor_x++;
-                break;
+    uint64_t flags = spinlock_acquire_irqsave(&tty->lock);
+    tty_escape_byte(tty, '\033');
+    while (*seq) tty_escape_byte(tty, *seq++);
+    if (tty->backend->flush) tty->backend->flush(tty);
+    spinlock_release_irqrestore(&tty->lock, flags);
+}
 
-            case 'D':  // Cursor left
-                if (tty->cursor_x > 0) tty->cursor_x--;
-                break;
-        }
+void tty_scrollback(tty_device_t* tty, int lines) {
+    if (!tty || !tty->cells || !lines) return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&tty->lock);
+    int64_t offset = (int64_t)tty->view_offset + lines;
+    if (offset < 0) offset = 0;
+    if (offset > tty->history) offset = tty->history;
+    if ((uint32_t)offset != tty->view_offset) {
+        tty->view_offset = (uint32_t)offset;
+        tty_redraw(tty);
+        if (tty->backend->flush) tty->backend->flush(tty);
     }
-}
\ No newline at end of file
+    spinlock_release_irqrestore(&tty->lock, flags);
+}
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <fs/epoll.h>
+#include <core/smp.h>
 
 // TTY IOCTL Commands
 #define TCGETS          0x5401
@@ -43,6 +45,8 @@ struct winsize {
 #define TTY_MAX_DEVICES     8
 #define TTY_BUFFER_SIZE     4096
 #define TTY_NAME_MAX        32
+#define TTY_SCROLLBACK      512     // Lines kept above the screen
+#define TTY_ESC_MAX_PARAMS  8       // CSI parameters kept; the rest are dropped
 
 // TTY Device States
 #define TTY_STATE_UNUSED    0
@@ -54,8 +58,24 @@ struct winsize {
 #define TTY_FLAG_CANONICAL  (1 << 1)
 #define TTY_FLAG_RAW       (1 << 2)
 
+// Escape parser states, kept between writes
+#define TTY_ESC_NONE        0
+#define TTY_ESC_START       1       // After ESC
+#define TTY_ESC_CSI         2       // After ESC [
+
+struct tty_device;
+
+// Output backend. A screen draws runs of cells and moves its picture; a
+// stream, with no draw_span, takes the bytes as they are in write_raw.
+struct tty_backend {
+    void (*draw_span)(struct tty_device* tty, uint32_t x, uint32_t y, const char* cells, uint32_t count);
+    void (*scroll)(struct tty_device* tty, uint32_t lines);
+    void (*flush)(struct tty_device* tty);
+    void (*write_raw)(const char* buf, size_t count);
+};
+
 // TTY Structure
-typedef struct {
+typedef struct tty_device {
     char name[TTY_NAME_MAX];
     uint8_t state;
     uint32_t flags;
@@ -79,9 +99,26 @@ typedef struct {
     uint32_t cursor_x;
     uint32_t cursor_y;
 
+    // Screen TTYs: cells, a ring of lines holding the screen and the
+    // scrollback above it; screen row y is line (line_start + y) % lines
+    char* cells;
+    uint32_t lines;
+    uint32_t line_start;
+    uint32_t history;           // Lines above the screen worth showing
+    uint32_t view_offset;       // Lines scrolled back, 0 to follow output
+
+    // Escape sequence in progress
+    uint8_t esc_state;
+    uint8_t esc_count;
+    uint16_t esc_params[TTY_ESC_MAX_PARAMS];
+
     // Callbacks
-    void (*write_char)(char c);
+    const struct tty_backend* backend;
     char (*read_char)(void);
+    spinlock_t lock;            // Output state
+
+    // Epoll watchers, told when input arrives
+    struct poll_head poll;
 } tty_device_t;
 
 // Function declarations
@@ -97,6 +134,8 @@ int tty_ioctl(tty_device_t* tty, uint32_t cmd, uint64_t arg);
 // Buffer operations
 void tty_input_putc(tty_device_t* tty, char c);
 char tty_input_getc(tty_device_t* tty);
+// EPOLLIN while input is buffered, EPOLLOUT while output has room
+uint32_t tty_poll(tty_device_t* tty);
 void tty_output_putc(tty_device_t* tty, char c);
 char tty_output_getc(tty_device_t* tty);
 
@@ -104,6 +143,10 @@ char tty_output_getc(tty_device_t* tty);
 void tty_clear(tty_device_t* tty);
 void tty_set_cursor(tty_device_t* tty, uint32_t x, uint32_t y);
 void tty_scroll(tty_device_t* tty, int lines);
+// Feed one sequence, without its ESC, through the escape parser
 void tty_process_escape_sequence(tty_device_t* tty, const char* seq);
+// Look lines back into the scrollback (negative: forward again); new
+// output returns to the bottom
+void tty_scrollback(tty_device_t* tty, int lines);
 
 #endif // TTY_H
\ No newline at end of file
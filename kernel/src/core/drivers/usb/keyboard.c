@@ -5,6 +5,7 @@
 #include <mm/heap.h>
 #include <utils/mem.h>
 #include <core/idt.h>
+#include <core/drivers/input.h>
 
 // Maximum number of supported USB keyboards
 #define MAX_USB_KEYBOARDS 4
@@ -16,7 +17,8 @@ typedef struct {
     uint8_t interface;
     uint8_t in_endpoint;
     uint16_t max_packet_size;
-    void* report_buffer;
+    uint8_t prev_modifiers;         // As of the last report
+    uint8_t prev_keys[6];
     bool initialized;
     keyboard_event_handler_t event_handler;
 } usb_keyboard_device_t;
@@ -63,9 +65,9 @@ void usb_keyboard_init(void) {
 
 // Cleanup USB keyboard resources
 void usb_keyboard_cleanup(void) {
-    for (uint8_t i = 0; i < keyboard_state.num_devices; i++) {
-        if (keyboard_state.devices[i].report_buffer) {
-            free(keyboard_state.devices[i].report_buffer);
+    for (uint8_t i = 0; i < MAX_USB_KEYBOARDS; i++) {
+        if (keyboard_state.devices[i].dev) {
+            usb_interrupt_stop(keyboard_state.devices[i].dev, keyboard_state.devices[i].in_endpoint);
         }
     }
     keyboard_state.initialized = false;
@@ -107,9 +109,22 @@ static char convert_keycode(uint8_t keycode, bool shift) {
     return shift ? keymap_us_shift[keycode] : keymap_us[keycode];
 }
 
-// Process keyboard report
+// Process keyboard report: characters to the key buffer, presses and
+// releases to the handler and the input ring
 static void process_keyboard_report(usb_keyboard_device_t* kbd, usb_keyboard_report_t* report) {
-    static uint8_t prev_keys[6] = {0};
+    uint8_t* prev_keys = kbd->prev_keys;
+    bool any = false;
+
+    // Modifiers are HID usages 0xE0 to 0xE7, one bit each
+    uint8_t changed = report->modifiers ^ kbd->prev_modifiers;
+    for (int bit = 0; bit < 8; bit++) {
+        if (changed & (1 << bit)) {
+            input_report(INPUT_EV_KEY, 0xE0 + bit, (report->modifiers >> bit) & 1);
+            any = true;
+        }
+    }
+    kbd->prev_modifiers = report->modifiers;
+
     bool shift = report->modifiers & (USB_HID_MOD_LEFT_SHIFT | USB_HID_MOD_RIGHT_SHIFT);
 
     // Check for pressed keys
@@ -139,6 +154,8 @@ static void process_keyboard_report(usb_keyboard_device_t* kbd, usb_keyboard_rep
                 if (kbd->event_handler) {
                     kbd->event_handler(report->keys[i], true);
                 }
+                input_report(INPUT_EV_KEY, report->keys[i], 1);
+                any = true;
             }
         }
     }
@@ -154,14 +171,30 @@ static void process_keyboard_report(usb_keyboard_device_t* kbd, usb_keyboard_rep
                 }
             }
 
-            if (!still_pressed && kbd->event_handler) {
-                kbd->event_handler(prev_keys[i], false);
+            if (!still_pressed) {
+                if (kbd->event_handler) {
+                    kbd->event_handler(prev_keys[i], false);
+                }
+                input_report(INPUT_EV_KEY, prev_keys[i], 0);
+                any = true;
             }
         }
     }
 
     // Update previous keys state
     memcpy(prev_keys, report->keys, 6);
+    if (any) input_report(INPUT_EV_SYN, 0, 0);
+}
+
+// From the xHCI event interrupt, for each report the keyboard sends
+static void keyboard_report(void* context, const uint8_t* data, uint32_t length) {
+    usb_keyboard_report_t report;
+    if (length < sizeof(report)) return;
+
+    memcpy(&report, data, sizeof(report));
+    // Every key slot reading ErrorRollOver: too many keys down to tell
+    if (report.keys[0] == USB_HID_KEY_ERROR) return;
+    process_keyboard_report(context, &report);
 }
 
 // Attach USB keyboard device
@@ -171,7 +204,12 @@ bool usb_keyboard_attach(struct usb_device* dev) {
         return false;
     }
 
-    usb_keyboard_device_t* kbd = &keyboard_state.devices[keyboard_state.num_devices];
+    // Slots stay put while their endpoint runs, as its callback holds one
+    usb_keyboard_device_t* kbd = NULL;
+    for (uint8_t i = 0; i < MAX_USB_KEYBOARDS && !kbd; i++) {
+        if (!keyboard_state.devices[i].dev) kbd = &keyboard_state.devices[i];
+    }
+    if (!kbd) return false;
     memset(kbd, 0, sizeof(usb_keyboard_device_t));
 
     kbd->dev = dev;
@@ -202,9 +240,9 @@ bool usb_keyboard_attach(struct usb_device* dev) {
         i += desc_len;
     }
 
-    // Allocate report buffer
-    kbd->report_buffer = malloc(kbd->max_packet_size);
-    if (!kbd->report_buffer) {
+    // Reports arrive by interrupt from here on
+    if (!usb_interrupt_start(dev, kbd->in_endpoint, kbd->max_packet_size, keyboard_report, kbd)) {
+        kbd->dev = NULL;
         return false;
     }
 
@@ -216,18 +254,11 @@ bool usb_keyboard_attach(struct usb_device* dev) {
 
 // Detach USB keyboard device
 void usb_keyboard_detach(struct usb_device* dev) {
-    for (uint8_t i = 0; i < keyboard_state.num_devices; i++) {
-        if (keyboard_state.devices[i].dev == dev) {
-            if (keyboard_state.devices[i].report_buffer) {
-                free(keyboard_state.devices[i].report_buffer);
-            }
-
-            // Shift remaining devices
-            if (i < keyboard_state.num_devices - 1) {
-                memmove(&keyboard_state.devices[i],
-                       &keyboard_state.devices[i + 1],
-                       sizeof(usb_keyboard_device_t) * (keyboard_state.num_devices - i - 1));
-            }
+    for (uint8_t i = 0; i < MAX_USB_KEYBOARDS; i++) {
+        if (dev && keyboard_state.devices[i].dev == dev) {
+            // No report callback runs once this returns
+            usb_interrupt_stop(dev, keyboard_state.devices[i].in_endpoint);
+            memset(&keyboard_state.devices[i], 0, sizeof(usb_keyboard_device_t));
 
             keyboard_state.num_devices--;
             break;
@@ -249,7 +280,7 @@ char usb_keyboard_get_char(void) {
 // Register keyboard event handler
 void usb_keyboard_register_handler(keyboard_event_handler_t handler) {
     // Register handler for all attached keyboards
-    for (uint8_t i = 0; i < keyboard_state.num_devices; i++) {
+    for (uint8_t i = 0; i < MAX_USB_KEYBOARDS; i++) {
         keyboard_state.devices[i].event_handler = handler;
     }
 }
\ No newline at end of file
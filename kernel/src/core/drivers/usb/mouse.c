@@ -1,6 +1,7 @@
 #include <core/drivers/usb/mouse.h>
 #include <utils/mem.h>
 #include <utils/log.h>
+#include <core/drivers/input.h>
 
 // HID Class-Specific Requests
 #define HID_GET_REPORT      0x01
@@ -77,11 +78,11 @@ void usb_mouse_cleanup(void) {
         return;
     }
 
-    // Clean up each mouse device
-    for (int i = 0; i < mouse_state.num_devices; i++) {
+    // Stop each mouse's endpoint
+    for (int i = 0; i < MAX_MICE; i++) {
         usb_mouse_device_t* mouse = &mouse_state.devices[i];
-        if (mouse->report_buffer) {
-            free(mouse->report_buffer);
+        if (mouse->dev) {
+            usb_interrupt_stop(mouse->dev, mouse->in_endpoint);
         }
     }
 
@@ -115,13 +116,65 @@ bool usb_mouse_probe(struct usb_device* dev) {
     return intf != NULL;
 }
 
+// From the xHCI event interrupt, for each report the mouse sends
+static void mouse_report(void* context, const uint8_t* data, uint32_t length) {
+    static const struct {
+        uint8_t mask;
+        uint16_t code;
+    } buttons[] = {
+        {USB_HID_MOUSE_BUTTON_LEFT, INPUT_BTN_LEFT},
+        {USB_HID_MOUSE_BUTTON_RIGHT, INPUT_BTN_RIGHT},
+        {USB_HID_MOUSE_BUTTON_MIDDLE, INPUT_BTN_MIDDLE},
+    };
+    usb_mouse_device_t* mouse = context;
+    if (length < 3) return;
+
+    // Boot protocol reports stop after Y
+    usb_mouse_report_t report;
+    memset(&report, 0, sizeof(report));
+    memcpy(&report, data, length < sizeof(report) ? length : sizeof(report));
+    int8_t wheel = mouse->has_wheel ? report.wheel : 0;
+    int8_t pan = mouse->has_pan ? report.pan : 0;
+
+    uint8_t changed = report.buttons ^ mouse->prev_buttons;
+    for (uint32_t i = 0; i < sizeof(buttons) / sizeof(buttons[0]); i++) {
+        if (changed & buttons[i].mask) {
+            input_report(INPUT_EV_KEY, buttons[i].code, (report.buttons & buttons[i].mask) ? 1 : 0);
+        }
+    }
+    mouse->prev_buttons = report.buttons;
+    if (report.x) input_report(INPUT_EV_REL, INPUT_REL_X, report.x);
+    if (report.y) input_report(INPUT_EV_REL, INPUT_REL_Y, report.y);
+    if (wheel) input_report(INPUT_EV_REL, INPUT_REL_WHEEL, wheel);
+    if (pan) input_report(INPUT_EV_REL, INPUT_REL_HWHEEL, pan);
+    input_report(INPUT_EV_SYN, 0, 0);
+
+    usb_mouse_event_handler_t handler = mouse_state.event_handler;
+    if (handler) {
+        usb_mouse_event_t event;
+        event.left_button = report.buttons & USB_HID_MOUSE_BUTTON_LEFT;
+        event.right_button = report.buttons & USB_HID_MOUSE_BUTTON_RIGHT;
+        event.middle_button = report.buttons & USB_HID_MOUSE_BUTTON_MIDDLE;
+        event.rel_x = report.x;
+        event.rel_y = report.y;
+        event.wheel_delta = wheel;
+        event.pan_delta = pan;
+        handler(&event);
+    }
+}
+
 bool usb_mouse_connect(struct usb_device* dev) {
     if (!mouse_state.initialized || mouse_state.num_devices >= MAX_MICE ||
         !usb_mouse_probe(dev)) {
         return false;
     }
 
-    usb_mouse_device_t* mouse = &mouse_state.devices[mouse_state.num_devices];
+    // Slots stay put while their endpoint runs, as its callback holds one
+    usb_mouse_device_t* mouse = NULL;
+    for (int i = 0; i < MAX_MICE && !mouse; i++) {
+        if (!mouse_state.devices[i].dev) mouse = &mouse_state.devices[i];
+    }
+    if (!mouse) return false;
     memset(mouse, 0, sizeof(usb_mouse_device_t));
 
     mouse->dev = dev;
@@ -154,12 +207,7 @@ bool usb_mouse_connect(struct usb_device* dev) {
 
     // Parse HID descriptors
     if (!parse_mouse_descriptor(mouse)) {
-        return false;
-    }
-
-    // Allocate report buffer
-    mouse->report_buffer = malloc(mouse->max_packet_size);
-    if (!mouse->report_buffer) {
+        mouse->dev = NULL;
         return false;
     }
 
@@ -167,7 +215,13 @@ bool usb_mouse_connect(struct usb_device* dev) {
     if (usb_control_transfer(dev, 0x21, HID_SET_PROTOCOL,
                            USB_HID_MOUSE_PROTOCOL_BOOT, mouse->interface,
                            NULL, 0) < 0) {
-        free(mouse->report_buffer);
+        mouse->dev = NULL;
+        return false;
+    }
+
+    // Reports arrive by interrupt from here on
+    if (!usb_interrupt_start(dev, mouse->in_endpoint, mouse->max_packet_size, mouse_report, mouse)) {
+        mouse->dev = NULL;
         return false;
     }
 
@@ -177,18 +231,11 @@ bool usb_mouse_connect(struct usb_device* dev) {
 }
 
 void usb_mouse_disconnect(struct usb_device* dev) {
-    for (int i = 0; i < mouse_state.num_devices; i++) {
-        if (mouse_state.devices[i].dev == dev) {
-            if (mouse_state.devices[i].report_buffer) {
-                free(mouse_state.devices[i].report_buffer);
-            }
-
-            // Shift remaining devices
-            if (i < mouse_state.num_devices - 1) {
-                memmove(&mouse_state.devices[i],
-                       &mouse_state.devices[i + 1],
-                       (mouse_state.num_devices - i - 1) * sizeof(usb_mouse_device_t));
-            }
+    for (int i = 0; i < MAX_MICE; i++) {
+        if (dev && mouse_state.devices[i].dev == dev) {
+            // No report callback runs once this returns
+            usb_interrupt_stop(dev, mouse_state.devices[i].in_endpoint);
+            memset(&mouse_state.devices[i], 0, sizeof(usb_mouse_device_t));
 
             mouse_state.num_devices--;
             log_info("USB Mouse disconnected");
@@ -200,30 +247,3 @@ void usb_mouse_disconnect(struct usb_device* dev) {
 void usb_mouse_register_handler(usb_mouse_event_handler_t handler) {
     mouse_state.event_handler = handler;
 }
-
-void usb_mouse_process_events(void) {
-    if (!mouse_state.initialized || !mouse_state.event_handler) {
-        return;
-    }
-
-    for (int i = 0; i < mouse_state.num_devices; i++) {
-        usb_mouse_device_t* mouse = &mouse_state.devices[i];
-        uint16_t length = mouse->max_packet_size;
-
-        if (usb_interrupt_transfer(mouse->dev, mouse->in_endpoint,
-                                mouse->report_buffer, length, 0) == 0) {
-            usb_mouse_report_t* report = mouse->report_buffer;
-            usb_mouse_event_t event;
-
-            event.left_button = report->buttons & USB_HID_MOUSE_BUTTON_LEFT;
-            event.right_button = report->buttons & USB_HID_MOUSE_BUTTON_RIGHT;
-            event.middle_button = report->buttons & USB_HID_MOUSE_BUTTON_MIDDLE;
-            event.rel_x = report->x;
-            event.rel_y = report->y;
-            event.wheel_delta = mouse->has_wheel ? report->wheel : 0;
-            event.pan_delta = mouse->has_pan ? report->pan : 0;
-
-            mouse_state.event_handler(&event);
-        }
-    }
-}
\ No newline at end of file
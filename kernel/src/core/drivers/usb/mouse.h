@@ -32,7 +32,7 @@ typedef struct {
     uint16_t max_packet_size;      // Max packet size for IN endpoint
     bool has_wheel;                // Mouse has scroll wheel
     bool has_pan;                  // Mouse has horizontal scroll
-    void* report_buffer;           // Buffer for report data
+    uint8_t prev_buttons;          // Buttons down in the last report
 } usb_mouse_device_t;
 
 // Mouse event structure
@@ -46,7 +46,7 @@ typedef struct {
     int8_t pan_delta;             // Horizontal scroll movement
 } usb_mouse_event_t;
 
-// Mouse event callback type
+// Mouse event callback type; called from the interrupt path for each report
 typedef void (*usb_mouse_event_handler_t)(usb_mouse_event_t* event);
 
 // Function declarations
@@ -59,7 +59,7 @@ bool usb_mouse_connect(struct usb_device* dev);
 void usb_mouse_disconnect(struct usb_device* dev);
 
 // Event handling
+// Reports also go, as INPUT_EV_* events, to the input ring
 void usb_mouse_register_handler(usb_mouse_event_handler_t handler);
-void usb_mouse_process_events(void);
 
 #endif // USB_MOUSE_H
\ No newline at end of file
@@ -101,6 +101,16 @@ int usb_interrupt_transfer(struct usb_device* dev, uint8_t endpoint,
     return 0;
 }
 
+bool usb_interrupt_start(struct usb_device* dev, uint8_t endpoint, uint16_t max_size,
+                         usb_report_callback_t callback, void* context) {
+    if (!dev || !xhci_ctrl) return false;
+    return xhci_interrupt_start(xhci_ctrl, dev->address, endpoint, max_size, callback, context);
+}
+
+void usb_interrupt_stop(struct usb_device* dev, uint8_t endpoint) {
+    if (dev && xhci_ctrl) xhci_interrupt_stop(xhci_ctrl, dev->address, endpoint);
+}
+
 // Get device descriptor
 static bool usb_get_device_descriptor(struct usb_device* dev) {
     int ret = usb_control_transfer(dev, 0x80, USB_REQ_GET_DESCRIPTOR,
@@ -134,4 +134,11 @@ int usb_bulk_transfer(struct usb_device* dev, uint8_t endpoint,
 int usb_interrupt_transfer(struct usb_device* dev, uint8_t endpoint,
                           void* data, uint16_t length, uint32_t timeout);
 
+// Reports from a periodic IN endpoint, delivered from interrupt context
+// as they arrive; keep the callback short
+typedef void (*usb_report_callback_t)(void* context, const uint8_t* report, uint32_t length);
+bool usb_interrupt_start(struct usb_device* dev, uint8_t endpoint, uint16_t max_size,
+                         usb_report_callback_t callback, void* context);
+void usb_interrupt_stop(struct usb_device* dev, uint8_t endpoint);
+
 #endif // USB_H
\ No newline at end of file
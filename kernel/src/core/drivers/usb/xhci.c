@@ -6,6 +6,10 @@
 #include <mm/heap.h>
 #include <mm/pmm.h>
 #include <mm/vmm.h>
+#include <core/smp.h>
+#include <core/wait.h>
+#include <core/time.h>
+#include <core/drivers/irq.h>
 
 #define TRB_SIZE 16
 #define EVENT_RING_SIZE 256
@@ -60,84 +64,169 @@ enum {
     TRB_SPLIT_TRANSACTION_ERROR = 36
 };
 
+// TRB fields
+#define TRB_CYCLE               (1 << 0)
+#define TRB_TOGGLE_CYCLE        (1 << 1)    // Link TRBs
+#define TRB_ISP                 (1 << 2)    // Interrupt on short packet
+#define TRB_CHAIN               (1 << 4)
+#define TRB_IOC                 (1 << 5)    // Interrupt on completion
+#define TRB_IDT                 (1 << 6)    // Immediate data, for setup TRBs
+#define TRB_DIR_IN              (1 << 16)   // Data and status stages
+#define TRB_TRT_OUT             (2 << 16)   // Setup stage transfer type
+#define TRB_TRT_IN              (3 << 16)
+#define TRB_TYPE(control)       (((control) >> 10) & 0x3F)
+
+// One TRB moves at most 64 KB, and its buffer may not cross a 64 KB boundary
+#define XHCI_TRB_MAX_LENGTH     0x10000
+#define XHCI_TD_PACKET_SIZE     512         // For TD Size; high-speed bulk
+#define XHCI_CONTROL_TIMEOUT_NS 5000000000ULL
+
+// Halting takes at most 16 ms; reset has no bound in the spec
+#define XHCI_HALT_TIMEOUT_NS    20000000ULL
+#define XHCI_RESET_TIMEOUT_NS   1000000000ULL
+#define XHCI_POLL_NS            100000ULL
+
+// Per-endpoint DMA pool, bounced through so a transfer allocates nothing
+#define XHCI_EP_POOL_ORDER      5
+#define XHCI_EP_POOL_SIZE       (PAGE_SIZE << XHCI_EP_POOL_ORDER)
+
+// Reads kept queued on a periodic endpoint, each with its own slice of the pool
+#define XHCI_INTR_OUTSTANDING   4
+#define XHCI_INTR_MAX_SIZE      3072        // High-bandwidth: 3 packets of 1024
+
+// One event ring per interrupter, each with its own vector and CPU
+#define XHCI_MAX_INTERRUPTERS   8
+#define XHCI_MAX_SLOTS          255
+
 struct transfer_ring {
     struct trb {
         uint64_t params;
         uint32_t status;
         uint32_t control;
     } __attribute__((packed)) *trbs;
+    uint64_t trbs_phys;
     uint32_t enqueue_idx;
     uint32_t dequeue_idx;
     uint32_t cycle_bit;
-    void* dma_buffer;
+    uint8_t* pool;
+    uint64_t pool_phys;
+
+    // One TD in flight per endpoint; the owner sets busy, the event
+    // handler fills in the rest and wakes it
+    volatile bool busy;
+    bool halted;                // A TD timed out and may still be live
+    struct wait_queue wait;
+    uint32_t td_first;
+    uint32_t td_last;
+    volatile bool td_done;
+    uint32_t td_completion;
+    uint32_t td_transferred;
+
+    // Periodic IN endpoints: reports go to callback from the event
+    // interrupt, and each read is queued again straight after
+    bool periodic;
+    xhci_report_callback_t callback;
+    void* context;
+    uint8_t slot_id;
+    uint8_t dci;
+    uint32_t interrupter;       // Target of every TRB queued here
 };
 
 struct event_ring {
     struct trb* trbs;
+    uint64_t trbs_phys;
     uint32_t* erst;
-    uint32_t enqueue_idx;
+    uint64_t erst_phys;
     uint32_t dequeue_idx;
     uint32_t cycle_bit;
+    uint32_t index;             // Interrupter number
+    uint8_t vector;             // 0 until MSI-X entry index has one
+    spinlock_t lock;
 };
 
-struct device_context {
-    uint32_t* slots;
+// Per device slot, indexed by slot ID; its endpoints by DCI - 1. Every
+// endpoint of a device reports to the same interrupter, so one device's
+// events are handled on one CPU while another's go elsewhere.
+struct xhci_slot {
     struct transfer_ring* ep_rings[31];
+    uint32_t interrupter;
 };
 
 static struct xhci_controller* xhci = NULL;
-static struct event_ring* event_ring = NULL;
-static struct device_context* device_contexts = NULL;
+static struct event_ring* event_rings[XHCI_MAX_INTERRUPTERS];
+static struct xhci_slot** slots = NULL;           // max_slots + 1 entries, filled in on first use
+static spinlock_t slots_lock = SPINLOCK_INIT;
+
+static void free_transfer_ring(struct transfer_ring* ring) {
+    if (ring->trbs) pmm_free_page((void*)ring->trbs_phys);
+    if (ring->pool) pmm_free_pages((void*)ring->pool_phys, XHCI_EP_POOL_ORDER);
+    free(ring);
+}
 
 static struct transfer_ring* create_transfer_ring(void) {
     struct transfer_ring* ring = malloc(sizeof(struct transfer_ring));
     if (!ring) return NULL;
-
-    ring->trbs = pmm_alloc_page();
-    if (!ring->trbs) {
-        free(ring);
+    memset(ring, 0, sizeof(struct transfer_ring));
+
+    void* trbs = pmm_alloc_page();
+    void* pool = pmm_alloc_pages(XHCI_EP_POOL_ORDER);
+    ring->trbs_phys = (uint64_t)trbs;
+    ring->pool_phys = (uint64_t)pool;
+    ring->trbs = trbs ? pmm_phys_to_virt(trbs) : NULL;
+    ring->pool = pool ? pmm_phys_to_virt(pool) : NULL;
+    if (!ring->trbs || !ring->pool) {
+        free_transfer_ring(ring);
         return NULL;
     }
+    memset(ring->trbs, 0, PAGE_SIZE);
 
     ring->enqueue_idx = 0;
     ring->dequeue_idx = 0;
     ring->cycle_bit = 1;
-    ring->dma_buffer = NULL;
+    wait_queue_init(&ring->wait);
 
     // Create link TRB at the end
     struct trb* link_trb = &ring->trbs[TRANSFER_RING_SIZE - 1];
-    link_trb->params = (uint64_t)ring->trbs;
+    link_trb->params = ring->trbs_phys;
     link_trb->status = 0;
-    link_trb->control = (TRB_LINK << 10) | (1 << 1);
+    link_trb->control = (TRB_LINK << 10) | TRB_TOGGLE_CYCLE;
 
     return ring;
 }
 
-static struct event_ring* create_event_ring(void) {
+static struct event_ring* create_event_ring(uint32_t index) {
     struct event_ring* ring = malloc(sizeof(struct event_ring));
     if (!ring) return NULL;
+    memset(ring, 0, sizeof(struct event_ring));
 
-    ring->trbs = pmm_alloc_page();
-    if (!ring->trbs) {
+    void* trbs = pmm_alloc_page();
+    if (!trbs) {
         free(ring);
         return NULL;
     }
 
-    ring->erst = pmm_alloc_page();
-    if (!ring->erst) {
-        pmm_free_page(ring->trbs);
+    void* erst = pmm_alloc_page();
+    if (!erst) {
+        pmm_free_page(trbs);
         free(ring);
         return NULL;
     }
 
-    ring->erst[0] = (uint32_t)(uint64_t)ring->trbs;
-    ring->erst[1] = (uint32_t)((uint64_t)ring->trbs >> 32);
+    ring->trbs_phys = (uint64_t)trbs;
+    ring->erst_phys = (uint64_t)erst;
+    ring->trbs = pmm_phys_to_virt(trbs);
+    ring->erst = pmm_phys_to_virt(erst);
+    memset(ring->trbs, 0, PAGE_SIZE);
+
+    ring->erst[0] = (uint32_t)ring->trbs_phys;
+    ring->erst[1] = (uint32_t)(ring->trbs_phys >> 32);
     ring->erst[2] = EVENT_RING_SIZE;
     ring->erst[3] = 0;
 
-    ring->enqueue_idx = 0;
     ring->dequeue_idx = 0;
     ring->cycle_bit = 1;
+    ring->index = index;
+    spinlock_init(&ring->lock);
 
     return ring;
 }
@@ -154,6 +243,187 @@ static inline uint32_t xhci_op_read32(struct xhci_controller* ctrl, uint32_t reg
     return ctrl->op_regs[reg / 4];
 }
 
+static inline uint32_t xhci_ir_read32(struct xhci_controller* ctrl, uint32_t ir, uint32_t reg) {
+    return ctrl->run_regs[(XHCI_RT_IR0 + ir * XHCI_RT_IR_STRIDE + reg) / 4];
+}
+
+static inline void xhci_ir_write32(struct xhci_controller* ctrl, uint32_t ir, uint32_t reg, uint32_t val) {
+    ctrl->run_regs[(XHCI_RT_IR0 + ir * XHCI_RT_IR_STRIDE + reg) / 4] = val;
+}
+
+// 64-bit interrupter registers, low dword first
+static inline void xhci_ir_write64(struct xhci_controller* ctrl, uint32_t ir, uint32_t reg, uint64_t val) {
+    xhci_ir_write32(ctrl, ir, reg, (uint32_t)val);
+    xhci_ir_write32(ctrl, ir, reg + 4, (uint32_t)(val >> 32));
+}
+
+// A slot's context, created the first time the slot is used; NULL past
+// the controller's slots or out of memory
+static struct xhci_slot* get_slot(struct xhci_controller* ctrl, uint32_t slot_id) {
+    if (!slots || slot_id == 0 || slot_id > ctrl->max_slots) return NULL;
+
+    struct xhci_slot* slot = __atomic_load_n(&slots[slot_id], __ATOMIC_ACQUIRE);
+    if (slot) return slot;
+
+    struct xhci_slot* fresh = malloc(sizeof(struct xhci_slot));
+    if (!fresh) return NULL;
+    memset(fresh, 0, sizeof(struct xhci_slot));
+    fresh->interrupter = slot_id % ctrl->interrupter_count;
+
+    uint64_t flags = spinlock_acquire_irqsave(&slots_lock);
+    slot = slots[slot_id];
+    if (!slot) __atomic_store_n(&slots[slot_id], slot = fresh, __ATOMIC_RELEASE);
+    spinlock_release_irqrestore(&slots_lock, flags);
+    if (slot != fresh) free(fresh);
+    return slot;
+}
+
+// TRBs from one ring index to another, stepping over the link TRB
+static inline uint32_t ring_distance(uint32_t from, uint32_t to) {
+    return (to + (TRANSFER_RING_SIZE - 1) - from) % (TRANSFER_RING_SIZE - 1);
+}
+
+static uint32_t queue_trb(struct transfer_ring* ring, uint64_t params, uint32_t status,
+                          uint32_t control, bool first);
+
+// Hand one report to the endpoint's callback and queue its read again on
+// the same buffer. A stall or error stops the endpoint instead.
+static void xhci_report_event(struct xhci_controller* ctrl, struct transfer_ring* ring,
+                              uint32_t index, const struct trb* event) {
+    struct trb* trb = &ring->trbs[index];
+    uint64_t buffer = trb->params;
+    uint32_t size = trb->status & 0x1FFFF;
+    uint32_t completion = event->status >> 24;
+    uint32_t residual = event->status & 0xFFFFFF;
+    ring->dequeue_idx = (index + 1) % (TRANSFER_RING_SIZE - 1);
+
+    if (completion != TRB_SUCCESS && completion != TRB_SHORT_PACKET) {
+        ring->callback = NULL;
+        ring->halted = true;
+        log_error("xHCI periodic endpoint stopped");
+        return;
+    }
+
+    if (residual < size) ring->callback(ring->context, ring->pool + (buffer - ring->pool_phys), size - residual);
+
+    queue_trb(ring, buffer, size, (TRB_NORMAL << 10) | TRB_ISP | TRB_IOC, false);
+    if (ctrl->db_regs) {
+        ctrl->db_regs[ring->slot_id] = ring->dci;
+    }
+}
+
+// Finish the TD in flight on the event's endpoint. A short packet reports
+// from the TRB it ended in, the TRBs before it having moved in full; a
+// second event for the same TD, or one for a TD given up on, is dropped.
+static void xhci_transfer_event(struct xhci_controller* ctrl, const struct trb* event) {
+    uint32_t slot_id = event->control >> 24;
+    uint32_t dci = (event->control >> 16) & 0x1F;
+    if (!slots || slot_id == 0 || slot_id > ctrl->max_slots || !dci) return;
+
+    struct xhci_slot* slot = __atomic_load_n(&slots[slot_id], __ATOMIC_ACQUIRE);
+    if (!slot) return;
+    struct transfer_ring* ring = __atomic_load_n(&slot->ep_rings[dci - 1], __ATOMIC_ACQUIRE);
+    if (!ring || !ring->busy) return;
+
+    uint64_t offset = event->params - ring->trbs_phys;
+    if (offset >= (uint64_t)(TRANSFER_RING_SIZE - 1) * TRB_SIZE) return;
+    uint32_t index = (uint32_t)(offset / TRB_SIZE);
+    if (ring->callback) {
+        xhci_report_event(ctrl, ring, index, event);
+        return;
+    }
+
+    if (ring->td_done) return;
+    if (ring_distance(ring->td_first, index) > ring_distance(ring->td_first, ring->td_last)) return;
+
+    uint32_t completion = event->status >> 24;
+    if (completion == TRB_SUCCESS && index != ring->td_last) return;
+
+    uint32_t transferred = 0;
+    for (uint32_t i = ring->td_first;; i = (i + 1) % (TRANSFER_RING_SIZE - 1)) {
+        uint32_t type = TRB_TYPE(ring->trbs[i].control);
+        uint32_t length = ring->trbs[i].status & 0x1FFFF;
+        if (type == TRB_NORMAL || type == TRB_DATA) {
+            if (i != index) {
+                transferred += length;
+            } else {
+                uint32_t residual = event->status & 0xFFFFFF;
+                transferred += residual < length ? length - residual : 0;
+            }
+        }
+        if (i == index) break;
+    }
+
+    ring->td_completion = completion;
+    ring->td_transferred = transferred;
+    ring->dequeue_idx = (ring->td_last + 1) % (TRANSFER_RING_SIZE - 1);
+    __atomic_store_n(&ring->td_done, true, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&ring->wait);
+}
+
+// Consume every new event on one interrupter's ring, then tell the
+// controller how far we got. That ring's lock held.
+static void xhci_process_events(struct xhci_controller* ctrl, struct event_ring* er) {
+    bool any = false;
+    while (1) {
+        struct trb* event = &er->trbs[er->dequeue_idx];
+        if ((__atomic_load_n(&event->control, __ATOMIC_ACQUIRE) & TRB_CYCLE) != er->cycle_bit) break;
+
+        if (TRB_TYPE(event->control) == TRB_EVENT) xhci_transfer_event(ctrl, event);
+
+        er->dequeue_idx = (er->dequeue_idx + 1) % EVENT_RING_SIZE;
+        if (er->dequeue_idx == 0) er->cycle_bit ^= 1;
+        any = true;
+    }
+
+    if (any) {
+        xhci_ir_write64(ctrl, er->index, XHCI_IR_ERDP,
+                        (er->trbs_phys + er->dequeue_idx * TRB_SIZE) | XHCI_ERDP_EHB);
+    }
+}
+
+static void xhci_interrupt_handler(void* data) {
+    struct event_ring* er = data;
+    struct xhci_controller* ctrl = xhci;
+
+    // Both pending bits are write-one-to-clear
+    xhci_op_write32(ctrl, XHCI_OP_USBSTS, XHCI_STS_EINT);
+    xhci_ir_write32(ctrl, er->index, XHCI_IR_IMAN, xhci_ir_read32(ctrl, er->index, XHCI_IR_IMAN) | XHCI_IMAN_IP);
+
+    spinlock_acquire(&er->lock);
+    xhci_process_events(ctrl, er);
+    spinlock_release(&er->lock);
+}
+
+// Point each interrupter at its event ring. With MSI-X, interrupter i
+// interrupts CPU i, moderated; without, events wait for a poller.
+static void xhci_setup_interrupters(struct xhci_controller* ctrl) {
+    for (uint32_t i = 0; i < ctrl->interrupter_count; i++) {
+        struct event_ring* er = event_rings[i];
+        memset(er->trbs, 0, PAGE_SIZE);
+        er->dequeue_idx = 0;
+        er->cycle_bit = 1;
+
+        xhci_ir_write32(ctrl, i, XHCI_IR_ERSTSZ, 1);
+        xhci_ir_write64(ctrl, i, XHCI_IR_ERDP, er->trbs_phys);
+        xhci_ir_write64(ctrl, i, XHCI_IR_ERSTBA, er->erst_phys);
+        xhci_ir_write32(ctrl, i, XHCI_IR_IMOD, XHCI_IMOD_DEFAULT);
+
+        if (!ctrl->msix_table) continue;
+        if (!er->vector) {
+            er->vector = irq_setup_msix(ctrl->pci_dev, ctrl->msix_table, i, "xhci",
+                                        xhci_interrupt_handler, er, i, 0);
+        }
+        if (!er->vector) {
+            // Out of vectors: only the interrupters that have one stay in use
+            ctrl->interrupter_count = i ? i : 1;
+            break;
+        }
+        if (!ctrl->vector) ctrl->vector = er->vector;
+        xhci_ir_write32(ctrl, i, XHCI_IR_IMAN, XHCI_IMAN_IP | XHCI_IMAN_IE);
+    }
+}
+
 struct xhci_controller* xhci_init(void) {
     if (xhci) return xhci;
 
@@ -167,8 +437,12 @@ struct xhci_controller* xhci_init(void) {
 bool xhci_probe(void) {
     if (!xhci) return false;
 
-    struct pci_device* pci_dev = pci_scan_for_class(0x0C, 0x03);
-    if (!pci_dev || pci_dev->prog_if != 0x30) {
+    static const struct pci_device_id xhci_ids[] = {
+        { PCI_ANY_ID, PCI_ANY_ID, 0x0C, 0x03, 0x30 },   // USB controller, xHCI interface
+        { 0 }
+    };
+    struct pci_device* pci_dev = pci_next_match(xhci_ids, NULL);
+    if (!pci_dev) {
         log_error("No xHCI controller found");
         return false;
     }
@@ -182,6 +456,9 @@ bool xhci_probe(void) {
     xhci->cap_regs = (volatile uint32_t*)mmio_base;
     xhci->cap_length = xhci_cap_read32(xhci, XHCI_CAP_HCIVERSION) >> 16;
     xhci->op_regs = (volatile uint32_t*)(mmio_base + xhci->cap_length);
+    xhci->run_regs = (volatile uint32_t*)(mmio_base + (xhci_cap_read32(xhci, XHCI_CAP_RTSOFF) & ~0x1FU));
+    xhci->db_regs = (volatile uint32_t*)(mmio_base + (xhci_cap_read32(xhci, XHCI_CAP_DBOFF) & ~0x3U));
+    xhci->pci_dev = pci_dev;
 
     xhci->hcs_params1 = xhci_cap_read32(xhci, XHCI_CAP_HCSPARAMS1);
     xhci->hcs_params2 = xhci_cap_read32(xhci, XHCI_CAP_HCSPARAMS2);
@@ -194,24 +471,56 @@ bool xhci_probe(void) {
     cmd |= (1 << 2);
     pci_write_config(pci_dev->bus, pci_dev->slot, pci_dev->func, 0x04, cmd);
 
-    event_ring = create_event_ring();
-    if (!event_ring) {
-        log_error("Failed to create event ring");
-        return false;
+    // Without MSI-X, waiters poll the event ring themselves
+    xhci->msix_table = pci_msix_enable(pci_dev, &xhci->msix_entries);
+
+    // As many interrupters as the controller, its MSI-X table and the CPUs
+    // allow; polling needs only the one
+    uint32_t count = 1;
+    if (xhci->msix_table) {
+        uint32_t cpus = smp_get_cpu_count();
+        count = (xhci->hcs_params1 >> 8) & 0x7FF;
+        if (count > xhci->msix_entries) count = xhci->msix_entries;
+        if (count > (cpus ? cpus : 1)) count = cpus ? cpus : 1;
+        if (count > XHCI_MAX_INTERRUPTERS) count = XHCI_MAX_INTERRUPTERS;
+        if (!count) count = 1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        event_rings[i] = create_event_ring(i);
+        if (!event_rings[i]) {
+            log_error("Failed to create event ring");
+            return false;
+        }
+        xhci->interrupter_count = i + 1;
     }
 
-    device_contexts = malloc(sizeof(struct device_context));
-    if (!device_contexts) {
+    xhci->max_slots = xhci->hcs_params1 & 0xFF;
+    if (!xhci->max_slots || xhci->max_slots > XHCI_MAX_SLOTS) xhci->max_slots = XHCI_MAX_SLOTS;
+    slots = malloc((xhci->max_slots + 1) * sizeof(struct xhci_slot*));
+    if (!slots) {
         log_error("Failed to allocate device contexts");
         return false;
     }
 
-    memset(device_contexts, 0, sizeof(struct device_context));
+    memset(slots, 0, (xhci->max_slots + 1) * sizeof(struct xhci_slot*));
 
     xhci->initialized = true;
     return true;
 }
 
+// Until the masked operational register reads want, sleeping between
+// reads; false after timeout_ns
+static bool xhci_op_wait(struct xhci_controller* ctrl, uint32_t reg, uint32_t mask, uint32_t want,
+                         uint64_t timeout_ns) {
+    uint64_t deadline = ktime_get_ns() + timeout_ns;
+    while ((xhci_op_read32(ctrl, reg) & mask) != want) {
+        if (ktime_get_ns() >= deadline) return false;
+        timer_sleep_ns(XHCI_POLL_NS);
+    }
+    return true;
+}
+
 bool xhci_start(struct xhci_controller* ctrl) {
     if (!ctrl || !ctrl->initialized) return false;
 
@@ -219,31 +528,28 @@ bool xhci_start(struct xhci_controller* ctrl) {
     if (cmd & XHCI_CMD_RUN) {
         cmd &= ~XHCI_CMD_RUN;
         xhci_op_write32(ctrl, XHCI_OP_USBCMD, cmd);
-        while (!(xhci_op_read32(ctrl, XHCI_OP_USBSTS) & XHCI_STS_HCH));
+        if (!xhci_op_wait(ctrl, XHCI_OP_USBSTS, XHCI_STS_HCH, XHCI_STS_HCH, XHCI_HALT_TIMEOUT_NS)) {
+            log_error("xHCI halt timeout");
+            return false;
+        }
     }
 
     cmd = xhci_op_read32(ctrl, XHCI_OP_USBCMD);
     cmd |= XHCI_CMD_HCRST;
     xhci_op_write32(ctrl, XHCI_OP_USBCMD, cmd);
 
-    int timeout = 1000000;
-    while (--timeout) {
-        if (!(xhci_op_read32(ctrl, XHCI_OP_USBCMD) & XHCI_CMD_HCRST)) {
-            break;
-        }
-    }
-    if (!timeout) {
+    if (!xhci_op_wait(ctrl, XHCI_OP_USBCMD, XHCI_CMD_HCRST, 0, XHCI_RESET_TIMEOUT_NS)) {
         log_error("xHCI reset timeout");
         return false;
     }
 
-    if (event_ring) {
-        xhci_op_write32(ctrl, XHCI_OP_CRCR, (uint32_t)(uint64_t)event_ring->erst);
-        xhci_op_write32(ctrl, XHCI_OP_CRCR + 4, (uint32_t)((uint64_t)event_ring->erst >> 32));
+    if (ctrl->interrupter_count) {
+        xhci_setup_interrupters(ctrl);
     }
 
     cmd = xhci_op_read32(ctrl, XHCI_OP_USBCMD);
     cmd |= XHCI_CMD_RUN;
+    if (ctrl->vector) cmd |= XHCI_CMD_INTE;
     xhci_op_write32(ctrl, XHCI_OP_USBCMD, cmd);
 
     return true;
@@ -256,7 +562,9 @@ void xhci_stop(struct xhci_controller* ctrl) {
     cmd &= ~XHCI_CMD_RUN;
     xhci_op_write32(ctrl, XHCI_OP_USBCMD, cmd);
 
-    while (!(xhci_op_read32(ctrl, XHCI_OP_USBSTS) & XHCI_STS_HCH));
+    if (!xhci_op_wait(ctrl, XHCI_OP_USBSTS, XHCI_STS_HCH, XHCI_STS_HCH, XHCI_HALT_TIMEOUT_NS)) {
+        log_error("xHCI halt timeout");
+    }
 }
 
 void xhci_cleanup(struct xhci_controller* ctrl) {
@@ -265,27 +573,27 @@ void xhci_cleanup(struct xhci_controller* ctrl) {
     if (ctrl->initialized) {
         xhci_stop(ctrl);
 
-        if (event_ring) {
-            if (event_ring->trbs) pmm_free_page(event_ring->trbs);
-            if (event_ring->erst) pmm_free_page(event_ring->erst);
-            free(event_ring);
-            event_ring = NULL;
+        for (uint32_t i = 0; i < ctrl->interrupter_count; i++) {
+            if (!event_rings[i]) continue;
+            pmm_free_page((void*)event_rings[i]->trbs_phys);
+            pmm_free_page((void*)event_rings[i]->erst_phys);
+            free(event_rings[i]);
+            event_rings[i] = NULL;
         }
-
-        if (device_contexts) {
-            for (int i = 0; i < 31; i++) {
-                if (device_contexts->ep_rings[i]) {
-                    if (device_contexts->ep_rings[i]->trbs) {
-                        pmm_free_page(device_contexts->ep_rings[i]->trbs);
-                    }
-                    if (device_contexts->ep_rings[i]->dma_buffer) {
-                        pmm_free_page(device_contexts->ep_rings[i]->dma_buffer);
+        ctrl->interrupter_count = 0;
+
+        if (slots) {
+            for (uint32_t s = 1; s <= ctrl->max_slots; s++) {
+                if (!slots[s]) continue;
+                for (int i = 0; i < 31; i++) {
+                    if (slots[s]->ep_rings[i]) {
+                        free_transfer_ring(slots[s]->ep_rings[i]);
                     }
-                    free(device_contexts->ep_rings[i]);
                 }
+                free(slots[s]);
             }
-            free(device_contexts);
-            device_contexts = NULL;
+            free(slots);
+            slots = NULL;
         }
     }
 
@@ -293,149 +601,212 @@ void xhci_cleanup(struct xhci_controller* ctrl) {
     if (ctrl == xhci) xhci = NULL;
 }
 
-static void submit_transfer_trb(struct transfer_ring* ring,
-                             uint64_t params, uint32_t status, uint32_t control) {
-    struct trb* trb = &ring->trbs[ring->enqueue_idx];
+// Put a TRB at the enqueue pointer, stepping over (and handing to the
+// controller) the link TRB at the end. The first TRB of a TD goes down with
+// the wrong cycle bit until the rest is in place. Returns its index.
+static uint32_t queue_trb(struct transfer_ring* ring, uint64_t params, uint32_t status,
+                          uint32_t control, bool first) {
+    uint32_t index = ring->enqueue_idx;
+    struct trb* trb = &ring->trbs[index];
     trb->params = params;
-    trb->status = status;
-    trb->control = (control & ~1) | ring->cycle_bit;
-
-    ring->enqueue_idx = (ring->enqueue_idx + 1) % (TRANSFER_RING_SIZE - 1);
-    if (ring->enqueue_idx == 0) {
+    trb->status = status | (ring->interrupter << 22);
+    __atomic_store_n(&trb->control, (control & ~TRB_CYCLE) | (first ? ring->cycle_bit ^ 1 : ring->cycle_bit),
+                     __ATOMIC_RELEASE);
+
+    ring->enqueue_idx++;
+    if (ring->enqueue_idx == TRANSFER_RING_SIZE - 1) {
+        // A chained TD carries on across the link
+        struct trb* link = &ring->trbs[TRANSFER_RING_SIZE - 1];
+        link->control = (TRB_LINK << 10) | TRB_TOGGLE_CYCLE | (control & TRB_CHAIN) | ring->cycle_bit;
+        ring->enqueue_idx = 0;
         ring->cycle_bit ^= 1;
     }
+    return index;
 }
 
-int xhci_control_transfer(struct xhci_controller* ctrl, uint8_t dev_addr,
-                         struct xhci_setup_packet* setup,
-                         void* data, uint16_t length) {
-    if (!ctrl || !ctrl->initialized || !setup) return -1;
+// Hand the TD from first to last to the controller in one step
+static void commit_td(struct transfer_ring* ring, uint32_t first, uint32_t last) {
+    ring->td_first = first;
+    ring->td_last = last;
+    ring->td_completion = 0;
+    ring->td_transferred = 0;
+    ring->td_done = false;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ring->trbs[first].control ^= TRB_CYCLE;
+}
 
-    struct transfer_ring* ring = device_contexts->ep_rings[0];
-    if (!ring) {
-        ring = create_transfer_ring();
-        if (!ring) return -1;
-        device_contexts->ep_rings[0] = ring;
+// The first length bytes of the pool as one TD of Normal TRBs, chained at
+// each 64 KB boundary
+static void queue_pool_td(struct transfer_ring* ring, uint32_t length, bool in) {
+    uint32_t first = ring->enqueue_idx, last = first;
+    uint32_t offset = 0;
+    while (offset < length) {
+        uint64_t phys = ring->pool_phys + offset;
+        uint32_t size = XHCI_TRB_MAX_LENGTH - (uint32_t)(phys & (XHCI_TRB_MAX_LENGTH - 1));
+        if (size > length - offset) size = length - offset;
+        offset += size;
+
+        // TD Size: packets still to come after this TRB, saturating at 31
+        uint32_t packets = (length - offset + XHCI_TD_PACKET_SIZE - 1) / XHCI_TD_PACKET_SIZE;
+        if (packets > 31) packets = 31;
+
+        uint32_t control = (TRB_NORMAL << 10) | (in ? TRB_ISP : 0) | (offset == length ? TRB_IOC : TRB_CHAIN);
+        last = queue_trb(ring, phys, size | (packets << 17), control, phys == ring->pool_phys);
     }
+    commit_td(ring, first, last);
+}
 
-    // Setup stage
-    submit_transfer_trb(ring,
-        *(uint64_t*)setup,
-        (8 << 16) | (TRB_SETUP << 10),
-        (3 << 16) | (1 << 6)
-    );
-
-    // Data stage (if any)
-    if (length > 0 && data) {
-        ring->dma_buffer = pmm_alloc_page();
-        if (!ring->dma_buffer) return -1;
-        memcpy(ring->dma_buffer, data, length);
+// Take an endpoint's ring for one transfer, creating it the first time;
+// callers after the same endpoint sleep their turn. NULL if it cannot be
+// had, or it is halted.
+static struct transfer_ring* claim_ring(struct xhci_controller* ctrl, uint32_t slot_id, uint32_t dci) {
+    struct xhci_slot* slot = get_slot(ctrl, slot_id);
+    if (!slot) return NULL;
 
-        submit_transfer_trb(ring,
-            (uint64_t)ring->dma_buffer,
-            (length << 16) | (TRB_DATA << 10),
-            (1 << 16) | (1 << 6) | ((setup->bmRequestType & 0x80) ? 3 : 2)
-        );
+    struct transfer_ring* ring = __atomic_load_n(&slot->ep_rings[dci - 1], __ATOMIC_ACQUIRE);
+    if (!ring) {
+        struct transfer_ring* fresh = create_transfer_ring();
+        if (!fresh) return NULL;
+        fresh->slot_id = (uint8_t)slot_id;
+        fresh->dci = (uint8_t)dci;
+        fresh->interrupter = slot->interrupter;
+
+        uint64_t flags = spinlock_acquire_irqsave(&slots_lock);
+        ring = slot->ep_rings[dci - 1];
+        if (!ring) __atomic_store_n(&slot->ep_rings[dci - 1], ring = fresh, __ATOMIC_RELEASE);
+        spinlock_release_irqrestore(&slots_lock, flags);
+        if (ring != fresh) free_transfer_ring(fresh);
     }
 
-    // Status stage
-    submit_transfer_trb(ring,
-        0,
-        (TRB_STATUS << 10),
-        (1 << 5) | ((setup->bmRequestType & 0x80) ? 2 : 3)
-    );
-
-    // Ring doorbell
-    if (ctrl->db_regs) {
-        ctrl->db_regs[dev_addr] = 1;
+    if (ring->halted) return NULL;
+    while (__atomic_test_and_set(&ring->busy, __ATOMIC_ACQUIRE)) {
+        wait_event(&ring->wait, !__atomic_load_n(&ring->busy, __ATOMIC_RELAXED));
     }
+    if (ring->halted) {
+        __atomic_clear(&ring->busy, __ATOMIC_RELEASE);
+        wait_queue_wake_all(&ring->wait);
+        return NULL;
+    }
+    return ring;
+}
 
-    // Wait for completion
-    int timeout = 1000000;
-    while (timeout--) {
-        if (event_ring->trbs[event_ring->dequeue_idx].control & 1) {
-            uint32_t completion = event_ring->trbs[event_ring->dequeue_idx].status >> 24;
-            event_ring->dequeue_idx = (event_ring->dequeue_idx + 1) % EVENT_RING_SIZE;
-
-            // Cleanup
-            if (ring->dma_buffer) {
-                if (completion == TRB_SUCCESS && (setup->bmRequestType & 0x80)) {
-                    memcpy(data, ring->dma_buffer, length);
-                }
-                pmm_free_page(ring->dma_buffer);
-                ring->dma_buffer = NULL;
-            }
+static void release_ring(struct transfer_ring* ring) {
+    __atomic_clear(&ring->busy, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&ring->wait);
+}
 
-            return (completion == TRB_SUCCESS) ? 0 : -1;
+// Until the TD in flight completes: asleep when the event interrupt will
+// wake us, polling the ring's event ring when there is none. False once deadline
+// (ns, 0 for none) passes; the TD cannot be taken back without a command
+// ring, so the endpoint stays halted.
+static bool wait_td(struct xhci_controller* ctrl, struct transfer_ring* ring, uint64_t deadline) {
+    while (!__atomic_load_n(&ring->td_done, __ATOMIC_ACQUIRE)) {
+        if (!ctrl->vector) {
+            struct event_ring* er = event_rings[ring->interrupter];
+            uint64_t flags = spinlock_acquire_irqsave(&er->lock);
+            xhci_process_events(ctrl, er);
+            spinlock_release_irqrestore(&er->lock, flags);
+            __asm__ volatile("pause");
+        } else if (!deadline) {
+            wait_event(&ring->wait, __atomic_load_n(&ring->td_done, __ATOMIC_ACQUIRE));
+        } else {
+            wait_event_deadline(&ring->wait, __atomic_load_n(&ring->td_done, __ATOMIC_ACQUIRE), deadline);
         }
-    }
 
-    // Timeout cleanup
-    if (ring->dma_buffer) {
-        pmm_free_page(ring->dma_buffer);
-        ring->dma_buffer = NULL;
+        if (deadline && !__atomic_load_n(&ring->td_done, __ATOMIC_ACQUIRE) && ktime_get_ns() >= deadline) {
+            ring->halted = true;
+            log_error("xHCI transfer timed out on endpoint ring");
+            return false;
+        }
     }
-    return -1;
+    return true;
 }
 
-int xhci_bulk_transfer(struct xhci_controller* ctrl, uint8_t dev_addr,
-                      uint8_t endpoint, void* data,
-                      uint16_t length, uint32_t timeout) {
-    if (!ctrl || !ctrl->initialized || !data || length == 0) return -1;
+int xhci_control_transfer(struct xhci_controller* ctrl, uint8_t dev_addr,
+                         struct xhci_setup_packet* setup,
+                         void* data, uint16_t length) {
+    if (!ctrl || !ctrl->initialized || !setup) return -1;
 
-    uint8_t ep_idx = ((endpoint & 0x80) ? 1 : 2) + (endpoint & 0x0F);
-    struct transfer_ring* ring = device_contexts->ep_rings[ep_idx];
-    if (!ring) {
-        ring = create_transfer_ring();
-        if (!ring) return -1;
-        device_contexts->ep_rings[ep_idx] = ring;
+    struct transfer_ring* ring = claim_ring(ctrl, dev_addr, 1);
+    if (!ring) return -1;
+
+    bool in = setup->bmRequestType & 0x80;
+    bool has_data = length > 0 && data;
+    if (has_data && !in) {
+        memcpy(ring->pool, data, length);
     }
 
-    // Prepare data buffer
-    ring->dma_buffer = pmm_alloc_page();
-    if (!ring->dma_buffer) return -1;
+    // Setup stage, the packet carried in the TRB itself
+    uint64_t packet;
+    memcpy(&packet, setup, sizeof(packet));
+    uint32_t first = queue_trb(ring, packet, 8,
+        (TRB_SETUP << 10) | TRB_IDT | (has_data ? (in ? TRB_TRT_IN : TRB_TRT_OUT) : 0), true);
 
-    if (!(endpoint & 0x80)) {  // OUT endpoint
-        memcpy(ring->dma_buffer, data, length);
+    // Data stage (if any)
+    if (has_data) {
+        queue_trb(ring, ring->pool_phys, length, (TRB_DATA << 10) | (in ? TRB_DIR_IN : 0), false);
     }
 
-    // Submit normal TRB
-    submit_transfer_trb(ring,
-        (uint64_t)ring->dma_buffer,
-        (length << 16) | (TRB_NORMAL << 10),
-        (1 << 16) | ((endpoint & 0x80) ? 3 : 2)
-    );
+    // Status stage, the other way from the data; IN without any
+    uint32_t last = queue_trb(ring, 0, 0,
+        (TRB_STATUS << 10) | TRB_IOC | ((has_data && in) ? 0 : TRB_DIR_IN), false);
+    commit_td(ring, first, last);
 
     // Ring doorbell
     if (ctrl->db_regs) {
-        ctrl->db_regs[dev_addr] = ep_idx;
+        ctrl->db_regs[dev_addr] = 1;
     }
 
-    // Wait for completion
-    while (timeout--) {
-        if (event_ring->trbs[event_ring->dequeue_idx].control & 1) {
-            uint32_t completion = event_ring->trbs[event_ring->dequeue_idx].status >> 24;
-            event_ring->dequeue_idx = (event_ring->dequeue_idx + 1) % EVENT_RING_SIZE;
+    int result = -1;
+    if (wait_td(ctrl, ring, ktime_get_ns() + XHCI_CONTROL_TIMEOUT_NS) && ring->td_completion == TRB_SUCCESS) {
+        if (has_data && in) memcpy(data, ring->pool, length);
+        result = 0;
+    }
+    release_ring(ring);
+    return result;
+}
 
-            // Cleanup and copy data for IN transfers
-            if (ring->dma_buffer) {
-                if (completion == TRB_SUCCESS && (endpoint & 0x80)) {
-                    memcpy(data, ring->dma_buffer, length);
-                }
-                pmm_free_page(ring->dma_buffer);
-                ring->dma_buffer = NULL;
-            }
+int xhci_bulk_transfer(struct xhci_controller* ctrl, uint8_t dev_addr,
+                      uint8_t endpoint, void* data,
+                      uint32_t length, uint32_t timeout) {
+    if (!ctrl || !ctrl->initialized || !data || length == 0) return -1;
 
-            return (completion == TRB_SUCCESS) ? 0 : -1;
+    // Device context index: OUT endpoints even, IN odd, 1 being control
+    bool in = endpoint & 0x80;
+    uint32_t dci = (endpoint & 0x0F) * 2 + (in ? 1 : 0);
+    if (dci < 2) return -1;
+
+    struct transfer_ring* ring = claim_ring(ctrl, dev_addr, dci);
+    if (!ring) return -1;
+
+    uint64_t deadline = timeout ? ktime_get_ns() + (uint64_t)timeout * 1000000ULL : 0;
+    uint8_t* buffer = data;
+    uint32_t done = 0;
+    int result = 0;
+    while (done < length) {
+        uint32_t chunk = (length - done < XHCI_EP_POOL_SIZE) ? length - done : XHCI_EP_POOL_SIZE;
+        if (!in) memcpy(ring->pool, buffer + done, chunk);
+
+        queue_pool_td(ring, chunk, in);
+        if (ctrl->db_regs) {
+            ctrl->db_regs[dev_addr] = dci;
+        }
+
+        if (!wait_td(ctrl, ring, deadline) ||
+            (ring->td_completion != TRB_SUCCESS && ring->td_completion != TRB_SHORT_PACKET)) {
+            result = -1;
+            break;
         }
-    }
 
-    // Timeout cleanup
-    if (ring->dma_buffer) {
-        pmm_free_page(ring->dma_buffer);
-        ring->dma_buffer = NULL;
+        uint32_t moved = ring->td_transferred;
+        if (in) memcpy(buffer + done, ring->pool, moved);
+        done += moved;
+
+        // A short packet ends the transfer
+        if (moved < chunk) break;
     }
-    return -1;
+    release_ring(ring);
+    return result < 0 ? -1 : (int)done;
 }
 
 int xhci_interrupt_transfer(struct xhci_controller* ctrl, uint8_t dev_addr,
@@ -468,4 +839,59 @@ bool xhci_get_port_status_change(struct xhci_controller* ctrl,
     }
 
     return true;
-}
\ No newline at end of file
+}
+bool xhci_interrupt_start(struct xhci_controller* ctrl, uint8_t dev_addr, uint8_t endpoint,
+                          uint16_t max_size, xhci_report_callback_t callback, void* context) {
+    if (!ctrl || !ctrl->initialized || !callback || !(endpoint & 0x80) ||
+        max_size == 0 || max_size > XHCI_INTR_MAX_SIZE) return false;
+
+    // Reports only arrive by interrupt; polling for them would cost the CPU
+    // time this is meant to save
+    if (!ctrl->vector) {
+        log_error("xHCI periodic endpoints need MSI-X");
+        return false;
+    }
+
+    uint32_t dci = (endpoint & 0x0F) * 2 + 1;
+    struct transfer_ring* ring = claim_ring(ctrl, dev_addr, dci);
+    if (!ring) return false;
+
+    // The ring stays claimed while the endpoint runs, keeping other
+    // transfers off the pool
+    ring->periodic = true;
+    ring->context = context;
+    __atomic_store_n(&ring->callback, callback, __ATOMIC_RELEASE);
+
+    uint32_t slice = XHCI_EP_POOL_SIZE / XHCI_INTR_OUTSTANDING;
+    for (uint32_t i = 0; i < XHCI_INTR_OUTSTANDING; i++) {
+        queue_trb(ring, ring->pool_phys + i * slice, max_size, (TRB_NORMAL << 10) | TRB_ISP | TRB_IOC, false);
+    }
+
+    // Ring doorbell
+    if (ctrl->db_regs) {
+        ctrl->db_regs[dev_addr] = dci;
+    }
+    return true;
+}
+
+void xhci_interrupt_stop(struct xhci_controller* ctrl, uint8_t dev_addr, uint8_t endpoint) {
+    if (!ctrl || !ctrl->initialized || !slots || dev_addr == 0 || dev_addr > ctrl->max_slots) return;
+
+    uint32_t dci = (endpoint & 0x0F) * 2 + 1;
+    struct xhci_slot* slot = __atomic_load_n(&slots[dev_addr], __ATOMIC_ACQUIRE);
+    struct transfer_ring* ring = slot ? slot->ep_rings[dci - 1] : NULL;
+    if (!ring || !ring->periodic) return;
+
+    // Callbacks run under their event ring's lock, so none is running after this
+    struct event_ring* er = event_rings[ring->interrupter];
+    uint64_t flags = spinlock_acquire_irqsave(&er->lock);
+    ring->periodic = false;
+    ring->callback = NULL;
+    ring->context = NULL;
+    spinlock_release_irqrestore(&er->lock, flags);
+
+    // Without a Stop Endpoint command the reads stay queued, and the
+    // controller may still fill the pool, so the ring is not reused
+    ring->halted = true;
+    release_ring(ring);
+}
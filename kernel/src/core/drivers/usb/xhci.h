@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <core/drivers/pci.h>
 
 // xHCI capability registers
 #define XHCI_CAP_HCIVERSION     0x00
@@ -50,6 +51,19 @@
 #define XHCI_PORT_PRC           (1 << 21)
 #define XHCI_PORT_CHANGE_BITS   (0x7FE000)
 
+// Interrupter register set, from the runtime base plus 32 bytes per interrupter
+#define XHCI_RT_IR0             0x20
+#define XHCI_RT_IR_STRIDE       0x20
+#define XHCI_IR_IMAN            0x00
+#define XHCI_IR_IMOD            0x04
+#define XHCI_IR_ERSTSZ          0x08
+#define XHCI_IR_ERSTBA          0x10
+#define XHCI_IR_ERDP            0x18
+#define XHCI_IMAN_IP            (1 << 0)
+#define XHCI_IMAN_IE            (1 << 1)
+#define XHCI_ERDP_EHB           (1 << 3)
+#define XHCI_IMOD_DEFAULT       1000    // 250 ns units: at most 4000 interrupts/s
+
 // xHCI controller structure
 struct xhci_controller {
     volatile uint32_t* cap_regs;     // Capability registers
@@ -62,6 +76,12 @@ struct xhci_controller {
     uint32_t hcs_params2;            // Structural parameters 2
     uint32_t hcs_params3;            // Structural parameters 3
     uint32_t hcc_params1;            // Capability parameters 1
+    struct pci_device* pci_dev;
+    volatile uint32_t* msix_table;
+    uint32_t msix_entries;
+    uint32_t max_slots;              // Highest slot ID the controller offers
+    uint32_t interrupter_count;      // Event rings in use, each on its own CPU
+    uint8_t vector;                  // Interrupter 0's vector; 0 if waiters poll
     bool initialized;                 // Initialization state
 };
 
@@ -86,14 +106,28 @@ int xhci_control_transfer(struct xhci_controller* xhci, uint8_t dev_addr,
                          struct xhci_setup_packet* setup,
                          void* data, uint16_t length);
 
+// Bulk transfers of any length, through the endpoint's DMA pool in TDs of
+// chained TRBs; the bytes moved (fewer on a short IN packet), -1 on error.
+// timeout is in milliseconds, 0 to wait for as long as it takes.
 int xhci_bulk_transfer(struct xhci_controller* xhci, uint8_t dev_addr,
                       uint8_t endpoint, void* data,
-                      uint16_t length, uint32_t timeout);
+                      uint32_t length, uint32_t timeout);
 
 int xhci_interrupt_transfer(struct xhci_controller* xhci, uint8_t dev_addr,
                            uint8_t endpoint, void* data,
                            uint16_t length, uint32_t timeout);
 
+// Called from the event interrupt with each report from a periodic endpoint
+typedef void (*xhci_report_callback_t)(void* context, const uint8_t* report, uint32_t length);
+
+// Keep several reads of up to max_size queued on a periodic IN endpoint,
+// each queued again once its report is handed to callback; nothing polls,
+// so an idle device costs nothing. Needs MSI-X.
+bool xhci_interrupt_start(struct xhci_controller* xhci, uint8_t dev_addr, uint8_t endpoint,
+                          uint16_t max_size, xhci_report_callback_t callback, void* context);
+// No callback runs after this returns
+void xhci_interrupt_stop(struct xhci_controller* xhci, uint8_t dev_addr, uint8_t endpoint);
+
 // Port management
 uint32_t xhci_get_port_count(struct xhci_controller* xhci);
 bool xhci_get_port_status_change(struct xhci_controller* xhci,
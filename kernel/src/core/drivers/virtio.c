@@ -0,0 +1,378 @@
+#include <core/drivers/virtio.h>
+#include <core/drivers/irq.h>
+#include <core/time.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/heap.h>
+#include <mm/slab.h>
+#include <utils/mem.h>
+#include <utils/log.h>
+
+// Vendor capability types, in the byte after the capability's length
+#define VIRTIO_PCI_CAP_COMMON   1
+#define VIRTIO_PCI_CAP_NOTIFY   2
+#define VIRTIO_PCI_CAP_ISR      3
+#define VIRTIO_PCI_CAP_DEVICE   4
+
+#define VIRTIO_MSI_NO_VECTOR    0xFFFF
+#define VIRTIO_RESET_TIMEOUT_NS 100000000ULL
+
+// Indirect tables; an object never crosses a page, so one is contiguous
+static struct kmem_cache* indirect_cache = NULL;
+
+// Map the structure a vendor capability points at: BAR, offset, length
+static volatile void* virtio_map_cap(struct pci_device* pci_dev, uint8_t cap) {
+    uint8_t bar = pci_read_config(pci_dev->bus, pci_dev->slot, pci_dev->func, cap + 4) & 0xFF;
+    uint32_t offset = pci_read_config(pci_dev->bus, pci_dev->slot, pci_dev->func, cap + 8);
+    uint32_t length = pci_read_config(pci_dev->bus, pci_dev->slot, pci_dev->func, cap + 12);
+    if (bar >= 6 || !length) return NULL;
+    return pci_map_bar(pci_dev, bar, offset, length);
+}
+
+bool virtio_pci_init(struct virtio_device* dev, struct pci_device* pci_dev) {
+    memset(dev, 0, sizeof(*dev));
+    dev->pci_dev = pci_dev;
+
+    // Memory space and bus mastering
+    uint32_t cmd = pci_read_config(pci_dev->bus, pci_dev->slot, pci_dev->func, PCI_COMMAND);
+    pci_write_config(pci_dev->bus, pci_dev->slot, pci_dev->func, PCI_COMMAND, cmd | (1 << 1) | (1 << 2));
+
+    // The first capability of each type is the one to use
+    for (uint8_t cap = 0; (cap = pci_next_capability(pci_dev, PCI_CAP_ID_VENDOR, cap)) != 0;) {
+        uint8_t type = (pci_read_config(pci_dev->bus, pci_dev->slot, pci_dev->func, cap) >> 24) & 0xFF;
+        if (type == VIRTIO_PCI_CAP_COMMON && !dev->common) {
+            dev->common = virtio_map_cap(pci_dev, cap);
+        } else if (type == VIRTIO_PCI_CAP_NOTIFY && !dev->notify_base) {
+            dev->notify_base = virtio_map_cap(pci_dev, cap);
+            dev->notify_multiplier = pci_read_config(pci_dev->bus, pci_dev->slot, pci_dev->func, cap + 16);
+        } else if (type == VIRTIO_PCI_CAP_ISR && !dev->isr) {
+            dev->isr = virtio_map_cap(pci_dev, cap);
+        } else if (type == VIRTIO_PCI_CAP_DEVICE && !dev->config) {
+            dev->config = virtio_map_cap(pci_dev, cap);
+        }
+    }
+    if (!dev->common || !dev->notify_base) return false;
+
+    // Reset, which completes when the status reads back as zero
+    dev->common->device_status = 0;
+    uint64_t deadline = ktime_get_ns() + VIRTIO_RESET_TIMEOUT_NS;
+    while (dev->common->device_status) {
+        if (ktime_get_ns() > deadline) return false;
+        __asm__ volatile("pause");
+    }
+    dev->common->device_status = VIRTIO_STATUS_ACKNOWLEDGE;
+    dev->common->device_status |= VIRTIO_STATUS_DRIVER;
+
+    dev->msix_table = pci_msix_enable(pci_dev, &dev->msix_entries);
+    if (dev->msix_table) dev->common->msix_config = VIRTIO_MSI_NO_VECTOR;
+
+    if (!indirect_cache) {
+        uint32_t size = VIRTIO_INDIRECT_MAX * sizeof(struct virtq_desc);
+        indirect_cache = kmem_cache_create("virtio_indirect", size, size, NULL);
+    }
+    return true;
+}
+
+bool virtio_negotiate(struct virtio_device* dev, uint64_t wanted) {
+    volatile struct virtio_pci_common_cfg* common = dev->common;
+    common->device_feature_select = 0;
+    uint64_t offered = common->device_feature;
+    common->device_feature_select = 1;
+    offered |= (uint64_t)common->device_feature << 32;
+
+    // Legacy behaviour is not supported
+    wanted |= VIRTIO_FEATURE(VIRTIO_F_VERSION_1);
+    if (!(offered & VIRTIO_FEATURE(VIRTIO_F_VERSION_1))) return false;
+    if (!indirect_cache) wanted &= ~VIRTIO_FEATURE(VIRTIO_F_INDIRECT_DESC);
+    dev->features = offered & wanted;
+
+    common->driver_feature_select = 0;
+    common->driver_feature = (uint32_t)dev->features;
+    common->driver_feature_select = 1;
+    common->driver_feature = (uint32_t)(dev->features >> 32);
+
+    common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    return (common->device_status & VIRTIO_STATUS_FEATURES_OK) != 0;
+}
+
+void virtio_driver_ok(struct virtio_device* dev) {
+    dev->common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+}
+
+void virtio_fail(struct virtio_device* dev) {
+    dev->common->device_status |= VIRTIO_STATUS_FAILED;
+}
+
+uint16_t virtio_queue_count(struct virtio_device* dev) {
+    return dev->common->num_queues;
+}
+
+static void virtqueue_interrupt(void* data) {
+    struct virtqueue* vq = data;
+    if (vq->callback) vq->callback(vq);
+}
+
+// MSI-X entry index + 1 for queue index, leaving entry 0 to configuration
+// changes; false if out of entries or vectors, and the queue is polled
+static bool virtqueue_route(struct virtqueue* vq, uint32_t cpu) {
+    struct virtio_device* dev = vq->dev;
+    uint16_t entry = vq->index + 1;
+    if (!dev->msix_table || entry >= dev->msix_entries) return false;
+
+    // The device may turn the entry down, if it cannot allocate for it
+    dev->common->queue_msix_vector = entry;
+    if (dev->common->queue_msix_vector != entry) return false;
+
+    vq->vector = irq_setup_msix(dev->pci_dev, dev->msix_table, entry, "virtqueue",
+                                virtqueue_interrupt, vq, cpu, IRQ_BALANCE);
+    if (!vq->vector) {
+        dev->common->queue_msix_vector = VIRTIO_MSI_NO_VECTOR;
+        return false;
+    }
+    return true;
+}
+
+void virtqueue_set_affinity(struct virtqueue* vq, uint32_t cpu) {
+    if (vq->vector) irq_set_affinity(vq->vector, cpu);
+}
+
+bool virtqueue_setup(struct virtio_device* dev, struct virtqueue* vq, uint16_t index,
+                     uint16_t max_size, virtqueue_callback_t callback, uint32_t cpu) {
+    memset(vq, 0, sizeof(*vq));
+    volatile struct virtio_pci_common_cfg* common = dev->common;
+    common->queue_select = index;
+    uint16_t size = common->queue_size;
+    if (!size) return false;
+    if (max_size > VIRTIO_MAX_QUEUE_SIZE) max_size = VIRTIO_MAX_QUEUE_SIZE;
+    if (size > max_size) size = max_size;
+
+    // Descriptors, then the avail ring, then the used ring at its alignment,
+    // each with room for the event index after it
+    size_t desc_bytes = (size_t)size * sizeof(struct virtq_desc);
+    size_t avail_bytes = 6 + 2 * (size_t)size;
+    size_t used_offset = (desc_bytes + avail_bytes + 3) & ~(size_t)3;
+    size_t used_bytes = 6 + sizeof(struct virtq_used_elem) * (size_t)size;
+    size_t pages = (used_offset + used_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    vq->ring_order = (uint32_t)pmm_order_for_pages(pages);
+    vq->ring_pages = pmm_alloc_pages(vq->ring_order);
+    vq->tokens = malloc(size * sizeof(void*));
+    vq->indirect = malloc(size * sizeof(struct virtq_desc*));
+    if (!vq->ring_pages || !vq->tokens || !vq->indirect) {
+        if (vq->ring_pages) pmm_free_pages(vq->ring_pages, vq->ring_order);
+        if (vq->tokens) free(vq->tokens);
+        if (vq->indirect) free(vq->indirect);
+        return false;
+    }
+
+    uint8_t* ring = pmm_phys_to_virt(vq->ring_pages);
+    memset(ring, 0, PAGE_SIZE << vq->ring_order);
+    memset(vq->tokens, 0, size * sizeof(void*));
+    memset(vq->indirect, 0, size * sizeof(struct virtq_desc*));
+    vq->dev = dev;
+    vq->index = index;
+    vq->size = size;
+    vq->desc = (struct virtq_desc*)ring;
+    vq->avail = (struct virtq_avail*)(ring + desc_bytes);
+    vq->used = (struct virtq_used*)(ring + used_offset);
+    vq->callback = callback;
+    spinlock_init(&vq->lock);
+
+    // Free descriptors chain through next
+    for (uint16_t i = 0; i < size; i++) vq->desc[i].next = i + 1;
+    vq->free_head = 0;
+    vq->num_free = size;
+
+    uint64_t phys = (uint64_t)vq->ring_pages;
+    common->queue_size = size;
+    common->queue_desc_lo = (uint32_t)phys;
+    common->queue_desc_hi = (uint32_t)(phys >> 32);
+    common->queue_driver_lo = (uint32_t)(phys + desc_bytes);
+    common->queue_driver_hi = (uint32_t)((phys + desc_bytes) >> 32);
+    common->queue_device_lo = (uint32_t)(phys + used_offset);
+    common->queue_device_hi = (uint32_t)((phys + used_offset) >> 32);
+
+    if (dev->msix_table) {
+        common->queue_msix_vector = VIRTIO_MSI_NO_VECTOR;
+        if (callback) virtqueue_route(vq, cpu);
+    }
+    if (!vq->vector) vq->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+    vq->notify = (volatile uint16_t*)(dev->notify_base + (uint32_t)common->queue_notify_off * dev->notify_multiplier);
+    common->queue_enable = 1;
+    return true;
+}
+
+// Split bufs into physically contiguous pieces; false past max of them
+static bool virtio_gather(struct virtio_buf* bufs, uint32_t count, uint32_t in_from,
+                          struct virtq_desc* out, uint32_t max, uint32_t* pieces) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t* addr = bufs[i].addr;
+        uint32_t left = bufs[i].len;
+        uint16_t flags = i >= in_from ? VIRTQ_DESC_F_WRITE : 0;
+        while (left) {
+            uint32_t chunk = PAGE_SIZE - ((uintptr_t)addr & (PAGE_SIZE - 1));
+            if (chunk > left) chunk = left;
+            uint64_t phys = vmm_get_phys_addr((uint64_t)addr);
+            if (n && out[n - 1].flags == flags && out[n - 1].addr + out[n - 1].len == phys) {
+                out[n - 1].len += chunk;
+            } else {
+                if (n == max) return false;
+                out[n].addr = phys;
+                out[n].len = chunk;
+                out[n].flags = flags;
+                n++;
+            }
+            addr += chunk;
+            left -= chunk;
+        }
+    }
+    *pieces = n;
+    return true;
+}
+
+bool virtqueue_add(struct virtqueue* vq, struct virtio_buf* bufs, uint32_t out, uint32_t in, void* token) {
+    struct virtq_desc pieces[VIRTIO_INDIRECT_MAX];
+    uint32_t count = 0;
+    if (!token || !virtio_gather(bufs, out + in, out, pieces, VIRTIO_INDIRECT_MAX, &count) || !count) {
+        return false;
+    }
+
+    // More than one piece goes in an indirect table, costing one ring slot
+    struct virtq_desc* table = NULL;
+    if (count > 1 && virtio_has_feature(vq->dev, VIRTIO_F_INDIRECT_DESC)) {
+        table = kmem_cache_alloc(indirect_cache);
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&vq->lock);
+    uint32_t needed = table ? 1 : count;
+    if (vq->num_free < needed) {
+        spinlock_release_irqrestore(&vq->lock, flags);
+        if (table) kmem_cache_free(indirect_cache, table);
+        return false;
+    }
+
+    uint16_t head = vq->free_head;
+    if (table) {
+        for (uint32_t i = 0; i < count; i++) {
+            table[i] = pieces[i];
+            if (i + 1 < count) {
+                table[i].flags |= VIRTQ_DESC_F_NEXT;
+                table[i].next = (uint16_t)(i + 1);
+            }
+        }
+        struct virtq_desc* desc = &vq->desc[head];
+        vq->free_head = desc->next;
+        desc->addr = vmm_get_phys_addr((uint64_t)table);
+        desc->len = count * sizeof(struct virtq_desc);
+        desc->flags = VIRTQ_DESC_F_INDIRECT;
+    } else {
+        uint16_t idx = head;
+        for (uint32_t i = 0; i < count; i++) {
+            struct virtq_desc* desc = &vq->desc[idx];
+            uint16_t next = desc->next;
+            desc->addr = pieces[i].addr;
+            desc->len = pieces[i].len;
+            desc->flags = pieces[i].flags | (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0);
+            if (i + 1 < count) idx = next;
+            else vq->free_head = next;
+        }
+    }
+    vq->num_free -= needed;
+    vq->tokens[head] = token;
+    vq->indirect[head] = table;
+
+    vq->avail->ring[vq->avail_idx % vq->size] = head;
+    vq->avail_idx++;
+    spinlock_release_irqrestore(&vq->lock, flags);
+    return true;
+}
+
+// Whether the device asked to hear of new entries between old and new
+static inline bool vring_need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+void virtqueue_kick(struct virtqueue* vq) {
+    uint64_t flags = spinlock_acquire_irqsave(&vq->lock);
+    uint16_t old_idx = vq->kicked_idx;
+    uint16_t new_idx = vq->avail_idx;
+    if (old_idx == new_idx) {
+        spinlock_release_irqrestore(&vq->lock, flags);
+        return;
+    }
+
+    // Entries before the index, then the index before reading the device's
+    // suppression state
+    __atomic_store_n(&vq->avail->idx, new_idx, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    vq->kicked_idx = new_idx;
+
+    bool notify;
+    if (virtio_has_feature(vq->dev, VIRTIO_F_EVENT_IDX)) {
+        volatile uint16_t* avail_event = (volatile uint16_t*)((uint8_t*)vq->used + 4 + 8 * (size_t)vq->size);
+        notify = vring_need_event(*avail_event, new_idx, old_idx);
+    } else {
+        notify = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+    spinlock_release_irqrestore(&vq->lock, flags);
+
+    if (notify) *vq->notify = vq->index;
+}
+
+void* virtqueue_get(struct virtqueue* vq, uint32_t* len) {
+    uint64_t flags = spinlock_acquire_irqsave(&vq->lock);
+    if (vq->last_used == __atomic_load_n(&vq->used->idx, __ATOMIC_ACQUIRE)) {
+        spinlock_release_irqrestore(&vq->lock, flags);
+        return NULL;
+    }
+
+    struct virtq_used_elem* elem = &vq->used->ring[vq->last_used % vq->size];
+    uint16_t head = (uint16_t)elem->id;
+    if (len) *len = elem->len;
+    vq->last_used++;
+
+    void* token = vq->tokens[head];
+    struct virtq_desc* table = vq->indirect[head];
+    vq->tokens[head] = NULL;
+    vq->indirect[head] = NULL;
+
+    // Back on the free list, the whole chain at once
+    uint16_t tail = head;
+    uint16_t freed = 1;
+    while (vq->desc[tail].flags & VIRTQ_DESC_F_NEXT) {
+        tail = vq->desc[tail].next;
+        freed++;
+    }
+    vq->desc[tail].next = vq->free_head;
+    vq->free_head = head;
+    vq->num_free += freed;
+    spinlock_release_irqrestore(&vq->lock, flags);
+
+    if (table) kmem_cache_free(indirect_cache, table);
+    return token;
+}
+
+bool virtqueue_enable_cb(struct virtqueue* vq) {
+    uint64_t flags = spinlock_acquire_irqsave(&vq->lock);
+    if (virtio_has_feature(vq->dev, VIRTIO_F_EVENT_IDX)) {
+        volatile uint16_t* used_event = (volatile uint16_t*)((uint8_t*)vq->avail + 4 + 2 * (size_t)vq->size);
+        *used_event = vq->last_used;
+    } else {
+        vq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+
+    // Published before looking, or a completion in between goes unnoticed
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bool empty = vq->last_used == vq->used->idx;
+    spinlock_release_irqrestore(&vq->lock, flags);
+    return empty;
+}
+
+void virtqueue_disable_cb(struct virtqueue* vq) {
+    // With the event index, used_event simply stays behind
+    if (!virtio_has_feature(vq->dev, VIRTIO_F_EVENT_IDX)) {
+        vq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+}
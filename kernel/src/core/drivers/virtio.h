@@ -0,0 +1,170 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/drivers/pci.h>
+#include <core/smp.h>
+
+// Virtio 1.x over PCI: the modern transport only, with split virtqueues.
+// Transitional devices are driven through the same modern capabilities.
+#define VIRTIO_PCI_VENDOR        0x1AF4
+#define VIRTIO_PCI_MODERN_BASE   0x1040  // Modern device IDs are this plus the type
+#define VIRTIO_PCI_TRANS_NET     0x1000  // Transitional device IDs
+#define VIRTIO_PCI_TRANS_BLOCK   0x1001
+#define VIRTIO_ID_NET            1
+#define VIRTIO_ID_BLOCK          2
+
+#define VIRTIO_MAX_QUEUE_SIZE    256     // Ring entries, capped by the device's limit
+#define VIRTIO_INDIRECT_MAX      64      // Descriptors in one indirect table
+
+// Device status
+#define VIRTIO_STATUS_ACKNOWLEDGE  0x01
+#define VIRTIO_STATUS_DRIVER       0x02
+#define VIRTIO_STATUS_DRIVER_OK    0x04
+#define VIRTIO_STATUS_FEATURES_OK  0x08
+#define VIRTIO_STATUS_FAILED       0x80
+
+// Transport feature bits
+#define VIRTIO_F_INDIRECT_DESC   28
+#define VIRTIO_F_EVENT_IDX       29
+#define VIRTIO_F_VERSION_1       32
+
+#define VIRTIO_FEATURE(bit)      (1ULL << (bit))
+
+// Split virtqueue layout, shared with the device
+#define VIRTQ_DESC_F_NEXT        1
+#define VIRTQ_DESC_F_WRITE       2       // The device writes this buffer
+#define VIRTQ_DESC_F_INDIRECT    4
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY   1
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed));
+
+struct virtq_avail {
+    uint16_t flags;
+    volatile uint16_t idx;
+    uint16_t ring[];    // Then used_event, with VIRTIO_F_EVENT_IDX
+} __attribute__((packed));
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+} __attribute__((packed));
+
+struct virtq_used {
+    volatile uint16_t flags;
+    volatile uint16_t idx;
+    struct virtq_used_elem ring[];  // Then avail_event, with VIRTIO_F_EVENT_IDX
+} __attribute__((packed));
+
+// Common configuration structure, through the first capability of its type
+struct virtio_pci_common_cfg {
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_driver_lo;
+    uint32_t queue_driver_hi;
+    uint32_t queue_device_lo;
+    uint32_t queue_device_hi;
+} __attribute__((packed));
+
+// A buffer handed to the device, in virtual memory; it may cross pages
+struct virtio_buf {
+    void* addr;
+    uint32_t len;
+};
+
+struct virtio_device;
+struct virtqueue;
+
+// Runs from the queue's interrupt handler
+typedef void (*virtqueue_callback_t)(struct virtqueue* vq);
+
+struct virtqueue {
+    struct virtio_device* dev;
+    uint16_t index;
+    uint16_t size;
+    struct virtq_desc* desc;
+    struct virtq_avail* avail;
+    struct virtq_used* used;
+    void* ring_pages;               // Physical, the three parts back to back
+    uint32_t ring_order;
+    volatile uint16_t* notify;
+    void** tokens;                  // Per head descriptor, until the device is done
+    struct virtq_desc** indirect;   // The head's indirect table, if it has one
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t avail_idx;             // Next free avail slot, published to the device on kick
+    uint16_t kicked_idx;            // avail_idx at the last notification
+    uint16_t last_used;             // Next used entry to consume
+    uint8_t vector;                 // 0 if the queue is only polled
+    spinlock_t lock;
+    virtqueue_callback_t callback;
+    void* private_data;
+};
+
+struct virtio_device {
+    struct pci_device* pci_dev;
+    volatile struct virtio_pci_common_cfg* common;
+    volatile uint8_t* isr;
+    volatile void* config;          // Device-specific configuration
+    volatile uint8_t* notify_base;
+    uint32_t notify_multiplier;
+    uint64_t features;              // Negotiated
+    volatile uint32_t* msix_table;
+    uint32_t msix_entries;
+};
+
+// Find the capabilities, reset the device and acknowledge it
+bool virtio_pci_init(struct virtio_device* dev, struct pci_device* pci_dev);
+// Accept wanted & offered, VERSION_1 always; false if the device refuses.
+// The result is left in dev->features.
+bool virtio_negotiate(struct virtio_device* dev, uint64_t wanted);
+// Set queue index up with at most max_size entries. With a callback it
+// gets an MSI-X vector aimed at cpu's local APIC, if any are left.
+bool virtqueue_setup(struct virtio_device* dev, struct virtqueue* vq, uint16_t index,
+                     uint16_t max_size, virtqueue_callback_t callback, uint32_t cpu);
+// Queues are live from here on; the driver must have set them all up
+void virtio_driver_ok(struct virtio_device* dev);
+void virtio_fail(struct virtio_device* dev);
+// Aim an interrupting queue's vector at another CPU
+void virtqueue_set_affinity(struct virtqueue* vq, uint32_t cpu);
+uint16_t virtio_queue_count(struct virtio_device* dev);
+
+static inline bool virtio_has_feature(struct virtio_device* dev, uint32_t bit) {
+    return (dev->features >> bit) & 1;
+}
+
+// Queue out device-readable buffers followed by in device-writable ones.
+// Not visible to the device until virtqueue_kick(); false if the ring is
+// full or the chain does not fit.
+bool virtqueue_add(struct virtqueue* vq, struct virtio_buf* bufs, uint32_t out, uint32_t in, void* token);
+// Publish what was added and notify the device, unless it asked not to be
+void virtqueue_kick(struct virtqueue* vq);
+// Next finished buffer chain, NULL if none; *len is what the device wrote
+void* virtqueue_get(struct virtqueue* vq, uint32_t* len);
+// Interrupt once past what has been consumed; false if more completed
+// already, so the caller polls again instead of waiting
+bool virtqueue_enable_cb(struct virtqueue* vq);
+// Ask the device not to interrupt, as a hint
+void virtqueue_disable_cb(struct virtqueue* vq);
+
+#endif // VIRTIO_H
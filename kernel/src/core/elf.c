@@ -4,6 +4,11 @@
 #include <mm/heap.h>
 #include <utils/mem.h>
 #include <core/idt.h>
+#include <core/process.h>
+#include <core/vdso.h>
+#include <core/syscalls.h>
+#include <mm/vma.h>
+#include <fs/page_cache.h>
 
 // Logging and debug
 #include <graphics/display.h>
@@ -18,6 +23,8 @@ extern struct limine_framebuffer* global_framebuffer;
 #define PAGE_ALIGN_UP(addr) (((addr) + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1))
 #define PAGE_OFFSET(addr) ((addr) & (PAGE_SIZE_4K - 1))
 
+#define ELF_MAX_SEGMENTS 16
+
 // ELF validation and loading errors
 typedef enum {
     ELF_LOAD_SUCCESS = 0,
@@ -33,6 +40,7 @@ typedef enum {
 
 // Segment information for tracking
 typedef struct {
+    uint64_t vaddr;
     uint64_t vaddr_start;
     uint64_t vaddr_end;
     uint64_t file_offset;
@@ -76,6 +84,7 @@ static void log_elf_error(Elf_Load_Error error) {
 
     draw_string(global_framebuffer, "ELF Loading Error: ", 0, 220, RED);
     draw_string(global_framebuffer, error_msg, 0, 240, RED);
+    display_flush(global_framebuffer);
 #endif
 }
 
@@ -119,11 +128,11 @@ static Elf_Load_Error validate_elf_header(Elf64_Ehdr* header, size_t data_size)
 // Gather and validate segment information
 static Elf_Load_Error collect_segment_info(
     Elf64_Ehdr* header,
+    Elf64_Phdr* pheaders,
     size_t data_size,
     Elf_Segment_Info* segments,
     uint16_t* segment_count
 ) {
-    Elf64_Phdr* pheaders = (Elf64_Phdr*)((uint8_t*)header + header->e_phoff);
     *segment_count = 0;
 
     for (uint16_t i = 0; i < header->e_phnum; i++) {
@@ -137,8 +146,16 @@ static Elf_Load_Error collect_segment_info(
             return ELF_ERR_DATA_TRUNCATED;
         }
 
+        // File pages are mapped in place, so they must line up with memory
+        if (pheaders[i].p_filesz > pheaders[i].p_memsz ||
+            PAGE_OFFSET(pheaders[i].p_vaddr) != PAGE_OFFSET(pheaders[i].p_offset) ||
+            *segment_count == ELF_MAX_SEGMENTS) {
+            return ELF_ERR_SEGMENT_MAPPING;
+        }
+
         // Track segment info
         Elf_Segment_Info* seg = &segments[*segment_count];
+        seg->vaddr = pheaders[i].p_vaddr;
         seg->vaddr_start = PAGE_ALIGN_DOWN(pheaders[i].p_vaddr);
         seg->vaddr_end = PAGE_ALIGN_UP(pheaders[i].p_vaddr + pheaders[i].p_memsz);
         seg->file_offset = pheaders[i].p_offset;
@@ -162,43 +179,46 @@ static Elf_Load_Error collect_segment_info(
     return ELF_LOAD_SUCCESS;
 }
 
-// Allocate and map memory for segments
+// Describe each segment as file-backed and anonymous areas; pages are
+// populated from the page cache on first touch by vma_handle_fault()
 static Elf_Load_Error map_segments(
-    void* elf_data,
+    uint32_t inode,
     Elf_Segment_Info* segments,
     uint16_t segment_count
 ) {
+    process_t* current = get_current_process();
+    if (!current) {
+        return ELF_ERR_SEGMENT_MAPPING;
+    }
+
     for (uint16_t i = 0; i < segment_count; i++) {
         Elf_Segment_Info* seg = &segments[i];
 
-        // Allocate physical pages for the entire segment range
-        for (uint64_t page = seg->vaddr_start; page < seg->vaddr_end; page += PAGE_SIZE_4K) {
-            uint64_t phys_page = (uint64_t)pmm_alloc_page();
-            if (!phys_page) {
-                return ELF_ERR_MEMORY_ALLOCATION;
-            }
+        // Determine page permissions
+        uint64_t page_flags = PTE_PRESENT | PTE_USER;
+        if (seg->flags & PF_W) page_flags |= PTE_WRITABLE;
+        if (!(seg->flags & PF_X)) page_flags |= PTE_NX;
 
-            // Determine page permissions
-            uint64_t page_flags = PTE_PRESENT | PTE_USER;
-            if (seg->flags & PF_W) page_flags |= PTE_WRITABLE;
-            if (seg->flags & PF_X) page_flags |= PTE_WRITABLE;  // Executable segments require write for now
+        // Drop whatever the previous image left in the range
+        if (sys_munmap((void*)seg->vaddr_start, seg->vaddr_end - seg->vaddr_start) < 0) {
+            return ELF_ERR_SEGMENT_MAPPING;
+        }
 
-            // Map page
-            if (!vmm_map_page(page, phys_page, page_flags)) {
-                return ELF_ERR_SEGMENT_MAPPING;
+        // Pages holding file data, the last one possibly part bss
+        uint64_t file_end = seg->file_size ? PAGE_ALIGN_UP(seg->vaddr + seg->file_size) : seg->vaddr_start;
+        if (file_end > seg->vaddr_start) {
+            // Bss sharing the last file page must read as zero
+            uint64_t data_end = seg->mem_size > seg->file_size ? seg->file_offset + seg->file_size : UINT64_MAX;
+            if (!vma_create(current->vmas, seg->vaddr_start, file_end - seg->vaddr_start,
+                            page_flags, inode, PAGE_ALIGN_DOWN(seg->file_offset), data_end)) {
+                return ELF_ERR_MEMORY_ALLOCATION;
             }
         }
 
-        // Zero out the memory first (including uninitialized parts)
-        memset((void*)seg->vaddr_start, 0, seg->vaddr_end - seg->vaddr_start);
-
-        // Copy segment data if it exists
-        if (seg->file_size > 0) {
-            memcpy(
-                (void*)(seg->vaddr_start + PAGE_OFFSET(segments[i].vaddr_start)),
-                (uint8_t*)elf_data + seg->file_offset,
-                seg->file_size
-            );
+        // The rest of the bss
+        if (seg->vaddr_end > file_end &&
+            !vma_create(current->vmas, file_end, seg->vaddr_end - file_end, page_flags, 0, 0, UINT64_MAX)) {
+            return ELF_ERR_MEMORY_ALLOCATION;
         }
     }
 
@@ -206,35 +226,60 @@ static Elf_Load_Error map_segments(
 }
 
 // Main ELF executable loading function
-int elf_load_executable(void* elf_data, size_t data_size, uint64_t* entry_point) {
-    Elf64_Ehdr* header = (Elf64_Ehdr*)elf_data;
+int elf_load_executable(uint32_t inode, size_t data_size, uint64_t* entry_point) {
+    Elf64_Ehdr header;
+    if (data_size < sizeof(Elf64_Ehdr) || !page_cache_read(inode, &header, 0, sizeof(header))) {
+        log_elf_error(ELF_ERR_DATA_TRUNCATED);
+        return ELF_ERR_DATA_TRUNCATED;
+    }
 
     // Validate ELF header
-    Elf_Load_Error validation_result = validate_elf_header(header, data_size);
+    Elf_Load_Error validation_result = validate_elf_header(&header, data_size);
     if (validation_result != ELF_LOAD_SUCCESS) {
         log_elf_error(validation_result);
         return validation_result;
     }
 
+    // Only the program headers are copied out; segments stay in the cache
+    size_t pheaders_size = header.e_phnum * sizeof(Elf64_Phdr);
+    Elf64_Phdr* pheaders = malloc(pheaders_size);
+    if (!pheaders) {
+        log_elf_error(ELF_ERR_MEMORY_ALLOCATION);
+        return ELF_ERR_MEMORY_ALLOCATION;
+    }
+    if (!page_cache_read(inode, pheaders, header.e_phoff, pheaders_size)) {
+        free(pheaders);
+        log_elf_error(ELF_ERR_DATA_TRUNCATED);
+        return ELF_ERR_DATA_TRUNCATED;
+    }
+
     // Collect and validate segment information
-    Elf_Segment_Info segments[16];  // Limit to 16 loadable segments
+    Elf_Segment_Info segments[ELF_MAX_SEGMENTS];
     uint16_t segment_count = 0;
-    validation_result = collect_segment_info(header, data_size, segments, &segment_count);
+    validation_result = collect_segment_info(&header, pheaders, data_size, segments, &segment_count);
+    free(pheaders);
     if (validation_result != ELF_LOAD_SUCCESS) {
         log_elf_error(validation_result);
         return validation_result;
     }
 
     // Map and load segments
-    validation_result = map_segments(elf_data, segments, segment_count);
+    validation_result = map_segments(inode, segments, segment_count);
     if (validation_result != ELF_LOAD_SUCCESS) {
         log_elf_error(validation_result);
         return validation_result;
     }
 
+    // Clock and PID reads without a syscall
+    process_t* current = get_current_process();
+    if (current && !vdso_map(current->pid)) {
+        log_elf_error(ELF_ERR_MEMORY_ALLOCATION);
+        return ELF_ERR_MEMORY_ALLOCATION;
+    }
+
     // Set entry point if requested
     if (entry_point) {
-        *entry_point = header->e_entry;
+        *entry_point = header.e_entry;
     }
 
     return ELF_LOAD_SUCCESS;
@@ -138,7 +138,8 @@ typedef struct {
 #define STT_FILE     4   // Source file
 
 // Function declarations for ELF handling
-int elf_load_executable(void* elf_data, size_t data_size, uint64_t* entry_point);
+// Map the segments of an executable file into the current process
+int elf_load_executable(uint32_t inode, size_t data_size, uint64_t* entry_point);
 bool elf_validate(void* elf_data, size_t data_size, Elf_Validation_Result* result);
 void* elf_get_interpreter(void* elf_data, size_t data_size);
 
@@ -0,0 +1,231 @@
+#include <core/fpu.h>
+#include <core/process.h>
+#include <core/smp.h>
+#include <core/idt.h>
+#include <mm/slab.h>
+#include <utils/asm.h>
+#include <utils/mem.h>
+#include <utils/log.h>
+
+#define CR0_MP          (1ULL << 1)
+#define CR0_EM          (1ULL << 2)
+#define CR0_TS          (1ULL << 3)
+#define CR0_NE          (1ULL << 5)
+#define CR4_OSFXSR      (1ULL << 9)
+#define CR4_OSXMMEXCPT  (1ULL << 10)
+#define CR4_OSXSAVE     (1ULL << 18)
+
+#define XFEATURE_X87     (1ULL << 0)
+#define XFEATURE_SSE     (1ULL << 1)
+#define XFEATURE_AVX     (1ULL << 2)
+#define XFEATURE_AVX512  (7ULL << 5)   // Opmask, upper ZMM halves, ZMM16-31
+
+#define FXSAVE_SIZE      512
+#define FPU_STATE_ALIGN  64
+#define FPU_DEFAULT_FCW    0x037F
+#define FPU_DEFAULT_MXCSR  0x1F80
+
+static bool use_xsave = false;
+static bool use_xsaveopt = false;
+static uint64_t xfeatures = 0;
+static uint32_t fpu_state_size = FXSAVE_SIZE;
+static struct kmem_cache* fpu_cache = NULL;
+static void* fpu_init_state = NULL;   // What a process starts with
+
+static inline void cpuid_count(uint32_t leaf, uint32_t sub, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(sub));
+}
+
+static inline uint64_t read_cr0(void) {
+    uint64_t cr0;
+    asm volatile("mov %0, cr0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint64_t cr0) {
+    asm volatile("mov cr0, %0" :: "r"(cr0) : "memory");
+}
+
+static inline void clts(void) {
+    asm volatile("clts" ::: "memory");
+}
+
+static void fpu_save(void* area) {
+    uint32_t lo = (uint32_t)xfeatures, hi = (uint32_t)(xfeatures >> 32);
+    if (use_xsaveopt) {
+        // Skips components that are unmodified since the last XRSTOR
+        asm volatile("xsaveopt64 [%0]" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else if (use_xsave) {
+        asm volatile("xsave64 [%0]" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else {
+        asm volatile("fxsave64 [%0]" :: "r"(area) : "memory");
+    }
+}
+
+static void fpu_restore(const void* area) {
+    uint32_t lo = (uint32_t)xfeatures, hi = (uint32_t)(xfeatures >> 32);
+    if (use_xsave) {
+        asm volatile("xrstor64 [%0]" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else {
+        asm volatile("fxrstor64 [%0]" :: "r"(area) : "memory");
+    }
+}
+
+// #NM: the running process touched the FPU for the first time this slice
+static void fpu_trap_handler(struct interrupt_frame_error* frame) {
+    (void)frame;
+    struct cpu_data* cpu = this_cpu();
+    process_t* current = get_current_process();
+    clts();
+    cpu->fpu_live = true;
+
+    if (!current) {
+        log_error("fpu: FPU used outside a process");
+        cpu->fpu_owner = NULL;
+        return;
+    }
+
+    // Nothing else loaded state here since it was last saved
+    if (cpu->fpu_owner == current && current->fpu_cpu == cpu->cpu_number) return;
+
+    if (!current->fpu_state) {
+        current->fpu_state = kmem_cache_alloc(fpu_cache);
+        if (!current->fpu_state) {
+            // Clean registers, but nothing to keep them in across a switch
+            log_error("fpu: no memory for FPU state");
+            fpu_restore(fpu_init_state);
+            cpu->fpu_owner = NULL;
+            return;
+        }
+        memcpy(current->fpu_state, fpu_init_state, fpu_state_size);
+    }
+
+    fpu_restore(current->fpu_state);
+    cpu->fpu_owner = current;
+    current->fpu_cpu = cpu->cpu_number;
+}
+
+void fpu_init_cpu(void) {
+    uint64_t cr0 = read_cr0();
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP | CR0_NE | CR0_TS;
+    write_cr0(cr0);
+
+    uint64_t cr4;
+    asm volatile("mov %0, cr4" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (use_xsave) cr4 |= CR4_OSXSAVE;
+    asm volatile("mov cr4, %0" :: "r"(cr4) : "memory");
+
+    if (use_xsave) {
+        asm volatile("xsetbv" :: "c"(0), "a"((uint32_t)xfeatures), "d"((uint32_t)(xfeatures >> 32)) : "memory");
+    }
+
+    struct cpu_data* cpu = this_cpu();
+    cpu->fpu_owner = NULL;
+    cpu->fpu_live = false;
+}
+
+void fpu_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    // FXSR and SSE2 are part of x86_64, XSAVE is not
+    cpuid_count(1, 0, &eax, &ebx, &ecx, &edx);
+    use_xsave = (ecx & (1 << 26)) != 0;
+
+    if (use_xsave) {
+        cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx);
+        xfeatures = (((uint64_t)edx << 32) | eax) & (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX | XFEATURE_AVX512);
+        // AVX-512 components are only valid together
+        if ((xfeatures & XFEATURE_AVX512) != XFEATURE_AVX512) xfeatures &= ~XFEATURE_AVX512;
+
+        cpuid_count(0xD, 1, &eax, &ebx, &ecx, &edx);
+        use_xsaveopt = (eax & 1) != 0;
+    }
+
+    fpu_init_cpu();
+
+    if (use_xsave) {
+        // EBX reports the size for the features enabled in XCR0
+        cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx);
+        fpu_state_size = ebx;
+    }
+
+    fpu_cache = kmem_cache_create("fpu_state", fpu_state_size, FPU_STATE_ALIGN, NULL);
+    fpu_init_state = fpu_cache ? kmem_cache_alloc(fpu_cache) : NULL;
+    if (!fpu_init_state) {
+        log_error("fpu: no memory for FPU state, FPU stays disabled");
+        return;
+    }
+
+    // An empty XSAVE header restores every component to its reset value,
+    // except the control words kept in the legacy area
+    memset(fpu_init_state, 0, fpu_state_size);
+    *(uint16_t*)fpu_init_state = FPU_DEFAULT_FCW;
+    *(uint32_t*)((uint8_t*)fpu_init_state + 24) = FPU_DEFAULT_MXCSR;
+
+    register_exception_handler(INT_DEVICE_NOT_AVAILABLE, fpu_trap_handler);
+    log_info("FPU: %s, %d byte state", use_xsaveopt ? "XSAVEOPT" : use_xsave ? "XSAVE" : "FXSAVE",
+             (int)fpu_state_size);
+}
+
+void fpu_switch(void) {
+    struct cpu_data* cpu = this_cpu();
+    if (!cpu->fpu_live) return;
+
+    // Registers stay loaded, so the owner may resume without a restore
+    if (cpu->fpu_owner) fpu_save(cpu->fpu_owner->fpu_state);
+    write_cr0(read_cr0() | CR0_TS);
+    cpu->fpu_live = false;
+}
+
+void fpu_fork(struct process* child, struct process* parent) {
+    if (!parent->fpu_state) return;
+
+    // The parent's latest state may still be in the registers
+    uint64_t flags = irq_save();
+    struct cpu_data* cpu = this_cpu();
+    if (cpu->fpu_live && cpu->fpu_owner == parent) fpu_save(parent->fpu_state);
+    irq_restore(flags);
+
+    child->fpu_state = kmem_cache_alloc(fpu_cache);
+    if (child->fpu_state) memcpy(child->fpu_state, parent->fpu_state, fpu_state_size);
+}
+
+void fpu_release(struct process* process) {
+    uint64_t flags = irq_save();
+    struct cpu_data* cpu = this_cpu();
+    if (cpu->fpu_owner == process) cpu->fpu_owner = NULL;
+    irq_restore(flags);
+
+    if (process->fpu_state) {
+        kmem_cache_free(fpu_cache, process->fpu_state);
+        process->fpu_state = NULL;
+    }
+    process->fpu_cpu = FPU_NO_CPU;
+}
+
+bool kernel_fpu_usable(void) {
+    return fpu_init_state != NULL;
+}
+
+uint64_t kernel_fpu_begin(void) {
+    uint64_t flags = irq_save();
+    struct cpu_data* cpu = this_cpu();
+
+    // Unless it was live this slice, the owner's state was saved when it
+    // was last switched out. Either way the registers are ours now.
+    if (cpu->fpu_live && cpu->fpu_owner) fpu_save(cpu->fpu_owner->fpu_state);
+    cpu->fpu_owner = NULL;
+    clts();
+    cpu->fpu_live = true;
+    return flags;
+}
+
+void kernel_fpu_end(uint64_t flags) {
+    struct cpu_data* cpu = this_cpu();
+    // The next process to use the FPU traps and loads its own state
+    write_cr0(read_cr0() | CR0_TS);
+    cpu->fpu_live = false;
+    irq_restore(flags);
+}
@@ -0,0 +1,36 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// x87/SSE/AVX state is switched lazily. CR0.TS is set whenever a process is
+// switched in, so its first FPU instruction traps and loads its state, or
+// finds it still in the registers. Only a process that used the FPU during
+// its slice pays for a save when switched out. The kernel itself is built
+// without SSE and only touches these registers between kernel_fpu_begin()
+// and kernel_fpu_end().
+
+#define FPU_NO_CPU 0xFFFFFFFF
+
+struct process;
+
+// BSP: pick XSAVEOPT/XSAVE/FXSAVE, size the state and take over #NM
+void fpu_init(void);
+// Every CPU: control registers and XCR0
+void fpu_init_cpu(void);
+
+// Before switching away from the running process, interrupts off
+void fpu_switch(void);
+
+void fpu_fork(struct process* child, struct process* parent);
+void fpu_release(struct process* process);
+
+// Borrow the vector registers for kernel code, such as crypto kernels in
+// inline asm. Whatever process state they hold is saved first. Interrupts
+// stay off in between, so keep the section short.
+bool kernel_fpu_usable(void);
+uint64_t kernel_fpu_begin(void);
+void kernel_fpu_end(uint64_t flags);
+
+#endif // FPU_H
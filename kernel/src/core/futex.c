@@ -0,0 +1,245 @@
+#include <core/futex.h>
+#include <core/process.h>
+#include <core/syscalls.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <core/timer.h>
+#include <core/workqueue.h>
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+
+#define FUTEX_BUCKETS (1U << FUTEX_HASH_BITS)
+
+// Private futexes are told apart by address space, shared ones by the
+// physical word so every mapping of it agrees
+struct futex_key {
+    uint64_t space;     // page_directory, or 0 when shared
+    uint64_t addr;
+};
+
+struct futex_bucket;
+
+// Lives on the sleeper's stack while it is queued
+struct futex_waiter {
+    struct futex_key key;
+    process_t* process;
+    struct futex_bucket* volatile bucket;   // NULL once woken; changes on requeue
+    struct futex_waiter* next;
+    bool timed_out;                         // Taken off by the timeout, not a waker
+    struct timer timeout;
+};
+
+struct futex_bucket {
+    spinlock_t lock;
+    volatile uint32_t waiters;      // Lets futex_wake() skip an idle bucket unlocked
+    struct futex_waiter* head;
+    struct futex_waiter* tail;
+};
+
+static struct futex_bucket futex_queues[FUTEX_BUCKETS];
+
+static bool futex_key(uint32_t* uaddr, bool private, struct futex_key* key) {
+    process_t* current = get_current_process();
+    if (!current || ((uint64_t)uaddr & 3)) return false;
+
+    // Touch the word so it is present before any lock is held
+    (void)__atomic_load_n(uaddr, __ATOMIC_RELAXED);
+
+    if (private) {
+        key->space = current->page_directory;
+        key->addr = (uint64_t)uaddr;
+    } else {
+        key->space = 0;
+        key->addr = vmm_get_phys_addr((uint64_t)uaddr);
+        if (!key->addr) return false;
+    }
+    return true;
+}
+
+static inline bool key_equal(const struct futex_key* a, const struct futex_key* b) {
+    return a->space == b->space && a->addr == b->addr;
+}
+
+static inline struct futex_bucket* key_bucket(const struct futex_key* key) {
+    uint64_t hash = (key->addr ^ key->space) * 0x9E3779B97F4A7C15ULL;
+    return &futex_queues[hash >> (64 - FUTEX_HASH_BITS)];
+}
+
+// Bucket lock held
+static void bucket_append(struct futex_bucket* bucket, struct futex_waiter* waiter) {
+    waiter->next = NULL;
+    if (bucket->tail) {
+        bucket->tail->next = waiter;
+    } else {
+        bucket->head = waiter;
+    }
+    bucket->tail = waiter;
+}
+
+// Bucket lock held; prev is the waiter before it or NULL
+static void bucket_unlink(struct futex_bucket* bucket, struct futex_waiter* prev, struct futex_waiter* waiter) {
+    if (prev) {
+        prev->next = waiter->next;
+    } else {
+        bucket->head = waiter->next;
+    }
+    if (bucket->tail == waiter) bucket->tail = prev;
+}
+
+// Unlink and queue to run. The waiter may return and drop its stack frame
+// as soon as bucket is cleared, so that comes last.
+static void wake_waiter(struct futex_bucket* bucket, struct futex_waiter* prev, struct futex_waiter* waiter) {
+    bucket_unlink(bucket, prev, waiter);
+    __atomic_sub_fetch(&bucket->waiters, 1, __ATOMIC_RELAXED);
+    scheduler_add(waiter->process);
+    __atomic_store_n(&waiter->bucket, NULL, __ATOMIC_RELEASE);
+}
+
+// Lock whichever bucket the waiter is on now; NULL if it has been woken
+static struct futex_bucket* lock_waiter(struct futex_waiter* waiter, uint64_t* flags) {
+    for (;;) {
+        struct futex_bucket* bucket = __atomic_load_n(&waiter->bucket, __ATOMIC_ACQUIRE);
+        if (!bucket) return NULL;
+        *flags = spinlock_acquire_irqsave(&bucket->lock);
+        if (waiter->bucket == bucket) return bucket;
+        spinlock_release_irqrestore(&bucket->lock, *flags);
+    }
+}
+
+// The deadline passed with the waiter still queued: wake it as a waker would
+static void futex_timeout(struct timer* timer) {
+    struct futex_waiter* waiter = container_of(timer, struct futex_waiter, timeout);
+    uint64_t flags;
+    struct futex_bucket* bucket = lock_waiter(waiter, &flags);
+    if (!bucket) return;
+
+    struct futex_waiter* prev = NULL;
+    for (struct futex_waiter* it = bucket->head; it != waiter; it = it->next) prev = it;
+    waiter->timed_out = true;
+    wake_waiter(bucket, prev, waiter);
+    spinlock_release_irqrestore(&bucket->lock, flags);
+}
+
+int futex_wait(uint32_t* uaddr, uint32_t val, const struct timespec* timeout, bool private) {
+    struct futex_key key;
+    if (!futex_key(uaddr, private, &key)) return -EFAULT;
+    if (timeout && (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000)) {
+        return -EINVAL;
+    }
+
+    process_t* current = get_current_process();
+    struct futex_waiter waiter = {
+        .key = key,
+        .process = current,
+    };
+    timer_init(&waiter.timeout, futex_timeout);
+    uint64_t deadline = timeout ? ktime_get_ns() + (uint64_t)timeout->tv_sec * 1000000000ULL +
+                                  (uint64_t)timeout->tv_nsec : 0;
+
+    // Count ourselves before reading the value: a waker stores the value
+    // before reading the count, so one of us sees the other
+    struct futex_bucket* bucket = key_bucket(&key);
+    uint64_t flags = spinlock_acquire_irqsave(&bucket->lock);
+    __atomic_add_fetch(&bucket->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(uaddr, __ATOMIC_SEQ_CST) != val) {
+        __atomic_sub_fetch(&bucket->waiters, 1, __ATOMIC_RELAXED);
+        spinlock_release_irqrestore(&bucket->lock, flags);
+        return -EAGAIN;
+    }
+    waiter.bucket = bucket;
+    bucket_append(bucket, &waiter);
+    current->state = PROCESS_STATE_BLOCKED;
+    // Armed under the lock, so it cannot find us half queued
+    if (timeout) mod_timer(&waiter.timeout, deadline);
+    spinlock_release_irqrestore(&bucket->lock, flags);
+
+    while (__atomic_load_n(&waiter.bucket, __ATOMIC_ACQUIRE)) {
+        schedule();
+
+        // Resumed while still queued: block again unless woken meanwhile
+        struct futex_bucket* now = lock_waiter(&waiter, &flags);
+        if (!now) break;
+        current->state = PROCESS_STATE_BLOCKED;
+        spinlock_release_irqrestore(&now->lock, flags);
+    }
+
+    // The timer may be running on another CPU and still touching the waiter
+    if (timeout) del_timer_sync(&waiter.timeout);
+    return waiter.timed_out ? -ETIMEDOUT : 0;
+}
+
+int futex_wake(uint32_t* uaddr, uint32_t count, bool private) {
+    struct futex_key key;
+    if (!futex_key(uaddr, private, &key)) return -EFAULT;
+
+    struct futex_bucket* bucket = key_bucket(&key);
+    if (!__atomic_load_n(&bucket->waiters, __ATOMIC_SEQ_CST)) return 0;
+
+    int woken = 0;
+    uint64_t flags = spinlock_acquire_irqsave(&bucket->lock);
+    struct futex_waiter* prev = NULL;
+    struct futex_waiter* waiter = bucket->head;
+    while (waiter && (uint32_t)woken < count) {
+        struct futex_waiter* next = waiter->next;
+        if (key_equal(&waiter->key, &key)) {
+            wake_waiter(bucket, prev, waiter);
+            woken++;
+        } else {
+            prev = waiter;
+        }
+        waiter = next;
+    }
+    spinlock_release_irqrestore(&bucket->lock, flags);
+    return woken;
+}
+
+int futex_requeue(uint32_t* uaddr, uint32_t nr_wake, uint32_t nr_move, uint32_t* uaddr2,
+                  bool cmp, uint32_t val, bool private) {
+    struct futex_key key, key2;
+    if (!futex_key(uaddr, private, &key) || !futex_key(uaddr2, private, &key2)) return -EFAULT;
+
+    // Both buckets locked, lower address first
+    struct futex_bucket* from = key_bucket(&key);
+    struct futex_bucket* to = key_bucket(&key2);
+    struct futex_bucket* first = from < to ? from : to;
+    struct futex_bucket* second = from < to ? to : from;
+    uint64_t flags = spinlock_acquire_irqsave(&first->lock);
+    if (second != first) spinlock_acquire(&second->lock);
+
+    int result = 0;
+    if (cmp && __atomic_load_n(uaddr, __ATOMIC_SEQ_CST) != val) {
+        result = -EAGAIN;
+    } else {
+        uint32_t woken = 0, moved = 0;
+        struct futex_waiter* prev = NULL;
+        struct futex_waiter* waiter = from->head;
+        while (waiter && (woken < nr_wake || moved < nr_move)) {
+            struct futex_waiter* next = waiter->next;
+            if (!key_equal(&waiter->key, &key)) {
+                prev = waiter;
+            } else if (woken < nr_wake) {
+                wake_waiter(from, prev, waiter);
+                woken++;
+            } else if (from != to) {
+                // The sleeper finds its new bucket through waiter->bucket
+                bucket_unlink(from, prev, waiter);
+                __atomic_sub_fetch(&from->waiters, 1, __ATOMIC_RELAXED);
+                waiter->key = key2;
+                bucket_append(to, waiter);
+                __atomic_add_fetch(&to->waiters, 1, __ATOMIC_RELAXED);
+                waiter->bucket = to;
+                moved++;
+            } else {
+                waiter->key = key2;
+                prev = waiter;
+                moved++;
+            }
+            waiter = next;
+        }
+        result = (int)(woken + moved);
+    }
+
+    if (second != first) spinlock_release(&second->lock);
+    spinlock_release_irqrestore(&first->lock, flags);
+    return result;
+}
@@ -0,0 +1,31 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Operations
+#define FUTEX_WAIT          0   // Sleep while *uaddr == val
+#define FUTEX_WAKE          1   // Wake up to val waiters
+#define FUTEX_REQUEUE       3   // Wake val, move up to val2 to uaddr2
+#define FUTEX_CMP_REQUEUE   4   // FUTEX_REQUEUE if *uaddr == val3
+
+#define FUTEX_PRIVATE_FLAG  128   // Only this address space uses the word
+#define FUTEX_CLOCK_REALTIME 256
+#define FUTEX_CMD_MASK      (~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME))
+
+#define FUTEX_HASH_BITS     8     // Buckets of waiters, shared by all keys
+
+struct timespec;
+
+// Sleep until woken, unless *uaddr no longer holds val. timeout is
+// relative and may be NULL. Returns 0, -EAGAIN or -ETIMEDOUT.
+int futex_wait(uint32_t* uaddr, uint32_t val, const struct timespec* timeout, bool private);
+// Returns the number woken
+int futex_wake(uint32_t* uaddr, uint32_t count, bool private);
+// Wake nr_wake waiters on uaddr and move up to nr_move to uaddr2; with
+// cmp, only if *uaddr still holds val. Returns woken plus moved.
+int futex_requeue(uint32_t* uaddr, uint32_t nr_wake, uint32_t nr_move, uint32_t* uaddr2,
+                  bool cmp, uint32_t val, bool private);
+
+#endif // FUTEX_H
@@ -1,23 +1,31 @@
 #include <core/gdt.h>
+#include <core/smp.h>
+#include <mm/pmm.h>
 
-static struct gdt_entry gdt_entries[7];
-static struct gdt_ptr gdt_pointer __attribute__((aligned(16)));
-static struct tss tss __attribute__((aligned(16)));
+#define GDT_ENTRIES     7
+#define IST_STACK_SIZE  0x4000
+
+// Every CPU has its own GDT and TSS: ltr marks the descriptor busy, and the
+// TSS holds the CPU's own RSP0 and interrupt stacks
+static struct gdt_entry gdt_entries[MAX_CPUS][GDT_ENTRIES];
+static struct gdt_ptr gdt_pointers[MAX_CPUS] __attribute__((aligned(16)));
+static struct tss tss[MAX_CPUS] __attribute__((aligned(16)));
 
 // External assembly function to load GDT and TSS
 extern void gdt_flush(uint64_t gdt_ptr);
 
-static void gdt_set_gate(int32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
-    gdt_entries[num].base_low = base & 0xFFFF;
-    gdt_entries[num].base_middle = (base >> 16) & 0xFF;
-    gdt_entries[num].base_high = (base >> 24) & 0xFF;
-    gdt_entries[num].limit_low = limit & 0xFFFF;
-    gdt_entries[num].granularity = ((limit >> 16) & 0x0F) | (gran & 0xF0);
-    gdt_entries[num].access = access;
+static void gdt_set_gate(struct gdt_entry* gdt, int32_t num, uint32_t base, uint32_t limit,
+                         uint8_t access, uint8_t gran) {
+    gdt[num].base_low = base & 0xFFFF;
+    gdt[num].base_middle = (base >> 16) & 0xFF;
+    gdt[num].base_high = (base >> 24) & 0xFF;
+    gdt[num].limit_low = limit & 0xFFFF;
+    gdt[num].granularity = ((limit >> 16) & 0x0F) | (gran & 0xF0);
+    gdt[num].access = access;
 }
 
-static void gdt_set_tss(uint32_t num, uint64_t base, uint32_t limit) {
-    struct gdt_tss_entry* tss_entry = (struct gdt_tss_entry*)&gdt_entries[num];
+static void gdt_set_tss(struct gdt_entry* gdt, uint32_t num, uint64_t base, uint32_t limit) {
+    struct gdt_tss_entry* tss_entry = (struct gdt_tss_entry*)&gdt[num];
 
     // Set base address
     tss_entry->base_low = base & 0xFFFF;
@@ -36,43 +44,52 @@ static void gdt_set_tss(uint32_t num, uint64_t base, uint32_t limit) {
 }
 
 void gdt_init(void) {
+    struct cpu_data* cpu = this_cpu();
+    uint32_t n = cpu->cpu_number;
+    struct gdt_entry* gdt = gdt_entries[n];
+    struct tss* t = &tss[n];
+
     // Setup GDT pointer
-    gdt_pointer.limit = (sizeof(struct gdt_entry) * 7) - 1;
-    gdt_pointer.base = (uint64_t)&gdt_entries;
+    gdt_pointers[n].limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
+    gdt_pointers[n].base = (uint64_t)gdt;
 
     // Initialize TSS
-    for (int i = 0; i < sizeof(tss); i++) {
-        ((uint8_t*)&tss)[i] = 0;
+    for (size_t i = 0; i < sizeof(struct tss); i++) {
+        ((uint8_t*)t)[i] = 0;
     }
 
-    // Set up stack pointers in TSS
-    // RSP0 is set later via gdt_load_tss
-    tss.ist1 = 0x50000;  // Debug stack
-    tss.ist2 = 0x51000;  // NMI stack
-    tss.ist3 = 0x52000;  // Double fault stack
-    tss.ist4 = 0x53000;  // General stack for interrupts
-    tss.iopb_offset = sizeof(tss);  // No I/O permission bitmap
+    // IST1-7, one stack each, see IST_* in core/idt.h. The BSP gets its
+    // stacks here, APs from smp_init(). RSP0 is set later via gdt_load_tss.
+    for (int i = 0; i < 7; i++) {
+        if (!cpu->ist_stacks[i]) {
+            void* phys = pmm_alloc_pages(pmm_order_for_pages(IST_STACK_SIZE / PAGE_SIZE));
+            if (phys) cpu->ist_stacks[i] = pmm_phys_to_virt(phys);
+        }
+        if (cpu->ist_stacks[i]) (&t->ist1)[i] = (uint64_t)cpu->ist_stacks[i] + IST_STACK_SIZE;
+    }
+    t->iopb_offset = sizeof(struct tss);  // No I/O permission bitmap
+    cpu->tss = t;
 
     // NULL descriptor
-    gdt_set_gate(0, 0, 0, 0, 0);
+    gdt_set_gate(gdt, 0, 0, 0, 0, 0);
 
     // Kernel mode code segment
-    gdt_set_gate(1, 0, 0xFFFFFFFF,
+    gdt_set_gate(gdt, 1, 0, 0xFFFFFFFF,
         GDT_PRESENT | GDT_DESCRIPTOR | GDT_EXECUTABLE | GDT_READWRITE,
         GDT_GRANULARITY | GDT_SIZE_64);
 
     // Kernel mode data segment
-    gdt_set_gate(2, 0, 0xFFFFFFFF,
+    gdt_set_gate(gdt, 2, 0, 0xFFFFFFFF,
         GDT_PRESENT | GDT_DESCRIPTOR | GDT_READWRITE,
         GDT_GRANULARITY | GDT_SIZE_64);
 
     // TSS entries (we need two entries for x86_64 TSS)
-    gdt_set_tss(5, (uint64_t)&tss, sizeof(tss));
+    gdt_set_tss(gdt, 5, (uint64_t)t, sizeof(struct tss));
 
     // Load GDT and TSS
-    gdt_flush((uint64_t)&gdt_pointer);
+    gdt_flush((uint64_t)&gdt_pointers[n]);
 }
 
 void gdt_load_tss(uint64_t rsp0) {
-    tss.rsp0 = rsp0;
+    this_cpu()->tss->rsp0 = rsp0;
 }
\ No newline at end of file
@@ -65,7 +65,9 @@ struct tss {
     uint16_t iopb_offset;
 } __attribute__((packed));
 
+// Build and load this CPU's GDT and TSS, once its GS base is set
 void gdt_init(void);
+// Stack the CPU switches to on entry from user mode
 void gdt_load_tss(uint64_t rsp0);
 
 #endif
\ No newline at end of file
@@ -16,12 +16,12 @@ gdt_flush:
     db 0x48                    ; REX prefix for 64-bit operand
     retf                       ; Far return to reload CS
 .reload_cs:
-    ; Reload data segment registers
+    ; Reload data segment registers. GS keeps its selector: loading it
+    ; would zero MSR_GS_BASE, which already points at this CPU's data.
     mov     ax, 0x10           ; Kernel data segment selector
     mov     ds, ax
     mov     es, ax
     mov     fs, ax
-    mov     gs, ax
     mov     ss, ax
     
     ; Load TSS
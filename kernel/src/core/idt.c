@@ -92,7 +92,11 @@ void idt_init(void) {
     idt_set_descriptor(INT_GENERAL_PROTECTION, isr_stub_table[INT_GENERAL_PROTECTION],
                       IDT_GATE_INTERRUPT, IST_GPF);
 
-    // Load the IDT
+    idt_load();
+}
+
+// Load the shared IDT on this CPU
+void idt_load(void) {
     asm volatile ("lidt %0" : : "m"(idtr));
 }
 
@@ -117,7 +121,7 @@ const char* get_exception_name(uint8_t vector) {
 
 // This is called from our ASM interrupt handler stubs
 void exception_handler_common(struct interrupt_frame_error* frame) {
-    uint64_t vector = frame->error_code >> 3;  // Error code contains the vector in our setup
+    uint64_t vector = interrupt_frame_vector(frame);
 
     // Handle CPU exceptions (vectors 0-31)
     if (vector < 32) {
@@ -130,7 +134,7 @@ void exception_handler_common(struct interrupt_frame_error* frame) {
             // Get CR2 for page faults
             uint64_t cr2 = 0;
             if (vector == INT_PAGE_FAULT) {
-                asm volatile("mov %%cr2, %0" : "=r"(cr2));
+                asm volatile("mov %0, cr2" : "=r"(cr2));
             }
 
             // TODO: Add proper display/logging of exception information
@@ -140,6 +144,6 @@ void exception_handler_common(struct interrupt_frame_error* frame) {
     }
     // Handle regular interrupts (vectors 32-255)
     else if (interrupt_handlers[vector]) {
-        interrupt_handlers[vector]((struct interrupt_frame*)frame);
+        interrupt_handlers[vector]((struct interrupt_frame*)&frame->rip);
     }
 }
\ No newline at end of file
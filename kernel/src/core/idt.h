@@ -69,6 +69,15 @@
 #define IRQ14                   46   // Primary ATA Hard Disk
 #define IRQ15                   47   // Secondary ATA Hard Disk
 
+// Device interrupts take vectors 0x30-0xEF as they need them, see
+// core/drivers/irq.h
+
+// Local APIC and Inter-processor Interrupt Vectors
+#define INT_LAPIC_TIMER       0xF0   // Per-CPU scheduler tick
+#define INT_PROFILE           0xFB   // Start or stop sampling on a CPU
+#define INT_RESCHEDULE        0xFC   // Wake an idle CPU to pick up work
+#define INT_TLB_SHOOTDOWN     0xFD   // Remote TLB invalidation
+
 // IDT Gate Types
 #define IDT_GATE_INTERRUPT      0x8E    // Present=1, DPL=0, Type=1110 (64-bit Interrupt Gate)
 #define IDT_GATE_TRAP          0x8F    // Present=1, DPL=0, Type=1111 (64-bit Trap Gate)
@@ -113,8 +122,14 @@ struct idt_ptr {
 typedef void (*interrupt_handler_t)(struct interrupt_frame*);
 typedef void (*interrupt_handler_error_t)(struct interrupt_frame_error*);
 
+// The ISR stub pushes the vector number just below the error code
+static inline uint8_t interrupt_frame_vector(struct interrupt_frame_error* frame) {
+    return (uint8_t)((uint64_t*)frame)[-1];
+}
+
 // Function declarations
 void idt_init(void);
+void idt_load(void);
 void idt_set_descriptor(uint8_t vector, void* isr, uint8_t flags, uint8_t ist);
 void register_interrupt_handler(uint8_t vector, interrupt_handler_t handler);
 void register_exception_handler(uint8_t vector, interrupt_handler_error_t handler);
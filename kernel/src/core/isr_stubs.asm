@@ -40,9 +40,25 @@ isr_stub_%1:
     jmp     isr_common ; Jump to common handler
 %endmacro
 
+; Macro for ISRs that can land anywhere, even between a swapgs and the
+; instruction next to it (NMI, machine check)
+%macro ISR_PARANOID 1
+align 16
+isr_stub_%1:
+    push    0              ; Push dummy error code
+    push    %1             ; Push interrupt number
+    jmp     isr_paranoid   ; Jump to paranoid handler
+%endmacro
+
 ; Common interrupt handling code
 align 16
 isr_common:
+    ; Switch to kernel GS if we came from user mode (CS at rsp + 24)
+    test    qword [rsp + 24], 3
+    jz      .kernel_entry
+    swapgs
+.kernel_entry:
+
     ; Save all general purpose registers
     push    rax
     push    rcx
@@ -60,25 +76,16 @@ isr_common:
     push    r14
     push    r15
 
-    ; Save SIMD state
-    mov     rax, cr0
-    mov     rdx, rax
-    and     rax, 0xFFFB    ; Clear TS bit
-    mov     cr0, rax       ; Disable #NM
+    ; C code expects DF clear, the interrupted code may have set it
+    cld
 
-    sub     rsp, 512
-    fxsave  [rsp]          ; Save FPU/SSE state
+    ; The kernel never touches FPU/SSE registers, so they and CR0.TS are
+    ; left as they are; core/fpu.c switches them lazily
 
     ; Call C handler
-    mov     rcx, rsp       ; Pass pointer to interrupt frame
+    lea     rdi, [rsp + 16 * 8] ; Pass pointer to the error code / CPU frame
     call    exception_handler_common
 
-    ; Restore SIMD state
-    fxrstor [rsp]
-    add     rsp, 512
-
-    mov     cr0, rdx       ; Restore original CR0
-
     ; Restore general purpose registers
     pop     r15
     pop     r14
@@ -96,17 +103,82 @@ isr_common:
     pop     rcx
     pop     rax
 
+    ; Back to user GS if returning to user mode
+    test    qword [rsp + 24], 3
+    jz      .kernel_exit
+    swapgs
+.kernel_exit:
+
     ; Remove error code and interrupt number
     add     rsp, 16
 
     ; Return from interrupt
     iretq
 
+; Paranoid entry: CS says nothing about GS when the interrupt hits the
+; syscall entry before its swapgs or an exit path after it, so the GS base
+; itself decides. The kernel's is a higher-half address, a user one never is.
+align 16
+isr_paranoid:
+    push    rax
+    push    rcx
+    push    rdx
+    push    rbx
+    push    rbp
+    push    rsi
+    push    rdi
+    push    r8
+    push    r9
+    push    r10
+    push    r11
+    push    r12
+    push    r13
+    push    r14
+    push    r15
+
+    cld
+
+    mov     ecx, 0xC0000101    ; MSR_GS_BASE
+    rdmsr
+    xor     ebx, ebx           ; rbx is callee-saved: 1 if we swapped
+    test    edx, edx
+    js      .kernel_gs
+    swapgs
+    mov     ebx, 1
+.kernel_gs:
+
+    lea     rdi, [rsp + 16 * 8] ; Pass pointer to the error code / CPU frame
+    call    exception_handler_common
+
+    test    ebx, ebx
+    jz      .restored_gs
+    swapgs
+.restored_gs:
+
+    pop     r15
+    pop     r14
+    pop     r13
+    pop     r12
+    pop     r11
+    pop     r10
+    pop     r9
+    pop     r8
+    pop     rdi
+    pop     rsi
+    pop     rbp
+    pop     rbx
+    pop     rdx
+    pop     rcx
+    pop     rax
+
+    add     rsp, 16
+    iretq
+
 ; Generate stubs for all interrupts
 ; CPU Exceptions (some push error codes, some don't)
 ISR_NOERROR 0    ; Divide by Zero
 ISR_NOERROR 1    ; Debug
-ISR_NOERROR 2    ; Non-maskable Interrupt
+ISR_PARANOID 2   ; Non-maskable Interrupt
 ISR_NOERROR 3    ; Breakpoint
 ISR_NOERROR 4    ; Overflow
 ISR_NOERROR 5    ; Bound Range Exceeded
@@ -122,7 +194,7 @@ ISR_ERROR   14   ; Page Fault
 ISR_NOERROR 15   ; Reserved
 ISR_NOERROR 16   ; x87 Floating-Point Exception
 ISR_ERROR   17   ; Alignment Check
-ISR_NOERROR 18   ; Machine Check
+ISR_PARANOID 18  ; Machine Check
 ISR_NOERROR 19   ; SIMD Floating-Point Exception
 ISR_NOERROR 20   ; Virtualization Exception
 ISR_ERROR   21   ; Control Protection Exception
@@ -0,0 +1,462 @@
+#include <core/kbench.h>
+#include <core/process.h>
+#include <core/smp.h>
+#include <core/syscalls.h>
+#include <core/time.h>
+#include <core/uring.h>
+#include <core/drivers/net/e1000.h>
+#include <core/drivers/net/ip.h>
+#include <core/drivers/net/netdev.h>
+#include <mm/heap.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/vmalloc.h>
+#include <utils/asm.h>
+#include <utils/io.h>
+#include <utils/log.h>
+#include <utils/mem.h>
+
+#define KBENCH_BATCH        512         // Operations per timed batch
+#define KBENCH_ROUNDS       64          // Batches per benchmark
+#define KBENCH_COPY_BYTES   (64 * 1024 * 1024)  // Moved per memcpy benchmark
+#define KBENCH_COPY_MAX     65536
+#define KBENCH_NET_FRAMES   1024
+#define KBENCH_NET_TIMEOUT_NS 100000000ULL      // Per frame, before loopback counts as broken
+#define KBENCH_ETH_TYPE     0x88B5      // Local experimental, which the stack drops
+#define KBENCH_LINE_MAX     160
+#define KBENCH_URING_PAGES  256         // Under 2MB, so each page faults in on its own
+
+// Scratch kernel addresses for the mapping benchmarks, at the far end of
+// the vmalloc range
+#define KBENCH_MAP_BASE     (VMALLOC_BASE + VMALLOC_SIZE - KBENCH_BATCH * PAGE_SIZE)
+
+// QEMU's isa-debug-exit, as make bench starts it
+#define KBENCH_EXIT_PORT    0xF4
+
+struct kbench_timer {
+    uint64_t ns;
+    uint64_t cycles;
+    uint64_t ops;
+    uint64_t start_ns;
+    uint64_t start_cycles;
+};
+
+// A benchmark times only its operations, leaving setup and cleanup out,
+// and returns false when it cannot run here
+struct kbench {
+    const char* name;
+    bool (*run)(struct kbench_timer* timer, uint64_t size);
+    uint64_t size;      // Bytes per operation, 0 where that means nothing
+};
+
+static void* slots[KBENCH_BATCH];
+static volatile uint64_t sink;
+
+static inline void timer_start(struct kbench_timer* timer) {
+    timer->start_ns = ktime_get_ns();
+    timer->start_cycles = rdtsc();
+}
+
+static inline void timer_stop(struct kbench_timer* timer, uint64_t ops) {
+    timer->cycles += rdtsc() - timer->start_cycles;
+    timer->ns += ktime_get_ns() - timer->start_ns;
+    timer->ops += ops;
+}
+
+static bool free_slots(void) {
+    bool ok = true;
+    for (uint32_t i = 0; i < KBENCH_BATCH; i++) {
+        if (slots[i]) {
+            free(slots[i]);
+        } else {
+            ok = false;
+        }
+        slots[i] = NULL;
+    }
+    return ok;
+}
+
+static bool bench_heap_alloc(struct kbench_timer* timer, uint64_t size) {
+    for (uint32_t round = 0; round < KBENCH_ROUNDS; round++) {
+        timer_start(timer);
+        for (uint32_t i = 0; i < KBENCH_BATCH; i++) slots[i] = malloc(size);
+        timer_stop(timer, KBENCH_BATCH);
+        if (!free_slots()) return false;
+    }
+    return true;
+}
+
+static bool bench_heap_free(struct kbench_timer* timer, uint64_t size) {
+    for (uint32_t round = 0; round < KBENCH_ROUNDS; round++) {
+        for (uint32_t i = 0; i < KBENCH_BATCH; i++) {
+            slots[i] = malloc(size);
+            if (!slots[i]) {
+                free_slots();
+                return false;
+            }
+        }
+        timer_start(timer);
+        for (uint32_t i = 0; i < KBENCH_BATCH; i++) free(slots[i]);
+        timer_stop(timer, KBENCH_BATCH);
+        memset(slots, 0, sizeof(slots));
+    }
+    return true;
+}
+
+static bool bench_pmm_alloc_page(struct kbench_timer* timer, uint64_t size) {
+    (void)size;
+    for (uint32_t round = 0; round < KBENCH_ROUNDS; round++) {
+        timer_start(timer);
+        for (uint32_t i = 0; i < KBENCH_BATCH; i++) slots[i] = pmm_alloc_page();
+        timer_stop(timer, KBENCH_BATCH);
+
+        bool ok = true;
+        for (uint32_t i = 0; i < KBENCH_BATCH; i++) {
+            if (slots[i]) {
+                pmm_free_page(slots[i]);
+            } else {
+                ok = false;
+            }
+            slots[i] = NULL;
+        }
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Every scratch page maps the same frame; only the tables matter here
+static bool map_setup(uint64_t* frame) {
+    if (!vmm_is_unmapped(KBENCH_MAP_BASE, KBENCH_BATCH * PAGE_SIZE)) return false;
+    *frame = (uint64_t)pmm_alloc_page();
+    return *frame != 0;
+}
+
+static bool bench_vmm_map_page(struct kbench_timer* timer, uint64_t size) {
+    (void)size;
+    uint64_t frame;
+    if (!map_setup(&frame)) return false;
+
+    bool ok = true;
+    for (uint32_t round = 0; round < KBENCH_ROUNDS && ok; round++) {
+        timer_start(timer);
+        for (uint32_t i = 0; i < KBENCH_BATCH; i++) {
+            ok &= vmm_map_page(KBENCH_MAP_BASE + i * PAGE_SIZE, frame, PTE_WRITABLE | PTE_NX);
+        }
+        timer_stop(timer, KBENCH_BATCH);
+        vmm_unmap_range(KBENCH_MAP_BASE, KBENCH_BATCH * PAGE_SIZE);
+    }
+    pmm_free_page((void*)frame);
+    return ok;
+}
+
+static bool bench_vmm_unmap_page(struct kbench_timer* timer, uint64_t size) {
+    (void)size;
+    uint64_t frame;
+    if (!map_setup(&frame)) return false;
+
+    bool ok = true;
+    for (uint32_t round = 0; round < KBENCH_ROUNDS && ok; round++) {
+        for (uint32_t i = 0; i < KBENCH_BATCH && ok; i++) {
+            ok = vmm_map_page(KBENCH_MAP_BASE + i * PAGE_SIZE, frame, PTE_WRITABLE | PTE_NX);
+        }
+        if (!ok) break;
+
+        timer_start(timer);
+        for (uint32_t i = 0; i < KBENCH_BATCH; i++) vmm_unmap_page(KBENCH_MAP_BASE + i * PAGE_SIZE);
+        timer_stop(timer, KBENCH_BATCH);
+    }
+    vmm_unmap_range(KBENCH_MAP_BASE, KBENCH_BATCH * PAGE_SIZE);
+    pmm_free_page((void*)frame);
+    return ok;
+}
+
+static volatile bool partner_stop;
+static volatile uint64_t partner_runs;
+
+static void switch_partner(void) {
+    while (!partner_stop) {
+        partner_runs++;
+        schedule();
+    }
+}
+
+// Both processes are pinned to this CPU at the same level, so every
+// schedule() goes to the partner and back. Only the partner's turns
+// count, in case something else got in between.
+static bool bench_context_switch(struct kbench_timer* timer, uint64_t size) {
+    (void)size;
+    process_t* self = get_current_process();
+    process_t* partner = process_create(switch_partner, self->priority, "kbench-switch");
+    if (!partner) return false;
+    partner->cpu = self->cpu;
+    partner->pinned = true;
+    partner_stop = false;
+    scheduler_add(partner);
+    schedule();
+
+    for (uint32_t round = 0; round < KBENCH_ROUNDS; round++) {
+        uint64_t runs = partner_runs;
+        timer_start(timer);
+        for (uint32_t i = 0; i < KBENCH_BATCH; i++) schedule();
+        timer_stop(timer, 0);
+        timer->ops += 2 * (partner_runs - runs);
+    }
+
+    partner_stop = true;
+    schedule();
+    return true;
+}
+
+// Through the table, as kernel callers go. There is no user program to
+// run here, so SYSCALL and SYSRET themselves are not in the number.
+static bool bench_syscall(struct kbench_timer* timer, uint64_t size) {
+    (void)size;
+    for (uint32_t round = 0; round < KBENCH_ROUNDS; round++) {
+        timer_start(timer);
+        for (uint32_t i = 0; i < KBENCH_BATCH; i++) {
+            sink += (uint64_t)syscall_handler(__NR_getpid, 0, 0, 0, 0, 0, 0);
+        }
+        timer_stop(timer, KBENCH_BATCH);
+    }
+    return true;
+}
+
+static bool bench_ip_checksum(struct kbench_timer* timer, uint64_t size) {
+    uint8_t* buffer = malloc(size);
+    if (!buffer) return false;
+    for (uint64_t i = 0; i < size; i++) buffer[i] = (uint8_t)(i * 7);
+
+    for (uint32_t round = 0; round < KBENCH_ROUNDS; round++) {
+        timer_start(timer);
+        for (uint32_t i = 0; i < KBENCH_BATCH; i++) sink += ip_calculate_checksum(buffer, size);
+        timer_stop(timer, KBENCH_BATCH);
+    }
+    free(buffer);
+    return true;
+}
+
+static bool bench_memcpy(struct kbench_timer* timer, uint64_t size) {
+    uint8_t* src = vmalloc(KBENCH_COPY_MAX);
+    uint8_t* dest = vmalloc(KBENCH_COPY_MAX);
+    if (!src || !dest) {
+        if (src) vfree(src);
+        if (dest) vfree(dest);
+        return false;
+    }
+    memset(src, 0x5A, KBENCH_COPY_MAX);
+    memset(dest, 0, KBENCH_COPY_MAX);
+
+    uint64_t iters = KBENCH_COPY_BYTES / size;
+    timer_start(timer);
+    for (uint64_t i = 0; i < iters; i++) memcpy(dest, src, size);
+    timer_stop(timer, iters);
+
+    vfree(src);
+    vfree(dest);
+    return true;
+}
+
+// One frame at a time through the PHY and back up the RX path: send, then
+// yield until the bottom half has counted it
+static bool bench_e1000_loopback(struct kbench_timer* timer, uint64_t size) {
+    struct netdev* dev = netdev_get_by_name("eth0");
+    if (!dev) return false;
+    if (!e1000_set_loopback(dev, true)) {
+        netdev_put(dev);
+        return false;
+    }
+
+    static uint8_t frame[NETDEV_MAX_FRAME];
+    memcpy(frame, dev->mac, 6);
+    memcpy(frame + 6, dev->mac, 6);
+    frame[12] = KBENCH_ETH_TYPE >> 8;
+    frame[13] = KBENCH_ETH_TYPE & 0xFF;
+    memset(frame + NETDEV_ETH_HLEN, 0xA5, size - NETDEV_ETH_HLEN);
+
+    struct netdev_stats stats;
+    netdev_get_stats(dev, &stats);
+    uint64_t received = stats.rx_packets;
+
+    bool ok = true;
+    for (uint32_t i = 0; i < KBENCH_NET_FRAMES && ok; i++) {
+        timer_start(timer);
+        ok = e1000_send_packet(dev, frame, (uint16_t)size);
+        uint64_t deadline = ktime_get_ns() + KBENCH_NET_TIMEOUT_NS;
+        while (ok) {
+            netdev_get_stats(dev, &stats);
+            if (stats.rx_packets != received) break;
+            if (ktime_get_ns() >= deadline) ok = false;
+            schedule();
+        }
+        if (ok) {
+            timer_stop(timer, 1);
+            received = stats.rx_packets;
+        }
+    }
+
+    e1000_set_loopback(dev, false);
+    netdev_put(dev);
+    return ok;
+}
+
+// A pipe READ through a ring into each page of a fresh anonymous mapping,
+// so every operation faults a lazy page in from a ring worker, which only
+// the owner's areas describe
+static bool bench_uring_read_fault(struct kbench_timer* timer, uint64_t size) {
+    int pipefd[2];
+    if (syscall_handler(__NR_pipe, (uint64_t)pipefd, 0, 0, 0, 0, 0) < 0) return false;
+
+    struct uring_params params = { 0 };
+    long ring_fd = syscall_handler(__NR_io_uring_setup, 1, (uint64_t)&params, 0, 0, 0, 0);
+    if (ring_fd < 0) {
+        syscall_handler(__NR_close, pipefd[0], 0, 0, 0, 0, 0);
+        syscall_handler(__NR_close, pipefd[1], 0, 0, 0, 0, 0);
+        return false;
+    }
+    struct uring_rings* rings = (struct uring_rings*)params.rings;
+    struct uring_sqe* sqes = (struct uring_sqe*)(params.rings + rings->sqe_offset);
+    struct uring_cqe* cqes = (struct uring_cqe*)(params.rings + rings->cqe_offset);
+
+    static uint8_t data[PAGE_SIZE];
+    memset(data, 0xC3, size);
+    uint64_t length = KBENCH_URING_PAGES * PAGE_SIZE;
+
+    bool ok = true;
+    for (uint32_t round = 0; round < KBENCH_ROUNDS && ok; round++) {
+        long addr = syscall_handler(__NR_mmap, 0, length, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, (uint64_t)-1, 0);
+        if (addr < 0) {
+            ok = false;
+            break;
+        }
+
+        timer_start(timer);
+        for (uint32_t i = 0; i < KBENCH_URING_PAGES && ok; i++) {
+            uint8_t* buffer = (uint8_t*)addr + (uint64_t)i * PAGE_SIZE;
+            ok = syscall_handler(__NR_write, pipefd[1], (uint64_t)data, size, 0, 0, 0) == (long)size;
+
+            uint32_t tail = rings->sq_tail;
+            struct uring_sqe* sqe = &sqes[tail & rings->sq_mask];
+            memset(sqe, 0, sizeof(struct uring_sqe));
+            sqe->opcode = URING_OP_READ;
+            sqe->fd = pipefd[0];
+            sqe->addr = (uint64_t)buffer;
+            sqe->len = (uint32_t)size;
+            sqe->off = (uint64_t)-1;
+            __atomic_store_n(&rings->sq_tail, tail + 1, __ATOMIC_RELEASE);
+            syscall_handler(__NR_io_uring_enter, (uint64_t)ring_fd, 1, 1, URING_ENTER_GETEVENTS, 0, 0);
+
+            uint32_t head = rings->cq_head;
+            ok &= head != __atomic_load_n(&rings->cq_tail, __ATOMIC_ACQUIRE) &&
+                  cqes[head & rings->cq_mask].res == (int32_t)size && buffer[size - 1] == 0xC3;
+            __atomic_store_n(&rings->cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+        timer_stop(timer, KBENCH_URING_PAGES);
+
+        syscall_handler(__NR_munmap, (uint64_t)addr, length, 0, 0, 0, 0);
+    }
+    if (!ok) log_error("kbench: uring READ into a lazy mapping failed");
+
+    syscall_handler(__NR_close, (uint64_t)ring_fd, 0, 0, 0, 0, 0);
+    syscall_handler(__NR_munmap, params.rings, params.size, 0, 0, 0, 0);
+    syscall_handler(__NR_close, pipefd[0], 0, 0, 0, 0, 0);
+    syscall_handler(__NR_close, pipefd[1], 0, 0, 0, 0, 0);
+    return ok;
+}
+
+static const struct kbench benchmarks[] = {
+    { "heap_alloc",             bench_heap_alloc,       64 },
+    { "heap_alloc",             bench_heap_alloc,       1024 },
+    { "heap_free",              bench_heap_free,        64 },
+    { "heap_free",              bench_heap_free,        1024 },
+    { "pmm_alloc_page",         bench_pmm_alloc_page,   0 },
+    { "vmm_map_page",           bench_vmm_map_page,     0 },
+    { "vmm_unmap_page",         bench_vmm_unmap_page,   0 },
+    { "context_switch",         bench_context_switch,   0 },
+    { "syscall_getpid",         bench_syscall,          0 },
+    { "ip_calculate_checksum",  bench_ip_checksum,      20 },
+    { "ip_calculate_checksum",  bench_ip_checksum,      1500 },
+    { "memcpy",                 bench_memcpy,           64 },
+    { "memcpy",                 bench_memcpy,           4096 },
+    { "memcpy",                 bench_memcpy,           KBENCH_COPY_MAX },
+    { "e1000_loopback",         bench_e1000_loopback,   64 },
+    { "e1000_loopback",         bench_e1000_loopback,   1514 },
+    { "uring_read_fault",       bench_uring_read_fault, 64 },
+};
+
+static char* append(char* p, char* end, const char* str) {
+    while (*str && p < end) *p++ = *str++;
+    return p;
+}
+
+static char* append_number(char* p, char* end, uint64_t value, int width) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (width-- > n && p < end) *p++ = '0';
+    while (n && p < end) *p++ = digits[--n];
+    return p;
+}
+
+static void report(const struct kbench* bench, const struct kbench_timer* timer) {
+    char line[KBENCH_LINE_MAX];
+    char* end = line + KBENCH_LINE_MAX - 1;
+    char* p = append(line, end, "kbench name=");
+    p = append(p, end, bench->name);
+    if (bench->size) {
+        p = append(p, end, " size=");
+        p = append_number(p, end, bench->size, 0);
+    }
+
+    if (!timer) {
+        p = append(p, end, " skipped");
+    } else {
+        // Thousandths of a nanosecond, as the fast ones take a few
+        uint64_t ps = timer->ns * 1000 / timer->ops;
+        p = append(p, end, " ops=");
+        p = append_number(p, end, timer->ops, 0);
+        p = append(p, end, " ns=");
+        p = append_number(p, end, timer->ns, 0);
+        p = append(p, end, " ns_per_op=");
+        p = append_number(p, end, ps / 1000, 0);
+        p = append(p, end, ".");
+        p = append_number(p, end, ps % 1000, 3);
+        p = append(p, end, " cycles_per_op=");
+        p = append_number(p, end, timer->cycles / timer->ops, 0);
+    }
+    *p = '\0';
+    log_string(LOG_LEVEL_RAW, line);
+}
+
+static void kbench_main(void) {
+    uint32_t count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    log_info("kbench: running %d benchmarks", (int)count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct kbench_timer timer = { 0 };
+        bool ok = benchmarks[i].run(&timer, benchmarks[i].size) && timer.ops;
+        report(&benchmarks[i], ok ? &timer : NULL);
+    }
+
+    log_info("kbench: done");
+    log_flush();
+
+    // Ends the QEMU run; nothing else listens on this port
+    outb(KBENCH_EXIT_PORT, 0);
+}
+
+void kbench_start(void) {
+    process_t* runner = process_create(kbench_main, 0, "kbench");
+    if (!runner) {
+        log_error("kbench: cannot start the runner");
+        return;
+    }
+
+    // Pinned, so the context switch partner can share its CPU
+    runner->cpu = smp_get_current_cpu();
+    runner->pinned = true;
+    scheduler_add(runner);
+}
@@ -0,0 +1,16 @@
+#ifndef KBENCH_H
+#define KBENCH_H
+
+// In-kernel microbenchmarks, run by the kernel-kbench build (make kbench,
+// make bench) once boot is complete. Each one reports one line on the
+// serial port for scripts to compare between builds:
+//
+//   kbench name=memcpy size=4096 ops=16384 ns=1234567 ns_per_op=75.351 cycles_per_op=226
+//
+// or "skipped" in place of the numbers when it cannot run on this machine.
+// The runner then leaves QEMU through isa-debug-exit.
+
+// Queue the runner on this CPU and return
+void kbench_start(void);
+
+#endif // KBENCH_H
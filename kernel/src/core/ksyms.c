@@ -0,0 +1,27 @@
+#include <core/ksyms.h>
+#include <stddef.h>
+
+extern const struct ksym __ksyms_start[];
+extern const struct ksym __ksyms_end[];
+
+const char* ksym_lookup(uint64_t address, uint64_t* start) {
+    size_t count = (size_t)(__ksyms_end - __ksyms_start);
+
+    // The last symbol only marks the end of code
+    if (count < 2 || address < __ksyms_start[0].address || address >= __ksyms_start[count - 1].address) {
+        return NULL;
+    }
+
+    // Last symbol at or below address
+    size_t low = 0, high = count - 1;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (__ksyms_start[mid].address <= address) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    if (start) *start = __ksyms_start[low].address;
+    return __ksyms_start[low].name;
+}
@@ -0,0 +1,17 @@
+#ifndef KSYMS_H
+#define KSYMS_H
+
+#include <stdint.h>
+
+// Kernel function symbols sorted by address, generated from the linked
+// kernel by gen-ksyms and linked into .ksyms, see linker-x86_64.ld
+struct ksym {
+    uint64_t address;
+    const char* name;
+};
+
+// The function containing address and where it starts; NULL if address is
+// not kernel code or the kernel was linked without the table
+const char* ksym_lookup(uint64_t address, uint64_t* start);
+
+#endif // KSYMS_H
@@ -1,6 +1,5 @@
 #include <core/pit.h>
 #include <utils/io.h>
-#include <core/process.h>
 
 #define PIT_CHANNEL0 0x40
 #define PIT_CHANNEL1 0x41
@@ -22,7 +21,6 @@ void pit_init(void) {
     uint16_t divisor = PIT_FREQUENCY / 100;
     outb(PIT_CHANNEL0, divisor & 0xFF);        // Low byte
     outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF); // High byte
-    scheduler_tick();
 }
 
 void pit_wait(uint32_t milliseconds) {
@@ -34,8 +32,10 @@ void pit_wait(uint32_t milliseconds) {
     outb(PIT_CHANNEL0, cycles & 0xFF);
     outb(PIT_CHANNEL0, (cycles >> 8) & 0xFF);
 
-    // Wait for countdown to finish
-    while (!(inb(PIT_CHANNEL0) & 0x80)) {
+    // Wait for countdown to finish: read back channel 0 status, bit 7 is the output pin
+    while (1) {
+        outb(PIT_COMMAND, 0xE2);
+        if (inb(PIT_CHANNEL0) & 0x80) break;
         __asm__ volatile("pause");
     }
 }
\ No newline at end of file
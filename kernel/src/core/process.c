@@ -1,30 +1,102 @@
 #include <core/process.h>
+#include <core/fpu.h>
 #include <mm/heap.h>
+#include <mm/slab.h>
 #include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/vma.h>
 #include <utils/mem.h>
 #include <utils/str.h>
+#include <utils/asm.h>
 #include <core/idt.h>
-
-#define MAX_PROCESSES 256
+#include <core/smp.h>
+#include <core/pit.h>
+#include <core/time.h>
+#include <core/timer.h>
+#include <core/rcu.h>
+#include <core/sched_trace.h>
+#include <core/profile.h>
+#include <fs/file.h>
+#include <core/drivers/lapic.h>
+
+#define MAX_PROCESSES 4096
+#define PID_HASH_SIZE 1024   // Buckets, a power of two
 #define STACK_SIZE    16384  // 16KB stack
 
-static process_t *current_process = NULL;
+// Per-CPU queues of ready processes, one FIFO per priority level
+struct run_queue {
+    spinlock_t lock;
+    process_t *head[SCHED_LEVELS];
+    process_t *tail[SCHED_LEVELS];
+    uint32_t bitmap;               // Bit n set when level n is non-empty
+    uint64_t last_boost;           // scheduler_clock() when levels were last reset
+    uint64_t slice_start;          // scheduler_clock() when the current slice began
+    volatile uint32_t count;       // Queued processes, read unlocked when stealing
+    process_t *volatile current;   // NULL while the CPU idles
+    process_t *switching_from;     // Previous process until the switch completes
+    bool preempting;               // The next switch is a slice expiry or preemption
+    cpu_state_t idle_state;        // The CPU's own boot context, run when idle
+    bool online;                   // Timer running, may receive work
+};
+
 process_t *process_list = NULL;
+static process_t *pid_hash[PID_HASH_SIZE];
 static uint32_t next_pid = 1;
 static uint32_t process_count = 0;
+static spinlock_t process_lock = SPINLOCK_INIT;
+static struct kmem_cache *process_cache = NULL;
+
+static struct run_queue run_queues[MAX_CPUS];
+
+// Assembly function declarations
+extern void context_switch(cpu_state_t *old_state, cpu_state_t *new_state);
+extern void process_start(void);
+
+static inline struct run_queue *this_rq(void) {
+    return &run_queues[smp_get_current_cpu()];
+}
+
+// Lower levels run first with short slices; demoted levels get longer ones
+static inline uint32_t sched_slice(uint32_t level) {
+    return SCHED_SLICE_US << level;
+}
+
+// Microseconds since boot, from the TSC
+uint64_t scheduler_clock(void) {
+    return ktime_get_ns() / 1000;
+}
+
+// Start a fresh slice for the process now running on this CPU, or stop
+// the timer if the CPU is going idle
+static void arm_slice(struct run_queue *rq, process_t *process) {
+    rq->slice_start = scheduler_clock();
+    if (process) {
+        process->time_slice = sched_slice(process->level);
+        process->time_used = 0;
+        timer_set_slice(profile_timer_interval(process->time_slice));
+    } else {
+        timer_set_slice(0);
+    }
+}
 
-// Round-robin scheduler queue
-static process_t *ready_queue_head = NULL;
-static process_t *ready_queue_tail = NULL;
+// Charge the running process for the time since its slice began
+static void account_slice(struct run_queue *rq, process_t *process) {
+    if (process) {
+        process->time_used = (uint32_t)(scheduler_clock() - rq->slice_start);
+    }
+}
 
 // Initialize process management
 void process_init(void) {
-    current_process = NULL;
     process_list = NULL;
+    memset(pid_hash, 0, sizeof(pid_hash));
     next_pid = 1;
     process_count = 0;
-    ready_queue_head = NULL;
-    ready_queue_tail = NULL;
+
+    if (!process_cache) {
+        process_cache = kmem_cache_create("process", sizeof(process_t), 16, NULL);
+    }
+    vma_init();
 }
 
 // Create a new process
@@ -34,44 +106,100 @@ process_t *process_create(void (*entry)(void), uint32_t priority, const char *na
     }
 
     // Allocate process structure
-    process_t *process = malloc(sizeof(process_t));
+    process_t *process = kmem_cache_alloc(process_cache);
     if (!process) {
         return NULL;
     }
 
     // Initialize process control block
-    process->pid = next_pid++;
+    process->pid = __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED);
     process->state = PROCESS_STATE_NEW;
     process->stack_size = STACK_SIZE;
     process->next = NULL;
-    process->time_slice = 100;  // 100ms default time slice
+    process->prev = NULL;
+    process->pid_next = NULL;
+    process->parent = NULL;
+    process->children = NULL;
+    process->sibling_next = NULL;
+    process->sibling_prev = NULL;
+    process->run_next = NULL;
+    process->run_prev = NULL;
+    process->on_rq = false;
+    process->wait_next = NULL;
+    process->wait_queue = NULL;
+    process->cpu = smp_get_current_cpu();
+    process->on_cpu = false;
+    process->pinned = false;
+    process->priority = priority < SCHED_LEVELS ? priority : SCHED_LEVELS - 1;
+    process->level = process->priority;
+    process->time_slice = sched_slice(process->level);
     process->time_used = 0;
-    process->priority = priority;
+    process->vmas = NULL;
+    process->fpu_state = NULL;
+    process->fpu_cpu = FPU_NO_CPU;
+    process->ready_ns = 0;
+    process->files = NULL;
+    process->worker_data = NULL;
     strncpy(process->name, name, 31);
     process->name[31] = '\0';
 
     // Allocate stack
-    process->stack = pmm_alloc_page();
-    if (!process->stack) {
-        free(process);
+    void *stack_phys = pmm_alloc_pages(pmm_order_for_pages(STACK_SIZE / PAGE_SIZE));
+    if (!stack_phys) {
+        kmem_cache_free(process_cache, process);
+        return NULL;
+    }
+    process->stack = pmm_phys_to_virt(stack_phys);
+
+    // Private address space sharing the kernel half
+    process->page_directory = vmm_create_address_space();
+    if (!process->page_directory) {
+        pmm_free_pages(stack_phys, pmm_order_for_pages(STACK_SIZE / PAGE_SIZE));
+        kmem_cache_free(process_cache, process);
+        return NULL;
+    }
+    process->vmas = vma_list_create();
+    if (!process->vmas) {
+        vmm_destroy_address_space(process->page_directory);
+        pmm_free_pages(stack_phys, pmm_order_for_pages(STACK_SIZE / PAGE_SIZE));
+        kmem_cache_free(process_cache, process);
         return NULL;
     }
 
     // Allocate and initialize CPU state at top of stack
-    process->cpu_state = (cpu_state_t*)(process->stack + STACK_SIZE - sizeof(cpu_state_t));
+    uint8_t *stack_top = (uint8_t*)process->stack + STACK_SIZE;
+    process->cpu_state = (cpu_state_t*)(stack_top - sizeof(cpu_state_t));
     memset(process->cpu_state, 0, sizeof(cpu_state_t));
 
-    // Set initial CPU state
-    process->cpu_state->rip = (uint64_t)entry;
-    process->cpu_state->rflags = 0x202;  // Interrupts enabled
+    // Set initial CPU state; process_start enables interrupts and calls entry
+    process->cpu_state->rip = (uint64_t)process_start;
+    process->cpu_state->rbx = (uint64_t)entry;
+    process->cpu_state->rflags = 0x002;  // Interrupts off until the switch completes
     process->cpu_state->cs = 0x08;       // Kernel code segment
     process->cpu_state->ss = 0x10;       // Kernel data segment
-    process->cpu_state->rsp = (uint64_t)(process->stack + STACK_SIZE);
+    process->cpu_state->rsp = (uint64_t)process->cpu_state & ~0xFULL;  // Stack grows below the state
 
-    // Add to process list
+    // Add to process list, the PID hash and the creator's children
+    process_t *parent = get_current_process();
+    uint64_t flags = irq_save();
+    spinlock_acquire(&process_lock);
     process->next = process_list;
+    if (process_list) process_list->prev = process;
     process_list = process;
+
+    process_t **bucket = &pid_hash[process->pid & (PID_HASH_SIZE - 1)];
+    process->pid_next = *bucket;
+    *bucket = process;
+
+    if (parent) {
+        process->parent = parent;
+        process->sibling_next = parent->children;
+        if (parent->children) parent->children->sibling_prev = process;
+        parent->children = process;
+    }
     process_count++;
+    spinlock_release(&process_lock);
+    irq_restore(flags);
 
     return process;
 }
@@ -84,118 +212,464 @@ void process_destroy(process_t *process) {
     scheduler_remove(process);
 
     // Remove from process list
-    if (process_list == process) {
-        process_list = process->next;
+    uint64_t flags = irq_save();
+    spinlock_acquire(&process_lock);
+    if (process->prev) {
+        process->prev->next = process->next;
     } else {
-        process_t *prev = process_list;
-        while (prev && prev->next != process) {
-            prev = prev->next;
-        }
-        if (prev) {
-            prev->next = process->next;
+        process_list = process->next;
+    }
+    if (process->next) process->next->prev = process->prev;
+
+    // Buckets stay short: PIDs are sequential
+    process_t **link = &pid_hash[process->pid & (PID_HASH_SIZE - 1)];
+    while (*link && *link != process) link = &(*link)->pid_next;
+    if (*link) *link = process->pid_next;
+
+    if (process->parent) {
+        if (process->sibling_prev) {
+            process->sibling_prev->sibling_next = process->sibling_next;
+        } else {
+            process->parent->children = process->sibling_next;
         }
+        if (process->sibling_next) process->sibling_next->sibling_prev = process->sibling_prev;
     }
 
-    // Free resources
-    pmm_free_page(process->stack);
-    free(process);
+    // Children outlive us as orphans
+    for (process_t *child = process->children; child; ) {
+        process_t *next = child->sibling_next;
+        child->parent = NULL;
+        child->sibling_next = child->sibling_prev = NULL;
+        child = next;
+    }
     process_count--;
+    spinlock_release(&process_lock);
+    irq_restore(flags);
+
+    // Free resources
+    fdtable_destroy(process->files);
+    fpu_release(process);
+    vma_list_put(process->vmas);
+    vmm_destroy_address_space(process->page_directory);
+    pmm_free_pages(pmm_virt_to_phys(process->stack), pmm_order_for_pages(STACK_SIZE / PAGE_SIZE));
+    kmem_cache_free(process_cache, process);
 }
 
-// Assembly function declarations
-extern void context_switch(cpu_state_t *old_state, cpu_state_t *new_state);
+static void scheduler_timer_handler(struct interrupt_frame *frame);
+static void scheduler_resched_handler(struct interrupt_frame *frame);
+
+// Called on the new stack once context_switch() is done with the old one,
+// after which the previous process may run elsewhere
+void scheduler_finish_switch(void) {
+    struct run_queue *rq = this_rq();
+    if (rq->switching_from) {
+        rq->switching_from->on_cpu = false;
+        rq->switching_from = NULL;
+    }
+}
+
+// Run next on this CPU, or the idle context if next is NULL. Interrupts must be off.
+static void switch_to(struct run_queue *rq, process_t *prev, process_t *next) {
+    sched_trace_switch(prev, next, rq->preempting);
+    rq->preempting = false;
+    rq->current = next;
+    this_cpu()->current_pid = next ? next->pid : 0;
+    if (next) {
+        next->state = PROCESS_STATE_RUNNING;
+        next->cpu = smp_get_current_cpu();
+        next->on_cpu = true;
+    }
+    arm_slice(rq, next);
+
+    // PCID tagging keeps the TLB warm across address space switches
+    uint64_t space = next ? next->page_directory : vmm_kernel_address_space();
+    uint64_t prev_space = prev ? prev->page_directory : vmm_kernel_address_space();
+    if (space != prev_space) {
+        vmm_switch_address_space(space);
+    }
+
+    fpu_switch();
+    rq->switching_from = prev;
+    context_switch(prev ? prev->cpu_state : &rq->idle_state,
+                   next ? next->cpu_state : &rq->idle_state);
+
+    // Possibly on another CPU now
+    scheduler_finish_switch();
+}
 
 // Switch to another process
 void process_switch(process_t *next) {
-    if (!next || next == current_process) return;
+    uint64_t flags = irq_save();
+    struct run_queue *rq = this_rq();
+    if (next && next != rq->current) {
+        switch_to(rq, rq->current, next);
+    }
+    irq_restore(flags);
+}
+
+static void rq_push(struct run_queue *rq, process_t *process) {
+    uint32_t level = process->level;
+    process->run_next = NULL;
+    process->run_prev = rq->tail[level];
+    if (!rq->tail[level]) {
+        rq->head[level] = process;
+    } else {
+        rq->tail[level]->run_next = process;
+    }
+    rq->tail[level] = process;
+    process->on_rq = true;
+    rq->bitmap |= 1U << level;
+    rq->count++;
+}
 
-    process_t *prev = current_process;
-    current_process = next;
+// The process must be queued on rq, if anywhere: its level and cpu do not
+// change while it is
+static bool rq_remove(struct run_queue *rq, process_t *process) {
+    if (!process->on_rq) return false;
 
-    if (prev) {
-        context_switch(prev->cpu_state, next->cpu_state);
+    uint32_t level = process->level;
+    if (process->run_prev) {
+        process->run_prev->run_next = process->run_next;
+    } else {
+        rq->head[level] = process->run_next;
+    }
+    if (process->run_next) {
+        process->run_next->run_prev = process->run_prev;
     } else {
-        context_switch(NULL, next->cpu_state);
+        rq->tail[level] = process->run_prev;
+    }
+    if (!rq->head[level]) {
+        rq->bitmap &= ~(1U << level);
+    }
+    process->run_next = process->run_prev = NULL;
+    process->on_rq = false;
+    rq->count--;
+    return true;
+}
+
+// Highest priority queued process. When stealing, skip pinned ones and
+// ones still switching out elsewhere.
+static process_t *rq_first(struct run_queue *rq, bool stealing) {
+    for (uint32_t levels = rq->bitmap; levels; levels &= levels - 1) {
+        process_t *process = rq->head[__builtin_ctz(levels)];
+        while (process && stealing && (process->on_cpu || process->pinned)) {
+            process = process->run_next;
+        }
+        if (process) return process;
+    }
+    return NULL;
+}
+
+// Lowest queued level, SCHED_LEVELS if none; callers hold the lock or
+// tolerate a stale answer
+static inline uint32_t rq_best_level(struct run_queue *rq) {
+    return rq->bitmap ? (uint32_t)__builtin_ctz(rq->bitmap) : SCHED_LEVELS;
+}
+
+// Periodically return every queued process to its base priority so
+// demoted CPU-bound work cannot starve
+static void rq_boost(struct run_queue *rq) {
+    process_t *boosted = NULL;
+    for (uint32_t level = 0; level < SCHED_LEVELS; level++) {
+        while (rq->head[level]) {
+            process_t *process = rq->head[level];
+            rq_remove(rq, process);
+            process->run_next = boosted;
+            boosted = process;
+        }
+    }
+    // Re-queue in reverse to keep the original order within each level
+    process_t *ordered = NULL;
+    while (boosted) {
+        process_t *next = boosted->run_next;
+        boosted->run_next = ordered;
+        ordered = boosted;
+        boosted = next;
+    }
+    while (ordered) {
+        process_t *next = ordered->run_next;
+        ordered->level = ordered->priority;
+        rq_push(rq, ordered);
+        ordered = next;
+    }
+}
+
+// Take the best process from the busiest other CPU
+static process_t *steal(uint32_t self) {
+    uint32_t cpus = smp_get_cpu_count();
+    uint32_t victim = self;
+    uint32_t most = 0;
+    for (uint32_t cpu = 0; cpu < cpus; cpu++) {
+        if (cpu != self && run_queues[cpu].count > most) {
+            most = run_queues[cpu].count;
+            victim = cpu;
+        }
+    }
+    if (victim == self) return NULL;
+
+    struct run_queue *rq = &run_queues[victim];
+    spinlock_acquire(&rq->lock);
+    process_t *process = rq_first(rq, true);
+    if (process) {
+        rq_remove(rq, process);
+        process->cpu = self;
     }
+    spinlock_release(&rq->lock);
+    return process;
 }
 
 // Initialize scheduler
 void scheduler_init(void) {
-    ready_queue_head = NULL;
-    ready_queue_tail = NULL;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (uint32_t level = 0; level < SCHED_LEVELS; level++) {
+            run_queues[cpu].head[level] = NULL;
+            run_queues[cpu].tail[level] = NULL;
+        }
+        run_queues[cpu].bitmap = 0;
+        run_queues[cpu].last_boost = 0;
+        run_queues[cpu].slice_start = 0;
+        run_queues[cpu].count = 0;
+        run_queues[cpu].current = NULL;
+        run_queues[cpu].switching_from = NULL;
+        run_queues[cpu].preempting = false;
+        spinlock_init(&run_queues[cpu].lock);
+    }
+
+    // Slices are armed in LAPIC counts, measured against the PIT, and
+    // accounted in clocksource time
+    lapic_timer_calibrate();
+
+    register_interrupt_handler(INT_LAPIC_TIMER, scheduler_timer_handler);
+    register_interrupt_handler(INT_RESCHEDULE, scheduler_resched_handler);
+}
+
+// Let this CPU take work; every CPU calls this once. The timer stays off
+// until a process is switched in or a timer is added.
+void scheduler_init_cpu(void) {
+    struct run_queue *rq = this_rq();
+    rq->last_boost = scheduler_clock();
+    sched_trace_init_cpu();
+    lapic_timer_stop();
+    timer_init_cpu();
+    rq->online = true;
+}
+
+// Wake an idle CPU to steal from a queue that already has waiting work
+static void kick_idle_cpu(uint32_t busy) {
+    for (uint32_t cpu = 0; cpu < smp_get_cpu_count(); cpu++) {
+        if (cpu != busy && scheduler_cpu_idle(cpu)) {
+            smp_send_ipi(cpu, INT_RESCHEDULE);
+            return;
+        }
+    }
 }
 
-// Add process to scheduler queue
+// Queue a process on the CPU it last ran on, or the least loaded CPU for a
+// new one. The target is kicked if it idles or runs something less urgent.
 void scheduler_add(process_t *process) {
     if (!process) return;
 
-    process->state = PROCESS_STATE_READY;
-    process->next = NULL;
+    uint32_t self = smp_get_current_cpu();
+    uint32_t target = process->cpu;
+    if (process->pinned && target < MAX_CPUS) {
+        // Stays put even before its CPU comes online
+    } else if (process->state == PROCESS_STATE_NEW || target >= MAX_CPUS || !run_queues[target].online) {
+        target = run_queues[self].online ? self : 0;
+        for (uint32_t cpu = 0; cpu < smp_get_cpu_count(); cpu++) {
+            if (run_queues[cpu].online && run_queues[cpu].count < run_queues[target].count) {
+                target = cpu;
+            }
+        }
+    }
 
-    if (!ready_queue_tail) {
-        ready_queue_head = ready_queue_tail = process;
-    } else {
-        ready_queue_tail->next = process;
-        ready_queue_tail = process;
+    uint64_t flags = irq_save();
+    struct run_queue *rq = &run_queues[target];
+    spinlock_acquire(&rq->lock);
+    process->state = PROCESS_STATE_READY;
+    process->cpu = target;
+    sched_trace_wakeup(process, target);
+    rq_push(rq, process);
+    spinlock_release(&rq->lock);
+
+    // A self-IPI is taken as soon as interrupts are back on
+    process_t *current = rq->current;
+    if (rq->online && (!current ? target != self : current->level > process->level)) {
+        smp_send_ipi(target, INT_RESCHEDULE);
+    } else if (current) {
+        // Without a periodic tick idle CPUs do not look for work on their own
+        kick_idle_cpu(target);
     }
+    irq_restore(flags);
 }
 
 // Remove process from scheduler queue
 void scheduler_remove(process_t *process) {
     if (!process) return;
 
-    if (ready_queue_head == process) {
-        ready_queue_head = process->next;
-        if (!ready_queue_head) {
-            ready_queue_tail = NULL;
-        }
-    } else {
-        process_t *prev = ready_queue_head;
-        while (prev && prev->next != process) {
-            prev = prev->next;
-        }
-        if (prev) {
-            prev->next = process->next;
-            if (ready_queue_tail == process) {
-                ready_queue_tail = prev;
-            }
+    // A steal may move the process to another queue while we look
+    uint64_t flags = irq_save();
+    for (;;) {
+        uint32_t cpu = process->cpu;
+        if (cpu >= MAX_CPUS) break;
+
+        struct run_queue *rq = &run_queues[cpu];
+        spinlock_acquire(&rq->lock);
+        bool moved = process->cpu != cpu;
+        if (!moved) rq_remove(rq, process);
+        spinlock_release(&rq->lock);
+        if (!moved) break;
+    }
+    irq_restore(flags);
+}
+
+// Get next process to run: the best of the local queue, then other CPUs' queues
+process_t *scheduler_next(void) {
+    uint64_t flags = irq_save();
+    uint32_t self = smp_get_current_cpu();
+    struct run_queue *rq = &run_queues[self];
+
+    spinlock_acquire(&rq->lock);
+    process_t *next = rq_first(rq, false);
+    if (next) rq_remove(rq, next);
+    spinlock_release(&rq->lock);
+
+    if (!next) next = steal(self);
+    irq_restore(flags);
+    return next;
+}
+
+// Give up the CPU. A running process goes to the back of its level; a
+// blocked or terminated one stays off the queues. Falls back to the idle context.
+void schedule(void) {
+    uint64_t flags = irq_save();
+    rcu_note_qs();
+    struct run_queue *rq = this_rq();
+    process_t *prev = rq->current;
+    account_slice(rq, prev);
+
+    uint64_t now = scheduler_clock();
+    if (now - rq->last_boost >= SCHED_BOOST_US) {
+        rq->last_boost = now;
+        spinlock_acquire(&rq->lock);
+        rq_boost(rq);
+        spinlock_release(&rq->lock);
+        if (prev) prev->level = prev->priority;
+    }
+
+    if (prev && prev->state == PROCESS_STATE_RUNNING) {
+        spinlock_acquire(&rq->lock);
+        prev->state = PROCESS_STATE_READY;
+        sched_trace_enqueue(prev);
+        rq_push(rq, prev);
+        spinlock_release(&rq->lock);
+    } else if (prev && prev->state == PROCESS_STATE_BLOCKED) {
+        // Blocked before its slice ran out: interactive, move up a level.
+        // A wakeup queues it here under this lock, so the level cannot
+        // change under a queued process.
+        spinlock_acquire(&rq->lock);
+        if (prev->state == PROCESS_STATE_BLOCKED && prev->time_used < prev->time_slice &&
+            prev->level > prev->priority) {
+            prev->level--;
         }
+        spinlock_release(&rq->lock);
     }
 
-    process->next = NULL;
+    process_t *next = scheduler_next();
+    if (next && next == prev) {
+        // Still the most urgent, keep going
+        prev->state = PROCESS_STATE_RUNNING;
+        prev->ready_ns = 0;
+        rq->preempting = false;
+        arm_slice(rq, prev);
+    } else if (next || prev) {
+        switch_to(rq, prev, next);
+    }
+    irq_restore(flags);
 }
 
-// Timer tick handler for scheduler
+// Slice timer expiry, runs on every CPU
 void scheduler_tick(void) {
-    if (!current_process) return;
-
-    current_process->time_used++;
-    if (current_process->time_used >= current_process->time_slice) {
-        // Time slice expired, move to back of queue
-        process_t *next = scheduler_next();
-        if (next) {
-            current_process->time_used = 0;
-            scheduler_add(current_process);
-            process_switch(next);
-        }
+    struct run_queue *rq = this_rq();
+    process_t *current = rq->current;
+
+    if (!current) {
+        // Idle: pick up anything queued here or elsewhere
+        if (rq->online) schedule();
+        return;
+    }
+
+    account_slice(rq, current);
+    sched_trace_tick(current);
+    if (current->time_used >= current->time_slice) {
+        // Used the whole slice: CPU-bound, move down a level for a longer one
+        if (current->level < SCHED_LEVELS - 1) current->level++;
+        rq->preempting = true;
+        schedule();
+    } else {
+        // Early expiry or a timer, wait out the rest
+        timer_set_slice(profile_timer_interval(current->time_slice - current->time_used));
     }
 }
 
-// Get next process to run
-process_t *scheduler_next(void) {
-    if (!ready_queue_head) return NULL;
+static void scheduler_timer_handler(struct interrupt_frame *frame) {
+    profile_timer_sample(frame);
+    rcu_note_qs();
+    lapic_eoi();
+    timer_interrupt();
+    scheduler_tick();
+}
 
-    process_t *next = ready_queue_head;
-    ready_queue_head = ready_queue_head->next;
-    if (!ready_queue_head) {
-        ready_queue_tail = NULL;
+static void scheduler_resched_handler(struct interrupt_frame *frame) {
+    (void)frame;
+    rcu_note_qs();
+    lapic_eoi();
+    struct run_queue *rq = this_rq();
+    if (!rq->current || rq_best_level(rq) < rq->current->level) {
+        rq->preempting = rq->current != NULL;
+        schedule();
     }
-    next->next = NULL;
+}
 
-    return next;
+// One pass of a CPU's idle loop
+void scheduler_idle(void) {
+    schedule();
+
+    // Spare time goes to zeroing pages
+    if (pmm_zero_pool_fill()) return;
+
+    // sti only takes effect after hlt, so a wakeup IPI cannot slip in between
+    cli();
+    if (run_queues[smp_get_current_cpu()].count == 0) {
+        asm volatile("sti; hlt" ::: "memory");
+    } else {
+        sti();
+    }
+}
+
+// True if the CPU is online and has nothing to run
+bool scheduler_cpu_idle(uint32_t cpu) {
+    if (cpu >= MAX_CPUS) return false;
+    struct run_queue *rq = &run_queues[cpu];
+    return rq->online && !rq->current && rq->count == 0;
+}
+
+// Look up a live process by PID
+process_t *process_find(uint32_t pid) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&process_lock);
+    process_t *process = pid_hash[pid & (PID_HASH_SIZE - 1)];
+    while (process && process->pid != pid) {
+        process = process->pid_next;
+    }
+    spinlock_release(&process_lock);
+    irq_restore(flags);
+    return process;
 }
 
 // Get current running process
 process_t *get_current_process(void) {
-    return current_process;
+    uint64_t flags = irq_save();
+    process_t *current = this_rq()->current;
+    irq_restore(flags);
+    return current;
 }
@@ -4,6 +4,16 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// Multi-level feedback queue: priority is a process's base level, 0 most
+// urgent. Using a whole slice moves a process down a level, blocking early
+// moves it back up, and every level is reset once a second.
+#define SCHED_LEVELS       8
+#define SCHED_SLICE_US     1000             // Slice at level 0, doubles per level
+#define SCHED_BOOST_US     1000000
+
+// There is no periodic tick: each CPU arms a one-shot LAPIC timer for the
+// end of the running slice and stops it while idle
+
 // Process states
 typedef enum {
     PROCESS_STATE_NEW,
@@ -20,12 +30,33 @@ typedef struct process {
     uint64_t *stack;                 // Kernel stack pointer
     uint64_t stack_size;             // Stack size
     struct cpu_state *cpu_state;     // Saved CPU state
-    struct process *next;            // Next process in queue
-    uint32_t time_slice;             // Time slice for scheduling
-    uint32_t time_used;              // Time used in current slice
+    struct process *next;            // Next process in process_list
+    struct process *prev;            // Previous process in process_list
+    struct process *pid_next;        // Next process in the same PID hash bucket
+    struct process *parent;          // Creator, NULL for kernel-started processes
+    struct process *children;        // First child
+    struct process *sibling_next;    // Next child of the same parent
+    struct process *sibling_prev;    // Previous child of the same parent
+    struct process *run_next;        // Next process in a run queue
+    struct process *run_prev;        // Previous process in a run queue
+    bool on_rq;                      // Linked on the run queue of cpu
+    struct process *wait_next;       // Next process in a wait queue
+    struct wait_queue *wait_queue;   // Wait queue the process sleeps on, if any
+    uint32_t cpu;                    // CPU that queues or last ran the process
+    volatile bool on_cpu;            // Context still live on a CPU, not stealable
+    bool pinned;                     // Only ever runs on cpu
+    uint32_t time_slice;             // Time slice for scheduling, in microseconds
+    uint32_t time_used;              // Microseconds used in current slice
     char name[32];                   // Process name
-    uint32_t priority;               // Process priority
-    void *page_directory;            // Process page directory
+    uint32_t priority;               // Base scheduling level, 0 highest
+    uint32_t level;                  // Current level, priority or lower
+    uint64_t page_directory;         // Address space (CR3 value with PCID)
+    struct vma_list *vmas;           // Lazily populated mappings (sys_mmap), shared like page_directory
+    void *fpu_state;                 // XSAVE area, allocated on first FPU use
+    uint32_t fpu_cpu;                // CPU that last loaded fpu_state
+    uint64_t ready_ns;               // When last queued, for run-queue wait tracing
+    struct fd_table *files;          // Open descriptors, created on first use
+    void *worker_data;               // Argument for kernel worker processes
 } process_t;
 
 // CPU state structure (saved during context switch)
@@ -47,10 +78,16 @@ process_t *process_create(void (*entry)(void), uint32_t priority, const char *na
 void process_destroy(process_t *process);
 void process_switch(process_t *next);
 void scheduler_init(void);
+void scheduler_init_cpu(void);
+void scheduler_idle(void);
+void schedule(void);
 void scheduler_add(process_t *process);
 void scheduler_remove(process_t *process);
 void scheduler_tick(void);
+uint64_t scheduler_clock(void);
 process_t *scheduler_next(void);
 process_t *get_current_process(void);
+process_t *process_find(uint32_t pid);
+bool scheduler_cpu_idle(uint32_t cpu);
 
 #endif // PROCESS_H
\ No newline at end of file
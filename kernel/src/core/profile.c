@@ -0,0 +1,504 @@
+#include <core/profile.h>
+#include <core/ksyms.h>
+#include <core/idt.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <core/timer.h>
+#include <core/drivers/lapic.h>
+#include <core/syscalls.h>
+#include <fs/vfs.h>
+#include <fs/file.h>
+#include <mm/vmm.h>
+#include <mm/vmalloc.h>
+#include <utils/mem.h>
+#include <utils/str.h>
+#include <utils/asm.h>
+#include <utils/log.h>
+
+// Architectural performance monitoring, CPUID leaf 0xA
+#define MSR_PERFEVTSEL0          0x186
+#define MSR_PMC0                 0xC1
+#define MSR_PERF_GLOBAL_STATUS   0x38E
+#define MSR_PERF_GLOBAL_CTRL     0x38F
+#define MSR_PERF_GLOBAL_OVF_CTRL 0x390
+
+#define PERFEVTSEL_USR           (1 << 16)
+#define PERFEVTSEL_OS            (1 << 17)
+#define PERFEVTSEL_INT           (1 << 20)
+#define PERFEVTSEL_EN            (1 << 22)
+#define EVENT_UNHALTED_CYCLES    0x3C       // Umask 0
+
+#define KERNEL_HALF              0xFFFF800000000000ULL
+#define MAX_FRAME                0x4000     // Farthest a caller's frame may be
+#define STOP_TIMEOUT_NS          100000000ULL
+#define LINE_MAX                 1024
+
+typedef enum {
+    SOURCE_NONE,
+    SOURCE_PMU,                 // Counter overflow NMI
+    SOURCE_TIMER                // LAPIC slice timer, clamped to the interval
+} profile_source_t;
+
+// Written only by its CPU while sampling; read by the dump once stopped
+struct profile_cpu {
+    volatile uint32_t source;   // Set by the CPU itself as it arms
+    uint32_t version;           // Perfmon version, 0 if unusable
+    uint64_t counter_top;       // Top bit of the counter, clear once it wraps
+    bool pmu_used;              // The counter may still raise an NMI
+    uint32_t count;
+    uint64_t lost;
+    struct profile_sample samples[PROFILE_SAMPLES];
+};
+
+// A distinct stack and how often it was sampled
+struct profile_bucket {
+    struct profile_sample* sample;
+    uint32_t count;
+};
+
+static struct profile_cpu* profile_cpus[MAX_CPUS];
+static volatile bool sampling = false;
+static volatile bool busy = false;      // Start, stop or dump in progress
+static uint32_t interval_us;
+static uint64_t period_cycles;
+
+// Perfmon version if it can count unhalted cycles, else 0
+static uint32_t pmu_version(uint64_t* counter_top) {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+    if (eax < 0xA) return 0;
+
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xA), "c"(0));
+    uint32_t version = eax & 0xFF;
+    uint32_t counters = (eax >> 8) & 0xFF;
+    uint32_t width = (eax >> 16) & 0xFF;
+    uint32_t events = (eax >> 24) & 0xFF;
+
+    // EBX bit 0 set means the cycles event is not there
+    if (!version || !counters || !events || width < 32 || (ebx & 1)) return 0;
+    *counter_top = 1ULL << (width - 1);
+    return version;
+}
+
+// Counter writes sign-extend from 32 bits, enough for a period under 2^31
+static inline void pmu_reload(void) {
+    wrmsr(MSR_PMC0, -period_cycles);
+}
+
+// Arm or disarm this CPU to match sampling; interrupts off
+static void profile_arm_cpu(void) {
+    struct profile_cpu* cpu = profile_cpus[smp_get_current_cpu()];
+    if (!cpu) return;
+
+    if (sampling && cpu->source == SOURCE_NONE) {
+        cpu->version = pmu_version(&cpu->counter_top);
+        if (cpu->version) {
+            wrmsr(MSR_PERFEVTSEL0, 0);
+            pmu_reload();
+            if (cpu->version >= 2) {
+                wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, 1);
+                wrmsr(MSR_PERF_GLOBAL_CTRL, rdmsr(MSR_PERF_GLOBAL_CTRL) | 1);
+            }
+            lapic_perf_nmi(true);
+            cpu->pmu_used = true;
+            cpu->source = SOURCE_PMU;
+            wrmsr(MSR_PERFEVTSEL0, EVENT_UNHALTED_CYCLES | PERFEVTSEL_USR | PERFEVTSEL_OS |
+                                   PERFEVTSEL_INT | PERFEVTSEL_EN);
+        } else {
+            // Later slices are clamped; cut the current one short
+            cpu->source = SOURCE_TIMER;
+            timer_set_slice(interval_us);
+        }
+    } else if (!sampling && cpu->source != SOURCE_NONE) {
+        if (cpu->source == SOURCE_PMU) {
+            wrmsr(MSR_PERFEVTSEL0, 0);
+            lapic_perf_nmi(false);
+        }
+        __atomic_store_n(&cpu->source, SOURCE_NONE, __ATOMIC_RELEASE);
+    }
+}
+
+static void profile_ipi_handler(struct interrupt_frame* frame) {
+    (void)frame;
+    lapic_eoi();
+    profile_arm_cpu();
+}
+
+// Both words of a frame must be mapped before they are read
+static bool frame_mapped(uint64_t rbp, uint64_t* checked) {
+    for (uint64_t page = rbp & ~0xFFFULL; page <= ((rbp + 15) & ~0xFFFULL); page += 0x1000) {
+        if (page == *checked) continue;
+        if (!vmm_get_phys_addr(page)) return false;
+        *checked = page;
+    }
+    return true;
+}
+
+// Follow saved frame pointers up a kernel stack, stopping at the first
+// frame that does not look like one
+static uint16_t walk_stack(uint64_t rbp, uint64_t* stack) {
+    uint16_t depth = 0;
+    uint64_t checked = 0;
+
+    while (depth < PROFILE_DEPTH && rbp >= KERNEL_HALF && !(rbp & 7) && frame_mapped(rbp, &checked)) {
+        uint64_t next = ((uint64_t*)rbp)[0];
+        uint64_t ret = ((uint64_t*)rbp)[1];
+        if (ret < KERNEL_HALF) break;
+        stack[depth++] = ret;
+
+        // Callers' frames sit higher up the same stack
+        if (next <= rbp || next - rbp > MAX_FRAME) break;
+        rbp = next;
+    }
+    return depth;
+}
+
+static void record(struct profile_cpu* cpu, uint64_t rip, uint64_t cs, uint64_t rbp) {
+    if (cpu->count >= PROFILE_SAMPLES) {
+        cpu->lost++;
+        return;
+    }
+
+    struct profile_sample* sample = &cpu->samples[cpu->count];
+    sample->rip = rip;
+    sample->pid = (uint32_t)this_cpu()->current_pid;
+    sample->user = (cs & 3) != 0;
+    sample->depth = sample->user ? 0 : walk_stack(rbp, sample->stack);
+    cpu->count++;
+}
+
+bool profile_nmi(struct interrupt_frame_error* frame) {
+    struct profile_cpu* cpu = profile_cpus[smp_get_current_cpu()];
+    if (!cpu || !cpu->pmu_used) return false;
+
+    if (cpu->version >= 2) {
+        if (!(rdmsr(MSR_PERF_GLOBAL_STATUS) & 1)) return false;
+        wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, 1);
+    } else if (rdmsr(MSR_PMC0) & cpu->counter_top) {
+        return false;
+    }
+
+    if (cpu->source != SOURCE_PMU) {
+        // Overflowed just as it was stopped; leave it short of wrapping
+        wrmsr(MSR_PMC0, -1ULL);
+        return true;
+    }
+
+    // The ISR stub saved rbp six slots below the error code
+    record(cpu, frame->rip, frame->cs, ((uint64_t*)frame)[-6]);
+    pmu_reload();
+    lapic_perf_nmi(true);
+    return true;
+}
+
+uint64_t profile_timer_interval(uint64_t us) {
+    struct profile_cpu* cpu = profile_cpus[smp_get_current_cpu()];
+    if (cpu && cpu->source == SOURCE_TIMER && us > interval_us) return interval_us;
+    return us;
+}
+
+void profile_timer_sample(struct interrupt_frame* frame) {
+    struct profile_cpu* cpu = profile_cpus[smp_get_current_cpu()];
+    if (!cpu || cpu->source != SOURCE_TIMER) return;
+
+    // One slot further down than for exception frames, which have the error code
+    record(cpu, frame->rip, frame->cs, ((uint64_t*)frame)[-7]);
+}
+
+static inline bool cpu_online(uint32_t cpu) {
+    struct cpu_data* data = smp_get_cpu_data(cpu);
+    return data && (data->state & CPU_STATE_ONLINE);
+}
+
+static void send_to_online(void) {
+    for (uint32_t cpu = 0; cpu < smp_get_cpu_count(); cpu++) {
+        if (cpu_online(cpu) && profile_cpus[cpu]) smp_send_ipi(cpu, INT_PROFILE);
+    }
+}
+
+int profile_start(uint32_t us) {
+    if (__atomic_exchange_n(&busy, true, __ATOMIC_ACQUIRE)) return -1;
+    if (sampling) {
+        __atomic_store_n(&busy, false, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    for (uint32_t cpu = 0; cpu < smp_get_cpu_count(); cpu++) {
+        if (!cpu_online(cpu)) continue;
+        if (!profile_cpus[cpu]) {
+            struct profile_cpu* buffer = vmalloc(sizeof(struct profile_cpu));
+            if (!buffer) {
+                __atomic_store_n(&busy, false, __ATOMIC_RELEASE);
+                return -1;
+            }
+            memset(buffer, 0, sizeof(struct profile_cpu));
+            profile_cpus[cpu] = buffer;
+        }
+        profile_cpus[cpu]->count = 0;
+        profile_cpus[cpu]->lost = 0;
+    }
+
+    interval_us = us ? us : PROFILE_DEFAULT_US;
+    uint64_t cycles = time_clock_params()->tsc_hz * interval_us / 1000000;
+    period_cycles = cycles < 1000 ? 1000 : cycles > 0x7FFFFFFF ? 0x7FFFFFFF : cycles;
+
+    register_interrupt_handler(INT_PROFILE, profile_ipi_handler);
+    __atomic_store_n(&sampling, true, __ATOMIC_SEQ_CST);
+    send_to_online();
+
+    __atomic_store_n(&busy, false, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void profile_stop(void) {
+    if (__atomic_exchange_n(&busy, true, __ATOMIC_ACQUIRE)) return;
+
+    if (sampling) {
+        __atomic_store_n(&sampling, false, __ATOMIC_SEQ_CST);
+        send_to_online();
+
+        // The dump may only read buffers their CPUs have let go of
+        uint64_t deadline = ktime_get_ns() + STOP_TIMEOUT_NS;
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            struct profile_cpu* buffer = profile_cpus[cpu];
+            if (!buffer) continue;
+            while (__atomic_load_n(&buffer->source, __ATOMIC_ACQUIRE) != SOURCE_NONE &&
+                   ktime_get_ns() < deadline) {
+                asm volatile("pause");
+            }
+            if (buffer->source != SOURCE_NONE) log_warn("profile: cpu %d did not stop", (int)cpu);
+        }
+    }
+    __atomic_store_n(&busy, false, __ATOMIC_RELEASE);
+}
+
+bool profile_running(void) {
+    return sampling;
+}
+
+// Addresses to the start of their function, so samples anywhere in one
+// fold together. Return addresses point past the call, hence the - 1.
+static void canonicalize(struct profile_sample* sample) {
+    uint64_t start;
+    if (!sample->user && ksym_lookup(sample->rip, &start)) sample->rip = start;
+    for (uint16_t i = 0; i < sample->depth; i++) {
+        if (ksym_lookup(sample->stack[i] - 1, &start)) sample->stack[i] = start;
+    }
+}
+
+static bool same_stack(const struct profile_sample* a, const struct profile_sample* b) {
+    if (a->user != b->user || a->depth != b->depth) return false;
+    if (a->user) return a->pid == b->pid;
+    if (a->rip != b->rip) return false;
+    for (uint16_t i = 0; i < a->depth; i++) {
+        if (a->stack[i] != b->stack[i]) return false;
+    }
+    return true;
+}
+
+static uint64_t stack_hash(const struct profile_sample* sample) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    if (sample->user) return (hash ^ sample->pid) * 0x100000001B3ULL;
+    hash = (hash ^ sample->rip) * 0x100000001B3ULL;
+    for (uint16_t i = 0; i < sample->depth; i++) {
+        hash = (hash ^ sample->stack[i]) * 0x100000001B3ULL;
+    }
+    return hash ^ (hash >> 29);
+}
+
+static char* append(char* p, char* end, const char* str) {
+    while (*str && p < end) *p++ = *str++;
+    return p;
+}
+
+static char* append_number(char* p, char* end, uint64_t value, uint32_t base) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value);
+    if (base == 16) p = append(p, end, "0x");
+    while (n && p < end) *p++ = digits[--n];
+    return p;
+}
+
+static char* append_frame(char* p, char* end, uint64_t address) {
+    const char* name = ksym_lookup(address, NULL);
+    return name ? append(p, end, name) : append_number(p, end, address, 16);
+}
+
+static void dump_bucket(const struct profile_bucket* bucket) {
+    char line[LINE_MAX];
+    char* end = line + LINE_MAX - 24;       // Room for the count
+    const struct profile_sample* sample = bucket->sample;
+
+    char* p = line;
+    if (sample->user) {
+        p = append(p, end, "[user pid ");
+        p = append_number(p, end, sample->pid, 10);
+        p = append(p, end, "]");
+    } else {
+        // Folded stacks run from the outermost frame in
+        for (uint16_t i = sample->depth; i > 0; i--) {
+            p = append_frame(p, end, sample->stack[i - 1]);
+            p = append(p, end, ";");
+        }
+        p = append_frame(p, end, sample->rip);
+    }
+    *p++ = ' ';
+    p = append_number(p, line + LINE_MAX - 1, bucket->count, 10);
+    *p = '\0';
+    log_string(LOG_LEVEL_RAW, line);
+}
+
+void profile_dump(void) {
+    if (__atomic_exchange_n(&busy, true, __ATOMIC_ACQUIRE)) return;
+    if (sampling) {
+        log_warn("profile: stop sampling before dumping");
+        __atomic_store_n(&busy, false, __ATOMIC_RELEASE);
+        return;
+    }
+
+    uint64_t total = 0, lost = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct profile_cpu* buffer = profile_cpus[cpu];
+        if (!buffer) continue;
+        total += buffer->count;
+        lost += buffer->lost;
+    }
+    log_info("profile: %d samples every %dus, %d lost", (int)total, (int)interval_us, (int)lost);
+
+    // Open addressing, at most half full
+    uint64_t slots = 2;
+    while (slots < total * 2) slots <<= 1;
+    struct profile_bucket* table = vmalloc(slots * sizeof(struct profile_bucket));
+    if (!table) {
+        log_warn("profile: no memory to fold %d samples", (int)total);
+        __atomic_store_n(&busy, false, __ATOMIC_RELEASE);
+        return;
+    }
+    memset(table, 0, slots * sizeof(struct profile_bucket));
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct profile_cpu* buffer = profile_cpus[cpu];
+        if (!buffer) continue;
+        for (uint32_t i = 0; i < buffer->count; i++) {
+            struct profile_sample* sample = &buffer->samples[i];
+            canonicalize(sample);
+            uint64_t slot = stack_hash(sample) & (slots - 1);
+            while (table[slot].sample && !same_stack(table[slot].sample, sample)) {
+                slot = (slot + 1) & (slots - 1);
+            }
+            table[slot].sample = sample;
+            table[slot].count++;
+        }
+        // Folded in place; a second dump would find nothing new
+        buffer->count = 0;
+    }
+
+    for (uint64_t slot = 0; slot < slots; slot++) {
+        if (table[slot].sample) dump_bucket(&table[slot]);
+    }
+    vfree(table);
+    __atomic_store_n(&busy, false, __ATOMIC_RELEASE);
+}
+
+// Control file: "start [us]", "stop" or "dump" written to it; reading
+// tells whether sampling is on
+struct profile_status {
+    size_t len;
+    char text[48];
+};
+
+static ssize_t profile_readv(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    struct profile_status* status = file->private_data;
+    if (offset >= status->len) return 0;
+
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    return (ssize_t)iov_copy_to_iter(&iter, status->text + offset, status->len - offset);
+}
+
+static ssize_t profile_writev(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    (void)file; (void)offset;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    char command[32];
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    size_t len = iov_copy_from_iter(&iter, command, sizeof(command) - 1);
+    while (len && (command[len - 1] == '\n' || command[len - 1] == ' ')) len--;
+    command[len] = '\0';
+
+    if (memcmp(command, "start", 5) == 0 && (command[5] == '\0' || command[5] == ' ')) {
+        uint32_t us = 0;
+        for (const char* p = command + 5; *p; p++) {
+            if (*p == ' ') continue;
+            if (*p < '0' || *p > '9') return -EINVAL;
+            us = us * 10 + (uint32_t)(*p - '0');
+        }
+        if (profile_start(us) < 0) return -EBUSY;
+    } else if (strcmp(command, "stop") == 0) {
+        profile_stop();
+    } else if (strcmp(command, "dump") == 0) {
+        profile_dump();
+    } else {
+        return -EINVAL;
+    }
+    return (ssize_t)total;
+}
+
+static uint64_t profile_size(struct file* file) {
+    return ((struct profile_status*)file->private_data)->len;
+}
+
+static void profile_release(struct file* file) {
+    free(file->private_data);
+}
+
+static const struct file_ops profile_file_ops = {
+    .readv = profile_readv,
+    .writev = profile_writev,
+    .size = profile_size,
+};
+
+static int profile_open(void* data, const char* path, int flags, mode_t mode, struct file* file) {
+    (void)data; (void)mode; (void)flags;
+    if (*path) return -ENOENT;
+
+    struct profile_status* status = malloc(sizeof(struct profile_status));
+    if (!status) return -ENOMEM;
+    char* end = status->text + sizeof(status->text) - 1;
+    char* p = status->text;
+    if (sampling) {
+        p = append(p, end, "running ");
+        p = append_number(p, end, interval_us, 10);
+        p = append(p, end, "us");
+    } else {
+        p = append(p, end, "stopped");
+    }
+    *p++ = '\n';
+    status->len = (size_t)(p - status->text);
+
+    file->inode = 0;
+    file->private_data = status;
+    file->ops = &profile_file_ops;
+    file->release = profile_release;
+    return 0;
+}
+
+static int profile_unlink(void* data, const char* path) {
+    (void)data; (void)path;
+    return -EACCES;
+}
+
+static const struct vfs_ops profile_vfs_ops = {
+    .open = profile_open,
+    .unlink = profile_unlink,
+};
+
+bool profile_mount(const char* path) {
+    return vfs_mount(path, &profile_vfs_ops, NULL);
+}
@@ -0,0 +1,49 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct interrupt_frame;
+struct interrupt_frame_error;
+
+// Sampling profiler. Each CPU counts unhalted cycles in a performance
+// counter whose overflow arrives as an NMI, so samples land inside
+// interrupts-off code too; without an architectural PMU the CPU falls back
+// to its LAPIC timer, which only sees code running with interrupts on.
+#define PROFILE_SAMPLES      8192       // Per CPU, later samples are counted as lost
+#define PROFILE_DEPTH        16         // Return addresses kept per sample
+#define PROFILE_DEFAULT_US   1000       // Sampling interval if none is given
+
+struct profile_sample {
+    uint64_t rip;
+    uint32_t pid;                       // 0 for the idle context
+    uint16_t depth;                     // Entries in stack, innermost first
+    uint16_t user;                      // Taken in user mode, no stack
+    uint64_t stack[PROFILE_DEPTH];
+};
+
+// Start sampling every interval_us on every running CPU; -1 if already
+// running or out of memory. Earlier samples are discarded.
+int profile_start(uint32_t interval_us);
+// Stop on every CPU, waiting for them to let go of their buffers
+void profile_stop(void);
+bool profile_running(void);
+
+// Log what was sampled as folded stacks, one "outer;...;inner count" line
+// per distinct stack, for flamegraph.pl and friends
+void profile_dump(void);
+
+// Control file at path taking "start [us]", "stop" and "dump", for use
+// from user space, e.g. echo start 500 > /proc/profile
+bool profile_mount(const char* path);
+
+// True, and handled, if the NMI was this CPU's counter overflowing
+bool profile_nmi(struct interrupt_frame_error* frame);
+
+// LAPIC timer fallback, from the scheduler: how long to arm the slice timer
+// for, and a sample from its interrupt
+uint64_t profile_timer_interval(uint64_t us);
+void profile_timer_sample(struct interrupt_frame* frame);
+
+#endif // PROFILE_H
@@ -0,0 +1,31 @@
+#include <core/rcu.h>
+#include <core/smp.h>
+#include <core/idt.h>
+
+void rcu_note_qs(void) {
+    // Only this CPU writes its counter
+    this_cpu()->rcu_qs++;
+}
+
+void synchronize_rcu(void) {
+    uint32_t self = smp_get_current_cpu();
+    uint32_t cpus = smp_get_cpu_count();
+    uint64_t snap[MAX_CPUS];
+
+    for (uint32_t cpu = 0; cpu < cpus; cpu++) {
+        struct cpu_data* data = smp_get_cpu_data(cpu);
+        snap[cpu] = data ? data->rcu_qs : 0;
+    }
+
+    for (uint32_t cpu = 0; cpu < cpus; cpu++) {
+        struct cpu_data* data = smp_get_cpu_data(cpu);
+        if (cpu == self || !data || !(data->state & CPU_STATE_ONLINE)) continue;
+        if (data->rcu_qs != snap[cpu]) continue;
+
+        // Taken as soon as the CPU leaves its read section, if it is in one
+        smp_send_ipi(cpu, INT_RESCHEDULE);
+        while (data->rcu_qs == snap[cpu]) {
+            asm volatile("pause");
+        }
+    }
+}
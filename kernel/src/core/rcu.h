@@ -0,0 +1,34 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <stdint.h>
+#include <utils/asm.h>
+
+// Read-mostly data published by pointer. Readers run with interrupts off
+// and take no locks; writers copy, modify, publish the new version with
+// rcu_assign_pointer() and free the old one after synchronize_rcu().
+//
+// A CPU taking an interrupt or calling schedule() cannot be inside a read
+// section, so those count as quiescent states. A grace period ends once
+// every other online CPU has passed one; CPUs that are slow to do so get
+// a reschedule IPI.
+
+static inline uint64_t rcu_read_lock(void) {
+    return irq_save();
+}
+
+static inline void rcu_read_unlock(uint64_t flags) {
+    irq_restore(flags);
+}
+
+#define rcu_dereference(p)       __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Record a quiescent state on this CPU
+void rcu_note_qs(void);
+
+// Wait until every reader that may see an unpublished version is done.
+// Process context with interrupts enabled, outside any read section.
+void synchronize_rcu(void);
+
+#endif // RCU_H
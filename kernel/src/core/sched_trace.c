@@ -0,0 +1,182 @@
+#include <core/sched_trace.h>
+#include <core/process.h>
+#include <core/workqueue.h>
+#include <core/time.h>
+#include <core/smp.h>
+#include <utils/mem.h>
+#include <utils/asm.h>
+#include <utils/log.h>
+
+#if SCHED_TRACE
+
+#define SLICE_BUCKETS 11   // Tenths of the slice used, the last for all of it
+
+struct sched_trace_cpu {
+    uint32_t head;                              // Next event slot
+    struct sched_event events[SCHED_TRACE_ENTRIES];
+    uint64_t wait[SCHED_TRACE_BUCKETS];         // Queued until switched in
+    uint64_t slice[SLICE_BUCKETS];              // Share of the slice used before switching out
+    uint64_t voluntary;                         // Blocked, exited or yielded
+    uint64_t involuntary;                       // Slice expired or preempted
+};
+
+// NULL until the CPU's scheduler comes up
+static struct sched_trace_cpu* trace_cpus[MAX_CPUS];
+
+#if SCHED_TRACE_DUMP_US
+static uint64_t last_dump = 0;
+
+static void dump_work_func(struct work* work) {
+    (void)work;
+    sched_trace_dump(0);
+}
+static struct work dump_work = WORK_INIT(dump_work_func);
+#endif
+
+void sched_trace_init_cpu(void) {
+    uint32_t cpu = smp_get_current_cpu();
+    if (trace_cpus[cpu]) return;
+
+    struct sched_trace_cpu* trace = malloc(sizeof(struct sched_trace_cpu));
+    if (!trace) return;
+    memset(trace, 0, sizeof(struct sched_trace_cpu));
+    __atomic_store_n(&trace_cpus[cpu], trace, __ATOMIC_RELEASE);
+}
+
+// Callers have interrupts off
+static inline struct sched_trace_cpu* this_trace(void) {
+    return trace_cpus[smp_get_current_cpu()];
+}
+
+static inline void record(struct sched_trace_cpu* trace, uint64_t now, uint32_t type,
+                          uint32_t pid, uint32_t arg) {
+    struct sched_event* event = &trace->events[trace->head++ & (SCHED_TRACE_ENTRIES - 1)];
+    event->time = now;
+    event->type = type;
+    event->pid = pid;
+    event->arg = arg;
+}
+
+// Bucket b holds [2^(b-1), 2^b) microseconds, bucket 0 under one
+static inline uint32_t log2_bucket(uint64_t us) {
+    uint32_t bucket = us ? 64 - (uint32_t)__builtin_clzll(us) : 0;
+    return bucket < SCHED_TRACE_BUCKETS ? bucket : SCHED_TRACE_BUCKETS - 1;
+}
+
+void sched_trace_enqueue(process_t* process) {
+    process->ready_ns = ktime_get_ns();
+}
+
+void sched_trace_wakeup(process_t* process, uint32_t cpu) {
+    uint64_t now = ktime_get_ns();
+    process->ready_ns = now;
+
+    struct sched_trace_cpu* trace = this_trace();
+    if (trace) record(trace, now, SCHED_EVENT_WAKEUP, process->pid, cpu);
+}
+
+void sched_trace_tick(process_t* current) {
+    struct sched_trace_cpu* trace = this_trace();
+    if (!trace) return;
+    record(trace, ktime_get_ns(), SCHED_EVENT_TICK, current ? current->pid : 0,
+           current ? current->time_used : 0);
+}
+
+void sched_trace_switch(process_t* prev, process_t* next, bool involuntary) {
+    struct sched_trace_cpu* trace = this_trace();
+    if (!trace) return;
+
+    uint64_t now = ktime_get_ns();
+    record(trace, now, SCHED_EVENT_SWITCH, next ? next->pid : 0, prev ? prev->pid : 0);
+
+    if (prev) {
+        uint32_t tenths = prev->time_slice ? prev->time_used * 10 / prev->time_slice : 0;
+        trace->slice[tenths < SLICE_BUCKETS ? tenths : SLICE_BUCKETS - 1]++;
+        if (involuntary) {
+            trace->involuntary++;
+        } else {
+            trace->voluntary++;
+        }
+    }
+    if (next && next->ready_ns) {
+        trace->wait[log2_bucket((now - next->ready_ns) / 1000)]++;
+        next->ready_ns = 0;
+    }
+
+#if SCHED_TRACE_DUMP_US
+    // Whichever CPU switches first after the interval claims the dump
+    uint64_t last = __atomic_load_n(&last_dump, __ATOMIC_RELAXED);
+    if (now - last >= (uint64_t)SCHED_TRACE_DUMP_US * 1000 &&
+        __atomic_compare_exchange_n(&last_dump, &last, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        work_schedule(&dump_work);
+    }
+#endif
+}
+
+static const char* const event_names[] = { "switch", "wakeup", "tick" };
+
+void sched_trace_dump(uint32_t events) {
+    uint64_t wait[SCHED_TRACE_BUCKETS] = { 0 };
+    uint64_t slice[SLICE_BUCKETS] = { 0 };
+    uint64_t voluntary = 0, involuntary = 0;
+
+    // Counters are read unlocked; a dump racing a switch may be off by one
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct sched_trace_cpu* trace = __atomic_load_n(&trace_cpus[cpu], __ATOMIC_ACQUIRE);
+        if (!trace) continue;
+        for (uint32_t b = 0; b < SCHED_TRACE_BUCKETS; b++) wait[b] += trace->wait[b];
+        for (uint32_t b = 0; b < SLICE_BUCKETS; b++) slice[b] += trace->slice[b];
+        voluntary += trace->voluntary;
+        involuntary += trace->involuntary;
+    }
+
+    log_info("sched: %d voluntary, %d involuntary switches", (int)voluntary, (int)involuntary);
+    for (uint32_t b = 0; b < SCHED_TRACE_BUCKETS; b++) {
+        if (wait[b]) log_info("sched: run-queue wait < %dus: %d", 1 << b, (int)wait[b]);
+    }
+    for (uint32_t b = 0; b < SLICE_BUCKETS; b++) {
+        if (slice[b]) log_info("sched: slice used %d0%%+: %d", (int)b, (int)slice[b]);
+    }
+
+    if (!events) return;
+    if (events > SCHED_TRACE_ENTRIES) events = SCHED_TRACE_ENTRIES;
+
+    uint64_t now = ktime_get_ns();
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct sched_trace_cpu* trace = __atomic_load_n(&trace_cpus[cpu], __ATOMIC_ACQUIRE);
+        if (!trace) continue;
+
+        uint32_t head = trace->head;
+        uint32_t count = head < events ? head : events;
+        for (uint32_t i = head - count; i != head; i++) {
+            struct sched_event* event = &trace->events[i & (SCHED_TRACE_ENTRIES - 1)];
+            log_info("sched: cpu %d -%dus %s pid %d arg %d", (int)cpu,
+                     (int)((now - event->time) / 1000), event_names[event->type],
+                     (int)event->pid, (int)event->arg);
+        }
+    }
+}
+
+void sched_trace_reset(void) {
+    uint64_t flags = irq_save();
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct sched_trace_cpu* trace = trace_cpus[cpu];
+        if (!trace) continue;
+        memset(trace->wait, 0, sizeof(trace->wait));
+        memset(trace->slice, 0, sizeof(trace->slice));
+        trace->voluntary = 0;
+        trace->involuntary = 0;
+    }
+    irq_restore(flags);
+}
+
+#else
+
+void sched_trace_dump(uint32_t events) {
+    (void)events;
+    log_info("sched: tracing compiled out");
+}
+
+void sched_trace_reset(void) {}
+
+#endif
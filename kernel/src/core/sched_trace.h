@@ -0,0 +1,52 @@
+#ifndef SCHED_TRACE_H
+#define SCHED_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Per-CPU ring of recent scheduler events plus histograms, dumped to the
+// serial log. Only the owning CPU writes its ring, with interrupts off.
+#define SCHED_TRACE          1
+#define SCHED_TRACE_ENTRIES  256        // Events per CPU, a power of two
+#define SCHED_TRACE_BUCKETS  16         // Log2 microsecond buckets
+#define SCHED_TRACE_DUMP_US  0          // Periodic dump interval, 0 for none
+
+typedef enum {
+    SCHED_EVENT_SWITCH,     // pid: next (0 idle), arg: previous
+    SCHED_EVENT_WAKEUP,     // pid: woken process, arg: target CPU
+    SCHED_EVENT_TICK        // pid: running process, arg: microseconds used
+} sched_event_type_t;
+
+struct sched_event {
+    uint64_t time;          // ktime_get_ns()
+    uint32_t type;
+    uint32_t pid;
+    uint32_t arg;
+};
+
+struct process;
+
+#if SCHED_TRACE
+// Allocate this CPU's ring, from scheduler_init_cpu()
+void sched_trace_init_cpu(void);
+// Stamp a process as queued so its run-queue wait can be measured
+void sched_trace_enqueue(struct process* process);
+void sched_trace_wakeup(struct process* process, uint32_t cpu);
+void sched_trace_tick(struct process* current);
+// prev and next may be NULL for the idle context
+void sched_trace_switch(struct process* prev, struct process* next, bool involuntary);
+#else
+static inline void sched_trace_init_cpu(void) {}
+static inline void sched_trace_enqueue(struct process* process) { (void)process; }
+static inline void sched_trace_wakeup(struct process* process, uint32_t cpu) { (void)process; (void)cpu; }
+static inline void sched_trace_tick(struct process* current) { (void)current; }
+static inline void sched_trace_switch(struct process* prev, struct process* next, bool involuntary) {
+    (void)prev; (void)next; (void)involuntary;
+}
+#endif
+
+// Log the summed histograms, and the last events of every CPU if events > 0
+void sched_trace_dump(uint32_t events);
+void sched_trace_reset(void);
+
+#endif // SCHED_TRACE_H
@@ -2,15 +2,24 @@
 #include <core/acpi.h>
 #include <core/drivers/lapic.h>
 #include <core/gdt.h>
+#include <core/idt.h>
 #include <mm/pmm.h>
 #include <mm/vmm.h>
-#include <core/pit.h>
+#include <core/time.h>
+#include <core/timer.h>
+#include <core/process.h>
+#include <core/fpu.h>
+#include <core/vdso.h>
 #include <utils/mem.h>
 #include <utils/asm.h>
+#include <utils/log.h>
 
 // Stack size for each CPU (16KB)
 #define KERNEL_STACK_SIZE 0x4000
 
+#define MSR_GS_BASE        0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102  // Swapped in by swapgs
+
 // CPU data array
 static struct cpu_data cpu_data[MAX_CPUS];
 static uint32_t cpu_count = 0;
@@ -29,18 +38,27 @@ struct ap_startup_data {
     void* stack_ptr;         // Stack pointer for the AP
     void* page_table;        // CR3 value to use
     void (*entry)(void);     // Entry point function
-    spinlock_t startup_lock; // Lock for synchronization
+    volatile uint32_t startup_lock; // Set by the BSP, cleared by the AP once running
 };
 
 // Assembly function declarations
 extern void ap_trampoline(void);
 extern void ap_trampoline_end(void);
 
-// Current CPU pointer (accessed via GS base)
-static __thread struct cpu_data* current_cpu;
+// Point GS base at a CPU's data; user GS starts out null
+static void load_cpu_base(struct cpu_data* cpu) {
+    cpu->self = cpu;
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+static void* alloc_stack(void) {
+    void* phys = pmm_alloc_pages(pmm_order_for_pages(KERNEL_STACK_SIZE / PAGE_SIZE));
+    return phys ? pmm_phys_to_virt(phys) : NULL;
+}
 
-// Get current CPU data
-static struct cpu_data* get_current_cpu(void) {
+// Find a CPU's data by LAPIC ID, before its GS base is set up
+static struct cpu_data* find_cpu_by_apic_id(void) {
     uint32_t apic_id = lapic_get_id();
 
     for (uint32_t i = 0; i < cpu_count; i++) {
@@ -54,28 +72,32 @@ static struct cpu_data* get_current_cpu(void) {
 // AP entry point (called after AP startup)
 static void ap_main(void) {
     // Get our CPU data
-    struct cpu_data* cpu = get_current_cpu();
+    struct cpu_data* cpu = find_cpu_by_apic_id();
     if (!cpu) {
         // Something went wrong
         while(1) hlt();
     }
+    load_cpu_base(cpu);
+
+    // Same memory types as the BSP before anything else is touched
+    vmm_init_cpu();
 
     // Initialize this CPU's local APIC
     lapic_init();
     lapic_enable();
 
-    // Set up GDT and TSS for this CPU
+    // Set up GDT, TSS and interrupt stacks for this CPU
     gdt_init();
     gdt_load_tss((uint64_t)cpu->kernel_stack + KERNEL_STACK_SIZE);
 
-    // Set up interrupt stacks in TSS
-    if (cpu->tss) {
-        for (int i = 0; i < 7; i++) {
-            // IST entries are ist1 through ist7 in the TSS
-            uint64_t* ist_ptr = &cpu->tss->ist1 + i;
-            *ist_ptr = (uint64_t)cpu->ist_stacks[i] + KERNEL_STACK_SIZE;
-        }
-    }
+    // Use the BSP's interrupt table so IPIs reach their handlers
+    idt_load();
+
+    fpu_init_cpu();
+    vdso_init_cpu();
+
+    // Start this CPU's scheduler tick
+    scheduler_init_cpu();
 
     // Enable interrupts
     sti();
@@ -83,12 +105,17 @@ static void ap_main(void) {
     // Mark CPU as online
     cpu->state |= CPU_STATE_ONLINE;
 
-    // Wait for work
+    // Run processes, zeroing free pages while idle
     while (1) {
-        hlt();
+        scheduler_idle();
     }
 }
 
+// Give the BSP its per-CPU base before anything calls this_cpu()
+void smp_early_init(void) {
+    load_cpu_base(&cpu_data[0]);
+}
+
 // Initialize SMP
 void smp_init(void) {
     // Get BSP's APIC ID
@@ -98,10 +125,10 @@ void smp_init(void) {
     cpu_data[0].apic_id = bsp_apic_id;
     cpu_data[0].cpu_number = 0;
     cpu_data[0].state = CPU_STATE_PRESENT | CPU_STATE_ONLINE | CPU_STATE_BSP;
-    cpu_data[0].kernel_stack = pmm_alloc_page();
-    for (int i = 0; i < 7; i++) {
-        cpu_data[0].ist_stacks[i] = pmm_alloc_page();
-    }
+    cpu_data[0].node = acpi_numa_node_for_apic(bsp_apic_id);
+    cpu_data[0].kernel_stack = alloc_stack();
+    cpu_data[0].kernel_rsp = (uint64_t)cpu_data[0].kernel_stack + KERNEL_STACK_SIZE;
+    // Its interrupt stacks came with gdt_init()
     cpu_count = 1;
 
     // Parse MADT to find other CPUs
@@ -126,9 +153,11 @@ void smp_init(void) {
             cpu_data[cpu_count].apic_id = lapic->apic_id;
             cpu_data[cpu_count].cpu_number = cpu_count;
             cpu_data[cpu_count].state = CPU_STATE_PRESENT | CPU_STATE_AP;
-            cpu_data[cpu_count].kernel_stack = pmm_alloc_page();
+            cpu_data[cpu_count].node = acpi_numa_node_for_apic(lapic->apic_id);
+            cpu_data[cpu_count].kernel_stack = alloc_stack();
+            cpu_data[cpu_count].kernel_rsp = (uint64_t)cpu_data[cpu_count].kernel_stack + KERNEL_STACK_SIZE;
             for (int i = 0; i < 7; i++) {
-                cpu_data[cpu_count].ist_stacks[i] = pmm_alloc_page();
+                cpu_data[cpu_count].ist_stacks[i] = alloc_stack();
             }
             cpu_count++;
 
@@ -146,7 +175,7 @@ void smp_boot_aps(void) {
 
     // Initialize startup data page
     struct ap_startup_data* startup_data = (struct ap_startup_data*)AP_DATA_PAGE;
-    startup_data->page_table = (void*)vmm_get_cr3();
+    startup_data->page_table = (void*)vmm_kernel_address_space();
     startup_data->entry = ap_main;
 
     // Boot each AP
@@ -156,27 +185,31 @@ void smp_boot_aps(void) {
         // Set up startup data for this AP
         startup_data->apic_id = cpu_data[i].apic_id;
         startup_data->stack_ptr = cpu_data[i].kernel_stack + KERNEL_STACK_SIZE;
-        spinlock_init(&startup_data->startup_lock);
-        spinlock_acquire(&startup_data->startup_lock);
+        startup_data->startup_lock = 1;
 
         // Send INIT IPI
         lapic_send_ipi(cpu_data[i].apic_id, 0x500);  // Assert INIT
-        pit_wait(10);  // Wait 10ms
+        timer_sleep_ns(10000000);  // Wait 10ms
         lapic_send_ipi(cpu_data[i].apic_id, 0x600);  // Deassert INIT
-        pit_wait(10);  // Wait 10ms
+        timer_sleep_ns(10000000);  // Wait 10ms
 
         // Send STARTUP IPI (twice as per Intel docs)
         for (int j = 0; j < 2; j++) {
             lapic_send_ipi(cpu_data[i].apic_id, 0x600 | (AP_TRAMPOLINE_ADDR >> 12));
-            pit_wait(1);  // Wait 1ms
+            timer_sleep_ns(1000000);  // Wait 1ms
         }
 
         // Wait for AP to start up
-        spinlock_acquire(&startup_data->startup_lock);
-        spinlock_release(&startup_data->startup_lock);
+        while (startup_data->startup_lock) {
+            __asm__ volatile("pause");
+        }
 
-        // Check if AP is online
-        pit_wait(100);  // Wait 100ms max
+        // Check if AP is online, 100ms max
+        uint64_t deadline = ktime_get_ns() + 100000000;
+        while (!(__atomic_load_n(&cpu_data[i].state, __ATOMIC_ACQUIRE) & CPU_STATE_ONLINE) &&
+               ktime_get_ns() < deadline) {
+            __asm__ volatile("pause");
+        }
         if (!(cpu_data[i].state & CPU_STATE_ONLINE)) {
             // AP failed to start
             cpu_data[i].state &= ~CPU_STATE_PRESENT;
@@ -198,8 +231,13 @@ struct cpu_data* smp_get_cpu_data(uint32_t cpu_num) {
 
 // Get current CPU number
 uint32_t smp_get_current_cpu(void) {
-    struct cpu_data* cpu = get_current_cpu();
-    return cpu ? cpu->cpu_number : 0;
+    return this_cpu()->cpu_number;
+}
+
+// Get current CPU data structure, NULL until smp_init() has run
+struct cpu_data* smp_get_current_cpu_data(void) {
+    if (cpu_count == 0) return NULL;
+    return this_cpu();
 }
 
 // Send IPI to specific CPU
@@ -209,21 +247,158 @@ void smp_send_ipi(uint32_t cpu_num, uint32_t vector) {
 }
 
 // Spinlock implementation
+#if SPINLOCK_STATS
+struct lock_site_stats {
+    uint64_t site;              // Return address of the acquiring call
+    uint64_t acquisitions;
+    uint64_t contended;         // Acquisitions that had to wait
+    uint64_t spin_cycles;
+    uint64_t max_hold_cycles;
+};
+
+static struct lock_site_stats lock_sites[SPINLOCK_STATS_SITES];
+
+// Slot for a call site, claimed on first use; the last slot collects overflow
+static uint32_t lock_site_slot(uint64_t site) {
+    uint32_t slot = (uint32_t)(site >> 2) % (SPINLOCK_STATS_SITES - 1);
+    for (uint32_t i = 0; i < SPINLOCK_STATS_SITES - 1; i++) {
+        uint64_t cur = __atomic_load_n(&lock_sites[slot].site, __ATOMIC_RELAXED);
+        if (cur == site) return slot;
+        if (cur == 0 && __sync_bool_compare_and_swap(&lock_sites[slot].site, 0, site)) return slot;
+        if (lock_sites[slot].site == site) return slot;
+        slot = (slot + 1) % (SPINLOCK_STATS_SITES - 1);
+    }
+    return SPINLOCK_STATS_SITES - 1;
+}
+
+static void lock_stats_acquired(spinlock_t* lock, uint64_t site, uint64_t spin) {
+    struct lock_site_stats* stats = &lock_sites[lock_site_slot(site)];
+    __atomic_add_fetch(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    if (spin) {
+        __atomic_add_fetch(&stats->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->spin_cycles, spin, __ATOMIC_RELAXED);
+    }
+    lock->site = (uint32_t)(stats - lock_sites);
+    lock->acquired_at = rdtsc();
+}
+
+static void lock_stats_released(spinlock_t* lock) {
+    struct lock_site_stats* stats = &lock_sites[lock->site];
+    uint64_t hold = rdtsc() - lock->acquired_at;
+    uint64_t max = __atomic_load_n(&stats->max_hold_cycles, __ATOMIC_RELAXED);
+    while (hold > max && !__atomic_compare_exchange_n(&stats->max_hold_cycles, &max, hold,
+                                                      false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static int clamp_int(uint64_t value) {
+    return value > 0x7FFFFFFF ? 0x7FFFFFFF : (int)value;
+}
+
+// Log every site seen so far, hottest first by spin cycles
+void spinlock_stats_dump(void) {
+    bool done[SPINLOCK_STATS_SITES] = { false };
+    for (;;) {
+        int best = -1;
+        for (int i = 0; i < SPINLOCK_STATS_SITES; i++) {
+            if (done[i] || !lock_sites[i].acquisitions) continue;
+            if (best < 0 || lock_sites[i].spin_cycles > lock_sites[best].spin_cycles) best = i;
+        }
+        if (best < 0) break;
+        done[best] = true;
+
+        // log_printf only formats 32-bit values
+        char addr[19] = "0x";
+        for (int i = 0; i < 16; i++) {
+            addr[2 + i] = "0123456789abcdef"[(lock_sites[best].site >> (60 - i * 4)) & 0xF];
+        }
+        addr[18] = '\0';
+
+        struct lock_site_stats* stats = &lock_sites[best];
+        log_info("lock %s: %d acquisitions, %d contended, %d spin cycles, %d max hold cycles",
+                 best == SPINLOCK_STATS_SITES - 1 ? "(other)" : addr,
+                 clamp_int(stats->acquisitions), clamp_int(stats->contended),
+                 clamp_int(stats->spin_cycles), clamp_int(stats->max_hold_cycles));
+    }
+}
+#else
+void spinlock_stats_dump(void) {
+    log_info("lock statistics disabled, build with SPINLOCK_STATS");
+}
+#endif
+
 void spinlock_init(spinlock_t* lock) {
-    *lock = 0;
+    lock->value = 0;
 }
 
 void spinlock_acquire(spinlock_t* lock) {
-    while (!spinlock_try_acquire(lock)) {
-        __asm__ volatile("pause");
+    uint16_t ticket = (uint16_t)(__atomic_fetch_add(&lock->value, 1 << 16, __ATOMIC_ACQUIRE) >> 16);
+
+#if SPINLOCK_STATS
+    uint64_t start = rdtsc();
+    bool waited = false;
+#endif
+    // Back off in proportion to the queue ahead of us
+    for (;;) {
+        uint16_t owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+        if (owner == ticket) break;
+#if SPINLOCK_STATS
+        waited = true;
+#endif
+        for (uint16_t i = (uint16_t)(ticket - owner); i; i--) {
+            __asm__ volatile("pause");
+        }
     }
+#if SPINLOCK_STATS
+    lock_stats_acquired(lock, (uint64_t)__builtin_return_address(0), waited ? rdtsc() - start : 0);
+#endif
 }
 
 void spinlock_release(spinlock_t* lock) {
-    __asm__ volatile("" ::: "memory");
-    *lock = 0;
+#if SPINLOCK_STATS
+    lock_stats_released(lock);
+#endif
+    // Only the holder writes owner
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
 }
 
 bool spinlock_try_acquire(spinlock_t* lock) {
-    return __sync_bool_compare_and_swap(lock, 0, 1);
+    uint32_t value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+    if ((value & 0xFFFF) != (value >> 16)) return false;
+
+    // Free: take the next ticket if nobody else did meanwhile
+    if (!__atomic_compare_exchange_n(&lock->value, &value, value + (1 << 16),
+                                     false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+#if SPINLOCK_STATS
+    lock_stats_acquired(lock, (uint64_t)__builtin_return_address(0), 0);
+#endif
+    return true;
+}
+
+void rwlock_init(rwlock_t* lock) {
+    spinlock_init(&lock->lock);
+    lock->readers = 0;
+}
+
+void rwlock_read_acquire(rwlock_t* lock) {
+    spinlock_acquire(&lock->lock);
+    __atomic_add_fetch(&lock->readers, 1, __ATOMIC_ACQUIRE);
+    spinlock_release(&lock->lock);
+}
+
+void rwlock_read_release(rwlock_t* lock) {
+    __atomic_sub_fetch(&lock->readers, 1, __ATOMIC_RELEASE);
+}
+
+void rwlock_write_acquire(rwlock_t* lock) {
+    spinlock_acquire(&lock->lock);
+    while (__atomic_load_n(&lock->readers, __ATOMIC_ACQUIRE)) {
+        __asm__ volatile("pause");
+    }
+}
+
+void rwlock_write_release(rwlock_t* lock) {
+    spinlock_release(&lock->lock);
 }
\ No newline at end of file
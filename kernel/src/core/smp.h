@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <utils/asm.h>
 
 #define MAX_CPUS 256
 
@@ -12,31 +13,116 @@
 #define CPU_STATE_BSP      (1 << 2)  // Bootstrap Processor
 #define CPU_STATE_AP       (1 << 3)  // Application Processor
 
-// Per-CPU data structure
+// Per-CPU page cache sizing
+#define CPU_PAGE_CACHE_SIZE  64   // Pages held per CPU
+#define CPU_PAGE_CACHE_BATCH 32   // Pages moved per refill/drain
+
+// Statistics counters each CPU keeps its own copy of, see core/counter.h
+#define CPU_COUNTERS         128
+
+// Per-CPU cache of free order-0 pages in front of the PMM
+struct cpu_page_cache {
+    uint32_t count;
+    void* pages[CPU_PAGE_CACHE_SIZE];
+};
+
+// Per-CPU data structure, found through GS base while in the kernel.
+// The first three fields are used from assembly at fixed GS offsets.
 struct cpu_data {
+    struct cpu_data* self; // gs:0, see this_cpu()
+    uint64_t kernel_rsp;   // gs:8, stack syscall_entry switches to
+    uint64_t user_rsp;     // gs:16, user stack saved by syscall_entry
+    uint64_t current_pid;  // gs:24, running process for the getpid fast path
     uint32_t apic_id;      // Local APIC ID
     uint32_t cpu_number;   // Logical CPU number
     uint32_t state;        // CPU state flags
+    uint32_t node;         // NUMA node, from the SRAT
     void* kernel_stack;    // Kernel stack for this CPU
     void* ist_stacks[7];   // Interrupt stacks for this CPU
     struct tss* tss;       // TSS for this CPU
+    void* pml4;            // Page tables CR3 points at, see mm/vmm.c
+    struct cpu_page_cache page_cache; // Free pages owned by this CPU
+    struct process* fpu_owner;  // Process whose FPU state the registers hold
+    bool fpu_live;              // CR0.TS clear, registers in use this slice
+    volatile uint64_t rcu_qs;   // Quiescent states passed, see core/rcu.h
+    // Columns of the registered counters, on cache lines of their own
+    uint64_t counters[CPU_COUNTERS] __attribute__((aligned(64)));
 };
 
+// Data of the CPU we are running on, a single GS-relative load. Callers
+// that can be preempted must not keep the result across a reschedule.
+static inline struct cpu_data* this_cpu(void) {
+    struct cpu_data* cpu;
+    asm volatile ("mov %0, qword ptr gs:0" : "=r"(cpu));
+    return cpu;
+}
+
 // SMP functions
+void smp_early_init(void);
 void smp_init(void);
 void smp_boot_aps(void);
 uint32_t smp_get_cpu_count(void);
 struct cpu_data* smp_get_cpu_data(uint32_t cpu_num);
 uint32_t smp_get_current_cpu(void);
+struct cpu_data* smp_get_current_cpu_data(void);
 void smp_send_ipi(uint32_t cpu_num, uint32_t vector);
 
-// Spinlock for SMP synchronization
-typedef volatile uint32_t spinlock_t;
+// Record acquisitions, spin cycles and worst hold time per acquiring call
+// site, see spinlock_stats_dump()
+#define SPINLOCK_STATS 0
+#define SPINLOCK_STATS_SITES 128
+
+// Ticket spinlock: CPUs are served in arrival order and waiters only read
+// the lock word until their turn comes
+typedef struct spinlock {
+    union {
+        volatile uint32_t value;
+        struct {
+            volatile uint16_t owner;   // Ticket being served
+            volatile uint16_t next;    // Next ticket handed out
+        };
+    };
+#if SPINLOCK_STATS
+    uint32_t site;                     // Stats slot of the current holder
+    uint64_t acquired_at;              // TSC when the holder got the lock
+#endif
+} spinlock_t;
+
+#define SPINLOCK_INIT { { 0 } }
 
 void spinlock_init(spinlock_t* lock);
 void spinlock_acquire(spinlock_t* lock);
 void spinlock_release(spinlock_t* lock);
 bool spinlock_try_acquire(spinlock_t* lock);
+void spinlock_stats_dump(void);
+
+// Take a lock that interrupt handlers also take; returns the flags for
+// spinlock_release_irqrestore()
+static inline __attribute__((always_inline)) uint64_t spinlock_acquire_irqsave(spinlock_t* lock) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(lock);
+    return flags;
+}
+
+static inline __attribute__((always_inline)) void spinlock_release_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spinlock_release(lock);
+    irq_restore(flags);
+}
+
+// Reader-writer spinlock. A waiting writer holds the ticket lock, so new
+// readers queue behind it and writers cannot starve.
+typedef struct rwlock {
+    spinlock_t lock;
+    volatile uint32_t readers;
+} rwlock_t;
+
+#define RWLOCK_INIT { SPINLOCK_INIT, 0 }
+
+void rwlock_init(rwlock_t* lock);
+void rwlock_read_acquire(rwlock_t* lock);
+void rwlock_read_release(rwlock_t* lock);
+void rwlock_write_acquire(rwlock_t* lock);
+void rwlock_write_release(rwlock_t* lock);
 
 // Inter-processor message functions
 void smp_send_message(uint32_t cpu_num, uint32_t message, uint64_t data);
@@ -1,12 +1,28 @@
 [BITS 64]
 global syscall_entry
 
-extern syscall_handler
+extern syscall_table
+extern syscall_traced
+extern syscall_stats_enabled
+
+%define SYSCALL_MAX 512         ; See core/syscalls.h
+%define NR_GETPID   39
+%define ENOSYS      38
 
 section .text
 
 syscall_entry:
-    ; Save user stack
+    ; getpid is answered from the per-CPU copy of the running PID without
+    ; touching the stack; interrupts stay masked until sysret
+    cmp rax, NR_GETPID
+    jne .slow
+    swapgs
+    mov eax, dword [gs:24]
+    swapgs
+    sysretq
+
+.slow:
+    ; Save user stack, see struct cpu_data for the GS offsets
     swapgs                      ; Switch to kernel GS
     mov [gs:16], rsp           ; Save user RSP
     mov rsp, [gs:8]           ; Load kernel RSP
@@ -16,8 +32,8 @@ syscall_entry:
     push r11                  ; Save user RFLAGS
     push rcx                  ; Save user RIP
 
-    ; Save registers
-    push rax                  ; System call number
+    ; Only registers the C handler may clobber and user space expects
+    ; back; rax carries the result
     push rdi                  ; Arg 1
     push rsi                  ; Arg 2
     push rdx                  ; Arg 3
@@ -25,14 +41,29 @@ syscall_entry:
     push r8                   ; Arg 5
     push r9                   ; Arg 6
 
-    ; Align stack for function call
-    sub rsp, 8
+    ; Aligns the stack for the call and is the traced path's seventh
+    ; argument
+    push rax
+
+    cmp rax, SYSCALL_MAX
+    jae .enosys
+    mov rcx, r10             ; Arg 4 into its C ABI register
+    cmp byte [rel syscall_stats_enabled], 0
+    jne .traced
+
+    ; Table dispatch, every slot is valid after syscalls_init()
+    lea r11, [rel syscall_table]
+    call qword [r11 + rax * 8]
+    jmp .done
+
+.traced:
+    call syscall_traced
+    jmp .done
 
-    ; Call C handler
-    mov rcx, r10             ; Restore arg4 from r10
-    call syscall_handler
+.enosys:
+    mov rax, -ENOSYS
 
-    ; Restore stack alignment
+.done:
     add rsp, 8
 
     ; Restore registers
@@ -42,12 +73,13 @@ syscall_entry:
     pop rdx
     pop rsi
     pop rdi
-    pop rax
 
-    ; Restore user context
+    ; Restore user context. The handler may have moved us to another CPU,
+    ; so the user RSP comes off our own stack rather than gs:16.
+    cli
     pop rcx                  ; Restore RIP
     pop r11                  ; Restore RFLAGS
-    mov rsp, [gs:16]        ; Restore user RSP
+    pop rsp                  ; Restore user RSP
     swapgs                  ; Restore user GS
 
     ; Return to user mode
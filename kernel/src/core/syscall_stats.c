@@ -0,0 +1,105 @@
+#include <core/syscall_stats.h>
+#include <core/syscalls.h>
+#include <core/smp.h>
+#include <utils/mem.h>
+#include <utils/asm.h>
+#include <utils/log.h>
+
+volatile uint8_t syscall_stats_enabled = 0;
+
+#if SYSCALL_STATS
+
+struct syscall_stats_cpu {
+    uint64_t calls[SYSCALL_MAX];
+    uint64_t cycles[SYSCALL_MAX];
+    uint32_t hist[SYSCALL_MAX][SYSCALL_STATS_BUCKETS];
+};
+
+// NULL until the first syscall_stats_enable()
+static struct syscall_stats_cpu* stats_cpus[MAX_CPUS];
+
+bool syscall_stats_enable(bool enable) {
+    if (enable) {
+        for (uint32_t cpu = 0; cpu < smp_get_cpu_count(); cpu++) {
+            if (stats_cpus[cpu]) continue;
+            struct syscall_stats_cpu* stats = malloc(sizeof(struct syscall_stats_cpu));
+            if (!stats) return false;
+            memset(stats, 0, sizeof(struct syscall_stats_cpu));
+            __atomic_store_n(&stats_cpus[cpu], stats, __ATOMIC_RELEASE);
+        }
+    }
+    syscall_stats_enabled = enable;
+    return true;
+}
+
+// Bucket b holds [2^(b-1), 2^b) cycles
+static inline uint32_t cycle_bucket(uint64_t cycles) {
+    uint32_t bucket = cycles ? 64 - (uint32_t)__builtin_clzll(cycles) : 0;
+    return bucket < SYSCALL_STATS_BUCKETS ? bucket : SYSCALL_STATS_BUCKETS - 1;
+}
+
+long syscall_traced(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                    uint64_t arg4, uint64_t arg5, uint64_t arg6, uint64_t nr) {
+    uint64_t start = rdtsc();
+    long result = syscall_table[nr](arg1, arg2, arg3, arg4, arg5, arg6);
+    uint64_t cycles = rdtsc() - start;
+
+    // Charged to the CPU the call finished on; only that CPU writes its set
+    uint64_t flags = irq_save();
+    struct syscall_stats_cpu* stats = stats_cpus[smp_get_current_cpu()];
+    if (stats) {
+        stats->calls[nr]++;
+        stats->cycles[nr] += cycles;
+        stats->hist[nr][cycle_bucket(cycles)]++;
+    }
+    irq_restore(flags);
+    return result;
+}
+
+void syscall_stats_dump(void) {
+    for (uint32_t nr = 0; nr < SYSCALL_MAX; nr++) {
+        uint64_t calls = 0, cycles = 0;
+        uint64_t hist[SYSCALL_STATS_BUCKETS] = { 0 };
+
+        // Read unlocked; a dump racing a call may be off by one
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            struct syscall_stats_cpu* stats = __atomic_load_n(&stats_cpus[cpu], __ATOMIC_ACQUIRE);
+            if (!stats || !stats->calls[nr]) continue;
+            calls += stats->calls[nr];
+            cycles += stats->cycles[nr];
+            for (uint32_t b = 0; b < SYSCALL_STATS_BUCKETS; b++) hist[b] += stats->hist[nr][b];
+        }
+        if (!calls) continue;
+
+        log_info("syscall %d: %d calls, %d cycles average", (int)nr, (int)calls, (int)(cycles / calls));
+        for (uint32_t b = 0; b < SYSCALL_STATS_BUCKETS; b++) {
+            if (hist[b]) log_info("syscall %d:   < 2^%d cycles: %d", (int)nr, (int)b, (int)hist[b]);
+        }
+    }
+}
+
+void syscall_stats_reset(void) {
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct syscall_stats_cpu* stats = stats_cpus[cpu];
+        if (stats) memset(stats, 0, sizeof(struct syscall_stats_cpu));
+    }
+}
+
+#else
+
+bool syscall_stats_enable(bool enable) {
+    return !enable;
+}
+
+void syscall_stats_dump(void) {
+    log_info("syscall: statistics compiled out");
+}
+
+void syscall_stats_reset(void) {}
+
+long syscall_traced(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                    uint64_t arg4, uint64_t arg5, uint64_t arg6, uint64_t nr) {
+    return syscall_table[nr](arg1, arg2, arg3, arg4, arg5, arg6);
+}
+
+#endif
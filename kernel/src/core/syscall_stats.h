@@ -0,0 +1,27 @@
+#ifndef SYSCALL_STATS_H
+#define SYSCALL_STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Per-CPU call counts and TSC cycle histograms per syscall number. Off
+// until syscall_stats_enable(); while off syscall_entry never leaves the
+// direct table call.
+#define SYSCALL_STATS         1
+#define SYSCALL_STATS_BUCKETS 24    // Log2 cycle buckets, the last open-ended
+
+// Read by syscall_entry to pick the traced path
+extern volatile uint8_t syscall_stats_enabled;
+
+// Allocate the counters on first use and start or stop recording; false
+// if the counters could not be allocated or are compiled out
+bool syscall_stats_enable(bool enable);
+// Log every number called since the last reset with its histogram
+void syscall_stats_dump(void);
+void syscall_stats_reset(void);
+
+// Traced dispatch, called by syscall_entry with the call number last
+long syscall_traced(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                    uint64_t arg4, uint64_t arg5, uint64_t arg6, uint64_t nr);
+
+#endif // SYSCALL_STATS_H
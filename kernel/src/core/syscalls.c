@@ -2,58 +2,49 @@
 #include <mm/vmm.h>
 #include <mm/pmm.h>
 #include <mm/heap.h>
+#include <mm/slab.h>
+#include <mm/vma.h>
 #include <fs/ext2.h>
+#include <fs/file.h>
+#include <fs/epoll.h>
+#include <fs/page_cache.h>
+#include <fs/vfs.h>
 #include <core/process.h>
+#include <core/fpu.h>
+#include <core/vdso.h>
 #include <core/elf.h>
+#include <core/uring.h>
+#include <core/futex.h>
+#include <core/time.h>
+#include <core/timer.h>
 #include <utils/log.h>
 #include <core/acpi.h>
 #include <core/drivers/pic.h>
 #include <core/drivers/lapic.h>
 #include <core/drivers/serial/serial.h>
 #include <core/drivers/net/netdev.h>
+#include <core/drivers/tty/pipe.h>
 #include <net/net.h>
 #include <graphics/display.h>
 #include <limine.h>
 #include <utils/mem.h>
 #include <utils/str.h>
+#include <utils/asm.h>
 
 extern volatile struct limine_framebuffer_request framebuffer_request;
 
-// Expanded file descriptor tracking
-#define MAX_FDS 256
 #define MAX_PROCESSES 256
 
-// File descriptor types
-#define FD_TYPE_FILE    0
-#define FD_TYPE_SOCKET  1
-#define FD_TYPE_PIPE    2
-#define FD_TYPE_DIR     3
-
-// File descriptor management structure
-typedef struct {
-    uint32_t inode;
-    uint32_t offset;
-    uint32_t flags;
-    uint16_t refcount;
-    void* private_data;
-    int type;
-} file_descriptor_t;
-
-// Pipe structure for pipe syscalls
-typedef struct {
-    uint8_t* buffer;
-    size_t buffer_size;
-    size_t read_pos;
-    size_t write_pos;
-    size_t data_size;
-} pipe_t;
-
-static file_descriptor_t* fd_table[MAX_FDS];
+// Bytes sendfile() moves per read/write round
+#define SENDFILE_CHUNK 32768
+
 static void* program_break = NULL;
 static void* next_mmap_addr = (void*)0x600000000000ULL;
 
 // Existing method declarations
 extern process_t* process_list;
+int sys_munmap(void* addr, size_t length);
+static void syscall_table_fill(void);
 
 // Dirent structure for getdents syscall
 struct linux_dirent {
@@ -70,20 +61,6 @@ struct linux_dirent {
 #define MSR_SYSCALL_MASK 0xC0000084 // System Call Flag Mask
 #define EFER_SCE        0x00000001  // System Call Extensions bit
 
-// Read MSR
-static inline uint64_t rdmsr(uint32_t msr) {
-    uint32_t low, high;
-    asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
-    return ((uint64_t)high << 32) | low;
-}
-
-// Write MSR
-static inline void wrmsr(uint32_t msr, uint64_t value) {
-    uint32_t low = value & 0xFFFFFFFF;
-    uint32_t high = value >> 32;
-    asm volatile("wrmsr" : : "c"(msr), "a"(low), "d"(high));
-}
-
 // Assembly syscall entry point
 extern void syscall_entry(void);
 
@@ -99,7 +76,8 @@ void syscalls_init(void) {
     star |= ((uint64_t)0x1B << 48);           // SYSRET CS/SS: user code (0x1B)
     wrmsr(MSR_STAR, star);
 
-    // Set up syscall entry point
+    // Set up syscall entry point, with every table slot valid first
+    syscall_table_fill();
     wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
 
     // Set up syscall flags mask
@@ -118,72 +96,114 @@ void syscalls_init(void) {
         return;
     }
 
-    // Initialize the file descriptor table
-    memset(fd_table, 0, sizeof(fd_table));
+    file_init();
 }
 
 // File descriptor management
-static int alloc_fd(void) {
-    for (int i = 0; i < MAX_FDS; i++) {
-        if (!fd_table[i]) {
-            fd_table[i] = malloc(sizeof(file_descriptor_t));
-            if (fd_table[i]) {
-                memset(fd_table[i], 0, sizeof(file_descriptor_t));
-                fd_table[i]->refcount = 1;
-                return i;
-            }
-            return -ENOMEM;
-        }
+
+// The calling process's descriptor table, created on first use
+static struct fd_table* current_files(void) {
+    process_t* current = get_current_process();
+    if (!current) return NULL;
+    if (!current->files) current->files = fdtable_create();
+    return current->files;
+}
+
+static struct file* get_file(int fd) {
+    process_t* current = get_current_process();
+    return current ? fd_get(current->files, fd) : NULL;
+}
+
+// Give a new open file the lowest free descriptor, or drop it on failure
+static int install_file(struct file* file) {
+    struct fd_table* files = current_files();
+    int fd = files ? fd_install(files, file) : -ENOMEM;
+    if (fd < 0) file_put(file);
+    return fd;
+}
+
+static void socket_release(struct file* file) {
+    net_socket* sock = file->private_data;
+    if (sock) {
+        net_socket_close(sock->fd);
+        free(sock);
     }
-    return -EMFILE;
 }
 
-static void free_fd(int fd) {
-    if (fd < 0 || fd >= MAX_FDS || !fd_table[fd]) return;
+static void pipe_release(struct file* file) {
+    pipe_t* pipe = file->private_data;
+    if (!pipe) return;
+    if (file->flags & O_WRONLY) {
+        pipe_remove_writer(pipe);
+    } else {
+        pipe_remove_reader(pipe);
+    }
+}
 
-    fd_table[fd]->refcount--;
-    if (fd_table[fd]->refcount == 0) {
-        // Close socket or other resources
-        switch (fd_table[fd]->type) {
-            case FD_TYPE_SOCKET:
-                if (fd_table[fd]->private_data) {
-                    net_socket_close(((net_socket*)fd_table[fd]->private_data)->fd);
-                    free(fd_table[fd]->private_data);
-                }
-                break;
-            case FD_TYPE_PIPE:
-                {
-                    pipe_t* pipe_data = (pipe_t*)fd_table[fd]->private_data;
-                    if (pipe_data) {
-                        free(pipe_data->buffer);
-                        free(pipe_data);
-                    }
-                }
-                break;
+uint32_t file_poll(struct file* file, struct poll_head** head) {
+    if (head) *head = NULL;
+
+    switch (file->type) {
+        case FD_TYPE_PIPE: {
+            pipe_t* pipe = file->private_data;
+            if (head) *head = &pipe->poll;
+            return pipe_poll(pipe, (file->flags & O_WRONLY) != 0);
         }
-        free(fd_table[fd]);
-        fd_table[fd] = NULL;
+        case FD_TYPE_SOCKET: {
+            net_socket* sock = file->private_data;
+            if (!sock) return EPOLLERR;
+            if (head) *head = net_socket_poll_head(sock->fd);
+            return net_socket_poll(sock->fd);
+        }
+        default:
+            // Regular files never block
+            return EPOLLIN | EPOLLOUT;
     }
 }
 
 // Expanded system call implementations
 int sys_open(const char* pathname, int flags, mode_t mode) {
-    // Use EXT2 to find and open the file
-    uint32_t inode = ext2_find_file(EXT2_ROOT_INO, pathname);
+    if (!pathname) return -EFAULT;
+
+    // Paths under a mount point belong to that filesystem
+    const char* rest;
+    void* mount_data;
+    const struct vfs_ops* ops = vfs_resolve(pathname, &rest, &mount_data);
+    if (ops) {
+        struct file* file = file_alloc();
+        if (!file) return -ENOMEM;
+        file->flags = flags;
+        file->type = FD_TYPE_FILE;
+        int result = ops->open(mount_data, rest, flags, mode, file);
+        if (result < 0) {
+            file_put(file);
+            return result;
+        }
+        return install_file(file);
+    }
+
+    // Walk to the containing directory, then look the last name up in it
+    const char* name;
+    uint32_t parent = ext2_lookup_parent(pathname, &name);
+    if (!parent) return -ENOENT;
+
+    uint32_t name_len = 0;
+    while (name[name_len] && name[name_len] != '/') name_len++;
+    uint32_t inode = name_len ? ext2_find_entry(parent, name, name_len) : parent;
 
     // If file not found and O_CREAT is set, create it
     if (!inode && (flags & O_CREAT)) {
-        inode = ext2_create_file(EXT2_ROOT_INO, pathname,
+        if (name[name_len]) return -EISDIR;
+        inode = ext2_create_file(parent, name,
             mode & 0777 | S_IFREG);
         if (!inode) return -EACCES;
     } else if (!inode) {
         return -ENOENT;
     }
 
-    int fd = alloc_fd();
-    if (fd < 0) return fd;
+    struct file* file_desc = file_alloc();
+    if (!file_desc) return -ENOMEM;
 
-    file_descriptor_t* file_desc = fd_table[fd];
     file_desc->inode = inode;
     file_desc->offset = 0;
     file_desc->flags = flags;
@@ -195,130 +215,359 @@ int sys_open(const char* pathname, int flags, mode_t mode) {
         // TODO: Implement file truncation
     }
 
-    return fd;
+    return install_file(file_desc);
 }
 
 int sys_close(int fd) {
-    if (fd < 0 || fd >= MAX_FDS || !fd_table[fd]) return -EBADF;
-    free_fd(fd);
+    process_t* current = get_current_process();
+    struct file* file = current ? fd_remove(current->files, fd) : NULL;
+    if (!file) return -EBADF;
+    file_put(file);
     return 0;
 }
 
-ssize_t sys_read(int fd, void* buf, size_t count) {
-    if (!buf) return -EINVAL;
-    if (fd < 0 || fd >= MAX_FDS || !fd_table[fd]) return -EBADF;
+// Total length of a user iovec array, or a negative errno
+static ssize_t iov_total(const struct iovec* iov, int iovcnt) {
+    if (iovcnt < 0 || iovcnt > IOV_MAX) return -EINVAL;
+    if (iovcnt > 0 && !iov) return -EFAULT;
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len && !iov[i].iov_base) return -EFAULT;
+        if (iov[i].iov_len > (size_t)INT64_MAX - total) return -EINVAL;
+        total += iov[i].iov_len;
+    }
+    return (ssize_t)total;
+}
+
+// Read total bytes into the segments at pos, or at the file offset if pos
+// is -1. The segments may be kernel buffers, as for splice().
+ssize_t file_readv(struct file* file, const struct iovec* iov, int iovcnt, size_t total, off_t pos) {
+    // Only regular files have positions
+    if (pos != -1 && file->type != FD_TYPE_FILE) return -ESPIPE;
+    if (pos < -1) return -EINVAL;
+
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+
+    // Handle pipes, a page buffer at a time
+    if (file->type == FD_TYPE_PIPE) {
+        return pipe_readv(file->private_data, &iter, total, (file->flags & O_NONBLOCK) != 0);
+    }
+
+    // Handle network sockets: one packet, scattered across the segments
+    if (file->type == FD_TYPE_SOCKET) {
+        net_socket* sock = file->private_data;
+        uint16_t received = total > 0xFFFF ? 0xFFFF : (uint16_t)total;
+        if (iovcnt == 1) {
+            return net_socket_receive_wait(sock->fd, iov[0].iov_base, &received) == 0 ? received : -EIO;
+        }
+
+        void* bounce = malloc(received ? received : 1);
+        if (!bounce) return -ENOMEM;
+        ssize_t result = -EIO;
+        if (net_socket_receive_wait(sock->fd, bounce, &received) == 0) {
+            result = iov_copy_to_iter(&iter, bounce, received);
+        }
+        free(bounce);
+        return result;
+    }
+
+    // Handle regular files through the page cache shared with mappings
+    uint64_t offset = pos == -1 ? file->offset : (uint64_t)pos;
+    if (offset > 0xFFFFFFFFULL) return 0;
+    int64_t result;
+    if (file->ops) {
+        result = file->ops->readv(file, iov, iovcnt, offset);
+        if (result < 0) return result;
+    } else {
+        result = page_cache_readv(file->inode, iov, iovcnt, offset, &file->ra);
+        if (result < 0) return -EIO;
+    }
+
+    if (pos == -1) file->offset += (uint32_t)result;
+    return result;
+}
+
+static ssize_t do_readv(int fd, const struct iovec* iov, int iovcnt, off_t pos) {
+    struct file* file = get_file(fd);
+    if (!file) return -EBADF;
+
+    ssize_t total = iov_total(iov, iovcnt);
+    if (total < 0) return total;
 
     // Handle stdin from serial
     if (fd == STDIN_FILENO) {
+        if (pos != -1) return -ESPIPE;
+        if (total == 0) return 0;
         char c = serial_read_char(COM1);
-        if (count > 0) {
-            ((char*)buf)[0] = c;
-            return 1;
-        }
-        return 0;
+        struct iov_iter iter;
+        iov_iter_init(&iter, iov, iovcnt);
+        return iov_copy_to_iter(&iter, &c, 1);
     }
 
-    // Handle pipes
-    if (fd_table[fd]->type == FD_TYPE_PIPE) {
-        pipe_t* pipe_data = (pipe_t*)fd_table[fd]->private_data;
-        size_t to_read = (count < pipe_data->data_size) ? count : pipe_data->data_size;
+    return file_readv(file, iov, iovcnt, (size_t)total, pos);
+}
+
+// Draw to the framebuffer console
+static ssize_t console_write(const char* cbuf, size_t count) {
+    struct limine_framebuffer* fb = framebuffer_request.response->framebuffers[0];
+    if (!fb) return -EIO;
 
-        for (size_t i = 0; i < to_read; i++) {
-            ((uint8_t*)buf)[i] = pipe_data->buffer[pipe_data->read_pos];
-            pipe_data->read_pos = (pipe_data->read_pos + 1) % pipe_data->buffer_size;
+    static uint32_t x = 0, y = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (cbuf[i] == '\n' || x > fb->width - DISPLAY_GLYPH_WIDTH) {
+            x = 0;
+            y += DISPLAY_GLYPH_HEIGHT;
+            if (y > fb->height - DISPLAY_GLYPH_HEIGHT) {
+                display_scroll(fb, DISPLAY_GLYPH_HEIGHT, 0x000000);
+                y = fb->height - DISPLAY_GLYPH_HEIGHT;
+            }
+            if (cbuf[i] == '\n') continue;
         }
+        draw_glyph(fb, cbuf[i], x, y, 0xFFFFFF, 0x000000);
+        x += DISPLAY_GLYPH_WIDTH;
+    }
+    display_flush(fb);
+    return count;
+}
+
+// Write total bytes from the segments at pos, or at the file offset if pos is -1
+ssize_t file_writev(struct file* file, const struct iovec* iov, int iovcnt, size_t total, off_t pos) {
+    if (pos != -1 && file->type != FD_TYPE_FILE) return -ESPIPE;
+    if (pos < -1) return -EINVAL;
 
-        pipe_data->data_size -= to_read;
-        return to_read;
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+
+    // Handle pipes, a page buffer at a time
+    if (file->type == FD_TYPE_PIPE) {
+        return pipe_writev(file->private_data, &iter, total, (file->flags & O_NONBLOCK) != 0);
     }
 
-    // Handle network sockets
-    if (fd_table[fd]->type == FD_TYPE_SOCKET) {
-        net_socket* sock = fd_table[fd]->private_data;
-        uint16_t received = count;
-        int result = net_socket_receive(sock->fd, buf, &received);
-        return result == 0 ? received : -EIO;
+    // Handle network sockets: the segments go down in one send
+    if (file->type == FD_TYPE_SOCKET) {
+        net_socket* sock = file->private_data;
+        return net_socket_sendv(sock->fd, iov, iovcnt) == 0 ? total : -EIO;
     }
 
-    // Handle regular files using EXT2
-    if (!ext2_read_file(fd_table[fd]->inode, buf,
-        fd_table[fd]->offset, count)) {
-        return -EIO;
+    // Handle regular file writes through EXT2, in one pass over the blocks,
+    // keeping cached pages current
+    uint64_t offset = pos == -1 ? file->offset : (uint64_t)pos;
+    if (offset + (uint64_t)total > 0xFFFFFFFFULL) return -EFBIG;
+    int64_t result;
+    if (file->ops) {
+        result = file->ops->writev(file, iov, iovcnt, offset);
+        if (result < 0) return result;
+    } else {
+        result = page_cache_writev(file->inode, iov, iovcnt, offset);
+        if (result < 0) return -EIO;
     }
 
-    fd_table[fd]->offset += count;
-    return count;
+    if (pos == -1) file->offset += (uint32_t)result;
+    return result;
 }
 
-ssize_t sys_write(int fd, const void* buf, size_t count) {
-    if (!buf) return -EINVAL;
-    if (fd < 0 || fd >= MAX_FDS || !fd_table[fd]) return -EBADF;
+static ssize_t do_writev(int fd, const struct iovec* iov, int iovcnt, off_t pos) {
+    struct file* file = get_file(fd);
+    if (!file) return -EBADF;
+
+    ssize_t total = iov_total(iov, iovcnt);
+    if (total < 0) return total;
 
     // Handle stdout/stderr to framebuffer
     if (fd == STDOUT_FILENO || fd == STDERR_FILENO) {
-        struct limine_framebuffer* fb = framebuffer_request.response->framebuffers[0];
-        if (!fb) return -EIO;
-
-        static uint32_t x = 0, y = 0;
-        const char* cbuf = buf;
-
-        for (size_t i = 0; i < count; i++) {
-            if (cbuf[i] == '\n' || x >= fb->width - 8) {
-                x = 0;
-                y += 16;
-                if (y >= fb->height - 16) {
-                    memmove((void*)fb->address,
-                           (void*)(fb->address + fb->pitch * 16),
-                           fb->pitch * (fb->height - 16));
-                    y = fb->height - 16;
-                }
-                if (cbuf[i] == '\n') continue;
-            }
-            draw_char(fb, cbuf[i], x, y, 0xFFFFFF);
-            x += 8;
+        if (pos != -1) return -ESPIPE;
+        for (int i = 0; i < iovcnt; i++) {
+            ssize_t result = console_write(iov[i].iov_base, iov[i].iov_len);
+            if (result < 0) return result;
         }
-        return count;
+        return total;
     }
 
-    // Handle pipes
-    if (fd_table[fd]->type == FD_TYPE_PIPE) {
-        pipe_t* pipe_data = (pipe_t*)fd_table[fd]->private_data;
-        size_t available = pipe_data->buffer_size - pipe_data->data_size;
-        size_t to_write = (count < available) ? count : available;
+    return file_writev(file, iov, iovcnt, (size_t)total, pos);
+}
 
-        for (size_t i = 0; i < to_write; i++) {
-            pipe_data->buffer[pipe_data->write_pos] = ((const uint8_t*)buf)[i];
-            pipe_data->write_pos = (pipe_data->write_pos + 1) % pipe_data->buffer_size;
-        }
+ssize_t sys_read(int fd, void* buf, size_t count) {
+    if (!buf) return -EINVAL;
+    struct iovec iov = { buf, count };
+    return do_readv(fd, &iov, 1, -1);
+}
 
-        pipe_data->data_size += to_write;
-        return to_write;
+ssize_t sys_write(int fd, const void* buf, size_t count) {
+    if (!buf) return -EINVAL;
+    struct iovec iov = { (void*)buf, count };
+    return do_writev(fd, &iov, 1, -1);
+}
+
+ssize_t sys_pread64(int fd, void* buf, size_t count, off_t offset) {
+    if (!buf) return -EINVAL;
+    if (offset < 0) return -EINVAL;
+    struct iovec iov = { buf, count };
+    return do_readv(fd, &iov, 1, offset);
+}
+
+ssize_t sys_pwrite64(int fd, const void* buf, size_t count, off_t offset) {
+    if (!buf) return -EINVAL;
+    if (offset < 0) return -EINVAL;
+    struct iovec iov = { (void*)buf, count };
+    return do_writev(fd, &iov, 1, offset);
+}
+
+ssize_t sys_readv(int fd, const struct iovec* iov, int iovcnt) {
+    return do_readv(fd, iov, iovcnt, -1);
+}
+
+ssize_t sys_writev(int fd, const struct iovec* iov, int iovcnt) {
+    return do_writev(fd, iov, iovcnt, -1);
+}
+
+ssize_t sys_preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset) {
+    if (offset < 0) return -EINVAL;
+    return do_readv(fd, iov, iovcnt, offset);
+}
+
+ssize_t sys_pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset) {
+    if (offset < 0) return -EINVAL;
+    return do_writev(fd, iov, iovcnt, offset);
+}
+
+// Move data between a pipe and another file through the pipe's pages,
+// without a copy to or from user space; between two pipes the pages move
+ssize_t sys_splice(int fd_in, off_t* off_in, int fd_out, off_t* off_out, size_t len, unsigned int flags) {
+    struct file* in = get_file(fd_in);
+    struct file* out = get_file(fd_out);
+    if (!in || !out) return -EBADF;
+    if (in == out) return -EINVAL;
+    if (in->type != FD_TYPE_PIPE && out->type != FD_TYPE_PIPE) return -EINVAL;
+
+    // Pipes have no positions
+    if ((in->type == FD_TYPE_PIPE && off_in) || (out->type == FD_TYPE_PIPE && off_out)) return -ESPIPE;
+    if ((off_in && *off_in < 0) || (off_out && *off_out < 0)) return -EINVAL;
+    off_t pos_in = off_in ? *off_in : -1;
+    off_t pos_out = off_out ? *off_out : -1;
+
+    bool nonblock = (flags & SPLICE_F_NONBLOCK) != 0;
+    ssize_t moved;
+    if (in->type == FD_TYPE_PIPE) {
+        nonblock |= (in->flags & O_NONBLOCK) != 0;
+        moved = pipe_splice_to(in->private_data, out, len, pos_out, nonblock);
+    } else {
+        nonblock |= (out->flags & O_NONBLOCK) != 0;
+        moved = pipe_splice_from(out->private_data, in, len, pos_in, nonblock);
     }
 
-    // Handle network sockets
-    if (fd_table[fd]->type == FD_TYPE_SOCKET) {
-        net_socket* sock = fd_table[fd]->private_data;
-        return net_socket_send(sock->fd, buf, count);
+    if (moved > 0) {
+        if (off_in) *off_in += moved;
+        if (off_out) *off_out += moved;
     }
+    return moved;
+}
+
+// Into a pipe the user pages are shared, not copied; out of one this is
+// a plain read
+ssize_t sys_vmsplice(int fd, const struct iovec* iov, unsigned long nr_segs, unsigned int flags) {
+    struct file* file = get_file(fd);
+    if (!file || file->type != FD_TYPE_PIPE) return -EBADF;
+    if (nr_segs > IOV_MAX) return -EINVAL;
+    ssize_t total = iov_total(iov, (int)nr_segs);
+    if (total < 0) return total;
+
+    bool nonblock = (flags & SPLICE_F_NONBLOCK) || (file->flags & O_NONBLOCK);
+    if (file->flags & O_WRONLY) return pipe_vmsplice(file->private_data, iov, (int)nr_segs, nonblock);
+
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, (int)nr_segs);
+    return pipe_readv(file->private_data, &iter, (size_t)total, nonblock);
+}
 
-    // Handle regular file writes through EXT2
-    if (!ext2_write_file(fd_table[fd]->inode, buf,
-        fd_table[fd]->offset, count)) {
-        return -EIO;
+// Status flags, of which only O_NONBLOCK can change, and pipe capacity
+int sys_fcntl(int fd, int cmd, unsigned long arg) {
+    struct file* file = get_file(fd);
+    if (!file) return -EBADF;
+
+    switch (cmd) {
+        case F_GETFL:
+            return (int)(file->flags & ~O_CLOEXEC);
+        case F_SETFL:
+            file->flags = (file->flags & ~O_NONBLOCK) | ((uint32_t)arg & O_NONBLOCK);
+            return 0;
+        case F_GETPIPE_SZ:
+            if (file->type != FD_TYPE_PIPE) return -EBADF;
+            return (int)pipe_get_size(file->private_data);
+        case F_SETPIPE_SZ:
+            if (file->type != FD_TYPE_PIPE) return -EBADF;
+            return (int)pipe_set_size(file->private_data, arg);
+        default:
+            return -EINVAL;
     }
+}
 
-    fd_table[fd]->offset += count;
-    return count;
+// Copy from a file to any descriptor inside the kernel. Pipes are filled
+// straight from the file; everything else goes through one kernel chunk
+// per SENDFILE_CHUNK bytes, so a socket sends one packet per chunk.
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t* offset, size_t count) {
+    struct file* in = get_file(in_fd);
+    struct file* out = get_file(out_fd);
+    if (!in || !out) return -EBADF;
+    if (in->type != FD_TYPE_FILE) return -EINVAL;
+    if (offset && *offset < 0) return -EINVAL;
+
+    if (out->type == FD_TYPE_PIPE) {
+        if (offset) return sys_splice(in_fd, offset, out_fd, NULL, count, 0);
+
+        // splice() would not move the file offset without one
+        off_t pos = in->offset;
+        ssize_t moved = sys_splice(in_fd, &pos, out_fd, NULL, count, 0);
+        if (moved > 0) in->offset = (uint32_t)pos;
+        return moved;
+    }
+
+    size_t chunk_size = count < SENDFILE_CHUNK ? count : SENDFILE_CHUNK;
+    if (!chunk_size) return 0;
+    void* chunk = malloc(chunk_size);
+    if (!chunk) return -ENOMEM;
+
+    // Read at explicit positions so a short write leaves the offset right
+    off_t pos = offset ? *offset : (off_t)in->offset;
+    size_t done = 0;
+    ssize_t error = 0;
+    while (done < count) {
+        size_t want = count - done < chunk_size ? count - done : chunk_size;
+        struct iovec iov = { chunk, want };
+        ssize_t got = file_readv(in, &iov, 1, want, pos);
+        if (got <= 0) {
+            error = got;
+            break;
+        }
+
+        iov.iov_len = got;
+        ssize_t sent = file_writev(out, &iov, 1, got, -1);
+        if (sent <= 0) {
+            error = sent;
+            break;
+        }
+        done += sent;
+        pos += sent;
+        if (sent < got) break;
+    }
+    free(chunk);
+
+    if (offset) {
+        *offset = pos;
+    } else {
+        in->offset = (uint32_t)pos;
+    }
+    return done ? (ssize_t)done : error;
 }
 
 off_t sys_lseek(int fd, off_t offset, int whence) {
-    if (fd < 0 || fd >= MAX_FDS || !fd_table[fd]) return -EBADF;
+    struct file* file = get_file(fd);
+    if (!file) return -EBADF;
 
     // Cannot seek on pipes or sockets
-    if (fd_table[fd]->type != FD_TYPE_FILE) return -ESPIPE;
-
-    struct ext2_inode* inode = ext2_get_inode(fd_table[fd]->inode);
-    if (!inode) return -EBADF;
+    if (file->type != FD_TYPE_FILE) return -ESPIPE;
 
     off_t new_offset;
     switch (whence) {
@@ -326,68 +575,87 @@ off_t sys_lseek(int fd, off_t offset, int whence) {
             new_offset = offset;
             break;
         case SEEK_CUR:
-            new_offset = fd_table[fd]->offset + offset;
+            new_offset = (off_t)file->offset + offset;
             break;
-        case SEEK_END:
-            new_offset = inode->i_size + offset;
+        case SEEK_END: {
+            if (file->ops) {
+                new_offset = (off_t)file->ops->size(file) + offset;
+                break;
+            }
+            struct ext2_inode* inode = ext2_get_inode(file->inode);
+            if (!inode) return -EBADF;
+            new_offset = (off_t)inode->i_size + offset;
+            ext2_put_inode(inode);
             break;
+        }
         default:
-            free(inode);
             return -EINVAL;
     }
 
-    // Validate new offset
-    if (new_offset < 0 || new_offset > inode->i_size) {
-        free(inode);
+    // Seeking past the end is allowed; a later write extends the file
+    if (new_offset < 0 || new_offset > 0xFFFFFFFFLL) {
         return -EINVAL;
     }
 
-    fd_table[fd]->offset = new_offset;
-    free(inode);
+    file->offset = (uint32_t)new_offset;
     return new_offset;
 }
 
+// The block cache is shared by every file, so this flushes all of it
+int sys_fsync(int fd) {
+    struct file* file = get_file(fd);
+    if (!file) return -EBADF;
+    if (file->type != FD_TYPE_FILE) return -EINVAL;
+    // Memory-only files have nowhere to go
+    if (file->ops) return 0;
+
+    return ext2_sync() ? 0 : -EIO;
+}
+
+int sys_sync(void) {
+    ext2_sync();
+    return 0;
+}
+
 int sys_pipe(int pipefd[2]) {
-    // Create a pipe
-    pipe_t* pipe_buffer = malloc(sizeof(pipe_t));
-    if (!pipe_buffer) return -ENOMEM;
-
-    pipe_buffer->buffer_size = 4096;  // 4KB default
-    pipe_buffer->buffer = malloc(pipe_buffer->buffer_size);
-    if (!pipe_buffer->buffer) {
-        free(pipe_buffer);
+    pipe_t* pipe = pipe_create();
+    if (!pipe) return -ENOMEM;
+
+    // Open files for the read and write ends
+    struct file* read_file = file_alloc();
+    struct file* write_file = file_alloc();
+    if (!read_file || !write_file) {
+        if (read_file) file_put(read_file);
+        if (write_file) file_put(write_file);
+        pipe_destroy(pipe);
         return -ENOMEM;
     }
 
-    pipe_buffer->read_pos = 0;
-    pipe_buffer->write_pos = 0;
-    pipe_buffer->data_size = 0;
+    // From here on the last release frees the pipe
+    pipe_add_reader(pipe);
+    pipe_add_writer(pipe);
+    read_file->type = FD_TYPE_PIPE;
+    read_file->private_data = pipe;
+    read_file->flags = O_RDONLY;
+    read_file->release = pipe_release;
 
-    // Allocate file descriptors for read and write ends
-    int read_fd = alloc_fd();
+    write_file->type = FD_TYPE_PIPE;
+    write_file->private_data = pipe;
+    write_file->flags = O_WRONLY;
+    write_file->release = pipe_release;
+
+    int read_fd = install_file(read_file);
     if (read_fd < 0) {
-        free(pipe_buffer->buffer);
-        free(pipe_buffer);
+        file_put(write_file);
         return read_fd;
     }
 
-    int write_fd = alloc_fd();
+    int write_fd = install_file(write_file);
     if (write_fd < 0) {
-        free_fd(read_fd);
-        free(pipe_buffer->buffer);
-        free(pipe_buffer);
+        sys_close(read_fd);
         return write_fd;
     }
 
-    // Set up file descriptors
-    fd_table[read_fd]->type = FD_TYPE_PIPE;
-    fd_table[read_fd]->private_data = pipe_buffer;
-    fd_table[read_fd]->flags = O_RDONLY;
-
-    fd_table[write_fd]->type = FD_TYPE_PIPE;
-    fd_table[write_fd]->private_data = pipe_buffer;
-    fd_table[write_fd]->flags = O_WRONLY;
-
     pipefd[0] = read_fd;
     pipefd[1] = write_fd;
 
@@ -400,58 +668,70 @@ int sys_pipe2(int pipefd[2], int flags) {
 
     if (flags & O_NONBLOCK) {
         // Set non-blocking mode on both fds
-        fd_table[pipefd[0]]->flags |= O_NONBLOCK;
-        fd_table[pipefd[1]]->flags |= O_NONBLOCK;
+        get_file(pipefd[0])->flags |= O_NONBLOCK;
+        get_file(pipefd[1])->flags |= O_NONBLOCK;
     }
 
     if (flags & O_CLOEXEC) {
         // Set close-on-exec flag on both fds
-        fd_table[pipefd[0]]->flags |= O_CLOEXEC;
-        fd_table[pipefd[1]]->flags |= O_CLOEXEC;
+        get_file(pipefd[0])->flags |= O_CLOEXEC;
+        get_file(pipefd[1])->flags |= O_CLOEXEC;
     }
 
     return 0;
 }
 
+// Both descriptors share the open file, offset included
 int sys_dup(int oldfd) {
-    if (oldfd < 0 || oldfd >= MAX_FDS || !fd_table[oldfd]) return -EBADF;
-
-    int newfd = alloc_fd();
-    if (newfd < 0) return newfd;
+    struct file* file = get_file(oldfd);
+    if (!file) return -EBADF;
 
-    // Copy file descriptor
-    memcpy(fd_table[newfd], fd_table[oldfd], sizeof(file_descriptor_t));
-    fd_table[oldfd]->refcount++;
-
-    return newfd;
+    file_get(file);
+    return install_file(file);
 }
 
 int sys_dup2(int oldfd, int newfd) {
-    // Close newfd if it's open
-    if (newfd >= 0 && newfd < MAX_FDS) {
-        if (fd_table[newfd]) {
-            sys_close(newfd);
-        }
-    }
+    struct file* file = get_file(oldfd);
+    if (!file) return -EBADF;
+    if (oldfd == newfd) return newfd;
+
+    // Replaces and closes whatever newfd referred to
+    file_get(file);
+    int result = fd_install_at(current_files(), newfd, file);
+    if (result < 0) file_put(file);
+    return result;
+}
 
-    // Validate oldfd
-    if (oldfd < 0 || oldfd >= MAX_FDS || !fd_table[oldfd]) return -EBADF;
+int sys_unlink(const char* pathname) {
+    if (!pathname) return -EFAULT;
 
-    if (newfd < 0 || newfd >= MAX_FDS) return -EBADF;
+    const char* rest;
+    void* mount_data;
+    const struct vfs_ops* ops = vfs_resolve(pathname, &rest, &mount_data);
+    if (ops) return ops->unlink(mount_data, rest);
 
-    // Copy file descriptor
-    fd_table[newfd] = malloc(sizeof(file_descriptor_t));
-    if (!fd_table[newfd]) return -ENOMEM;
+    const char* name;
+    uint32_t parent = ext2_lookup_parent(pathname, &name);
+    if (!parent) return -ENOENT;
+    uint32_t name_len = 0;
+    while (name[name_len] && name[name_len] != '/') name_len++;
+    if (!name_len || name[name_len]) return -EISDIR;
 
-    memcpy(fd_table[newfd], fd_table[oldfd], sizeof(file_descriptor_t));
-    fd_table[oldfd]->refcount++;
+    uint32_t inode = ext2_find_entry(parent, name, name_len);
+    if (!inode) return -ENOENT;
+    struct ext2_inode* node = ext2_get_inode(inode);
+    if (!node) return -EIO;
+    bool directory = (node->i_mode & EXT2_S_IFDIR) != 0;
+    ext2_put_inode(node);
+    if (directory) return -EISDIR;
 
-    return newfd;
+    return ext2_delete_file(parent, name) ? 0 : -EIO;
 }
 
 ssize_t sys_getdents(unsigned int fd, struct linux_dirent* dirp, unsigned int count) {
-    if (fd < 0 || fd >= MAX_FDS || !fd_table[fd]) return -EBADF;
-    if (fd_table[fd]->type != FD_TYPE_DIR) return -ENOTDIR;
+    struct file* file = get_file((int)fd);
+    if (!file) return -EBADF;
+    if (file->type != FD_TYPE_DIR) return -ENOTDIR;
 
     // TODO: Implement directory entry reading
     return -ENOSYS;
@@ -497,7 +777,7 @@ void* sys_brk(void* addr) {
 
             if (phys_addr) {
                 vmm_unmap_page((uint64_t)page_addr);
-                pmm_free_page((void*)phys_addr);
+                pmm_page_put((void*)phys_addr);
             }
         }
 
@@ -510,12 +790,34 @@ void* sys_brk(void* addr) {
 void* sys_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
     // Validate inputs
     if (length == 0) return (void*)-EINVAL;
+    if (offset < 0 || (offset & (PAGE_SIZE - 1))) return (void*)-EINVAL;
+
+    process_t* current = get_current_process();
+    if (!current) return (void*)-ESRCH;
 
     // Round length to page size
     length = PAGE_ALIGN(length);
 
+    // File-backed mappings need an open file, writable to share stores
+    uint32_t inode = 0;
+    if (!(flags & MAP_ANONYMOUS)) {
+        struct file* file = get_file(fd);
+        if (!file) return (void*)-EBADF;
+        // Mappings are served by the ext2 page cache
+        if (file->ops || file->type != FD_TYPE_FILE) return (void*)-ENODEV;
+        if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !(file->flags & (O_WRONLY | O_RDWR))) {
+            return (void*)-EACCES;
+        }
+        inode = file->inode;
+    }
+
     // Determine address
     if (!addr) {
+        // Keep large anonymous mappings 2MB aligned so they can use huge pages
+        if ((flags & MAP_ANONYMOUS) && length >= PAGE_SIZE_2M) {
+            next_mmap_addr = (void*)(((uint64_t)next_mmap_addr + PAGE_SIZE_2M - 1) &
+                                     ~(uint64_t)(PAGE_SIZE_2M - 1));
+        }
         addr = next_mmap_addr;
         next_mmap_addr += length;
     }
@@ -527,52 +829,16 @@ void* sys_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t off
     uint64_t page_flags = PTE_PRESENT | PTE_USER;
     if (prot & PROT_WRITE) page_flags |= PTE_WRITABLE;
     if (!(prot & PROT_EXEC)) page_flags |= PTE_NX;
+    // Shared areas map page cache frames as is and stay shared across fork
+    if (flags & MAP_SHARED) page_flags |= PTE_SHARED;
 
-    // Anonymous mapping
-    if (flags & MAP_ANONYMOUS) {
-        for (size_t i = 0; i < length; i += PAGE_SIZE) {
-            void* phys = pmm_alloc_page();
-            if (!phys || !vmm_map_page((uint64_t)addr + i, (uint64_t)phys, page_flags)) {
-                // Rollback mapping on failure
-                for (size_t j = 0; j < i; j += PAGE_SIZE) {
-                    vmm_unmap_page((uint64_t)addr + j);
-                }
-                return (void*)-ENOMEM;
-            }
-            // Zero out the page
-            memset((void*)((uint64_t)addr + i), 0, PAGE_SIZE);
-        }
-    }
-    // File-backed mapping
-    else if (fd >= 0 && fd < MAX_FDS && fd_table[fd]) {
-        struct ext2_inode* inode = ext2_get_inode(fd_table[fd]->inode);
-        if (!inode) return (void*)-EBADF;
-
-        for (size_t i = 0; i < length; i += PAGE_SIZE) {
-            void* phys = pmm_alloc_page();
-            if (!phys || !vmm_map_page((uint64_t)addr + i, (uint64_t)phys, page_flags)) {
-                // Rollback mapping on failure
-                for (size_t j = 0; j < i; j += PAGE_SIZE) {
-                    vmm_unmap_page((uint64_t)addr + j);
-                }
-                free(inode);
-                return (void*)-ENOMEM;
-            }
+    // Replace whatever was mapped there before
+    int result = sys_munmap(addr, length);
+    if (result < 0) return (void*)(int64_t)result;
 
-            // Read file data into the mapped page
-            if (!ext2_read_file(fd_table[fd]->inode,
-                               (void*)((uint64_t)addr + i),
-                               offset + i,
-                               PAGE_SIZE)) {
-                // Rollback mapping on read failure
-                for (size_t j = 0; j < i; j += PAGE_SIZE) {
-                    vmm_unmap_page((uint64_t)addr + j);
-                }
-                free(inode);
-                return (void*)-EIO;
-            }
-        }
-        free(inode);
+    // Pages are populated on first access by vma_handle_fault()
+    if (!vma_create(current->vmas, (uint64_t)addr, length, page_flags, inode, (uint64_t)offset, UINT64_MAX)) {
+        return (void*)-ENOMEM;
     }
 
     return addr;
@@ -585,22 +851,88 @@ int sys_munmap(void* addr, size_t length) {
     // Round length to page size
     length = PAGE_ALIGN(length);
 
-    // Unmap pages
+    // Stores to shared file pages reach the file before the pages go; a
+    // failed write-back is not reported, as with munmap(2)
+    process_t* current = get_current_process();
+    if (current) vma_sync_range(current->vmas, (uint64_t)addr, length);
+
+    // Forget the areas first so nothing repopulates the range
+    if (current && !vma_remove_range(current->vmas, (uint64_t)addr, length)) {
+        return -ENOMEM;
+    }
+
+    // Free the backing pages, then drop the mappings with a single flush
     for (size_t i = 0; i < length; i += PAGE_SIZE) {
-        uint64_t phys_addr = vmm_get_phys_addr((uint64_t)addr + i);
+        uint64_t virt = (uint64_t)addr + i;
+
+        // Lazily populated areas are mostly holes; step over empty 2MB blocks
+        if (!(virt & (PAGE_SIZE_2M - 1)) && length - i >= PAGE_SIZE_2M &&
+            vmm_is_unmapped(virt, PAGE_SIZE_2M)) {
+            i += PAGE_SIZE_2M - PAGE_SIZE;
+            continue;
+        }
+
+        uint64_t phys_addr = vmm_get_phys_addr(virt);
         if (phys_addr) {
-            vmm_unmap_page((uint64_t)addr + i);
-            pmm_free_page((void*)phys_addr);
+            pmm_page_put((void*)(phys_addr & ~(uint64_t)(PAGE_SIZE - 1)));
         }
     }
+    vmm_unmap_range((uint64_t)addr, length);
 
     return 0;
 }
 
-int sys_socket(int domain, int type, int protocol) {
-    int fd = alloc_fd();
-    if (fd < 0) return fd;
+int sys_msync(void* addr, size_t length, int flags) {
+    if ((uint64_t)addr & (PAGE_SIZE - 1)) return -EINVAL;
+    if (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC)) return -EINVAL;
+    if ((flags & MS_ASYNC) && (flags & MS_SYNC)) return -EINVAL;
+
+    process_t* current = get_current_process();
+    if (!current) return -ESRCH;
 
+    // There is no background flusher, so MS_ASYNC writes back now too
+    return vma_sync_range(current->vmas, (uint64_t)addr, PAGE_ALIGN(length)) ? 0 : -EIO;
+}
+
+// Wrap a network stack socket in an open file
+static struct file* socket_file(int sock_fd, net_socket_type sock_type) {
+    struct file* file_desc = file_alloc();
+    net_socket* sock = malloc(sizeof(net_socket));
+    if (!file_desc || !sock) {
+        if (file_desc) file_put(file_desc);
+        free(sock);
+        return NULL;
+    }
+
+    sock->fd = sock_fd;
+    sock->type = sock_type;
+
+    file_desc->type = FD_TYPE_SOCKET;
+    file_desc->private_data = sock;
+    file_desc->flags = O_RDWR;
+    file_desc->release = socket_release;
+    return file_desc;
+}
+
+int file_accept(struct file* listener, struct fd_table* table) {
+    net_socket* sock = listener->private_data;
+    if (!sock || listener->type != FD_TYPE_SOCKET) return -EBADF;
+
+    net_address client;
+    int conn = net_socket_accept_wait(sock->fd, &client);
+    if (conn < 0) return -EINVAL;
+
+    struct file* file = socket_file(conn, sock->type);
+    if (!file) {
+        net_socket_close(conn);
+        return -ENOMEM;
+    }
+    int fd = table ? fd_install(table, file) : -ENOMEM;
+    if (fd < 0) file_put(file);
+    return fd;
+}
+
+int sys_socket(int domain, int type, int protocol) {
     // Convert socket type
     net_socket_type sock_type = SOCKET_TCP;
     switch (type) {
@@ -608,44 +940,29 @@ int sys_socket(int domain, int type, int protocol) {
         case SOCK_DGRAM:  sock_type = SOCKET_UDP; break;
         case SOCK_RAW:    sock_type = SOCKET_RAW; break;
         default:
-            free_fd(fd);
             return -EINVAL;
     }
 
     // Change this to handle potential integer return
     int sock_fd = net_socket_create(sock_type);
-    if (sock_fd < 0) {
-        free_fd(fd);
-        return sock_fd;
-    }
+    if (sock_fd < 0) return sock_fd;
 
-    // Create a net_socket structure manually
-    net_socket* sock = malloc(sizeof(net_socket));
-    if (!sock) {
+    struct file* file_desc = socket_file(sock_fd, sock_type);
+    if (!file_desc) {
         net_socket_close(sock_fd);
-        free_fd(fd);
         return -ENOMEM;
     }
 
-    // Initialize the socket structure
-    sock->fd = sock_fd;
-    sock->type = sock_type;
-    // Initialize other fields as needed
-
-    file_descriptor_t* file_desc = fd_table[fd];
-    file_desc->type = FD_TYPE_SOCKET;
-    file_desc->private_data = sock;
-    file_desc->flags = O_RDWR;
-
-    return fd;
+    return install_file(file_desc);
 }
 
 int sys_connect(int sockfd, const struct sockaddr* addr, uint32_t addrlen) {
     if (!addr || addrlen < sizeof(struct sockaddr_in)) return -EINVAL;
-    if (sockfd < 0 || sockfd >= MAX_FDS || !fd_table[sockfd]) return -EBADF;
+    struct file* file = get_file(sockfd);
+    if (!file) return -EBADF;
 
-    net_socket* sock = fd_table[sockfd]->private_data;
-    if (!sock || fd_table[sockfd]->type != FD_TYPE_SOCKET) return -EBADF;
+    net_socket* sock = file->private_data;
+    if (!sock || file->type != FD_TYPE_SOCKET) return -EBADF;
 
     const struct sockaddr_in* addr_in = (const struct sockaddr_in*)addr;
     return net_socket_connect(sock->fd, addr_in->sin_addr.s_addr, addr_in->sin_port);
@@ -653,26 +970,145 @@ int sys_connect(int sockfd, const struct sockaddr* addr, uint32_t addrlen) {
 
 ssize_t sys_send(int sockfd, const void* buf, size_t len, int flags) {
     if (!buf) return -EINVAL;
-    if (sockfd < 0 || sockfd >= MAX_FDS || !fd_table[sockfd]) return -EBADF;
+    struct file* file = get_file(sockfd);
+    if (!file) return -EBADF;
 
-    net_socket* sock = fd_table[sockfd]->private_data;
-    if (!sock || fd_table[sockfd]->type != FD_TYPE_SOCKET) return -EBADF;
+    net_socket* sock = file->private_data;
+    if (!sock || file->type != FD_TYPE_SOCKET) return -EBADF;
 
-    return net_socket_send(sock->fd, buf, len);
+    uint32_t length = len > 0x7FFFFFFF ? 0x7FFFFFFF : (uint32_t)len;
+    return net_socket_send(sock->fd, buf, length) == 0 ? (ssize_t)length : -EIO;
 }
 
 ssize_t sys_recv(int sockfd, void* buf, size_t len, int flags) {
     if (!buf) return -EINVAL;
-    if (sockfd < 0 || sockfd >= MAX_FDS || !fd_table[sockfd]) return -EBADF;
+    struct file* file = get_file(sockfd);
+    if (!file) return -EBADF;
 
-    net_socket* sock = fd_table[sockfd]->private_data;
-    if (!sock || fd_table[sockfd]->type != FD_TYPE_SOCKET) return -EBADF;
+    net_socket* sock = file->private_data;
+    if (!sock || file->type != FD_TYPE_SOCKET) return -EBADF;
 
     uint16_t received = len;
-    int result = net_socket_receive(sock->fd, buf, &received);
+    int result = net_socket_receive_wait(sock->fd, buf, &received);
     return result == 0 ? received : -EIO;
 }
 
+// Asynchronous I/O rings
+
+static void uring_release(struct file* file) {
+    uring_destroy(file->private_data);
+}
+
+int sys_io_uring_setup(uint32_t entries, struct uring_params* params) {
+    if (!params) return -EFAULT;
+    process_t* current = get_current_process();
+    if (!current || !current_files()) return -ESRCH;
+
+    struct uring* ring = uring_create(entries, params->flags, current);
+    if (!ring) return -EINVAL;
+
+    // Map the region into the program. The pages are shared with the kernel
+    // mapping rather than copied on fork, and each mapping holds a reference.
+    // The area is fully populated, so it only tells munmap() what is there.
+    size_t size;
+    uint8_t* region = uring_region(ring, &size);
+    uint8_t* user = next_mmap_addr;
+    uint64_t page_flags = PTE_PRESENT | PTE_WRITABLE | PTE_USER | PTE_NX | PTE_SHARED;
+    next_mmap_addr += size;
+    if (!vma_create(current->vmas, (uint64_t)user, size, page_flags, 0, 0, UINT64_MAX)) {
+        uring_destroy(ring);
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < size; i += PAGE_SIZE) {
+        uint64_t phys = vmm_get_phys_addr((uint64_t)region + i) & ~(uint64_t)(PAGE_SIZE - 1);
+        pmm_page_get((void*)phys);
+        if (!vmm_map_page((uint64_t)user + i, phys, page_flags)) {
+            pmm_page_put((void*)phys);
+            sys_munmap(user, size);
+            uring_destroy(ring);
+            return -ENOMEM;
+        }
+    }
+
+    struct file* file = file_alloc();
+    if (!file) {
+        sys_munmap(user, size);
+        uring_destroy(ring);
+        return -ENOMEM;
+    }
+    file->type = FD_TYPE_URING;
+    file->private_data = ring;
+    file->flags = O_RDWR;
+    file->release = uring_release;
+
+    struct uring_rings* rings = (struct uring_rings*)region;
+    params->sq_entries = rings->sq_entries;
+    params->cq_entries = rings->cq_entries;
+    params->rings = (uint64_t)user;
+    params->size = size;
+    return install_file(file);
+}
+
+int sys_io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    struct file* file = get_file(fd);
+    if (!file) return -EBADF;
+    if (file->type != FD_TYPE_URING) return -EINVAL;
+    return uring_enter(file->private_data, to_submit, min_complete, flags);
+}
+
+// Readiness notification
+
+int sys_epoll_create1(int flags) {
+    if (flags & ~EPOLL_CLOEXEC) return -EINVAL;
+
+    struct file* file = epoll_create_file();
+    if (!file) return -ENOMEM;
+    if (flags & EPOLL_CLOEXEC) file->flags |= O_CLOEXEC;
+    return install_file(file);
+}
+
+int sys_epoll_create(int size) {
+    // size is only a hint; the instance grows as needed
+    if (size <= 0) return -EINVAL;
+    return sys_epoll_create1(0);
+}
+
+int sys_epoll_ctl(int epfd, int op, int fd, struct epoll_event* event) {
+    struct file* epfile = get_file(epfd);
+    struct file* file = get_file(fd);
+    if (!epfile || !file) return -EBADF;
+    if (epfile == file) return -EINVAL;
+    return epoll_ctl(epfile, op, fd, file, event);
+}
+
+int sys_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout) {
+    struct file* epfile = get_file(epfd);
+    if (!epfile) return -EBADF;
+    return epoll_wait(epfile, events, maxevents, timeout);
+}
+
+// User-space synchronization
+
+long sys_futex(uint32_t* uaddr, int op, uint32_t val, const struct timespec* timeout,
+               uint32_t* uaddr2, uint32_t val3) {
+    bool private = op & FUTEX_PRIVATE_FLAG;
+    // The REQUEUE operations pass a count where the timeout would go
+    uint32_t val2 = (uint32_t)(uint64_t)timeout;
+
+    switch (op & FUTEX_CMD_MASK) {
+        case FUTEX_WAIT:
+            return futex_wait(uaddr, val, timeout, private);
+        case FUTEX_WAKE:
+            return futex_wake(uaddr, val, private);
+        case FUTEX_REQUEUE:
+            return futex_requeue(uaddr, val, val2, uaddr2, false, 0, private);
+        case FUTEX_CMP_REQUEUE:
+            return futex_requeue(uaddr, val, val2, uaddr2, true, val3, private);
+        default:
+            return -ENOSYS;
+    }
+}
+
 // Process management syscalls
 int sys_fork(void) {
     process_t* current = get_current_process();
@@ -686,12 +1122,34 @@ int sys_fork(void) {
 
     if (!child) return -EAGAIN;
 
-    memcpy(child->page_directory, current->page_directory, PAGE_SIZE);
+    // Replace the child's fresh address space with a copy of ours
+    uint64_t address_space = vmm_clone_address_space(current->page_directory);
+    if (!address_space) {
+        process_destroy(child);
+        return -ENOMEM;
+    }
+    vmm_destroy_address_space(child->page_directory);
+    child->page_directory = address_space;
+
+    if (!vdso_fork(address_space, child->pid)) {
+        process_destroy(child);
+        return -ENOMEM;
+    }
+
+    if (!vma_clone_list(current->vmas, child->vmas)) {
+        process_destroy(child);
+        return -ENOMEM;
+    }
+
     memcpy(child->cpu_state, current->cpu_state, sizeof(cpu_state_t));
+    fpu_fork(child, current);
 
-    for (int i = 0; i < MAX_FDS; i++) {
-        if (fd_table[i]) {
-            fd_table[i]->refcount++;
+    // The child shares our open files, offsets included
+    if (current->files) {
+        child->files = fdtable_clone(current->files);
+        if (!child->files) {
+            process_destroy(child);
+            return -ENOMEM;
         }
     }
 
@@ -704,29 +1162,22 @@ int sys_fork(void) {
 int sys_execve(const char* pathname, char* const argv[], char* const envp[]) {
     if (!pathname) return -EINVAL;
 
-    uint32_t inode = ext2_find_file(EXT2_ROOT_INO, pathname);
+    // Programs are loaded through the ext2 page cache
+    const char* rest;
+    void* mount_data;
+    if (vfs_resolve(pathname, &rest, &mount_data)) return -EACCES;
+
+    uint32_t inode = ext2_lookup_path(pathname);
     if (!inode) return -ENOENT;
 
     struct ext2_inode* file_inode = ext2_get_inode(inode);
     if (!file_inode) return -EIO;
+    uint32_t file_size = file_inode->i_size;
+    ext2_put_inode(file_inode);
 
-    void* program_data = malloc(file_inode->i_size);
-    if (!program_data) {
-        free(file_inode);
-        return -ENOMEM;
-    }
-
-    if (!ext2_read_file(inode, program_data, 0, file_inode->i_size)) {
-        free(program_data);
-        free(file_inode);
-        return -EIO;
-    }
-
+    // Segments are read through the page cache as they are touched
     uint64_t entry_point;
-    int result = elf_load_executable(program_data, file_inode->i_size, &entry_point);
-
-    free(program_data);
-    free(file_inode);
+    int result = elf_load_executable(inode, file_size, &entry_point);
 
     if (result != 0) return -ENOEXEC;
 
@@ -744,18 +1195,18 @@ void sys_exit(int status) {
     process_t* current = get_current_process();
     if (!current) return;
 
+    // Shared mappings die with the address space; save their stores
+    vma_sync_range(current->vmas, 0, UINT64_MAX);
+
     // Close all file descriptors
-    for (int i = 0; i < MAX_FDS; i++) {
-        free_fd(i);
-    }
+    fdtable_destroy(current->files);
+    current->files = NULL;
 
     current->state = PROCESS_STATE_TERMINATED;
     scheduler_remove(current);
 
-    process_t* next = scheduler_next();
-    if (next) {
-        process_switch(next);
-    }
+    // Terminated processes are not requeued, so this does not return
+    schedule();
 
     while (1) __asm__ volatile("hlt");
 }
@@ -769,12 +1220,169 @@ int sys_getppid(void) {
     process_t* current = get_current_process();
     if (!current) return -ESRCH;
 
-    // TODO: Implement parent tracking in process structure
-    // For now, return 0
+    // Orphans and kernel-started processes report 0
+    process_t* parent = current->parent;
+    return parent ? (int)parent->pid : 0;
+}
+
+int sys_clock_gettime(int clock, struct timespec* ts) {
+    if (!ts) return -EFAULT;
+
+    uint64_t ns;
+    switch (clock) {
+        case CLOCK_REALTIME:  ns = ktime_get_real_ns(); break;
+        case CLOCK_MONOTONIC: ns = ktime_get_ns(); break;
+        default:
+            return -EINVAL;
+    }
+    ts->tv_sec = (time_t)(ns / NSEC_PER_SEC);
+    ts->tv_nsec = (long)(ns % NSEC_PER_SEC);
+    return 0;
+}
+
+// Nothing interrupts a sleep, so rem always comes back zero
+int sys_nanosleep(const struct timespec* req, struct timespec* rem) {
+    if (!req) return -EFAULT;
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= (long)NSEC_PER_SEC) return -EINVAL;
+
+    // Clamped well short of wrapping the deadline
+    uint64_t sec = (uint64_t)req->tv_sec < UINT32_MAX ? (uint64_t)req->tv_sec : UINT32_MAX;
+    timer_sleep_ns(sec * NSEC_PER_SEC + (uint64_t)req->tv_nsec);
+    if (rem) {
+        rem->tv_sec = 0;
+        rem->tv_nsec = 0;
+    }
     return 0;
 }
 
-// Final syscall handler
+// Dispatch table. syscall_entry indexes it with the call number and calls
+// the entry with the user's argument registers, so each entry only casts.
+#define SYSCALL_ENTRY(name, call)                                               \
+    static long entry_##name(uint64_t arg1, uint64_t arg2, uint64_t arg3,       \
+                             uint64_t arg4, uint64_t arg5, uint64_t arg6) {     \
+        (void)arg1; (void)arg2; (void)arg3; (void)arg4; (void)arg5; (void)arg6; \
+        return (long)(call);                                                    \
+    }
+
+// File operations
+SYSCALL_ENTRY(read, sys_read((int)arg1, (void*)arg2, (size_t)arg3))
+SYSCALL_ENTRY(write, sys_write((int)arg1, (const void*)arg2, (size_t)arg3))
+SYSCALL_ENTRY(open, sys_open((const char*)arg1, (int)arg2, (mode_t)arg3))
+SYSCALL_ENTRY(close, sys_close((int)arg1))
+SYSCALL_ENTRY(lseek, sys_lseek((int)arg1, (off_t)arg2, (int)arg3))
+SYSCALL_ENTRY(fsync, sys_fsync((int)arg1))
+SYSCALL_ENTRY(sync, sys_sync())
+SYSCALL_ENTRY(pread64, sys_pread64((int)arg1, (void*)arg2, (size_t)arg3, (off_t)arg4))
+SYSCALL_ENTRY(pwrite64, sys_pwrite64((int)arg1, (const void*)arg2, (size_t)arg3, (off_t)arg4))
+SYSCALL_ENTRY(readv, sys_readv((int)arg1, (const struct iovec*)arg2, (int)arg3))
+SYSCALL_ENTRY(writev, sys_writev((int)arg1, (const struct iovec*)arg2, (int)arg3))
+SYSCALL_ENTRY(preadv, sys_preadv((int)arg1, (const struct iovec*)arg2, (int)arg3, (off_t)arg4))
+SYSCALL_ENTRY(pwritev, sys_pwritev((int)arg1, (const struct iovec*)arg2, (int)arg3, (off_t)arg4))
+SYSCALL_ENTRY(sendfile, sys_sendfile((int)arg1, (int)arg2, (off_t*)arg3, (size_t)arg4))
+SYSCALL_ENTRY(splice, sys_splice((int)arg1, (off_t*)arg2, (int)arg3, (off_t*)arg4,
+                                 (size_t)arg5, (unsigned int)arg6))
+SYSCALL_ENTRY(vmsplice, sys_vmsplice((int)arg1, (const struct iovec*)arg2, (unsigned long)arg3,
+                                     (unsigned int)arg4))
+SYSCALL_ENTRY(fcntl, sys_fcntl((int)arg1, (int)arg2, (unsigned long)arg3))
+SYSCALL_ENTRY(futex, sys_futex((uint32_t*)arg1, (int)arg2, (uint32_t)arg3,
+                               (const struct timespec*)arg4, (uint32_t*)arg5, (uint32_t)arg6))
+SYSCALL_ENTRY(epoll_create, sys_epoll_create((int)arg1))
+SYSCALL_ENTRY(epoll_create1, sys_epoll_create1((int)arg1))
+SYSCALL_ENTRY(epoll_ctl, sys_epoll_ctl((int)arg1, (int)arg2, (int)arg3, (struct epoll_event*)arg4))
+// No signal delivery yet, so the pwait mask has nothing to block
+SYSCALL_ENTRY(epoll_wait, sys_epoll_wait((int)arg1, (struct epoll_event*)arg2, (int)arg3, (int)arg4))
+SYSCALL_ENTRY(io_uring_setup, sys_io_uring_setup((uint32_t)arg1, (struct uring_params*)arg2))
+SYSCALL_ENTRY(io_uring_enter, sys_io_uring_enter((int)arg1, (uint32_t)arg2, (uint32_t)arg3, (uint32_t)arg4))
+SYSCALL_ENTRY(pipe, sys_pipe((int*)arg1))
+SYSCALL_ENTRY(dup, sys_dup((int)arg1))
+SYSCALL_ENTRY(dup2, sys_dup2((int)arg1, (int)arg2))
+SYSCALL_ENTRY(getdents, sys_getdents((unsigned int)arg1, (struct linux_dirent*)arg2, (unsigned int)arg3))
+SYSCALL_ENTRY(unlink, sys_unlink((const char*)arg1))
+
+// Memory management
+SYSCALL_ENTRY(brk, sys_brk((void*)arg1))
+SYSCALL_ENTRY(mmap, sys_mmap((void*)arg1, (size_t)arg2, (int)arg3, (int)arg4, (int)arg5, (off_t)arg6))
+SYSCALL_ENTRY(munmap, sys_munmap((void*)arg1, (size_t)arg2))
+SYSCALL_ENTRY(msync, sys_msync((void*)arg1, (size_t)arg2, (int)arg3))
+
+// Network operations
+SYSCALL_ENTRY(socket, sys_socket((int)arg1, (int)arg2, (int)arg3))
+SYSCALL_ENTRY(connect, sys_connect((int)arg1, (const struct sockaddr*)arg2, (uint32_t)arg3))
+SYSCALL_ENTRY(send, sys_send((int)arg1, (const void*)arg2, (size_t)arg3, (int)arg4))
+SYSCALL_ENTRY(recv, sys_recv((int)arg1, (void*)arg2, (size_t)arg3, (int)arg4))
+
+// Process management
+SYSCALL_ENTRY(fork, sys_fork())
+SYSCALL_ENTRY(execve, sys_execve((const char*)arg1, (char* const*)arg2, (char* const*)arg3))
+SYSCALL_ENTRY(exit, (sys_exit((int)arg1), 0))
+SYSCALL_ENTRY(getpid, sys_getpid())
+SYSCALL_ENTRY(getppid, sys_getppid())
+SYSCALL_ENTRY(pipe2, sys_pipe2((int*)arg1, (int)arg2))
+
+// Time
+SYSCALL_ENTRY(clock_gettime, sys_clock_gettime((int)arg1, (struct timespec*)arg2))
+SYSCALL_ENTRY(nanosleep, sys_nanosleep((const struct timespec*)arg1, (struct timespec*)arg2))
+
+SYSCALL_ENTRY(ni_syscall, -ENOSYS)
+
+// Unlisted numbers point at entry_ni_syscall once syscalls_init() has run
+syscall_fn_t syscall_table[SYSCALL_MAX] = {
+    [__NR_read]           = entry_read,
+    [__NR_write]          = entry_write,
+    [__NR_open]           = entry_open,
+    [__NR_close]          = entry_close,
+    [__NR_lseek]          = entry_lseek,
+    [__NR_fsync]          = entry_fsync,
+    [__NR_fdatasync]      = entry_fsync,
+    [__NR_sync]           = entry_sync,
+    [__NR_pread64]        = entry_pread64,
+    [__NR_pwrite64]       = entry_pwrite64,
+    [__NR_readv]          = entry_readv,
+    [__NR_writev]         = entry_writev,
+    [__NR_preadv]         = entry_preadv,
+    [__NR_pwritev]        = entry_pwritev,
+    [__NR_sendfile]       = entry_sendfile,
+    [__NR_splice]         = entry_splice,
+    [__NR_vmsplice]       = entry_vmsplice,
+    [__NR_fcntl]          = entry_fcntl,
+    [__NR_futex]          = entry_futex,
+    [__NR_epoll_create]   = entry_epoll_create,
+    [__NR_epoll_create1]  = entry_epoll_create1,
+    [__NR_epoll_ctl]      = entry_epoll_ctl,
+    [__NR_epoll_wait]     = entry_epoll_wait,
+    [__NR_epoll_pwait]    = entry_epoll_wait,
+    [__NR_io_uring_setup] = entry_io_uring_setup,
+    [__NR_io_uring_enter] = entry_io_uring_enter,
+    [__NR_pipe]           = entry_pipe,
+    [__NR_dup]            = entry_dup,
+    [__NR_dup2]           = entry_dup2,
+    [__NR_getdents]       = entry_getdents,
+    [__NR_unlink]         = entry_unlink,
+    [__NR_brk]            = entry_brk,
+    [__NR_mmap]           = entry_mmap,
+    [__NR_munmap]         = entry_munmap,
+    [__NR_msync]          = entry_msync,
+    [__NR_socket]         = entry_socket,
+    [__NR_connect]        = entry_connect,
+    [__NR_send]           = entry_send,
+    [__NR_recv]           = entry_recv,
+    [__NR_fork]           = entry_fork,
+    [__NR_execve]         = entry_execve,
+    [__NR_exit]           = entry_exit,
+    [__NR_getpid]         = entry_getpid,
+    [__NR_getppid]        = entry_getppid,
+    [__NR_pipe2]          = entry_pipe2,
+    [__NR_clock_gettime]  = entry_clock_gettime,
+    [__NR_nanosleep]      = entry_nanosleep,
+};
+
+static void syscall_table_fill(void) {
+    for (uint32_t i = 0; i < SYSCALL_MAX; i++) {
+        if (!syscall_table[i]) syscall_table[i] = entry_ni_syscall;
+    }
+}
+
+// For kernel callers; user space comes in through syscall_entry
 long syscall_handler(long syscall_num,
                     uint64_t arg1,
                     uint64_t arg2,
@@ -782,65 +1390,6 @@ long syscall_handler(long syscall_num,
                     uint64_t arg4,
                     uint64_t arg5,
                     uint64_t arg6) {
-    switch (syscall_num) {
-        // File operations
-        case __NR_read:
-            return sys_read((int)arg1, (void*)arg2, (size_t)arg3);
-        case __NR_write:
-            return sys_write((int)arg1, (const void*)arg2, (size_t)arg3);
-        case __NR_open:
-            return sys_open((const char*)arg1, (int)arg2, (mode_t)arg3);
-        case __NR_close:
-            return sys_close((int)arg1);
-        case __NR_lseek:
-            return sys_lseek((int)arg1, (off_t)arg2, (int)arg3);
-        case __NR_pipe:
-            return sys_pipe((int*)arg1);
-        case __NR_dup:
-            return sys_dup((int)arg1);
-        case __NR_dup2:
-            return sys_dup2((int)arg1, (int)arg2);
-        case __NR_getdents:
-            return sys_getdents((unsigned int)arg1,
-                                (struct linux_dirent*)arg2,
-                                (unsigned int)arg3);
-
-        // Memory management
-        case __NR_brk:
-            return (long)sys_brk((void*)arg1);
-        case __NR_mmap:
-            return (long)sys_mmap((void*)arg1, (size_t)arg2, (int)arg3,
-                                  (int)arg4, (int)arg5, (off_t)arg6);
-        case __NR_munmap:
-            return sys_munmap((void*)arg1, (size_t)arg2);
-
-        // Network operations
-        case __NR_socket:
-            return sys_socket((int)arg1, (int)arg2, (int)arg3);
-        case __NR_connect:
-            return sys_connect((int)arg1, (const struct sockaddr*)arg2, (uint32_t)arg3);
-        case __NR_send:
-            return sys_send((int)arg1, (const void*)arg2, (size_t)arg3, (int)arg4);
-        case __NR_recv:
-            return sys_recv((int)arg1, (void*)arg2, (size_t)arg3, (int)arg4);
-
-        // Process management
-        case __NR_fork:
-            return sys_fork();
-        case __NR_execve:
-            return sys_execve((const char*)arg1, (char* const*)arg2, (char* const*)arg3);
-        case __NR_exit:
-            sys_exit((int)arg1);
-            return 0;
-        case __NR_getpid:
-            return sys_getpid();
-        case __NR_getppid:
-            return sys_getppid();
-        case __NR_pipe2:
-            return sys_pipe2((int*)arg1, (int)arg2);
-
-        // Default case
-        default:
-            return -ENOSYS;
-    }
+    if ((uint64_t)syscall_num >= SYSCALL_MAX) return -ENOSYS;
+    return syscall_table[syscall_num](arg1, arg2, arg3, arg4, arg5, arg6);
 }
\ No newline at end of file
@@ -81,11 +81,31 @@ typedef uint16_t in_port_t;
 #define __NR_exit        60
 #define __NR_wait4       61
 #define __NR_kill        62
+#define __NR_fsync       74
+#define __NR_fdatasync   75
 #define __NR_getdents    78
+#define __NR_unlink      87
+#define __NR_sync        162
 #define __NR_getpid      39
+#define __NR_sendfile    40
+#define __NR_splice      275
+#define __NR_vmsplice    278
+#define __NR_fcntl       72
 #define __NR_getppid     110
 #define __NR_pipe        22
 #define __NR_pipe2       293
+#define __NR_preadv      295
+#define __NR_pwritev     296
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
+#define __NR_epoll_create 213
+#define __NR_epoll_wait  232
+#define __NR_epoll_ctl   233
+#define __NR_epoll_pwait 281
+#define __NR_epoll_create1 291
+#define __NR_futex       202
+#define __NR_clock_gettime 228
+#define __NR_nanosleep   35
 
 // File-related flags
 #define O_RDONLY             00
@@ -110,6 +130,19 @@ typedef uint16_t in_port_t;
 #define SEEK_CUR    1   // Seek from current position
 #define SEEK_END    2   // Seek from end of file
 
+// splice() and vmsplice() flags; pages always move where they can, so
+// MOVE and GIFT change nothing, and MORE is a hint nobody uses
+#define SPLICE_F_MOVE     1
+#define SPLICE_F_NONBLOCK 2
+#define SPLICE_F_MORE     4
+#define SPLICE_F_GIFT     8
+
+// fcntl() commands
+#define F_GETFL         3
+#define F_SETFL         4
+#define F_SETPIPE_SZ    1031
+#define F_GETPIPE_SZ    1032
+
 // File mode (permission) bits
 #define S_IFMT   0170000 // Bit mask for file type
 #define S_IFSOCK 0140000 // Socket
@@ -194,7 +227,9 @@ typedef uint16_t in_port_t;
 #define EPIPE           32   // Broken pipe
 #define EDOM            33   // Math argument out of domain of func
 #define ERANGE          34   // Math result not representable
+#define ENAMETOOLONG    36   // File name too long
 #define ENOSYS          38   //
+#define ETIMEDOUT      110   // Connection or wait timed out
 
 struct in_addr {
     uint32_t s_addr;  // IP address in network byte order
@@ -218,6 +253,14 @@ struct sockaddr_un {
     char sun_path[108];          // Pathname
 };
 
+// Scatter/gather segment for readv() and friends
+#define IOV_MAX 1024
+
+struct iovec {
+    void* iov_base;
+    size_t iov_len;
+};
+
 struct timespec {
     time_t tv_sec;   // Seconds
     long tv_nsec;    // Nanoseconds
@@ -241,6 +284,10 @@ struct timespec {
 #define MAP_FIXED       0x10    // Interpret addr exactly
 #define MAP_ANONYMOUS   0x20    // Don't use a file
 
+#define MS_ASYNC        1       // Schedule write-back (done at once)
+#define MS_INVALIDATE   2       // Drop stale copies (shared mappings have none)
+#define MS_SYNC         4       // Write back before returning
+
 // Signal-related definitions (basic set)
 #define SIGHUP      1   // Hangup
 #define SIGINT      2   // Interrupt
@@ -274,6 +321,33 @@ struct timespec {
 #define SIGPWR      30  // Power failure
 #define SIGSYS      31  // Bad system call
 
+// Descriptor I/O for kernel users such as the uring workers. The segments
+// may be kernel buffers; pos -1 uses and advances the file offset.
+struct file;
+struct fd_table;
+ssize_t file_readv(struct file* file, const struct iovec* iov, int iovcnt, size_t total, off_t pos);
+ssize_t file_writev(struct file* file, const struct iovec* iov, int iovcnt, size_t total, off_t pos);
+// Wait for a connection on a listening socket and install it in table
+int file_accept(struct file* listener, struct fd_table* table);
+// The EPOLL* events file is ready for now. head, if given, is set to where
+// the file announces changes, or NULL if it never waits.
+struct poll_head;
+uint32_t file_poll(struct file* file, struct poll_head** head);
+// Drop the areas and pages of a range of the current process, as munmap(2),
+// writing shared file pages back first
+int sys_munmap(void* addr, size_t length);
+
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+
+// Call numbers at or above this are -ENOSYS; syscall_entry.asm repeats it
+#define SYSCALL_MAX 512
+
+// Every table entry takes the six argument registers as they came in
+typedef long (*syscall_fn_t)(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                             uint64_t arg4, uint64_t arg5, uint64_t arg6);
+extern syscall_fn_t syscall_table[SYSCALL_MAX];
+
 // Syscall declaration for kernel use
 long syscall_handler(long syscall_num,
                     uint64_t arg1,
@@ -0,0 +1,68 @@
+#include <core/time.h>
+#include <core/pit.h>
+#include <core/drivers/rtc/rtc.h>
+#include <utils/asm.h>
+#include <utils/log.h>
+
+#define CALIBRATE_ROUNDS 5     // pit_wait() tops out near 55ms per call
+#define CALIBRATE_MS     10
+#define CLOCK_SHIFT      32
+
+// Used when the RTC reads as unset: January 1, 2024 00:00:00 UTC
+#define DEFAULT_TIMESTAMP 1704067200ULL
+
+static struct clock_params clock = { 0, 0, 1, 0, 0, 0, false };
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+void time_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000007) {
+        cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        clock.invariant = (edx & (1 << 8)) != 0;
+    }
+    if (!clock.invariant) {
+        log_error("time: TSC is not invariant, the clock may drift with frequency changes");
+    }
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < CALIBRATE_ROUNDS; i++) {
+        pit_wait(CALIBRATE_MS);
+    }
+    uint64_t end = rdtsc();
+
+    clock.tsc_hz = (end - start) * 1000 / (CALIBRATE_ROUNDS * CALIBRATE_MS);
+    if (!clock.tsc_hz) clock.tsc_hz = 1;
+    clock.shift = CLOCK_SHIFT;
+    clock.mult = (NSEC_PER_SEC << CLOCK_SHIFT) / clock.tsc_hz;
+    clock.tsc_base = end;
+    clock.ns_base = 0;
+
+    uint64_t rtc = rtc_get_timestamp();
+    if (rtc < DEFAULT_TIMESTAMP) rtc = DEFAULT_TIMESTAMP;
+    clock.wall_offset_ns = rtc * NSEC_PER_SEC;
+
+    log_info("time: TSC at %d kHz", (int)(clock.tsc_hz / 1000));
+}
+
+const struct clock_params* time_clock_params(void) {
+    return &clock;
+}
+
+uint64_t ktime_get_ns(void) {
+    uint64_t delta = rdtsc() - clock.tsc_base;
+    // Another CPU's TSC may trail the one that calibrated by a few cycles
+    if ((int64_t)delta < 0) delta = 0;
+    return clock.ns_base + (uint64_t)(((unsigned __int128)delta * clock.mult) >> clock.shift);
+}
+
+uint64_t ktime_get_real_ns(void) {
+    return ktime_get_ns() + clock.wall_offset_ns;
+}
+
+uint32_t ktime_get_real_seconds(void) {
+    return (uint32_t)(ktime_get_real_ns() / NSEC_PER_SEC);
+}
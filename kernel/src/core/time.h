@@ -0,0 +1,29 @@
+#ifndef TIME_H
+#define TIME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+
+// TSC to nanoseconds: ns = ns_base + ((tsc - tsc_base) * mult >> shift).
+// The RTC is read once; wall time is the monotonic clock plus wall_offset_ns.
+struct clock_params {
+    uint64_t tsc_base;
+    uint64_t ns_base;
+    uint64_t mult;
+    uint32_t shift;
+    uint64_t wall_offset_ns;
+    uint64_t tsc_hz;
+    bool invariant;          // TSC rate holds across P-/C-states
+};
+
+// Calibrate the TSC against the PIT and take the wall clock from the RTC
+void time_init(void);
+const struct clock_params* time_clock_params(void);
+
+uint64_t ktime_get_ns(void);            // Monotonic, since time_init()
+uint64_t ktime_get_real_ns(void);       // Unix time
+uint32_t ktime_get_real_seconds(void);
+
+#endif // TIME_H
@@ -0,0 +1,289 @@
+#include <core/timer.h>
+#include <core/wait.h>
+#include <core/time.h>
+#include <core/smp.h>
+#include <core/idt.h>
+#include <core/drivers/lapic.h>
+#include <utils/mem.h>
+#include <utils/asm.h>
+
+#define SLOTS        (TIMER_LEVELS * TIMER_LEVEL_SIZE)
+#define SLOT_MASK    (TIMER_LEVEL_SIZE - 1)
+#define NO_DEADLINE  UINT64_MAX
+
+// The furthest tick a timer is filed under; later ones are refiled when
+// they get there, so the top level never wraps onto itself
+#define MAX_DELTA    ((uint64_t)SLOT_MASK << (TIMER_LEVEL_BITS * (TIMER_LEVELS - 1)))
+
+// Longest one-shot, well inside what the LAPIC counter holds at any bus clock
+#define MAX_ARM_US   10000000
+
+struct timer_base {
+    spinlock_t lock;
+    uint64_t clk;                       // Tick the wheel has run up to
+    uint32_t pending;                   // Queued timers
+    uint64_t occupied[TIMER_LEVELS];    // Bit per non-empty slot
+    struct timer* slots[SLOTS];
+    struct timer* volatile running;     // Callback in progress, run unlocked
+    uint64_t slice_deadline;            // End of the running slice, ns
+    uint64_t armed;                     // What the LAPIC is set for, ns
+};
+
+// Allocated by timer_init_cpu()
+static struct timer_base* bases[MAX_CPUS];
+
+static inline uint32_t level_shift(uint32_t level) {
+    return level * TIMER_LEVEL_BITS;
+}
+
+// File a timer under the lowest level whose slots still tell its tick
+// apart from clk, at earliest on tick earliest. Base lock held.
+static void enqueue(struct timer_base* base, struct timer* timer, uint64_t earliest) {
+    uint64_t tick = (timer->expires + TIMER_TICK_NS - 1) >> TIMER_TICK_SHIFT;
+    if (tick < earliest) tick = earliest;
+    if (tick - base->clk >= MAX_DELTA) tick = base->clk + MAX_DELTA - 1;
+
+    uint32_t level = 0;
+    while ((tick >> level_shift(level)) - (base->clk >> level_shift(level)) >= TIMER_LEVEL_SIZE) level++;
+    uint32_t index = (uint32_t)(tick >> level_shift(level)) & SLOT_MASK;
+    uint32_t slot = level * TIMER_LEVEL_SIZE + index;
+
+    timer->slot = (uint16_t)slot;
+    timer->next = base->slots[slot];
+    if (timer->next) timer->next->pprev = &timer->next;
+    timer->pprev = &base->slots[slot];
+    base->slots[slot] = timer;
+    base->occupied[level] |= 1ULL << index;
+}
+
+static void unlink(struct timer_base* base, struct timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    if (!base->slots[timer->slot]) {
+        base->occupied[timer->slot / TIMER_LEVEL_SIZE] &= ~(1ULL << (timer->slot & SLOT_MASK));
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// First tick at which a level 0 slot is due or a higher slot drops a
+// level, from the occupancy bitmaps alone; NO_DEADLINE if nothing is queued
+static uint64_t next_event(struct timer_base* base) {
+    uint64_t next = NO_DEADLINE;
+    if (!base->pending) return next;
+
+    for (uint32_t level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t bits = base->occupied[level];
+        if (!bits) continue;
+
+        uint64_t pos = base->clk >> level_shift(level);
+        uint32_t index = (uint32_t)pos & SLOT_MASK;
+        if (index) bits = (bits >> index) | (bits << (TIMER_LEVEL_SIZE - index));
+        uint64_t tick = (pos + (uint64_t)__builtin_ctzll(bits)) << level_shift(level);
+        if (tick < base->clk) tick = base->clk;
+        if (tick < next) next = tick;
+    }
+    return next;
+}
+
+// Point the LAPIC at the sooner of the slice end and the next timer. Base
+// lock held, on the base's own CPU.
+static void program(struct timer_base* base, uint64_t now) {
+    uint64_t deadline = base->slice_deadline;
+    uint64_t tick = next_event(base);
+    if (tick != NO_DEADLINE && (tick << TIMER_TICK_SHIFT) < deadline) deadline = tick << TIMER_TICK_SHIFT;
+
+    base->armed = deadline;
+    if (deadline == NO_DEADLINE) {
+        lapic_timer_stop();
+        return;
+    }
+    uint64_t us = deadline > now ? (deadline - now + 999) / 1000 : 1;
+    lapic_timer_oneshot(INT_LAPIC_TIMER, us < MAX_ARM_US ? us : MAX_ARM_US);
+}
+
+// Lock the base the timer is on; it may move while we wait for the lock
+static struct timer_base* lock_timer_base(struct timer* timer) {
+    for (;;) {
+        uint32_t cpu = timer->cpu;
+        struct timer_base* base = bases[cpu];
+        if (!base) return NULL;
+        spinlock_acquire(&base->lock);
+        if (timer->cpu == cpu) return base;
+        spinlock_release(&base->lock);
+    }
+}
+
+void timer_init(struct timer* timer, timer_func_t func) {
+    memset(timer, 0, sizeof(struct timer));
+    timer->func = func;
+}
+
+void add_timer(struct timer* timer) {
+    mod_timer(timer, timer->expires);
+}
+
+bool mod_timer(struct timer* timer, uint64_t expires) {
+    uint64_t flags = irq_save();
+    uint32_t self = smp_get_current_cpu();
+    struct timer_base* local = bases[self];
+    if (!local) {
+        irq_restore(flags);
+        return false;
+    }
+
+    // Both wheels locked in address order, so the move is atomic
+    struct timer_base* old;
+    for (;;) {
+        uint32_t cpu = timer->cpu;
+        old = bases[cpu] ? bases[cpu] : local;
+        struct timer_base* first = old < local ? old : local;
+        struct timer_base* second = old < local ? local : old;
+        spinlock_acquire(&first->lock);
+        if (second != first) spinlock_acquire(&second->lock);
+        if (timer->cpu == cpu) break;
+        if (second != first) spinlock_release(&second->lock);
+        spinlock_release(&first->lock);
+    }
+
+    bool was_pending = timer_pending(timer);
+    if (was_pending) {
+        unlink(old, timer);
+        old->pending--;
+    }
+
+    // A callback running on the old wheel expects to find it there
+    struct timer_base* target = old->running == timer ? old : local;
+    uint64_t now = ktime_get_ns();
+    if (!target->pending && target->clk < (now >> TIMER_TICK_SHIFT)) target->clk = now >> TIMER_TICK_SHIFT;
+    timer->expires = expires;
+    enqueue(target, timer, target->clk + 1);
+    target->pending++;
+    timer->cpu = target == local ? self : timer->cpu;
+
+    if (target == local && expires < local->armed) program(local, now);
+    if (old != local) spinlock_release(&old->lock);
+    spinlock_release(&local->lock);
+    irq_restore(flags);
+    return was_pending;
+}
+
+bool del_timer(struct timer* timer) {
+    uint64_t flags = irq_save();
+    struct timer_base* base = lock_timer_base(timer);
+    bool was_pending = base && timer_pending(timer);
+    if (was_pending) {
+        unlink(base, timer);
+        base->pending--;
+    }
+    if (base) spinlock_release(&base->lock);
+    irq_restore(flags);
+    return was_pending;
+}
+
+bool del_timer_sync(struct timer* timer) {
+    bool was_pending = false;
+    for (;;) {
+        if (del_timer(timer)) was_pending = true;
+        struct timer_base* base = bases[timer->cpu];
+        if (!base || base->running != timer) return was_pending;
+        __asm__ volatile("pause");
+    }
+}
+
+// Drop every slot that starts at clk down a level, then run level 0's.
+// Base lock held, dropped around each callback.
+static void run_tick(struct timer_base* base, uint64_t now) {
+    for (uint32_t level = 1; level < TIMER_LEVELS; level++) {
+        if (base->clk & ((1ULL << level_shift(level)) - 1)) break;
+        uint32_t slot = level * TIMER_LEVEL_SIZE + ((uint32_t)(base->clk >> level_shift(level)) & SLOT_MASK);
+        while (base->slots[slot]) {
+            struct timer* timer = base->slots[slot];
+            unlink(base, timer);
+            enqueue(base, timer, base->clk);
+        }
+    }
+
+    uint32_t slot = (uint32_t)base->clk & SLOT_MASK;
+    while (base->slots[slot]) {
+        struct timer* timer = base->slots[slot];
+        unlink(base, timer);
+
+        // Only timers clamped to the top level get here early
+        if (timer->expires > now) {
+            enqueue(base, timer, base->clk + 1);
+            continue;
+        }
+
+        base->pending--;
+        base->running = timer;
+        spinlock_release(&base->lock);
+        timer->func(timer);
+        spinlock_acquire(&base->lock);
+        base->running = NULL;
+    }
+}
+
+void timer_interrupt(void) {
+    struct timer_base* base = bases[smp_get_current_cpu()];
+    if (!base) return;
+
+    spinlock_acquire(&base->lock);
+    uint64_t now = ktime_get_ns();
+    if (base->slice_deadline <= now) base->slice_deadline = NO_DEADLINE;
+
+    // Jump from event to event instead of walking every tick in between
+    uint64_t now_tick = now >> TIMER_TICK_SHIFT;
+    for (;;) {
+        uint64_t tick = next_event(base);
+        if (tick > now_tick) break;
+        base->clk = tick;
+        run_tick(base, now);
+    }
+    if (base->clk < now_tick) base->clk = now_tick;
+
+    program(base, ktime_get_ns());
+    spinlock_release(&base->lock);
+}
+
+void timer_set_slice(uint64_t us) {
+    uint64_t flags = irq_save();
+    struct timer_base* base = bases[smp_get_current_cpu()];
+    if (!base) {
+        if (us) lapic_timer_oneshot(INT_LAPIC_TIMER, us);
+        else lapic_timer_stop();
+        irq_restore(flags);
+        return;
+    }
+
+    spinlock_acquire(&base->lock);
+    uint64_t now = ktime_get_ns();
+    base->slice_deadline = us ? now + us * 1000 : NO_DEADLINE;
+    program(base, now);
+    spinlock_release(&base->lock);
+    irq_restore(flags);
+}
+
+void timer_init_cpu(void) {
+    uint32_t cpu = smp_get_current_cpu();
+    if (bases[cpu]) return;
+
+    struct timer_base* base = malloc(sizeof(struct timer_base));
+    if (!base) return;
+    memset(base, 0, sizeof(struct timer_base));
+    spinlock_init(&base->lock);
+    base->clk = ktime_get_ns() >> TIMER_TICK_SHIFT;
+    base->slice_deadline = NO_DEADLINE;
+    base->armed = NO_DEADLINE;
+    __atomic_store_n(&bases[cpu], base, __ATOMIC_RELEASE);
+}
+
+void timer_sleep_until(uint64_t deadline) {
+    struct wait_queue wq = WAIT_QUEUE_INIT;
+    wait_event_deadline(&wq, false, deadline);
+}
+
+void timer_sleep_ns(uint64_t ns) {
+    uint64_t now = ktime_get_ns();
+    timer_sleep_until(ns < UINT64_MAX - now ? now + ns : UINT64_MAX);
+}
@@ -0,0 +1,69 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Kernel timers on a hierarchical wheel per CPU. Level 0 has 64 slots one
+// tick wide; every level above has 64 slots, each 64 times wider than the
+// slots of the level below, and a timer drops a level when its slot comes
+// up. Every timer then fires within a tick of its deadline, however far out
+// it was set, and queuing, moving and removing one are O(1). Each CPU arms
+// its LAPIC one-shot for the earlier of its next timer and the end of the
+// running slice, so there is still no periodic tick.
+
+#define TIMER_TICK_SHIFT  14                        // 16.4us ticks
+#define TIMER_TICK_NS     (1ULL << TIMER_TICK_SHIFT)
+#define TIMER_LEVEL_BITS  6
+#define TIMER_LEVEL_SIZE  (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS      6                         // Reach 2^50ns, 13 days; later timers wait at the top
+
+struct timer;
+typedef void (*timer_func_t)(struct timer* timer);
+
+struct timer {
+    struct timer* next;         // In its wheel slot
+    struct timer** pprev;       // NULL while not queued
+    uint64_t expires;           // ktime_get_ns() deadline
+    timer_func_t func;          // Runs with interrupts off on the CPU the timer is queued on
+    volatile uint32_t cpu;      // Wheel it is queued on or last ran from
+    uint16_t slot;              // Level * TIMER_LEVEL_SIZE + index, while queued
+};
+
+#define TIMER_INIT(fn) { NULL, NULL, 0, (fn), 0, 0 }
+
+void timer_init(struct timer* timer, timer_func_t func);
+
+// Queue the timer for timer->expires on this CPU. A deadline already past
+// fires on the next tick.
+void add_timer(struct timer* timer);
+// Set a new deadline and queue the timer on this CPU, or leave it on the
+// CPU running its callback; true if it was queued before
+bool mod_timer(struct timer* timer, uint64_t expires);
+// Take the timer off its wheel; true if it was queued. Its callback may
+// still be running on another CPU.
+bool del_timer(struct timer* timer);
+// The same, then wait for a running callback to return. Not from the
+// callback itself.
+bool del_timer_sync(struct timer* timer);
+
+static inline bool timer_pending(const struct timer* timer) {
+    return timer->pprev != NULL;
+}
+
+// Block until deadline (ktime_get_ns()), or for ns. Without a process to
+// block, as in early boot, this spins on the clock instead.
+void timer_sleep_until(uint64_t deadline);
+void timer_sleep_ns(uint64_t ns);
+
+// For the scheduler. Every CPU calls timer_init_cpu() once; the wheel
+// cannot take timers before that, and waits with deadlines spin until then.
+void timer_init_cpu(void);
+// Fire the LAPIC at the end of the running slice, us from now, as well as
+// for timers; 0 when the CPU goes idle
+void timer_set_slice(uint64_t us);
+// Run the due timers and rearm, from the LAPIC timer interrupt
+void timer_interrupt(void);
+
+#endif // TIMER_H
@@ -0,0 +1,305 @@
+#include <core/uring.h>
+#include <core/process.h>
+#include <core/syscalls.h>
+#include <core/wait.h>
+#include <core/time.h>
+#include <fs/file.h>
+#include <fs/ext2.h>
+#include <mm/vmm.h>
+#include <mm/vma.h>
+#include <mm/vmalloc.h>
+#include <mm/pmm.h>
+#include <utils/mem.h>
+#include <utils/log.h>
+
+struct uring {
+    spinlock_t lock;                // Orders SQ consumption and CQ posting among workers
+    struct uring_rings* rings;      // Kernel view of the shared region
+    struct uring_sqe* sqes;
+    struct uring_cqe* cqes;
+    size_t size;
+    uint32_t flags;
+    process_t* owner;
+    struct fd_table* files;         // The owner's, referenced so it outlives the owner's exit
+    process_t* workers[URING_WORKERS];
+    volatile uint32_t live_workers;
+    volatile uint32_t refs;         // The ring file and each live worker
+    volatile bool dying;
+    struct wait_queue sq_wait;      // Workers waiting for SQEs
+    struct wait_queue cq_wait;      // enter() waiting for completions
+    struct wait_queue exit_wait;    // uring_destroy() waiting for the workers
+};
+
+static inline bool sq_pending(struct uring* ring) {
+    return __atomic_load_n(&ring->rings->sq_tail, __ATOMIC_ACQUIRE) != ring->rings->sq_head;
+}
+
+static inline uint32_t cq_ready(struct uring* ring) {
+    return __atomic_load_n(&ring->rings->cq_tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&ring->rings->cq_head, __ATOMIC_ACQUIRE);
+}
+
+// Take the next SQE, copied so the program may reuse its slot at once
+static bool sq_pop(struct uring* ring, struct uring_sqe* sqe) {
+    uint64_t flags = spinlock_acquire_irqsave(&ring->lock);
+    struct uring_rings* rings = ring->rings;
+    uint32_t head = rings->sq_head;
+    bool found = head != __atomic_load_n(&rings->sq_tail, __ATOMIC_ACQUIRE);
+    if (found) {
+        *sqe = ring->sqes[head & rings->sq_mask];
+        __atomic_store_n(&rings->sq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    spinlock_release_irqrestore(&ring->lock, flags);
+    return found;
+}
+
+static void cq_post(struct uring* ring, uint64_t user_data, int32_t res) {
+    uint64_t flags = spinlock_acquire_irqsave(&ring->lock);
+    struct uring_rings* rings = ring->rings;
+    uint32_t tail = rings->cq_tail;
+    if (tail - __atomic_load_n(&rings->cq_head, __ATOMIC_ACQUIRE) >= rings->cq_entries) {
+        rings->cq_overflow++;
+    } else {
+        struct uring_cqe* cqe = &ring->cqes[tail & rings->cq_mask];
+        cqe->user_data = user_data;
+        cqe->res = res;
+        cqe->flags = 0;
+        __atomic_store_n(&rings->cq_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    spinlock_release_irqrestore(&ring->lock, flags);
+    wait_queue_wake_all(&ring->cq_wait);
+}
+
+// The worker sleeps until the deadline or until the ring goes away
+static int32_t op_timeout(struct uring* ring, const struct uring_sqe* sqe) {
+    const struct timespec* ts = (const struct timespec*)sqe->addr;
+    if (!ts || ts->tv_sec < 0 || ts->tv_nsec < 0) return -EINVAL;
+
+    uint64_t deadline = ktime_get_ns() + (uint64_t)ts->tv_sec * 1000000000ULL + (uint64_t)ts->tv_nsec;
+    wait_event_deadline(&ring->sq_wait, ring->dying, deadline);
+    return -ETIME;
+}
+
+static int32_t execute(struct uring* ring, const struct uring_sqe* sqe) {
+    switch (sqe->opcode) {
+        case URING_OP_NOP:
+            return 0;
+        case URING_OP_TIMEOUT:
+            return op_timeout(ring, sqe);
+        default:
+            break;
+    }
+
+    // Held across the operation so a racing close() cannot free the file
+    struct file* file = fd_get_ref(ring->files, sqe->fd);
+    if (!file) return -EBADF;
+
+    struct iovec iov = { (void*)sqe->addr, sqe->len };
+    off_t pos = sqe->off == (uint64_t)-1 ? -1 : (off_t)sqe->off;
+    int32_t res;
+    switch (sqe->opcode) {
+        case URING_OP_READ:
+            res = (int32_t)file_readv(file, &iov, 1, sqe->len, pos);
+            break;
+        case URING_OP_WRITE:
+            res = (int32_t)file_writev(file, &iov, 1, sqe->len, pos);
+            break;
+        case URING_OP_SEND:
+            res = file->type == FD_TYPE_SOCKET ? (int32_t)file_writev(file, &iov, 1, sqe->len, -1) : -EINVAL;
+            break;
+        case URING_OP_RECV:
+            res = file->type == FD_TYPE_SOCKET ? (int32_t)file_readv(file, &iov, 1, sqe->len, -1) : -EINVAL;
+            break;
+        case URING_OP_ACCEPT:
+            res = file_accept(file, ring->files);
+            break;
+        case URING_OP_FSYNC:
+            if (file->type != FD_TYPE_FILE) {
+                res = -EINVAL;
+            } else {
+                res = ext2_sync() ? 0 : -EIO;
+            }
+            break;
+        default:
+            res = -EINVAL;
+            break;
+    }
+    file_put(file);
+    return res;
+}
+
+// With SQPOLL the first worker keeps polling for a while after running dry
+// so a busy program never has to enter to submit
+static void sq_poll_idle(struct uring* ring) {
+    uint64_t deadline = ktime_get_ns() + (uint64_t)URING_SQPOLL_IDLE_US * 1000;
+    while (!sq_pending(ring) && !ring->dying && ktime_get_ns() < deadline) {
+        schedule();
+    }
+    if (sq_pending(ring) || ring->dying) return;
+
+    // Tell the program to wake us, then look once more so a submission
+    // racing with the flag is not missed
+    __atomic_or_fetch(&ring->rings->sq_flags, URING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+    wait_event(&ring->sq_wait, sq_pending(ring) || ring->dying);
+    __atomic_and_fetch(&ring->rings->sq_flags, ~URING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+}
+
+static void uring_put(struct uring* ring) {
+    if (__atomic_sub_fetch(&ring->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    // Pages stay alive while the program still has them mapped
+    fdtable_put(ring->files);
+    vfree(ring->rings);
+    free(ring);
+}
+
+static void uring_worker_main(void) {
+    process_t* self = get_current_process();
+    struct uring* ring = self->worker_data;
+    bool poller = (ring->flags & URING_SETUP_SQPOLL) && ring->workers[0] == self;
+
+    for (;;) {
+        struct uring_sqe sqe;
+        if (sq_pop(ring, &sqe)) {
+            cq_post(ring, sqe.user_data, execute(ring, &sqe));
+            continue;
+        }
+        if (ring->dying) break;
+
+        if (poller) {
+            sq_poll_idle(ring);
+        } else {
+            wait_event(&ring->sq_wait, sq_pending(ring) || ring->dying);
+        }
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&ring->lock);
+    ring->live_workers--;
+    spinlock_release_irqrestore(&ring->lock, flags);
+    wait_queue_wake_all(&ring->exit_wait);
+    uring_put(ring);
+
+    // Leave the owner's address space, whose last user may now be us
+    uint64_t space = self->page_directory;
+    self->page_directory = vmm_kernel_address_space();
+    vmm_destroy_address_space(space);
+    struct vma_list* vmas = self->vmas;
+    self->vmas = NULL;
+    vma_list_put(vmas);
+
+    self->state = PROCESS_STATE_TERMINATED;
+    scheduler_remove(self);
+    schedule();
+    for (;;) asm volatile("hlt");
+}
+
+struct uring* uring_create(uint32_t entries, uint32_t flags, process_t* owner) {
+    if (!owner || entries == 0 || entries > URING_MAX_ENTRIES) return NULL;
+    if (flags & ~URING_SETUP_SQPOLL) return NULL;
+
+    uint32_t sq_entries = 1;
+    while (sq_entries < entries) sq_entries <<= 1;
+    uint32_t cq_entries = sq_entries * 2;
+
+    struct uring* ring = malloc(sizeof(struct uring));
+    if (!ring) return NULL;
+    memset(ring, 0, sizeof(struct uring));
+
+    size_t sqe_offset = (sizeof(struct uring_rings) + 63) & ~(size_t)63;
+    size_t cqe_offset = sqe_offset + sq_entries * sizeof(struct uring_sqe);
+    ring->size = PAGE_ALIGN(cqe_offset + cq_entries * sizeof(struct uring_cqe));
+    ring->rings = vmalloc(ring->size);
+    if (!ring->rings) {
+        free(ring);
+        return NULL;
+    }
+    memset(ring->rings, 0, ring->size);
+
+    ring->rings->sq_entries = sq_entries;
+    ring->rings->sq_mask = sq_entries - 1;
+    ring->rings->cq_entries = cq_entries;
+    ring->rings->cq_mask = cq_entries - 1;
+    ring->rings->sqe_offset = (uint32_t)sqe_offset;
+    ring->rings->cqe_offset = (uint32_t)cqe_offset;
+    ring->sqes = (struct uring_sqe*)((uint8_t*)ring->rings + sqe_offset);
+    ring->cqes = (struct uring_cqe*)((uint8_t*)ring->rings + cqe_offset);
+    ring->flags = flags;
+    ring->owner = owner;
+    ring->files = owner->files;
+    fdtable_get(ring->files);
+    spinlock_init(&ring->lock);
+    wait_queue_init(&ring->sq_wait);
+    wait_queue_init(&ring->cq_wait);
+    wait_queue_init(&ring->exit_wait);
+
+    // Workers run in the owner's address space so user buffers resolve,
+    // lazy ones through the owner's areas, each holding a reference to
+    // both so exit() cannot free them under them
+    for (uint32_t i = 0; i < URING_WORKERS; i++) {
+        process_t* worker = process_create(uring_worker_main, owner->priority, "uring");
+        if (!worker) break;
+        vmm_destroy_address_space(worker->page_directory);
+        vmm_address_space_get(owner->page_directory);
+        worker->page_directory = owner->page_directory;
+        vma_list_put(worker->vmas);
+        vma_list_get(owner->vmas);
+        worker->vmas = owner->vmas;
+        worker->worker_data = ring;
+        ring->workers[i] = worker;
+        ring->live_workers++;
+    }
+    ring->refs = ring->live_workers + 1;
+    if (!ring->live_workers) {
+        fdtable_put(ring->files);
+        vfree(ring->rings);
+        free(ring);
+        return NULL;
+    }
+
+    // Started only once every worker is recorded, for the poller check
+    for (uint32_t i = 0; i < URING_WORKERS; i++) {
+        if (ring->workers[i]) scheduler_add(ring->workers[i]);
+    }
+    return ring;
+}
+
+void uring_destroy(struct uring* ring) {
+    if (!ring) return;
+
+    ring->dying = true;
+    wait_queue_wake_all(&ring->sq_wait);
+    wait_queue_wake_all(&ring->cq_wait);
+
+    // The last file reference may be dropped by a worker finishing an
+    // operation on the ring's own fd; it must not wait for itself
+    process_t* self = get_current_process();
+    bool worker = false;
+    for (uint32_t i = 0; i < URING_WORKERS; i++) {
+        if (ring->workers[i] && ring->workers[i] == self) worker = true;
+    }
+    if (!worker) wait_event(&ring->exit_wait, ring->live_workers == 0);
+    uring_put(ring);
+}
+
+void* uring_region(struct uring* ring, size_t* size) {
+    *size = ring->size;
+    return ring->rings;
+}
+
+int uring_enter(struct uring* ring, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    struct uring_rings* rings = ring->rings;
+    uint32_t queued = __atomic_load_n(&rings->sq_tail, __ATOMIC_ACQUIRE) -
+                      __atomic_load_n(&rings->sq_head, __ATOMIC_ACQUIRE);
+    if (queued > rings->sq_entries) return -EINVAL;  // The program corrupted sq_tail
+    uint32_t submitted = queued < to_submit ? queued : to_submit;
+
+    // A polling worker only needs a kick once it has gone to sleep
+    if (!(ring->flags & URING_SETUP_SQPOLL) || (flags & URING_ENTER_SQ_WAKEUP)) {
+        if (queued) wait_queue_wake_all(&ring->sq_wait);
+    }
+
+    if (flags & URING_ENTER_GETEVENTS) {
+        if (min_complete > rings->cq_entries) min_complete = rings->cq_entries;
+        wait_event(&ring->cq_wait, cq_ready(ring) >= min_complete || ring->dying);
+    }
+    return (int)submitted;
+}
@@ -0,0 +1,100 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Asynchronous I/O through rings shared with user space. The program
+// queues SQEs and bumps sq_tail; kernel workers consume them and post a
+// CQE per operation, which the program reaps by advancing cq_head.
+
+#define URING_MAX_ENTRIES    4096
+#define URING_WORKERS        4      // Operations run concurrently per ring
+#define URING_SQPOLL_IDLE_US 2000   // Polling worker spins this long before sleeping
+
+// Setup flags
+#define URING_SETUP_SQPOLL    (1U << 0)   // A worker polls the SQ; enter only to wake it
+
+// Enter flags
+#define URING_ENTER_GETEVENTS (1U << 0)   // Wait for min_complete completions
+#define URING_ENTER_SQ_WAKEUP (1U << 1)   // Wake a sleeping SQ poller
+
+// sq_flags
+#define URING_SQ_NEED_WAKEUP  (1U << 0)   // The poller sleeps until the next enter
+
+typedef enum {
+    URING_OP_NOP,
+    URING_OP_READ,      // fd, addr, len, off (-1 for the file offset)
+    URING_OP_WRITE,
+    URING_OP_SEND,      // fd, addr, len
+    URING_OP_RECV,
+    URING_OP_ACCEPT,    // fd; res is the new descriptor
+    URING_OP_FSYNC,     // fd
+    URING_OP_TIMEOUT    // addr: struct timespec; res is -ETIME
+} uring_op_t;
+
+#define ETIME 62    // Timer expired
+
+struct uring_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t ioprio;
+    int32_t fd;
+    uint64_t off;
+    uint64_t addr;
+    uint32_t len;
+    uint32_t op_flags;
+    uint64_t user_data;     // Copied to the CQE
+    uint64_t reserved[3];
+};
+
+struct uring_cqe {
+    uint64_t user_data;
+    int32_t res;            // Result or negative errno
+    uint32_t flags;
+};
+
+// Start of the shared region, followed by the SQE and CQE arrays
+struct uring_rings {
+    volatile uint32_t sq_head;      // Written by the kernel
+    volatile uint32_t sq_tail;      // Written by the program
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    volatile uint32_t sq_flags;
+    volatile uint32_t cq_head;      // Written by the program
+    volatile uint32_t cq_tail;      // Written by the kernel
+    uint32_t cq_mask;
+    uint32_t cq_entries;
+    volatile uint32_t cq_overflow;  // Completions dropped on a full CQ
+    uint32_t sqe_offset;            // From the start of the region
+    uint32_t cqe_offset;
+};
+
+// Filled in by io_uring_setup()
+struct uring_params {
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t rings;                 // User address of struct uring_rings
+    uint64_t size;                  // Bytes mapped there
+};
+
+struct uring;
+struct process;
+
+// Rings for the calling process with room for entries SQEs, rounded up
+// to a power of two, and twice that many CQEs
+struct uring* uring_create(uint32_t entries, uint32_t flags, struct process* owner);
+// Stop the workers once their current operations finish, then free
+void uring_destroy(struct uring* ring);
+
+// Kernel view of the shared region, PAGE_SIZE aligned and size bytes long
+void* uring_region(struct uring* ring, size_t* size);
+
+// Hand queued SQEs to the workers and optionally wait for completions;
+// returns the SQEs that were queued
+int uring_enter(struct uring* ring, uint32_t to_submit, uint32_t min_complete, uint32_t flags);
+
+#endif // URING_H
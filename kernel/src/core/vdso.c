@@ -0,0 +1,167 @@
+#include <core/vdso.h>
+#include <core/time.h>
+#include <core/smp.h>
+#include <core/syscalls.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <utils/asm.h>
+#include <utils/mem.h>
+#include <utils/log.h>
+
+#define MSR_TSC_AUX 0xC0000103
+
+// vDSO functions run at VDSO_TEXT_ADDR in user mode: they are copied out of
+// the kernel image, so they may only touch the fixed vDSO addresses and must
+// not call anything
+#define VDSO_TEXT __attribute__((section(".vdso_text"), used, noinline))
+
+extern uint8_t __vdso_text_start[];
+extern uint8_t __vdso_text_end[];
+
+static struct vdso_data* vdso_data = NULL;   // Kernel view of the shared page
+static void* vdso_data_phys = NULL;
+static void* vdso_text_phys = NULL;
+
+VDSO_TEXT int vdso_clock_gettime(int clock, struct timespec* ts) {
+    const volatile struct vdso_data* data = (const volatile struct vdso_data*)VDSO_DATA_ADDR;
+    if (clock != VDSO_CLOCK_REALTIME && clock != VDSO_CLOCK_MONOTONIC) return -1;
+
+    uint32_t seq;
+    uint64_t ns;
+    do {
+        seq = data->seq;
+        asm volatile("" ::: "memory");
+        uint32_t lo, hi;
+        asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        uint64_t delta = (((uint64_t)hi << 32) | lo) - data->tsc_base;
+        if ((int64_t)delta < 0) delta = 0;
+        ns = data->ns_base + (uint64_t)(((unsigned __int128)delta * data->mult) >> data->shift);
+        if (clock == VDSO_CLOCK_REALTIME) ns += data->wall_offset_ns;
+        asm volatile("" ::: "memory");
+    } while ((seq & 1) || seq != data->seq);
+
+    ts->tv_sec = (time_t)(ns / NSEC_PER_SEC);
+    ts->tv_nsec = (long)(ns % NSEC_PER_SEC);
+    return 0;
+}
+
+VDSO_TEXT int vdso_getpid(void) {
+    return (int)((const volatile struct vdso_proc*)VDSO_PROC_ADDR)->pid;
+}
+
+VDSO_TEXT int vdso_getcpu(void) {
+    const volatile struct vdso_data* data = (const volatile struct vdso_data*)VDSO_DATA_ADDR;
+    if (!data->has_rdtscp) return -1;
+
+    uint32_t lo, hi, aux;
+    asm volatile("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+    return (int)aux;
+}
+
+static inline uint64_t vdso_user_addr(void* fn) {
+    return VDSO_TEXT_ADDR + (uint64_t)((uint8_t*)fn - __vdso_text_start);
+}
+
+void vdso_update_clock(void) {
+    if (!vdso_data) return;
+    const struct clock_params* clock = time_clock_params();
+
+    __atomic_add_fetch(&vdso_data->seq, 1, __ATOMIC_RELEASE);
+    vdso_data->shift = clock->shift;
+    vdso_data->mult = clock->mult;
+    vdso_data->tsc_base = clock->tsc_base;
+    vdso_data->ns_base = clock->ns_base;
+    vdso_data->wall_offset_ns = clock->wall_offset_ns;
+    __atomic_add_fetch(&vdso_data->seq, 1, __ATOMIC_RELEASE);
+}
+
+void vdso_init_cpu(void) {
+    if (vdso_data && vdso_data->has_rdtscp) {
+        wrmsr(MSR_TSC_AUX, smp_get_current_cpu());
+    }
+}
+
+void vdso_init(void) {
+    size_t text_size = (size_t)(__vdso_text_end - __vdso_text_start);
+    if (text_size > PAGE_SIZE) {
+        log_error("vdso: text does not fit in a page");
+        return;
+    }
+
+    // Both pages stay referenced by the kernel, so unmapping never frees them
+    vdso_data_phys = pmm_alloc_zeroed_page();
+    vdso_text_phys = pmm_alloc_zeroed_page();
+    if (!vdso_data_phys || !vdso_text_phys) {
+        log_error("vdso: out of memory");
+        if (vdso_data_phys) pmm_free_page(vdso_data_phys);
+        if (vdso_text_phys) pmm_free_page(vdso_text_phys);
+        vdso_data_phys = vdso_text_phys = NULL;
+        return;
+    }
+    memcpy(pmm_phys_to_virt(vdso_text_phys), __vdso_text_start, text_size);
+
+    vdso_data = pmm_phys_to_virt(vdso_data_phys);
+    vdso_data->clock_gettime = vdso_user_addr((void*)vdso_clock_gettime);
+    vdso_data->getpid = vdso_user_addr((void*)vdso_getpid);
+    vdso_data->getcpu = vdso_user_addr((void*)vdso_getcpu);
+
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001), "c"(0));
+    vdso_data->has_rdtscp = (edx & (1 << 27)) != 0;
+
+    vdso_update_clock();
+    vdso_init_cpu();
+}
+
+// Map a frame the caller holds a reference for, dropping whatever it replaces
+static bool map_user_page(uint64_t virt, void* phys, uint64_t flags) {
+    uint64_t old = vmm_get_phys_addr(virt);
+    if (old == (uint64_t)phys) {
+        pmm_page_put(phys);
+        return true;
+    }
+    if (!vmm_map_page(virt, (uint64_t)phys, flags)) {
+        pmm_page_put(phys);
+        return false;
+    }
+    if (old) pmm_page_put((void*)old);
+    return true;
+}
+
+static void* alloc_proc_page(uint32_t pid) {
+    void* phys = pmm_alloc_zeroed_page();
+    if (phys) {
+        ((struct vdso_proc*)pmm_phys_to_virt(phys))->pid = pid;
+    }
+    return phys;
+}
+
+bool vdso_map(uint32_t pid) {
+    if (!vdso_data) return false;
+
+    void* proc = alloc_proc_page(pid);
+    if (!proc) return false;
+
+    pmm_page_get(vdso_data_phys);
+    pmm_page_get(vdso_text_phys);
+    return map_user_page(VDSO_DATA_ADDR, vdso_data_phys, PTE_PRESENT | PTE_USER | PTE_NX) &&
+           map_user_page(VDSO_PROC_ADDR, proc, PTE_PRESENT | PTE_USER | PTE_NX) &&
+           map_user_page(VDSO_TEXT_ADDR, vdso_text_phys, PTE_PRESENT | PTE_USER);
+}
+
+bool vdso_fork(uint64_t child_space, uint32_t child_pid) {
+    if (!vdso_data || !vmm_get_phys_addr(VDSO_PROC_ADDR)) return true;
+
+    void* proc = alloc_proc_page(child_pid);
+    if (!proc) return false;
+
+    // The clone shares the parent's page; swap it while the child's space
+    // is loaded, with no chance of being switched out meanwhile
+    uint64_t flags = irq_save();
+    uint64_t parent_space = vmm_get_cr3();
+    vmm_switch_address_space(child_space);
+    bool mapped = map_user_page(VDSO_PROC_ADDR, proc, PTE_PRESENT | PTE_USER | PTE_NX);
+    vmm_switch_address_space(parent_space);
+    irq_restore(flags);
+    return mapped;
+}
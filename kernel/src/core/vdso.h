@@ -0,0 +1,53 @@
+#ifndef VDSO_H
+#define VDSO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Every user address space gets three read-only pages at the top of the
+// lower half: clock data shared by all processes, a page with the
+// process's own PID, and the vDSO text. The data page starts with the
+// user addresses of the vDSO functions:
+//   int clock_gettime(int clock, struct timespec* ts)   0 or -1
+//   int getpid(void)
+//   int getcpu(void)                                     -1 without RDTSCP
+#define VDSO_DATA_ADDR  0x00007FFFFFFFC000ULL
+#define VDSO_PROC_ADDR  0x00007FFFFFFFD000ULL
+#define VDSO_TEXT_ADDR  0x00007FFFFFFFE000ULL
+
+#define VDSO_CLOCK_REALTIME   0
+#define VDSO_CLOCK_MONOTONIC  1
+
+struct vdso_data {
+    uint64_t clock_gettime;      // Entry points
+    uint64_t getpid;
+    uint64_t getcpu;
+
+    // Reader retries while seq is odd or changed (seqlock)
+    volatile uint32_t seq;
+    uint32_t shift;
+    uint64_t mult;
+    uint64_t tsc_base;
+    uint64_t ns_base;
+    uint64_t wall_offset_ns;
+    bool has_rdtscp;             // TSC_AUX holds the CPU number
+};
+
+struct vdso_proc {
+    uint32_t pid;
+};
+
+// After time_init(): build the pages and publish the clock
+void vdso_init(void);
+// Every CPU: CPU number in TSC_AUX for getcpu
+void vdso_init_cpu(void);
+
+// Map into the current address space for a process starting a new image
+bool vdso_map(uint32_t pid);
+// Give a forked child its own PID page
+bool vdso_fork(uint64_t child_space, uint32_t child_pid);
+
+// Republish the clock after a change to time_clock_params()
+void vdso_update_clock(void);
+
+#endif // VDSO_H
@@ -0,0 +1,94 @@
+#include <core/wait.h>
+
+void wait_queue_init(struct wait_queue* wq) {
+    spinlock_init(&wq->lock);
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+bool wait_queue_prepare(struct wait_queue* wq) {
+    process_t* current = get_current_process();
+    if (!current) return false;
+
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+    current->state = PROCESS_STATE_BLOCKED;
+    current->wait_queue = wq;
+    current->wait_next = NULL;
+    if (wq->tail) {
+        wq->tail->wait_next = current;
+    } else {
+        wq->head = current;
+    }
+    wq->tail = current;
+    spinlock_release_irqrestore(&wq->lock, flags);
+    return true;
+}
+
+// Unlink a process; queue lock held
+static void unlink_waiter(struct wait_queue* wq, process_t* process) {
+    process_t** link = &wq->head;
+    process_t* prev = NULL;
+    while (*link && *link != process) {
+        prev = *link;
+        link = &(*link)->wait_next;
+    }
+    if (!*link) return;
+
+    *link = process->wait_next;
+    if (wq->tail == process) {
+        wq->tail = prev;
+    }
+    process->wait_next = NULL;
+    process->wait_queue = NULL;
+}
+
+void wait_queue_finish(struct wait_queue* wq) {
+    process_t* current = get_current_process();
+    if (!current) return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+    if (current->wait_queue == wq) {
+        unlink_waiter(wq, current);
+    } else {
+        // A wakeup that beat schedule() left us queued to run while running
+        scheduler_remove(current);
+    }
+    current->state = PROCESS_STATE_RUNNING;
+    spinlock_release_irqrestore(&wq->lock, flags);
+}
+
+// Wakers queue the process to run before dropping the queue lock, so
+// wait_queue_finish() never sees it woken but not yet runnable
+void wait_queue_wake_one(struct wait_queue* wq) {
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+    process_t* process = wq->head;
+    if (process) {
+        unlink_waiter(wq, process);
+        scheduler_add(process);
+    }
+    spinlock_release_irqrestore(&wq->lock, flags);
+}
+
+void wait_queue_wake_all(struct wait_queue* wq) {
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+    while (wq->head) {
+        process_t* process = wq->head;
+        unlink_waiter(wq, process);
+        scheduler_add(process);
+    }
+    spinlock_release_irqrestore(&wq->lock, flags);
+}
+
+static void wait_timeout_fire(struct timer* timer) {
+    wait_queue_wake_all(((struct wait_timeout*)timer)->wq);
+}
+
+void wait_timeout_start(struct wait_timeout* timeout, struct wait_queue* wq, uint64_t deadline) {
+    timer_init(&timeout->timer, wait_timeout_fire);
+    timeout->wq = wq;
+    mod_timer(&timeout->timer, deadline);
+}
+
+void wait_timeout_stop(struct wait_timeout* timeout) {
+    del_timer_sync(&timeout->timer);
+}
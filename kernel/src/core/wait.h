@@ -0,0 +1,69 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <core/smp.h>
+#include <core/process.h>
+#include <core/timer.h>
+#include <core/time.h>
+
+// Processes blocked until some condition changes
+struct wait_queue {
+    spinlock_t lock;
+    process_t* head;
+    process_t* tail;
+};
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, NULL, NULL }
+
+void wait_queue_init(struct wait_queue* wq);
+
+// Queue the current process and mark it blocked; false if there is no
+// current process to block (early boot or a CPU's idle context)
+bool wait_queue_prepare(struct wait_queue* wq);
+
+// Undo wait_queue_prepare() after sleeping or when the condition came
+// true first, whether or not a wakeup arrived meanwhile
+void wait_queue_finish(struct wait_queue* wq);
+
+void wait_queue_wake_one(struct wait_queue* wq);
+void wait_queue_wake_all(struct wait_queue* wq);
+
+// Sleep until cond holds. cond is checked again after queuing, so a wakeup
+// racing with the check is not lost. Without a current process this spins.
+#define wait_event(wq, cond)                    \
+    do {                                        \
+        while (!(cond)) {                       \
+            if (!wait_queue_prepare(wq)) {      \
+                __asm__ volatile("pause");      \
+                continue;                       \
+            }                                   \
+            if (!(cond)) schedule();            \
+            wait_queue_finish(wq);              \
+        }                                       \
+    } while (0)
+
+// Wakes a queue at a deadline, for wait_event_deadline()
+struct wait_timeout {
+    struct timer timer;
+    struct wait_queue* wq;
+};
+
+void wait_timeout_start(struct wait_timeout* timeout, struct wait_queue* wq, uint64_t deadline);
+void wait_timeout_stop(struct wait_timeout* timeout);
+
+// As wait_event(), giving up once ktime_get_ns() reaches deadline; true if
+// cond held. A timer wakes the queue then, so the sleeper does not poll.
+#define wait_event_deadline(wq, cond, deadline)                              \
+    ({                                                                       \
+        struct wait_timeout __timeout;                                       \
+        uint64_t __deadline = (deadline);                                    \
+        bool __done = false;                                                 \
+        wait_timeout_start(&__timeout, (wq), __deadline);                    \
+        wait_event((wq), (__done = (cond)) || ktime_get_ns() >= __deadline); \
+        wait_timeout_stop(&__timeout);                                       \
+        __done;                                                              \
+    })
+
+#endif // WAIT_H
@@ -0,0 +1,99 @@
+#include <core/workqueue.h>
+#include <core/process.h>
+#include <core/smp.h>
+#include <core/wait.h>
+#include <utils/log.h>
+
+// Work runs on the worker of the CPU it was queued to, in queue order
+struct worker {
+    spinlock_t lock;
+    struct work* head;
+    struct work* tail;
+    struct wait_queue wait;
+    process_t* thread;
+};
+
+static struct worker workers[MAX_CPUS];
+
+void work_init(struct work* work, work_func_t func) {
+    work->func = func;
+    work->next = NULL;
+    work->pending = 0;
+}
+
+static void worker_main(void) {
+    // Workers are pinned, so this stays our CPU
+    struct worker* worker = &workers[smp_get_current_cpu()];
+
+    for (;;) {
+        wait_event(&worker->wait, worker->head != NULL);
+
+        uint64_t flags = spinlock_acquire_irqsave(&worker->lock);
+        struct work* work = worker->head;
+        if (work) {
+            worker->head = work->next;
+            if (!worker->head) worker->tail = NULL;
+            work->next = NULL;
+            // Cleared before running, so the work may queue itself again
+            __atomic_store_n(&work->pending, 0, __ATOMIC_RELEASE);
+        }
+        spinlock_release_irqrestore(&worker->lock, flags);
+
+        if (work) work->func(work);
+    }
+}
+
+// Zeroed workers are valid empty queues, so work may be queued before this
+void workqueue_init(void) {
+    for (uint32_t cpu = 0; cpu < smp_get_cpu_count(); cpu++) {
+        // Highest priority, so deferred interrupt work preempts batch jobs
+        process_t* thread = process_create(worker_main, 0, "kworker");
+        if (!thread) {
+            log_error("workqueue: no worker for a CPU, its work runs elsewhere");
+            continue;
+        }
+        thread->cpu = cpu;
+        thread->pinned = true;
+        workers[cpu].thread = thread;
+        scheduler_add(thread);
+    }
+}
+
+bool work_schedule_on(uint32_t cpu, struct work* work) {
+    if (cpu >= MAX_CPUS) return false;
+    if (__atomic_exchange_n(&work->pending, 1, __ATOMIC_ACQ_REL)) return false;
+
+    struct worker* worker = &workers[cpu];
+    uint64_t flags = spinlock_acquire_irqsave(&worker->lock);
+    work->next = NULL;
+    if (worker->tail) {
+        worker->tail->next = work;
+    } else {
+        worker->head = work;
+    }
+    worker->tail = work;
+    spinlock_release_irqrestore(&worker->lock, flags);
+
+    wait_queue_wake_one(&worker->wait);
+    return true;
+}
+
+bool work_schedule(struct work* work) {
+    uint32_t self = smp_get_current_cpu();
+    uint32_t cpus = smp_get_cpu_count();
+
+    // An idle CPU picks it up without disturbing whatever runs here
+    for (uint32_t i = 1; i < cpus; i++) {
+        uint32_t cpu = (self + i) % cpus;
+        if (workers[cpu].thread && scheduler_cpu_idle(cpu)) {
+            return work_schedule_on(cpu, work);
+        }
+    }
+
+    if (!workers[self].thread) {
+        // Before workqueue_init(), or this CPU has no worker: the BSP's
+        // worker drains it once it starts
+        return work_schedule_on(0, work);
+    }
+    return work_schedule_on(self, work);
+}
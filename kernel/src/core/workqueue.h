@@ -0,0 +1,35 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Interrupt handlers do the minimum (ack the device, note what happened)
+// and hand the rest to a per-CPU worker process as a work item
+
+struct work;
+typedef void (*work_func_t)(struct work* work);
+
+struct work {
+    work_func_t func;
+    struct work* next;
+    volatile uint32_t pending;   // Queued and not started yet
+};
+
+#define WORK_INIT(fn) { (fn), NULL, 0 }
+
+// Structure embedding a member, for work functions
+#define container_of(ptr, type, member) ((type*)((uint8_t*)(ptr) - offsetof(type, member)))
+
+void work_init(struct work* work, work_func_t func);
+
+// Start a worker on every CPU, once SMP and the scheduler are up
+void workqueue_init(void);
+
+// Queue work, preferring an idle CPU's worker. Safe from interrupt
+// context; false if it was already pending.
+bool work_schedule(struct work* work);
+bool work_schedule_on(uint32_t cpu, struct work* work);
+
+#endif // WORKQUEUE_H
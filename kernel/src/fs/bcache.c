@@ -0,0 +1,590 @@
+#include <fs/bcache.h>
+#include <mm/slab.h>
+#include <mm/heap.h>
+#include <core/process.h>
+#include <core/wait.h>
+#include <core/time.h>
+#include <core/timer.h>
+#include <core/smp.h>
+#include <utils/mem.h>
+#include <utils/log.h>
+
+#define BCACHE_BUCKETS (1U << BCACHE_HASH_BITS)
+#define SYNC_BATCH     32          // Write-backs bcache_sync() has in flight at once
+
+#define BUF_VALID      (1U << 0)   // Data loaded; clear while the first read is in flight
+#define BUF_DIRTY      (1U << 1)   // Newer than the disk, on the dirty list
+#define BUF_WRITEBACK  (1U << 2)   // A copy is being written out
+
+struct buffer {
+    uint32_t block;
+    uint32_t flags;
+    uint64_t dirtied_ns;
+    void* data;
+    struct buffer* hash_next;
+    struct buffer* lru_prev;    // Towards the most recently used end
+    struct buffer* lru_next;
+    struct buffer* dirty_prev;  // Towards the longest dirty
+    struct buffer* dirty_next;
+};
+
+static struct block_device* device = NULL;
+static uint32_t block_size = 0;             // 0 until bcache_enable()
+static uint32_t sectors_per_block = 0;
+static struct kmem_cache* buffer_cache = NULL;
+static struct kmem_cache* data_cache = NULL;
+
+// Hash, lists, counters and buffer flags
+static spinlock_t bcache_lock;
+static struct buffer* buffer_hash[BCACHE_BUCKETS];
+static struct buffer* lru_head = NULL;      // Most recently used
+static struct buffer* lru_tail = NULL;
+static struct buffer* dirty_head = NULL;    // Dirty the longest
+static struct buffer* dirty_tail = NULL;
+static uint32_t cached_count = 0;
+static uint32_t dirty_count = 0;
+static uint32_t writeback_count = 0;
+static uint32_t max_blocks = BCACHE_MAX_BLOCKS;
+static uint32_t dirty_limit = BCACHE_DIRTY_LIMIT;
+
+static struct wait_queue io_wait;           // Blocks being loaded or written back
+static struct wait_queue flush_wait;        // The flusher, with nothing dirty
+static void* flush_bounce = NULL;           // The flusher's write-back copy
+
+// One of bcache_sync()'s batched write-backs
+struct sync_write {
+    struct blk_request req;
+    struct buffer* buf;
+    void* bounce;
+    bool success;
+};
+
+struct sync_batch {
+    volatile uint32_t pending;
+};
+
+static bool device_io(uint64_t lba, uint32_t sectors, void* buffer, bool write) {
+    // Goes through the request queues, which take concurrent calls
+    return blk_io(device, lba, sectors, buffer, write);
+}
+
+bool bcache_init(struct block_device* dev) {
+    if (!dev || !dev->read || !dev->write) return false;
+    if (dev->block_size < BLOCKDEV_SECTOR_SIZE || (dev->block_size & (dev->block_size - 1))) return false;
+
+    spinlock_init(&bcache_lock);
+    wait_queue_init(&io_wait);
+    wait_queue_init(&flush_wait);
+    if (!buffer_cache) {
+        buffer_cache = kmem_cache_create("bcache_buffer", sizeof(struct buffer), 8, NULL);
+    }
+    device = dev;
+    return buffer_cache != NULL;
+}
+
+bool bcache_enable(uint32_t size) {
+    // Blocks are whole logical blocks of the device
+    if (!device || size < device->block_size || (size & (device->block_size - 1))) return false;
+    if (block_size == size) return true;
+
+    data_cache = kmem_cache_create("bcache_data", size, size, NULL);
+    if (!data_cache) return false;
+    sectors_per_block = size / device->block_size;
+    block_size = size;
+    return true;
+}
+
+bool bcache_read_sectors(uint64_t lba, uint32_t sectors, void* buffer) {
+    return device_io(lba, sectors, buffer, false);
+}
+
+static inline uint32_t hash_bucket(uint32_t block) {
+    return (uint32_t)((block * 0x9E3779B97F4A7C15ULL) >> (64 - BCACHE_HASH_BITS));
+}
+
+// Lock held
+static struct buffer* hash_lookup(uint32_t block) {
+    for (struct buffer* buf = buffer_hash[hash_bucket(block)]; buf; buf = buf->hash_next) {
+        if (buf->block == block) return buf;
+    }
+    return NULL;
+}
+
+// Lock held
+static void lru_unlink(struct buffer* buf) {
+    if (buf->lru_prev) buf->lru_prev->lru_next = buf->lru_next;
+    else lru_head = buf->lru_next;
+    if (buf->lru_next) buf->lru_next->lru_prev = buf->lru_prev;
+    else lru_tail = buf->lru_prev;
+}
+
+// Lock held
+static void lru_push(struct buffer* buf) {
+    buf->lru_prev = NULL;
+    buf->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = buf;
+    else lru_tail = buf;
+    lru_head = buf;
+}
+
+// Lock held
+static void dirty_unlink(struct buffer* buf) {
+    if (buf->dirty_prev) buf->dirty_prev->dirty_next = buf->dirty_next;
+    else dirty_head = buf->dirty_next;
+    if (buf->dirty_next) buf->dirty_next->dirty_prev = buf->dirty_prev;
+    else dirty_tail = buf->dirty_prev;
+    buf->flags &= ~BUF_DIRTY;
+    dirty_count--;
+}
+
+// Lock held. True if the flusher should be woken.
+static bool mark_dirty(struct buffer* buf) {
+    if (buf->flags & BUF_DIRTY) return false;
+
+    buf->flags |= BUF_DIRTY;
+    buf->dirtied_ns = ktime_get_ns();
+    buf->dirty_prev = dirty_tail;
+    buf->dirty_next = NULL;
+    if (dirty_tail) dirty_tail->dirty_next = buf;
+    else dirty_head = buf;
+    dirty_tail = buf;
+    dirty_count++;
+    return dirty_count == 1 || dirty_count >= dirty_limit;
+}
+
+// Lock held
+static void buffer_insert(struct buffer* buf) {
+    uint32_t bucket = hash_bucket(buf->block);
+    buf->hash_next = buffer_hash[bucket];
+    buffer_hash[bucket] = buf;
+    lru_push(buf);
+    cached_count++;
+}
+
+// Lock held; the caller frees the buffer once the lock is dropped
+static void buffer_remove(struct buffer* buf) {
+    struct buffer** link = &buffer_hash[hash_bucket(buf->block)];
+    while (*link != buf) link = &(*link)->hash_next;
+    *link = buf->hash_next;
+    lru_unlink(buf);
+    if (buf->flags & BUF_DIRTY) dirty_unlink(buf);
+    cached_count--;
+}
+
+static struct buffer* buffer_new(uint32_t block) {
+    struct buffer* buf = kmem_cache_alloc(buffer_cache);
+    if (!buf) return NULL;
+    buf->data = kmem_cache_alloc(data_cache);
+    if (!buf->data) {
+        kmem_cache_free(buffer_cache, buf);
+        return NULL;
+    }
+    buf->block = block;
+    buf->flags = 0;
+    return buf;
+}
+
+static void buffer_free(struct buffer* buf) {
+    kmem_cache_free(data_cache, buf->data);
+    kmem_cache_free(buffer_cache, buf);
+}
+
+// Lock held. Drop clean, idle buffers from the cold end until at most
+// target are cached; freed buffers are chained on hash_next for the caller.
+static struct buffer* shrink(uint32_t target) {
+    struct buffer* freed = NULL;
+    struct buffer* buf = lru_tail;
+    while (buf && cached_count > target) {
+        struct buffer* prev = buf->lru_prev;
+        if (buf->flags == BUF_VALID) {
+            buffer_remove(buf);
+            buf->hash_next = freed;
+            freed = buf;
+        }
+        buf = prev;
+    }
+    return freed;
+}
+
+static void free_chain(struct buffer* buf) {
+    while (buf) {
+        struct buffer* next = buf->hash_next;
+        buffer_free(buf);
+        buf = next;
+    }
+}
+
+static bool block_loading(uint32_t block) {
+    uint64_t flags = spinlock_acquire_irqsave(&bcache_lock);
+    struct buffer* buf = hash_lookup(block);
+    bool loading = buf && !(buf->flags & BUF_VALID);
+    spinlock_release_irqrestore(&bcache_lock, flags);
+    return loading;
+}
+
+static bool block_busy(uint32_t block) {
+    uint64_t flags = spinlock_acquire_irqsave(&bcache_lock);
+    struct buffer* buf = hash_lookup(block);
+    bool busy = buf && (!(buf->flags & BUF_VALID) || (buf->flags & BUF_WRITEBACK));
+    spinlock_release_irqrestore(&bcache_lock, flags);
+    return busy;
+}
+
+// Cached buffer for block, inserted if missing. Returns with the lock held
+// and *flags set; NULL, unlocked, if no buffer could be allocated. A buffer
+// still loading is waited out unless the caller is the one to load it.
+static struct buffer* buffer_get(uint32_t block, uint64_t* flags, bool* inserted) {
+    struct buffer* fresh = NULL;
+    for (;;) {
+        *flags = spinlock_acquire_irqsave(&bcache_lock);
+        struct buffer* buf = hash_lookup(block);
+        if (buf && !(buf->flags & BUF_VALID)) {
+            spinlock_release_irqrestore(&bcache_lock, *flags);
+            wait_event(&io_wait, !block_loading(block));
+            continue;
+        }
+        if (buf) {
+            lru_unlink(buf);
+            lru_push(buf);
+            *inserted = false;
+            if (fresh) buffer_free(fresh);   // Lost the race to insert it
+            return buf;
+        }
+        if (fresh) {
+            buffer_insert(fresh);
+            *inserted = true;
+            return fresh;
+        }
+
+        spinlock_release_irqrestore(&bcache_lock, *flags);
+        fresh = buffer_new(block);
+        if (!fresh) return NULL;
+    }
+}
+
+// Unlock after buffer_get(), trimming the cache and waking the flusher
+static void buffer_release(uint64_t flags, bool wake_flusher) {
+    struct buffer* freed = cached_count > max_blocks ? shrink(max_blocks) : NULL;
+    // Only dirty buffers left to drop: they have to be written back first
+    if (cached_count > max_blocks && dirty_count) wake_flusher = true;
+    spinlock_release_irqrestore(&bcache_lock, flags);
+
+    free_chain(freed);
+    if (wake_flusher) wait_queue_wake_one(&flush_wait);
+}
+
+bool bcache_read(uint32_t block, void* buffer) {
+    if (!block_size) return false;
+
+    uint64_t flags;
+    bool inserted;
+    struct buffer* buf = buffer_get(block, &flags, &inserted);
+    if (!buf) return device_io((uint64_t)block * sectors_per_block, sectors_per_block, buffer, false);
+
+    if (!inserted) {
+        memcpy(buffer, buf->data, block_size);
+        buffer_release(flags, false);
+        return true;
+    }
+
+    // First use: others wait on io_wait until it is valid
+    spinlock_release_irqrestore(&bcache_lock, flags);
+    bool success = device_io((uint64_t)block * sectors_per_block, sectors_per_block, buf->data, false);
+
+    flags = spinlock_acquire_irqsave(&bcache_lock);
+    if (success) {
+        buf->flags |= BUF_VALID;
+        memcpy(buffer, buf->data, block_size);
+        buffer_release(flags, false);
+    } else {
+        buffer_remove(buf);
+        spinlock_release_irqrestore(&bcache_lock, flags);
+        buffer_free(buf);
+    }
+    wait_queue_wake_all(&io_wait);
+    return success;
+}
+
+// Copy out a loaded block if the cache has one, without inserting it
+static bool copy_cached(uint32_t block, void* buffer) {
+    uint64_t flags = spinlock_acquire_irqsave(&bcache_lock);
+    struct buffer* buf = hash_lookup(block);
+    bool hit = buf && (buf->flags & BUF_VALID);
+    if (hit) {
+        memcpy(buffer, buf->data, block_size);
+        lru_unlink(buf);
+        lru_push(buf);
+    }
+    spinlock_release_irqrestore(&bcache_lock, flags);
+    return hit;
+}
+
+static bool block_cached(uint32_t block) {
+    uint64_t flags = spinlock_acquire_irqsave(&bcache_lock);
+    struct buffer* buf = hash_lookup(block);
+    bool cached = buf && (buf->flags & BUF_VALID);
+    spinlock_release_irqrestore(&bcache_lock, flags);
+    return cached;
+}
+
+bool bcache_read_blocks(uint32_t block, uint32_t count, void* buffer) {
+    if (!block_size) return false;
+
+    // Cached blocks, dirty ones included, are copied; each stretch of
+    // uncached ones is a single device request straight into the buffer
+    uint8_t* out = buffer;
+    uint32_t done = 0;
+    while (done < count) {
+        if (copy_cached(block + done, out + (size_t)done * block_size)) {
+            done++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (done + run < count && !block_cached(block + done + run)) run++;
+        if (!device_io((uint64_t)(block + done) * sectors_per_block, run * sectors_per_block,
+                       out + (size_t)done * block_size, false)) {
+            return false;
+        }
+        done += run;
+    }
+    return true;
+}
+
+bool bcache_write(uint32_t block, const void* buffer) {
+    if (!block_size) return false;
+
+    uint64_t flags;
+    bool inserted;
+    struct buffer* buf = buffer_get(block, &flags, &inserted);
+    if (!buf) return device_io((uint64_t)block * sectors_per_block, sectors_per_block, (void*)buffer, true);
+
+    // A copy under write-back is unaffected; the block is just dirty again
+    memcpy(buf->data, buffer, block_size);
+    buf->flags |= BUF_VALID;
+    buffer_release(flags, mark_dirty(buf));
+    return true;
+}
+
+bool bcache_write_sectors(uint64_t lba, uint32_t sectors, const void* buffer) {
+    if (!device_io(lba, sectors, (void*)buffer, true)) return false;
+    if (!block_size || !sectors) return true;
+
+    // Cached copies of the blocks touched are out of date now
+    uint32_t first = (uint32_t)(lba / sectors_per_block);
+    uint32_t last = (uint32_t)((lba + sectors - 1) / sectors_per_block);
+    for (uint32_t block = first; block <= last; block++) {
+        wait_event(&io_wait, !block_busy(block));
+
+        uint64_t flags = spinlock_acquire_irqsave(&bcache_lock);
+        struct buffer* buf = hash_lookup(block);
+        if (buf) buffer_remove(buf);
+        spinlock_release_irqrestore(&bcache_lock, flags);
+        if (buf) buffer_free(buf);
+    }
+    return true;
+}
+
+// Lock held, buffer dirty and not under write-back. The data is copied out
+// first, so writes landing during the I/O just dirty the block again.
+static void writeback_start(struct buffer* buf, void* bounce) {
+    memcpy(bounce, buf->data, block_size);
+    dirty_unlink(buf);
+    buf->flags |= BUF_WRITEBACK;
+    writeback_count++;
+}
+
+// Lock held; a buffer under write-back is never dropped
+static bool writeback_finish(struct buffer* buf, bool success) {
+    buf->flags &= ~BUF_WRITEBACK;
+    writeback_count--;
+    if (!success) {
+        log_error("bcache: write-back of block %d failed", (int)buf->block);
+        mark_dirty(buf);
+    }
+    return success;
+}
+
+// Write one buffer back; returns with the lock held
+static bool writeback(struct buffer* buf, void* bounce, uint64_t* flags) {
+    writeback_start(buf, bounce);
+    spinlock_release_irqrestore(&bcache_lock, *flags);
+
+    bool success = device_io((uint64_t)buf->block * sectors_per_block, sectors_per_block, bounce, true);
+
+    *flags = spinlock_acquire_irqsave(&bcache_lock);
+    return writeback_finish(buf, success);
+}
+
+static void sync_write_done(struct blk_request* req, bool success) {
+    struct sync_write* write = (struct sync_write*)req;
+    struct sync_batch* batch = req->private_data;
+    write->success = success;
+    // The batch may be gone once pending reaches 0; io_wait is not
+    __atomic_sub_fetch(&batch->pending, 1, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&io_wait);
+}
+
+// Write back up to count buffers under one plug, so neighbouring blocks
+// merge and the driver sees a single batch. Returns with the lock held.
+static bool writeback_batch(struct sync_write* writes, uint32_t count, uint64_t* flags) {
+    struct sync_batch batch = { count };
+    spinlock_release_irqrestore(&bcache_lock, *flags);
+
+    uint32_t token = blk_plug();
+    for (uint32_t i = 0; i < count; i++) {
+        writes[i].req = (struct blk_request){
+            .dev = device,
+            .lba = (uint64_t)writes[i].buf->block * sectors_per_block,
+            .count = sectors_per_block,
+            .write = true,
+            .buffer = writes[i].bounce,
+            .done = sync_write_done,
+            .private_data = &batch,
+        };
+        blk_submit(&writes[i].req);
+    }
+    blk_unplug(token);
+    wait_event(&io_wait, (blk_poll(device), !__atomic_load_n(&batch.pending, __ATOMIC_ACQUIRE)));
+
+    bool success = true;
+    *flags = spinlock_acquire_irqsave(&bcache_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        if (!writeback_finish(writes[i].buf, writes[i].success)) success = false;
+    }
+    return success;
+}
+
+// Lock held. Longest-dirty buffer not already being written, if it is due.
+static struct buffer* next_due(bool all) {
+    uint64_t now = ktime_get_ns();
+    bool over = dirty_count >= dirty_limit || cached_count > max_blocks;
+    for (struct buffer* buf = dirty_head; buf; buf = buf->dirty_next) {
+        if (buf->flags & BUF_WRITEBACK) continue;
+        // The list is oldest first, so nothing later is due either
+        if (!all && !over && now - buf->dirtied_ns < (uint64_t)BCACHE_WRITEBACK_DELAY_MS * 1000000ULL) {
+            return NULL;
+        }
+        return buf;
+    }
+    return NULL;
+}
+
+bool bcache_sync(void) {
+    if (!block_size) return true;
+
+    // As many bounces as can be had, up to a batch
+    struct sync_write* writes = malloc(SYNC_BATCH * sizeof(struct sync_write));
+    uint32_t bounces = 0;
+    while (writes && bounces < SYNC_BATCH && (writes[bounces].bounce = kmem_cache_alloc(data_cache))) {
+        bounces++;
+    }
+    if (!bounces) {
+        if (writes) free(writes);
+        return false;
+    }
+
+    bool success = true;
+    uint64_t flags = spinlock_acquire_irqsave(&bcache_lock);
+    for (;;) {
+        uint32_t count = 0;
+        struct buffer* buf;
+        while (count < bounces && (buf = next_due(true))) {
+            writeback_start(buf, writes[count].bounce);
+            writes[count++].buf = buf;
+        }
+        if (count) {
+            if (!writeback_batch(writes, count, &flags)) {
+                // Left dirty; stop rather than retry a failing device forever
+                success = false;
+                break;
+            }
+            continue;
+        }
+        if (!writeback_count) break;
+
+        // Someone else is writing the rest; wait for them to finish
+        spinlock_release_irqrestore(&bcache_lock, flags);
+        wait_event(&io_wait, !__atomic_load_n(&writeback_count, __ATOMIC_ACQUIRE));
+        flags = spinlock_acquire_irqsave(&bcache_lock);
+    }
+    spinlock_release_irqrestore(&bcache_lock, flags);
+
+    for (uint32_t i = 0; i < bounces; i++) kmem_cache_free(data_cache, writes[i].bounce);
+    free(writes);
+    wait_queue_wake_all(&io_wait);
+
+    // Raw sector writes count too, so the device is flushed either way
+    if (success && !blk_flush(device)) {
+        log_error("bcache: device flush failed");
+        success = false;
+    }
+    return success;
+}
+
+void bcache_set_limits(uint32_t blocks, uint32_t dirty) {
+    if (!blocks) blocks = 1;
+    if (!dirty || dirty > blocks) dirty = blocks;
+
+    uint64_t flags = spinlock_acquire_irqsave(&bcache_lock);
+    max_blocks = blocks;
+    dirty_limit = dirty;
+    buffer_release(flags, dirty_count >= dirty_limit);
+}
+
+// Lock held. When the longest-dirty buffer not under write-back ages; if
+// all of them are, look again a full delay later.
+static uint64_t next_due_ns(void) {
+    uint64_t delay = (uint64_t)BCACHE_WRITEBACK_DELAY_MS * 1000000ULL;
+    for (struct buffer* buf = dirty_head; buf; buf = buf->dirty_next) {
+        if (!(buf->flags & BUF_WRITEBACK)) return buf->dirtied_ns + delay;
+    }
+    return ktime_get_ns() + delay;
+}
+
+static void flusher_main(void) {
+    for (;;) {
+        wait_event(&flush_wait, __atomic_load_n(&dirty_count, __ATOMIC_ACQUIRE) != 0);
+
+        uint64_t flags = spinlock_acquire_irqsave(&bcache_lock);
+        struct buffer* buf = next_due(false);
+        bool written = buf && writeback(buf, flush_bounce, &flags);
+        uint64_t due = next_due_ns();
+        buffer_release(flags, false);
+
+        if (buf) {
+            wait_queue_wake_all(&io_wait);
+            // Over the limits the block is due again at once; give a failing
+            // device a rest rather than hammer it
+            if (!written) timer_sleep_ns((uint64_t)BCACHE_RETRY_DELAY_MS * 1000000ULL);
+        } else {
+            // Only young blocks are dirty; sleep until the oldest ages, or
+            // until the limits make everything due and the flusher is woken
+            wait_event_deadline(&flush_wait,
+                                __atomic_load_n(&dirty_count, __ATOMIC_ACQUIRE) >= dirty_limit ||
+                                __atomic_load_n(&cached_count, __ATOMIC_ACQUIRE) > max_blocks,
+                                due);
+        }
+    }
+}
+
+void bcache_flusher_init(void) {
+    if (!block_size) return;
+
+    // Lowest priority: write-back yields to everything interactive
+    flush_bounce = kmem_cache_alloc(data_cache);
+    process_t* flusher = flush_bounce ? process_create(flusher_main, SCHED_LEVELS - 1, "bflush") : NULL;
+    if (!flusher) {
+        log_error("bcache: no flusher, dirty blocks wait for bcache_sync()");
+        return;
+    }
+    scheduler_add(flusher);
+}
+
+void bcache_shutdown(void) {
+    bcache_sync();
+
+    uint64_t flags = spinlock_acquire_irqsave(&bcache_lock);
+    struct buffer* freed = shrink(0);
+    spinlock_release_irqrestore(&bcache_lock, flags);
+    free_chain(freed);
+}
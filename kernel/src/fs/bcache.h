@@ -0,0 +1,43 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/drivers/storage/blockdev.h>
+
+// Filesystem blocks cached by block number. Writes only dirty the cached
+// copy; the flusher writes them back once they have aged, at once when too
+// many are dirty, and bcache_sync() writes everything out.
+#define BCACHE_HASH_BITS          10
+#define BCACHE_MAX_BLOCKS         4096    // Default limit on cached blocks
+#define BCACHE_DIRTY_LIMIT        1024    // Default dirty count that starts write-back at once
+#define BCACHE_WRITEBACK_DELAY_MS 5000    // Age at which a dirty block is written back
+#define BCACHE_RETRY_DELAY_MS     1000    // Pause after a failed write-back
+
+// Attach the device; sector transfers work from here on
+bool bcache_init(struct block_device* device);
+// Start caching blocks of this size, once the superblock has been read
+bool bcache_enable(uint32_t block_size);
+// Start the flusher, once the scheduler is up
+void bcache_flusher_init(void);
+// Clean blocks over a lowered limit are dropped at once
+void bcache_set_limits(uint32_t max_blocks, uint32_t dirty_limit);
+
+// Whole blocks through the cache
+bool bcache_read(uint32_t block, void* buffer);
+bool bcache_write(uint32_t block, const void* buffer);
+// Consecutive blocks for streaming file I/O. Reads see cached copies but
+// do not add to the cache; bcache_write_sectors() covers the write side.
+bool bcache_read_blocks(uint32_t block, uint32_t count, void* buffer);
+
+// Raw transfers in the device's logical blocks. Reads bypass the cache;
+// writes replace any cached copy of the blocks they touch.
+bool bcache_read_sectors(uint64_t lba, uint32_t sectors, void* buffer);
+bool bcache_write_sectors(uint64_t lba, uint32_t sectors, const void* buffer);
+
+// Write every dirty block back and flush the device; false if any write failed
+bool bcache_sync(void);
+// Write back and forget every block, at unmount
+void bcache_shutdown(void);
+
+#endif // BCACHE_H
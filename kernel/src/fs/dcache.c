@@ -0,0 +1,152 @@
+#include <fs/dcache.h>
+#include <mm/slab.h>
+#include <core/smp.h>
+#include <utils/mem.h>
+
+#define DCACHE_BUCKETS (1U << DCACHE_HASH_BITS)
+
+struct dentry {
+    uint32_t parent;
+    uint32_t inode;             // 0 for a name known to be absent
+    uint32_t hash;
+    uint8_t len;
+    char name[DCACHE_NAME_INLINE];
+    struct dentry* hash_next;
+    struct dentry* lru_prev;    // Most recently used first
+    struct dentry* lru_next;
+};
+
+static struct kmem_cache* dentry_cache = NULL;
+static struct dentry* dentry_hash[DCACHE_BUCKETS];
+static struct dentry* lru_head = NULL;
+static struct dentry* lru_tail = NULL;
+static uint32_t dentries = 0;
+static spinlock_t dcache_lock;
+static volatile uint64_t invalidate_seq = 0;    // Lets a scan spot a racing change
+
+void dcache_init(void) {
+    if (!dentry_cache) {
+        dentry_cache = kmem_cache_create("dentry", sizeof(struct dentry), 8, NULL);
+        spinlock_init(&dcache_lock);
+    }
+}
+
+// FNV-1a over the name, mixed with the parent
+static uint32_t name_hash(uint32_t parent, const char* name, uint32_t len) {
+    uint32_t hash = 2166136261U ^ parent;
+    for (uint32_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static inline uint32_t hash_bucket(uint32_t hash) {
+    return (uint32_t)(((uint64_t)hash * 0x9E3779B97F4A7C15ULL) >> (64 - DCACHE_HASH_BITS));
+}
+
+// Lock held
+static struct dentry* dentry_lookup(uint32_t parent, const char* name, uint32_t len, uint32_t hash) {
+    for (struct dentry* d = dentry_hash[hash_bucket(hash)]; d; d = d->hash_next) {
+        if (d->hash == hash && d->parent == parent && d->len == len && memcmp(d->name, name, len) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Lock held
+static void lru_unlink(struct dentry* d) {
+    if (d->lru_prev) d->lru_prev->lru_next = d->lru_next;
+    else lru_head = d->lru_next;
+    if (d->lru_next) d->lru_next->lru_prev = d->lru_prev;
+    else lru_tail = d->lru_prev;
+}
+
+// Lock held
+static void lru_push(struct dentry* d) {
+    d->lru_prev = NULL;
+    d->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = d;
+    else lru_tail = d;
+    lru_head = d;
+}
+
+// Lock held
+static void dentry_remove(struct dentry* d) {
+    struct dentry** link = &dentry_hash[hash_bucket(d->hash)];
+    while (*link != d) link = &(*link)->hash_next;
+    *link = d->hash_next;
+    lru_unlink(d);
+    dentries--;
+    kmem_cache_free(dentry_cache, d);
+}
+
+bool dcache_lookup(uint32_t parent, const char* name, uint32_t len, uint32_t* inode, uint64_t* seq) {
+    *seq = __atomic_load_n(&invalidate_seq, __ATOMIC_ACQUIRE);
+    if (!dentry_cache || len > DCACHE_NAME_INLINE) return false;
+
+    uint32_t hash = name_hash(parent, name, len);
+    uint64_t flags = spinlock_acquire_irqsave(&dcache_lock);
+    struct dentry* d = dentry_lookup(parent, name, len, hash);
+    if (d) {
+        *inode = d->inode;
+        if (d != lru_head) {
+            lru_unlink(d);
+            lru_push(d);
+        }
+    }
+    spinlock_release_irqrestore(&dcache_lock, flags);
+    return d != NULL;
+}
+
+void dcache_add(uint32_t parent, const char* name, uint32_t len, uint32_t inode, uint64_t seq) {
+    if (!dentry_cache || len > DCACHE_NAME_INLINE) return;
+
+    struct dentry* fresh = kmem_cache_alloc(dentry_cache);
+    if (!fresh) return;
+    fresh->parent = parent;
+    fresh->inode = inode;
+    fresh->hash = name_hash(parent, name, len);
+    fresh->len = (uint8_t)len;
+    memcpy(fresh->name, name, len);
+
+    uint64_t flags = spinlock_acquire_irqsave(&dcache_lock);
+    if (invalidate_seq != seq || dentry_lookup(parent, name, len, fresh->hash)) {
+        spinlock_release_irqrestore(&dcache_lock, flags);
+        kmem_cache_free(dentry_cache, fresh);
+        return;
+    }
+    if (dentries >= DCACHE_MAX_ENTRIES) dentry_remove(lru_tail);
+
+    uint32_t bucket = hash_bucket(fresh->hash);
+    fresh->hash_next = dentry_hash[bucket];
+    dentry_hash[bucket] = fresh;
+    lru_push(fresh);
+    dentries++;
+    spinlock_release_irqrestore(&dcache_lock, flags);
+}
+
+void dcache_invalidate(uint32_t parent, const char* name, uint32_t len) {
+    if (!dentry_cache) return;
+
+    uint32_t hash = name_hash(parent, name, len);
+    uint64_t flags = spinlock_acquire_irqsave(&dcache_lock);
+    __atomic_add_fetch(&invalidate_seq, 1, __ATOMIC_RELEASE);
+    struct dentry* d = len <= DCACHE_NAME_INLINE ? dentry_lookup(parent, name, len, hash) : NULL;
+    if (d) dentry_remove(d);
+    spinlock_release_irqrestore(&dcache_lock, flags);
+}
+
+void dcache_invalidate_dir(uint32_t parent) {
+    if (!dentry_cache) return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&dcache_lock);
+    __atomic_add_fetch(&invalidate_seq, 1, __ATOMIC_RELEASE);
+    struct dentry* d = lru_head;
+    while (d) {
+        struct dentry* next = d->lru_next;
+        if (d->parent == parent) dentry_remove(d);
+        d = next;
+    }
+    spinlock_release_irqrestore(&dcache_lock, flags);
+}
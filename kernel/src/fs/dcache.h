@@ -0,0 +1,25 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Directory lookups cached by (parent inode, name), including misses, so a
+// path walk costs a hash probe per component once it is warm
+#define DCACHE_HASH_BITS    10
+#define DCACHE_MAX_ENTRIES  4096  // Least recently used entries go past this
+#define DCACHE_NAME_INLINE  40    // Longer names are never cached
+
+void dcache_init(void);
+
+// True on a hit, with *inode set, 0 for a cached miss. Otherwise *seq
+// is filled for the dcache_add() that follows the directory scan.
+bool dcache_lookup(uint32_t parent, const char* name, uint32_t len, uint32_t* inode, uint64_t* seq);
+// Remember a scan result; dropped if an invalidation ran since the lookup
+void dcache_add(uint32_t parent, const char* name, uint32_t len, uint32_t inode, uint64_t seq);
+// Forget one name, after it is created or removed
+void dcache_invalidate(uint32_t parent, const char* name, uint32_t len);
+// Forget every name in a directory that is being freed
+void dcache_invalidate_dir(uint32_t parent);
+
+#endif // DCACHE_H
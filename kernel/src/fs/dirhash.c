@@ -0,0 +1,145 @@
+#include <fs/dirhash.h>
+#include <stdbool.h>
+
+#define HTREE_EOF_32BIT 0x7FFFFFFFU
+
+static inline uint32_t rol32(uint32_t word, uint32_t shift) {
+    return (word << shift) | (word >> (32 - shift));
+}
+
+// The original hash, from before half MD4
+static uint32_t legacy_hash(const char* name, uint32_t len, bool is_signed) {
+    uint32_t hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+    for (uint32_t i = 0; i < len; i++) {
+        int c = is_signed ? (int)(signed char)name[i] : (int)(unsigned char)name[i];
+        uint32_t hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        if (hash & 0x80000000U) hash -= 0x7FFFFFFFU;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// Pack up to num words of the name, padded with its length
+static void str2hashbuf(const char* msg, uint32_t len, uint32_t* buf, int num, bool is_signed) {
+    uint32_t pad = len | (len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    if (len > (uint32_t)num * 4) len = (uint32_t)num * 4;
+    for (uint32_t i = 0; i < len; i++) {
+        int c = is_signed ? (int)(signed char)msg[i] : (int)(unsigned char)msg[i];
+        val = (uint32_t)c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) *buf++ = val;
+    while (--num >= 0) *buf++ = pad;
+}
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = rol32(a, s))
+#define K1 0
+#define K2 013240474631U
+#define K3 015666365641U
+
+// Three rounds of MD4 over eight words
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    ROUND(F, a, b, c, d, in[0] + K1, 3);
+    ROUND(F, d, a, b, c, in[1] + K1, 7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1, 3);
+    ROUND(F, d, a, b, c, in[5] + K1, 7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    ROUND(G, a, b, c, d, in[1] + K2, 3);
+    ROUND(G, d, a, b, c, in[3] + K2, 5);
+    ROUND(G, c, d, a, b, in[5] + K2, 9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2, 3);
+    ROUND(G, d, a, b, c, in[2] + K2, 5);
+    ROUND(G, c, d, a, b, in[4] + K2, 9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    ROUND(H, a, b, c, d, in[3] + K3, 3);
+    ROUND(H, d, a, b, c, in[7] + K3, 9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3, 3);
+    ROUND(H, d, a, b, c, in[5] + K3, 9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// Sixteen rounds of TEA over four words
+static void tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9E3779B9U;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+uint32_t ext2_dirhash(const char* name, uint32_t len, uint32_t version, const uint32_t* seed) {
+    uint32_t buf[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+    if (seed && (seed[0] | seed[1] | seed[2] | seed[3])) {
+        for (int i = 0; i < 4; i++) buf[i] = seed[i];
+    }
+
+    bool is_signed = version < DX_HASH_LEGACY_UNSIGNED;
+    uint32_t in[8];
+    uint32_t hash;
+    switch (version) {
+        case DX_HASH_LEGACY:
+        case DX_HASH_LEGACY_UNSIGNED:
+            hash = legacy_hash(name, len, is_signed);
+            break;
+        case DX_HASH_HALF_MD4:
+        case DX_HASH_HALF_MD4_UNSIGNED:
+            for (const char* p = name; ; p += 32) {
+                uint32_t left = len - (uint32_t)(p - name);
+                str2hashbuf(p, left, in, 8, is_signed);
+                half_md4_transform(buf, in);
+                if (left <= 32) break;
+            }
+            hash = buf[1];
+            break;
+        case DX_HASH_TEA:
+        case DX_HASH_TEA_UNSIGNED:
+            for (const char* p = name; ; p += 16) {
+                uint32_t left = len - (uint32_t)(p - name);
+                str2hashbuf(p, left, in, 4, is_signed);
+                tea_transform(buf, in);
+                if (left <= 16) break;
+            }
+            hash = buf[0];
+            break;
+        default:
+            return 0;
+    }
+
+    // The top value marks the end of a directory for readdir cookies
+    hash &= ~1U;
+    if (hash == (HTREE_EOF_32BIT << 1)) hash = (HTREE_EOF_32BIT - 1) << 1;
+    return hash;
+}
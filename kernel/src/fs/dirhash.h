@@ -0,0 +1,19 @@
+#ifndef DIRHASH_H
+#define DIRHASH_H
+
+#include <stdint.h>
+
+// Name hashes of the ext2/ext3 directory index, as the host tools compute
+// them. The unsigned variants differ only for bytes above 0x7F.
+#define DX_HASH_LEGACY             0
+#define DX_HASH_HALF_MD4           1
+#define DX_HASH_TEA                2
+#define DX_HASH_LEGACY_UNSIGNED    3
+#define DX_HASH_HALF_MD4_UNSIGNED  4
+#define DX_HASH_TEA_UNSIGNED       5
+
+// Major hash of a name, low bit clear; seed may be NULL or all zero for
+// the default. Unknown versions hash to 0.
+uint32_t ext2_dirhash(const char* name, uint32_t len, uint32_t version, const uint32_t* seed);
+
+#endif // DIRHASH_H
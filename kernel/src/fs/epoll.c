@@ -0,0 +1,397 @@
+#include <fs/epoll.h>
+#include <fs/file.h>
+#include <core/syscalls.h>
+#include <core/wait.h>
+#include <core/time.h>
+#include <core/workqueue.h>
+#include <utils/mem.h>
+
+#define EPOLL_BUCKETS_INITIAL 64
+#define EPOLL_BATCH           64     // Events gathered per pass under the lock
+
+// Always armed, whatever the registration asked for; a fired oneshot item
+// drops them along with everything else
+#define EPOLL_ALWAYS   (EPOLLERR | EPOLLHUP)
+#define EPOLL_FLAGS    (EPOLLET | EPOLLONESHOT)
+
+// One registered (fd, file) pair
+struct epitem {
+    struct poll_entry entry;        // On the file's poll head
+    struct eventpoll* ep;
+    struct file* file;              // Unreferenced; the item goes with the file
+    struct poll_head* head;
+    int fd;
+    uint32_t events;
+    uint64_t data;
+    bool ready;                     // On the ready list
+    struct epitem* ready_next;
+    struct epitem* hash_next;
+    struct epitem* file_next;       // Other registrations of the same file
+};
+
+struct eventpoll {
+    spinlock_t lock;                // Hash, ready list and item state
+    struct epitem** buckets;
+    uint32_t nbuckets;              // Power of two
+    uint32_t count;
+    struct epitem* ready_head;      // Items to recheck in epoll_wait()
+    struct epitem* ready_tail;
+    struct wait_queue wait;
+};
+
+// Orders registration changes against each other and against files and
+// instances going away. Taken before any poll head or instance lock.
+static spinlock_t epoll_lock = SPINLOCK_INIT;
+
+void poll_head_init(struct poll_head* head) {
+    spinlock_init(&head->lock);
+    head->first = NULL;
+}
+
+void poll_add(struct poll_head* head, struct poll_entry* entry) {
+    uint64_t flags = spinlock_acquire_irqsave(&head->lock);
+    entry->next = head->first;
+    head->first = entry;
+    spinlock_release_irqrestore(&head->lock, flags);
+}
+
+void poll_remove(struct poll_head* head, struct poll_entry* entry) {
+    uint64_t flags = spinlock_acquire_irqsave(&head->lock);
+    for (struct poll_entry** link = &head->first; *link; link = &(*link)->next) {
+        if (*link == entry) {
+            *link = entry->next;
+            break;
+        }
+    }
+    spinlock_release_irqrestore(&head->lock, flags);
+}
+
+void poll_notify(struct poll_head* head, uint32_t events) {
+    if (!head->first) return;
+    uint64_t flags = spinlock_acquire_irqsave(&head->lock);
+    for (struct poll_entry* entry = head->first; entry; entry = entry->next) {
+        entry->notify(entry, events);
+    }
+    spinlock_release_irqrestore(&head->lock, flags);
+}
+
+// Instance lock held
+static void ready_append(struct eventpoll* ep, struct epitem* item) {
+    item->ready = true;
+    item->ready_next = NULL;
+    if (ep->ready_tail) {
+        ep->ready_tail->ready_next = item;
+    } else {
+        ep->ready_head = item;
+    }
+    ep->ready_tail = item;
+}
+
+// Instance lock held
+static void ready_unlink(struct eventpoll* ep, struct epitem* item) {
+    if (!item->ready) return;
+    struct epitem* prev = NULL;
+    for (struct epitem* it = ep->ready_head; it; prev = it, it = it->ready_next) {
+        if (it != item) continue;
+        if (prev) {
+            prev->ready_next = it->ready_next;
+        } else {
+            ep->ready_head = it->ready_next;
+        }
+        if (ep->ready_tail == it) ep->ready_tail = prev;
+        break;
+    }
+    item->ready = false;
+}
+
+// Poll head locked. Only queues the item; epoll_wait() asks the file for
+// its real state, so spurious notifications cost one recheck.
+static void ep_notify(struct poll_entry* entry, uint32_t events) {
+    struct epitem* item = container_of(entry, struct epitem, entry);
+    struct eventpoll* ep = item->ep;
+
+    uint64_t flags = spinlock_acquire_irqsave(&ep->lock);
+    bool queued = !item->ready && (events & item->events & ~EPOLL_FLAGS);
+    if (queued) ready_append(ep, item);
+    spinlock_release_irqrestore(&ep->lock, flags);
+
+    if (queued) wait_queue_wake_all(&ep->wait);
+}
+
+static inline uint32_t hash_fd(struct eventpoll* ep, int fd, struct file* file) {
+    uint64_t key = (uint64_t)(uint32_t)fd ^ ((uint64_t)file >> 6);
+    return (uint32_t)(key * 0x9E3779B97F4A7C15ULL >> 32) & (ep->nbuckets - 1);
+}
+
+// Instance lock held
+static struct epitem** hash_find(struct eventpoll* ep, int fd, struct file* file) {
+    struct epitem** link = &ep->buckets[hash_fd(ep, fd, file)];
+    while (*link && ((*link)->fd != fd || (*link)->file != file)) link = &(*link)->hash_next;
+    return link;
+}
+
+// Double the buckets once the chains average two items. Instance lock held;
+// a failed allocation just leaves the chains longer.
+static void hash_grow(struct eventpoll* ep) {
+    uint32_t size = ep->nbuckets * 2;
+    struct epitem** buckets = malloc(size * sizeof(struct epitem*));
+    if (!buckets) return;
+    memset(buckets, 0, size * sizeof(struct epitem*));
+
+    struct epitem** old = ep->buckets;
+    uint32_t old_size = ep->nbuckets;
+    ep->buckets = buckets;
+    ep->nbuckets = size;
+    for (uint32_t i = 0; i < old_size; i++) {
+        while (old[i]) {
+            struct epitem* item = old[i];
+            old[i] = item->hash_next;
+            struct epitem** bucket = &buckets[hash_fd(ep, item->fd, item->file)];
+            item->hash_next = *bucket;
+            *bucket = item;
+        }
+    }
+    free(old);
+}
+
+static void file_unlink_item(struct file* file, struct epitem* item) {
+    for (struct epitem** link = &file->epitems; *link; link = &(*link)->file_next) {
+        if (*link == item) {
+            *link = item->file_next;
+            break;
+        }
+    }
+}
+
+// Queue item if its file is already ready. Instance lock held.
+static bool ep_check(struct eventpoll* ep, struct epitem* item) {
+    if (item->ready) return false;
+    if (!(file_poll(item->file, NULL) & item->events & ~EPOLL_FLAGS)) return false;
+    ready_append(ep, item);
+    return true;
+}
+
+static void ep_release(struct file* epfile) {
+    struct eventpoll* ep = epfile->private_data;
+    if (!ep) return;
+
+    spinlock_acquire(&epoll_lock);
+    for (uint32_t i = 0; i < ep->nbuckets; i++) {
+        while (ep->buckets[i]) {
+            struct epitem* item = ep->buckets[i];
+            ep->buckets[i] = item->hash_next;
+            poll_remove(item->head, &item->entry);
+            file_unlink_item(item->file, item);
+            free(item);
+        }
+    }
+    spinlock_release(&epoll_lock);
+
+    free(ep->buckets);
+    free(ep);
+}
+
+struct file* epoll_create_file(void) {
+    struct eventpoll* ep = malloc(sizeof(struct eventpoll));
+    if (!ep) return NULL;
+    memset(ep, 0, sizeof(struct eventpoll));
+
+    ep->nbuckets = EPOLL_BUCKETS_INITIAL;
+    ep->buckets = malloc(ep->nbuckets * sizeof(struct epitem*));
+    struct file* file = file_alloc();
+    if (!ep->buckets || !file) {
+        if (file) file_put(file);
+        free(ep->buckets);
+        free(ep);
+        return NULL;
+    }
+    memset(ep->buckets, 0, ep->nbuckets * sizeof(struct epitem*));
+    spinlock_init(&ep->lock);
+    wait_queue_init(&ep->wait);
+
+    file->type = FD_TYPE_EPOLL;
+    file->private_data = ep;
+    file->flags = O_RDWR;
+    file->release = ep_release;
+    return file;
+}
+
+int epoll_ctl(struct file* epfile, int op, int fd, struct file* file, const struct epoll_event* event) {
+    if (epfile->type != FD_TYPE_EPOLL) return -EINVAL;
+    // No nesting, so no wakeup loops to detect
+    if (file->type == FD_TYPE_EPOLL) return -EINVAL;
+    if (op != EPOLL_CTL_DEL && !event) return -EFAULT;
+
+    struct poll_head* head = NULL;
+    file_poll(file, &head);
+    if (!head) return -EPERM;   // Regular files are always ready
+
+    struct eventpoll* ep = epfile->private_data;
+    struct epitem* item = NULL;
+    if (op == EPOLL_CTL_ADD) {
+        item = malloc(sizeof(struct epitem));
+        if (!item) return -ENOMEM;
+        memset(item, 0, sizeof(struct epitem));
+        item->entry.notify = ep_notify;
+        item->ep = ep;
+        item->file = file;
+        item->head = head;
+        item->fd = fd;
+        item->events = event->events | EPOLL_ALWAYS;
+        item->data = event->data;
+    }
+
+    int result = 0;
+    bool wake = false;
+    spinlock_acquire(&epoll_lock);
+    uint64_t flags = spinlock_acquire_irqsave(&ep->lock);
+    struct epitem** link = hash_find(ep, fd, file);
+    struct epitem* found = *link;
+
+    switch (op) {
+        case EPOLL_CTL_ADD:
+            if (found) {
+                result = -EEXIST;
+                break;
+            }
+            *link = item;
+            if (++ep->count > ep->nbuckets * 2) hash_grow(ep);
+            item->file_next = file->epitems;
+            file->epitems = item;
+            spinlock_release_irqrestore(&ep->lock, flags);
+
+            // Watch for changes before the first check so none are missed
+            poll_add(head, &item->entry);
+            flags = spinlock_acquire_irqsave(&ep->lock);
+            wake = ep_check(ep, item);
+            item = NULL;
+            break;
+
+        case EPOLL_CTL_MOD:
+            if (!found) {
+                result = -ENOENT;
+                break;
+            }
+            found->events = event->events | EPOLL_ALWAYS;
+            found->data = event->data;
+            wake = ep_check(ep, found);
+            break;
+
+        case EPOLL_CTL_DEL:
+            if (!found) {
+                result = -ENOENT;
+                break;
+            }
+            *link = found->hash_next;
+            ep->count--;
+            file_unlink_item(file, found);
+            spinlock_release_irqrestore(&ep->lock, flags);
+
+            // A notification may still queue the item until it is off the head
+            poll_remove(head, &found->entry);
+            flags = spinlock_acquire_irqsave(&ep->lock);
+            ready_unlink(ep, found);
+            free(found);
+            break;
+
+        default:
+            result = -EINVAL;
+            break;
+    }
+    spinlock_release_irqrestore(&ep->lock, flags);
+    spinlock_release(&epoll_lock);
+
+    if (item) free(item);
+    if (wake) wait_queue_wake_all(&ep->wait);
+    return result;
+}
+
+// Report up to max ready items into out. Level-triggered items that are
+// still ready go back on the list, behind anything not looked at yet.
+static int ep_collect(struct eventpoll* ep, struct epoll_event* out, int max) {
+    int count = 0;
+    struct epitem* requeue = NULL;
+    struct epitem** requeue_tail = &requeue;
+
+    uint64_t flags = spinlock_acquire_irqsave(&ep->lock);
+    while (ep->ready_head && count < max) {
+        struct epitem* item = ep->ready_head;
+        ep->ready_head = item->ready_next;
+        if (!ep->ready_head) ep->ready_tail = NULL;
+        item->ready = false;
+
+        uint32_t mask = file_poll(item->file, NULL) & item->events & ~EPOLL_FLAGS;
+        if (!mask) continue;
+
+        out[count].events = mask;
+        out[count].data = item->data;
+        count++;
+
+        if (item->events & EPOLLONESHOT) {
+            item->events &= EPOLL_FLAGS;
+        } else if (!(item->events & EPOLLET)) {
+            item->ready = true;
+            item->ready_next = NULL;
+            *requeue_tail = item;
+            requeue_tail = &item->ready_next;
+        }
+    }
+    if (requeue) {
+        if (ep->ready_tail) {
+            ep->ready_tail->ready_next = requeue;
+        } else {
+            ep->ready_head = requeue;
+        }
+        ep->ready_tail = container_of(requeue_tail, struct epitem, ready_next);
+    }
+    spinlock_release_irqrestore(&ep->lock, flags);
+    return count;
+}
+
+int epoll_wait(struct file* epfile, struct epoll_event* events, int maxevents, int timeout_ms) {
+    if (epfile->type != FD_TYPE_EPOLL) return -EINVAL;
+    if (maxevents <= 0) return -EINVAL;
+    if (!events) return -EFAULT;
+
+    struct eventpoll* ep = epfile->private_data;
+    uint64_t deadline = timeout_ms > 0 ? ktime_get_ns() + (uint64_t)timeout_ms * 1000000 : 0;
+
+    for (;;) {
+        // Gather into a kernel buffer so user pages fault outside the lock
+        struct epoll_event batch[EPOLL_BATCH];
+        int total = 0;
+        while (total < maxevents) {
+            int want = maxevents - total < EPOLL_BATCH ? maxevents - total : EPOLL_BATCH;
+            int got = ep_collect(ep, batch, want);
+            memcpy(&events[total], batch, got * sizeof(struct epoll_event));
+            total += got;
+            if (got < want) break;
+        }
+        if (total || timeout_ms == 0) return total;
+
+        if (timeout_ms < 0) {
+            wait_event(&ep->wait, ep->ready_head != NULL);
+        } else if (!wait_event_deadline(&ep->wait, ep->ready_head != NULL, deadline)) {
+            return 0;
+        }
+    }
+}
+
+void eventpoll_release_file(struct file* file) {
+    spinlock_acquire(&epoll_lock);
+    while (file->epitems) {
+        struct epitem* item = file->epitems;
+        struct eventpoll* ep = item->ep;
+        file->epitems = item->file_next;
+
+        poll_remove(item->head, &item->entry);
+        uint64_t flags = spinlock_acquire_irqsave(&ep->lock);
+        struct epitem** link = hash_find(ep, item->fd, file);
+        if (*link == item) *link = item->hash_next;
+        ep->count--;
+        ready_unlink(ep, item);
+        spinlock_release_irqrestore(&ep->lock, flags);
+        free(item);
+    }
+    spinlock_release(&epoll_lock);
+}
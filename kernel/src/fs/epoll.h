@@ -0,0 +1,63 @@
+#ifndef EPOLL_H
+#define EPOLL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/smp.h>
+
+// Readiness events
+#define EPOLLIN      0x001
+#define EPOLLPRI     0x002
+#define EPOLLOUT     0x004
+#define EPOLLERR     0x008
+#define EPOLLHUP     0x010
+#define EPOLLRDHUP   0x2000
+#define EPOLLONESHOT (1U << 30)   // Disarm after one report until EPOLL_CTL_MOD
+#define EPOLLET      (1U << 31)   // Report on changes only, not while ready
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLL_CLOEXEC 02000000
+
+struct epoll_event {
+    uint32_t events;
+    uint64_t data;
+} __attribute__((packed));
+
+// Anything a file can wait on embeds a poll_head and calls poll_notify()
+// when its readiness may have changed. Watchers are called with the head
+// locked and must not sleep.
+struct poll_entry {
+    struct poll_entry* next;
+    void (*notify)(struct poll_entry* entry, uint32_t events);
+};
+
+struct poll_head {
+    spinlock_t lock;
+    struct poll_entry* first;
+};
+
+#define POLL_HEAD_INIT { SPINLOCK_INIT, NULL }
+
+void poll_head_init(struct poll_head* head);
+void poll_add(struct poll_head* head, struct poll_entry* entry);
+void poll_remove(struct poll_head* head, struct poll_entry* entry);
+// Tell every watcher that events may now be ready
+void poll_notify(struct poll_head* head, uint32_t events);
+
+struct file;
+struct eventpoll;
+
+// A new epoll instance as an open file
+struct file* epoll_create_file(void);
+int epoll_ctl(struct file* epfile, int op, int fd, struct file* file, const struct epoll_event* event);
+// Collect up to maxevents ready events, waiting up to timeout_ms (-1 for
+// ever, 0 not at all). Returns the count or a negative errno.
+int epoll_wait(struct file* epfile, struct epoll_event* events, int maxevents, int timeout_ms);
+
+// Drop every epoll registration of file; called once it has no references
+void eventpoll_release_file(struct file* file);
+
+#endif // EPOLL_H
@@ -1,140 +1,49 @@
 #include <fs/ext2.h>
 #include <mm/heap.h>
+#include <mm/slab.h>
 #include <utils/mem.h>
 #include <utils/str.h>
 #include <core/drivers/storage/nvme.h>
 #include <utils/io.h>
 #include <core/syscalls.h>
-
-// Base timestamp (initialized at mount time)
-static uint32_t base_time = 0;
-// Current timestamp (updated on operations)
-static uint32_t current_time = 0;
-// Timer tick counter for maintaining time
-static volatile uint64_t timer_ticks = 0;
-
-// UNIX timestamp for January 1, 2024 00:00:00 UTC
-#define DEFAULT_TIMESTAMP 1704067200
-
-// RTC port addresses
-#define RTC_INDEX_PORT   0x70
-#define RTC_DATA_PORT    0x71
-
-// RTC registers
-#define RTC_SECONDS      0x00
-#define RTC_MINUTES      0x02
-#define RTC_HOURS        0x04
-#define RTC_DAY          0x07
-#define RTC_MONTH        0x08
-#define RTC_YEAR         0x09
-
-// Helper function to read RTC register
-static uint8_t read_rtc_reg(uint8_t reg) {
-    outb(RTC_INDEX_PORT, reg);
-    return inb(RTC_DATA_PORT);
-}
-
-// Convert BCD to binary
-static uint8_t bcd_to_binary(uint8_t bcd) {
-    return ((bcd & 0xF0) >> 4) * 10 + (bcd & 0x0F);
-}
-
-// Days per month (non-leap year)
-static const uint8_t days_in_month[] = {
-    31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
-};
-
-// Check if year is leap year
-static bool is_leap_year(uint32_t year) {
-    return (year % 4 == 0 && year % 100 != 0) || (year % 400 == 0);
-}
-
-// Get timestamp from RTC
-static uint32_t get_rtc_timestamp(void) {
-    uint8_t second = bcd_to_binary(read_rtc_reg(RTC_SECONDS));
-    uint8_t minute = bcd_to_binary(read_rtc_reg(RTC_MINUTES));
-    uint8_t hour = bcd_to_binary(read_rtc_reg(RTC_HOURS));
-    uint8_t day = bcd_to_binary(read_rtc_reg(RTC_DAY));
-    uint8_t month = bcd_to_binary(read_rtc_reg(RTC_MONTH));
-    uint16_t year = bcd_to_binary(read_rtc_reg(RTC_YEAR)) + 2000; // Assume 20xx
-
-    // Calculate days since epoch (January 1, 1970)
-    uint32_t days = 0;
-
-    // Add days for each year from 1970 to current year
-    for (uint32_t y = 1970; y < year; y++) {
-        days += is_leap_year(y) ? 366 : 365;
-    }
-
-    // Add days for months in current year
-    for (uint8_t m = 1; m < month; m++) {
-        days += days_in_month[m - 1];
-        if (m == 2 && is_leap_year(year)) {
-            days++;
-        }
-    }
-
-    // Add days in current month
-    days += day - 1;
-
-    // Convert to seconds and add time
-    uint32_t timestamp = days * 86400;    // Seconds per day
-    timestamp += hour * 3600;             // Seconds per hour
-    timestamp += minute * 60;             // Seconds per minute
-    timestamp += second;
-
-    return timestamp;
-}
-
-// Initialize filesystem time
-void ext2_time_init(void) {
-    // Try to get time from RTC
-    uint32_t rtc_time = get_rtc_timestamp();
-
-    // Use RTC time if valid, otherwise use default
-    base_time = (rtc_time > DEFAULT_TIMESTAMP) ? rtc_time : DEFAULT_TIMESTAMP;
-    current_time = base_time;
-    timer_ticks = 0;
-}
-
-// Update time (called by timer interrupt)
-void ext2_timer_tick(void) {
-    timer_ticks++;
-    if (timer_ticks % 100 == 0) {  // Assuming 100Hz timer
-        current_time = base_time + (timer_ticks / 100);
-    }
-}
+#include <core/time.h>
+#include <fs/file.h>
+#include <fs/page_cache.h>
+#include <fs/bcache.h>
+#include <fs/dcache.h>
+#include <fs/dirhash.h>
+#include <core/smp.h>
 
 // Get current time
 uint32_t ext2_get_current_time(void) {
-    return current_time;
+    return ktime_get_real_seconds();
 }
 
 // Update access time for inode
 void ext2_update_atime(struct ext2_inode* inode) {
     if (inode) {
-        inode->i_atime = current_time;
+        inode->i_atime = ext2_get_current_time();
     }
 }
 
 // Update modification time for inode
 void ext2_update_mtime(struct ext2_inode* inode) {
     if (inode) {
-        inode->i_mtime = current_time;
+        inode->i_mtime = ext2_get_current_time();
     }
 }
 
 // Update change time for inode
 void ext2_update_ctime(struct ext2_inode* inode) {
     if (inode) {
-        inode->i_ctime = current_time;
+        inode->i_ctime = ext2_get_current_time();
     }
 }
 
 // Update all times for inode
 void ext2_update_times(struct ext2_inode* inode) {
     if (inode) {
-        uint32_t now = current_time;
+        uint32_t now = ext2_get_current_time();
         inode->i_atime = now;
         inode->i_mtime = now;
         inode->i_ctime = now;
@@ -143,44 +52,126 @@ void ext2_update_times(struct ext2_inode* inode) {
 
 // Global EXT2 filesystem instance
 static struct ext2_fs* ext2_instance = NULL;
-static nvme_device_t* nvme_dev = NULL;
+static struct block_device* block_dev = NULL;
+
+// Object caches for in-memory inodes and scratch block buffers
+static struct kmem_cache* inode_cache = NULL;
+static struct kmem_cache* block_buffer_cache = NULL;
+
+#define EXT2_ICACHE_BUCKETS (1U << EXT2_ICACHE_HASH_BITS)
+
+// In-core inode, shared by everyone holding the number. Callers only see
+// the embedded ext2_inode.
+struct ext2_icache_entry {
+    struct ext2_inode inode;
+    uint32_t inode_num;
+    uint32_t refs;
+    bool dirty;                         // Newer than the inode table
+    bool unhashed;                      // Deleted; freed on the last put
+    uint32_t prealloc_next;             // Preallocation window [next, end)
+    uint32_t prealloc_end;
+    // Mapped runs seen so far, so repeated lookups skip the indirect
+    // chain; holes are never recorded, so filling one changes nothing
+    spinlock_t extent_lock;
+    struct block_extent {
+        uint32_t logical;
+        uint32_t phys;
+        uint32_t count;                 // 0 for an empty slot
+    } extents[EXT2_BMAP_EXTENTS];
+    uint32_t extent_hand;               // Slot the next new run replaces
+    struct ext2_icache_entry* hash_next;
+    struct ext2_icache_entry* unused_prev;  // Unreferenced entries, newest first
+    struct ext2_icache_entry* unused_next;
+};
 
-// Convert block number to LBA
-static uint64_t block_to_lba(uint32_t block_num) {
-    if (!ext2_instance) return 0;
-    // Assuming standard 512-byte sectors, convert block size to sectors
-    return block_num * (ext2_instance->block_size / 512);
+// Back from an inode ext2_get_inode() returned to its entry
+static inline struct ext2_icache_entry* icache_entry(struct ext2_inode* inode) {
+    uintptr_t addr = (uintptr_t)inode - offsetof(struct ext2_icache_entry, inode);
+    return (struct ext2_icache_entry*)addr;
 }
 
-// Helper function to read blocks from NVMe device
-static bool read_blocks(uint32_t start_block, uint32_t block_count, void* buffer) {
-    if (!nvme_dev || !buffer) return false;
+static struct ext2_icache_entry* icache_hash[EXT2_ICACHE_BUCKETS];
+static struct ext2_icache_entry* icache_unused_head = NULL;
+static struct ext2_icache_entry* icache_unused_tail = NULL;
+static uint32_t icache_unused = 0;
+static spinlock_t icache_lock;
+
+// Allocation bitmaps of each group, loaded on first use and written back
+// by ext2_sync(), so allocating and freeing cost no I/O
+struct group_bitmaps {
+    uint64_t* blocks;       // As on disk
+    uint64_t* reserved;     // Free blocks held in preallocation windows; memory only
+    uint64_t* inodes;
+    bool blocks_dirty;
+    bool inodes_dirty;
+    volatile bool loaded;
+};
 
-    uint64_t lba = block_to_lba(start_block);
-    uint32_t sectors = (block_count * ext2_instance->block_size) / 512;
+static struct group_bitmaps* group_bitmaps = NULL;
+static spinlock_t alloc_lock;       // Bitmaps, free counts and preallocation windows
+
+// Group descriptors are read a table block at a time on first use. Free
+// counts change only in memory, here and in the superblock; ext2_sync()
+// writes the changed table blocks and the superblock back together.
+#define GDT_LOADED  (1U << 0)
+#define GDT_DIRTY   (1U << 1)
+
+static uint8_t* gdt_state = NULL;   // Per descriptor table block
+static uint32_t gdt_blocks = 0;
+static bool super_dirty = false;
 
-    return nvme_read(nvme_dev, 1, lba, sectors, buffer) == NVME_SUCCESS;
+static void icache_trim(uint32_t limit);
+static void icache_free(struct ext2_icache_entry* entry);
+static bool bitmaps_write_back(void);
+static void bitmaps_free(void);
+
+// Convert block number to LBA, in the device's own logical block size
+static uint64_t block_to_lba(uint32_t block_num) {
+    if (!ext2_instance) return 0;
+    return (uint64_t)block_num * (ext2_instance->block_size / block_dev->block_size);
 }
 
-// Helper function to write blocks to NVMe device
+// Helper function to write blocks to the device; cached copies are dropped
 static bool write_blocks(uint32_t start_block, uint32_t block_count, const void* buffer) {
-    if (!nvme_dev || !buffer) return false;
+    if (!block_dev || !buffer) return false;
 
     uint64_t lba = block_to_lba(start_block);
-    uint32_t sectors = (block_count * ext2_instance->block_size) / 512;
+    uint32_t sectors = (block_count * ext2_instance->block_size) / block_dev->block_size;
+
+    return bcache_write_sectors(lba, sectors, buffer);
+}
+
+// Read the superblock before the block size is known. With logical blocks
+// over 1 KiB it shares one with the boot record.
+static bool read_superblock(struct ext2_superblock* superblock) {
+    uint32_t lba_size = block_dev->block_size;
+    uint64_t first = EXT2_SUPERBLOCK_OFFSET / lba_size;
+    uint32_t count = (uint32_t)((EXT2_SUPERBLOCK_OFFSET + EXT2_SUPERBLOCK_SIZE + lba_size - 1) / lba_size - first);
+    uint8_t* buffer = malloc((size_t)count * lba_size);
+    if (!buffer) return false;
 
-    return nvme_write(nvme_dev, 1, lba, sectors, buffer) == NVME_SUCCESS;
+    bool success = bcache_read_sectors(first, count, buffer);
+    if (success) {
+        memcpy(superblock, buffer + (EXT2_SUPERBLOCK_OFFSET - first * lba_size), EXT2_SUPERBLOCK_SIZE);
+    }
+    free(buffer);
+    return success;
 }
 
 bool ext2_init(uint32_t device_id) {
-    // Initialize time handling
-    ext2_time_init();
+    // Get specified NVMe device
+    if (!ext2_init_device(nvme_get_block_device(device_id))) {
+        return false;
+    }
+    ext2_instance->device_id = device_id;
+    return true;
+}
 
-    // Get NVMe device
-    nvme_dev = nvme_get_device(device_id);  // Get specified NVMe device
-    if (!nvme_dev) {
+bool ext2_init_device(struct block_device* dev) {
+    if (!dev || !bcache_init(dev)) {
         return false;
     }
+    block_dev = dev;
 
     // Allocate filesystem instance
     ext2_instance = malloc(sizeof(struct ext2_fs));
@@ -190,9 +181,8 @@ bool ext2_init(uint32_t device_id) {
 
     // Initialize filesystem instance
     memset(ext2_instance, 0, sizeof(struct ext2_fs));
-    ext2_instance->device_id = device_id;
 
-    // Read superblock (always at block 1)
+    // Read superblock (always 1024 bytes into the volume)
     ext2_instance->superblock = malloc(sizeof(struct ext2_superblock));
     if (!ext2_instance->superblock) {
         free(ext2_instance);
@@ -201,7 +191,7 @@ bool ext2_init(uint32_t device_id) {
     }
 
     // Read the superblock from disk
-    if (!read_blocks(1, 1, ext2_instance->superblock)) {
+    if (!read_superblock(ext2_instance->superblock)) {
         free(ext2_instance->superblock);
         free(ext2_instance);
         ext2_instance = NULL;
@@ -221,85 +211,636 @@ bool ext2_init(uint32_t device_id) {
     ext2_instance->groups_count = (ext2_instance->superblock->s_blocks_count +
                                  ext2_instance->superblock->s_blocks_per_group - 1) /
                                  ext2_instance->superblock->s_blocks_per_group;
-    ext2_instance->inodes_per_block = ext2_instance->block_size / sizeof(struct ext2_inode);
-
-    // Allocate group descriptor array
-    uint32_t group_desc_size = sizeof(struct ext2_group_desc) * ext2_instance->groups_count;
-    uint32_t group_desc_blocks = (group_desc_size + ext2_instance->block_size - 1) / ext2_instance->block_size;
+    ext2_instance->inode_size = ext2_instance->superblock->s_rev_level ?
+                                ext2_instance->superblock->s_inode_size : EXT2_GOOD_OLD_INODE_SIZE;
+    if (ext2_instance->inode_size < sizeof(struct ext2_inode)) {
+        ext2_instance->inode_size = sizeof(struct ext2_inode);
+    }
+    ext2_instance->inodes_per_block = ext2_instance->block_size / ext2_instance->inode_size;
 
-    ext2_instance->group_desc = malloc(group_desc_blocks * ext2_instance->block_size);
-    if (!ext2_instance->group_desc) {
+    // Bitmaps, inode tables and indirect blocks are cached from here on
+    if (!bcache_enable(ext2_instance->block_size)) {
         free(ext2_instance->superblock);
         free(ext2_instance);
         ext2_instance = NULL;
         return false;
     }
 
-    // Read group descriptors (start at block 2)
-    if (!read_blocks(2, group_desc_blocks, ext2_instance->group_desc)) {
-        free(ext2_instance->group_desc);
+    // Room for the whole descriptor table; its blocks are read on first use
+    uint32_t group_desc_size = sizeof(struct ext2_group_desc) * ext2_instance->groups_count;
+    gdt_blocks = (group_desc_size + ext2_instance->block_size - 1) / ext2_instance->block_size;
+
+    ext2_instance->group_desc = malloc(gdt_blocks * ext2_instance->block_size);
+    gdt_state = malloc(gdt_blocks);
+    if (!ext2_instance->group_desc || !gdt_state) {
+        if (ext2_instance->group_desc) free(ext2_instance->group_desc);
+        if (gdt_state) free(gdt_state);
+        gdt_state = NULL;
         free(ext2_instance->superblock);
         free(ext2_instance);
         ext2_instance = NULL;
         return false;
     }
+    memset(gdt_state, 0, gdt_blocks);
 
-    // Verify group descriptor sanity
-    for (uint32_t i = 0; i < ext2_instance->groups_count; i++) {
-        struct ext2_group_desc* desc = &ext2_instance->group_desc[i];
-
-        // Check if block bitmap, inode bitmap, and inode table blocks are within bounds
-        if (desc->bg_block_bitmap >= ext2_instance->superblock->s_blocks_count ||
-            desc->bg_inode_bitmap >= ext2_instance->superblock->s_blocks_count ||
-            desc->bg_inode_table >= ext2_instance->superblock->s_blocks_count) {
-
-            free(ext2_instance->group_desc);
-            free(ext2_instance->superblock);
-            free(ext2_instance);
-            ext2_instance = NULL;
-            return false;
-        }
-    }
-
-    // Update mount count and time
+    // Update mount count and time; written with the first sync
     ext2_instance->superblock->s_mnt_count++;
-    ext2_instance->superblock->s_mtime = current_time;
+    ext2_instance->superblock->s_mtime = ext2_get_current_time();
+    super_dirty = true;
 
-    // Write back superblock
-    if (!write_blocks(1, 1, ext2_instance->superblock)) {
+    // Bitmaps are read per group as allocation first needs them
+    group_bitmaps = malloc(sizeof(struct group_bitmaps) * ext2_instance->groups_count);
+    if (!group_bitmaps) {
         free(ext2_instance->group_desc);
+        free(gdt_state);
+        gdt_state = NULL;
         free(ext2_instance->superblock);
         free(ext2_instance);
         ext2_instance = NULL;
         return false;
     }
+    memset(group_bitmaps, 0, sizeof(struct group_bitmaps) * ext2_instance->groups_count);
+    spinlock_init(&alloc_lock);
+
+    if (!inode_cache) {
+        inode_cache = kmem_cache_create("ext2_inode", sizeof(struct ext2_icache_entry), 8, NULL);
+        spinlock_init(&icache_lock);
+    }
+    if (!block_buffer_cache) {
+        block_buffer_cache = kmem_cache_create("ext2_block", ext2_instance->block_size,
+                                               ext2_instance->block_size, NULL);
+    }
+    page_cache_init();
+    dcache_init();
 
     // Read root inode to verify basic filesystem access
     struct ext2_inode* root_inode = ext2_get_inode(EXT2_ROOT_INO);
     if (!root_inode || !(root_inode->i_mode & EXT2_S_IFDIR)) {
-        if (root_inode) free(root_inode);
+        if (root_inode) ext2_put_inode(root_inode);
+        bitmaps_free();
         free(ext2_instance->group_desc);
+        free(gdt_state);
+        gdt_state = NULL;
         free(ext2_instance->superblock);
         free(ext2_instance);
         ext2_instance = NULL;
         return false;
     }
-    free(root_inode);
+    ext2_put_inode(root_inode);
 
     return true;
 }
 
 void ext2_cleanup(void) {
+    icache_trim(0);
+    ext2_sync();
+    bcache_shutdown();
     if (ext2_instance) {
+        bitmaps_free();
         if (ext2_instance->superblock) {
             free(ext2_instance->superblock);
         }
         if (ext2_instance->group_desc) {
             free(ext2_instance->group_desc);
         }
+        if (gdt_state) {
+            free(gdt_state);
+            gdt_state = NULL;
+        }
         free(ext2_instance);
         ext2_instance = NULL;
     }
+    if (block_buffer_cache) {
+        kmem_cache_destroy(block_buffer_cache);
+        block_buffer_cache = NULL;
+    }
+}
+
+static inline void set_bit(uint64_t* map, uint32_t bit) {
+    map[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline void clear_bit(uint64_t* map, uint32_t bit) {
+    map[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+static inline bool test_bit(const uint64_t* map, uint32_t bit) {
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+// First bit at or after start clear in both maps (extra may be NULL),
+// or nbits if there is none; scanned a word at a time
+static uint32_t find_zero_bit(const uint64_t* map, const uint64_t* extra, uint32_t nbits, uint32_t start) {
+    for (uint32_t word = start / 64; word * 64 < nbits; word++) {
+        uint64_t used = map[word] | (extra ? extra[word] : 0);
+        if (word == start / 64) used |= (1ULL << (start % 64)) - 1;
+        if (~used) {
+            uint32_t bit = word * 64 + (uint32_t)__builtin_ctzll(~used);
+            return bit < nbits ? bit : nbits;
+        }
+    }
+    return nbits;
+}
+
+// Blocks the group's bitmap covers; the last group may be short
+static uint32_t group_block_count(uint32_t group) {
+    struct ext2_superblock* sb = ext2_instance->superblock;
+    uint32_t first = sb->s_first_data_block + group * sb->s_blocks_per_group;
+    uint32_t left = sb->s_blocks_count - first;
+    return left < sb->s_blocks_per_group ? left : sb->s_blocks_per_group;
+}
+
+// The group's descriptor, reading its table block in on first use;
+// NULL if that fails or the block describes an impossible layout
+static struct ext2_group_desc* group_desc(uint32_t group) {
+    if (group >= ext2_instance->groups_count) return NULL;
+    uint32_t per_block = ext2_instance->block_size / sizeof(struct ext2_group_desc);
+    uint32_t index = group / per_block;
+    struct ext2_group_desc* table = &ext2_instance->group_desc[index * per_block];
+    if (__atomic_load_n(&gdt_state[index], __ATOMIC_ACQUIRE) & GDT_LOADED) return &ext2_instance->group_desc[group];
+
+    struct ext2_group_desc* buffer = kmem_cache_alloc(block_buffer_cache);
+    if (!buffer) return NULL;
+    bool success = ext2_read_block(ext2_instance->superblock->s_first_data_block + 1 + index, buffer);
+
+    // Bitmaps and inode tables must lie inside the volume
+    uint32_t blocks_count = ext2_instance->superblock->s_blocks_count;
+    for (uint32_t i = 0; success && i < per_block && index * per_block + i < ext2_instance->groups_count; i++) {
+        if (buffer[i].bg_block_bitmap >= blocks_count || buffer[i].bg_inode_bitmap >= blocks_count ||
+            buffer[i].bg_inode_table >= blocks_count) {
+            success = false;
+        }
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&alloc_lock);
+    if (success && !(gdt_state[index] & GDT_LOADED)) {
+        memcpy(table, buffer, ext2_instance->block_size);
+        __atomic_store_n(&gdt_state[index], GDT_LOADED, __ATOMIC_RELEASE);
+    }
+    spinlock_release_irqrestore(&alloc_lock, flags);
+
+    kmem_cache_free(block_buffer_cache, buffer);
+    return gdt_state[index] & GDT_LOADED ? &ext2_instance->group_desc[group] : NULL;
+}
+
+// Lock held. The group's descriptor and the superblock counts changed.
+static void group_dirty(uint32_t group) {
+    gdt_state[group / (ext2_instance->block_size / sizeof(struct ext2_group_desc))] |= GDT_DIRTY;
+    super_dirty = true;
+}
+
+// Read the group's bitmaps in if they are not in memory yet
+static bool group_load(uint32_t group) {
+    struct group_bitmaps* bitmaps = &group_bitmaps[group];
+    if (__atomic_load_n(&bitmaps->loaded, __ATOMIC_ACQUIRE)) return true;
+    struct ext2_group_desc* desc = group_desc(group);
+    if (!desc) return false;
+
+    uint32_t size = ext2_instance->block_size;
+    uint64_t* blocks = malloc(size);
+    uint64_t* reserved = malloc(size);
+    uint64_t* inodes = malloc(size);
+    bool success = blocks && reserved && inodes &&
+                   ext2_read_block(desc->bg_block_bitmap, blocks) &&
+                   ext2_read_block(desc->bg_inode_bitmap, inodes);
+
+    uint64_t flags = spinlock_acquire_irqsave(&alloc_lock);
+    if (success && !bitmaps->loaded) {
+        memset(reserved, 0, size);
+        bitmaps->blocks = blocks;
+        bitmaps->reserved = reserved;
+        bitmaps->inodes = inodes;
+        __atomic_store_n(&bitmaps->loaded, true, __ATOMIC_RELEASE);
+        blocks = reserved = inodes = NULL;
+    }
+    spinlock_release_irqrestore(&alloc_lock, flags);
+
+    // Lost the race, or failed
+    if (blocks) free(blocks);
+    if (reserved) free(reserved);
+    if (inodes) free(inodes);
+    return __atomic_load_n(&bitmaps->loaded, __ATOMIC_ACQUIRE);
+}
+
+// Group and bit of a block number; false if it is outside the data area
+static bool block_position(uint32_t block_num, uint32_t* group, uint32_t* bit) {
+    struct ext2_superblock* sb = ext2_instance->superblock;
+    if (block_num < sb->s_first_data_block || block_num >= sb->s_blocks_count) return false;
+    *group = (block_num - sb->s_first_data_block) / sb->s_blocks_per_group;
+    *bit = (block_num - sb->s_first_data_block) % sb->s_blocks_per_group;
+    return true;
+}
+
+// Lock held. Give back what is left of an inode's preallocation window.
+static void release_window_locked(struct ext2_icache_entry* entry) {
+    uint32_t group = 0, bit = 0;
+    for (uint32_t block = entry->prealloc_next; block < entry->prealloc_end; block++) {
+        if (block_position(block, &group, &bit)) clear_bit(group_bitmaps[group].reserved, bit);
+    }
+    entry->prealloc_next = entry->prealloc_end = 0;
+}
+
+static void release_window(struct ext2_icache_entry* entry) {
+    if (!group_bitmaps || entry->prealloc_next == entry->prealloc_end) return;
+    uint64_t flags = spinlock_acquire_irqsave(&alloc_lock);
+    release_window_locked(entry);
+    spinlock_release_irqrestore(&alloc_lock, flags);
+}
+
+// Lock held, group loaded. Mark a free block allocated.
+static void take_block(uint32_t group, uint32_t bit) {
+    set_bit(group_bitmaps[group].blocks, bit);
+    group_bitmaps[group].blocks_dirty = true;
+    ext2_instance->group_desc[group].bg_free_blocks_count--;
+    ext2_instance->superblock->s_free_blocks_count--;
+    group_dirty(group);
+}
+
+// Allocate the first free block at or after goal, trying the rest of its
+// group and then the following groups. For an inode, an allocation that
+// continues its preallocation window takes the next block of it, and a
+// fresh one reserves the free blocks right after it as a new window, so
+// files grown a block at a time still come out contiguous.
+static uint32_t allocate_block_near(uint32_t goal, struct ext2_icache_entry* entry) {
+    if (!ext2_instance || !group_bitmaps) return 0;
+    struct ext2_superblock* sb = ext2_instance->superblock;
+
+    uint64_t flags = spinlock_acquire_irqsave(&alloc_lock);
+    if (entry && entry->prealloc_next < entry->prealloc_end) {
+        if (!goal || goal == entry->prealloc_next) {
+            uint32_t block = entry->prealloc_next++;
+            uint32_t group = 0, bit = 0;
+            block_position(block, &group, &bit);
+            clear_bit(group_bitmaps[group].reserved, bit);
+            take_block(group, bit);
+            spinlock_release_irqrestore(&alloc_lock, flags);
+            return block;
+        }
+        release_window_locked(entry);
+    }
+    spinlock_release_irqrestore(&alloc_lock, flags);
+
+    // Without a goal, start in the inode's own group
+    uint32_t start_group, start_bit;
+    if (!block_position(goal, &start_group, &start_bit)) {
+        start_group = entry ? (entry->inode_num - 1) / sb->s_inodes_per_group : 0;
+        if (start_group >= ext2_instance->groups_count) start_group = 0;
+        start_bit = 0;
+    }
+
+    // The start group comes round again at the end for the bits before the goal
+    for (uint32_t i = 0; i <= ext2_instance->groups_count; i++) {
+        uint32_t group = (start_group + i) % ext2_instance->groups_count;
+        uint32_t from = i == 0 ? start_bit : 0;
+        if (i == ext2_instance->groups_count && !start_bit) break;
+        struct ext2_group_desc* desc = group_desc(group);
+        if (!desc || desc->bg_free_blocks_count == 0 || !group_load(group)) continue;
+
+        uint32_t nbits = group_block_count(group);
+        flags = spinlock_acquire_irqsave(&alloc_lock);
+        struct group_bitmaps* bitmaps = &group_bitmaps[group];
+        uint32_t bit = find_zero_bit(bitmaps->blocks, bitmaps->reserved, nbits, from);
+        if (bit >= nbits) {
+            spinlock_release_irqrestore(&alloc_lock, flags);
+            continue;
+        }
+        take_block(group, bit);
+        uint32_t block = sb->s_first_data_block + group * sb->s_blocks_per_group + bit;
+
+        if (entry) {
+            uint32_t count = 0;
+            while (count < EXT2_PREALLOC_BLOCKS && bit + 1 + count < nbits &&
+                   !test_bit(bitmaps->blocks, bit + 1 + count) &&
+                   !test_bit(bitmaps->reserved, bit + 1 + count)) {
+                set_bit(bitmaps->reserved, bit + 1 + count);
+                count++;
+            }
+            entry->prealloc_next = block + 1;
+            entry->prealloc_end = block + 1 + count;
+        }
+        spinlock_release_irqrestore(&alloc_lock, flags);
+        return block;
+    }
+
+    return 0;  // No free blocks found
+}
+
+bool ext2_set_block_bitmap(uint32_t block_num, bool used) {
+    uint32_t group = 0, bit = 0;
+    if (!ext2_instance || !group_bitmaps || !block_position(block_num, &group, &bit) || !group_load(group)) {
+        return false;
+    }
+
+    // Only a change of state moves the free counts
+    uint64_t flags = spinlock_acquire_irqsave(&alloc_lock);
+    struct group_bitmaps* bitmaps = &group_bitmaps[group];
+    bool changed = test_bit(bitmaps->blocks, bit) != used;
+    if (changed && used) {
+        clear_bit(bitmaps->reserved, bit);
+        take_block(group, bit);
+    } else if (changed) {
+        clear_bit(bitmaps->blocks, bit);
+        bitmaps->blocks_dirty = true;
+        ext2_instance->group_desc[group].bg_free_blocks_count++;
+        ext2_instance->superblock->s_free_blocks_count++;
+        group_dirty(group);
+    }
+    spinlock_release_irqrestore(&alloc_lock, flags);
+    return changed;
+}
+
+bool ext2_test_block_bitmap(uint32_t block_num) {
+    uint32_t group = 0, bit = 0;
+    if (!ext2_instance || !group_bitmaps || !block_position(block_num, &group, &bit) || !group_load(group)) {
+        return false;
+    }
+    return test_bit(group_bitmaps[group].blocks, bit);
+}
+
+bool ext2_set_inode_bitmap(uint32_t inode_num, bool used) {
+    if (!ext2_instance || !group_bitmaps || inode_num == 0 ||
+        inode_num > ext2_instance->superblock->s_inodes_count) {
+        return false;
+    }
+    uint32_t group = (inode_num - 1) / ext2_instance->superblock->s_inodes_per_group;
+    uint32_t bit = (inode_num - 1) % ext2_instance->superblock->s_inodes_per_group;
+    if (!group_load(group)) return false;
+
+    uint64_t flags = spinlock_acquire_irqsave(&alloc_lock);
+    struct group_bitmaps* bitmaps = &group_bitmaps[group];
+    bool changed = test_bit(bitmaps->inodes, bit) != used;
+    if (changed) {
+        if (used) set_bit(bitmaps->inodes, bit);
+        else clear_bit(bitmaps->inodes, bit);
+        bitmaps->inodes_dirty = true;
+        ext2_instance->group_desc[group].bg_free_inodes_count += used ? -1 : 1;
+        ext2_instance->superblock->s_free_inodes_count += used ? -1 : 1;
+        group_dirty(group);
+    }
+    spinlock_release_irqrestore(&alloc_lock, flags);
+    return changed;
+}
+
+bool ext2_test_inode_bitmap(uint32_t inode_num) {
+    if (!ext2_instance || !group_bitmaps || inode_num == 0 ||
+        inode_num > ext2_instance->superblock->s_inodes_count) {
+        return false;
+    }
+    uint32_t group = (inode_num - 1) / ext2_instance->superblock->s_inodes_per_group;
+    uint32_t bit = (inode_num - 1) % ext2_instance->superblock->s_inodes_per_group;
+    if (!group_load(group)) return false;
+    return test_bit(group_bitmaps[group].inodes, bit);
+}
+
+// Write changed bitmaps to their blocks; they reach the disk with the
+// rest of the block cache
+static bool bitmaps_write_back(void) {
+    if (!group_bitmaps) return true;
+
+    void* buffer = kmem_cache_alloc(block_buffer_cache);
+    if (!buffer) return false;
+
+    bool success = true;
+    for (uint32_t group = 0; group < ext2_instance->groups_count; group++) {
+        struct group_bitmaps* bitmaps = &group_bitmaps[group];
+        for (int inodes = 0; inodes < 2; inodes++) {
+            bool* dirty = inodes ? &bitmaps->inodes_dirty : &bitmaps->blocks_dirty;
+
+            // Snapshot under the lock; a change meanwhile dirties it again
+            uint64_t flags = spinlock_acquire_irqsave(&alloc_lock);
+            bool write = *dirty;
+            if (write) {
+                memcpy(buffer, inodes ? bitmaps->inodes : bitmaps->blocks, ext2_instance->block_size);
+                *dirty = false;
+            }
+            spinlock_release_irqrestore(&alloc_lock, flags);
+            if (!write) continue;
+
+            struct ext2_group_desc* desc = &ext2_instance->group_desc[group];
+            if (!ext2_write_block(inodes ? desc->bg_inode_bitmap : desc->bg_block_bitmap, buffer)) {
+                flags = spinlock_acquire_irqsave(&alloc_lock);
+                *dirty = true;
+                spinlock_release_irqrestore(&alloc_lock, flags);
+                success = false;
+            }
+        }
+    }
+
+    kmem_cache_free(block_buffer_cache, buffer);
+    return success;
+}
+
+// Write changed descriptor table blocks through the block cache, then
+// the superblock with its free counts
+static bool counters_write_back(void) {
+    if (!gdt_state) return true;
+
+    void* buffer = kmem_cache_alloc(block_buffer_cache);
+    if (!buffer) return false;
+
+    bool success = true;
+    uint32_t per_block = ext2_instance->block_size / sizeof(struct ext2_group_desc);
+    for (uint32_t index = 0; index < gdt_blocks; index++) {
+        uint64_t flags = spinlock_acquire_irqsave(&alloc_lock);
+        bool write = gdt_state[index] & GDT_DIRTY;
+        if (write) {
+            memcpy(buffer, &ext2_instance->group_desc[index * per_block], ext2_instance->block_size);
+            gdt_state[index] &= ~GDT_DIRTY;
+        }
+        spinlock_release_irqrestore(&alloc_lock, flags);
+
+        if (write && !ext2_write_block(ext2_instance->superblock->s_first_data_block + 1 + index, buffer)) {
+            flags = spinlock_acquire_irqsave(&alloc_lock);
+            gdt_state[index] |= GDT_DIRTY;
+            spinlock_release_irqrestore(&alloc_lock, flags);
+            success = false;
+        }
+    }
+
+    // Written on its own, unless it shares a logical block with the boot
+    // record; then it is patched into the filesystem block holding it
+    uint32_t lba_size = block_dev->block_size;
+    uint32_t super_block = EXT2_SUPERBLOCK_OFFSET / ext2_instance->block_size;
+    uint32_t offset = 0;
+    bool patch = lba_size > EXT2_SUPERBLOCK_SIZE;
+    bool loaded = false;
+    if (patch && __atomic_load_n(&super_dirty, __ATOMIC_RELAXED)) {
+        offset = EXT2_SUPERBLOCK_OFFSET % ext2_instance->block_size;
+        loaded = ext2_read_block(super_block, buffer);
+        if (!loaded) success = false;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&alloc_lock);
+    bool write = super_dirty && (!patch || loaded);
+    if (write) {
+        memcpy((uint8_t*)buffer + offset, ext2_instance->superblock, EXT2_SUPERBLOCK_SIZE);
+        super_dirty = false;
+    }
+    spinlock_release_irqrestore(&alloc_lock, flags);
+
+    if (write && !(patch ? ext2_write_block(super_block, buffer)
+                         : bcache_write_sectors(EXT2_SUPERBLOCK_OFFSET / lba_size,
+                                                EXT2_SUPERBLOCK_SIZE / lba_size, buffer))) {
+        flags = spinlock_acquire_irqsave(&alloc_lock);
+        super_dirty = true;
+        spinlock_release_irqrestore(&alloc_lock, flags);
+        success = false;
+    }
+
+    kmem_cache_free(block_buffer_cache, buffer);
+    return success;
+}
+
+static void bitmaps_free(void) {
+    if (!group_bitmaps) return;
+    for (uint32_t group = 0; group < ext2_instance->groups_count; group++) {
+        struct group_bitmaps* bitmaps = &group_bitmaps[group];
+        if (!bitmaps->loaded) continue;
+        free(bitmaps->blocks);
+        free(bitmaps->reserved);
+        free(bitmaps->inodes);
+    }
+    free(group_bitmaps);
+    group_bitmaps = NULL;
+}
+
+// Block and offset of an inode in its group's inode table
+static bool inode_location(uint32_t inode_num, uint32_t* block, uint32_t* offset) {
+    if (inode_num == 0 || inode_num > ext2_instance->superblock->s_inodes_count) return false;
+    uint32_t group = (inode_num - 1) / ext2_instance->superblock->s_inodes_per_group;
+    uint32_t index = (inode_num - 1) % ext2_instance->superblock->s_inodes_per_group;
+    struct ext2_group_desc* desc = group_desc(group);
+    if (!desc) return false;
+
+    *block = desc->bg_inode_table +
+             (index * ext2_instance->inode_size) / ext2_instance->block_size;
+    *offset = (index * ext2_instance->inode_size) % ext2_instance->block_size;
+    return true;
+}
+
+// Copy an inode into its inode-table block
+static bool inode_write_back(uint32_t inode_num, const struct ext2_inode* inode) {
+    uint32_t block, offset;
+    if (!inode_location(inode_num, &block, &offset)) return false;
+
+    void* buffer = kmem_cache_alloc(block_buffer_cache);
+    if (!buffer) return false;
+
+    bool success = ext2_read_block(block, buffer);
+    if (success) {
+        memcpy((uint8_t*)buffer + offset, inode, sizeof(struct ext2_inode));
+        success = ext2_write_block(block, buffer);
+    }
+    kmem_cache_free(block_buffer_cache, buffer);
+    return success;
+}
+
+static inline uint32_t icache_bucket(uint32_t inode_num) {
+    return (uint32_t)((inode_num * 0x9E3779B97F4A7C15ULL) >> (64 - EXT2_ICACHE_HASH_BITS));
+}
+
+// Lock held
+static struct ext2_icache_entry* icache_lookup(uint32_t inode_num) {
+    for (struct ext2_icache_entry* entry = icache_hash[icache_bucket(inode_num)]; entry; entry = entry->hash_next) {
+        if (entry->inode_num == inode_num) return entry;
+    }
+    return NULL;
+}
+
+// Lock held
+static void icache_unused_unlink(struct ext2_icache_entry* entry) {
+    if (entry->unused_prev) entry->unused_prev->unused_next = entry->unused_next;
+    else icache_unused_head = entry->unused_next;
+    if (entry->unused_next) entry->unused_next->unused_prev = entry->unused_prev;
+    else icache_unused_tail = entry->unused_prev;
+    icache_unused--;
+}
+
+// Lock held
+static void icache_remove(struct ext2_icache_entry* entry) {
+    struct ext2_icache_entry** link = &icache_hash[icache_bucket(entry->inode_num)];
+    while (*link != entry) link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    if (!entry->refs) icache_unused_unlink(entry);
+}
+
+// Forget every recorded run, once the inode's blocks are freed
+static void extents_invalidate(struct ext2_icache_entry* entry) {
+    uint64_t flags = spinlock_acquire_irqsave(&entry->extent_lock);
+    memset(entry->extents, 0, sizeof(entry->extents));
+    spinlock_release_irqrestore(&entry->extent_lock, flags);
+}
+
+static void icache_free(struct ext2_icache_entry* entry) {
+    release_window(entry);
+    kmem_cache_free(inode_cache, entry);
+}
+
+// Drop a deleted inode so its number can come back clean. Holders keep
+// their copy until they put it.
+static void icache_forget(uint32_t inode_num) {
+    uint64_t flags = spinlock_acquire_irqsave(&icache_lock);
+    struct ext2_icache_entry* entry = icache_lookup(inode_num);
+    if (entry) {
+        icache_remove(entry);
+        entry->dirty = false;
+        extents_invalidate(entry);
+        if (entry->refs) {
+            entry->unhashed = true;
+            entry = NULL;
+        }
+    }
+    spinlock_release_irqrestore(&icache_lock, flags);
+    if (entry) icache_free(entry);
+}
+
+// Write back and free unused entries, oldest first, down to the limit
+static void icache_trim(uint32_t limit) {
+    for (;;) {
+        uint64_t flags = spinlock_acquire_irqsave(&icache_lock);
+        struct ext2_icache_entry* entry = icache_unused_tail;
+        if (icache_unused <= limit || !entry) {
+            spinlock_release_irqrestore(&icache_lock, flags);
+            return;
+        }
+        if (!entry->dirty) {
+            icache_remove(entry);
+            spinlock_release_irqrestore(&icache_lock, flags);
+            icache_free(entry);
+            continue;
+        }
+
+        // Written back pinned and still hashed, as in ext2_sync(), so a
+        // lookup meanwhile finds this copy rather than the one on disk
+        entry->refs++;
+        icache_unused_unlink(entry);
+        entry->dirty = false;
+        struct ext2_inode snapshot = entry->inode;
+        spinlock_release_irqrestore(&icache_lock, flags);
+
+        bool written = inode_write_back(entry->inode_num, &snapshot);
+
+        flags = spinlock_acquire_irqsave(&icache_lock);
+        if (!written) entry->dirty = true;
+        if (--entry->refs == 0 && entry->unhashed) {
+            spinlock_release_irqrestore(&icache_lock, flags);
+            icache_free(entry);
+            continue;
+        }
+        if (entry->refs == 0) {
+            // Back at the old end, so a clean entry goes on the next pass
+            entry->unused_next = NULL;
+            entry->unused_prev = icache_unused_tail;
+            if (icache_unused_tail) icache_unused_tail->unused_next = entry;
+            else icache_unused_head = entry;
+            icache_unused_tail = entry;
+            icache_unused++;
+        }
+        spinlock_release_irqrestore(&icache_lock, flags);
+
+        // Kept dirty; stop rather than retry a failing device
+        if (!written) return;
+    }
 }
 
 struct ext2_inode* ext2_get_inode(uint32_t inode_num) {
@@ -307,38 +848,86 @@ struct ext2_inode* ext2_get_inode(uint32_t inode_num) {
         return NULL;
     }
 
-    // Calculate group and index
-    uint32_t group = (inode_num - 1) / ext2_instance->superblock->s_inodes_per_group;
-    uint32_t index = (inode_num - 1) % ext2_instance->superblock->s_inodes_per_group;
+    uint64_t flags = spinlock_acquire_irqsave(&icache_lock);
+    struct ext2_icache_entry* entry = icache_lookup(inode_num);
+    if (entry) {
+        if (entry->refs++ == 0) icache_unused_unlink(entry);
+        spinlock_release_irqrestore(&icache_lock, flags);
+        return &entry->inode;
+    }
+    spinlock_release_irqrestore(&icache_lock, flags);
 
-    // Get block containing inode
-    uint32_t block = ext2_instance->group_desc[group].bg_inode_table +
-                    (index * sizeof(struct ext2_inode)) / ext2_instance->block_size;
-    uint32_t offset = (index * sizeof(struct ext2_inode)) % ext2_instance->block_size;
+    // Miss: read it in through the block cache
+    uint32_t block, offset;
+    if (!inode_location(inode_num, &block, &offset)) return NULL;
 
-    // Allocate buffer for block
-    void* buffer = malloc(ext2_instance->block_size);
+    void* buffer = kmem_cache_alloc(block_buffer_cache);
     if (!buffer) {
         return NULL;
     }
 
-    // Read block containing inode
-    if (!read_blocks(block, 1, buffer)) {
-        free(buffer);
+    if (!ext2_read_block(block, buffer)) {
+        kmem_cache_free(block_buffer_cache, buffer);
         return NULL;
     }
 
-    // Allocate and copy inode
-    struct ext2_inode* inode = malloc(sizeof(struct ext2_inode));
-    if (!inode) {
-        free(buffer);
+    struct ext2_icache_entry* fresh = kmem_cache_alloc(inode_cache);
+    if (!fresh) {
+        kmem_cache_free(block_buffer_cache, buffer);
         return NULL;
     }
 
-    memcpy(inode, buffer + offset, sizeof(struct ext2_inode));
-    free(buffer);
+    memcpy(&fresh->inode, (uint8_t*)buffer + offset, sizeof(struct ext2_inode));
+    kmem_cache_free(block_buffer_cache, buffer);
+    fresh->inode_num = inode_num;
+    fresh->refs = 1;
+    fresh->dirty = false;
+    fresh->unhashed = false;
+    fresh->prealloc_next = fresh->prealloc_end = 0;
+    spinlock_init(&fresh->extent_lock);
+    memset(fresh->extents, 0, sizeof(fresh->extents));
+    fresh->extent_hand = 0;
+
+    // Someone else may have read it meanwhile; theirs wins
+    flags = spinlock_acquire_irqsave(&icache_lock);
+    entry = icache_lookup(inode_num);
+    if (entry) {
+        if (entry->refs++ == 0) icache_unused_unlink(entry);
+        spinlock_release_irqrestore(&icache_lock, flags);
+        kmem_cache_free(inode_cache, fresh);
+        return &entry->inode;
+    }
+    uint32_t bucket = icache_bucket(inode_num);
+    fresh->hash_next = icache_hash[bucket];
+    icache_hash[bucket] = fresh;
+    spinlock_release_irqrestore(&icache_lock, flags);
+
+    return &fresh->inode;
+}
 
-    return inode;
+void ext2_put_inode(struct ext2_inode* inode) {
+    if (!inode) return;
+    struct ext2_icache_entry* entry = icache_entry(inode);
+
+    // Unused entries stay cached, newest at the head
+    uint64_t flags = spinlock_acquire_irqsave(&icache_lock);
+    bool trim = false;
+    if (--entry->refs == 0 && entry->unhashed) {
+        spinlock_release_irqrestore(&icache_lock, flags);
+        icache_free(entry);
+        return;
+    }
+    if (entry->refs == 0) {
+        entry->unused_prev = NULL;
+        entry->unused_next = icache_unused_head;
+        if (icache_unused_head) icache_unused_head->unused_prev = entry;
+        else icache_unused_tail = entry;
+        icache_unused_head = entry;
+        trim = ++icache_unused > EXT2_ICACHE_MAX_UNUSED;
+    }
+    spinlock_release_irqrestore(&icache_lock, flags);
+
+    if (trim) icache_trim(EXT2_ICACHE_MAX_UNUSED);
 }
 
 bool ext2_read_block(uint32_t block_num, void* buffer) {
@@ -346,7 +935,7 @@ bool ext2_read_block(uint32_t block_num, void* buffer) {
         return false;
     }
 
-    return read_blocks(block_num, 1, buffer);
+    return bcache_read(block_num, buffer);
 }
 
 bool ext2_write_block(uint32_t block_num, const void* buffer) {
@@ -354,459 +943,967 @@ bool ext2_write_block(uint32_t block_num, const void* buffer) {
         return false;
     }
 
-    return write_blocks(block_num, 1, buffer);
+    return bcache_write(block_num, buffer);
 }
 
-// Allocate a new inode from the bitmap
+// Allocate a new inode from the in-memory bitmaps
 uint32_t ext2_allocate_inode(void) {
     if (!ext2_instance) return 0;
 
-    // Search through each block group
+    uint32_t per_group = ext2_instance->superblock->s_inodes_per_group;
     for (uint32_t group = 0; group < ext2_instance->groups_count; group++) {
-        struct ext2_group_desc* desc = &ext2_instance->group_desc[group];
-        if (desc->bg_free_inodes_count == 0) continue;
-
-        // Read inode bitmap
-        void* bitmap = malloc(ext2_instance->block_size);
-        if (!bitmap) return 0;
-
-        if (!ext2_read_block(desc->bg_inode_bitmap, bitmap)) {
-            free(bitmap);
-            continue;
+        struct ext2_group_desc* desc = group_desc(group);
+        if (!desc || desc->bg_free_inodes_count == 0 || !group_load(group)) continue;
+
+        uint64_t flags = spinlock_acquire_irqsave(&alloc_lock);
+        struct group_bitmaps* bitmaps = &group_bitmaps[group];
+        uint32_t bit = find_zero_bit(bitmaps->inodes, NULL, per_group, 0);
+        if (bit < per_group) {
+            set_bit(bitmaps->inodes, bit);
+            bitmaps->inodes_dirty = true;
+            desc->bg_free_inodes_count--;
+            ext2_instance->superblock->s_free_inodes_count--;
+            group_dirty(group);
         }
+        spinlock_release_irqrestore(&alloc_lock, flags);
 
-        // Find first free bit
-        for (uint32_t bit = 0; bit < ext2_instance->superblock->s_inodes_per_group; bit++) {
-            uint32_t byte_offset = bit / 8;
-            uint8_t bit_offset = bit % 8;
-
-            if (!(((uint8_t*)bitmap)[byte_offset] & (1 << bit_offset))) {
-                // Found free inode
-                ((uint8_t*)bitmap)[byte_offset] |= (1 << bit_offset);
-
-                // Write bitmap back
-                if (ext2_write_block(desc->bg_inode_bitmap, bitmap)) {
-                    // Update superblock and group descriptor
-                    desc->bg_free_inodes_count--;
-                    ext2_instance->superblock->s_free_inodes_count--;
-
-                    // Calculate inode number
-                    uint32_t inode = group * ext2_instance->superblock->s_inodes_per_group + bit + 1;
-                    free(bitmap);
-                    return inode;
-                }
-            }
-        }
-
-        free(bitmap);
+        if (bit < per_group) return group * per_group + bit + 1;
     }
 
     return 0;  // No free inodes found
 }
 
-// Write inode data to disk
+// Update the in-core inode; it reaches the disk when evicted or synced
 bool ext2_write_inode(uint32_t inode_num, struct ext2_inode* inode) {
     if (!ext2_instance || !inode || inode_num == 0) return false;
 
-    // Calculate group and index
-    uint32_t group = (inode_num - 1) / ext2_instance->superblock->s_inodes_per_group;
-    uint32_t index = (inode_num - 1) % ext2_instance->superblock->s_inodes_per_group;
+    uint64_t flags = spinlock_acquire_irqsave(&icache_lock);
+    struct ext2_icache_entry* entry = icache_lookup(inode_num);
+    if (entry) {
+        // A freshly built inode replaces whatever was cached for the number
+        if (&entry->inode != inode) memcpy(&entry->inode, inode, sizeof(struct ext2_inode));
+        entry->dirty = true;
+    }
+    spinlock_release_irqrestore(&icache_lock, flags);
 
-    // Get block containing inode
-    uint32_t block = ext2_instance->group_desc[group].bg_inode_table +
-                    (index * sizeof(struct ext2_inode)) / ext2_instance->block_size;
-    uint32_t offset = (index * sizeof(struct ext2_inode)) % ext2_instance->block_size;
+    return entry ? true : inode_write_back(inode_num, inode);
+}
 
-    // Read block
-    void* buffer = malloc(ext2_instance->block_size);
-    if (!buffer) return false;
+bool ext2_sync(void) {
+    if (!ext2_instance) return true;
+
+    // File data first: flushing it allocates blocks and grows inodes
+    bool success = page_cache_sync();
+
+    // Pin one dirty inode at a time and write a snapshot of it unlocked;
+    // a store meanwhile marks it dirty again for the next sync
+    for (uint32_t bucket = 0; bucket < EXT2_ICACHE_BUCKETS; bucket++) {
+        for (;;) {
+            uint64_t flags = spinlock_acquire_irqsave(&icache_lock);
+            struct ext2_icache_entry* entry = icache_hash[bucket];
+            while (entry && !entry->dirty) entry = entry->hash_next;
+            if (!entry) {
+                spinlock_release_irqrestore(&icache_lock, flags);
+                break;
+            }
+            if (entry->refs++ == 0) icache_unused_unlink(entry);
+            entry->dirty = false;
+            struct ext2_inode snapshot = entry->inode;
+            spinlock_release_irqrestore(&icache_lock, flags);
+
+            if (!inode_write_back(entry->inode_num, &snapshot)) {
+                flags = spinlock_acquire_irqsave(&icache_lock);
+                entry->dirty = true;
+                spinlock_release_irqrestore(&icache_lock, flags);
+                ext2_put_inode(&entry->inode);
+                success = false;
+                // Leave the rest of this bucket for the next sync
+                break;
+            }
+            ext2_put_inode(&entry->inode);
+        }
+    }
 
-    if (!ext2_read_block(block, buffer)) {
-        free(buffer);
+    if (!bitmaps_write_back()) success = false;
+    if (!counters_write_back()) success = false;
+    return bcache_sync() && success;
+}
+
+// Write data to a file
+bool ext2_write_file(uint32_t inode_num, const void* buffer, uint32_t offset, uint32_t size) {
+    struct iovec iov = { (void*)buffer, size };
+    return ext2_writev(inode_num, &iov, 1, offset) == (int64_t)size;
+}
+
+// Indirect blocks last read at each depth of the tree, so a walk over
+// consecutive logical blocks reads each of them once
+struct block_map {
+    uint32_t block[3];
+    uint32_t* data[3];
+    bool inode_dirty;       // Block pointers or i_blocks changed
+};
+
+static void block_map_release(struct block_map* map) {
+    for (int depth = 0; depth < 3; depth++) {
+        if (map->data[depth]) kmem_cache_free(block_buffer_cache, map->data[depth]);
+    }
+}
+
+// Allocate a block for the inode near goal, zeroed if zero is given, and
+// count it against the inode
+static uint32_t allocate_zeroed(struct ext2_inode* inode, struct block_map* map, uint32_t goal, void* zero) {
+    uint32_t block = allocate_block_near(goal, icache_entry(inode));
+    if (!block) return 0;
+    if (zero && !ext2_write_block(block, zero)) {
+        ext2_free_block(block);
+        return 0;
+    }
+    inode->i_blocks += ext2_instance->block_size / 512;
+    map->inode_dirty = true;
+    return block;
+}
+
+// Table in the given indirect block, read through the map
+static uint32_t* map_table(struct block_map* map, int depth, uint32_t block, bool fresh) {
+    if (map->block[depth] == block) return map->data[depth];
+    if (!map->data[depth]) {
+        map->data[depth] = kmem_cache_alloc(block_buffer_cache);
+        if (!map->data[depth]) return NULL;
+    }
+    map->block[depth] = 0;
+    if (fresh) {
+        memset(map->data[depth], 0, ext2_instance->block_size);
+    } else if (!ext2_read_block(block, map->data[depth])) {
+        return NULL;
+    }
+    map->block[depth] = block;
+    return map->data[depth];
+}
+
+// Physical block behind a logical one, 0 for a hole. With create, holes
+// are filled, indirect blocks included; *fresh reports a new data block.
+static bool map_block(struct ext2_inode* inode, uint32_t logical, struct block_map* map,
+                      bool create, uint32_t* phys, bool* fresh) {
+    uint32_t per = ext2_instance->block_size / 4;
+    uint32_t index[3];
+    int levels;
+    uint32_t slot;
+
+    if (fresh) *fresh = false;
+    if (logical < 12) {
+        levels = 0;
+        slot = logical;
+    } else if ((logical -= 12) < per) {
+        levels = 1;
+        slot = 12;
+        index[0] = logical;
+    } else if ((logical -= per) < per * per) {
+        levels = 2;
+        slot = 13;
+        index[0] = logical / per;
+        index[1] = logical % per;
+    } else if ((logical -= per * per) / per / per < per) {
+        levels = 3;
+        slot = 14;
+        index[0] = logical / per / per;
+        index[1] = (logical / per) % per;
+        index[2] = logical % per;
+    } else {
         return false;
     }
 
-    // Update inode data
-    memcpy(buffer + offset, inode, sizeof(struct ext2_inode));
+    // The slot is in table, or in i_block while table is NULL; owner is
+    // the indirect block holding table
+    uint32_t* table = NULL;
+    uint32_t owner = 0;
+    for (int depth = 0; depth <= levels; depth++) {
+        bool allocated = false;
+        uint32_t entry = table ? table[slot] : inode->i_block[slot];
+        if (!entry) {
+            if (!create) {
+                *phys = 0;
+                return true;
+            }
+            // Indirect blocks must start zeroed; data blocks are filled by the caller
+            void* zero = NULL;
+            if (depth < levels) {
+                zero = kmem_cache_alloc(block_buffer_cache);
+                if (!zero) return false;
+                memset(zero, 0, ext2_instance->block_size);
+            }
+            // Aim just past the previous slot's block, or the table's own
+            uint32_t prev = slot ? (table ? table[slot - 1] : inode->i_block[slot - 1]) : 0;
+            uint32_t goal = prev ? prev + 1 : (owner ? owner + 1 : 0);
+            entry = allocate_zeroed(inode, map, goal, zero);
+            if (zero) kmem_cache_free(block_buffer_cache, zero);
+            if (!entry) return false;
+            if (table) {
+                table[slot] = entry;
+                if (!ext2_write_block(owner, table)) return false;
+            } else {
+                inode->i_block[slot] = entry;
+            }
+            allocated = true;
+        }
+        if (depth == levels) {
+            *phys = entry;
+            if (fresh) *fresh = allocated;
+            return true;
+        }
 
-    // Write block back
-    bool success = ext2_write_block(block, buffer);
-    free(buffer);
+        owner = entry;
+        table = map_table(map, depth, owner, allocated);
+        if (!table) return false;
+        slot = index[depth];
+    }
+    return false;
+}
 
-    return success;
+// Recorded run covering logical; its length from there in *count
+static bool extent_lookup(struct ext2_icache_entry* entry, uint32_t logical, uint32_t* phys, uint32_t* count) {
+    uint64_t flags = spinlock_acquire_irqsave(&entry->extent_lock);
+    bool hit = false;
+    for (uint32_t i = 0; i < EXT2_BMAP_EXTENTS; i++) {
+        struct block_extent* extent = &entry->extents[i];
+        if (logical - extent->logical < extent->count) {
+            *phys = extent->phys + (logical - extent->logical);
+            *count = extent->count - (logical - extent->logical);
+            hit = true;
+            break;
+        }
+    }
+    spinlock_release_irqrestore(&entry->extent_lock, flags);
+    return hit;
 }
 
-// Write data to a file
-bool ext2_write_file(uint32_t inode_num, const void* buffer, uint32_t offset, uint32_t size) {
+// Record a mapped run, growing a recorded one it continues
+static void extent_insert(struct ext2_icache_entry* entry, uint32_t logical, uint32_t phys, uint32_t count) {
+    uint64_t flags = spinlock_acquire_irqsave(&entry->extent_lock);
+    struct block_extent* slot = NULL;
+    for (uint32_t i = 0; i < EXT2_BMAP_EXTENTS; i++) {
+        struct block_extent* extent = &entry->extents[i];
+        if (extent->count && extent->logical + extent->count == logical &&
+            extent->phys + extent->count == phys) {
+            extent->count += count;
+            spinlock_release_irqrestore(&entry->extent_lock, flags);
+            return;
+        }
+        if (!slot && !extent->count) slot = extent;
+    }
+    if (!slot) {
+        slot = &entry->extents[entry->extent_hand];
+        entry->extent_hand = (entry->extent_hand + 1) % EXT2_BMAP_EXTENTS;
+    }
+    slot->logical = logical;
+    slot->phys = phys;
+    slot->count = count;
+    spinlock_release_irqrestore(&entry->extent_lock, flags);
+}
+
+// Map up to count logical blocks from logical that are physically
+// consecutive, or all holes, into *phys (0 for holes). A run recorded in
+// the inode's extent cache is answered without walking the block map;
+// otherwise the walk stops at the first break and a mapped run is
+// recorded. Returns the run length, 0 on error. inode must come from
+// ext2_get_inode(), whose entry holds the extents.
+static uint32_t map_run(struct ext2_inode* inode, uint32_t logical, uint32_t count,
+                        struct block_map* map, bool create, uint32_t* phys, bool* fresh) {
+    struct ext2_icache_entry* entry = icache_entry(inode);
+    uint32_t known;
+    if (extent_lookup(entry, logical, phys, &known)) {
+        if (fresh) *fresh = false;
+        return known < count ? known : count;
+    }
+
+    if (!map_block(inode, logical, map, create, phys, fresh)) return 0;
+
+    uint32_t run = 1;
+    while (run < count) {
+        uint32_t next;
+        bool next_fresh;
+        if (!map_block(inode, logical + run, map, create, &next, &next_fresh)) break;
+        if (*phys ? next != *phys + run : next != 0) break;
+        // A run either reuses blocks or is all new, so partial blocks know
+        // whether there is anything to read back
+        if (fresh && next_fresh != *fresh) break;
+        run++;
+    }
+    if (*phys) extent_insert(entry, logical, *phys, run);
+    return run;
+}
+
+// Largest run issued as one device request
+static inline uint32_t max_run_blocks(void) {
+    uint32_t blocks = EXT2_MAX_IO_BYTES / ext2_instance->block_size;
+    return blocks ? blocks : 1;
+}
+
+// Destination usable for a transfer straight from the device
+static inline bool direct_span(void* span, size_t span_len, uint64_t bytes) {
+    return span && span_len >= bytes && ((uintptr_t)span & 3) == 0;
+}
+
+int64_t ext2_writev(uint32_t inode_num, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    uint64_t size = 0;
+    for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+    if (size == 0) return 0;
+    if (offset + size > 0xFFFFFFFFULL) return -1;
+
     struct ext2_inode* inode = ext2_get_inode(inode_num);
-    if (!inode) return false;
+    if (!inode) return -1;
 
     // Calculate block range to write
-    uint32_t start_block = offset / ext2_instance->block_size;
-    uint32_t end_block = (offset + size - 1) / ext2_instance->block_size;
-    uint32_t start_offset = offset % ext2_instance->block_size;
+    uint32_t block_size = ext2_instance->block_size;
+    uint32_t start_block = (uint32_t)(offset / block_size);
+    uint32_t end_block = (uint32_t)((offset + size - 1) / block_size);
+    uint32_t start_offset = (uint32_t)(offset % block_size);
 
-    // Allocate buffer for block operations
-    void* block_buffer = malloc(ext2_instance->block_size);
-    if (!block_buffer) {
-        free(inode);
-        return false;
+    // Staging for runs that cannot go straight from the caller's buffer
+    uint32_t max_run = max_run_blocks();
+    uint32_t span_blocks = end_block - start_block + 1;
+    if (span_blocks > max_run) span_blocks = max_run;
+    void* run_buffer = malloc((size_t)span_blocks * block_size);
+    if (!run_buffer) {
+        ext2_put_inode(inode);
+        return -1;
     }
 
     bool success = true;
-    uint32_t bytes_written = 0;
-    const uint8_t* write_ptr = (const uint8_t*)buffer;
-
-    // Write blocks
-    for (uint32_t block = start_block; success && block <= end_block; block++) {
-        // Read existing block if partial write
-        if (block == start_block ||
-            (block == end_block && (offset + size) % ext2_instance->block_size != 0)) {
-            success = ext2_read_inode_block(inode, block, block_buffer);
+    uint64_t bytes_written = 0;
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    struct block_map map = { 0 };
+
+    // Whole blocks go out a physically contiguous run at a time; a partial
+    // block at either end is merged with what is on disk
+    uint32_t block = start_block;
+    while (success && block <= end_block) {
+        uint32_t block_offset = (block == start_block) ? start_offset : 0;
+        uint64_t left = size - bytes_written;
+        bool partial = block_offset || left < block_size;
+        uint32_t want = partial ? 1 : (uint32_t)(left / block_size);
+        if (want > max_run) want = max_run;
+
+        uint32_t phys;
+        bool fresh;
+        uint32_t run = map_run(inode, block, want, &map, true, &phys, &fresh);
+        if (!run) {
+            success = false;
+            break;
         }
 
-        if (success) {
-            uint32_t block_offset = (block == start_block) ? start_offset : 0;
-            uint32_t bytes_to_write = ext2_instance->block_size - block_offset;
-
-            if (bytes_to_write > size - bytes_written) {
-                bytes_to_write = size - bytes_written;
+        if (partial) {
+            uint32_t bytes = block_size - block_offset;
+            if (bytes > left) bytes = (uint32_t)left;
+            if (fresh) {
+                memset(run_buffer, 0, block_size);
+            } else {
+                success = ext2_read_block(phys, run_buffer);
             }
-
-            memcpy((uint8_t*)block_buffer + block_offset, write_ptr, bytes_to_write);
-            success = ext2_write_inode_block(inode, block, block_buffer);
-
-            write_ptr += bytes_to_write;
-            bytes_written += bytes_to_write;
+            if (success) {
+                iov_copy_from_iter(&iter, (uint8_t*)run_buffer + block_offset, bytes);
+                success = ext2_write_block(phys, run_buffer);
+            }
+            if (success) bytes_written += bytes;
+        } else {
+            uint64_t bytes = (uint64_t)run * block_size;
+            size_t span_len;
+            void* span = iov_iter_span(&iter, &span_len);
+            if (direct_span(span, span_len, bytes)) {
+                success = write_blocks(phys, run, span);
+                if (success) iov_iter_advance(&iter, bytes);
+            } else {
+                iov_copy_from_iter(&iter, run_buffer, bytes);
+                success = write_blocks(phys, run, run_buffer);
+            }
+            if (success) bytes_written += bytes;
         }
+        block += run;
     }
 
     // Update inode size if necessary
     if (success && offset + size > inode->i_size) {
-        inode->i_size = offset + size;
-        success = ext2_write_inode(inode_num, inode);
+        inode->i_size = (uint32_t)(offset + size);
+        map.inode_dirty = true;
     }
+    // Blocks allocated before a failure still belong to the file
+    if (map.inode_dirty && !ext2_write_inode(inode_num, inode)) success = false;
 
-    free(block_buffer);
-    free(inode);
-    return success;
+    block_map_release(&map);
+    free(run_buffer);
+    ext2_put_inode(inode);
+    return success ? (int64_t)bytes_written : -1;
 }
 
 // Free an inode in the bitmap
 bool free_inode_bitmap(uint32_t inode_num) {
-    if (!ext2_instance || inode_num == 0) return false;
+    return ext2_set_inode_bitmap(inode_num, false);
+}
 
-    // Calculate group and bit offset
-    uint32_t group = (inode_num - 1) / ext2_instance->superblock->s_inodes_per_group;
-    uint32_t index = (inode_num - 1) % ext2_instance->superblock->s_inodes_per_group;
+// Hashed directory index, laid out as the host tools write it: block 0
+// keeps "." and ".." followed by a sorted (hash, block) table, with at
+// most one level of interior nodes between it and the leaves. Leaves are
+// ordinary directory blocks, so a linear scan still finds every entry.
+struct dx_root_info {
+    uint32_t reserved_zero;
+    uint8_t  hash_version;
+    uint8_t  info_length;
+    uint8_t  indirect_levels;
+    uint8_t  unused_flags;
+} __attribute__((packed));
+
+struct dx_entry {
+    uint32_t hash;   // In entry 0 this is the limit and count
+    uint32_t block;
+} __attribute__((packed));
+
+struct dx_countlimit {
+    uint16_t limit;
+    uint16_t count;
+} __attribute__((packed));
+
+#define DX_ROOT_INFO     24   // After the "." and ".." entries
+#define DX_ROOT_ENTRIES  32
+#define DX_NODE_ENTRIES  8    // After a fake entry spanning the block
+#define DX_MAX_LEVELS    2
+#define DX_BLOCK_MASK    0x0FFFFFFF
+
+struct dx_frame {
+    uint32_t logical;
+    uint8_t* buf;
+    struct dx_entry* entries;
+    struct dx_entry* at;
+};
 
-    // Read bitmap block
-    void* bitmap = malloc(ext2_instance->block_size);
-    if (!bitmap) return false;
+struct dx_path {
+    uint32_t hash;
+    uint32_t version;
+    uint32_t levels;
+    struct dx_frame frames[DX_MAX_LEVELS];
+};
 
-    if (!ext2_read_block(ext2_instance->group_desc[group].bg_inode_bitmap, bitmap)) {
-        free(bitmap);
-        return false;
-    }
+static inline struct dx_countlimit* dx_countlimit(struct dx_entry* entries) {
+    return (struct dx_countlimit*)entries;
+}
 
-    // Clear bit in bitmap
-    uint32_t byte_offset = index / 8;
-    uint8_t bit_offset = index % 8;
-    ((uint8_t*)bitmap)[byte_offset] &= ~(1 << bit_offset);
+static inline uint32_t dx_root_limit(void) {
+    return (ext2_instance->block_size - DX_ROOT_ENTRIES) / sizeof(struct dx_entry);
+}
 
-    // Write bitmap back
-    bool success = ext2_write_block(ext2_instance->group_desc[group].bg_inode_bitmap, bitmap);
-    if (success) {
-        // Update counts
-        ext2_instance->group_desc[group].bg_free_inodes_count++;
-        ext2_instance->superblock->s_free_inodes_count++;
+static inline uint32_t dx_node_limit(void) {
+    return (ext2_instance->block_size - DX_NODE_ENTRIES) / sizeof(struct dx_entry);
+}
+
+static inline bool dx_enabled(void) {
+    return ext2_instance->superblock->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX;
+}
+
+// Hash to use for a root's version, honouring the filesystem's signedness
+static uint32_t dx_version(uint32_t version) {
+    if (version <= DX_HASH_TEA && (ext2_instance->superblock->s_flags & EXT2_FLAGS_UNSIGNED_HASH)) {
+        version += DX_HASH_LEGACY_UNSIGNED;
     }
+    return version;
+}
 
-    free(bitmap);
-    return success;
+static inline uint32_t dx_hash(const char* name, uint32_t len, uint32_t version) {
+    uint32_t seed[4];
+    memcpy(seed, ext2_instance->superblock->s_hash_seed, sizeof(seed));
+    return ext2_dirhash(name, len, version, seed);
 }
 
-// Create a directory entry
-bool ext2_create_directory_entry(uint32_t dir_inode, const char* name,
-                               uint32_t inode_num, uint8_t type) {
-    struct ext2_inode* dir = ext2_get_inode(dir_inode);
-    if (!dir) return false;
+static void dx_release(struct dx_path* path) {
+    for (uint32_t i = 0; i < path->levels; i++) free(path->frames[i].buf);
+    path->levels = 0;
+}
 
-    void* block_buffer = malloc(ext2_instance->block_size);
-    if (!block_buffer) {
-        free(dir);
-        return false;
+// Last entry whose hash is at most the target; entry 0 stands for hash 0
+static struct dx_entry* dx_search(struct dx_entry* entries, uint32_t count, uint32_t hash) {
+    uint32_t low = 1, high = count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (entries[mid].hash <= hash) low = mid + 1;
+        else high = mid;
     }
+    return &entries[low - 1];
+}
 
-    bool success = false;
-    uint32_t name_len = strlen(name);
-    uint32_t entry_size = sizeof(struct ext2_dir_entry) + name_len;
-    entry_size = (entry_size + 3) & ~3;  // Round up to 4-byte boundary
-
-    // Search for space in directory blocks
-    for (uint32_t i = 0; !success && i < dir->i_blocks; i++) {
-        if (ext2_read_inode_block(dir, i, block_buffer)) {
-            uint32_t offset = 0;
-            struct ext2_dir_entry* entry;
+// Walk from the root to the leaf covering the hash of name. False if the
+// index is not one this code understands, in which case the directory is
+// treated as linear.
+static bool dx_probe(struct ext2_inode* dir, const char* name, uint32_t len, struct dx_path* path) {
+    path->levels = 0;
+    uint8_t* buf = malloc(ext2_instance->block_size);
+    if (!buf) return false;
+    if (!ext2_read_inode_block(dir, 0, buf)) {
+        free(buf);
+        return false;
+    }
 
-            // Search through entries in block
-            while (offset < ext2_instance->block_size) {
-                entry = (struct ext2_dir_entry*)((uint8_t*)block_buffer + offset);
-
-                // Check if we can fit our entry here
-                if (entry->rec_len >= entry_size + ((entry->name_len + 3) & ~3)) {
-                    // Split existing entry
-                    uint32_t new_rec_len = entry->rec_len - entry_size;
-                    entry->rec_len = (entry->name_len + 8 + 3) & ~3;
-
-                    // Create new entry
-                    entry = (struct ext2_dir_entry*)((uint8_t*)block_buffer + offset + entry->rec_len);
-                    entry->inode = inode_num;
-                    entry->rec_len = new_rec_len;
-                    entry->name_len = name_len;
-                    entry->file_type = type;
-                    memcpy(entry->name, name, name_len);
-
-                    success = ext2_write_inode_block(dir, i, block_buffer);
-                    break;
-                }
+    struct dx_root_info* info = (struct dx_root_info*)(buf + DX_ROOT_INFO);
+    if (info->reserved_zero != 0 || info->info_length != sizeof(struct dx_root_info) ||
+        info->hash_version > DX_HASH_TEA || info->indirect_levels >= DX_MAX_LEVELS) {
+        free(buf);
+        return false;
+    }
+    uint32_t depth = info->indirect_levels + 1;
+    path->version = dx_version(info->hash_version);
+    path->hash = dx_hash(name, len, path->version);
+
+    uint32_t logical = 0;
+    uint32_t offset = DX_ROOT_ENTRIES;
+    uint32_t limit = dx_root_limit();
+    uint32_t blocks = dir->i_size / ext2_instance->block_size;
+    for (uint32_t level = 0; level < depth; level++) {
+        struct dx_frame* frame = &path->frames[level];
+        frame->logical = logical;
+        frame->buf = buf;
+        frame->entries = (struct dx_entry*)(buf + offset);
+        path->levels++;
+
+        struct dx_countlimit* cl = dx_countlimit(frame->entries);
+        if (cl->limit != limit || cl->count == 0 || cl->count > limit) {
+            dx_release(path);
+            return false;
+        }
+        frame->at = dx_search(frame->entries, cl->count, path->hash);
+        logical = frame->at->block & DX_BLOCK_MASK;
+        if (logical == 0 || logical >= blocks) {
+            dx_release(path);
+            return false;
+        }
+        if (level + 1 == depth) break;
 
-                offset += entry->rec_len;
-                if (offset >= ext2_instance->block_size || entry->rec_len == 0) {
-                    break;
-                }
-            }
+        buf = malloc(ext2_instance->block_size);
+        if (!buf || !ext2_read_inode_block(dir, logical, buf)) {
+            free(buf);
+            dx_release(path);
+            return false;
         }
+        offset = DX_NODE_ENTRIES;
+        limit = dx_node_limit();
     }
-
-    free(block_buffer);
-    free(dir);
-    return success;
+    return true;
 }
 
-// Allocate a new block
-uint32_t ext2_allocate_block(void) {
-    if (!ext2_instance) return 0;
+// Leaf block the search moves to when a run of equal hashes was split,
+// or 0 once the run has ended
+static uint32_t dx_next_leaf(struct dx_path* path) {
+    struct dx_frame* frame = &path->frames[path->levels - 1];
+    struct dx_entry* next = frame->at + 1;
+    if (next >= frame->entries + dx_countlimit(frame->entries)->count) return 0;
+    if (!(next->hash & 1) || (next->hash & ~1U) != path->hash) return 0;
+    frame->at = next;
+    return next->block & DX_BLOCK_MASK;
+}
 
-    // Search through each block group
-    for (uint32_t group = 0; group < ext2_instance->groups_count; group++) {
-        struct ext2_group_desc* desc = &ext2_instance->group_desc[group];
-        if (desc->bg_free_blocks_count == 0) continue;
+// Entries of one directory block, stopping at a malformed record
+static struct ext2_dir_entry* dirent_find(uint8_t* block, const char* name, uint32_t len) {
+    uint32_t pos = 0;
+    while (pos + sizeof(struct ext2_dir_entry) <= ext2_instance->block_size) {
+        struct ext2_dir_entry* entry = (struct ext2_dir_entry*)(block + pos);
+        if (entry->rec_len < sizeof(struct ext2_dir_entry) || pos + entry->rec_len > ext2_instance->block_size) {
+            break;
+        }
+        if (entry->inode != 0 && entry->name_len == len && memcmp(entry->name, name, len) == 0) {
+            return entry;
+        }
+        pos += entry->rec_len;
+    }
+    return NULL;
+}
 
-        // Read block bitmap
-        void* bitmap = malloc(ext2_instance->block_size);
-        if (!bitmap) return 0;
+static inline uint32_t dirent_size(uint32_t name_len) {
+    return (sizeof(struct ext2_dir_entry) + name_len + 3) & ~3U;
+}
 
-        if (!ext2_read_block(desc->bg_block_bitmap, bitmap)) {
-            free(bitmap);
-            continue;
+// Put a name into the first gap that holds it, reusing a free record or
+// splitting the slack off the end of a live one
+static bool dirent_insert(uint8_t* block, const char* name, uint32_t len, uint32_t inode_num, uint8_t type) {
+    uint32_t needed = dirent_size(len);
+    uint32_t pos = 0;
+    while (pos + sizeof(struct ext2_dir_entry) <= ext2_instance->block_size) {
+        struct ext2_dir_entry* entry = (struct ext2_dir_entry*)(block + pos);
+        uint32_t rec_len = entry->rec_len;
+        if (rec_len < sizeof(struct ext2_dir_entry) || pos + rec_len > ext2_instance->block_size) {
+            return false;
         }
-
-        // Find first free block
-        for (uint32_t bit = 0; bit < ext2_instance->superblock->s_blocks_per_group; bit++) {
-            uint32_t byte_offset = bit / 8;
-            uint8_t bit_offset = bit % 8;
-
-            if (!(((uint8_t*)bitmap)[byte_offset] & (1 << bit_offset))) {
-                // Found free block
-                ((uint8_t*)bitmap)[byte_offset] |= (1 << bit_offset);
-
-                // Write bitmap back
-                if (ext2_write_block(desc->bg_block_bitmap, bitmap)) {
-                    // Update superblock and group descriptor
-                    desc->bg_free_blocks_count--;
-                    ext2_instance->superblock->s_free_blocks_count--;
-
-                    // Calculate block number
-                    uint32_t block = group * ext2_instance->superblock->s_blocks_per_group + bit;
-                    free(bitmap);
-                    return block;
-                }
+        uint32_t used = entry->inode ? dirent_size(entry->name_len) : 0;
+        if (rec_len >= used + needed) {
+            if (used) {
+                entry->rec_len = used;
+                entry = (struct ext2_dir_entry*)(block + pos + used);
+                entry->rec_len = rec_len - used;
             }
+            entry->inode = inode_num;
+            entry->name_len = len;
+            entry->file_type = type;
+            memcpy(entry->name, name, len);
+            return true;
         }
-
-        free(bitmap);
+        pos += rec_len;
     }
+    return false;
+}
 
-    return 0;  // No free blocks found
+// Lay out a block from scratch after a split
+static void dirent_init(uint8_t* block) {
+    memset(block, 0, ext2_instance->block_size);
+    struct ext2_dir_entry* entry = (struct ext2_dir_entry*)block;
+    entry->rec_len = ext2_instance->block_size;
 }
 
-bool ext2_read_inode_block(struct ext2_inode* inode, uint32_t block_num, void* buffer) {
-    if (!ext2_instance || !inode || !buffer) {
-        return false;
+static uint32_t dx_lookup(struct ext2_inode* dir, const char* name, uint32_t len, bool* indexed) {
+    struct dx_path path;
+    *indexed = dx_probe(dir, name, len, &path);
+    if (!*indexed) return 0;
+
+    uint32_t found = 0;
+    uint8_t* leaf = malloc(ext2_instance->block_size);
+    uint32_t logical = path.frames[path.levels - 1].at->block & DX_BLOCK_MASK;
+    while (leaf && logical && ext2_read_inode_block(dir, logical, leaf)) {
+        struct ext2_dir_entry* entry = dirent_find(leaf, name, len);
+        if (entry) {
+            found = entry->inode;
+            break;
+        }
+        logical = dx_next_leaf(&path);
     }
+    if (!leaf) *indexed = false;
+    free(leaf);
+    dx_release(&path);
+    return found;
+}
 
-    // Handle direct blocks
-    if (block_num < 12) {
-        return ext2_read_block(inode->i_block[block_num], buffer);
-    }
+struct dx_map {
+    uint32_t hash;
+    uint16_t offset;
+    uint16_t size;
+};
 
-    // Handle indirect blocks
-    uint32_t* block_buffer = malloc(ext2_instance->block_size);
-    if (!block_buffer) {
-        return false;
-    }
+// Append a zeroed block to the directory, returning its logical number
+static uint32_t dir_append_block(struct ext2_inode* dir, uint8_t* contents) {
+    uint32_t logical = dir->i_size / ext2_instance->block_size;
+    if (!ext2_write_inode_block(dir, logical, contents)) return 0;
+    dir->i_size += ext2_instance->block_size;
+    return logical;
+}
 
-    bool success = false;
-    block_num -= 12;
+// Open room in an index node for one more entry after at
+static void dx_insert_entry(struct dx_frame* frame, uint32_t hash, uint32_t block) {
+    struct dx_countlimit* cl = dx_countlimit(frame->entries);
+    struct dx_entry* at = frame->at + 1;
+    memmove(at + 1, at, (uint8_t*)(frame->entries + cl->count) - (uint8_t*)at);
+    at->hash = hash;
+    at->block = block;
+    cl->count++;
+}
 
-    // Single indirect
-    if (block_num < ext2_instance->block_size / 4) {
-        if (ext2_read_block(inode->i_block[12], block_buffer)) {
-            success = ext2_read_block(block_buffer[block_num], buffer);
-        }
-    }
-    // Double indirect
-    else if (block_num < (ext2_instance->block_size / 4) * (ext2_instance->block_size / 4)) {
-        block_num -= ext2_instance->block_size / 4;
-        uint32_t indirect_block = block_num / (ext2_instance->block_size / 4);
-        uint32_t indirect_offset = block_num % (ext2_instance->block_size / 4);
+// Make room in the full bottom index node, by pushing the root's
+// entries down into a new node or halving a full interior node. The
+// caller probes again afterwards.
+static bool dx_grow(struct ext2_inode* dir, struct dx_path* path) {
+    struct dx_frame* root = &path->frames[0];
+    uint8_t* node = malloc(ext2_instance->block_size);
+    if (!node) return false;
+    memset(node, 0, ext2_instance->block_size);
+    struct ext2_dir_entry* fake = (struct ext2_dir_entry*)node;
+    fake->rec_len = ext2_instance->block_size;
+    struct dx_entry* entries = (struct dx_entry*)(node + DX_NODE_ENTRIES);
 
-        if (ext2_read_block(inode->i_block[13], block_buffer)) {
-            uint32_t* indirect_ptr = block_buffer;
-            if (ext2_read_block(indirect_ptr[indirect_block], block_buffer)) {
-                success = ext2_read_block(block_buffer[indirect_offset], buffer);
-            }
+    bool success = false;
+    if (path->levels == 1) {
+        struct dx_countlimit* cl = dx_countlimit(root->entries);
+        memcpy(entries, root->entries, cl->count * sizeof(struct dx_entry));
+        dx_countlimit(entries)->limit = dx_node_limit();
+        uint32_t logical = dir_append_block(dir, node);
+        if (logical) {
+            cl->count = 1;
+            root->entries[0].block = logical;
+            ((struct dx_root_info*)(root->buf + DX_ROOT_INFO))->indirect_levels = 1;
+            success = ext2_write_inode_block(dir, 0, root->buf);
         }
-    }
-    // Triple indirect
-    else {
-        block_num -= (ext2_instance->block_size / 4) * (ext2_instance->block_size / 4);
-        uint32_t double_indirect = block_num / ((ext2_instance->block_size / 4) * (ext2_instance->block_size / 4));
-        block_num %= (ext2_instance->block_size / 4) * (ext2_instance->block_size / 4);
-        uint32_t indirect_block = block_num / (ext2_instance->block_size / 4);
-        uint32_t indirect_offset = block_num % (ext2_instance->block_size / 4);
-
-        if (ext2_read_block(inode->i_block[14], block_buffer)) {
-            uint32_t* triple_ptr = block_buffer;
-            if (ext2_read_block(triple_ptr[double_indirect], block_buffer)) {
-                uint32_t* double_ptr = block_buffer;
-                if (ext2_read_block(double_ptr[indirect_block], block_buffer)) {
-                    success = ext2_read_block(block_buffer[indirect_offset], buffer);
+    } else {
+        struct dx_frame* frame = &path->frames[1];
+        struct dx_countlimit* cl = dx_countlimit(frame->entries);
+        if (dx_countlimit(root->entries)->count < dx_countlimit(root->entries)->limit) {
+            uint32_t keep = cl->count / 2;
+            uint32_t moved = cl->count - keep;
+            memcpy(entries, frame->entries + keep, moved * sizeof(struct dx_entry));
+            uint32_t split_hash = frame->entries[keep].hash;
+            struct dx_countlimit* fresh = dx_countlimit(entries);
+            fresh->limit = dx_node_limit();
+            fresh->count = moved;
+            uint32_t logical = dir_append_block(dir, node);
+            if (logical) {
+                cl->count = keep;
+                if (ext2_write_inode_block(dir, frame->logical, frame->buf)) {
+                    dx_insert_entry(root, split_hash, logical);
+                    success = ext2_write_inode_block(dir, 0, root->buf);
                 }
             }
         }
     }
-
-    free(block_buffer);
+    free(node);
     return success;
 }
 
-void ext2_free_block(uint32_t block_num) {
-    if (!ext2_instance || block_num < ext2_instance->superblock->s_first_data_block ||
-        block_num >= ext2_instance->superblock->s_blocks_count) {
-        return;
+// Move the upper half of a full leaf, by hash, to a new block and index it
+static bool dx_split_leaf(struct ext2_inode* dir, struct dx_path* path, uint32_t logical, uint8_t* leaf) {
+    uint32_t max_entries = ext2_instance->block_size / dirent_size(1);
+    struct dx_map* map = malloc(max_entries * sizeof(struct dx_map));
+    uint8_t* upper = malloc(ext2_instance->block_size);
+    uint8_t* lower = malloc(ext2_instance->block_size);
+    bool success = false;
+    if (!map || !upper || !lower) goto out;
+
+    // Gather the live entries sorted by hash
+    uint32_t count = 0, pos = 0;
+    while (pos + sizeof(struct ext2_dir_entry) <= ext2_instance->block_size && count < max_entries) {
+        struct ext2_dir_entry* entry = (struct ext2_dir_entry*)(leaf + pos);
+        if (entry->rec_len < sizeof(struct ext2_dir_entry) || pos + entry->rec_len > ext2_instance->block_size) {
+            break;
+        }
+        if (entry->inode) {
+            struct dx_map item = { dx_hash(entry->name, entry->name_len, path->version),
+                                   (uint16_t)pos, (uint16_t)dirent_size(entry->name_len) };
+            uint32_t i = count++;
+            while (i > 0 && map[i - 1].hash > item.hash) {
+                map[i] = map[i - 1];
+                i--;
+            }
+            map[i] = item;
+        }
+        pos += entry->rec_len;
     }
+    if (count < 2) goto out;
 
-    // Calculate group and index
-    uint32_t group = (block_num - ext2_instance->superblock->s_first_data_block) /
-                    ext2_instance->superblock->s_blocks_per_group;
-    uint32_t index = (block_num - ext2_instance->superblock->s_first_data_block) %
-                    ext2_instance->superblock->s_blocks_per_group;
-
-    // Read block bitmap
-    void* bitmap = malloc(ext2_instance->block_size);
-    if (!bitmap) return;
+    // Names sharing the split hash continue into the new block, flagged
+    // in the low bit so a lookup knows to keep going
+    uint32_t split = count / 2;
+    uint32_t split_hash = map[split].hash;
+    uint32_t continued = map[split - 1].hash == split_hash;
 
-    if (!ext2_read_block(ext2_instance->group_desc[group].bg_block_bitmap, bitmap)) {
-        free(bitmap);
-        return;
+    dirent_init(lower);
+    dirent_init(upper);
+    for (uint32_t i = 0; i < count; i++) {
+        struct ext2_dir_entry* entry = (struct ext2_dir_entry*)(leaf + map[i].offset);
+        dirent_insert(i < split ? lower : upper, entry->name, entry->name_len, entry->inode, entry->file_type);
     }
 
-    // Clear bit in bitmap
-    uint32_t byte_offset = index / 8;
-    uint8_t bit_offset = index % 8;
-    ((uint8_t*)bitmap)[byte_offset] &= ~(1 << bit_offset);
+    uint32_t fresh = dir_append_block(dir, upper);
+    if (!fresh || !ext2_write_inode_block(dir, logical, lower)) goto out;
 
-    // Write bitmap back
-    if (ext2_write_block(ext2_instance->group_desc[group].bg_block_bitmap, bitmap)) {
-        // Update superblock and group descriptor
-        ext2_instance->group_desc[group].bg_free_blocks_count++;
-        ext2_instance->superblock->s_free_blocks_count++;
+    struct dx_frame* frame = &path->frames[path->levels - 1];
+    dx_insert_entry(frame, split_hash | continued, fresh);
+    success = ext2_write_inode_block(dir, frame->logical, frame->buf);
+
+out:
+    free(map);
+    free(upper);
+    free(lower);
+    return success;
+}
 
-        // Zero out the freed block (optional but safer)
-        void* zero_block = malloc(ext2_instance->block_size);
-        if (zero_block) {
-            memset(zero_block, 0, ext2_instance->block_size);
-            ext2_write_block(block_num, zero_block);
-            free(zero_block);
+// 1 once inserted, 0 if the index cannot take the name, -1 on I/O failure
+static int dx_add_entry(struct ext2_inode* dir, const char* name, uint32_t len, uint32_t inode_num, uint8_t type) {
+    uint8_t* leaf = malloc(ext2_instance->block_size);
+    if (!leaf) return -1;
+
+    int result = 0;
+    // Each pass either inserts or splits; a split may first need a grow
+    for (uint32_t attempt = 0; attempt < 4 && result == 0; attempt++) {
+        struct dx_path path;
+        if (!dx_probe(dir, name, len, &path)) break;
+
+        struct dx_frame* frame = &path.frames[path.levels - 1];
+        uint32_t logical = frame->at->block & DX_BLOCK_MASK;
+        if (!ext2_read_inode_block(dir, logical, leaf)) {
+            result = -1;
+        } else if (dirent_insert(leaf, name, len, inode_num, type)) {
+            result = ext2_write_inode_block(dir, logical, leaf) ? 1 : -1;
+        } else if (dx_countlimit(frame->entries)->count >= dx_countlimit(frame->entries)->limit) {
+            if (!dx_grow(dir, &path)) {
+                dx_release(&path);
+                break;
+            }
+        } else if (!dx_split_leaf(dir, &path, logical, leaf)) {
+            result = -1;
         }
+        dx_release(&path);
     }
+    free(leaf);
+    return result;
+}
 
-    free(bitmap);
+// Turn a full one-block directory into an indexed one: "." and ".." stay
+// in block 0 with the root, every other name moves to block 1
+static bool dx_make_indexed(struct ext2_inode* dir) {
+    uint8_t* root = malloc(ext2_instance->block_size);
+    uint8_t* leaf = malloc(ext2_instance->block_size);
+    bool success = false;
+    if (!root || !leaf || !ext2_read_inode_block(dir, 0, root)) goto out;
+
+    struct ext2_dir_entry* dot = (struct ext2_dir_entry*)root;
+    if (dot->rec_len != dirent_size(1) || dot->name_len != 1 || dot->name[0] != '.') goto out;
+    struct ext2_dir_entry* dotdot = (struct ext2_dir_entry*)(root + dot->rec_len);
+    if (dotdot->name_len != 2 || memcmp(dotdot->name, "..", 2) != 0) goto out;
+    if (dx_root_limit() < 2) goto out;
+
+    dirent_init(leaf);
+    uint32_t pos = dot->rec_len + dotdot->rec_len;
+    while (pos + sizeof(struct ext2_dir_entry) <= ext2_instance->block_size) {
+        struct ext2_dir_entry* entry = (struct ext2_dir_entry*)(root + pos);
+        if (entry->rec_len < sizeof(struct ext2_dir_entry) || pos + entry->rec_len > ext2_instance->block_size) {
+            goto out;
+        }
+        if (entry->inode) dirent_insert(leaf, entry->name, entry->name_len, entry->inode, entry->file_type);
+        pos += entry->rec_len;
+    }
+    if (dir_append_block(dir, leaf) != 1) goto out;
+
+    dotdot->rec_len = ext2_instance->block_size - dot->rec_len;
+    memset(root + DX_ROOT_INFO, 0, ext2_instance->block_size - DX_ROOT_INFO);
+    struct dx_root_info* info = (struct dx_root_info*)(root + DX_ROOT_INFO);
+    uint8_t version = ext2_instance->superblock->s_def_hash_version;
+    info->hash_version = version <= DX_HASH_TEA ? version : DX_HASH_HALF_MD4;
+    info->info_length = sizeof(struct dx_root_info);
+    struct dx_entry* entries = (struct dx_entry*)(root + DX_ROOT_ENTRIES);
+    dx_countlimit(entries)->limit = dx_root_limit();
+    dx_countlimit(entries)->count = 1;
+    entries[0].block = 1;
+    if (!ext2_write_inode_block(dir, 0, root)) goto out;
+
+    dir->i_flags |= EXT2_INDEX_FL;
+    success = true;
+
+out:
+    free(root);
+    free(leaf);
+    return success;
 }
 
-bool ext2_write_inode_block(struct ext2_inode* inode, uint32_t block_num, const void* buffer) {
-    if (!ext2_instance || !inode || !buffer) {
-        return false;
-    }
+// Create a directory entry
+bool ext2_create_directory_entry(uint32_t dir_inode, const char* name,
+                               uint32_t inode_num, uint8_t type) {
+    uint32_t name_len = strlen(name);
+    if (!ext2_instance || name_len == 0 || name_len > EXT2_NAME_LEN) return false;
 
-    // Handle direct blocks
-    if (block_num < 12) {
-        return ext2_write_block(inode->i_block[block_num], buffer);
-    }
+    struct ext2_inode* dir = ext2_get_inode(dir_inode);
+    if (!dir) return false;
 
-    // Handle indirect blocks
-    uint32_t* block_buffer = malloc(ext2_instance->block_size);
+    uint8_t* block_buffer = malloc(ext2_instance->block_size);
     if (!block_buffer) {
+        ext2_put_inode(dir);
         return false;
     }
 
     bool success = false;
-    block_num -= 12;
-
-    // Single indirect
-    if (block_num < ext2_instance->block_size / 4) {
-        if (ext2_read_block(inode->i_block[12], block_buffer)) {
-            success = ext2_write_block(block_buffer[block_num], buffer);
+    uint32_t old_size = dir->i_size;
+    uint32_t old_flags = dir->i_flags;
+    uint32_t blocks = dir->i_size / ext2_instance->block_size;
+
+    if (dir->i_flags & EXT2_INDEX_FL) {
+        int result = dx_enabled() ? dx_add_entry(dir, name, name_len, inode_num, type) : 0;
+        if (result < 0) goto out;
+        // A linear insert leaves the index stale, so stop trusting it
+        if (result == 0) dir->i_flags &= ~EXT2_INDEX_FL;
+        success = result > 0;
+    }
+
+    for (uint32_t i = 0; !success && i < blocks; i++) {
+        if (!ext2_read_inode_block(dir, i, block_buffer)) goto out;
+        if (dirent_insert(block_buffer, name, name_len, inode_num, type)) {
+            if (!ext2_write_inode_block(dir, i, block_buffer)) goto out;
+            success = true;
         }
     }
-    // Double indirect
-    else if (block_num < (ext2_instance->block_size / 4) * (ext2_instance->block_size / 4)) {
-        block_num -= ext2_instance->block_size / 4;
-        uint32_t indirect_block = block_num / (ext2_instance->block_size / 4);
-        uint32_t indirect_offset = block_num % (ext2_instance->block_size / 4);
 
-        if (ext2_read_block(inode->i_block[13], block_buffer)) {
-            uint32_t* indirect_ptr = block_buffer;
-            if (ext2_read_block(indirect_ptr[indirect_block], block_buffer)) {
-                success = ext2_write_block(block_buffer[indirect_offset], buffer);
-            }
-        }
+    // A directory outgrowing its first block gets an index when the
+    // filesystem allows one
+    if (!success && blocks == 1 && dx_enabled() && dx_make_indexed(dir)) {
+        int result = dx_add_entry(dir, name, name_len, inode_num, type);
+        if (result < 0) goto out;
+        if (result == 0) dir->i_flags &= ~EXT2_INDEX_FL;
+        success = result > 0;
     }
-    // Triple indirect
-    else {
-        block_num -= (ext2_instance->block_size / 4) * (ext2_instance->block_size / 4);
-        uint32_t double_indirect = block_num / ((ext2_instance->block_size / 4) * (ext2_instance->block_size / 4));
-        block_num %= (ext2_instance->block_size / 4) * (ext2_instance->block_size / 4);
-        uint32_t indirect_block = block_num / (ext2_instance->block_size / 4);
-        uint32_t indirect_offset = block_num % (ext2_instance->block_size / 4);
-
-        if (ext2_read_block(inode->i_block[14], block_buffer)) {
-            uint32_t* triple_ptr = block_buffer;
-            if (ext2_read_block(triple_ptr[double_indirect], block_buffer)) {
-                uint32_t* double_ptr = block_buffer;
-                if (ext2_read_block(double_ptr[indirect_block], block_buffer)) {
-                    success = ext2_write_block(block_buffer[indirect_offset], buffer);
-                }
-            }
-        }
+
+    if (!success) {
+        dirent_init(block_buffer);
+        dirent_insert(block_buffer, name, name_len, inode_num, type);
+        success = dir_append_block(dir, block_buffer) != 0;
     }
 
+out:
+    if (dir->i_size != old_size || dir->i_flags != old_flags) {
+        success = ext2_write_inode(dir_inode, dir) && success;
+    }
+    if (success) dcache_invalidate(dir_inode, name, name_len);
     free(block_buffer);
+    ext2_put_inode(dir);
     return success;
 }
 
+// Allocate a new block
+uint32_t ext2_allocate_block(void) {
+    return allocate_block_near(0, NULL);
+}
+
+bool ext2_read_inode_block(struct ext2_inode* inode, uint32_t block_num, void* buffer) {
+    if (!ext2_instance || !inode || !buffer) {
+        return false;
+    }
+
+    struct block_map map = { 0 };
+    uint32_t phys;
+    bool success = map_run(inode, block_num, 1, &map, false, &phys, NULL) != 0;
+    block_map_release(&map);
+    if (!success) return false;
+
+    // Holes read as zeros
+    if (!phys) {
+        memset(buffer, 0, ext2_instance->block_size);
+        return true;
+    }
+    return ext2_read_block(phys, buffer);
+}
+
+void ext2_free_block(uint32_t block_num) {
+    if (!ext2_set_block_bitmap(block_num, false)) return;
+
+    // Zero out the freed block (optional but safer)
+    void* zero_block = kmem_cache_alloc(block_buffer_cache);
+    if (zero_block) {
+        memset(zero_block, 0, ext2_instance->block_size);
+        ext2_write_block(block_num, zero_block);
+        kmem_cache_free(block_buffer_cache, zero_block);
+    }
+}
+
+bool ext2_write_inode_block(struct ext2_inode* inode, uint32_t block_num, const void* buffer) {
+    if (!ext2_instance || !inode || !buffer) {
+        return false;
+    }
+
+    // A hole gets a block of its own
+    struct block_map map = { 0 };
+    uint32_t phys;
+    bool success = map_run(inode, block_num, 1, &map, true, &phys, NULL) != 0;
+    block_map_release(&map);
+    if (success && map.inode_dirty) success = ext2_write_inode(icache_entry(inode)->inode_num, inode);
+    return success && ext2_write_block(phys, buffer);
+}
+
 bool ext2_read_directory(uint32_t inode_num, void (*callback)(struct ext2_dir_entry*)) {
     struct ext2_inode* inode = ext2_get_inode(inode_num);
     if (!inode || !(inode->i_mode & EXT2_S_IFDIR)) {
-        free(inode);
+        ext2_put_inode(inode);
         return false;
     }
 
     void* block_buffer = malloc(ext2_instance->block_size);
     if (!block_buffer) {
-        free(inode);
+        ext2_put_inode(inode);
         return false;
     }
 
@@ -832,20 +1929,28 @@ bool ext2_read_directory(uint32_t inode_num, void (*callback)(struct ext2_dir_en
     }
 
     free(block_buffer);
-    free(inode);
+    ext2_put_inode(inode);
     return success;
 }
 
 bool ext2_read_file(uint32_t inode_num, void* buffer, uint32_t offset, uint32_t size) {
+    struct iovec iov = { buffer, size };
+    return ext2_readv(inode_num, &iov, 1, offset) > 0;
+}
+
+int64_t ext2_readv(uint32_t inode_num, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    uint64_t size = 0;
+    for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+
     struct ext2_inode* inode = ext2_get_inode(inode_num);
     if (!inode) {
-        return false;
+        return -1;
     }
 
-    // Ensure offset and size are valid
+    // Nothing to read at or past end of file
     if (offset >= inode->i_size || size == 0) {
-        free(inode);
-        return false;
+        ext2_put_inode(inode);
+        return 0;
     }
 
     // Adjust size if it would read past end of file
@@ -854,86 +1959,163 @@ bool ext2_read_file(uint32_t inode_num, void* buffer, uint32_t offset, uint32_t
     }
 
     // Calculate block range to read
-    uint32_t start_block = offset / ext2_instance->block_size;
-    uint32_t end_block = (offset + size - 1) / ext2_instance->block_size;
-    uint32_t start_offset = offset % ext2_instance->block_size;
+    uint32_t block_size = ext2_instance->block_size;
+    uint32_t start_block = (uint32_t)(offset / block_size);
+    uint32_t end_block = (uint32_t)((offset + size - 1) / block_size);
+    uint32_t start_offset = (uint32_t)(offset % block_size);
 
-    // Allocate temporary buffer for block reads
-    void* block_buffer = malloc(ext2_instance->block_size);
-    if (!block_buffer) {
-        free(inode);
-        return false;
+    // Staging for runs that cannot land straight in the caller's buffer
+    uint32_t max_run = max_run_blocks();
+    uint32_t span_blocks = end_block - start_block + 1;
+    if (span_blocks > max_run) span_blocks = max_run;
+    void* run_buffer = malloc((size_t)span_blocks * block_size);
+    if (!run_buffer) {
+        ext2_put_inode(inode);
+        return -1;
     }
 
     bool success = true;
-    uint32_t bytes_read = 0;
-    uint8_t* write_ptr = (uint8_t*)buffer;
-
-    // Read blocks
-    for (uint32_t block = start_block; success && block <= end_block; block++) {
-        success = ext2_read_inode_block(inode, block, block_buffer);
-        if (success) {
-            uint32_t block_offset = (block == start_block) ? start_offset : 0;
-            uint32_t bytes_to_copy = ext2_instance->block_size - block_offset;
+    uint64_t bytes_read = 0;
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    struct block_map map = { 0 };
+
+    // Each physically contiguous run is a single request, made straight
+    // into the segment when it covers the run
+    uint32_t block = start_block;
+    while (success && block <= end_block) {
+        uint32_t want = end_block - block + 1;
+        if (want > max_run) want = max_run;
+
+        uint32_t phys;
+        uint32_t run = map_run(inode, block, want, &map, false, &phys, NULL);
+        if (!run) {
+            success = false;
+            break;
+        }
 
-            if (bytes_to_copy > size - bytes_read) {
-                bytes_to_copy = size - bytes_read;
+        uint32_t block_offset = (block == start_block) ? start_offset : 0;
+        uint64_t bytes = (uint64_t)run * block_size - block_offset;
+        if (bytes > size - bytes_read) bytes = size - bytes_read;
+
+        size_t span_len;
+        void* span = iov_iter_span(&iter, &span_len);
+        if (!block_offset && bytes == (uint64_t)run * block_size && direct_span(span, span_len, bytes)) {
+            if (phys) {
+                success = bcache_read_blocks(phys, run, span);
+            } else {
+                memset(span, 0, bytes);
             }
-
-            memcpy(write_ptr, (uint8_t*)block_buffer + block_offset, bytes_to_copy);
-            write_ptr += bytes_to_copy;
-            bytes_read += bytes_to_copy;
+            if (success) iov_iter_advance(&iter, bytes);
+        } else {
+            // Holes read as zeros
+            if (phys) {
+                success = bcache_read_blocks(phys, run, run_buffer);
+            } else {
+                memset(run_buffer, 0, (size_t)run * block_size);
+            }
+            if (success) iov_copy_to_iter(&iter, (uint8_t*)run_buffer + block_offset, bytes);
         }
+        if (success) bytes_read += bytes;
+        block += run;
     }
 
-    free(block_buffer);
-    free(inode);
-    return success;
+    block_map_release(&map);
+    free(run_buffer);
+    ext2_put_inode(inode);
+    return success ? (int64_t)bytes_read : -1;
 }
 
-uint32_t ext2_find_file(uint32_t dir_inode, const char* name) {
+// Scan a directory's blocks for one name
+static uint32_t find_entry(uint32_t dir_inode, const char* name, uint32_t len) {
     struct ext2_inode* inode = ext2_get_inode(dir_inode);
     if (!inode || !(inode->i_mode & EXT2_S_IFDIR)) {
-        free(inode);
+        ext2_put_inode(inode);
         return 0;
     }
 
-    void* block_buffer = malloc(ext2_instance->block_size);
+    uint32_t found_inode = 0;
+    if ((inode->i_flags & EXT2_INDEX_FL) && dx_enabled()) {
+        bool indexed;
+        found_inode = dx_lookup(inode, name, len, &indexed);
+        if (indexed) {
+            ext2_put_inode(inode);
+            return found_inode;
+        }
+    }
+
+    uint8_t* block_buffer = malloc(ext2_instance->block_size);
     if (!block_buffer) {
-        free(inode);
+        ext2_put_inode(inode);
         return 0;
     }
 
-    uint32_t found_inode = 0;
     uint32_t block_index = 0;
-
-    while (block_index * ext2_instance->block_size < inode->i_size) {
+    while (!found_inode && block_index * ext2_instance->block_size < inode->i_size) {
         if (ext2_read_inode_block(inode, block_index, block_buffer)) {
-            uint32_t pos = 0;
-            while (pos < ext2_instance->block_size) {
-                struct ext2_dir_entry* entry = (struct ext2_dir_entry*)(block_buffer + pos);
-                if (entry->inode != 0) {  // Valid entry
-                    if (strlen(name) == entry->name_len &&
-                        memcmp(name, entry->name, entry->name_len) == 0) {
-                        found_inode = entry->inode;
-                        goto cleanup;
-                    }
-                }
-                pos += entry->rec_len;
-                if (pos >= ext2_instance->block_size || entry->rec_len == 0) {
-                    break;
-                }
-            }
+            struct ext2_dir_entry* entry = dirent_find(block_buffer, name, len);
+            if (entry) found_inode = entry->inode;
         }
         block_index++;
     }
 
-cleanup:
     free(block_buffer);
-    free(inode);
+    ext2_put_inode(inode);
     return found_inode;
 }
 
+uint32_t ext2_find_entry(uint32_t dir_inode, const char* name, uint32_t len) {
+    if (!ext2_instance || len == 0 || len > EXT2_NAME_LEN) return 0;
+
+    uint32_t inode;
+    uint64_t seq;
+    if (dcache_lookup(dir_inode, name, len, &inode, &seq)) return inode;
+
+    // Misses are cached too, so repeated probes for absent names stay cheap
+    inode = find_entry(dir_inode, name, len);
+    dcache_add(dir_inode, name, len, inode, seq);
+    return inode;
+}
+
+uint32_t ext2_find_file(uint32_t dir_inode, const char* name) {
+    return ext2_find_entry(dir_inode, name, strlen(name));
+}
+
+static inline uint32_t component_len(const char* path) {
+    uint32_t len = 0;
+    while (path[len] && path[len] != '/') len++;
+    return len;
+}
+
+uint32_t ext2_lookup_parent(const char* path, const char** name) {
+    if (!ext2_instance || !path) return 0;
+
+    // There is no working directory yet, so every path starts at the root
+    uint32_t dir = EXT2_ROOT_INO;
+    while (*path == '/') path++;
+
+    for (;;) {
+        uint32_t len = component_len(path);
+        const char* next = path + len;
+        while (*next == '/') next++;
+        if (!*next) {
+            *name = path;
+            return dir;
+        }
+
+        dir = ext2_find_entry(dir, path, len);
+        if (!dir) return 0;
+        path = next;
+    }
+}
+
+uint32_t ext2_lookup_path(const char* path) {
+    const char* name;
+    uint32_t dir = ext2_lookup_parent(path, &name);
+    if (!dir || !*name) return dir;
+    return ext2_find_entry(dir, name, component_len(name));
+}
+
 uint32_t ext2_create_file(uint32_t parent_inode, const char* name, uint16_t mode) {
     // First check if file already exists
     if (ext2_find_file(parent_inode, name)) {
@@ -951,9 +2133,10 @@ uint32_t ext2_create_file(uint32_t parent_inode, const char* name, uint16_t mode
     inode.i_mode = mode;
     inode.i_uid = 0;  // Root user
     inode.i_size = 0;
-    inode.i_atime = current_time;
-    inode.i_ctime = current_time;
-    inode.i_mtime = current_time;
+    uint32_t now = ext2_get_current_time();
+    inode.i_atime = now;
+    inode.i_ctime = now;
+    inode.i_mtime = now;
     inode.i_dtime = 0;
     inode.i_gid = 0;  // Root group
     inode.i_links_count = 1;
@@ -1026,7 +2209,7 @@ uint32_t ext2_create_file(uint32_t parent_inode, const char* name, uint16_t mode
             dir_inode->i_size = ext2_instance->block_size;
             dir_inode->i_blocks = ext2_instance->block_size / 512;
             ext2_write_inode(inode_num, dir_inode);
-            free(dir_inode);
+            ext2_put_inode(dir_inode);
         }
     }
 
@@ -1046,7 +2229,7 @@ bool ext2_delete_file(uint32_t parent_inode, const char* name) {
 
     // Don't delete non-empty directories
     if ((inode->i_mode & EXT2_S_IFDIR) && inode->i_size > ext2_instance->block_size) {
-        free(inode);
+        ext2_put_inode(inode);
         return false;
     }
 
@@ -1130,9 +2313,14 @@ bool ext2_delete_file(uint32_t parent_inode, const char* name) {
         ext2_free_block(inode->i_block[14]);
     }
 
-    // Free the inode itself
+    // Free the inode itself; its number may be reused, so its pages and
+    // any names cached under it go too
+    bool is_dir = (inode->i_mode & EXT2_S_IFDIR) != 0;
+    page_cache_evict_inode(inode_num);
+    if (is_dir) dcache_invalidate_dir(inode_num);
+    icache_forget(inode_num);
     free_inode_bitmap(inode_num);
-    free(inode);
+    ext2_put_inode(inode);
 
     // Remove directory entry
     struct ext2_inode* parent = ext2_get_inode(parent_inode);
@@ -1143,7 +2331,7 @@ bool ext2_delete_file(uint32_t parent_inode, const char* name) {
     bool found = false;
     void* block_buffer = malloc(ext2_instance->block_size);
     if (!block_buffer) {
-        free(parent);
+        ext2_put_inode(parent);
         return false;
     }
 
@@ -1167,6 +2355,7 @@ bool ext2_delete_file(uint32_t parent_inode, const char* name) {
                     if (ext2_write_inode_block(parent, i, block_buffer)) {
                         found = true;
                     }
+                    dcache_invalidate(parent_inode, name, strlen(name));
                     break;
                 }
 
@@ -1182,7 +2371,7 @@ bool ext2_delete_file(uint32_t parent_inode, const char* name) {
     }
 
     free(block_buffer);
-    free(parent);
+    ext2_put_inode(parent);
 
     return found;
 }
\ No newline at end of file
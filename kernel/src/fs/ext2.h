@@ -3,10 +3,31 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <core/drivers/storage/blockdev.h>
 
 // EXT2 Superblock Constants
 #define EXT2_SUPER_MAGIC    0xEF53
 #define EXT2_ROOT_INO       2
+#define EXT2_NAME_LEN       255
+#define EXT2_MAX_IO_BYTES   (128 * 1024)  // Largest single device request for file data
+#define EXT2_SUPERBLOCK_OFFSET 1024       // Bytes into the volume, whatever the block size
+#define EXT2_SUPERBLOCK_SIZE   1024
+#define EXT2_GOOD_OLD_INODE_SIZE 128      // Inode size of revision 0
+
+// Feature and superblock flags this driver looks at
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define EXT2_FLAGS_SIGNED_HASH      0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH    0x0002
+#define EXT2_INDEX_FL               0x00001000  // Directory has a hashed index
+
+// In-core inode cache
+#define EXT2_ICACHE_HASH_BITS   10
+#define EXT2_ICACHE_MAX_UNUSED  512   // Unreferenced inodes kept before eviction
+
+// Blocks reserved past each fresh allocation for the same inode
+#define EXT2_PREALLOC_BLOCKS    8
+// Mapped runs remembered per in-core inode
+#define EXT2_BMAP_EXTENTS       8
 
 // EXT2 File Types
 #define EXT2_FT_UNKNOWN     0
@@ -68,8 +89,43 @@ struct ext2_superblock {
     uint32_t s_rev_level;
     uint16_t s_def_resuid;
     uint16_t s_def_resgid;
+    // Revision 1 and later
+    uint32_t s_first_ino;
+    uint16_t s_inode_size;
+    uint16_t s_block_group_nr;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t  s_uuid[16];
+    char     s_volume_name[16];
+    char     s_last_mounted[64];
+    uint32_t s_algorithm_usage_bitmap;
+    uint8_t  s_prealloc_blocks;
+    uint8_t  s_prealloc_dir_blocks;
+    uint16_t s_padding1;
+    uint8_t  s_journal_uuid[16];
+    uint32_t s_journal_inum;
+    uint32_t s_journal_dev;
+    uint32_t s_last_orphan;
+    uint32_t s_hash_seed[4];
+    uint8_t  s_def_hash_version;
+    uint8_t  s_reserved_char_pad;
+    uint16_t s_reserved_word_pad;
+    uint32_t s_default_mount_opts;
+    uint32_t s_first_meta_bg;
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;
+    uint32_t s_reserved[167];
 } __attribute__((packed));
 
+_Static_assert(sizeof(struct ext2_superblock) == EXT2_SUPERBLOCK_SIZE, "superblock layout");
+
 // EXT2 Block Group Descriptor
 struct ext2_group_desc {
     uint32_t bg_block_bitmap;
@@ -120,27 +176,47 @@ struct ext2_fs {
     uint32_t block_size;
     uint32_t groups_count;
     uint32_t inodes_per_block;
+    uint32_t inode_size;  // Stride of the inode tables
     uint32_t device_id;  // Reference to storage device
 };
 
 // Function declarations
 bool ext2_init(uint32_t device_id);
+// Mount from any block device, such as the boot ramdisk
+bool ext2_init_device(struct block_device* dev);
 void ext2_cleanup(void);
+// Write dirty in-core inodes and all dirty blocks to disk
+bool ext2_sync(void);
 
 // Inode operations
 struct ext2_inode* ext2_get_inode(uint32_t inode_num);
+void ext2_put_inode(struct ext2_inode* inode);
 bool ext2_read_inode_block(struct ext2_inode* inode, uint32_t block_num, void* buffer);
 bool ext2_write_inode_block(struct ext2_inode* inode, uint32_t block_num, const void* buffer);
 
 // Directory operations
 bool ext2_read_directory(uint32_t inode_num, void (*callback)(struct ext2_dir_entry*));
 uint32_t ext2_find_file(uint32_t dir_inode, const char* name);
+// Look up a name of len bytes, through the dentry cache
+uint32_t ext2_find_entry(uint32_t dir_inode, const char* name, uint32_t len);
+// Walk all but the last component of path; *name points at that component
+// within path, with any trailing slashes. 0 if a directory is missing.
+uint32_t ext2_lookup_parent(const char* path, const char** name);
+// Inode a path names, 0 if it does not exist
+uint32_t ext2_lookup_path(const char* path);
 bool ext2_create_directory_entry(uint32_t dir_inode, const char* name,
                                uint32_t inode_num, uint8_t type);
 
 // File operations
 bool ext2_read_file(uint32_t inode_num, void* buffer, uint32_t offset, uint32_t size);
 bool ext2_write_file(uint32_t inode_num, const void* buffer, uint32_t offset, uint32_t size);
+// Scatter/gather in one pass over the blocks. Return the bytes moved, 0 at
+// end of file for reads, or -1 on error.
+struct iovec;
+// Files stay under 4GB, so reads from there find end of file and writes
+// that would go past it fail.
+int64_t ext2_readv(uint32_t inode_num, const struct iovec* iov, int iovcnt, uint64_t offset);
+int64_t ext2_writev(uint32_t inode_num, const struct iovec* iov, int iovcnt, uint64_t offset);
 uint32_t ext2_create_file(uint32_t parent_inode, const char* name, uint16_t mode);
 bool ext2_delete_file(uint32_t parent_inode, const char* name);
 
@@ -161,4 +237,7 @@ uint32_t ext2_allocate_inode(void);
 bool ext2_write_inode(uint32_t inode_num, struct ext2_inode* inode);
 bool free_inode_bitmap(uint32_t inode_num);
 
+// Log create/delete, lookup, file I/O and allocation timings on the mounted volume
+void fs_benchmark(void);
+
 #endif // EXT2_H
\ No newline at end of file
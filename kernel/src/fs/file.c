@@ -0,0 +1,313 @@
+#include <fs/file.h>
+#include <fs/epoll.h>
+#include <mm/slab.h>
+#include <core/syscalls.h>
+#include <utils/mem.h>
+
+static struct kmem_cache* file_cache = NULL;
+
+void iov_iter_init(struct iov_iter* iter, const struct iovec* iov, int count) {
+    iter->iov = iov;
+    iter->count = count;
+    iter->offset = 0;
+}
+
+// Bytes left in the current segment, skipping exhausted ones
+static size_t iov_iter_chunk(struct iov_iter* iter) {
+    while (iter->count > 0 && iter->offset >= iter->iov->iov_len) {
+        iter->iov++;
+        iter->count--;
+        iter->offset = 0;
+    }
+    return iter->count > 0 ? iter->iov->iov_len - iter->offset : 0;
+}
+
+void* iov_iter_span(struct iov_iter* iter, size_t* len) {
+    *len = iov_iter_chunk(iter);
+    return *len ? (uint8_t*)iter->iov->iov_base + iter->offset : NULL;
+}
+
+size_t iov_copy_to_iter(struct iov_iter* iter, const void* src, size_t len) {
+    const uint8_t* from = src;
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = iov_iter_chunk(iter);
+        if (!chunk) break;
+        if (chunk > len - done) chunk = len - done;
+        memcpy((uint8_t*)iter->iov->iov_base + iter->offset, from + done, chunk);
+        iter->offset += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+size_t iov_copy_from_iter(struct iov_iter* iter, void* dst, size_t len) {
+    uint8_t* to = dst;
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = iov_iter_chunk(iter);
+        if (!chunk) break;
+        if (chunk > len - done) chunk = len - done;
+        memcpy(to + done, (const uint8_t*)iter->iov->iov_base + iter->offset, chunk);
+        iter->offset += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+size_t iov_iter_advance(struct iov_iter* iter, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = iov_iter_chunk(iter);
+        if (!chunk) break;
+        if (chunk > len - done) chunk = len - done;
+        iter->offset += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+void file_init(void) {
+    if (!file_cache) {
+        file_cache = kmem_cache_create("file", sizeof(struct file), 8, NULL);
+    }
+}
+
+struct file* file_alloc(void) {
+    struct file* file = kmem_cache_alloc(file_cache);
+    if (!file) return NULL;
+    memset(file, 0, sizeof(struct file));
+    file->refcount = 1;
+    return file;
+}
+
+void file_get(struct file* file) {
+    __atomic_add_fetch(&file->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void file_put(struct file* file) {
+    if (__atomic_sub_fetch(&file->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+    if (file->epitems) eventpoll_release_file(file);
+    if (file->release) file->release(file);
+    kmem_cache_free(file_cache, file);
+}
+
+static inline uint32_t full_words(uint32_t size) {
+    return (size / 64 + 63) / 64;
+}
+
+static bool fdtable_alloc_arrays(struct fd_table* table, uint32_t size) {
+    table->files = malloc(size * sizeof(struct file*));
+    table->open = malloc(size / 8);
+    table->full = malloc(full_words(size) * sizeof(uint64_t));
+    if (!table->files || !table->open || !table->full) {
+        free(table->files);
+        free(table->open);
+        free(table->full);
+        return false;
+    }
+    table->size = size;
+    return true;
+}
+
+struct fd_table* fdtable_create(void) {
+    struct fd_table* table = malloc(sizeof(struct fd_table));
+    if (!table) return NULL;
+    if (!fdtable_alloc_arrays(table, FDTABLE_INITIAL)) {
+        free(table);
+        return NULL;
+    }
+    spinlock_init(&table->lock);
+    table->refs = 1;
+    table->closed = false;
+    memset(table->files, 0, FDTABLE_INITIAL * sizeof(struct file*));
+    memset(table->open, 0, FDTABLE_INITIAL / 8);
+    memset(table->full, 0, full_words(FDTABLE_INITIAL) * sizeof(uint64_t));
+    return table;
+}
+
+struct fd_table* fdtable_clone(struct fd_table* table) {
+    struct fd_table* copy = malloc(sizeof(struct fd_table));
+    if (!copy) return NULL;
+
+    spinlock_acquire(&table->lock);
+    if (!fdtable_alloc_arrays(copy, table->size)) {
+        spinlock_release(&table->lock);
+        free(copy);
+        return NULL;
+    }
+    memcpy(copy->files, table->files, table->size * sizeof(struct file*));
+    memcpy(copy->open, table->open, table->size / 8);
+    memcpy(copy->full, table->full, full_words(table->size) * sizeof(uint64_t));
+
+    for (uint32_t word = 0; word < table->size / 64; word++) {
+        for (uint64_t bits = table->open[word]; bits; bits &= bits - 1) {
+            file_get(table->files[word * 64 + __builtin_ctzll(bits)]);
+        }
+    }
+    spinlock_release(&table->lock);
+
+    spinlock_init(&copy->lock);
+    copy->refs = 1;
+    copy->closed = false;
+    return copy;
+}
+
+void fdtable_get(struct fd_table* table) {
+    __atomic_add_fetch(&table->refs, 1, __ATOMIC_RELAXED);
+}
+
+void fdtable_put(struct fd_table* table) {
+    if (__atomic_sub_fetch(&table->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    free(table->files);
+    free(table->open);
+    free(table->full);
+    free(table);
+}
+
+void fdtable_destroy(struct fd_table* table) {
+    if (!table) return;
+
+    // Empty the table before closing anything, as a release may itself
+    // wait on a user of the table
+    spinlock_acquire(&table->lock);
+    struct file** files = table->files;
+    uint64_t* open = table->open;
+    uint32_t size = table->size;
+    free(table->full);
+    table->files = NULL;
+    table->open = NULL;
+    table->full = NULL;
+    table->size = 0;
+    table->closed = true;
+    spinlock_release(&table->lock);
+
+    for (uint32_t word = 0; word < size / 64; word++) {
+        for (uint64_t bits = open[word]; bits; bits &= bits - 1) {
+            file_put(files[word * 64 + __builtin_ctzll(bits)]);
+        }
+    }
+    free(files);
+    free(open);
+    fdtable_put(table);
+}
+
+// Double the table until fd fits. Lock held.
+static bool fdtable_grow(struct fd_table* table, uint32_t fd) {
+    if (fd >= FDTABLE_MAX) return false;
+
+    uint32_t size = table->size;
+    while (size <= fd) size *= 2;
+
+    struct file** files = realloc(table->files, size * sizeof(struct file*));
+    if (!files) return false;
+    table->files = files;
+
+    uint64_t* open = realloc(table->open, size / 8);
+    if (!open) return false;
+    table->open = open;
+
+    uint64_t* full = realloc(table->full, full_words(size) * sizeof(uint64_t));
+    if (!full) return false;
+    table->full = full;
+
+    memset(&table->files[table->size], 0, (size - table->size) * sizeof(struct file*));
+    memset(&table->open[table->size / 64], 0, (size - table->size) / 8);
+    uint32_t old_full = full_words(table->size);
+    memset(&table->full[old_full], 0, (full_words(size) - old_full) * sizeof(uint64_t));
+    table->size = size;
+    return true;
+}
+
+// Lowest free fd, or the table size if every fd is taken. Lock held.
+static uint32_t find_free(struct fd_table* table) {
+    uint32_t words = table->size / 64;
+    for (uint32_t i = 0; i < full_words(table->size); i++) {
+        uint64_t free_words = ~table->full[i];
+        if (i * 64 + 64 > words) free_words &= (1ULL << (words - i * 64)) - 1;
+        if (!free_words) continue;
+
+        uint32_t word = i * 64 + __builtin_ctzll(free_words);
+        return word * 64 + __builtin_ctzll(~table->open[word]);
+    }
+    return table->size;
+}
+
+static inline void mark_open(struct fd_table* table, uint32_t fd) {
+    uint32_t word = fd / 64;
+    table->open[word] |= 1ULL << (fd % 64);
+    if (table->open[word] == ~0ULL) table->full[word / 64] |= 1ULL << (word % 64);
+}
+
+static inline void mark_free(struct fd_table* table, uint32_t fd) {
+    uint32_t word = fd / 64;
+    table->open[word] &= ~(1ULL << (fd % 64));
+    table->full[word / 64] &= ~(1ULL << (word % 64));
+}
+
+int fd_install(struct fd_table* table, struct file* file) {
+    spinlock_acquire(&table->lock);
+    if (table->closed) {
+        spinlock_release(&table->lock);
+        return -EBADF;
+    }
+    uint32_t fd = find_free(table);
+    if (fd >= table->size && !fdtable_grow(table, fd)) {
+        spinlock_release(&table->lock);
+        return fd >= FDTABLE_MAX ? -EMFILE : -ENOMEM;
+    }
+    table->files[fd] = file;
+    mark_open(table, fd);
+    spinlock_release(&table->lock);
+    return (int)fd;
+}
+
+int fd_install_at(struct fd_table* table, int fd, struct file* file) {
+    if (fd < 0 || fd >= FDTABLE_MAX) return -EBADF;
+
+    spinlock_acquire(&table->lock);
+    if (table->closed) {
+        spinlock_release(&table->lock);
+        return -EBADF;
+    }
+    if ((uint32_t)fd >= table->size && !fdtable_grow(table, (uint32_t)fd)) {
+        spinlock_release(&table->lock);
+        return -ENOMEM;
+    }
+    struct file* old = table->files[fd];
+    table->files[fd] = file;
+    mark_open(table, (uint32_t)fd);
+    spinlock_release(&table->lock);
+
+    if (old) file_put(old);
+    return fd;
+}
+
+struct file* fd_get(struct fd_table* table, int fd) {
+    if (!table || fd < 0 || (uint32_t)fd >= table->size) return NULL;
+    return table->files[fd];
+}
+
+struct file* fd_get_ref(struct fd_table* table, int fd) {
+    if (!table || fd < 0) return NULL;
+
+    spinlock_acquire(&table->lock);
+    struct file* file = (uint32_t)fd < table->size ? table->files[fd] : NULL;
+    if (file) file_get(file);
+    spinlock_release(&table->lock);
+    return file;
+}
+
+struct file* fd_remove(struct fd_table* table, int fd) {
+    if (!table || fd < 0) return NULL;
+
+    spinlock_acquire(&table->lock);
+    struct file* file = NULL;
+    if ((uint32_t)fd < table->size && table->files[fd]) {
+        file = table->files[fd];
+        table->files[fd] = NULL;
+        mark_free(table, (uint32_t)fd);
+    }
+    spinlock_release(&table->lock);
+    return file;
+}
@@ -0,0 +1,96 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <core/smp.h>
+#include <fs/page_cache.h>
+
+#define FDTABLE_INITIAL 64       // Descriptors in a new table
+#define FDTABLE_MAX     65536    // Growth limit, a power of two
+
+// File descriptor types
+#define FD_TYPE_FILE    0
+#define FD_TYPE_SOCKET  1
+#define FD_TYPE_PIPE    2
+#define FD_TYPE_DIR     3
+#define FD_TYPE_URING   4
+#define FD_TYPE_EPOLL   5
+
+// An open file, shared by every descriptor dup()ed or fork()ed from the
+// one open() returned
+struct file {
+    uint32_t inode;
+    uint32_t offset;
+    uint32_t flags;
+    volatile uint32_t refcount;
+    void* private_data;
+    int type;
+    void (*release)(struct file* file);   // Frees private_data on the last put
+    struct epitem* epitems;               // Epoll registrations, dropped on the last put
+    struct readahead ra;                  // Sequential read detection, regular files
+    const struct file_ops* ops;           // Regular files of a mounted filesystem; NULL for ext2
+};
+
+// A process's descriptors. Bit n of open is set when fd n is in use; bit n
+// of full is set when word n of open is all ones, so the lowest free fd is
+// found in a handful of word scans at any table size.
+struct fd_table {
+    spinlock_t lock;
+    uint32_t size;               // Descriptors, a multiple of 64
+    struct file** files;
+    uint64_t* open;
+    uint64_t* full;
+    volatile uint32_t refs;      // The owner and kernel users such as io_uring
+    bool closed;                 // The owner exited; installs fail
+};
+
+// Walks an iovec array as one contiguous buffer
+struct iovec;
+struct iov_iter {
+    const struct iovec* iov;
+    int count;                   // Segments left, including the current one
+    size_t offset;               // Into the current segment
+};
+
+void iov_iter_init(struct iov_iter* iter, const struct iovec* iov, int count);
+// Copy between the segments and a flat buffer, advancing the iterator;
+// returns the bytes copied, short once the segments run out
+size_t iov_copy_to_iter(struct iov_iter* iter, const void* src, size_t len);
+size_t iov_copy_from_iter(struct iov_iter* iter, void* dst, size_t len);
+size_t iov_iter_advance(struct iov_iter* iter, size_t len);
+// Contiguous bytes at the iterator, for transfers straight into a segment
+void* iov_iter_span(struct iov_iter* iter, size_t* len);
+
+void file_init(void);
+
+// A new open file with one reference
+struct file* file_alloc(void);
+void file_get(struct file* file);
+void file_put(struct file* file);
+
+struct fd_table* fdtable_create(void);
+// Share every open file of table with a new table, for fork()
+struct fd_table* fdtable_clone(struct fd_table* table);
+// Close every descriptor and drop the owner's reference. Other holders
+// keep an empty table until their fdtable_put().
+void fdtable_destroy(struct fd_table* table);
+void fdtable_get(struct fd_table* table);
+void fdtable_put(struct fd_table* table);
+
+// Install file at the lowest free fd, taking over the caller's reference.
+// Returns the fd, -EMFILE/-ENOMEM, or -EBADF once the table is closed.
+int fd_install(struct fd_table* table, struct file* file);
+// Install file at fd, closing whatever was there; for dup2()
+int fd_install_at(struct fd_table* table, int fd, struct file* file);
+// The file behind fd or NULL. The table belongs to one process, so the
+// pointer stays valid until that process closes fd.
+struct file* fd_get(struct fd_table* table, int fd);
+// The file behind fd with a reference taken, for users outside the owning
+// process that may race with close()
+struct file* fd_get_ref(struct fd_table* table, int fd);
+// Unlink fd and hand its reference to the caller, NULL if not open
+struct file* fd_remove(struct fd_table* table, int fd);
+
+#endif // FILE_H
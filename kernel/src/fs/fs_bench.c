@@ -0,0 +1,189 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <fs/ext2.h>
+#include <core/time.h>
+#include <utils/mem.h>
+#include <utils/log.h>
+#include <mm/vmalloc.h>
+
+// Times the ext2 entry points against whichever device is mounted and logs
+// ops/sec with latency percentiles. Everything lives under /fsbench, which
+// is emptied again afterwards.
+
+#define FSBENCH_DIR        "fsbench"
+#define FSBENCH_FILES      2048                 // Names in the large directory
+#define FSBENCH_FILE_SIZE  (8 * 1024 * 1024)    // Target of the read/write runs
+#define FSBENCH_IO_BYTES   (32 * 1024 * 1024)   // Bytes moved per run
+#define FSBENCH_MAX_OPS    4096
+#define FSBENCH_BLOCKS     1024
+
+static const uint32_t io_sizes[] = { 4096, 65536, 1024 * 1024 };
+
+static uint64_t samples[FSBENCH_MAX_OPS];
+static uint32_t rng_state = 0x2545F491;
+
+static uint32_t bench_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void file_name(char* name, uint32_t n) {
+    char digits[10];
+    uint32_t len = 0;
+    do {
+        digits[len++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n);
+
+    *name++ = 'f';
+    while (len) *name++ = digits[--len];
+    *name = '\0';
+}
+
+static void sort_samples(uint64_t* a, uint32_t n) {
+    // Heapsort; n is at most FSBENCH_MAX_OPS
+    for (uint32_t start = n / 2; start-- > 0;) {
+        for (uint32_t root = start, child; (child = 2 * root + 1) < n; root = child) {
+            if (child + 1 < n && a[child] < a[child + 1]) child++;
+            if (a[root] >= a[child]) break;
+            uint64_t t = a[root]; a[root] = a[child]; a[child] = t;
+        }
+    }
+    for (uint32_t end = n; end-- > 1;) {
+        uint64_t t = a[0]; a[0] = a[end]; a[end] = t;
+        for (uint32_t root = 0, child; (child = 2 * root + 1) < end; root = child) {
+            if (child + 1 < end && a[child] < a[child + 1]) child++;
+            if (a[root] >= a[child]) break;
+            t = a[root]; a[root] = a[child]; a[child] = t;
+        }
+    }
+}
+
+static void report(const char* what, uint32_t size, uint32_t ops, uint32_t failed) {
+    if (!ops) return;
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < ops; i++) total += samples[i];
+    sort_samples(samples, ops);
+
+    // Latencies in microseconds
+    int rate = (int)(total ? (uint64_t)ops * 1000000000ULL / total : 0);
+    int p50 = (int)(samples[ops / 2] / 1000);
+    int p90 = (int)(samples[ops * 9 / 10] / 1000);
+    int p99 = (int)(samples[ops * 99 / 100] / 1000);
+    int max = (int)(samples[ops - 1] / 1000);
+    if (size) {
+        log_info("fsbench: %s %d bytes: %d ops/s, p50 %d us, p90 %d us, p99 %d us, max %d us, %d failed",
+                 what, (int)size, rate, p50, p90, p99, max, (int)failed);
+    } else {
+        log_info("fsbench: %s: %d ops/s, p50 %d us, p90 %d us, p99 %d us, max %d us, %d failed",
+                 what, rate, p50, p90, p99, max, (int)failed);
+    }
+}
+
+static void bench_io(uint32_t file, uint8_t* buffer, uint32_t size, bool random, bool write) {
+    uint32_t ops = FSBENCH_IO_BYTES / size;
+    uint32_t slots = FSBENCH_FILE_SIZE / size;
+    uint32_t failed = 0;
+    if (ops > FSBENCH_MAX_OPS) ops = FSBENCH_MAX_OPS;
+
+    for (uint32_t i = 0; i < ops; i++) {
+        uint32_t offset = (random ? bench_random() % slots : i % slots) * size;
+        uint64_t start = ktime_get_ns();
+        bool ok = write ? ext2_write_file(file, buffer, offset, size)
+                        : ext2_read_file(file, buffer, offset, size);
+        samples[i] = ktime_get_ns() - start;
+        if (!ok) failed++;
+    }
+    report(random ? (write ? "random write" : "random read")
+                  : (write ? "sequential write" : "sequential read"), size, ops, failed);
+}
+
+static void bench_names(uint32_t dir) {
+    char name[16];
+    uint32_t failed = 0;
+
+    for (uint32_t i = 0; i < FSBENCH_FILES; i++) {
+        file_name(name, i);
+        uint64_t start = ktime_get_ns();
+        if (!ext2_create_file(dir, name, EXT2_S_IFREG | 0644)) failed++;
+        samples[i] = ktime_get_ns() - start;
+    }
+    report("create", 0, FSBENCH_FILES, failed);
+
+    // The first pass reads the directory, the second hits the dentry cache
+    for (int pass = 0; pass < 2; pass++) {
+        failed = 0;
+        for (uint32_t i = 0; i < FSBENCH_FILES; i++) {
+            file_name(name, bench_random() % FSBENCH_FILES);
+            uint64_t start = ktime_get_ns();
+            if (!ext2_find_file(dir, name)) failed++;
+            samples[i] = ktime_get_ns() - start;
+        }
+        report(pass ? "lookup cached" : "lookup", 0, FSBENCH_FILES, failed);
+    }
+
+    failed = 0;
+    for (uint32_t i = 0; i < FSBENCH_FILES; i++) {
+        file_name(name, i);
+        uint64_t start = ktime_get_ns();
+        if (!ext2_delete_file(dir, name)) failed++;
+        samples[i] = ktime_get_ns() - start;
+    }
+    report("delete", 0, FSBENCH_FILES, failed);
+}
+
+static void bench_blocks(void) {
+    static uint32_t blocks[FSBENCH_BLOCKS];
+    uint32_t failed = 0;
+
+    for (uint32_t i = 0; i < FSBENCH_BLOCKS; i++) {
+        uint64_t start = ktime_get_ns();
+        blocks[i] = ext2_allocate_block();
+        samples[i] = ktime_get_ns() - start;
+        if (!blocks[i]) failed++;
+    }
+    report("block allocate", 0, FSBENCH_BLOCKS, failed);
+
+    for (uint32_t i = 0; i < FSBENCH_BLOCKS; i++) {
+        uint64_t start = ktime_get_ns();
+        if (blocks[i]) ext2_free_block(blocks[i]);
+        samples[i] = ktime_get_ns() - start;
+    }
+    report("block free", 0, FSBENCH_BLOCKS, 0);
+}
+
+void fs_benchmark(void) {
+    uint32_t dir = ext2_find_file(EXT2_ROOT_INO, FSBENCH_DIR);
+    if (!dir) dir = ext2_create_file(EXT2_ROOT_INO, FSBENCH_DIR, EXT2_S_IFDIR | 0755);
+    uint8_t* buffer = vmalloc(io_sizes[sizeof(io_sizes) / sizeof(io_sizes[0]) - 1]);
+    if (!dir || !buffer) {
+        log_error("fsbench: cannot set up /" FSBENCH_DIR);
+        if (buffer) vfree(buffer);
+        return;
+    }
+
+    bench_names(dir);
+    bench_blocks();
+
+    // Sequential writes first so the random runs find every block allocated
+    uint32_t file = ext2_create_file(dir, "data", EXT2_S_IFREG | 0644);
+    if (file) {
+        for (size_t s = 0; s < sizeof(io_sizes) / sizeof(io_sizes[0]); s++) {
+            memset(buffer, (int)s, io_sizes[s]);
+            bench_io(file, buffer, io_sizes[s], false, true);
+            bench_io(file, buffer, io_sizes[s], false, false);
+            bench_io(file, buffer, io_sizes[s], true, true);
+            bench_io(file, buffer, io_sizes[s], true, false);
+        }
+        ext2_delete_file(dir, "data");
+    } else {
+        log_error("fsbench: cannot create /" FSBENCH_DIR "/data");
+    }
+
+    ext2_delete_file(EXT2_ROOT_INO, FSBENCH_DIR);
+    ext2_sync();
+    vfree(buffer);
+}
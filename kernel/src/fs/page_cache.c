@@ -0,0 +1,689 @@
+#include <fs/page_cache.h>
+#include <fs/ext2.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/slab.h>
+#include <core/smp.h>
+#include <core/syscalls.h>
+#include <fs/file.h>
+#include <core/workqueue.h>
+#include <core/process.h>
+#include <core/wait.h>
+#include <core/time.h>
+#include <mm/heap.h>
+#include <utils/mem.h>
+#include <utils/log.h>
+
+#define PAGE_CACHE_BUCKETS (1U << PAGE_CACHE_HASH_BITS)
+
+struct cached_page {
+    uint32_t inode;
+    uint64_t index;             // Page number within the file
+    void* phys;
+    bool dirty;                 // Newer than the file; never evicted
+    struct cached_page* next;   // Hash chain
+};
+
+// Files with dirty pages, the longest dirty first
+struct dirty_file {
+    uint32_t inode;
+    uint32_t pages;
+    uint64_t dirtied_ns;        // When the first of them was dirtied
+    struct dirty_file* next;
+};
+
+static struct kmem_cache* cached_page_cache = NULL;
+static struct cached_page* page_hash[PAGE_CACHE_BUCKETS];
+static spinlock_t page_cache_lock;
+static uint32_t cached_pages = 0;
+static uint32_t evict_hand = 0;     // Bucket the next eviction sweep starts at
+static volatile uint64_t write_seq = 0;     // Bumped around write-through and by eviction, so fills can spot a race
+
+static struct kmem_cache* dirty_file_cache = NULL;
+static struct dirty_file* dirty_files = NULL;
+static volatile uint32_t dirty_pages = 0;
+static struct wait_queue flush_wait;        // The flusher, with nothing dirty
+static struct wait_queue flush_done;        // Flushes waiting their turn
+static volatile bool flushing = false;      // One flush at a time, so block mapping never races
+
+void page_cache_init(void) {
+    if (!cached_page_cache) {
+        cached_page_cache = kmem_cache_create("cached_page", sizeof(struct cached_page), 8, NULL);
+        dirty_file_cache = kmem_cache_create("dirty_file", sizeof(struct dirty_file), 8, NULL);
+        spinlock_init(&page_cache_lock);
+        wait_queue_init(&flush_wait);
+        wait_queue_init(&flush_done);
+    }
+}
+
+static inline uint32_t page_bucket(uint32_t inode, uint64_t index) {
+    uint64_t hash = (((uint64_t)inode << 32) ^ index) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(hash >> (64 - PAGE_CACHE_HASH_BITS));
+}
+
+// Lock held
+static struct cached_page* page_lookup(uint32_t inode, uint64_t index) {
+    for (struct cached_page* page = page_hash[page_bucket(inode, index)]; page; page = page->next) {
+        if (page->inode == inode && page->index == index) return page;
+    }
+    return NULL;
+}
+
+// Lock held. Drop pages only the cache still references, sweeping buckets
+// round-robin so the same files are not always the first to go.
+static void evict_unmapped(void) {
+    for (uint32_t scanned = 0; scanned < PAGE_CACHE_BUCKETS && cached_pages >= PAGE_CACHE_MAX_PAGES; scanned++) {
+        struct cached_page** link = &page_hash[evict_hand];
+        evict_hand = (evict_hand + 1) & (PAGE_CACHE_BUCKETS - 1);
+
+        while (*link) {
+            struct cached_page* page = *link;
+            if (page->dirty || pmm_page_refcount(page->phys) > 1) {
+                link = &page->next;
+                continue;
+            }
+            *link = page->next;
+            pmm_page_put(page->phys);
+            kmem_cache_free(cached_page_cache, page);
+            cached_pages--;
+        }
+    }
+}
+
+// Cached frame for the page with a reference for the caller. Without
+// fill a missing page starts zeroed, for a caller about to overwrite it.
+static void* page_get(uint32_t inode, uint64_t index, bool fill) {
+    uint64_t flags = spinlock_acquire_irqsave(&page_cache_lock);
+    struct cached_page* page = page_lookup(inode, index);
+    if (page) {
+        void* phys = page->phys;
+        pmm_page_get(phys);
+        spinlock_release_irqrestore(&page_cache_lock, flags);
+        return phys;
+    }
+    spinlock_release_irqrestore(&page_cache_lock, flags);
+
+    // Read with the lock dropped; if another miss on the page wins the race
+    // below, this copy is thrown away
+    void* phys = pmm_alloc_page();
+    if (!phys) return NULL;
+    struct cached_page* entry = kmem_cache_alloc(cached_page_cache);
+
+    uint64_t offset = index * PAGE_SIZE;
+    for (;;) {
+        uint64_t seq = __atomic_load_n(&write_seq, __ATOMIC_ACQUIRE);
+        memset(pmm_phys_to_virt(phys), 0, PAGE_SIZE);
+        if (fill) {
+            struct iovec iov = { pmm_phys_to_virt(phys), PAGE_SIZE };
+            if (ext2_readv(inode, &iov, 1, offset) < 0) {
+                pmm_free_page(phys);
+                if (entry) kmem_cache_free(cached_page_cache, entry);
+                return NULL;
+            }
+        }
+
+        // A write that finished meanwhile found nothing cached to update
+        flags = spinlock_acquire_irqsave(&page_cache_lock);
+        if (__atomic_load_n(&write_seq, __ATOMIC_ACQUIRE) == seq) break;
+        spinlock_release_irqrestore(&page_cache_lock, flags);
+    }
+
+    page = page_lookup(inode, index);
+    if (page) {
+        void* cached = page->phys;
+        pmm_page_get(cached);
+        spinlock_release_irqrestore(&page_cache_lock, flags);
+        pmm_free_page(phys);
+        if (entry) kmem_cache_free(cached_page_cache, entry);
+        return cached;
+    }
+
+    // Out of entries: hand the page over uncached
+    if (!entry) {
+        spinlock_release_irqrestore(&page_cache_lock, flags);
+        return phys;
+    }
+
+    if (cached_pages >= PAGE_CACHE_MAX_PAGES) evict_unmapped();
+
+    uint32_t bucket = page_bucket(inode, index);
+    entry->inode = inode;
+    entry->index = index;
+    entry->phys = phys;
+    entry->dirty = false;
+    entry->next = page_hash[bucket];
+    page_hash[bucket] = entry;
+    cached_pages++;
+
+    // One reference for the cache, one for the caller
+    pmm_page_get(phys);
+    spinlock_release_irqrestore(&page_cache_lock, flags);
+    return phys;
+}
+
+void* page_cache_get(uint32_t inode, uint64_t index) {
+    return page_get(inode, index, true);
+}
+
+bool page_cache_read(uint32_t inode, void* buffer, uint64_t offset, size_t size) {
+    uint8_t* out = buffer;
+    while (size) {
+        uint64_t in_page = offset & (PAGE_SIZE - 1);
+        size_t chunk = PAGE_SIZE - in_page;
+        if (chunk > size) chunk = size;
+
+        void* phys = page_cache_get(inode, offset / PAGE_SIZE);
+        if (!phys) return false;
+        memcpy(out, (uint8_t*)pmm_phys_to_virt(phys) + in_page, chunk);
+        pmm_page_put(phys);
+
+        out += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+static bool page_present(uint32_t inode, uint64_t index) {
+    uint64_t flags = spinlock_acquire_irqsave(&page_cache_lock);
+    bool present = page_lookup(inode, index) != NULL;
+    spinlock_release_irqrestore(&page_cache_lock, flags);
+    return present;
+}
+
+// Cache a filled frame unless the page is there already or a write or
+// eviction ran since seq. Takes the caller's reference either way.
+static void page_insert(uint32_t inode, uint64_t index, void* phys, uint64_t seq) {
+    struct cached_page* entry = kmem_cache_alloc(cached_page_cache);
+    if (!entry) {
+        pmm_free_page(phys);
+        return;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&page_cache_lock);
+    if (__atomic_load_n(&write_seq, __ATOMIC_ACQUIRE) != seq || page_lookup(inode, index)) {
+        spinlock_release_irqrestore(&page_cache_lock, flags);
+        pmm_free_page(phys);
+        kmem_cache_free(cached_page_cache, entry);
+        return;
+    }
+    if (cached_pages >= PAGE_CACHE_MAX_PAGES) evict_unmapped();
+
+    uint32_t bucket = page_bucket(inode, index);
+    entry->inode = inode;
+    entry->index = index;
+    entry->phys = phys;
+    entry->dirty = false;
+    entry->next = page_hash[bucket];
+    page_hash[bucket] = entry;
+    cached_pages++;
+    spinlock_release_irqrestore(&page_cache_lock, flags);
+}
+
+void page_cache_prefetch(uint32_t inode, uint64_t index, uint32_t count) {
+    struct ext2_inode* node = ext2_get_inode(inode);
+    if (!node) return;
+    uint64_t end = ((uint64_t)node->i_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    ext2_put_inode(node);
+    if (index >= end) return;
+    if (count > end - index) count = (uint32_t)(end - index);
+
+    void* buffer = NULL;
+    while (count) {
+        if (page_present(inode, index)) {
+            index++;
+            count--;
+            continue;
+        }
+
+        // One ext2 read for the stretch, coalesced into large device
+        // requests, then copied out a frame at a time
+        uint32_t run = 1;
+        while (run < count && run < PAGE_CACHE_BATCH && !page_present(inode, index + run)) run++;
+        if (!buffer) {
+            buffer = malloc(PAGE_CACHE_BATCH * PAGE_SIZE);
+            if (!buffer) return;
+        }
+
+        uint64_t seq = __atomic_load_n(&write_seq, __ATOMIC_ACQUIRE);
+        uint64_t offset = index * PAGE_SIZE;
+        struct iovec iov = { buffer, (size_t)run * PAGE_SIZE };
+        int64_t got = ext2_readv(inode, &iov, 1, offset);
+        if (got < 0) break;
+        memset((uint8_t*)buffer + got, 0, (size_t)run * PAGE_SIZE - (size_t)got);
+
+        for (uint32_t i = 0; i < run; i++) {
+            void* phys = pmm_alloc_page();
+            if (!phys) break;
+            memcpy(pmm_phys_to_virt(phys), (uint8_t*)buffer + (size_t)i * PAGE_SIZE, PAGE_SIZE);
+            page_insert(inode, index + i, phys, seq);
+        }
+        index += run;
+        count -= run;
+    }
+    free(buffer);
+}
+
+struct prefetch_work {
+    struct work work;
+    uint32_t inode;
+    uint64_t index;
+    uint32_t count;
+};
+
+static void prefetch_worker(struct work* work) {
+    struct prefetch_work* prefetch = container_of(work, struct prefetch_work, work);
+    page_cache_prefetch(prefetch->inode, prefetch->index, prefetch->count);
+    free(prefetch);
+}
+
+// Called for each read of pages [first, last] before it is served
+static void readahead_update(uint32_t inode, struct readahead* ra, uint64_t first, uint64_t last, uint64_t end) {
+    bool sequential = first == ra->next || first + 1 == ra->next;
+    ra->next = last + 1;
+    if (!sequential) {
+        ra->window = 0;
+        return;
+    }
+    if (!ra->window) {
+        ra->window = READAHEAD_MIN_PAGES;
+        ra->ahead = last + 1;
+    }
+    if (ra->ahead < last + 1) ra->ahead = last + 1;
+
+    // Start the next window once the reader is within half a window of
+    // the end of what has been prefetched
+    if (ra->ahead - (last + 1) > ra->window / 2 || ra->ahead >= end) return;
+    uint32_t count = ra->window;
+    if (count > end - ra->ahead) count = (uint32_t)(end - ra->ahead);
+
+    struct prefetch_work* prefetch = malloc(sizeof(struct prefetch_work));
+    if (!prefetch) return;
+    work_init(&prefetch->work, prefetch_worker);
+    prefetch->inode = inode;
+    prefetch->index = ra->ahead;
+    prefetch->count = count;
+    if (!work_schedule(&prefetch->work)) {
+        free(prefetch);
+        return;
+    }
+
+    ra->ahead += count;
+    if (ra->window < READAHEAD_MAX_PAGES) ra->window *= 2;
+}
+
+int64_t page_cache_readv(uint32_t inode, const struct iovec* iov, int iovcnt, uint64_t offset,
+                         struct readahead* ra) {
+    struct ext2_inode* node = ext2_get_inode(inode);
+    if (!node) return -1;
+    uint64_t file_size = node->i_size;
+    ext2_put_inode(node);
+
+    uint64_t size = 0;
+    for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+    if (offset >= file_size) return 0;
+    if (size > file_size - offset) size = file_size - offset;
+
+    // Missing pages of a multi-page read are filled in batches rather
+    // than one page_cache_get() at a time
+    uint64_t first = offset / PAGE_SIZE;
+    uint64_t last = (offset + size - 1) / PAGE_SIZE;
+    if (last > first) page_cache_prefetch(inode, first, (uint32_t)(last - first + 1));
+    if (ra) readahead_update(inode, ra, first, last, (file_size + PAGE_SIZE - 1) / PAGE_SIZE);
+
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    uint64_t done = 0;
+    while (done < size) {
+        uint64_t in_page = (offset + done) & (PAGE_SIZE - 1);
+        size_t chunk = PAGE_SIZE - in_page;
+        if (chunk > size - done) chunk = size - done;
+
+        void* phys = page_cache_get(inode, (offset + done) / PAGE_SIZE);
+        if (!phys) return done ? (int64_t)done : -1;
+        iov_copy_to_iter(&iter, (uint8_t*)pmm_phys_to_virt(phys) + in_page, chunk);
+        pmm_page_put(phys);
+        done += chunk;
+    }
+    return (int64_t)done;
+}
+
+// Lock held. The file's dirty record, with *link at it; NULL and the
+// list's tail link if it has none.
+static struct dirty_file* dirty_file_find(uint32_t inode, struct dirty_file*** link) {
+    struct dirty_file** at = &dirty_files;
+    while (*at && (*at)->inode != inode) at = &(*at)->next;
+    *link = at;
+    return *at;
+}
+
+// Mark the cached frame of a page dirty; false if phys is not what the
+// cache holds for it, so nothing would ever flush it
+static bool page_set_dirty(uint32_t inode, uint64_t index, void* phys) {
+    struct dirty_file* spare = kmem_cache_alloc(dirty_file_cache);
+    bool wake = false;
+
+    uint64_t flags = spinlock_acquire_irqsave(&page_cache_lock);
+    struct cached_page* page = page_lookup(inode, index);
+    bool cached = page && page->phys == phys;
+    if (cached && !page->dirty) {
+        struct dirty_file** link;
+        struct dirty_file* file = dirty_file_find(inode, &link);
+        if (!file && spare) {
+            file = spare;
+            spare = NULL;
+            file->inode = inode;
+            file->pages = 0;
+            file->dirtied_ns = ktime_get_ns();
+            file->next = NULL;
+            *link = file;
+        }
+        if (file) {
+            page->dirty = true;
+            file->pages++;
+            // First page, or enough that the flusher stops waiting for age
+            wake = dirty_pages++ == 0 || dirty_pages == PAGE_CACHE_DIRTY_LIMIT;
+        } else {
+            cached = false;
+        }
+    }
+    spinlock_release_irqrestore(&page_cache_lock, flags);
+
+    if (spare) kmem_cache_free(dirty_file_cache, spare);
+    if (wake) wait_queue_wake_one(&flush_wait);
+    return cached;
+}
+
+// Longest dirty file, or 0 if none is
+static uint32_t oldest_dirty(void) {
+    uint64_t flags = spinlock_acquire_irqsave(&page_cache_lock);
+    uint32_t inode = dirty_files ? dirty_files->inode : 0;
+    spinlock_release_irqrestore(&page_cache_lock, flags);
+    return inode;
+}
+
+struct flush_page {
+    uint64_t index;
+    void* phys;
+};
+
+static void flush_begin(void) {
+    for (;;) {
+        uint64_t flags = spinlock_acquire_irqsave(&page_cache_lock);
+        if (!flushing) {
+            flushing = true;
+            spinlock_release_irqrestore(&page_cache_lock, flags);
+            return;
+        }
+        spinlock_release_irqrestore(&page_cache_lock, flags);
+        wait_event(&flush_done, !__atomic_load_n(&flushing, __ATOMIC_ACQUIRE));
+    }
+}
+
+static void flush_end(void) {
+    __atomic_store_n(&flushing, false, __ATOMIC_RELEASE);
+    wait_queue_wake_one(&flush_done);
+}
+
+int64_t page_cache_writev(uint32_t inode, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    uint64_t size = 0;
+    for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+    if (size == 0) return 0;
+    if (offset + size > 0xFFFFFFFFULL) return -1;
+
+    struct ext2_inode* node = ext2_get_inode(inode);
+    if (!node) return -1;
+    uint64_t file_size = node->i_size;
+
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    uint64_t done = 0;
+    while (done < size) {
+        uint64_t in_page = (offset + done) & (PAGE_SIZE - 1);
+        size_t chunk = PAGE_SIZE - in_page;
+        if (chunk > size - done) chunk = size - done;
+
+        // Pages overwritten whole or lying past end of file are not read
+        uint64_t index = (offset + done) / PAGE_SIZE;
+        bool fill = chunk < PAGE_SIZE && index * PAGE_SIZE < file_size;
+        void* phys = page_get(inode, index, fill);
+        if (!phys) break;
+        uint8_t* data = (uint8_t*)pmm_phys_to_virt(phys) + in_page;
+        iov_copy_from_iter(&iter, data, chunk);
+
+        // Dirtied after the copy, so a flush that already took the page
+        // sees it dirty again
+        if (!page_set_dirty(inode, index, phys)) {
+            // Before and after, so a fill reading the file meanwhile retries
+            struct iovec through = { data, chunk };
+            __atomic_add_fetch(&write_seq, 1, __ATOMIC_RELEASE);
+            flush_begin();
+            int64_t written = ext2_writev(inode, &through, 1, offset + done);
+            flush_end();
+            __atomic_add_fetch(&write_seq, 1, __ATOMIC_RELEASE);
+            if (written != (int64_t)chunk) {
+                pmm_page_put(phys);
+                break;
+            }
+        }
+        pmm_page_put(phys);
+        done += chunk;
+    }
+
+    if (offset + done > node->i_size) {
+        node->i_size = (uint32_t)(offset + done);
+        ext2_write_inode(inode, node);
+    }
+    ext2_put_inode(node);
+
+    // Writers pay for going over the limit by flushing the oldest file
+    if (__atomic_load_n(&dirty_pages, __ATOMIC_ACQUIRE) >= PAGE_CACHE_DIRTY_LIMIT) {
+        uint32_t oldest = oldest_dirty();
+        if (oldest) page_cache_flush(oldest);
+    }
+    return done ? (int64_t)done : -1;
+}
+
+// Take up to max of the file's dirty pages, each with a reference and no
+// longer marked dirty
+static uint32_t take_dirty(uint32_t inode, struct flush_page* pages, uint32_t max) {
+    uint32_t count = 0;
+    uint64_t flags = spinlock_acquire_irqsave(&page_cache_lock);
+    struct dirty_file** link;
+    struct dirty_file* file = dirty_file_find(inode, &link);
+    for (uint32_t bucket = 0; file && bucket < PAGE_CACHE_BUCKETS && count < max; bucket++) {
+        for (struct cached_page* page = page_hash[bucket]; page && count < max; page = page->next) {
+            if (page->inode != inode || !page->dirty) continue;
+            page->dirty = false;
+            pmm_page_get(page->phys);
+            pages[count].index = page->index;
+            pages[count].phys = page->phys;
+            count++;
+        }
+    }
+    if (file) {
+        file->pages -= count;
+        dirty_pages -= count;
+        if (!file->pages) {
+            *link = file->next;
+            kmem_cache_free(dirty_file_cache, file);
+        }
+    }
+    spinlock_release_irqrestore(&page_cache_lock, flags);
+    return count;
+}
+
+static uint32_t dirty_count(uint32_t inode) {
+    uint64_t flags = spinlock_acquire_irqsave(&page_cache_lock);
+    struct dirty_file** link;
+    struct dirty_file* file = dirty_file_find(inode, &link);
+    uint32_t pages = file ? file->pages : 0;
+    spinlock_release_irqrestore(&page_cache_lock, flags);
+    return pages;
+}
+
+// Write taken pages sorted by index, a run of consecutive ones per ext2
+// write so the blocks behind them are allocated together
+static bool write_taken(uint32_t inode, struct flush_page* pages, uint32_t count) {
+    for (uint32_t i = 1; i < count; i++) {
+        struct flush_page page = pages[i];
+        uint32_t j = i;
+        while (j > 0 && pages[j - 1].index > page.index) {
+            pages[j] = pages[j - 1];
+            j--;
+        }
+        pages[j] = page;
+    }
+
+    struct ext2_inode* node = ext2_get_inode(inode);
+    uint64_t file_size = node ? node->i_size : 0;
+    ext2_put_inode(node);
+
+    bool success = node != NULL;
+    struct iovec iov[PAGE_CACHE_BATCH];
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t run = 1;
+        while (i + run < count && run < PAGE_CACHE_BATCH && pages[i + run].index == pages[i].index + run) run++;
+
+        // Nothing past end of file is written
+        uint64_t offset = pages[i].index * PAGE_SIZE;
+        uint64_t bytes = 0;
+        for (uint32_t k = 0; k < run && offset + bytes < file_size; k++) {
+            uint64_t left = file_size - offset - bytes;
+            iov[k].iov_base = pmm_phys_to_virt(pages[i + k].phys);
+            iov[k].iov_len = left < PAGE_SIZE ? left : PAGE_SIZE;
+            bytes += iov[k].iov_len;
+        }
+        uint32_t segments = (uint32_t)((bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+        if (bytes && ext2_writev(inode, iov, (int)segments, offset) != (int64_t)bytes) {
+            // Kept dirty for a later flush to retry
+            log_error("page cache: write-back of inode %d failed", (int)inode);
+            for (uint32_t k = 0; k < run; k++) page_set_dirty(inode, pages[i + k].index, pages[i + k].phys);
+            success = false;
+        }
+        i += run;
+    }
+    for (i = 0; i < count; i++) pmm_page_put(pages[i].phys);
+    return success;
+}
+
+bool page_cache_flush(uint32_t inode) {
+    if (!dirty_count(inode)) return true;
+
+    flush_begin();
+    bool success = true;
+    struct flush_page* pages = NULL;
+    uint32_t capacity = 0;
+    // Pages dirtied while a batch is written are picked up by the next pass
+    for (uint32_t want; success && (want = dirty_count(inode)) != 0;) {
+        if (want > capacity) {
+            free(pages);
+            capacity = want;
+            pages = malloc(capacity * sizeof(struct flush_page));
+            if (!pages) {
+                success = false;
+                break;
+            }
+        }
+        uint32_t count = take_dirty(inode, pages, capacity);
+        if (!count) break;
+        success = write_taken(inode, pages, count);
+    }
+    free(pages);
+    flush_end();
+    return success;
+}
+
+bool page_cache_sync(void) {
+    // A failed file stays dirty at the head, so stop rather than spin on it
+    for (uint32_t inode; (inode = oldest_dirty()) != 0;) {
+        if (!page_cache_flush(inode)) return false;
+    }
+    return true;
+}
+
+static void flusher_main(void) {
+    for (;;) {
+        wait_event(&flush_wait, __atomic_load_n(&dirty_pages, __ATOMIC_ACQUIRE) != 0);
+
+        uint32_t inode = 0;
+        uint64_t due = 0;
+        uint64_t flags = spinlock_acquire_irqsave(&page_cache_lock);
+        struct dirty_file* file = dirty_files;
+        if (file) {
+            due = file->dirtied_ns + (uint64_t)PAGE_CACHE_WRITEBACK_DELAY_MS * 1000000ULL;
+            if (dirty_pages >= PAGE_CACHE_DIRTY_LIMIT || ktime_get_ns() >= due) inode = file->inode;
+        }
+        spinlock_release_irqrestore(&page_cache_lock, flags);
+
+        if (inode) {
+            page_cache_flush(inode);
+        } else {
+            // Only young pages are dirty; sleep until the oldest file ages
+            // or the dirty limit is reached
+            wait_event_deadline(&flush_wait,
+                                __atomic_load_n(&dirty_pages, __ATOMIC_ACQUIRE) >= PAGE_CACHE_DIRTY_LIMIT,
+                                due);
+        }
+    }
+}
+
+void page_cache_flusher_init(void) {
+    // Lowest priority, like the block cache flusher it feeds
+    process_t* flusher = process_create(flusher_main, SCHED_LEVELS - 1, "pflush");
+    if (!flusher) {
+        log_error("page cache: no flusher, dirty pages wait for sync");
+        return;
+    }
+    scheduler_add(flusher);
+}
+
+bool page_cache_writeback(uint32_t inode, uint64_t index, void* phys) {
+    struct ext2_inode* node = ext2_get_inode(inode);
+    if (!node) return false;
+    uint64_t file_size = node->i_size;
+    ext2_put_inode(node);
+
+    // Stores past end of file do not grow it
+    uint64_t offset = index * PAGE_SIZE;
+    if (offset >= file_size) return true;
+    size_t bytes = file_size - offset < PAGE_SIZE ? file_size - offset : PAGE_SIZE;
+
+    // Straight to ext2: the page is already what the cache holds
+    struct iovec iov = { pmm_phys_to_virt(phys), bytes };
+    flush_begin();
+    bool success = ext2_writev(inode, &iov, 1, offset) == (int64_t)bytes;
+    flush_end();
+    return success;
+}
+
+void page_cache_evict_inode(uint32_t inode) {
+    uint64_t flags = spinlock_acquire_irqsave(&page_cache_lock);
+    // A prefetch of the inode still running must not cache what it read
+    __atomic_add_fetch(&write_seq, 1, __ATOMIC_RELEASE);
+    for (uint32_t bucket = 0; bucket < PAGE_CACHE_BUCKETS; bucket++) {
+        struct cached_page** link = &page_hash[bucket];
+        while (*link) {
+            struct cached_page* page = *link;
+            if (page->inode != inode) {
+                link = &page->next;
+                continue;
+            }
+            // Mappings keep their own references to the frame; dirty
+            // data of a freed file is simply dropped
+            *link = page->next;
+            if (page->dirty) dirty_pages--;
+            pmm_page_put(page->phys);
+            kmem_cache_free(cached_page_cache, page);
+            cached_pages--;
+        }
+    }
+    struct dirty_file** link;
+    struct dirty_file* file = dirty_file_find(inode, &link);
+    if (file) {
+        *link = file->next;
+        kmem_cache_free(dirty_file_cache, file);
+    }
+    spinlock_release_irqrestore(&page_cache_lock, flags);
+}
@@ -0,0 +1,62 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// File contents cached a page at a time, keyed by (inode, page index). The
+// cache holds one reference to each frame; every mapping of it holds another.
+#define PAGE_CACHE_HASH_BITS  10
+#define PAGE_CACHE_MAX_PAGES  4096   // Past this, pages nobody maps are dropped
+
+// Sequential reads of an open file prefetch a window ahead of the reader
+// that doubles on every prefetch, from READAHEAD_MIN_PAGES up to the max
+#define READAHEAD_MIN_PAGES   4
+#define READAHEAD_MAX_PAGES   64    // 256KB
+#define PAGE_CACHE_BATCH      32    // Pages per device read when filling
+
+// Writes only dirty cached pages. Blocks are allocated when a file is
+// flushed, one ext2 write per run of consecutive pages, so appends are
+// laid out contiguously and cost no device I/O until then.
+#define PAGE_CACHE_DIRTY_LIMIT         1024  // Dirty pages that make writers flush
+#define PAGE_CACHE_WRITEBACK_DELAY_MS  5000  // Age at which a file's dirty pages are flushed
+
+// Per open file readahead state, zero for a file just opened
+struct readahead {
+    uint64_t next;          // Page a sequential read would start at
+    uint64_t ahead;         // First page not yet prefetched
+    uint32_t window;        // Pages per prefetch, 0 while reads look random
+};
+
+void page_cache_init(void);
+// Start the flusher, once the scheduler is up
+void page_cache_flusher_init(void);
+
+// Frame holding the given page of the file, read in on a miss; bytes past
+// end of file are zero. The caller owns one reference. NULL on failure.
+void* page_cache_get(uint32_t inode, uint64_t index);
+// Copy file bytes out through the cache, zero past end of file
+bool page_cache_read(uint32_t inode, void* buffer, uint64_t offset, size_t size);
+// Read uncached pages of [index, index + count) in batches, skipping
+// what is cached and what lies past end of file
+void page_cache_prefetch(uint32_t inode, uint64_t index, uint32_t count);
+struct iovec;
+// read(2) of a regular file: stops at end of file, returns bytes or -1.
+// With ra, sequential reads start asynchronous readahead.
+int64_t page_cache_readv(uint32_t inode, const struct iovec* iov, int iovcnt, uint64_t offset,
+                         struct readahead* ra);
+
+// write(2) of a regular file into cached pages, growing the in-core
+// size at once. Returns bytes or -1.
+int64_t page_cache_writev(uint32_t inode, const struct iovec* iov, int iovcnt, uint64_t offset);
+// Write a file's dirty pages out; false if any write failed
+bool page_cache_flush(uint32_t inode);
+// Flush every file, ahead of the metadata in ext2_sync()
+bool page_cache_sync(void);
+// Write a page of a shared mapping back to its file, up to end of file
+bool page_cache_writeback(uint32_t inode, uint64_t index, void* phys);
+// Forget every page of an inode that is being freed
+void page_cache_evict_inode(uint32_t inode);
+
+#endif // PAGE_CACHE_H
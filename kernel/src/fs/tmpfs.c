@@ -0,0 +1,354 @@
+#include <fs/tmpfs.h>
+#include <fs/vfs.h>
+#include <fs/file.h>
+#include <mm/pmm.h>
+#include <mm/heap.h>
+#include <core/smp.h>
+#include <core/syscalls.h>
+#include <utils/mem.h>
+#include <utils/str.h>
+
+struct tmpfs_node {
+    uint32_t ino;
+    volatile uint32_t refs;     // Open files, plus one while it has a name
+    spinlock_t lock;            // size and pages
+    uint64_t size;
+    void** pages;               // Frame per page index, NULL for a hole
+    uint32_t page_slots;
+};
+
+struct tmpfs_name {
+    struct tmpfs_node* node;
+    uint32_t hash;
+    uint32_t len;
+    struct tmpfs_name* next;
+    char name[];
+};
+
+struct tmpfs {
+    spinlock_t lock;            // The directory
+    struct tmpfs_name** buckets;
+    uint32_t bits;
+    uint32_t names;
+    uint32_t next_ino;
+};
+
+// Read for holes
+static const uint8_t zero_page[PAGE_SIZE];
+
+// FNV-1a, as the dentry cache uses
+static uint32_t name_hash(const char* name, uint32_t len) {
+    uint32_t hash = 2166136261U;
+    for (uint32_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static inline uint32_t name_bucket(uint32_t hash, uint32_t bits) {
+    return (uint32_t)(((uint64_t)hash * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+// Lock held. The link pointing at the name, or at the end of its chain.
+static struct tmpfs_name** name_link(struct tmpfs* fs, const char* name, uint32_t len, uint32_t hash) {
+    struct tmpfs_name** link = &fs->buckets[name_bucket(hash, fs->bits)];
+    while (*link && ((*link)->hash != hash || (*link)->len != len || memcmp((*link)->name, name, len) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Lock held. Move every name into a table twice the size.
+static void rehash(struct tmpfs* fs, struct tmpfs_name** buckets) {
+    uint32_t bits = fs->bits + 1;
+    memset(buckets, 0, sizeof(struct tmpfs_name*) << bits);
+    for (uint32_t i = 0; i < (1U << fs->bits); i++) {
+        struct tmpfs_name* entry = fs->buckets[i];
+        while (entry) {
+            struct tmpfs_name* next = entry->next;
+            uint32_t bucket = name_bucket(entry->hash, bits);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(fs->buckets);
+    fs->buckets = buckets;
+    fs->bits = bits;
+}
+
+static void node_free_pages(void** pages, uint32_t slots) {
+    for (uint32_t i = 0; i < slots; i++) {
+        if (pages[i]) pmm_page_put(pages[i]);
+    }
+    free(pages);
+}
+
+static void node_put(struct tmpfs_node* node) {
+    if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    if (node->pages) node_free_pages(node->pages, node->page_slots);
+    free(node);
+}
+
+// Frame of a page with a reference for the caller. With create a hole
+// gets a zeroed frame; NULL for a hole otherwise, or when memory is out.
+static void* node_page(struct tmpfs_node* node, uint64_t index, bool create) {
+    uint64_t flags = spinlock_acquire_irqsave(&node->lock);
+    void* phys = index < node->page_slots ? node->pages[index] : NULL;
+    if (phys) pmm_page_get(phys);
+    uint32_t slots = node->page_slots;
+    spinlock_release_irqrestore(&node->lock, flags);
+    if (phys || !create || index >= 0xFFFFFFFFULL / 2) return phys;
+
+    // Allocate unlocked, growing the page array by doubling
+    void* fresh = pmm_alloc_page();
+    if (!fresh) return NULL;
+    memset(pmm_phys_to_virt(fresh), 0, PAGE_SIZE);
+    void** grown = NULL;
+    uint32_t grown_slots = slots;
+    if (index >= slots) {
+        grown_slots = slots ? slots : 16;
+        while (grown_slots <= index) grown_slots *= 2;
+        grown = malloc(grown_slots * sizeof(void*));
+        if (!grown) {
+            pmm_free_page(fresh);
+            return NULL;
+        }
+    }
+
+    flags = spinlock_acquire_irqsave(&node->lock);
+    if (grown && grown_slots > node->page_slots) {
+        memset(grown, 0, grown_slots * sizeof(void*));
+        if (node->pages) memcpy(grown, node->pages, node->page_slots * sizeof(void*));
+        void** old = node->pages;
+        node->pages = grown;
+        node->page_slots = grown_slots;
+        grown = old;
+    }
+    if (index < node->page_slots) {
+        if (!node->pages[index]) {
+            node->pages[index] = fresh;
+            fresh = NULL;
+        }
+        phys = node->pages[index];
+        pmm_page_get(phys);
+    }
+    spinlock_release_irqrestore(&node->lock, flags);
+
+    // Lost a race for the page, or replaced the old array
+    if (fresh) pmm_free_page(fresh);
+    if (grown) free(grown);
+    return phys;
+}
+
+static uint64_t node_size(struct tmpfs_node* node) {
+    uint64_t flags = spinlock_acquire_irqsave(&node->lock);
+    uint64_t size = node->size;
+    spinlock_release_irqrestore(&node->lock, flags);
+    return size;
+}
+
+static void node_truncate(struct tmpfs_node* node) {
+    uint64_t flags = spinlock_acquire_irqsave(&node->lock);
+    void** pages = node->pages;
+    uint32_t slots = node->page_slots;
+    node->pages = NULL;
+    node->page_slots = 0;
+    node->size = 0;
+    spinlock_release_irqrestore(&node->lock, flags);
+
+    // Readers still holding a frame keep it until they put it
+    if (pages) node_free_pages(pages, slots);
+}
+
+static ssize_t tmpfs_readv(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    struct tmpfs_node* node = file->private_data;
+    uint64_t size = 0;
+    for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+    uint64_t file_size = node_size(node);
+    if (offset >= file_size) return 0;
+    if (size > file_size - offset) size = file_size - offset;
+
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    uint64_t done = 0;
+    while (done < size) {
+        uint64_t in_page = (offset + done) & (PAGE_SIZE - 1);
+        size_t chunk = PAGE_SIZE - in_page;
+        if (chunk > size - done) chunk = size - done;
+
+        void* phys = node_page(node, (offset + done) / PAGE_SIZE, false);
+        if (phys) {
+            iov_copy_to_iter(&iter, (uint8_t*)pmm_phys_to_virt(phys) + in_page, chunk);
+            pmm_page_put(phys);
+        } else {
+            iov_copy_to_iter(&iter, zero_page, chunk);
+        }
+        done += chunk;
+    }
+    return (ssize_t)done;
+}
+
+static ssize_t tmpfs_writev(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    struct tmpfs_node* node = file->private_data;
+    uint64_t size = 0;
+    for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    uint64_t done = 0;
+    while (done < size) {
+        uint64_t in_page = (offset + done) & (PAGE_SIZE - 1);
+        size_t chunk = PAGE_SIZE - in_page;
+        if (chunk > size - done) chunk = size - done;
+
+        void* phys = node_page(node, (offset + done) / PAGE_SIZE, true);
+        if (!phys) break;
+        iov_copy_from_iter(&iter, (uint8_t*)pmm_phys_to_virt(phys) + in_page, chunk);
+        pmm_page_put(phys);
+        done += chunk;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&node->lock);
+    if (offset + done > node->size) node->size = offset + done;
+    spinlock_release_irqrestore(&node->lock, flags);
+    return done || !size ? (ssize_t)done : -ENOSPC;
+}
+
+static uint64_t tmpfs_size(struct file* file) {
+    return node_size(file->private_data);
+}
+
+static void tmpfs_release(struct file* file) {
+    node_put(file->private_data);
+}
+
+static const struct file_ops tmpfs_file_ops = {
+    .readv = tmpfs_readv,
+    .writev = tmpfs_writev,
+    .size = tmpfs_size,
+};
+
+// Length of a name in the flat directory, or a negative errno
+static int name_check(const char* path) {
+    uint32_t len = 0;
+    while (path[len]) {
+        if (path[len] == '/') return -ENOENT;
+        if (++len > TMPFS_NAME_MAX) return -ENAMETOOLONG;
+    }
+    return len ? (int)len : -EISDIR;
+}
+
+static int tmpfs_open(void* data, const char* path, int flags, mode_t mode, struct file* file) {
+    (void)mode;
+    struct tmpfs* fs = data;
+    int len = name_check(path);
+    if (len < 0) return len;
+    uint32_t hash = name_hash(path, (uint32_t)len);
+
+    // A new name's node, entry and any bigger table are made unlocked
+    struct tmpfs_node* fresh = NULL;
+    struct tmpfs_name* entry = NULL;
+    struct tmpfs_name** buckets = NULL;
+    uint32_t bits = __atomic_load_n(&fs->bits, __ATOMIC_RELAXED);
+    if (flags & O_CREAT) {
+        fresh = malloc(sizeof(struct tmpfs_node));
+        entry = malloc(sizeof(struct tmpfs_name) + (uint32_t)len);
+        if (__atomic_load_n(&fs->names, __ATOMIC_RELAXED) + 1 > (2U << bits)) {
+            buckets = malloc(sizeof(struct tmpfs_name*) << (bits + 1));
+        }
+    }
+
+    int result = 0;
+    struct tmpfs_node* node = NULL;
+    uint64_t irq = spinlock_acquire_irqsave(&fs->lock);
+    struct tmpfs_name** link = name_link(fs, path, (uint32_t)len, hash);
+    if (*link) {
+        if ((flags & O_CREAT) && (flags & O_EXCL)) {
+            result = -EEXIST;
+        } else {
+            node = (*link)->node;
+            __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+        }
+    } else if (!(flags & O_CREAT)) {
+        result = -ENOENT;
+    } else if (!fresh || !entry) {
+        result = -ENOMEM;
+    } else {
+        memset(fresh, 0, sizeof(struct tmpfs_node));
+        spinlock_init(&fresh->lock);
+        fresh->ino = fs->next_ino++;
+        fresh->refs = 2;
+        entry->node = fresh;
+        entry->hash = hash;
+        entry->len = (uint32_t)len;
+        entry->next = NULL;
+        memcpy(entry->name, path, (uint32_t)len);
+        *link = entry;
+        fs->names++;
+        if (buckets && fs->bits == bits && fs->names > (2U << fs->bits)) {
+            rehash(fs, buckets);
+            buckets = NULL;
+        }
+        node = fresh;
+        fresh = NULL;
+        entry = NULL;
+    }
+    spinlock_release_irqrestore(&fs->lock, irq);
+
+    if (fresh) free(fresh);
+    if (entry) free(entry);
+    if (buckets) free(buckets);
+    if (result) return result;
+
+    if ((flags & O_TRUNC) && (flags & (O_WRONLY | O_RDWR))) node_truncate(node);
+    file->inode = node->ino;
+    file->private_data = node;
+    file->ops = &tmpfs_file_ops;
+    file->release = tmpfs_release;
+    return 0;
+}
+
+static int tmpfs_unlink(void* data, const char* path) {
+    struct tmpfs* fs = data;
+    int len = name_check(path);
+    if (len < 0) return len;
+    uint32_t hash = name_hash(path, (uint32_t)len);
+
+    uint64_t flags = spinlock_acquire_irqsave(&fs->lock);
+    struct tmpfs_name** link = name_link(fs, path, (uint32_t)len, hash);
+    struct tmpfs_name* entry = *link;
+    if (entry) {
+        *link = entry->next;
+        fs->names--;
+    }
+    spinlock_release_irqrestore(&fs->lock, flags);
+    if (!entry) return -ENOENT;
+
+    // Open files keep the data until they are closed
+    node_put(entry->node);
+    free(entry);
+    return 0;
+}
+
+static const struct vfs_ops tmpfs_vfs_ops = {
+    .open = tmpfs_open,
+    .unlink = tmpfs_unlink,
+};
+
+bool tmpfs_mount(const char* path) {
+    struct tmpfs* fs = malloc(sizeof(struct tmpfs));
+    if (!fs) return false;
+    memset(fs, 0, sizeof(struct tmpfs));
+    spinlock_init(&fs->lock);
+    fs->bits = TMPFS_HASH_BITS;
+    fs->next_ino = 1;
+    fs->buckets = malloc(sizeof(struct tmpfs_name*) << fs->bits);
+    if (fs->buckets) {
+        memset(fs->buckets, 0, sizeof(struct tmpfs_name*) << fs->bits);
+        if (vfs_mount(path, &tmpfs_vfs_ops, fs)) return true;
+        free(fs->buckets);
+    }
+    free(fs);
+    return false;
+}
@@ -0,0 +1,15 @@
+#ifndef TMPFS_H
+#define TMPFS_H
+
+#include <stdbool.h>
+
+// Files kept only in memory, a PMM frame per page, in one flat directory
+// per mount. Names are hashed, so create and unlink cost the same at any
+// directory size, and nothing ever reaches a device.
+#define TMPFS_HASH_BITS  6     // Initial buckets; doubled when names outnumber them twice over
+#define TMPFS_NAME_MAX   255
+
+// Mount a new, empty tmpfs at path
+bool tmpfs_mount(const char* path);
+
+#endif // TMPFS_H
@@ -0,0 +1,73 @@
+#include <fs/vfs.h>
+#include <core/smp.h>
+#include <utils/mem.h>
+#include <utils/str.h>
+
+struct vfs_mount {
+    char path[VFS_PATH_MAX];    // No trailing slash
+    uint32_t len;
+    const struct vfs_ops* ops;
+    void* data;
+};
+
+// Entries are filled before mount_count moves past them and never change,
+// so resolving takes no lock
+static struct vfs_mount mounts[VFS_MAX_MOUNTS];
+static volatile uint32_t mount_count = 0;
+static spinlock_t mount_lock = SPINLOCK_INIT;
+
+bool vfs_mount(const char* path, const struct vfs_ops* ops, void* data) {
+    uint32_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    if (!ops || path[0] != '/' || len < 2 || len >= VFS_PATH_MAX) return false;
+
+    uint64_t flags = spinlock_acquire_irqsave(&mount_lock);
+    uint32_t slot = mount_count;
+    bool success = slot < VFS_MAX_MOUNTS;
+    for (uint32_t i = 0; success && i < slot; i++) {
+        if (mounts[i].len == len && memcmp(mounts[i].path, path, len) == 0) success = false;
+    }
+    if (success) {
+        memcpy(mounts[slot].path, path, len);
+        mounts[slot].path[len] = '\0';
+        mounts[slot].len = len;
+        mounts[slot].ops = ops;
+        mounts[slot].data = data;
+        __atomic_store_n(&mount_count, slot + 1, __ATOMIC_RELEASE);
+    }
+    spinlock_release_irqrestore(&mount_lock, flags);
+    return success;
+}
+
+// Mount point a whole-component prefix of path, which has its leading
+// slashes stripped; compared a byte at a time, as path may end anywhere
+// before the mount point does
+static bool mount_covers(const struct vfs_mount* mount, const char* path) {
+    for (uint32_t i = 1; i < mount->len; i++) {
+        if (path[i - 1] != mount->path[i]) return false;
+    }
+    return path[mount->len - 1] == '\0' || path[mount->len - 1] == '/';
+}
+
+const struct vfs_ops* vfs_resolve(const char* path, const char** rest, void** data) {
+    if (!path) return NULL;
+
+    // There is no working directory yet, so relative paths start at the
+    // root, as they do on ext2
+    while (*path == '/') path++;
+
+    // The longest covering mount point wins
+    const struct vfs_mount* best = NULL;
+    uint32_t count = __atomic_load_n(&mount_count, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < count; i++) {
+        const struct vfs_mount* mount = &mounts[i];
+        if (mount_covers(mount, path) && (!best || mount->len > best->len)) best = mount;
+    }
+    if (!best) return NULL;
+
+    const char* below = path + best->len - 1;
+    while (*below == '/') below++;
+    *rest = below;
+    *data = best->data;
+    return best->ops;
+}
@@ -0,0 +1,39 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/syscalls.h>
+
+// Filesystems mounted over part of the namespace. Paths outside every
+// mount point belong to ext2, which sys_open() and friends call directly;
+// a mounted filesystem gets the path below its mount point instead.
+#define VFS_MAX_MOUNTS   8
+#define VFS_PATH_MAX     64    // Longest mount point
+
+struct file;
+struct iovec;
+
+// Per open file I/O, set by the filesystem that opened it. Returns bytes
+// or a negative errno.
+struct file_ops {
+    ssize_t (*readv)(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset);
+    ssize_t (*writev)(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset);
+    uint64_t (*size)(struct file* file);
+};
+
+// Namespace operations of a mounted filesystem; data is what it was
+// mounted with, path is relative to the mount point. 0 or a negative errno.
+struct vfs_ops {
+    // Fill in an allocated file: its ops, inode and private data
+    int (*open)(void* data, const char* path, int flags, mode_t mode, struct file* file);
+    int (*unlink)(void* data, const char* path);
+};
+
+bool vfs_mount(const char* path, const struct vfs_ops* ops, void* data);
+// Filesystem mounted over path, with *rest set to the part below the
+// mount point and *data to its mount data; NULL if path is on ext2.
+// Relative paths are taken from the root, like absolute ones.
+const struct vfs_ops* vfs_resolve(const char* path, const char** rest, void** data);
+
+#endif // VFS_H
@@ -1,50 +1,367 @@
 #include <graphics/display.h>
 #include <graphics/font.h>
+#include <mm/vmalloc.h>
+#include <utils/mem.h>
+#include <core/smp.h>
+
+// Regions kept apart before they are merged into their neighbours
+#define DISPLAY_MAX_DIRTY 8
+
+// Color pairs with a rendered atlas at once, replaced in turn
+#define DISPLAY_ATLAS_SLOTS 4
+
+// Two pixels stored at once, over memory also written a pixel at a time
+typedef uint64_t __attribute__((may_alias)) pair_t;
+
+// Every glyph in one color pair, scaled across: each font row as the 16
+// pixels it becomes, in pairs, drawn twice for the vertical scaling
+struct glyph_atlas {
+    uint32_t color;
+    uint32_t background;
+    bool valid;
+    uint64_t rows[128][8][DISPLAY_GLYPH_WIDTH / 2];
+};
+
+struct dirty_rect {
+    uint32_t x0, y0;
+    uint32_t x1, y1;            // Exclusive
+};
+
+// The one back-buffered framebuffer. Its rows are a ring starting at
+// row_base, so scrolling moves the start instead of the pixels.
+static struct {
+    struct limine_framebuffer *fb;
+    uint32_t *buffer;           // width * height pixels
+    uint32_t width;
+    uint32_t height;
+    uint32_t row_base;
+    struct dirty_rect dirty[DISPLAY_MAX_DIRTY];
+    uint32_t dirty_count;
+    struct glyph_atlas *atlas;  // DISPLAY_ATLAS_SLOTS of them
+    uint32_t atlas_next;
+} display;
+
+static spinlock_t display_lock = SPINLOCK_INIT;
+
+static inline bool buffered(struct limine_framebuffer *fb) {
+    return display.buffer && fb == display.fb;
+}
+
+// Screen row y, in the back buffer when there is one; the lock held
+static inline uint32_t *row_of(struct limine_framebuffer *fb, uint32_t y) {
+    if (!buffered(fb)) return (uint32_t *)((uint8_t *)fb->address + (uint64_t)y * fb->pitch);
+
+    uint32_t row = display.row_base + y;
+    if (row >= display.height) row -= display.height;
+    return display.buffer + (uint64_t)row * display.width;
+}
+
+static inline uint64_t rect_area(const struct dirty_rect *r) {
+    return (uint64_t)(r->x1 - r->x0) * (r->y1 - r->y0);
+}
+
+static inline void rect_union(struct dirty_rect *into, const struct dirty_rect *r) {
+    if (r->x0 < into->x0) into->x0 = r->x0;
+    if (r->y0 < into->y0) into->y0 = r->y0;
+    if (r->x1 > into->x1) into->x1 = r->x1;
+    if (r->y1 > into->y1) into->y1 = r->y1;
+}
+
+// Add a clipped rectangle to what the next flush copies. One it touches is
+// absorbed; with no room left it joins whichever grows least.
+static void mark_dirty(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    struct dirty_rect r = { x0, y0, x1, y1 };
+    if (x0 >= x1 || y0 >= y1) return;
+
+    for (uint32_t i = 0; i < display.dirty_count;) {
+        struct dirty_rect *d = &display.dirty[i];
+        if (r.x0 <= d->x1 && d->x0 <= r.x1 && r.y0 <= d->y1 && d->y0 <= r.y1) {
+            rect_union(&r, d);
+            *d = display.dirty[--display.dirty_count];
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    if (display.dirty_count < DISPLAY_MAX_DIRTY) {
+        display.dirty[display.dirty_count++] = r;
+        return;
+    }
+
+    uint32_t best = 0;
+    uint64_t best_growth = UINT64_MAX;
+    for (uint32_t i = 0; i < display.dirty_count; i++) {
+        struct dirty_rect u = display.dirty[i];
+        rect_union(&u, &r);
+        uint64_t growth = rect_area(&u) - rect_area(&display.dirty[i]);
+        if (growth < best_growth) {
+            best_growth = growth;
+            best = i;
+        }
+    }
+    rect_union(&display.dirty[best], &r);
+}
+
+static inline void mark_all_dirty(void) {
+    display.dirty[0] = (struct dirty_rect){ 0, 0, display.width, display.height };
+    display.dirty_count = 1;
+}
+
+static void fill_span(uint32_t *p, uint32_t count, uint32_t color) {
+    uint64_t pattern = ((uint64_t)color << 32) | color;
+    if (((uintptr_t)p & 4) && count) {
+        *p++ = color;
+        count--;
+    }
+    for (; count >= 2; count -= 2, p += 2) {
+        *(pair_t *)p = pattern;
+    }
+    if (count) *p = color;
+}
+
+static inline void movnti(volatile void *dest, uint64_t value) {
+    asm volatile("movnti [%0], %1" :: "r"(dest), "r"(value) : "memory");
+}
+
+// Write-only copy to VRAM, 8 bytes per store around the cache. movnti is
+// SSE2, which every x86_64 CPU has, and needs no vector registers.
+static void stream_span(volatile uint32_t *dst, const uint32_t *src, uint32_t count) {
+    if (((uintptr_t)dst & 4) && count) {
+        *dst++ = *src++;
+        count--;
+    }
+    for (; count >= 8; count -= 8, dst += 8, src += 8) {
+        const pair_t *s = (const pair_t *)src;
+        uint64_t a = s[0], b = s[1], c = s[2], d = s[3];
+        movnti(dst, a);
+        movnti(dst + 2, b);
+        movnti(dst + 4, c);
+        movnti(dst + 6, d);
+    }
+    for (; count >= 2; count -= 2, dst += 2, src += 2) {
+        movnti(dst, *(const pair_t *)src);
+    }
+    if (count) *dst = *src;
+}
+
+// Clip to the screen; false if nothing is left
+static inline bool clip(struct limine_framebuffer *fb, uint32_t x, uint32_t y,
+                        uint32_t *width, uint32_t *height) {
+    if (x >= fb->width || y >= fb->height) return false;
+    if (*width > fb->width - x) *width = fb->width - x;
+    if (*height > fb->height - y) *height = fb->height - y;
+    return *width && *height;
+}
+
+static inline uint64_t lock_display(struct limine_framebuffer *fb) {
+    return buffered(fb) ? spinlock_acquire_irqsave(&display_lock) : 0;
+}
+
+static inline void unlock_display(struct limine_framebuffer *fb, uint64_t flags) {
+    if (buffered(fb)) spinlock_release_irqrestore(&display_lock, flags);
+}
 
 void draw_pixel(struct limine_framebuffer *fb, uint32_t x, uint32_t y, uint32_t color) {
     if (x < fb->width && y < fb->height) {
-        volatile uint32_t *fb_ptr = fb->address;
-        fb_ptr[y * (fb->pitch / 4) + x] = color;
+        uint64_t flags = lock_display(fb);
+        row_of(fb, y)[x] = color;
+        if (buffered(fb)) mark_dirty(x, y, x + 1, y + 1);
+        unlock_display(fb, flags);
     }
 }
 
-void draw_rect(struct limine_framebuffer *fb, uint32_t x, uint32_t y, 
+static void fill_rect(struct limine_framebuffer *fb, uint32_t x, uint32_t y,
+                      uint32_t width, uint32_t height, uint32_t color) {
+    if (!clip(fb, x, y, &width, &height)) return;
+    for (uint32_t i = 0; i < height; i++) {
+        fill_span(row_of(fb, y + i) + x, width, color);
+    }
+    if (buffered(fb)) mark_dirty(x, y, x + width, y + height);
+}
+
+void draw_rect(struct limine_framebuffer *fb, uint32_t x, uint32_t y,
                uint32_t width, uint32_t height, uint32_t color) {
+    uint64_t flags = lock_display(fb);
+    fill_rect(fb, x, y, width, height, color);
+    unlock_display(fb, flags);
+}
+
+void display_panic_rect(struct limine_framebuffer *fb, uint32_t x, uint32_t y,
+                        uint32_t width, uint32_t height, uint32_t color) {
+    if (!clip(fb, x, y, &width, &height)) return;
+    for (uint32_t i = 0; i < height; i++) {
+        fill_span((uint32_t *)((uint8_t *)fb->address + (uint64_t)(y + i) * fb->pitch) + x, width, color);
+    }
+}
+
+static inline uint64_t pixel_pair(uint32_t color) {
+    return ((uint64_t)color << 32) | color;
+}
+
+// One glyph, each font bit a 2x2 block stored a pair at a time, the rest
+// left as it was; the lock held
+static void put_char(struct limine_framebuffer *fb, char c, uint32_t x, uint32_t y, uint32_t color) {
+    uint32_t width = DISPLAY_GLYPH_WIDTH, height = DISPLAY_GLYPH_HEIGHT;
+    if ((unsigned char)c >= 128 || !clip(fb, x, y, &width, &height)) return;
+
+    const uint8_t *glyph = font[(unsigned char)c];
+    uint64_t pair = pixel_pair(color);
     for (uint32_t i = 0; i < height; i++) {
-        for (uint32_t j = 0; j < width; j++) {
-            draw_pixel(fb, x + j, y + i, color);
+        uint32_t *row = row_of(fb, y + i) + x;
+        uint8_t bits = glyph[i / 2];
+        if (width == DISPLAY_GLYPH_WIDTH) {
+            for (; bits; bits &= bits - 1) {
+                *(pair_t *)(row + 2 * __builtin_ctz(bits)) = pair;
+            }
+        } else {
+            for (uint32_t j = 0; j < width; j++) {
+                if (bits & (1 << (j / 2))) row[j] = color;
+            }
         }
     }
+    if (buffered(fb)) mark_dirty(x, y, x + width, y + height);
 }
 
-void draw_char(struct limine_framebuffer *fb, char c, uint32_t x, uint32_t y, uint32_t color) {
-    if (c < 128) {
-        for (int i = 0; i < 8; i++) {
-            for (int j = 0; j < 8; j++) {
-                if (font[c][i] & (1 << j)) {
-                    // Draw a larger pixel (2x2 block)
-                    draw_pixel(fb, x + j * 2, y + i * 2, color);
-                    draw_pixel(fb, x + j * 2 + 1, y + i * 2, color);
-                    draw_pixel(fb, x + j * 2, y + i * 2 + 1, color);
-                    draw_pixel(fb, x + j * 2 + 1, y + i * 2 + 1, color);
-                }
+// The atlas for a color pair, rendering it over the oldest if it has none
+// yet; NULL without a back buffer. The lock held.
+static const struct glyph_atlas *atlas_for(uint32_t color, uint32_t background) {
+    if (!display.atlas) return NULL;
+    for (uint32_t i = 0; i < DISPLAY_ATLAS_SLOTS; i++) {
+        struct glyph_atlas *a = &display.atlas[i];
+        if (a->valid && a->color == color && a->background == background) return a;
+    }
+
+    struct glyph_atlas *a = &display.atlas[display.atlas_next];
+    display.atlas_next = (display.atlas_next + 1) % DISPLAY_ATLAS_SLOTS;
+
+    uint64_t on = pixel_pair(color), off = pixel_pair(background);
+    for (uint32_t c = 0; c < 128; c++) {
+        for (uint32_t r = 0; r < 8; r++) {
+            for (uint32_t k = 0; k < DISPLAY_GLYPH_WIDTH / 2; k++) {
+                a->rows[c][r][k] = (font[c][r] & (1 << k)) ? on : off;
             }
         }
     }
+    a->color = color;
+    a->background = background;
+    a->valid = true;
+    return a;
+}
+
+void draw_glyph(struct limine_framebuffer *fb, char c, uint32_t x, uint32_t y, uint32_t color, uint32_t background) {
+    uint32_t width = DISPLAY_GLYPH_WIDTH, height = DISPLAY_GLYPH_HEIGHT;
+    if ((unsigned char)c >= 128) c = ' ';
+    if (!clip(fb, x, y, &width, &height)) return;
+
+    uint64_t flags = lock_display(fb);
+    const struct glyph_atlas *a = atlas_for(color, background);
+    if (!a) {
+        fill_rect(fb, x, y, width, height, background);
+        put_char(fb, c, x, y, color);
+        unlock_display(fb, flags);
+        return;
+    }
+
+    for (uint32_t i = 0; i < height; i++) {
+        const uint64_t *src = a->rows[(unsigned char)c][i / 2];
+        uint32_t *row = row_of(fb, y + i) + x;
+        if (width == DISPLAY_GLYPH_WIDTH) {
+            for (uint32_t k = 0; k < DISPLAY_GLYPH_WIDTH / 2; k++) ((pair_t *)row)[k] = src[k];
+        } else {
+            memcpy(row, src, width * sizeof(uint32_t));
+        }
+    }
+    mark_dirty(x, y, x + width, y + height);
+    unlock_display(fb, flags);
+}
+
+void draw_char(struct limine_framebuffer *fb, char c, uint32_t x, uint32_t y, uint32_t color) {
+    uint64_t flags = lock_display(fb);
+    put_char(fb, c, x, y, color);
+    unlock_display(fb, flags);
 }
 
 void draw_string(struct limine_framebuffer *fb, const char *str, uint32_t x, uint32_t y, uint32_t color) {
+    uint64_t flags = lock_display(fb);
     while (*str) {
-        draw_char(fb, *str, x, y, color);
-        x += 12; // Change from 8 to 16 for doubled size
+        put_char(fb, *str, x, y, color);
+        x += DISPLAY_GLYPH_WIDTH;
         str++;
     }
+    unlock_display(fb, flags);
 }
 
 void clear_screen(struct limine_framebuffer *fb) {
+    uint64_t flags = lock_display(fb);
+    if (buffered(fb)) display.row_base = 0;
+    fill_rect(fb, 0, 0, fb->width, fb->height, 0x000000); // Clears screen with black color
+    unlock_display(fb, flags);
+}
+
+bool display_init(struct limine_framebuffer *fb) {
+    if (!fb || fb->bpp != 32 || !fb->width || !fb->height) return false;
+    if (display.buffer) return display.fb == fb;
+
+    uint32_t *buffer = vmalloc((uint64_t)fb->width * fb->height * sizeof(uint32_t));
+    if (!buffer) return false;
+
+    // Without atlases, glyph cells are filled and drawn bit by bit
+    struct glyph_atlas *atlas = vmalloc(DISPLAY_ATLAS_SLOTS * sizeof(struct glyph_atlas));
+    if (atlas) memset(atlas, 0, DISPLAY_ATLAS_SLOTS * sizeof(struct glyph_atlas));
+
+    // The only time VRAM is read: what is already on screen is kept
     for (uint32_t y = 0; y < fb->height; y++) {
-        for (uint32_t x = 0; x < fb->width; x++) {
-            draw_pixel(fb, x, y, 0x000000); // Clears screen with black color
+        memcpy(buffer + (uint64_t)y * fb->width, (uint8_t *)fb->address + (uint64_t)y * fb->pitch,
+               fb->width * sizeof(uint32_t));
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&display_lock);
+    display.fb = fb;
+    display.width = fb->width;
+    display.height = fb->height;
+    display.row_base = 0;
+    display.dirty_count = 0;
+    display.atlas = atlas;
+    display.buffer = buffer;
+    spinlock_release_irqrestore(&display_lock, flags);
+    return true;
+}
+
+void display_flush(struct limine_framebuffer *fb) {
+    // Direct drawing is on screen already
+    if (!buffered(fb)) return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&display_lock);
+    for (uint32_t i = 0; i < display.dirty_count; i++) {
+        struct dirty_rect *d = &display.dirty[i];
+        for (uint32_t y = d->y0; y < d->y1; y++) {
+            volatile uint32_t *vram = (volatile uint32_t *)((uint8_t *)fb->address + (uint64_t)y * fb->pitch);
+            stream_span(vram + d->x0, row_of(fb, y) + d->x0, d->x1 - d->x0);
         }
     }
-}
\ No newline at end of file
+    asm volatile("sfence" ::: "memory");
+    display.dirty_count = 0;
+    spinlock_release_irqrestore(&display_lock, flags);
+}
+
+void display_scroll(struct limine_framebuffer *fb, uint32_t pixels, uint32_t color) {
+    if (!pixels) return;
+    if (pixels >= fb->height) {
+        draw_rect(fb, 0, 0, fb->width, fb->height, color);
+        return;
+    }
+
+    uint64_t flags = lock_display(fb);
+    if (buffered(fb)) {
+        // Every row on screen changes, but the buffer only loses its top
+        display.row_base = (display.row_base + pixels) % display.height;
+        fill_rect(fb, 0, fb->height - pixels, fb->width, pixels, color);
+        mark_all_dirty();
+    } else {
+        memmove(fb->address, (uint8_t *)fb->address + (uint64_t)pixels * fb->pitch,
+                (uint64_t)(fb->height - pixels) * fb->pitch);
+        fill_rect(fb, 0, fb->height - pixels, fb->width, pixels, color);
+    }
+    unlock_display(fb, flags);
+}
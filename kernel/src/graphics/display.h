@@ -2,13 +2,40 @@
 #define DISPLAY_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <limine.h>
 
-// Basic drawing functions
+// Font cells are 8x8, drawn at twice the size
+#define DISPLAY_GLYPH_WIDTH  16
+#define DISPLAY_GLYPH_HEIGHT 16
+
+// Basic drawing functions. Once display_init() has given fb a back buffer
+// they draw into RAM, and nothing reaches the screen until display_flush().
 void draw_pixel(struct limine_framebuffer *fb, uint32_t x, uint32_t y, uint32_t color);
 void draw_rect(struct limine_framebuffer *fb, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t color);
 void draw_char(struct limine_framebuffer *fb, char c, uint32_t x, uint32_t y, uint32_t color);
 void draw_string(struct limine_framebuffer *fb, const char *str, uint32_t x, uint32_t y, uint32_t color);
 void clear_screen(struct limine_framebuffer *fb);
 
-#endif // DISPLAY_H
\ No newline at end of file
+// A whole glyph cell, background included, copied from a pre-rendered
+// atlas for the color pair a row at a time
+void draw_glyph(struct limine_framebuffer *fb, char c, uint32_t x, uint32_t y, uint32_t color, uint32_t background);
+
+// Put a RAM back buffer in front of fb, seeded from what is on screen.
+// Needs the heap; false if fb is not 32 bpp or there is no memory, and
+// drawing stays direct.
+bool display_init(struct limine_framebuffer *fb);
+
+// Copy what changed since the last flush to the framebuffer, with
+// streaming stores so VRAM is only ever written
+void display_flush(struct limine_framebuffer *fb);
+
+// For the exception path: fill straight into the framebuffer, past the
+// back buffer and without the lock, which the fault may have been taken in
+void display_panic_rect(struct limine_framebuffer *fb, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t color);
+
+// Move the picture up by pixels rows, filling the bottom with color. With a
+// back buffer this moves its first row instead of the pixels.
+void display_scroll(struct limine_framebuffer *fb, uint32_t pixels, uint32_t color);
+
+#endif // DISPLAY_H
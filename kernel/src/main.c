@@ -11,6 +11,17 @@
 #include <core/attributes.h>
 #include <utils/log.h>
 
+// Log memcpy/memset timings during boot
+#define MEM_BENCHMARK 0
+// Log filesystem timings once the flushers are running
+#define FS_BENCHMARK 0
+// Charge heap memory to call sites and log the largest holders after boot
+#define HEAP_TRACKING 0
+// Run the microbenchmarks after boot and exit QEMU; set by make kbench
+#ifndef KBENCH
+#define KBENCH 0
+#endif
+
 // Graphics
 #include <graphics/fbcheck.h>
 #include <graphics/display.h>
@@ -22,14 +33,23 @@
 #include <core/idt.h>
 #include <core/acpi.h>
 #include <core/pit.h>
+#include <core/time.h>
+#include <core/vdso.h>
 #include <core/smp.h>
 #include <core/syscalls.h>
 #include <core/process.h>
+#include <core/fpu.h>
+#include <core/profile.h>
+#include <core/boot.h>
+#include <core/kbench.h>
+#include <core/counter.h>
 
 // Memory
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <mm/heap.h>
+#include <mm/vma.h>
+#include <mm/tlb.h>
 
 // Drivers
 #include <core/drivers/ps2/keyboard.h>
@@ -40,15 +60,18 @@
 #include <core/drivers/usb/keyboard.h>
 #include <core/drivers/ioapic.h>
 #include <core/drivers/lapic.h>
+#include <core/drivers/irq.h>
 #include <core/drivers/net/ip.h>
 #include <core/drivers/net/e1000.h>
+#include <core/workqueue.h>
 #include <core/drivers/net/netdev.h>
 #include <core/drivers/storage/nvme.h>
+#include <core/drivers/storage/ramdisk.h>
+#include <core/drivers/storage/virtio_blk.h>
 #include <core/drivers/serial/serial.h>
 #include <core/drivers/ps2/mouse.h>
 #include <core/drivers/usb/mouse.h>
 #include <core/drivers/tty/tty.h>
-#include <core/drivers/tty/pipe.h>
 #include <core/drivers/rtc/rtc.h>
 
 // Net
@@ -57,9 +80,13 @@
 #include <net/http/https.h>
 #include <net/dns.h>
 #include <net/wifi.h>
+#include <net/capture.h>
 
 // Filesystem
 #include <fs/ext2.h>
+#include <fs/bcache.h>
+#include <fs/page_cache.h>
+#include <fs/tmpfs.h>
 
 // Global framebuffer pointer for exception handler
 struct limine_framebuffer* global_framebuffer;
@@ -68,14 +95,8 @@ struct limine_framebuffer* global_framebuffer;
 #define STACK_SIZE 16384 // 16 KB for each stack
 
 // Stacks for different CPU modes and interrupts
+// Interrupt stacks are per CPU, see gdt_init()
 static uint8_t kernel_stack[STACK_SIZE] __attribute__((aligned(16)));
-static uint8_t ist1_stack[STACK_SIZE] __attribute__((aligned(16))); // Debug exceptions
-static uint8_t ist2_stack[STACK_SIZE] __attribute__((aligned(16))); // NMI
-static uint8_t ist3_stack[STACK_SIZE] __attribute__((aligned(16))); // Double Fault
-static uint8_t ist4_stack[STACK_SIZE] __attribute__((aligned(16))); // Machine Check
-static uint8_t ist5_stack[STACK_SIZE] __attribute__((aligned(16))); // Stack Fault
-static uint8_t ist6_stack[STACK_SIZE] __attribute__((aligned(16))); // GPF
-static uint8_t ist7_stack[STACK_SIZE] __attribute__((aligned(16))); // General interrupts
 
 // Function to get the top of a stack (stack grows downward on x86)
 static inline uint64_t stack_top(uint8_t* stack) {
@@ -84,18 +105,21 @@ static inline uint64_t stack_top(uint8_t* stack) {
 
 // Exception handler that displays information
 void general_exception_handler(struct interrupt_frame_error* frame) {
-    uint8_t vector = frame->error_code >> 3;  // Get vector from error code
+    uint8_t vector = interrupt_frame_vector(frame);
     uint64_t cr2;
     char buffer[256];
 
+    // Sampling NMIs are not errors
+    if (vector == INT_NMI && profile_nmi(frame)) return;
+
+    // Queued messages first, then everything from here on synchronously
+    log_panic();
+
     // Get CR2 for page faults
     if (vector == INT_PAGE_FAULT) {
-        asm volatile ("mov cr2, rax" : "=a"(cr2));
+        asm volatile ("mov rax, cr2" : "=a"(cr2));
     }
 
-    // Clear a portion of the screen
-    draw_rect(global_framebuffer, 0, 140, global_framebuffer->width, 100, BLACK);
-
     // Display exception information
     log_error("EXCEPTION: %s", get_exception_name(vector));
 
@@ -107,16 +131,121 @@ void general_exception_handler(struct interrupt_frame_error* frame) {
         log_error("CR2: 0x%x", cr2);
     }
 
+    // Clear a portion of the screen, after the log in case the fault was
+    // taken while drawing; straight to VRAM, as the display lock may be held
+    display_panic_rect(global_framebuffer, 0, 140, global_framebuffer->width, 100, BLACK);
+
     // Halt the system
     while (1) {
         hlt();
     }
 }
 
+// Page faults go to the VMM first (copy-on-write, demand paging), anything else is fatal
+void page_fault_handler(struct interrupt_frame_error* frame) {
+    uint64_t cr2;
+    asm volatile ("mov rax, cr2" : "=a"(cr2));
+
+    if (vmm_handle_page_fault(cr2, frame->error_code) ||
+        vma_handle_fault(cr2, frame->error_code)) {
+        return;
+    }
+    general_exception_handler(frame);
+}
+
+// Init functions that cannot fail, for the boot table
+#define BOOT_VOID(fn) static bool boot_##fn(void) { fn(); return true; }
+BOOT_VOID(usb_init)
+BOOT_VOID(usb_keyboard_init)
+BOOT_VOID(usb_mouse_init)
+BOOT_VOID(keyboard_init)
+BOOT_VOID(ip_init)
+BOOT_VOID(netdev_init)
+BOOT_VOID(net_init)
+BOOT_VOID(nvme_init)
+BOOT_VOID(nvme_init_cpu_queues)
+BOOT_VOID(virtio_blk_init_cpu_queues)
+BOOT_VOID(dns_init)
+BOOT_VOID(bcache_flusher_init)
+BOOT_VOID(page_cache_flusher_init)
+
+static bool boot_mouse(void) {
+    mouse_init();
+    mouse_enable();
+    return true;
+}
+
+// The root is the first device holding an ext2 filesystem: a boot
+// ramdisk when one is loaded, then NVMe, then virtio-blk
+static bool boot_root_fs(void) {
+    struct block_device* ramdisk = ramdisk_init();
+    if (ramdisk && ext2_init_device(ramdisk)) return true;
+    if (ext2_init(0)) return true;
+    return ext2_init_device(virtio_blk_get_device(0));
+}
+
+static bool boot_virtio_blk(void) {
+    return virtio_blk_init() != 0;
+}
+
+static bool boot_tmpfs(void) {
+    return tmpfs_mount("/tmp");
+}
+
+static bool boot_counters(void) {
+    return counters_mount("/proc/counters");
+}
+
+static bool boot_profile(void) {
+    return profile_mount("/proc/profile");
+}
+
+static bool boot_heap(void) {
+    return heap_mount("/proc/heap");
+}
+
+static bool boot_capture(void) {
+    return net_capture_mount("/proc/capture");
+}
+
+// What waits for SMP and the workqueue, run as dependencies allow. The
+// 8042 serves keyboard and mouse, so they go one after the other.
+static struct boot_step boot_steps[] = {
+    { .name = "usb", .init = boot_usb_init },
+    { .name = "usb-keyboard", .init = boot_usb_keyboard_init, .deps = { "usb" } },
+    { .name = "usb-mouse", .init = boot_usb_mouse_init, .deps = { "usb" } },
+    { .name = "ps2-keyboard", .init = boot_keyboard_init },
+    { .name = "ps2-mouse", .init = boot_mouse, .deps = { "ps2-keyboard" } },
+    { .name = "ip", .init = boot_ip_init },
+    { .name = "netdev", .init = boot_netdev_init, .deps = { "ip" } },
+    { .name = "net", .init = boot_net_init, .deps = { "netdev" } },
+    { .name = "wifi", .init = wifi_init, .deps = { "net" } },
+    { .name = "nvme", .init = boot_nvme_init },
+    { .name = "nvme-queues", .init = boot_nvme_init_cpu_queues, .deps = { "nvme" } },
+    { .name = "virtio-blk", .init = boot_virtio_blk },
+    { .name = "virtio-blk-queues", .init = boot_virtio_blk_init_cpu_queues, .deps = { "virtio-blk" } },
+    { .name = "root-fs", .init = boot_root_fs, .deps = { "nvme-queues", "virtio-blk-queues" } },
+    { .name = "tmpfs", .init = boot_tmpfs, .deps = { "root-fs" } },
+    { .name = "counters", .init = boot_counters },
+    { .name = "profile", .init = boot_profile },
+    { .name = "heap", .init = boot_heap },
+    { .name = "capture", .init = boot_capture },
+    { .name = "bcache-flusher", .init = boot_bcache_flusher_init, .deps = { "root-fs" } },
+    { .name = "page-cache-flusher", .init = boot_page_cache_flusher_init, .deps = { "root-fs" } },
+    { .name = "dns", .init = boot_dns_init, .flags = BOOT_DEFERRED, .deps = { "net" } },
+    { .name = "http", .init = http_init, .flags = BOOT_DEFERRED, .deps = { "net" } },
+    { .name = "tls", .init = tls_init, .flags = BOOT_DEFERRED },
+    { .name = "https", .init = https_init, .flags = BOOT_DEFERRED, .deps = { "http", "tls" } },
+};
+
 void kmain(void) {
+    // Pick the string routines before anything copies memory
+    smp_early_init();
+    mem_init();
+
     // Initialize logging first
     log_init();
-    log_info("Kernel Initialization Started");
+    boot_mark("Kernel Initialization Started");
 
     // Disable interrupts until we're fully initialized
     cli();
@@ -130,45 +259,40 @@ void kmain(void) {
     log_debug("Framebuffer Check Complete");
 
     pmm_init(memmap_request.response);
-    log_info("Physical Memory Manager Initialized");
+    boot_mark("Physical Memory Manager Initialized");
 
     vmm_init();
-    log_info("Virtual Memory Manager Initialized");
+    boot_mark("Virtual Memory Manager Initialized");
 
     heap_init();
-    log_info("Heap Initialized");
+#if HEAP_TRACKING
+    heap_track(true);
+#endif
+    boot_mark("Heap Initialized");
+
+    // Drawing goes through RAM from here on
+    if (display_init(global_framebuffer)) boot_mark("Framebuffer Back Buffer Initialized");
+
+#if MEM_BENCHMARK
+    mem_benchmark();
+#endif
 
     gdt_init();
-    log_info("Global Descriptor Table Initialized");
+    boot_mark("Global Descriptor Table Initialized");
 
     // Set up TSS stacks
     log_debug("Setting up TSS Stacks");
     gdt_load_tss(stack_top(kernel_stack)); // RSP0 - Kernel stack for privilege changes
 
-    // Set up IST entries in TSS for exception handling
-    log_debug("Setting up Interrupt Stack Table Entries");
-    uint64_t* ist_ptr;
-    ist_ptr = (uint64_t*)(stack_top(ist1_stack));
-    *(ist_ptr - 1) = stack_top(ist1_stack);  // Debug exceptions
-    ist_ptr = (uint64_t*)(stack_top(ist2_stack));
-    *(ist_ptr - 1) = stack_top(ist2_stack);  // NMI
-    ist_ptr = (uint64_t*)(stack_top(ist3_stack));
-    *(ist_ptr - 1) = stack_top(ist3_stack);  // Double fault
-    ist_ptr = (uint64_t*)(stack_top(ist4_stack));
-    *(ist_ptr - 1) = stack_top(ist4_stack);  // Machine check
-    ist_ptr = (uint64_t*)(stack_top(ist5_stack));
-    *(ist_ptr - 1) = stack_top(ist5_stack);  // Stack fault
-    ist_ptr = (uint64_t*)(stack_top(ist6_stack));
-    *(ist_ptr - 1) = stack_top(ist6_stack);  // GPF
-    ist_ptr = (uint64_t*)(stack_top(ist7_stack));
-    *(ist_ptr - 1) = stack_top(ist7_stack);  // General interrupts
-
     idt_init();
-    log_info("Interrupt Descriptor Table Initialized");
+    boot_mark("Interrupt Descriptor Table Initialized");
 
     for (int i = 0; i < 32; i++) {
         register_exception_handler(i, general_exception_handler);
     }
+    register_exception_handler(INT_PAGE_FAULT, page_fault_handler);
+
+    fpu_init();
 
     // Enable interrupts
     log_debug("Enabling Interrupts");
@@ -176,107 +300,96 @@ void kmain(void) {
     log_debug("Enabled Interrupts");
 
     pic_init();
-    log_info("PIC Initialized");
+    boot_mark("PIC Initialized");
 
     ioapic_init();
-    log_info("IOAPIC Initialized");
+    boot_mark("IOAPIC Initialized");
 
     lapic_init();
     lapic_enable();
-    log_info("Local APIC Initialized");
-
-    usb_init();
-    log_info("USB Initialized");
+    boot_mark("Local APIC Initialized");
 
-    keyboard_init();
-    log_info("Keyboard Initialized");
+    time_init();
+    boot_mark("Clocksource Initialized");
 
-    mouse_init();
-    mouse_enable();
-    log_info("PS/2 Mouse Initialized");
-
-    usb_mouse_init();
-    log_info("USB Mouse Initialized");
-
-    usb_keyboard_init();
-    log_info("USB Keyboard Initialized");
+    vdso_init();
+    boot_mark("vDSO Initialized");
 
     acpi_init();
-    log_info("ACPI Initialized");
-
-    pci_init();
-    log_info("PCI Initialized");
+    boot_mark("ACPI Initialized");
 
-    ip_init();
-    log_info("IP Stack Initialized");
+    pmm_numa_init();
+    boot_mark("NUMA Initialized");
 
-    netdev_init();
-    struct netdev* net = netdev_get_default();
-    log_info("Network Devices Initialized");
-
-    net_init();
-    log_info("Network Stack Initialized");
-
-    nvme_init();
-    log_info("NVMe Initialized");
+    pci_init();
+    boot_mark("PCI Initialized");
 
-    http_init();
-    log_info("HTTP Initialized");
+    serial_init(COM1);
+    serial_enable_rx_interrupt(COM1);
+    log_enable_async();
+    boot_mark("Serial Communication Initialized");
 
-    https_init();
-    log_info("HTTPS Initialized");
+    process_init();
+    boot_mark("Process Management Initialized");
 
-    tls_init();
-    log_info("TLS Initialized");
+    pit_init();
+    boot_mark("PIT Initialized");
 
-    dns_init();
-    log_info("DNS Initialized");
+    scheduler_init();
+    boot_mark("Scheduler Initialized");
 
-    wifi_init();
-    log_info("WiFi Initialized");
+    smp_init();
+    smp_boot_aps();
+    boot_mark("SMP Initialized");
 
-    ext2_init(0);
-    log_info("Filesystem Initialized");
+    tlb_init();
+    boot_mark("TLB Shootdown Initialized");
 
-    serial_init(COM1);
-    log_info("Serial Communication Initialized");
+    scheduler_init_cpu();
 
-    process_init();
-    log_info("Process Management Initialized");
+    workqueue_init();
+    boot_mark("Workqueues Initialized");
 
-    scheduler_init();
-    log_info("Scheduler Initialized");
+    irq_balance_init();
+    boot_mark("IRQ Balancing Initialized");
 
-    pit_init();
-    log_info("PIT Initialized");
+    // Drivers and services, in parallel from here on
+    boot_run(boot_steps, sizeof(boot_steps) / sizeof(boot_steps[0]));
+    boot_mark("Boot Steps Complete");
 
-    smp_init();
-    smp_boot_aps();
-    log_info("SMP Initialized");
+#if FS_BENCHMARK
+    fs_benchmark();
+#endif
 
     tty_init();
-    log_info("TTY Initialized");
-
-    pipe_create();
-    log_info("Pipe Created");
+    boot_mark("TTY Initialized");
 
     rtc_init();
-    log_info("RTC Initialized");
+    boot_mark("RTC Initialized");
 
     syscalls_init();
 
-    log_info("System calls initialized successfully");
+    boot_mark("System calls initialized successfully");
 
     // Draw a welcome message to the framebuffer
     draw_string(global_framebuffer, "Welcome to AlephOS!", 0, 0, WHITE);
-    log_info("Welcome message displayed");
+    display_flush(global_framebuffer);
+    boot_mark("Welcome message displayed");
 
     // Log the final initialization message
-    log_info("Kernel Initialization Complete");
+    boot_mark("Kernel Initialization Complete");
+    boot_timeline();
+#if HEAP_TRACKING
+    heap_dump_sites(16);
+#endif
+
+#if KBENCH
+    kbench_start();
+#endif
 
-    // Main kernel loop
+    // Main kernel loop, the BSP's idle context
     while (1) {
-        // Add any periodic kernel maintenance tasks here
+        scheduler_idle();
     }
 
     // BRUH :dd:
@@ -1,60 +1,258 @@
 #include <mm/heap.h>
 #include <utils/mem.h>
+#include <utils/asm.h>
 #include <mm/pmm.h>
 #include <mm/vmm.h>
+#include <mm/vmalloc.h>
+#include <core/smp.h>
+#include <core/ksyms.h>
+#include <core/syscalls.h>
+#include <fs/vfs.h>
+#include <fs/file.h>
+#include <utils/str.h>
+#include <utils/log.h>
+
+#define SITE_LINE_MAX 160
+#define SITE_REPORT_DEFAULT 10   // Sites listed when the control file is not told
 
 static struct heap_block* heap_start = NULL;
+static struct heap_block* heap_last = NULL;
 static struct heap_stats heap_statistics;
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
+// Segregated free lists and their occupancy bitmaps
+static struct heap_block* free_lists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+static uint32_t fl_bitmap = 0;
+static uint32_t sl_bitmap[HEAP_FL_COUNT];
+
+// Live memory per allocating call site, filled while tracking is on. Sites
+// are never dropped; once the table is three quarters full new ones are
+// lumped into site_overflow.
+struct heap_site {
+    uintptr_t site;           // Return address into the caller, 0 for an empty slot
+    size_t live_bytes;        // Block sizes, headers included
+    uint32_t live_count;
+    uint64_t allocs;          // Every allocation ever charged here
+    size_t mark_bytes;        // live_bytes and live_count at heap_leak_mark()
+    uint32_t mark_count;
+};
+
+static struct heap_site sites[HEAP_SITES];
+static struct heap_site site_overflow;
+static uint32_t site_count = 0;
+static volatile bool tracking = false;
+
+// Find or claim the entry for site; called with heap_lock held
+static struct heap_site* site_lookup(uintptr_t site) {
+    uint32_t slot = (uint32_t)((site * 0x9E3779B97F4A7C15ULL) >> (64 - HEAP_SITE_BITS));
+    while (sites[slot].site && sites[slot].site != site) {
+        slot = (slot + 1) & (HEAP_SITES - 1);
+    }
+    if (sites[slot].site) return &sites[slot];
+    if (site_count >= HEAP_SITES * 3 / 4) return &site_overflow;
 
-static struct heap_block* find_free_block(size_t size) {
-    struct heap_block* current = heap_start;
+    sites[slot].site = site;
+    site_count++;
+    return &sites[slot];
+}
 
-    while (current) {
-        if ((current->flags & BLOCK_FREE) && current->size >= size + sizeof(struct heap_block)) {
-            return current;
+// Add or take back bytes and blocks charged to site; heap_lock held
+static void site_charge(uintptr_t site, int64_t bytes, int32_t count) {
+    if (!site) return;
+    struct heap_site* entry = site_lookup(site);
+    entry->live_bytes += bytes;
+    entry->live_count += count;
+    if (count > 0) entry->allocs += count;
+}
+
+static void site_charge_locked(uintptr_t site, int64_t bytes, int32_t count) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+    site_charge(site, bytes, count);
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+}
+
+static inline struct heap_block* next_phys(struct heap_block* block) {
+    if (block->flags & BLOCK_LAST) return NULL;
+    return (struct heap_block*)((uint8_t*)block + block->size);
+}
+
+static inline struct heap_block* prev_phys(struct heap_block* block) {
+    if (!block->prev_size) return NULL;
+    return (struct heap_block*)((uint8_t*)block - block->prev_size);
+}
+
+// Map a block size to its first/second level class
+static void size_to_class(size_t size, int* fl, int* sl) {
+    if (size < HEAP_SMALL_SIZE) {
+        *fl = 0;
+        *sl = size / (HEAP_SMALL_SIZE / HEAP_SL_COUNT);
+    } else {
+        int msb = 63 - __builtin_clzll(size);
+        *fl = msb - HEAP_SMALL_SHIFT + 1;
+        *sl = (size >> (msb - HEAP_SL_SHIFT)) ^ HEAP_SL_COUNT;
+    }
+}
+
+// Round a request up so any block in the resulting class is large enough
+static size_t round_to_class(size_t size) {
+    if (size >= HEAP_SMALL_SIZE) {
+        int msb = 63 - __builtin_clzll(size);
+        size_t step = (size_t)1 << (msb - HEAP_SL_SHIFT);
+        size = (size + step - 1) & ~(step - 1);
+    }
+    return size;
+}
+
+static void insert_free(struct heap_block* block) {
+    int fl, sl;
+    size_to_class(block->size, &fl, &sl);
+
+    block->prev = NULL;
+    block->next = free_lists[fl][sl];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    free_lists[fl][sl] = block;
+
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+    block->flags |= BLOCK_FREE;
+}
+
+static void remove_free(struct heap_block* block) {
+    int fl, sl;
+    size_to_class(block->size, &fl, &sl);
+
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_lists[fl][sl] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+
+    if (!free_lists[fl][sl]) {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (!sl_bitmap[fl]) {
+            fl_bitmap &= ~(1U << fl);
         }
-        if (current->flags & BLOCK_LAST) break;
-        current = current->next;
     }
+    block->next = block->prev = NULL;
+    block->flags &= ~BLOCK_FREE;
+}
+
+// O(1) lookup of a free block of at least size bytes
+static struct heap_block* find_free_block(size_t size) {
+    int fl, sl;
+    size_to_class(round_to_class(size), &fl, &sl);
+    if (fl >= HEAP_FL_COUNT) return NULL;
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        uint32_t fl_map = (fl + 1 < 32) ? (fl_bitmap & (~0U << (fl + 1))) : 0;
+        if (!fl_map) return NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
 
-    return NULL;
+    return free_lists[fl][sl];
 }
 
-static struct heap_block* expand_heap(size_t size) {
-    size_t pages_needed = (size + sizeof(struct heap_block) + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE;
-    void* new_mem = pmm_alloc_page();
+// Keep the boundary tag of the block after this one in sync
+static inline void update_next_tag(struct heap_block* block) {
+    struct heap_block* next = next_phys(block);
+    if (next) {
+        next->prev_size = block->size;
+    }
+}
 
-    if (!new_mem) return NULL;
+// Merge a free block with its free neighbours; block must not be on a list
+static struct heap_block* coalesce(struct heap_block* block) {
+    struct heap_block* next = next_phys(block);
+    if (next && (next->flags & BLOCK_FREE)) {
+        remove_free(next);
+        block->size += next->size;
+        block->flags |= (next->flags & BLOCK_LAST);
+        if (heap_last == next) heap_last = block;
+        heap_statistics.total_blocks--;
+        heap_statistics.free_blocks--;
+    }
 
-    struct heap_block* last = heap_start;
-    while (!(last->flags & BLOCK_LAST)) {
-        last = last->next;
+    struct heap_block* prev = prev_phys(block);
+    if (prev && (prev->flags & BLOCK_FREE)) {
+        remove_free(prev);
+        prev->size += block->size;
+        prev->flags |= (block->flags & BLOCK_LAST);
+        if (heap_last == block) heap_last = prev;
+        block = prev;
+        heap_statistics.total_blocks--;
+        heap_statistics.free_blocks--;
     }
 
-    struct heap_block* new_block = (struct heap_block*)((uint8_t*)last + last->size);
+    update_next_tag(block);
+    return block;
+}
 
-    // Map the new pages
-    for (size_t i = 0; i < pages_needed; i++) {
-        uint64_t phys = (uint64_t)pmm_alloc_page();
-        if (!phys || !vmm_map_page((uint64_t)new_block + (i * HEAP_PAGE_SIZE), phys, PTE_PRESENT | PTE_WRITABLE)) {
-            // Failed to allocate/map pages - cleanup
-            for (size_t j = 0; j < i; j++) {
-                vmm_unmap_page((uint64_t)new_block + (j * HEAP_PAGE_SIZE));
-            }
-            return NULL;
+// Map pages_needed fresh pages at virt, as few physically contiguous runs as possible
+static bool map_heap_pages(uint64_t virt, size_t pages_needed) {
+    size_t mapped = 0;
+
+    while (mapped < pages_needed) {
+        size_t order = pmm_order_for_pages(pages_needed - mapped);
+        if (order > PMM_MAX_ORDER) order = PMM_MAX_ORDER;
+        if (((size_t)1 << order) > pages_needed - mapped) order--;
+
+        uint64_t phys_base = (uint64_t)pmm_alloc_pages(order);
+        while (!phys_base && order > 0) {
+            phys_base = (uint64_t)pmm_alloc_pages(--order);
         }
+        if (!phys_base) break;
+
+        size_t run = ((size_t)1 << order) * HEAP_PAGE_SIZE;
+        if (!vmm_map_range(virt + mapped * HEAP_PAGE_SIZE, phys_base, run,
+                           PTE_PRESENT | PTE_WRITABLE)) {
+            vmm_unmap_range(virt + mapped * HEAP_PAGE_SIZE, run);
+            pmm_free_pages((void*)phys_base, order);
+            goto fail;
+        }
+        mapped += (size_t)1 << order;
     }
 
+    if (mapped == pages_needed) return true;
+
+fail:
+    // Failed to allocate/map pages - cleanup
+    for (size_t i = 0; i < mapped; i++) {
+        uint64_t phys = vmm_get_phys_addr(virt + i * HEAP_PAGE_SIZE);
+        pmm_free_page((void*)phys);
+    }
+    vmm_unmap_range(virt, mapped * HEAP_PAGE_SIZE);
+    return false;
+}
+
+static struct heap_block* expand_heap(size_t size) {
+    // Grow in large chunks so the heap does not creep up page by page
+    if (size < HEAP_GROW_CHUNK) size = HEAP_GROW_CHUNK;
+    size_t pages_needed = (size + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE;
+
+    struct heap_block* new_block = (struct heap_block*)((uint8_t*)heap_last + heap_last->size);
+    if (!map_heap_pages((uint64_t)new_block, pages_needed)) return NULL;
+
     // Setup new block
     new_block->magic = HEAP_BLOCK_MAGIC;
     new_block->size = pages_needed * HEAP_PAGE_SIZE;
-    new_block->flags = BLOCK_FREE | BLOCK_LAST;
-    new_block->prev = last;
+    new_block->flags = BLOCK_LAST;
+    new_block->prev_size = heap_last->size;
+    new_block->prev = NULL;
     new_block->next = NULL;
 
     // Update old last block
-    last->flags &= ~BLOCK_LAST;
-    last->next = new_block;
+    heap_last->flags &= ~BLOCK_LAST;
+    heap_last = new_block;
 
     // Update statistics
     heap_statistics.total_size += new_block->size;
@@ -62,79 +260,63 @@ static struct heap_block* expand_heap(size_t size) {
     heap_statistics.total_blocks++;
     heap_statistics.free_blocks++;
 
+    new_block = coalesce(new_block);
+    insert_free(new_block);
     return new_block;
 }
 
+// Trim a used block to size bytes, returning the tail to the free lists
 static void split_block(struct heap_block* block, size_t size) {
-    size_t total_size = block->size;
-    size_t remaining = total_size - size - sizeof(struct heap_block);
-
-    if (remaining < HEAP_MIN_BLOCK_SIZE) return;  // Too small to split
+    if (block->size < size + HEAP_MIN_BLOCK_SIZE) return;  // Too small to split
 
-    struct heap_block* new_block = (struct heap_block*)((uint8_t*)block + size + sizeof(struct heap_block));
+    struct heap_block* new_block = (struct heap_block*)((uint8_t*)block + size);
 
     new_block->magic = HEAP_BLOCK_MAGIC;
-    new_block->size = remaining;
-    new_block->flags = BLOCK_FREE;
-    if (block->flags & BLOCK_LAST) {
-        new_block->flags |= BLOCK_LAST;
-    }
-    new_block->next = block->next;
-    new_block->prev = block;
-
-    if (block->next) {
-        block->next->prev = new_block;
-    }
+    new_block->size = block->size - size;
+    new_block->flags = block->flags & BLOCK_LAST;
+    new_block->prev_size = size;
+    new_block->next = NULL;
+    new_block->prev = NULL;
 
-    block->next = new_block;
-    block->size = size + sizeof(struct heap_block);
+    block->size = size;
     block->flags &= ~BLOCK_LAST;
+    if (heap_last == block) heap_last = new_block;
 
     // Update statistics
     heap_statistics.total_blocks++;
     heap_statistics.free_blocks++;
-}
-
-static void merge_free_blocks(struct heap_block* block) {
-    // Merge with next block if it's free
-    while (block->next && (block->next->flags & BLOCK_FREE)) {
-        struct heap_block* next = block->next;
-        block->size += next->size;
-        block->flags |= (next->flags & BLOCK_LAST);
-        block->next = next->next;
-
-        if (next->next) {
-            next->next->prev = block;
-        }
+    heap_statistics.used_size -= new_block->size;
+    heap_statistics.free_size += new_block->size;
 
-        // Update statistics
-        heap_statistics.total_blocks--;
-        heap_statistics.free_blocks--;
-    }
+    update_next_tag(new_block);
+    new_block = coalesce(new_block);
+    insert_free(new_block);
 }
 
 bool heap_init(void) {
-    // Allocate initial heap space
-    void* heap_mem = pmm_alloc_page();
-    if (!heap_mem) return false;
+    // Map initial heap space in its own region rather than over the identity map
+    void* heap_mem = (void*)HEAP_VIRT_BASE;
+    if (!map_heap_pages(HEAP_VIRT_BASE, HEAP_GROW_CHUNK / HEAP_PAGE_SIZE)) return false;
 
-    if (!vmm_map_page((uint64_t)heap_mem, (uint64_t)heap_mem, PTE_PRESENT | PTE_WRITABLE)) {
-        pmm_free_page(heap_mem);
-        return false;
-    }
+    memset(free_lists, 0, sizeof(free_lists));
+    memset(sl_bitmap, 0, sizeof(sl_bitmap));
+    fl_bitmap = 0;
 
     // Initialize first block
     heap_start = (struct heap_block*)heap_mem;
     heap_start->magic = HEAP_BLOCK_MAGIC;
-    heap_start->size = HEAP_PAGE_SIZE;
-    heap_start->flags = BLOCK_FREE | BLOCK_LAST;
+    heap_start->size = HEAP_GROW_CHUNK;
+    heap_start->flags = BLOCK_LAST;
+    heap_start->prev_size = 0;
     heap_start->next = NULL;
     heap_start->prev = NULL;
+    heap_last = heap_start;
+    insert_free(heap_start);
 
     // Initialize statistics
-    heap_statistics.total_size = HEAP_PAGE_SIZE;
-    heap_statistics.used_size = 0;
-    heap_statistics.free_size = HEAP_PAGE_SIZE;
+    memset(&heap_statistics, 0, sizeof(heap_statistics));
+    heap_statistics.total_size = HEAP_GROW_CHUNK;
+    heap_statistics.free_size = HEAP_GROW_CHUNK;
     heap_statistics.total_blocks = 1;
     heap_statistics.free_blocks = 1;
 
@@ -142,84 +324,162 @@ bool heap_init(void) {
 }
 
 void* heap_alloc(size_t size) {
+    return heap_alloc_from(size, (uintptr_t)__builtin_return_address(0));
+}
+
+void* heap_alloc_from(size_t size, uintptr_t site) {
     if (!size) return NULL;
+    if (!tracking) site = 0;
+
+    // Large buffers get their own mapping instead of fragmenting the heap
+    if (size >= HEAP_LARGE_SIZE) {
+        void* ptr = vmalloc(size);
+        if (ptr && site) {
+            vmalloc_set_site(ptr, site);
+            site_charge_locked(site, (size + HEAP_PAGE_SIZE - 1) & ~(size_t)(HEAP_PAGE_SIZE - 1), 1);
+        }
+        return ptr;
+    }
 
     // Align size to ensure proper alignment of subsequent blocks
-    size = (size + 7) & ~7;
+    size = (size + sizeof(struct heap_block) + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+    if (size < HEAP_MIN_BLOCK_SIZE) size = HEAP_MIN_BLOCK_SIZE;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
 
     struct heap_block* block = find_free_block(size);
+    if (!block && expand_heap(round_to_class(size))) {
+        block = find_free_block(size);
+    }
     if (!block) {
-        block = expand_heap(size);
-        if (!block) return NULL;
+        spinlock_release(&heap_lock);
+        irq_restore(flags);
+        return NULL;
     }
 
-    // Split block if it's too large
-    split_block(block, size);
-
     // Mark block as used
-    block->flags &= ~BLOCK_FREE;
-
-    // Update statistics
+    remove_free(block);
     heap_statistics.used_size += block->size;
     heap_statistics.free_size -= block->size;
     heap_statistics.free_blocks--;
 
+    // Split block if it's too large
+    split_block(block, size);
+    block->site = site;
+    site_charge(site, block->size, 1);
+
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
     return block->data;
 }
 
 void heap_free(void* ptr) {
     if (!ptr) return;
+    if (is_vmalloc_addr(ptr)) {
+        uintptr_t site;
+        size_t size = vmalloc_size_site(ptr, &site);
+        vfree(ptr);
+        if (site) site_charge_locked(site, -(int64_t)size, -1);
+        return;
+    }
 
     struct heap_block* block = (struct heap_block*)((uint8_t*)ptr - sizeof(struct heap_block));
 
     // Validate block
-    if (block->magic != HEAP_BLOCK_MAGIC) return;
+    if (block->magic != HEAP_BLOCK_MAGIC || (block->flags & BLOCK_FREE)) return;
 
-    // Mark block as free
-    block->flags |= BLOCK_FREE;
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
 
     // Update statistics
     heap_statistics.used_size -= block->size;
     heap_statistics.free_size += block->size;
     heap_statistics.free_blocks++;
+    site_charge(block->site, -(int64_t)block->size, -1);
 
-    // Try to merge with adjacent free blocks
-    merge_free_blocks(block);
-    if (block->prev && (block->prev->flags & BLOCK_FREE)) {
-        merge_free_blocks(block->prev);
-    }
+    // Merge with adjacent free blocks and file under the new size
+    block = coalesce(block);
+    insert_free(block);
+
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
 }
 
 void* heap_realloc(void* ptr, size_t size) {
-    if (!ptr) return heap_alloc(size);
+    return heap_realloc_from(ptr, size, (uintptr_t)__builtin_return_address(0));
+}
+
+void* heap_realloc_from(void* ptr, size_t size, uintptr_t site) {
+    if (!ptr) return heap_alloc_from(size, site);
     if (!size) {
         heap_free(ptr);
         return NULL;
     }
 
+    // Moving between the heap and vmalloc always copies
+    if (is_vmalloc_addr(ptr) || size >= HEAP_LARGE_SIZE) {
+        size_t old_size = is_vmalloc_addr(ptr) ? vmalloc_size(ptr) :
+            ((struct heap_block*)((uint8_t*)ptr - sizeof(struct heap_block)))->size - sizeof(struct heap_block);
+        if (is_vmalloc_addr(ptr) && size <= old_size && size >= HEAP_LARGE_SIZE) return ptr;
+
+        void* new_ptr = heap_alloc_from(size, site);
+        if (!new_ptr) return NULL;
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        heap_free(ptr);
+        return new_ptr;
+    }
+
     struct heap_block* block = (struct heap_block*)((uint8_t*)ptr - sizeof(struct heap_block));
 
     // Validate block
-    if (block->magic != HEAP_BLOCK_MAGIC) return NULL;
+    if (block->magic != HEAP_BLOCK_MAGIC || (block->flags & BLOCK_FREE)) return NULL;
 
     size_t old_size = block->size - sizeof(struct heap_block);
+    size_t needed = (size + sizeof(struct heap_block) + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+    if (needed < HEAP_MIN_BLOCK_SIZE) needed = HEAP_MIN_BLOCK_SIZE;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+
+    // Resizing in place stays charged to the original caller
+    size_t old_block = block->size;
 
     // If new size is smaller, we can simply shrink the block
-    if (size <= old_size) {
-        split_block(block, size);
+    if (needed <= block->size) {
+        split_block(block, needed);
+        site_charge(block->site, (int64_t)block->size - (int64_t)old_block, 0);
+        spinlock_release(&heap_lock);
+        irq_restore(flags);
         return ptr;
     }
 
-    // If next block is free and has enough space, merge with it
-    if (block->next && (block->next->flags & BLOCK_FREE) &&
-        (block->size + block->next->size >= size + sizeof(struct heap_block))) {
-        merge_free_blocks(block);
-        split_block(block, size);
+    // If next block is free and has enough space, absorb it
+    struct heap_block* next = next_phys(block);
+    if (next && (next->flags & BLOCK_FREE) && block->size + next->size >= needed) {
+        remove_free(next);
+        block->size += next->size;
+        block->flags |= (next->flags & BLOCK_LAST);
+        if (heap_last == next) heap_last = block;
+        update_next_tag(block);
+
+        heap_statistics.used_size += next->size;
+        heap_statistics.free_size -= next->size;
+        heap_statistics.total_blocks--;
+        heap_statistics.free_blocks--;
+
+        split_block(block, needed);
+        site_charge(block->site, (int64_t)block->size - (int64_t)old_block, 0);
+        spinlock_release(&heap_lock);
+        irq_restore(flags);
         return ptr;
     }
 
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+
     // Otherwise, allocate new block and copy data
-    void* new_ptr = heap_alloc(size);
+    void* new_ptr = heap_alloc_from(size, site);
     if (!new_ptr) return NULL;
 
     memcpy(new_ptr, ptr, old_size);
@@ -229,13 +489,35 @@ void* heap_realloc(void* ptr, size_t size) {
 }
 
 void heap_get_stats(struct heap_stats* stats) {
-    if (stats) {
-        *stats = heap_statistics;
+    if (!stats) return;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+
+    *stats = heap_statistics;
+
+    // The largest free block sits in the highest occupied class
+    stats->largest_free = 0;
+    if (fl_bitmap) {
+        int fl = 31 - __builtin_clz(fl_bitmap);
+        int sl = 31 - __builtin_clz(sl_bitmap[fl]);
+        for (struct heap_block* b = free_lists[fl][sl]; b; b = b->next) {
+            if (b->size > stats->largest_free) stats->largest_free = b->size;
+        }
     }
+
+    stats->fragmentation = 0;
+    if (stats->free_size) {
+        stats->fragmentation = 100 - (uint32_t)((stats->largest_free * 100) / stats->free_size);
+    }
+
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
 }
 
 bool heap_check(void) {
     struct heap_block* current = heap_start;
+    struct heap_block* previous = NULL;
     size_t total_size = 0;
     size_t used_size = 0;
     size_t free_size = 0;
@@ -246,14 +528,15 @@ bool heap_check(void) {
         // Check magic number
         if (current->magic != HEAP_BLOCK_MAGIC) return false;
 
-        // Check pointers
-        if (current->next && current->next->prev != current) return false;
-        if (current->prev && current->prev->next != current) return false;
+        // Check boundary tags
+        if (current->prev_size != (previous ? previous->size : 0)) return false;
 
         total_size += current->size;
         total_blocks++;
 
         if (current->flags & BLOCK_FREE) {
+            // Free neighbours should always have been merged
+            if (previous && (previous->flags & BLOCK_FREE)) return false;
             free_size += current->size;
             free_blocks++;
         } else {
@@ -261,7 +544,20 @@ bool heap_check(void) {
         }
 
         if (current->flags & BLOCK_LAST) break;
-        current = current->next;
+        previous = current;
+        current = next_phys(current);
+    }
+    if (current != heap_last) return false;
+
+    // Every listed block must be free and filed under its own class
+    for (int fl = 0; fl < HEAP_FL_COUNT; fl++) {
+        for (int sl = 0; sl < HEAP_SL_COUNT; sl++) {
+            for (struct heap_block* b = free_lists[fl][sl]; b; b = b->next) {
+                int bfl, bsl;
+                size_to_class(b->size, &bfl, &bsl);
+                if (!(b->flags & BLOCK_FREE) || bfl != fl || bsl != sl) return false;
+            }
+        }
     }
 
     // Verify statistics
@@ -270,4 +566,203 @@ bool heap_check(void) {
             free_size == heap_statistics.free_size &&
             total_blocks == heap_statistics.total_blocks &&
             free_blocks == heap_statistics.free_blocks);
-}
\ No newline at end of file
+}
+
+void heap_track(bool enable) {
+    tracking = enable;
+}
+
+static char* append(char* p, char* end, const char* str) {
+    while (*str && p < end) *p++ = *str++;
+    return p;
+}
+
+static char* append_number(char* p, char* end, uint64_t value, uint32_t base) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value);
+    if (base == 16) p = append(p, end, "0x");
+    while (n && p < end) *p++ = digits[--n];
+    return p;
+}
+
+// Bytes a site holds, or has gained since the mark
+static int64_t site_weight(const struct heap_site* entry, bool since_mark) {
+    if (!since_mark) return (int64_t)entry->live_bytes;
+    return (int64_t)entry->live_bytes - (int64_t)entry->mark_bytes;
+}
+
+static void dump_site(const struct heap_site* entry, bool since_mark) {
+    char line[SITE_LINE_MAX];
+    char* end = line + SITE_LINE_MAX - 1;
+    char* p = append(line, end, "heap site=");
+
+    uint64_t start = 0;
+    const char* name = entry->site ? ksym_lookup(entry->site, &start) : "(other)";
+    if (name) {
+        p = append(p, end, name);
+        if (entry->site) {
+            p = append(p, end, "+");
+            p = append_number(p, end, entry->site - start, 16);
+        }
+    } else {
+        p = append_number(p, end, entry->site, 16);
+    }
+
+    p = append(p, end, since_mark ? " grown=" : " live=");
+    p = append_number(p, end, (uint64_t)site_weight(entry, since_mark), 10);
+    p = append(p, end, since_mark ? " new=" : " count=");
+    uint32_t count = entry->live_count;
+    if (since_mark) count = count > entry->mark_count ? count - entry->mark_count : 0;
+    p = append_number(p, end, count, 10);
+    p = append(p, end, " allocs=");
+    p = append_number(p, end, entry->allocs, 10);
+    *p = '\0';
+    log_string(LOG_LEVEL_RAW, line);
+}
+
+// Copy out the n heaviest sites under the lock, then name them without it
+static void dump_top(uint32_t n, bool since_mark) {
+    struct heap_site top[16];
+    if (n > sizeof(top) / sizeof(top[0])) n = sizeof(top) / sizeof(top[0]);
+    uint32_t found = 0;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+    for (uint32_t i = 0; i <= HEAP_SITES; i++) {
+        const struct heap_site* entry = i < HEAP_SITES ? &sites[i] : &site_overflow;
+        if (i < HEAP_SITES && !entry->site) continue;
+        int64_t weight = site_weight(entry, since_mark);
+        if (weight <= 0) continue;
+
+        // Insertion into the short sorted list
+        uint32_t pos = found;
+        while (pos && site_weight(&top[pos - 1], since_mark) < weight) pos--;
+        if (pos >= n) continue;
+        if (found < n) found++;
+        memmove(&top[pos + 1], &top[pos], (found - pos - 1) * sizeof(top[0]));
+        top[pos] = *entry;
+    }
+    uint32_t used = site_count;
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+
+    log_info("heap: %d of %d sites tracked%s", (int)used, HEAP_SITES * 3 / 4,
+             tracking ? "" : ", tracking off");
+    for (uint32_t i = 0; i < found; i++) dump_site(&top[i], since_mark);
+}
+
+void heap_dump_sites(uint32_t n) {
+    dump_top(n, false);
+}
+
+void heap_leak_mark(void) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+    for (uint32_t i = 0; i < HEAP_SITES; i++) {
+        sites[i].mark_bytes = sites[i].live_bytes;
+        sites[i].mark_count = sites[i].live_count;
+    }
+    site_overflow.mark_bytes = site_overflow.live_bytes;
+    site_overflow.mark_count = site_overflow.live_count;
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+}
+
+void heap_leak_report(uint32_t n) {
+    dump_top(n, true);
+}
+
+static ssize_t heap_file_readv(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    const char* status = file->private_data;
+    size_t len = strlen(status);
+    if (offset >= len) return 0;
+
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    return (ssize_t)iov_copy_to_iter(&iter, status + offset, len - offset);
+}
+
+// The site count after a command, SITE_REPORT_DEFAULT without one; false on junk
+static bool heap_file_count(const char* p, uint32_t* n) {
+    *n = 0;
+    while (*p == ' ') p++;
+    if (!*p) {
+        *n = SITE_REPORT_DEFAULT;
+        return true;
+    }
+    for (; *p; p++) {
+        if (*p < '0' || *p > '9') return false;
+        *n = *n * 10 + (uint32_t)(*p - '0');
+    }
+    return true;
+}
+
+static ssize_t heap_file_writev(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    (void)file; (void)offset;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    char command[32];
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    size_t len = iov_copy_from_iter(&iter, command, sizeof(command) - 1);
+    while (len && (command[len - 1] == '\n' || command[len - 1] == ' ')) len--;
+    command[len] = '\0';
+
+    uint32_t n;
+    if (strcmp(command, "track on") == 0) {
+        heap_track(true);
+    } else if (strcmp(command, "track off") == 0) {
+        heap_track(false);
+    } else if (strcmp(command, "mark") == 0) {
+        heap_leak_mark();
+    } else if (memcmp(command, "sites", 5) == 0 && (command[5] == '\0' || command[5] == ' ')) {
+        if (!heap_file_count(command + 5, &n)) return -EINVAL;
+        heap_dump_sites(n);
+    } else if (memcmp(command, "leaks", 5) == 0 && (command[5] == '\0' || command[5] == ' ')) {
+        if (!heap_file_count(command + 5, &n)) return -EINVAL;
+        heap_leak_report(n);
+    } else {
+        return -EINVAL;
+    }
+    return (ssize_t)total;
+}
+
+static uint64_t heap_file_size(struct file* file) {
+    return strlen(file->private_data);
+}
+
+static const struct file_ops heap_file_ops = {
+    .readv = heap_file_readv,
+    .writev = heap_file_writev,
+    .size = heap_file_size,
+};
+
+static int heap_file_open(void* data, const char* path, int flags, mode_t mode, struct file* file) {
+    (void)data; (void)mode; (void)flags;
+    if (*path) return -ENOENT;
+
+    // The state as of opening, as for /proc/profile
+    file->inode = 0;
+    file->private_data = (void*)(tracking ? "tracking on\n" : "tracking off\n");
+    file->ops = &heap_file_ops;
+    return 0;
+}
+
+static int heap_file_unlink(void* data, const char* path) {
+    (void)data; (void)path;
+    return -EACCES;
+}
+
+static const struct vfs_ops heap_vfs_ops = {
+    .open = heap_file_open,
+    .unlink = heap_file_unlink,
+};
+
+bool heap_mount(const char* path) {
+    return vfs_mount(path, &heap_vfs_ops, NULL);
+}
@@ -8,22 +8,40 @@
 // Size constants
 #define HEAP_BLOCK_MAGIC    0x1BADB002
 #define HEAP_INITIAL_SIZE   0x100000    // 1MB initial heap
-#define HEAP_MIN_BLOCK_SIZE sizeof(struct heap_block)
+#define HEAP_ALIGN          16
+#define HEAP_MIN_BLOCK_SIZE (sizeof(struct heap_block) + HEAP_ALIGN)
 #define HEAP_PAGE_SIZE      4096
+#define HEAP_GROW_CHUNK     0x40000     // Grow the heap 256KB at a time
+#define HEAP_LARGE_SIZE     0x10000     // Requests from 64KB go to vmalloc
+#define HEAP_SITE_BITS      8
+#define HEAP_SITES          (1 << HEAP_SITE_BITS)  // Call sites told apart, the rest share one entry
+
+// Size class bins (two-level segregated fit)
+#define HEAP_SL_SHIFT       4                       // 16 second-level classes per power of two
+#define HEAP_SL_COUNT       (1 << HEAP_SL_SHIFT)
+#define HEAP_SMALL_SHIFT    8                       // Below 256 bytes classes are linear
+#define HEAP_SMALL_SIZE     (1 << HEAP_SMALL_SHIFT)
+#define HEAP_FL_COUNT       (32 - HEAP_SMALL_SHIFT + 1)
 
 // Block flags
 #define BLOCK_FREE          0x1
 #define BLOCK_LAST          0x2
 
-// Heap block structure
+// Heap block structure. prev_size is the boundary tag of the physically
+// preceding block, next/prev link free blocks within their size class.
+// A used block keeps the call site it was charged to in place of next.
 struct heap_block {
     uint32_t magic;           // Magic number for validation
     uint32_t size;            // Size of the block including header
     uint32_t flags;           // Block flags (free/used, last block)
-    struct heap_block* next;  // Next block in list
-    struct heap_block* prev;  // Previous block in list
+    uint32_t prev_size;       // Size of the previous block in memory, 0 for the first
+    union {
+        struct heap_block* next;  // Next free block in the same class
+        uintptr_t site;           // Allocating call site of a used block, 0 if untracked
+    };
+    struct heap_block* prev;  // Previous free block in the same class
     uint8_t data[];          // Actual data starts here
-} __attribute__((packed));
+} __attribute__((packed, aligned(HEAP_ALIGN)));
 
 // Heap statistics
 struct heap_stats {
@@ -32,6 +50,8 @@ struct heap_stats {
     size_t free_size;         // Free memory size
     size_t total_blocks;      // Total number of blocks
     size_t free_blocks;       // Number of free blocks
+    size_t largest_free;      // Largest single free block
+    uint32_t fragmentation;   // Percent of free memory outside the largest free block
 };
 
 // Initialize the heap allocator
@@ -40,11 +60,15 @@ bool heap_init(void);
 // Allocate memory from heap
 void* heap_alloc(size_t size);
 
+// The same, charged to site when tracking is on; malloc() passes its caller
+void* heap_alloc_from(size_t size, uintptr_t site);
+
 // Free memory back to heap
 void heap_free(void* ptr);
 
 // Reallocate memory block
 void* heap_realloc(void* ptr, size_t size);
+void* heap_realloc_from(void* ptr, size_t size, uintptr_t site);
 
 // Get heap statistics
 void heap_get_stats(struct heap_stats* stats);
@@ -52,4 +76,25 @@ void heap_get_stats(struct heap_stats* stats);
 // Debug function to check heap consistency
 bool heap_check(void);
 
-#endif // HEAP_H
\ No newline at end of file
+// Charge allocations to their call sites from now on, or stop. Blocks
+// already charged stay charged until freed. Off by default.
+void heap_track(bool enable);
+
+// Log the n sites holding the most live memory, resolved through the
+// kernel symbol table, one line each:
+//
+//   heap site=ext2_get_inode+0x4c live=12288 count=96 allocs=1450
+void heap_dump_sites(uint32_t n);
+
+// Remember what every site holds now; heap_leak_report() then lists the n
+// sites that have grown the most since, which is what a workload run in
+// between left behind
+void heap_leak_mark(void);
+void heap_leak_report(uint32_t n);
+
+// Control file at path: "track on", "track off", "sites [n]", "mark" or
+// "leaks [n]" written to it, the reports going to the log; reading tells
+// whether tracking is on
+bool heap_mount(const char* path);
+
+#endif // HEAP_H
@@ -1,126 +1,661 @@
 #include <mm/pmm.h>
 #include <utils/mem.h>
+#include <core/smp.h>
+#include <utils/asm.h>
+#include <utils/log.h>
+#include <core/acpi.h>
 #include <limine.h>
 
 extern struct limine_hhdm_request hhdm_request;
 
-#define BITMAP_ENTRY uint64_t
-#define BITS_PER_ENTRY 64
-#define MAX_MEMORY_GB 4
+// Pages below 1MB are left to the AP trampoline and firmware
+#define PMM_LOW_RESERVED 0x100000ULL
 
-static BITMAP_ENTRY *bitmap = NULL;
-static uint64_t bitmap_size = 0;
+// Cap for pmm_page_try_get(), far below wrapping
+#define PMM_REF_MAX   (1U << 30)
+
+// Per-page state flags
+#define PAGE_FREE     (1 << 0)   // Head of a free block on a zone free list
+#define PAGE_RESERVED (1 << 1)   // Not managed by the allocator
+#define PAGE_IN_USE   (1 << 2)   // Handed out to a caller, cleared again on free
+
+// Per-page metadata, indexed by page frame number
+struct pmm_page {
+    uint8_t order;
+    uint8_t flags;
+    uint8_t node;            // NUMA node the page belongs to
+    uint32_t refcount;       // Mappings of an allocated page, see pmm_page_get()
+};
+
+// Free list node stored inside the free block itself (through the HHDM)
+struct free_block {
+    struct free_block *next;
+    struct free_block *prev;
+};
+
+struct pmm_zone {
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint64_t free_pages;
+    struct free_block *free_lists[PMM_MAX_ORDER + 1];
+};
+
+static struct pmm_page *pages = NULL;
+static struct pmm_zone zones[PMM_MAX_NODES][PMM_NUM_ZONES];
+static uint32_t node_count = 1;
+static uint8_t node_fallback[PMM_MAX_NODES][PMM_MAX_NODES];  // Nodes by distance
 static uint64_t total_pages = 0;
 static uint64_t free_pages = 0;
+static uint64_t max_pfn = 0;
 static uint64_t hhdm_offset = 0;
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+// Pre-zeroed pages per node, linked through their first word
+static void *zero_pool[PMM_MAX_NODES];
+static uint64_t zero_pool_count[PMM_MAX_NODES];
+static spinlock_t zero_lock = SPINLOCK_INIT;
 
-static inline void bitmap_set(uint64_t page) {
-    BITMAP_ENTRY mask = ((BITMAP_ENTRY)1 << (page % BITS_PER_ENTRY));
-    bitmap[page / BITS_PER_ENTRY] |= mask;
+static inline void* phys_to_virt(void *phys) {
+    return (void*)((uint64_t)phys + hhdm_offset);
 }
 
-static inline void bitmap_clear(uint64_t page) {
-    BITMAP_ENTRY mask = ((BITMAP_ENTRY)1 << (page % BITS_PER_ENTRY));
-    bitmap[page / BITS_PER_ENTRY] &= ~mask;
+static inline uint64_t block_to_pfn(struct free_block *block) {
+    return ((uint64_t)block - hhdm_offset) / PAGE_SIZE;
 }
 
-static inline bool bitmap_test(uint64_t page) {
-    BITMAP_ENTRY mask = ((BITMAP_ENTRY)1 << (page % BITS_PER_ENTRY));
-    return (bitmap[page / BITS_PER_ENTRY] & mask) != 0;
+static inline struct free_block *pfn_to_block(uint64_t pfn) {
+    return (struct free_block*)phys_to_virt((void*)(pfn * PAGE_SIZE));
 }
 
-static inline void* phys_to_virt(void *phys) {
-    return (void*)((uint64_t)phys + hhdm_offset);
+static struct pmm_zone *zone_for_pfn(uint64_t pfn) {
+    struct pmm_zone *node_zones = zones[pages[pfn].node];
+    for (int i = 0; i < PMM_NUM_ZONES; i++) {
+        if (pfn >= node_zones[i].start_pfn && pfn < node_zones[i].end_pfn) {
+            return &node_zones[i];
+        }
+    }
+    return NULL;
+}
+
+static void free_list_add(struct pmm_zone *zone, uint64_t pfn, size_t order) {
+    struct free_block *block = pfn_to_block(pfn);
+
+    block->prev = NULL;
+    block->next = zone->free_lists[order];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    zone->free_lists[order] = block;
+
+    pages[pfn].order = order;
+    pages[pfn].flags |= PAGE_FREE;
+}
+
+static void free_list_remove(struct pmm_zone *zone, uint64_t pfn, size_t order) {
+    struct free_block *block = pfn_to_block(pfn);
+
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        zone->free_lists[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+
+    pages[pfn].flags &= ~PAGE_FREE;
+}
+
+// Return a block to its zone, merging with free buddies as far as possible
+static void buddy_free(struct pmm_zone *zone, uint64_t pfn, size_t order) {
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = pfn ^ (1ULL << order);
+
+        if (buddy < zone->start_pfn || buddy >= zone->end_pfn) break;
+        if (pages[buddy].node != pages[pfn].node) break;
+        if (!(pages[buddy].flags & PAGE_FREE) || pages[buddy].order != order) break;
+
+        free_list_remove(zone, buddy, order);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+
+    free_list_add(zone, pfn, order);
+    zone->free_pages += 1ULL << order;
+    free_pages += 1ULL << order;
+}
+
+// Take a block of the requested order from a zone, splitting larger blocks
+static void *buddy_alloc(struct pmm_zone *zone, size_t order) {
+    size_t current = order;
+    while (current <= PMM_MAX_ORDER && !zone->free_lists[current]) {
+        current++;
+    }
+    if (current > PMM_MAX_ORDER) return NULL;
+
+    uint64_t pfn = block_to_pfn(zone->free_lists[current]);
+    free_list_remove(zone, pfn, current);
+
+    // Hand the upper halves back until the block is the right size
+    while (current > order) {
+        current--;
+        free_list_add(zone, pfn + (1ULL << current), current);
+    }
+
+    pages[pfn].order = order;
+    for (uint64_t i = 0; i < (1ULL << order); i++) {
+        pages[pfn + i].refcount = 1;
+        pages[pfn + i].flags |= PAGE_IN_USE;
+    }
+    zone->free_pages -= 1ULL << order;
+    free_pages -= 1ULL << order;
+
+    return (void*)(pfn * PAGE_SIZE);
+}
+
+static bool same_node(uint64_t pfn, uint64_t count) {
+    for (uint64_t i = 1; i < count; i++) {
+        if (pages[pfn + i].node != pages[pfn].node) return false;
+    }
+    return true;
+}
+
+// Freeing a page twice would put it on two lists at once: stop right here
+static void pmm_double_free(uint64_t pfn) {
+    cli();
+    log_panic();
+    log_error("PMM: double free of page 0x%x", pfn * PAGE_SIZE);
+    while (1) {
+        hlt();
+    }
+}
+
+// Clear the in-use flag of a page being freed, which must have been set
+static void page_release(uint64_t pfn) {
+    uint8_t old = __atomic_fetch_and(&pages[pfn].flags, (uint8_t)~PAGE_IN_USE, __ATOMIC_ACQ_REL);
+    if (!(old & PAGE_IN_USE)) pmm_double_free(pfn);
+}
+
+// Free a physical range using the largest aligned blocks that stay inside
+// one zone of one node. Returns the number of pages freed.
+static uint64_t free_range(uint64_t start_pfn, uint64_t end_pfn) {
+    uint64_t pfn = start_pfn;
+
+    while (pfn < end_pfn) {
+        struct pmm_zone *zone = zone_for_pfn(pfn);
+        if (!zone) break;
+
+        size_t order = PMM_MAX_ORDER;
+        while (order > 0 &&
+               ((pfn & ((1ULL << order) - 1)) != 0 ||
+                pfn + (1ULL << order) > end_pfn ||
+                pfn + (1ULL << order) > zone->end_pfn ||
+                !same_node(pfn, 1ULL << order))) {
+            order--;
+        }
+
+        for (uint64_t i = 0; i < (1ULL << order); i++) {
+            pages[pfn + i].flags &= ~PAGE_RESERVED;
+        }
+        buddy_free(zone, pfn, order);
+        pfn += 1ULL << order;
+    }
+    return pfn - start_pfn;
+}
+
+// Seed the zones with a physical range
+static void add_free_range(uint64_t start_pfn, uint64_t end_pfn) {
+    total_pages += free_range(start_pfn, end_pfn);
 }
 
 void pmm_init(struct limine_memmap_response *memmap) {
     hhdm_offset = hhdm_request.response->offset;
-    uint64_t max_addr = MAX_MEMORY_GB * 1024 * 1024 * 1024ULL;
 
-    total_pages = max_addr / PAGE_SIZE;
-    bitmap_size = (total_pages + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+    // Track every page up to the end of the highest usable region
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry *entry = memmap->entries[i];
+        if (entry->type != LIMINE_MEMMAP_USABLE) continue;
+
+        uint64_t end_pfn = (entry->base + entry->length) / PAGE_SIZE;
+        if (end_pfn > max_pfn) max_pfn = end_pfn;
+    }
 
-    // Find usable region for bitmap
+    uint64_t meta_size = PAGE_ALIGN(max_pfn * sizeof(struct pmm_page));
+
+    // Find usable region for the page metadata
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
         if (entry->type != LIMINE_MEMMAP_USABLE) continue;
 
-        uint64_t required_size = bitmap_size * sizeof(BITMAP_ENTRY);
-        if (entry->length >= required_size) {
-            bitmap = phys_to_virt((void*)entry->base);
-            // Mark all pages as used initially
-            memset(bitmap, 0xFF, bitmap_size * sizeof(BITMAP_ENTRY));
+        uint64_t base = PAGE_ALIGN(entry->base);
+        if (base < PMM_LOW_RESERVED) continue;
+        if (entry->base + entry->length < base + meta_size) continue;
 
-            entry->base += required_size;
-            entry->length -= required_size;
-            break;
+        pages = phys_to_virt((void*)base);
+        // Mark all pages as reserved initially
+        for (uint64_t pfn = 0; pfn < max_pfn; pfn++) {
+            pages[pfn].order = 0;
+            pages[pfn].flags = PAGE_RESERVED;
+            pages[pfn].node = 0;
+        }
+
+        entry->length -= (base + meta_size) - entry->base;
+        entry->base = base + meta_size;
+        break;
+    }
+
+    if (!pages) return;
+
+    // Every node spans the same address ranges; pages[].node picks the node
+    for (int n = 0; n < PMM_MAX_NODES; n++) {
+        zones[n][PMM_ZONE_DMA32].start_pfn = 0;
+        zones[n][PMM_ZONE_DMA32].end_pfn = PMM_DMA32_LIMIT / PAGE_SIZE;
+        zones[n][PMM_ZONE_NORMAL].start_pfn = PMM_DMA32_LIMIT / PAGE_SIZE;
+        zones[n][PMM_ZONE_NORMAL].end_pfn = max_pfn;
+        if (zones[n][PMM_ZONE_DMA32].end_pfn > max_pfn) {
+            zones[n][PMM_ZONE_DMA32].end_pfn = max_pfn;
         }
     }
 
-    // Mark available memory as free
+    // Hand available memory to the buddy lists
+    total_pages = 0;
     free_pages = 0;
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
         if (entry->type != LIMINE_MEMMAP_USABLE) continue;
 
-        uint64_t start_page = (entry->base + PAGE_SIZE - 1) / PAGE_SIZE;  // Round up
-        uint64_t end_page = entry->length / PAGE_SIZE;                    // Round down
+        uint64_t start = entry->base;
+        uint64_t end = entry->base + entry->length;
+        if (start < PMM_LOW_RESERVED) start = PMM_LOW_RESERVED;
+        if (end <= start) continue;
 
-        if (start_page >= total_pages) continue;
-        if (end_page > total_pages) end_page = total_pages;
+        uint64_t start_page = (start + PAGE_SIZE - 1) / PAGE_SIZE;  // Round up
+        uint64_t end_page = end / PAGE_SIZE;                        // Round down
+        if (end_page > start_page) {
+            add_free_range(start_page, end_page);
+        }
+    }
+}
 
-        for (uint64_t page = start_page; page < end_page; page++) {
-            bitmap_clear(page);
-            free_pages++;
+// Order every node's fallback list by SLIT distance, nearest first
+static void build_node_fallback(void) {
+    for (uint32_t n = 0; n < node_count; n++) {
+        for (uint32_t k = 0; k < node_count; k++) {
+            node_fallback[n][k] = k;
+        }
+        node_fallback[n][0] = n;
+        node_fallback[n][n] = 0;
+
+        // Insertion sort; the list is at most PMM_MAX_NODES long
+        for (uint32_t k = 2; k < node_count; k++) {
+            uint8_t other = node_fallback[n][k];
+            uint32_t j = k;
+            while (j > 1 && acpi_numa_distance(n, node_fallback[n][j - 1]) > acpi_numa_distance(n, other)) {
+                node_fallback[n][j] = node_fallback[n][j - 1];
+                j--;
+            }
+            node_fallback[n][j] = other;
         }
     }
 }
 
-void *pmm_alloc_page(void) {
-    if (free_pages == 0) return NULL;
-
-    // Start looking from entry 1 to avoid the first pages
-    for (uint64_t idx = 1; idx < bitmap_size; idx++) {
-        BITMAP_ENTRY entry = bitmap[idx];
-        if (entry == (BITMAP_ENTRY)-1) continue;  // Skip if fully used
-
-        // Find first free bit
-        for (uint64_t bit = 0; bit < BITS_PER_ENTRY; bit++) {
-            if (!(entry & ((BITMAP_ENTRY)1 << bit))) {
-                uint64_t page = idx * BITS_PER_ENTRY + bit;
-                if (page >= total_pages) return NULL;
-
-                bitmap_set(page);
-                free_pages--;
-                return (void*)(page * PAGE_SIZE);
+// Split the zones by NUMA node once the SRAT is known. Memory already
+// handed out keeps working; only the free blocks are redistributed.
+void pmm_numa_init(void) {
+    uint32_t nodes = acpi_numa_node_count();
+    if (!pages || nodes <= 1) return;
+    if (nodes > PMM_MAX_NODES) nodes = PMM_MAX_NODES;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pmm_lock);
+
+    // Cached pages may belong to any node now: hand them back to be split up too.
+    // The APs are not started yet, so no other CPU touches its cache meanwhile.
+    for (uint32_t i = 0; i < smp_get_cpu_count(); i++) {
+        struct cpu_data *cpu = smp_get_cpu_data(i);
+        if (!cpu) continue;
+
+        struct cpu_page_cache *cache = &cpu->page_cache;
+        while (cache->count) {
+            uint64_t pfn = (uint64_t)cache->pages[--cache->count] / PAGE_SIZE;
+            buddy_free(zone_for_pfn(pfn), pfn, 0);
+        }
+    }
+
+    // Pull every free block off the node 0 lists, chained through the blocks
+    struct free_block *chain = NULL;
+    for (int i = 0; i < PMM_NUM_ZONES; i++) {
+        struct pmm_zone *zone = &zones[0][i];
+        for (size_t order = 0; order <= PMM_MAX_ORDER; order++) {
+            while (zone->free_lists[order]) {
+                struct free_block *block = zone->free_lists[order];
+                free_list_remove(zone, block_to_pfn(block), order);
+                block->next = chain;
+                chain = block;
             }
         }
+        free_pages -= zone->free_pages;
+        zone->free_pages = 0;
+    }
+
+    // Tag pages with their node; ranges the SRAT leaves out stay on node 0
+    for (uint32_t i = 0; i < acpi_numa_range_count(); i++) {
+        uint64_t base, length;
+        uint32_t node;
+        if (!acpi_numa_range(i, &base, &length, &node) || node >= nodes) continue;
+
+        uint64_t start_pfn = base / PAGE_SIZE;
+        uint64_t end_pfn = (base + length) / PAGE_SIZE;
+        if (end_pfn > max_pfn) end_pfn = max_pfn;
+        for (uint64_t pfn = start_pfn; pfn < end_pfn; pfn++) {
+            pages[pfn].node = node;
+        }
+    }
+    node_count = nodes;
+
+    // Give the blocks back, split wherever they straddle two nodes
+    while (chain) {
+        struct free_block *block = chain;
+        chain = block->next;
+
+        uint64_t pfn = block_to_pfn(block);
+        free_range(pfn, pfn + (1ULL << pages[pfn].order));
     }
 
+    build_node_fallback();
+
+    spinlock_release(&pmm_lock);
+    irq_restore(flags);
+}
+
+// Take a block from the node's zones, then from the other nodes by distance.
+// Low memory first within a node: most drivers still use physical addresses directly.
+static void *node_alloc(uint32_t node, size_t order) {
+    for (uint32_t k = 0; k < node_count; k++) {
+        struct pmm_zone *node_zones = zones[node_fallback[node][k]];
+        for (int i = 0; i < PMM_NUM_ZONES; i++) {
+            void *block = buddy_alloc(&node_zones[i], order);
+            if (block) return block;
+        }
+    }
     return NULL;
 }
 
+uint32_t pmm_node_count(void) {
+    return node_count;
+}
+
+uint32_t pmm_current_node(void) {
+    struct cpu_data *cpu = smp_get_current_cpu_data();
+    if (!cpu || cpu->node >= node_count) return 0;
+    return cpu->node;
+}
+
+void *pmm_alloc_pages_node(size_t order, uint32_t node) {
+    if (order > PMM_MAX_ORDER) return NULL;
+    if (node >= node_count) node = 0;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pmm_lock);
+    void *block = node_alloc(node, order);
+    spinlock_release(&pmm_lock);
+    irq_restore(flags);
+    return block;
+}
+
+void *pmm_alloc_pages(size_t order) {
+    return pmm_alloc_pages_node(order, pmm_current_node());
+}
+
+// Refill a CPU page cache from the buddy lists under the global lock
+static void page_cache_refill(struct cpu_page_cache *cache, uint32_t node) {
+    spinlock_acquire(&pmm_lock);
+    while (cache->count < CPU_PAGE_CACHE_BATCH) {
+        void *page = node_alloc(node, 0);
+        if (!page) break;
+        pages[(uint64_t)page / PAGE_SIZE].flags &= ~PAGE_IN_USE;
+        cache->pages[cache->count++] = page;
+    }
+    spinlock_release(&pmm_lock);
+}
+
+// Give half of a full CPU page cache back to the buddy lists
+static void page_cache_drain(struct cpu_page_cache *cache) {
+    spinlock_acquire(&pmm_lock);
+    while (cache->count > CPU_PAGE_CACHE_SIZE - CPU_PAGE_CACHE_BATCH) {
+        uint64_t pfn = (uint64_t)cache->pages[--cache->count] / PAGE_SIZE;
+        buddy_free(zone_for_pfn(pfn), pfn, 0);
+    }
+    spinlock_release(&pmm_lock);
+}
+
+// Take a pre-zeroed page, clearing the link word it carried in the pool
+static void *zero_pool_pop(uint32_t node) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&zero_lock);
+
+    void *page = zero_pool[node];
+    if (page) {
+        uint64_t *link = phys_to_virt(page);
+        zero_pool[node] = (void*)link[0];
+        link[0] = 0;
+        zero_pool_count[node]--;
+        pages[(uint64_t)page / PAGE_SIZE].flags |= PAGE_IN_USE;
+    }
+
+    spinlock_release(&zero_lock);
+    irq_restore(flags);
+    return page;
+}
+
+void *pmm_alloc_page(void) {
+    uint64_t flags = irq_save();
+    struct cpu_data *cpu = smp_get_current_cpu_data();
+    if (!cpu) {
+        irq_restore(flags);
+        return pmm_alloc_pages(0);
+    }
+
+    // Fast path: no global lock unless the cache runs dry
+    uint32_t node = pmm_current_node();
+    struct cpu_page_cache *cache = &cpu->page_cache;
+    if (cache->count == 0) {
+        page_cache_refill(cache, node);
+    }
+
+    void *page = cache->count ? cache->pages[--cache->count] : NULL;
+    if (page) {
+        pages[(uint64_t)page / PAGE_SIZE].refcount = 1;
+        pages[(uint64_t)page / PAGE_SIZE].flags |= PAGE_IN_USE;
+    }
+    irq_restore(flags);
+    if (page) return page;
+
+    // Out of memory otherwise: the zero pools still hold free pages
+    for (uint32_t k = 0; k < node_count && !page; k++) {
+        page = zero_pool_pop(node_fallback[node][k]);
+    }
+    return page;
+}
+
+void *pmm_alloc_page_node(uint32_t node) {
+    // The per-CPU cache only holds pages of the CPU's own node
+    if (node == pmm_current_node()) return pmm_alloc_page();
+    return pmm_alloc_pages_node(0, node);
+}
+
+void *pmm_alloc_zeroed_page(void) {
+    void *page = zero_pool_pop(pmm_current_node());
+    if (page) return page;
+
+    // Pool is empty: zero on the caller's time
+    page = pmm_alloc_page();
+    if (page) {
+        memset(phys_to_virt(page), 0, PAGE_SIZE);
+    }
+    return page;
+}
+
+// Zero a few pages into the calling CPU's node pool; called from idle loops.
+// Returns false when there was nothing to do.
+bool pmm_zero_pool_fill(void) {
+    if (!pages) return false;
+
+    uint32_t node = pmm_current_node();
+    bool filled = false;
+    for (int i = 0; i < PMM_ZERO_POOL_BATCH; i++) {
+        // Leave plenty of memory to the regular allocator
+        if (__atomic_load_n(&zero_pool_count[node], __ATOMIC_RELAXED) >= PMM_ZERO_POOL_TARGET ||
+            free_pages < PMM_ZERO_POOL_TARGET * 4) {
+            break;
+        }
+
+        void *page = pmm_alloc_page();
+        if (!page) break;
+
+        // Only keep local pages, the cache may have fallen back to a remote node
+        uint64_t pfn = (uint64_t)page / PAGE_SIZE;
+        if (pages[pfn].node != node) {
+            pmm_free_page(page);
+            break;
+        }
+
+        uint64_t *link = phys_to_virt(page);
+        memset(link, 0, PAGE_SIZE);
+
+        page_release(pfn);
+
+        uint64_t flags = irq_save();
+        spinlock_acquire(&zero_lock);
+        link[0] = (uint64_t)zero_pool[node];
+        zero_pool[node] = page;
+        zero_pool_count[node]++;
+        spinlock_release(&zero_lock);
+        irq_restore(flags);
+
+        filled = true;
+    }
+    return filled;
+}
+
+void pmm_free_pages(void *addr, size_t order) {
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (!pages || pfn >= max_pfn || order > PMM_MAX_ORDER) return;
+    if (pfn & ((1ULL << order) - 1)) return;  // Not the head of a block
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pmm_lock);
+
+    struct pmm_zone *zone = zone_for_pfn(pfn);
+    if (zone && !(pages[pfn].flags & PAGE_RESERVED)) {
+        for (uint64_t i = 0; i < (1ULL << order); i++) {
+            page_release(pfn + i);
+        }
+        buddy_free(zone, pfn, order);
+    }
+
+    spinlock_release(&pmm_lock);
+    irq_restore(flags);
+}
+
 void pmm_free_page(void *addr) {
-    uint64_t page = (uint64_t)addr / PAGE_SIZE;
-    if (page >= total_pages) return;
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (!pages || pfn >= max_pfn || !zone_for_pfn(pfn)) return;
+    if (pages[pfn].flags & PAGE_RESERVED) return;
+
+    uint64_t flags = irq_save();
+    struct cpu_data *cpu = smp_get_current_cpu_data();
+    if (!cpu || pages[pfn].node != pmm_current_node()) {
+        // Remote pages go straight back to their own node
+        irq_restore(flags);
+        pmm_free_pages(addr, 0);
+        return;
+    }
+
+    page_release(pfn);
+    struct cpu_page_cache *cache = &cpu->page_cache;
+    if (cache->count == CPU_PAGE_CACHE_SIZE) {
+        page_cache_drain(cache);
+    }
+    cache->pages[cache->count++] = (void*)(pfn * PAGE_SIZE);
+    irq_restore(flags);
+}
+
+static inline bool pfn_is_managed(uint64_t pfn) {
+    return pages && pfn < max_pfn && !(pages[pfn].flags & PAGE_RESERVED);
+}
+
+void pmm_page_get(void *addr) {
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (!pfn_is_managed(pfn)) return;
+    __atomic_add_fetch(&pages[pfn].refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+bool pmm_page_try_get(void *addr) {
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (!pfn_is_managed(pfn)) return true;
 
-    if (bitmap_test(page)) {
-        bitmap_clear(page);
-        free_pages++;
+    uint32_t count = __atomic_load_n(&pages[pfn].refcount, __ATOMIC_RELAXED);
+    do {
+        if (count >= PMM_REF_MAX) return false;
+    } while (!__atomic_compare_exchange_n(&pages[pfn].refcount, &count, count + 1, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return true;
+}
+
+bool pmm_page_put(void *addr) {
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (!pfn_is_managed(pfn)) return false;
+
+    if (__atomic_sub_fetch(&pages[pfn].refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        pmm_free_page((void*)(pfn * PAGE_SIZE));
+        return true;
     }
+    return false;
+}
+
+bool pmm_page_unref(void *addr) {
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (!pfn_is_managed(pfn)) return true;
+    return __atomic_sub_fetch(&pages[pfn].refcount, 1, __ATOMIC_ACQ_REL) == 0;
 }
 
-void pmm_free_pages(void *addr, size_t count) {
-    uint64_t start_page = (uint64_t)addr / PAGE_SIZE;
-    if (start_page >= total_pages) return;
+uint32_t pmm_page_refcount(void *addr) {
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (!pfn_is_managed(pfn)) return 0;
+    return __atomic_load_n(&pages[pfn].refcount, __ATOMIC_ACQUIRE);
+}
 
-    for (size_t i = 0; i < count; i++) {
-        uint64_t page = start_page + i;
-        if (page >= total_pages) break;
-        pmm_free_page((void*)(page * PAGE_SIZE));
+size_t pmm_order_for_pages(size_t count) {
+    size_t order = 0;
+    while (((size_t)1 << order) < count) {
+        order++;
     }
+    return order;
 }
 
 size_t pmm_get_free_pages(void) {
-    return free_pages;
-}
\ No newline at end of file
+    size_t count = free_pages;
+    for (uint32_t n = 0; n < node_count; n++) {
+        count += zero_pool_count[n];
+    }
+
+    // Pages parked in per-CPU caches are still free
+    for (uint32_t i = 0; i < smp_get_cpu_count(); i++) {
+        struct cpu_data *cpu = smp_get_cpu_data(i);
+        if (cpu) count += cpu->page_cache.count;
+    }
+    return count;
+}
+
+size_t pmm_get_total_pages(void) {
+    return total_pages;
+}
+
+void *pmm_phys_to_virt(void *phys) {
+    return phys_to_virt(phys);
+}
+
+void *pmm_virt_to_phys(void *virt) {
+    return (void*)((uint64_t)virt - hhdm_offset);
+}
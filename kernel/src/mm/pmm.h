@@ -10,11 +10,54 @@
 #define PAGE_SIZE 4096
 #define PAGE_ALIGN(addr) ((addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
 
+// Buddy orders: order n is a block of (1 << n) pages, up to 4MB
+#define PMM_MAX_ORDER 10
+
+// Physical memory zones
+#define PMM_ZONE_DMA32  0   // Below 4GB, identity mapped and reachable by 32-bit DMA
+#define PMM_ZONE_NORMAL 1   // Everything above 4GB
+#define PMM_NUM_ZONES   2
+
+#define PMM_DMA32_LIMIT 0x100000000ULL
+
+// NUMA nodes; every node has its own set of zones
+#define PMM_MAX_NODES 8
+
+// Pages zeroed ahead of time by idle CPUs
+#define PMM_ZERO_POOL_TARGET 512   // Pages kept ready (2MB)
+#define PMM_ZERO_POOL_BATCH  8     // Pages zeroed per idle pass
+
 void pmm_init(struct limine_memmap_response *memmap);
 void *pmm_alloc_page(void);
-void *pmm_alloc_pages(size_t count);
+void *pmm_alloc_zeroed_page(void);
+bool pmm_zero_pool_fill(void);
+
+// Allocations default to the calling CPU's node and fall back to the
+// nearest other nodes; these take an explicit node instead
+void pmm_numa_init(void);
+uint32_t pmm_node_count(void);
+uint32_t pmm_current_node(void);
+void *pmm_alloc_page_node(uint32_t node);
+void *pmm_alloc_pages_node(size_t order, uint32_t node);
+void *pmm_alloc_pages(size_t order);
 void pmm_free_page(void *addr);
-void pmm_free_pages(void *addr, size_t count);
+void pmm_free_pages(void *addr, size_t order);
+size_t pmm_order_for_pages(size_t count);
 size_t pmm_get_free_pages(void);
+size_t pmm_get_total_pages(void);
+void *pmm_phys_to_virt(void *phys);
+
+// Reference counts for pages mapped by more than one address space.
+// Allocation sets the count to 1; pmm_page_put() frees on the last reference.
+void pmm_page_get(void *addr);
+// The same for references user space can pile up; false once the count is
+// at PMM_REF_MAX, so it can never wrap
+bool pmm_page_try_get(void *addr);
+bool pmm_page_put(void *addr);
+// Drop a reference without freeing; true if it was the last, leaving the
+// caller to tear the page down and free it
+bool pmm_page_unref(void *addr);
+uint32_t pmm_page_refcount(void *addr);
+void *pmm_virt_to_phys(void *virt);
 
-#endif // PMM_H
\ No newline at end of file
+#endif // PMM_H
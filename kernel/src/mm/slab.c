@@ -0,0 +1,240 @@
+#include <mm/slab.h>
+#include <mm/pmm.h>
+#include <utils/mem.h>
+#include <utils/str.h>
+#include <utils/asm.h>
+
+static struct kmem_cache caches[MAX_KMEM_CACHES];
+static spinlock_t caches_lock = SPINLOCK_INIT;
+
+static inline size_t slab_bytes(struct kmem_cache* cache) {
+    return (size_t)PAGE_SIZE << cache->order;
+}
+
+// Slabs are naturally aligned buddy blocks, so the header is found by masking
+static inline struct slab* obj_to_slab(struct kmem_cache* cache, void* obj) {
+    return (struct slab*)((uint64_t)obj & ~((uint64_t)slab_bytes(cache) - 1));
+}
+
+static inline size_t slab_header_size(struct kmem_cache* cache) {
+    return (sizeof(struct slab) + cache->stride - 1) / cache->stride * cache->stride;
+}
+
+static void partial_add(struct kmem_cache* cache, struct slab* slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial) {
+        cache->partial->prev = slab;
+    }
+    cache->partial = slab;
+    slab->on_partial = true;
+}
+
+static void partial_remove(struct kmem_cache* cache, struct slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = slab->prev = NULL;
+    slab->on_partial = false;
+}
+
+// Allocate a new slab and thread its objects onto the freelist
+static struct slab* slab_create(struct kmem_cache* cache) {
+    void* phys = pmm_alloc_pages(cache->order);
+    if (!phys) return NULL;
+
+    struct slab* slab = (struct slab*)pmm_phys_to_virt(phys);
+    memset(slab, 0, sizeof(struct slab));
+    slab->cache = cache;
+
+    uint8_t* base = (uint8_t*)slab + slab_header_size(cache);
+    for (uint32_t i = 0; i < cache->objects_per_slab; i++) {
+        void* obj = base + (size_t)i * cache->stride;
+        *(void**)obj = slab->freelist;
+        slab->freelist = obj;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+static void slab_destroy(struct kmem_cache* cache, struct slab* slab) {
+    pmm_free_pages(pmm_virt_to_phys(slab), cache->order);
+    cache->slabs--;
+}
+
+// Return one object to its slab; cache lock must be held
+static void slab_put(struct kmem_cache* cache, void* obj) {
+    struct slab* slab = obj_to_slab(cache, obj);
+
+    *(void**)obj = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+
+    if (slab->inuse == 0) {
+        if (slab->on_partial) {
+            partial_remove(cache, slab);
+        }
+        // Keep one empty slab around to absorb alloc/free churn
+        if (!cache->empty) {
+            cache->empty = slab;
+        } else {
+            slab_destroy(cache, slab);
+        }
+    } else if (!slab->on_partial) {
+        partial_add(cache, slab);
+    }
+}
+
+// Take one object from the shared slabs; cache lock must be held
+static void* slab_get(struct kmem_cache* cache) {
+    struct slab* slab = cache->partial;
+
+    if (!slab) {
+        if (cache->empty) {
+            slab = cache->empty;
+            cache->empty = NULL;
+        } else {
+            slab = slab_create(cache);
+            if (!slab) return NULL;
+        }
+        partial_add(cache, slab);
+    }
+
+    void* obj = slab->freelist;
+    slab->freelist = *(void**)obj;
+    slab->inuse++;
+
+    if (!slab->freelist) {
+        partial_remove(cache, slab);
+    }
+    return obj;
+}
+
+static struct kmem_magazine* current_magazine(struct kmem_cache* cache) {
+    return &cache->magazines[smp_get_current_cpu()];
+}
+
+struct kmem_cache* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor) {
+    if (size == 0 || size > (PAGE_SIZE << PMM_MAX_ORDER) / 2) return NULL;
+    if (align < sizeof(void*)) align = sizeof(void*);
+
+    spinlock_acquire(&caches_lock);
+    struct kmem_cache* cache = NULL;
+    for (int i = 0; i < MAX_KMEM_CACHES; i++) {
+        if (!caches[i].active) {
+            cache = &caches[i];
+            memset(cache, 0, sizeof(struct kmem_cache));
+            cache->active = true;
+            break;
+        }
+    }
+    spinlock_release(&caches_lock);
+    if (!cache) return NULL;
+
+    strncpy(cache->name, name, KMEM_CACHE_NAME_LEN - 1);
+    cache->name[KMEM_CACHE_NAME_LEN - 1] = '\0';
+    cache->object_size = size;
+    cache->stride = (size + align - 1) / align * align;
+    cache->ctor = ctor;
+
+    // Smallest slab that holds a useful number of objects
+    cache->order = 0;
+    while (cache->order < PMM_MAX_ORDER &&
+           (slab_bytes(cache) - slab_header_size(cache)) / cache->stride < KMEM_MIN_OBJECTS) {
+        cache->order++;
+    }
+    cache->objects_per_slab = (slab_bytes(cache) - slab_header_size(cache)) / cache->stride;
+
+    // Per-CPU magazines
+    size_t mag_bytes = MAX_CPUS * sizeof(struct kmem_magazine);
+    size_t mag_order = pmm_order_for_pages((mag_bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    void* mag_phys = pmm_alloc_pages(mag_order);
+    if (!mag_phys) {
+        cache->active = false;
+        return NULL;
+    }
+    cache->magazines = (struct kmem_magazine*)pmm_phys_to_virt(mag_phys);
+    memset(cache->magazines, 0, mag_bytes);
+
+    return cache;
+}
+
+void kmem_cache_destroy(struct kmem_cache* cache) {
+    if (!cache || !cache->active) return;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&cache->lock);
+
+    // Flush every CPU's magazine back into the slabs
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct kmem_magazine* mag = &cache->magazines[cpu];
+        while (mag->count) {
+            slab_put(cache, mag->objects[--mag->count]);
+        }
+    }
+
+    if (cache->empty) {
+        slab_destroy(cache, cache->empty);
+        cache->empty = NULL;
+    }
+
+    spinlock_release(&cache->lock);
+    irq_restore(flags);
+
+    size_t mag_bytes = MAX_CPUS * sizeof(struct kmem_magazine);
+    pmm_free_pages(pmm_virt_to_phys(cache->magazines),
+                   pmm_order_for_pages((mag_bytes + PAGE_SIZE - 1) / PAGE_SIZE));
+    cache->active = false;
+}
+
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+    if (!cache) return NULL;
+
+    uint64_t flags = irq_save();
+    struct kmem_magazine* mag = current_magazine(cache);
+
+    // Refill half a magazine at a time so frees have room too
+    if (mag->count == 0) {
+        spinlock_acquire(&cache->lock);
+        while (mag->count < KMEM_MAGAZINE_SIZE / 2) {
+            void* obj = slab_get(cache);
+            if (!obj) break;
+            mag->objects[mag->count++] = obj;
+        }
+        spinlock_release(&cache->lock);
+    }
+
+    void* obj = mag->count ? mag->objects[--mag->count] : NULL;
+    if (obj) cache->allocs++;
+    irq_restore(flags);
+
+    if (obj && cache->ctor) {
+        cache->ctor(obj);
+    }
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache* cache, void* obj) {
+    if (!cache || !obj) return;
+
+    uint64_t flags = irq_save();
+    struct kmem_magazine* mag = current_magazine(cache);
+
+    if (mag->count == KMEM_MAGAZINE_SIZE) {
+        spinlock_acquire(&cache->lock);
+        while (mag->count > KMEM_MAGAZINE_SIZE / 2) {
+            slab_put(cache, mag->objects[--mag->count]);
+        }
+        spinlock_release(&cache->lock);
+    }
+
+    mag->objects[mag->count++] = obj;
+    cache->frees++;
+    irq_restore(flags);
+}
@@ -0,0 +1,58 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <core/smp.h>
+
+#define MAX_KMEM_CACHES       32
+#define KMEM_CACHE_NAME_LEN   32
+#define KMEM_MAGAZINE_SIZE    16   // Objects held per CPU per cache
+#define KMEM_MIN_OBJECTS      8    // Minimum objects per slab when picking an order
+
+// Object constructor, run on every object handed out by kmem_cache_alloc()
+typedef void (*kmem_ctor_t)(void* obj);
+
+// Slab header, stored at the start of each naturally aligned slab block
+struct slab {
+    struct kmem_cache* cache;
+    struct slab* next;
+    struct slab* prev;
+    void* freelist;          // Free objects in this slab
+    uint32_t inuse;          // Objects handed out (including those in magazines)
+    bool on_partial;         // Linked on the cache partial list
+};
+
+// Per-CPU object magazine
+struct kmem_magazine {
+    uint32_t count;
+    void* objects[KMEM_MAGAZINE_SIZE];
+};
+
+// Object cache
+struct kmem_cache {
+    char name[KMEM_CACHE_NAME_LEN];
+    size_t object_size;      // Size requested by the user
+    size_t stride;           // Object size rounded up to alignment
+    size_t order;            // PMM order of each slab
+    uint32_t objects_per_slab;
+    kmem_ctor_t ctor;
+    spinlock_t lock;
+    struct slab* partial;    // Slabs with free objects
+    struct slab* empty;      // One cached empty slab
+    struct kmem_magazine* magazines;  // One per CPU
+    bool active;
+
+    // Statistics
+    uint64_t slabs;
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+struct kmem_cache* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor);
+void kmem_cache_destroy(struct kmem_cache* cache);
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+
+#endif // SLAB_H
@@ -0,0 +1,247 @@
+#include <mm/tlb.h>
+#include <mm/vmm.h>
+#include <core/smp.h>
+#include <core/idt.h>
+#include <core/drivers/lapic.h>
+#include <utils/asm.h>
+
+#define CPU_MASK_WORDS (MAX_CPUS / 64)
+
+#define CR4_PGE (1ULL << 7)
+
+// The shootdown in flight; initiators serialize on shootdown_lock
+static struct {
+    struct tlb_batch batch;
+    volatile uint64_t targets[CPU_MASK_WORDS];  // CPUs that have not acknowledged yet
+} request;
+static spinlock_t shootdown_lock = SPINLOCK_INIT;
+
+// Address space loaded on each CPU
+static volatile uint64_t active_cr3[MAX_CPUS];
+
+// CPUs that must flush a PCID the next time they load it. Set for every
+// CPU on each shootdown so CPUs that switched away need no IPI.
+static volatile uint64_t pcid_flush_pending[VMM_MAX_PCID][CPU_MASK_WORDS];
+
+static bool tlb_ready = false;
+
+static inline bool same_space(uint64_t a, uint64_t b) {
+    return (a & PTE_ADDR_MASK) == (b & PTE_ADDR_MASK);
+}
+
+static inline void invlpg(uint64_t virt) {
+    asm volatile("invlpg [%0]" :: "r"(virt) : "memory");
+}
+
+// Flush every TLB entry of every PCID, including global ones, by toggling CR4.PGE
+void tlb_flush_local_all(void) {
+    uint64_t cr4;
+    asm volatile("mov %0, cr4" : "=r"(cr4) :: "memory");
+    if (cr4 & CR4_PGE) {
+        asm volatile("mov cr4, %0" :: "r"(cr4 & ~CR4_PGE) : "memory");
+        asm volatile("mov cr4, %0" :: "r"(cr4) : "memory");
+    } else {
+        vmm_switch_pagemap(vmm_get_cr3());
+    }
+}
+
+// Reloading CR3 without the no-flush bit drops the current PCID's entries
+static void flush_local_context(uint64_t cr3) {
+    if (!cr3) {
+        tlb_flush_local_all();
+    } else {
+        vmm_switch_pagemap(vmm_get_cr3());
+    }
+}
+
+void tlb_flush_local(uint64_t cr3, uint64_t virt, uint64_t len) {
+    if (len / PAGE_SIZE > TLB_FLUSH_THRESHOLD) {
+        flush_local_context(cr3);
+        return;
+    }
+    for (uint64_t off = 0; off < len; off += PAGE_SIZE) {
+        invlpg(virt + off);
+    }
+}
+
+static void apply_batch(struct tlb_batch* batch) {
+    // Another CPU's space; its PCID is marked pending instead
+    if (batch->cr3 && !same_space(vmm_get_cr3(), batch->cr3)) return;
+
+    if (batch->full) {
+        flush_local_context(batch->cr3);
+        return;
+    }
+    for (uint32_t i = 0; i < batch->count; i++) {
+        tlb_flush_local(batch->cr3, batch->start[i], batch->len[i]);
+    }
+}
+
+// Handle the in-flight request if it is addressed to this CPU
+static void service_request(uint32_t cpu) {
+    uint64_t bit = 1ULL << (cpu % 64);
+    if (!(request.targets[cpu / 64] & bit)) return;
+
+    apply_batch(&request.batch);
+
+    // Still loaded here, so the flush above covered it. A CPU that switched
+    // away meanwhile keeps its pending mark.
+    uint64_t pcid = request.batch.cr3 & CR3_PCID_MASK;
+    if (pcid && same_space(vmm_get_cr3(), request.batch.cr3)) {
+        __atomic_and_fetch(&pcid_flush_pending[pcid][cpu / 64], ~bit, __ATOMIC_SEQ_CST);
+    }
+    __atomic_and_fetch(&request.targets[cpu / 64], ~bit, __ATOMIC_SEQ_CST);
+}
+
+static void tlb_ipi_handler(struct interrupt_frame* frame) {
+    (void)frame;
+    service_request(smp_get_current_cpu());
+    lapic_eoi();
+}
+
+void tlb_init(void) {
+    // Every CPU starts out on the kernel address space
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        active_cr3[cpu] = vmm_kernel_address_space();
+    }
+    active_cr3[smp_get_current_cpu()] = vmm_get_cr3();
+
+    register_interrupt_handler(INT_TLB_SHOOTDOWN, tlb_ipi_handler);
+    tlb_ready = true;
+}
+
+void tlb_batch_init(struct tlb_batch* batch, uint64_t cr3) {
+    batch->cr3 = cr3 & ~CR3_NOFLUSH;
+    batch->full = false;
+    batch->count = 0;
+    batch->pages = 0;
+}
+
+void tlb_batch_add(struct tlb_batch* batch, uint64_t virt, uint64_t len) {
+    if (batch->full || len == 0) return;
+
+    batch->pages += (len + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (batch->pages > TLB_FLUSH_THRESHOLD) {
+        batch->full = true;
+        return;
+    }
+
+    // Extend the previous range when contiguous
+    if (batch->count && batch->start[batch->count - 1] + batch->len[batch->count - 1] == virt) {
+        batch->len[batch->count - 1] += len;
+        return;
+    }
+    if (batch->count == TLB_BATCH_RANGES) {
+        batch->full = true;
+        return;
+    }
+    batch->start[batch->count] = virt;
+    batch->len[batch->count] = len;
+    batch->count++;
+}
+
+void tlb_batch_flush(struct tlb_batch* batch) {
+    if (!batch->full && batch->count == 0) return;
+
+    uint64_t flags = irq_save();
+    uint32_t self = smp_get_current_cpu();
+    uint32_t cpus = tlb_ready ? smp_get_cpu_count() : 1;
+
+    // Keep servicing other initiators while waiting, or two of them deadlock
+    if (cpus > 1) {
+        while (!spinlock_try_acquire(&shootdown_lock)) {
+            service_request(self);
+            asm volatile("pause");
+        }
+    }
+
+    // CPUs without the space loaded only need to flush when they switch back.
+    // Mark them before reading active_cr3 so a CPU switching in concurrently
+    // is either marked or seen.
+    uint64_t pcid = batch->cr3 & CR3_PCID_MASK;
+    if (pcid) {
+        for (uint32_t w = 0; w < CPU_MASK_WORDS; w++) {
+            __atomic_store_n(&pcid_flush_pending[pcid][w], ~0ULL, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    apply_batch(batch);
+    if (pcid && same_space(vmm_get_cr3(), batch->cr3)) {
+        __atomic_and_fetch(&pcid_flush_pending[pcid][self / 64], ~(1ULL << (self % 64)), __ATOMIC_SEQ_CST);
+    }
+
+    if (cpus <= 1) {
+        irq_restore(flags);
+        return;
+    }
+
+    request.batch = *batch;
+    bool all = true;
+    uint32_t targets = 0;
+    for (uint32_t cpu = 0; cpu < cpus; cpu++) {
+        struct cpu_data* data = smp_get_cpu_data(cpu);
+        if (cpu == self || !data || !(data->state & CPU_STATE_ONLINE)) continue;
+
+        // Kernel mappings are global and may be cached everywhere
+        if (batch->cr3 && !same_space(active_cr3[cpu], batch->cr3)) {
+            all = false;
+            continue;
+        }
+        __atomic_or_fetch(&request.targets[cpu / 64], 1ULL << (cpu % 64), __ATOMIC_SEQ_CST);
+        targets++;
+    }
+
+    if (targets) {
+        // One IPI round: a broadcast when everyone is involved
+        if (all) {
+            lapic_send_ipi(0, INT_TLB_SHOOTDOWN | LAPIC_ICR_ALL_EXCLUDING);
+        } else {
+            for (uint32_t cpu = 0; cpu < cpus; cpu++) {
+                if (request.targets[cpu / 64] & (1ULL << (cpu % 64))) {
+                    smp_send_ipi(cpu, INT_TLB_SHOOTDOWN);
+                }
+            }
+        }
+
+        // IRQs stay off while waiting, so answer anything addressed to this
+        // CPU from here rather than leaving its initiator spinning on us
+        for (uint32_t w = 0; w < CPU_MASK_WORDS; w++) {
+            while (__atomic_load_n(&request.targets[w], __ATOMIC_SEQ_CST)) {
+                service_request(self);
+                asm volatile("pause");
+            }
+        }
+    }
+
+    spinlock_release(&shootdown_lock);
+    irq_restore(flags);
+}
+
+void tlb_shootdown(uint64_t cr3, uint64_t virt, uint64_t len) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, cr3);
+    tlb_batch_add(&batch, virt, len);
+    tlb_batch_flush(&batch);
+}
+
+// Drop all non-global entries of an address space on every CPU. CPUs that
+// do not have it loaded flush its PCID when they next switch to it.
+void tlb_flush_address_space(uint64_t cr3) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, cr3);
+    batch.full = true;
+    tlb_batch_flush(&batch);
+}
+
+bool tlb_note_switch(uint64_t cr3) {
+    uint32_t cpu = smp_get_current_cpu();
+    uint64_t bit = 1ULL << (cpu % 64);
+
+    __atomic_store_n(&active_cr3[cpu], cr3 & ~CR3_NOFLUSH, __ATOMIC_SEQ_CST);
+
+    uint64_t pcid = cr3 & CR3_PCID_MASK;
+    if (!pcid) return true;
+
+    uint64_t old = __atomic_fetch_and(&pcid_flush_pending[pcid][cpu / 64], ~bit, __ATOMIC_SEQ_CST);
+    return (old & bit) != 0;
+}
@@ -0,0 +1,37 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TLB_FLUSH_THRESHOLD  64   // Pages; larger batches flush the whole context
+#define TLB_BATCH_RANGES     16   // Ranges carried by one shootdown
+
+// Ranges to invalidate in one address space, sent to other CPUs as one IPI round.
+// cr3 0 means kernel (global) mappings, which every CPU may cache.
+struct tlb_batch {
+    uint64_t cr3;
+    bool full;                              // Flush the whole context instead
+    uint32_t count;
+    uint64_t pages;                         // Total pages across all ranges
+    uint64_t start[TLB_BATCH_RANGES];
+    uint64_t len[TLB_BATCH_RANGES];
+};
+
+void tlb_init(void);
+
+// Local invalidation only
+void tlb_flush_local(uint64_t cr3, uint64_t virt, uint64_t len);
+void tlb_flush_local_all(void);
+
+// Invalidate on every CPU that may cache the translations
+void tlb_batch_init(struct tlb_batch* batch, uint64_t cr3);
+void tlb_batch_add(struct tlb_batch* batch, uint64_t virt, uint64_t len);
+void tlb_batch_flush(struct tlb_batch* batch);
+void tlb_shootdown(uint64_t cr3, uint64_t virt, uint64_t len);
+void tlb_flush_address_space(uint64_t cr3);
+
+// Record an address space switch on this CPU; true if its PCID must be flushed
+bool tlb_note_switch(uint64_t cr3);
+
+#endif // TLB_H
@@ -0,0 +1,306 @@
+#include <mm/vma.h>
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <core/process.h>
+#include <fs/page_cache.h>
+#include <utils/mem.h>
+
+static struct kmem_cache* vma_cache = NULL;
+static struct kmem_cache* vma_list_cache = NULL;
+
+void vma_init(void) {
+    if (!vma_cache) {
+        vma_cache = kmem_cache_create("vm_area", sizeof(struct vm_area), 8, NULL);
+    }
+    if (!vma_list_cache) {
+        vma_list_cache = kmem_cache_create("vma_list", sizeof(struct vma_list), 8, NULL);
+    }
+}
+
+static void vma_list_lock(struct vma_list* list) {
+    while (__atomic_test_and_set(&list->busy, __ATOMIC_ACQUIRE)) {
+        wait_event(&list->wait, !__atomic_load_n(&list->busy, __ATOMIC_RELAXED));
+    }
+}
+
+static void vma_list_unlock(struct vma_list* list) {
+    __atomic_clear(&list->busy, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&list->wait);
+}
+
+static void free_areas(struct vm_area** head) {
+    while (*head) {
+        struct vm_area* next = (*head)->next;
+        kmem_cache_free(vma_cache, *head);
+        *head = next;
+    }
+}
+
+struct vma_list* vma_list_create(void) {
+    struct vma_list* list = kmem_cache_alloc(vma_list_cache);
+    if (!list) return NULL;
+
+    list->head = NULL;
+    list->busy = false;
+    wait_queue_init(&list->wait);
+    list->refs = 1;
+    return list;
+}
+
+void vma_list_get(struct vma_list* list) {
+    __atomic_add_fetch(&list->refs, 1, __ATOMIC_RELAXED);
+}
+
+void vma_list_put(struct vma_list* list) {
+    if (!list || __atomic_sub_fetch(&list->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    free_areas(&list->head);
+    kmem_cache_free(vma_list_cache, list);
+}
+
+struct vm_area* vma_create(struct vma_list* list, uint64_t start, uint64_t len, uint64_t page_flags,
+                           uint32_t inode, uint64_t offset, uint64_t file_end) {
+    struct vm_area* vma = kmem_cache_alloc(vma_cache);
+    if (!vma) return NULL;
+
+    vma->start = start;
+    vma->end = start + len;
+    vma->page_flags = page_flags;
+    vma->inode = inode;
+    vma->offset = offset;
+    vma->file_end = file_end;
+
+    // Keep the list sorted; callers clear any overlap first
+    vma_list_lock(list);
+    struct vm_area** link = &list->head;
+    while (*link && (*link)->start < start) {
+        link = &(*link)->next;
+    }
+    vma->next = *link;
+    *link = vma;
+    vma_list_unlock(list);
+
+    return vma;
+}
+
+static bool remove_range(struct vm_area** list, uint64_t start, uint64_t len) {
+    uint64_t end = start + len;
+    struct vm_area** link = list;
+
+    while (*link) {
+        struct vm_area* vma = *link;
+        if (vma->end <= start || vma->start >= end) {
+            link = &vma->next;
+            continue;
+        }
+
+        if (start <= vma->start && end >= vma->end) {
+            // Fully covered
+            *link = vma->next;
+            kmem_cache_free(vma_cache, vma);
+            continue;
+        }
+
+        if (start > vma->start && end < vma->end) {
+            // Hole in the middle: split off the tail
+            struct vm_area* tail = kmem_cache_alloc(vma_cache);
+            if (!tail) return false;
+
+            tail->start = end;
+            tail->end = vma->end;
+            tail->page_flags = vma->page_flags;
+            tail->inode = vma->inode;
+            tail->offset = vma->offset + (end - vma->start);
+            tail->file_end = vma->file_end;
+            tail->next = vma->next;
+            vma->end = start;
+            vma->next = tail;
+            return true;
+        }
+
+        if (start <= vma->start) {
+            // Trim the head
+            if (vma->inode) vma->offset += end - vma->start;
+            vma->start = end;
+        } else {
+            // Trim the tail
+            vma->end = start;
+        }
+        link = &vma->next;
+    }
+    return true;
+}
+
+bool vma_remove_range(struct vma_list* list, uint64_t start, uint64_t len) {
+    vma_list_lock(list);
+    bool removed = remove_range(&list->head, start, len);
+    vma_list_unlock(list);
+    return removed;
+}
+
+static struct vm_area* vma_find(struct vm_area* list, uint64_t addr) {
+    for (struct vm_area* vma = list; vma && vma->start <= addr; vma = vma->next) {
+        if (addr < vma->end) return vma;
+    }
+    return NULL;
+}
+
+bool vma_clone_list(struct vma_list* src, struct vma_list* dst) {
+    struct vm_area* head = NULL;
+    struct vm_area** link = &head;
+    bool success = true;
+
+    vma_list_lock(src);
+    for (struct vm_area* vma = src->head; vma; vma = vma->next) {
+        struct vm_area* copy = kmem_cache_alloc(vma_cache);
+        if (!copy) {
+            success = false;
+            break;
+        }
+        memcpy(copy, vma, sizeof(struct vm_area));
+        copy->next = NULL;
+        *link = copy;
+        link = &copy->next;
+    }
+    vma_list_unlock(src);
+
+    if (!success) {
+        free_areas(&head);
+        return false;
+    }
+    vma_list_lock(dst);
+    dst->head = head;
+    vma_list_unlock(dst);
+    return true;
+}
+
+// Anonymous memory is zero-filled, using a 2MB page when the whole aligned
+// stretch lies inside the area and nothing in it is mapped yet
+static bool populate_anon(struct vm_area* vma, uint64_t page) {
+    uint64_t huge = page & ~(uint64_t)(PAGE_SIZE_2M - 1);
+    if (huge >= vma->start && huge + PAGE_SIZE_2M <= vma->end &&
+        vmm_is_unmapped(huge, PAGE_SIZE_2M)) {
+        size_t order = pmm_order_for_pages(PAGE_SIZE_2M / PAGE_SIZE);
+        void* phys = pmm_alloc_pages(order);
+        if (phys) {
+            memset(pmm_phys_to_virt(phys), 0, PAGE_SIZE_2M);
+            if (vmm_map_range(huge, (uint64_t)phys, PAGE_SIZE_2M, vma->page_flags)) {
+                return true;
+            }
+            pmm_free_pages(phys, order);
+        }
+    }
+
+    void* phys = pmm_alloc_zeroed_page();
+    if (!phys) return false;
+
+    if (!vmm_map_page(page, (uint64_t)phys, vma->page_flags)) {
+        pmm_free_page(phys);
+        return false;
+    }
+    return true;
+}
+
+// Private copy of a cached file page, zeroed past file_end
+static void* copy_file_page(struct vm_area* vma, uint64_t offset) {
+    void* cached = page_cache_get(vma->inode, offset / PAGE_SIZE);
+    if (!cached) return NULL;
+
+    void* phys = pmm_alloc_zeroed_page();
+    if (phys) {
+        uint64_t bytes = vma->file_end - offset < PAGE_SIZE ? vma->file_end - offset : PAGE_SIZE;
+        memcpy(pmm_phys_to_virt(phys), pmm_phys_to_virt(cached), bytes);
+    }
+    pmm_page_put(cached);
+    return phys;
+}
+
+// File pages come from the page cache, along with up to VMA_FAULT_AROUND - 1
+// following pages that are not populated yet. The cached frame is mapped
+// itself: as is in shared areas, copy-on-write in private writable ones.
+// Only the faulting page of a private write and pages cut short by file_end
+// get a private copy up front.
+static bool populate_file(struct vm_area* vma, uint64_t page, bool write) {
+    for (uint32_t i = 0; i < VMA_FAULT_AROUND; i++) {
+        uint64_t virt = page + (uint64_t)i * PAGE_SIZE;
+        if (virt >= vma->end) break;
+        if (i > 0 && vmm_get_phys_addr(virt)) break;
+
+        uint64_t offset = vma->offset + (virt - vma->start);
+        uint64_t flags = vma->page_flags;
+        void* phys;
+        if (offset >= vma->file_end) {
+            phys = pmm_alloc_zeroed_page();
+        } else if (flags & PTE_SHARED) {
+            phys = page_cache_get(vma->inode, offset / PAGE_SIZE);
+        } else if (offset + PAGE_SIZE > vma->file_end || (write && i == 0)) {
+            phys = copy_file_page(vma, offset);
+        } else {
+            phys = page_cache_get(vma->inode, offset / PAGE_SIZE);
+            if (flags & PTE_WRITABLE) flags = (flags & ~PTE_WRITABLE) | PTE_COW;
+        }
+        if (!phys) return i > 0;
+
+        if (!vmm_map_page(virt, (uint64_t)phys, flags)) {
+            pmm_page_put(phys);
+            return i > 0;
+        }
+    }
+    return true;
+}
+
+bool vma_sync_range(struct vma_list* list, uint64_t start, uint64_t len) {
+    uint64_t end = start + len;
+    bool success = true;
+
+    vma_list_lock(list);
+    for (struct vm_area* vma = list->head; vma && vma->start < end; vma = vma->next) {
+        if (!vma->inode || !(vma->page_flags & PTE_SHARED) || vma->end <= start) continue;
+
+        uint64_t from = (start > vma->start ? start : vma->start) & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t to = end < vma->end ? end : vma->end;
+        for (uint64_t virt = from; virt < to; virt += PAGE_SIZE) {
+            // Step over empty 2MB blocks of a sparsely touched area
+            if (!(virt & (PAGE_SIZE_2M - 1)) && to - virt >= PAGE_SIZE_2M &&
+                vmm_is_unmapped(virt, PAGE_SIZE_2M)) {
+                virt += PAGE_SIZE_2M - PAGE_SIZE;
+                continue;
+            }
+
+            // Cleared before the copy, so a store racing the write-back
+            // dirties the page again
+            if (!vmm_test_and_clear_dirty(virt)) continue;
+            uint64_t phys = vmm_get_phys_addr(virt) & ~(uint64_t)(PAGE_SIZE - 1);
+            uint64_t offset = vma->offset + (virt - vma->start);
+            if (!page_cache_writeback(vma->inode, offset / PAGE_SIZE, (void*)phys)) success = false;
+        }
+    }
+    vma_list_unlock(list);
+    return success;
+}
+
+bool vma_handle_fault(uint64_t addr, uint64_t error_code) {
+    // Protection faults on present pages are not ours
+    if (error_code & PF_PRESENT) return false;
+
+    // io_uring workers share their owner's list along with its address space
+    process_t* current = get_current_process();
+    if (!current || !current->vmas) return false;
+
+    // Held while populating, so munmap() cannot drop the area meanwhile
+    struct vma_list* list = current->vmas;
+    vma_list_lock(list);
+    bool handled = false;
+    struct vm_area* vma = vma_find(list->head, addr);
+    if (vma && (!(error_code & PF_WRITE) || (vma->page_flags & PTE_WRITABLE))) {
+        uint64_t page = addr & ~(uint64_t)(PAGE_SIZE - 1);
+        if (vmm_get_phys_addr(page)) {
+            // Another thread of the address space got here first
+            handled = true;
+        } else {
+            handled = vma->inode ? populate_file(vma, page, error_code & PF_WRITE) : populate_anon(vma, page);
+        }
+    }
+    vma_list_unlock(list);
+    return handled;
+}
@@ -0,0 +1,53 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <core/wait.h>
+
+#define VMA_FAULT_AROUND 16   // File pages populated per fault
+
+// A range of user address space populated lazily on first access
+struct vm_area {
+    uint64_t start;
+    uint64_t end;             // Exclusive
+    uint64_t page_flags;      // PTE flags for pages populated in this area
+    uint32_t inode;           // Backing file, 0 for anonymous memory
+    uint64_t offset;          // File offset of start
+    uint64_t file_end;        // File offset past which the area reads as zero
+    struct vm_area* next;     // Next area, sorted by address
+};
+
+// The areas of one address space. Referenced like the page directory by
+// the process and the kernel threads borrowing it (io_uring workers), and
+// freed with the last reference. busy serializes changes and faults, which
+// may sleep on file I/O while populating a page.
+struct vma_list {
+    struct vm_area* head;
+    volatile bool busy;
+    struct wait_queue wait;
+    volatile uint32_t refs;
+};
+
+void vma_init(void);
+struct vma_list* vma_list_create(void);
+void vma_list_get(struct vma_list* list);
+// Drop a reference, freeing the list and its areas with the last
+void vma_list_put(struct vma_list* list);
+
+// file_end: file offset past which the area reads as zero, UINT64_MAX for none
+struct vm_area* vma_create(struct vma_list* list, uint64_t start, uint64_t len, uint64_t page_flags,
+                           uint32_t inode, uint64_t offset, uint64_t file_end);
+bool vma_remove_range(struct vma_list* list, uint64_t start, uint64_t len);
+// Copy the areas of src into the empty list dst
+bool vma_clone_list(struct vma_list* src, struct vma_list* dst);
+// Write dirty pages of shared file areas in the range back to their files;
+// false if any write failed
+bool vma_sync_range(struct vma_list* list, uint64_t start, uint64_t len);
+
+// Populate a not-present page of the current address space; false if no
+// area covers it
+bool vma_handle_fault(uint64_t addr, uint64_t error_code);
+
+#endif // VMA_H
@@ -0,0 +1,193 @@
+#include <mm/vmalloc.h>
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <core/smp.h>
+#include <utils/mem.h>
+#include <utils/asm.h>
+
+// A run of pages in the vmalloc region, kept sorted by base address
+struct vmalloc_area {
+    uint64_t base;
+    uint64_t pages;     // Including the trailing guard page
+    bool used;
+    uintptr_t site;     // Caller charged by the heap, see heap_track()
+};
+
+static struct vmalloc_area areas[MAX_VMALLOC_AREAS];
+static uint32_t area_count = 0;
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
+
+static void areas_init(void) {
+    areas[0].base = VMALLOC_BASE;
+    areas[0].pages = VMALLOC_SIZE / PAGE_SIZE;
+    areas[0].used = false;
+    area_count = 1;
+}
+
+static int find_area(uint64_t base) {
+    // Binary search over the sorted area list
+    int lo = 0, hi = (int)area_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (areas[mid].base == base) return mid;
+        if (areas[mid].base < base) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+// Reserve exactly pages of address space, returns the base or 0. With
+// the area table full only a free area of that size will do, since the
+// remainder of a larger one could not be tracked.
+static uint64_t reserve_range(uint64_t pages) {
+    if (area_count == 0) areas_init();
+
+    for (uint32_t i = 0; i < area_count; i++) {
+        if (areas[i].used || areas[i].pages < pages) continue;
+        if (areas[i].pages > pages && area_count >= MAX_VMALLOC_AREAS) continue;
+
+        // Split off the remainder
+        if (areas[i].pages > pages) {
+            memmove(&areas[i + 2], &areas[i + 1], (area_count - i - 1) * sizeof(struct vmalloc_area));
+            areas[i + 1].base = areas[i].base + pages * PAGE_SIZE;
+            areas[i + 1].pages = areas[i].pages - pages;
+            areas[i + 1].used = false;
+            areas[i].pages = pages;
+            area_count++;
+        }
+
+        areas[i].used = true;
+        areas[i].site = 0;
+        return areas[i].base;
+    }
+    return 0;
+}
+
+static void release_range(int i) {
+    areas[i].used = false;
+
+    // Merge with the following free area
+    if (i + 1 < (int)area_count && !areas[i + 1].used) {
+        areas[i].pages += areas[i + 1].pages;
+        memmove(&areas[i + 1], &areas[i + 2], (area_count - i - 2) * sizeof(struct vmalloc_area));
+        area_count--;
+    }
+
+    // Merge with the preceding free area
+    if (i > 0 && !areas[i - 1].used) {
+        areas[i - 1].pages += areas[i].pages;
+        memmove(&areas[i], &areas[i + 1], (area_count - i - 1) * sizeof(struct vmalloc_area));
+        area_count--;
+    }
+}
+
+static void unmap_pages(uint64_t base, uint64_t pages) {
+    for (uint64_t i = 0; i < pages; i++) {
+        uint64_t virt = base + i * PAGE_SIZE;
+        uint64_t phys = vmm_get_phys_addr(virt);
+        if (!phys) continue;
+        vmm_unmap_page(virt);
+        // Pages may also be mapped into user space, as uring rings are
+        pmm_page_put((void*)(phys & ~(uint64_t)(PAGE_SIZE - 1)));
+    }
+}
+
+void* vmalloc(size_t size) {
+    if (!size) return NULL;
+
+    uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&vmalloc_lock);
+    uint64_t base = reserve_range(pages + 1);  // One unmapped guard page
+    spinlock_release(&vmalloc_lock);
+    irq_restore(flags);
+
+    if (!base) return NULL;
+
+    // Back the range page by page; physical contiguity is not needed here
+    for (uint64_t i = 0; i < pages; i++) {
+        void* phys = pmm_alloc_page();
+        if (!phys || !vmm_map_page(base + i * PAGE_SIZE, (uint64_t)phys,
+                                   PTE_PRESENT | PTE_WRITABLE)) {
+            if (phys) pmm_free_page(phys);
+            unmap_pages(base, i);
+
+            flags = irq_save();
+            spinlock_acquire(&vmalloc_lock);
+            release_range(find_area(base));
+            spinlock_release(&vmalloc_lock);
+            irq_restore(flags);
+            return NULL;
+        }
+    }
+
+    return (void*)base;
+}
+
+void vfree(void* ptr) {
+    if (!ptr || !is_vmalloc_addr(ptr)) return;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&vmalloc_lock);
+    int i = find_area((uint64_t)ptr);
+    if (i < 0 || !areas[i].used) {
+        spinlock_release(&vmalloc_lock);
+        irq_restore(flags);
+        return;
+    }
+    uint64_t pages = areas[i].pages - 1;
+    spinlock_release(&vmalloc_lock);
+    irq_restore(flags);
+
+    unmap_pages((uint64_t)ptr, pages);
+
+    flags = irq_save();
+    spinlock_acquire(&vmalloc_lock);
+    release_range(find_area((uint64_t)ptr));
+    spinlock_release(&vmalloc_lock);
+    irq_restore(flags);
+}
+
+size_t vmalloc_size(const void* ptr) {
+    if (!is_vmalloc_addr(ptr)) return 0;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&vmalloc_lock);
+    int i = find_area((uint64_t)ptr);
+    size_t size = (i >= 0 && areas[i].used) ? (areas[i].pages - 1) * PAGE_SIZE : 0;
+    spinlock_release(&vmalloc_lock);
+    irq_restore(flags);
+    return size;
+}
+
+void vmalloc_set_site(const void* ptr, uintptr_t site) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&vmalloc_lock);
+    int i = find_area((uint64_t)ptr);
+    if (i >= 0 && areas[i].used) areas[i].site = site;
+    spinlock_release(&vmalloc_lock);
+    irq_restore(flags);
+}
+
+size_t vmalloc_size_site(const void* ptr, uintptr_t* site) {
+    *site = 0;
+    if (!is_vmalloc_addr(ptr)) return 0;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&vmalloc_lock);
+    int i = find_area((uint64_t)ptr);
+    size_t size = 0;
+    if (i >= 0 && areas[i].used) {
+        size = (areas[i].pages - 1) * PAGE_SIZE;
+        *site = areas[i].site;
+    }
+    spinlock_release(&vmalloc_lock);
+    irq_restore(flags);
+    return size;
+}
+
+bool is_vmalloc_addr(const void* ptr) {
+    uint64_t addr = (uint64_t)ptr;
+    return addr >= VMALLOC_BASE && addr < VMALLOC_BASE + VMALLOC_SIZE;
+}
@@ -0,0 +1,20 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MAX_VMALLOC_AREAS 512
+
+// Virtually contiguous allocations backed by individual physical pages
+void* vmalloc(size_t size);
+void vfree(void* ptr);
+size_t vmalloc_size(const void* ptr);
+bool is_vmalloc_addr(const void* ptr);
+
+// The heap's call site tag for an area it handed out, kept for its accounting
+void vmalloc_set_site(const void* ptr, uintptr_t site);
+size_t vmalloc_size_site(const void* ptr, uintptr_t* site);
+
+#endif // VMALLOC_H
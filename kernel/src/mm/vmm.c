@@ -4,6 +4,8 @@
 #include <utils/log.h>
 #include <core/attributes.h>
 #include <utils/asm.h>
+#include <mm/tlb.h>
+#include <core/smp.h>
 
 extern void kmain();
 
@@ -18,10 +20,19 @@ typedef struct {
     page_entry_t entries[512];
 } __attribute__((aligned(0x1000))) page_table_t;
 
-// Current page map level 4 table
-static page_table_t* current_pml4 = NULL;
+// Page map level 4 table this CPU is running on
+static inline page_table_t* current_pml4(void) {
+    return this_cpu()->pml4;
+}
+
+static page_table_t* kernel_pml4 = NULL;
 static uint64_t hhdm_offset = 0;
 
+// PCID 0 is the kernel's own context
+static bool pcid_enabled = false;
+static uint64_t pcid_bitmap[VMM_MAX_PCID / 64];
+static spinlock_t pcid_lock = SPINLOCK_INIT;
+
 // Convert physical address to virtual using HHDM
 static inline void* phys_to_virt(uint64_t phys) {
     if (!phys) return NULL;
@@ -48,16 +59,238 @@ static inline void get_page_indices(uint64_t vaddr,
 
 // Create a new page table
 static page_table_t* create_page_table(void) {
-    void* phys = pmm_alloc_page();
+    void* phys = pmm_alloc_zeroed_page();
     if (!phys) return NULL;
 
-    page_table_t* table = phys_to_virt((uint64_t)phys);
-    memset(table, 0, sizeof(page_table_t));
-    return table;
+    return phys_to_virt((uint64_t)phys);
 }
 
 #define IDENTITY_MAP_SIZE 0x100000  // First 1MB
 
+#define KERNEL_PML4_START   256     // First PML4 slot of the higher half
+
+#define CR0_WP              (1ULL << 16)
+#define CR4_PGE             (1ULL << 7)
+#define CR4_PCIDE           (1ULL << 17)
+
+#define MSR_PAT             0x277
+// WB, WC, UC-, UC, WB, WT, UC-, UC: the reset layout with entry 1 as WC
+#define PAT_LAYOUT          0x0007040600070106ULL
+
+static bool has_1g_pages = false;
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    uint32_t eax;
+
+    asm volatile(
+        "cpuid"
+        : "=a"(eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+        : "a"(leaf), "c"(subleaf)
+    );
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t cr4;
+    asm volatile("mov %0, cr4" : "=r"(cr4) :: "memory");
+    return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4) {
+    asm volatile("mov cr4, %0" :: "r"(cr4) : "memory");
+}
+
+static inline void invlpg(uint64_t virt) {
+    asm volatile(
+        "invlpg [%0]"
+        :
+        : "r"(virt)
+        : "memory"
+    );
+}
+
+// Kernel-half mappings are global and may be cached by every CPU, user
+// mappings only by CPUs running the current address space
+static inline uint64_t tlb_context(uint64_t virt) {
+    return virt >= KERNEL_HALF_BASE ? 0 : vmm_get_cr3();
+}
+
+// Table flags for intermediate levels; leaf entries carry the real permissions
+static inline uint64_t table_flags(uint64_t flags) {
+    return PTE_PRESENT | PTE_WRITABLE | (flags & PTE_USER);
+}
+
+// Kernel-half mappings are global so they survive PCID switches and
+// invlpg drops them from every context at once
+static inline uint64_t leaf_flags(uint64_t virt, uint64_t flags) {
+    flags &= ~PTE_HUGE;
+    if (virt >= KERNEL_HALF_BASE) flags |= PTE_GLOBAL;
+    return flags;
+}
+
+// Page size mapped by a leaf entry at each level (3 = PDPT, 2 = PD, 1 = PT)
+static inline uint64_t level_page_size(int level) {
+    return level == 3 ? PAGE_SIZE_1G : level == 2 ? PAGE_SIZE_2M : PAGE_SIZE_4K;
+}
+
+// Follow an entry to the next level table. A missing table is allocated and
+// a huge entry is split into 512 entries of child_size so existing
+// translations are preserved. Returns NULL when create is false and there is
+// no table to follow.
+//
+// Kernel-half walks run on several CPUs at once (parallel boot steps map
+// BARs and vmalloc areas), so a new table goes in with cmpxchg and the CPU
+// that loses the race frees its copy and follows the winner's.
+static page_table_t* next_table(page_entry_t* entry, uint64_t child_size, uint64_t flags, bool create) {
+    for (;;) {
+        page_entry_t old = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+        if ((old & PTE_PRESENT) && !(old & PTE_HUGE)) {
+            if (create && (flags & PTE_USER) && !(old & PTE_USER)) {
+                __atomic_or_fetch(entry, PTE_USER, __ATOMIC_RELAXED);
+            }
+            return phys_to_virt(old & PTE_ADDR_MASK);
+        }
+        if (!create) return NULL;
+
+        page_table_t* table = create_page_table();
+        if (!table) return NULL;
+
+        page_entry_t new;
+        if (old & PTE_PRESENT) {
+            uint64_t base = old & PTE_ADDR_MASK & ~(child_size * 512 - 1);
+            uint64_t leaf = old & (~PTE_ADDR_MASK & ~(1ULL << 12));  // Drop the huge-page PAT bit
+            if (child_size == PAGE_SIZE_4K) {
+                leaf &= ~PTE_HUGE;
+            }
+            for (int i = 0; i < 512; i++) {
+                table->entries[i] = (base + i * child_size) | leaf;
+            }
+            new = virt_to_phys(table) | table_flags(old);
+        } else {
+            new = virt_to_phys(table) | table_flags(flags);
+        }
+        if (__atomic_compare_exchange_n(entry, &old, new, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return table;
+        }
+        pmm_free_page((void*)virt_to_phys(table));
+    }
+}
+
+// Return the entry that maps virt at the given page size, building or
+// splitting the upper levels as needed
+static page_entry_t* walk_create(uint64_t virt, uint64_t size, uint64_t flags) {
+    uint64_t pml4_index, pdp_index, pd_index, pt_index;
+    get_page_indices(virt, &pml4_index, &pdp_index, &pd_index, &pt_index);
+
+    page_table_t* pdp = next_table(&current_pml4()->entries[pml4_index], PAGE_SIZE_1G, flags, true);
+    if (!pdp) return NULL;
+    if (size == PAGE_SIZE_1G) return &pdp->entries[pdp_index];
+
+    page_table_t* pd = next_table(&pdp->entries[pdp_index], PAGE_SIZE_2M, flags, true);
+    if (!pd) return NULL;
+    if (size == PAGE_SIZE_2M) return &pd->entries[pd_index];
+
+    page_table_t* pt = next_table(&pd->entries[pd_index], PAGE_SIZE_4K, flags, true);
+    if (!pt) return NULL;
+    return &pt->entries[pt_index];
+}
+
+// Find the leaf entry mapping virt and the size of the page it maps
+static page_entry_t* walk_lookup(uint64_t virt, uint64_t* size) {
+    uint64_t pml4_index, pdp_index, pd_index, pt_index;
+    get_page_indices(virt, &pml4_index, &pdp_index, &pd_index, &pt_index);
+
+    page_table_t* pdp = next_table(&current_pml4()->entries[pml4_index], PAGE_SIZE_1G, 0, false);
+    if (!pdp) return NULL;
+
+    page_entry_t* entry = &pdp->entries[pdp_index];
+    if (!(*entry & PTE_PRESENT)) return NULL;
+    if (*entry & PTE_HUGE) {
+        *size = PAGE_SIZE_1G;
+        return entry;
+    }
+
+    page_table_t* pd = phys_to_virt(*entry & PTE_ADDR_MASK);
+    entry = &pd->entries[pd_index];
+    if (!(*entry & PTE_PRESENT)) return NULL;
+    if (*entry & PTE_HUGE) {
+        *size = PAGE_SIZE_2M;
+        return entry;
+    }
+
+    page_table_t* pt = phys_to_virt(*entry & PTE_ADDR_MASK);
+    entry = &pt->entries[pt_index];
+    if (!(*entry & PTE_PRESENT)) return NULL;
+    *size = PAGE_SIZE_4K;
+    return entry;
+}
+
+// True if nothing at all is mapped in the size-aligned block holding virt
+bool vmm_is_unmapped(uint64_t virt, uint64_t size) {
+    uint64_t pml4_index, pdp_index, pd_index, pt_index;
+    get_page_indices(virt, &pml4_index, &pdp_index, &pd_index, &pt_index);
+
+    page_table_t* pdp = next_table(&current_pml4()->entries[pml4_index], PAGE_SIZE_1G, 0, false);
+    if (!pdp) return !(current_pml4()->entries[pml4_index] & PTE_PRESENT);
+    if (size == PAGE_SIZE_1G) return !(pdp->entries[pdp_index] & PTE_PRESENT);
+
+    page_table_t* pd = next_table(&pdp->entries[pdp_index], PAGE_SIZE_2M, 0, false);
+    if (!pd) return !(pdp->entries[pdp_index] & PTE_PRESENT);
+    if (size == PAGE_SIZE_2M) return !(pd->entries[pd_index] & PTE_PRESENT);
+
+    page_table_t* pt = next_table(&pd->entries[pd_index], PAGE_SIZE_4K, 0, false);
+    if (!pt) return !(pd->entries[pd_index] & PTE_PRESENT);
+    return !(pt->entries[pt_index] & PTE_PRESENT);
+}
+
+// Largest page size usable for the next piece of a range
+static uint64_t pick_page_size(uint64_t virt, uint64_t phys, uint64_t left) {
+    if (has_1g_pages && left >= PAGE_SIZE_1G && !((virt | phys) & (PAGE_SIZE_1G - 1))) {
+        return PAGE_SIZE_1G;
+    }
+    if (left >= PAGE_SIZE_2M && !((virt | phys) & (PAGE_SIZE_2M - 1))) {
+        return PAGE_SIZE_2M;
+    }
+    return PAGE_SIZE_4K;
+}
+
+// Write protection and global pages on this CPU, and PCIDs if vmm_init()
+// found them. CR4.PCIDE may only be set while CR3 uses PCID 0, which the
+// kernel tables do.
+static void cpu_paging_init(void) {
+    // Write-protect applies to the kernel too, so its writes break COW sharing
+    uint64_t cr0;
+    asm volatile("mov %0, cr0" : "=r"(cr0) :: "memory");
+    asm volatile("mov cr0, %0" :: "r"(cr0 | CR0_WP) : "memory");
+
+    uint64_t cr4 = read_cr4() | CR4_PGE;
+    if (pcid_enabled) cr4 |= CR4_PCIDE;
+    write_cr4(cr4);
+}
+
+void vmm_init_cpu(void) {
+    // Walks go through the tables this CPU was started on until it switches
+    uint64_t cr3;
+    asm volatile("mov %0, cr3" : "=r"(cr3) :: "memory");
+    this_cpu()->pml4 = phys_to_virt(cr3 & PTE_ADDR_MASK);
+
+    // APs start on the finished kernel tables; the BSP gets here before
+    // they exist and runs this from vmm_init()
+    if (kernel_pml4) cpu_paging_init();
+
+    uint32_t ebx, ecx, edx;
+    cpuid(1, 0, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 16))) return;
+
+    // Caches written back either side and every TLB entry dropped, global
+    // ones included, so no line or translation keeps the old type
+    uint64_t cr4 = read_cr4();
+    asm volatile("wbinvd" ::: "memory");
+    wrmsr(MSR_PAT, PAT_LAYOUT);
+    asm volatile("wbinvd" ::: "memory");
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+}
+
 void vmm_init(void) {
     volatile struct limine_hhdm_response* hhdm = hhdm_request.response;
 
@@ -72,117 +305,172 @@ void vmm_init(void) {
     }
     hhdm_offset = hhdm->offset;
 
+    vmm_init_cpu();
+
+    uint32_t ebx, ecx, edx;
+    cpuid(0x80000001, 0, &ebx, &ecx, &edx);
+    has_1g_pages = (edx & (1 << 26)) != 0;
+
     uint64_t cr3;
     asm volatile("mov rax, cr3" : "=a"(cr3) :: "memory");
-    current_pml4 = phys_to_virt(cr3 & ~0xFFF);
+    this_cpu()->pml4 = phys_to_virt(cr3 & PTE_ADDR_MASK);
 
     page_table_t* new_pml4 = create_page_table();
     if (!new_pml4) {
         return;
     }
 
-    memcpy(new_pml4, current_pml4, sizeof(page_table_t));
+    memcpy(new_pml4, current_pml4(), sizeof(page_table_t));
+    this_cpu()->pml4 = new_pml4;
 
-    for (uint64_t addr = 0; addr < IDENTITY_MAP_SIZE; addr += PAGE_SIZE) {
-        vmm_map_page(addr, addr, PTE_PRESENT | PTE_WRITABLE);
-    }
+    vmm_map_range(0, 0, IDENTITY_MAP_SIZE, PTE_PRESENT | PTE_WRITABLE);
 
     uint64_t kernel_virt = kernel_address_request.response->virtual_base;
     uint64_t kernel_phys = kernel_address_request.response->physical_base;
     uint64_t kernel_size = PAGE_ALIGN(kernel_address_request.response->virtual_base + 0x1000000 - kernel_virt);
 
-    for (uint64_t offset = 0; offset < kernel_size; offset += PAGE_SIZE) {
-        vmm_map_page(kernel_virt + offset, kernel_phys + offset, PTE_PRESENT | PTE_WRITABLE);
-    }
+    vmm_map_range(kernel_virt, kernel_phys, kernel_size, PTE_PRESENT | PTE_WRITABLE);
 
-    uint64_t pt_phys = virt_to_phys(new_pml4);
-    uint64_t pt_virt = (uint64_t)new_pml4;
-
-    vmm_map_page(pt_virt, pt_phys, PTE_PRESENT | PTE_WRITABLE);
-
-    for (int pml4_index = 0; pml4_index < 512; pml4_index++) {
-        if (!(new_pml4->entries[pml4_index] & PTE_PRESENT)) {
+    // Direct map of RAM through the HHDM, with the largest pages that fit
+    volatile struct limine_memmap_response* memmap = memmap_request.response;
+    for (uint64_t i = 0; memmap && i < memmap->entry_count; i++) {
+        struct limine_memmap_entry* entry = memmap->entries[i];
+        if (entry->type != LIMINE_MEMMAP_USABLE &&
+            entry->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE &&
+            entry->type != LIMINE_MEMMAP_KERNEL_AND_MODULES) {
             continue;
         }
 
-        uint64_t pdpt_phys = new_pml4->entries[pml4_index] & ~0xFFF;
-        page_table_t* pdpt = phys_to_virt(pdpt_phys);
-        vmm_map_page((uint64_t)pdpt, pdpt_phys, PTE_PRESENT | PTE_WRITABLE);
+        uint64_t base = entry->base & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t len = PAGE_ALIGN(entry->base + entry->length) - base;
+        vmm_map_range(hhdm_offset + base, base, len, PTE_PRESENT | PTE_WRITABLE);
+    }
 
-        for (int pdpt_index = 0; pdpt_index < 512; pdpt_index++) {
-            if (!(pdpt->entries[pdpt_index] & PTE_PRESENT)) {
-                continue;
-            }
+    // Framebuffer, already in the HHDM but worth remapping with large pages,
+    // write-combining so streamed rows leave in full-line bursts
+    if (framebuffer_request.response) {
+        for (uint64_t i = 0; i < framebuffer_request.response->framebuffer_count; i++) {
+            struct limine_framebuffer* fb = framebuffer_request.response->framebuffers[i];
+            uint64_t fb_virt = (uint64_t)fb->address & ~(uint64_t)(PAGE_SIZE - 1);
+            uint64_t fb_len = PAGE_ALIGN((uint64_t)fb->address + fb->pitch * fb->height) - fb_virt;
+            vmm_map_range(fb_virt, fb_virt - hhdm_offset, fb_len,
+                          PTE_PRESENT | PTE_WRITABLE | PTE_WRITECOMBINE | PTE_NX);
+        }
+    }
 
-            uint64_t pd_phys = pdpt->entries[pdpt_index] & ~0xFFF;
-            page_table_t* pd = phys_to_virt(pd_phys);
-            vmm_map_page((uint64_t)pd, pd_phys, PTE_PRESENT | PTE_WRITABLE);
+    // Populate every higher-half slot now so the kernel half of the PML4
+    // never changes and can be shared by all address spaces
+    for (int i = KERNEL_PML4_START; i < 512; i++) {
+        next_table(&new_pml4->entries[i], PAGE_SIZE_1G, 0, true);
+    }
 
-            for (int pd_index = 0; pd_index < 512; pd_index++) {
-                if (!(pd->entries[pd_index] & PTE_PRESENT)) {
-                    continue;
-                }
+    kernel_pml4 = new_pml4;
+    vmm_switch_pagemap(virt_to_phys(new_pml4));
 
-                uint64_t pt_phys = pd->entries[pd_index] & ~0xFFF;
-                page_table_t* pt = phys_to_virt(pt_phys);
-                vmm_map_page((uint64_t)pt, pt_phys, PTE_PRESENT | PTE_WRITABLE);
-            }
-        }
+    cpuid(1, 0, &ebx, &ecx, &edx);
+    if (ecx & (1 << 17)) {
+        pcid_enabled = true;
+        pcid_bitmap[0] |= 1;
     }
+    cpu_paging_init();
 
-    vmm_switch_pagemap(virt_to_phys(new_pml4));
-    current_pml4 = new_pml4;
+    log_info(pcid_enabled ? "VMM: PCID enabled" : "VMM: PCID not supported");
 }
 
 bool vmm_map_page(uint64_t virt, uint64_t phys, uint64_t flags) {
-    uint64_t pml4_index, pdp_index, pd_index, pt_index;
-    get_page_indices(virt, &pml4_index, &pdp_index, &pd_index, &pt_index);
+    page_entry_t* entry = walk_create(virt, PAGE_SIZE_4K, flags);
+    if (!entry) return false;
 
-    // Get or create PDP
-    page_table_t* pdp;
-    if (current_pml4->entries[pml4_index] & PTE_PRESENT) {
-        pdp = phys_to_virt(current_pml4->entries[pml4_index] & ~0xFFF);
-    } else {
-        pdp = create_page_table();
-        if (!pdp) return false;
+    // Map the actual page
+    page_entry_t old = *entry;
+    *entry = (phys & PTE_ADDR_MASK) | leaf_flags(virt, flags) | PTE_PRESENT;
 
-        current_pml4->entries[pml4_index] = virt_to_phys(pdp) | flags | PTE_PRESENT;
+    // Only a replaced translation can be cached by other CPUs
+    if (old & PTE_PRESENT) {
+        tlb_shootdown(tlb_context(virt), virt, PAGE_SIZE);
+    } else {
+        invlpg(virt);
     }
 
-    // Get or create PD
-    page_table_t* pd;
-    if (pdp->entries[pdp_index] & PTE_PRESENT) {
-        pd = phys_to_virt(pdp->entries[pdp_index] & ~0xFFF);
-    } else {
-        pd = create_page_table();
-        if (!pd) return false;
+    return true;
+}
 
-        pdp->entries[pdp_index] = virt_to_phys(pd) | flags | PTE_PRESENT;
+bool vmm_map_range(uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags) {
+    len = PAGE_ALIGN(len);
+
+    uint64_t done = 0;
+    bool replaced = false;
+    while (done < len) {
+        uint64_t size = pick_page_size(virt + done, phys + done, len - done);
+        page_entry_t* entry;
+
+        // A slot already holding a lower-level table keeps it; use smaller pages there
+        for (;;) {
+            entry = walk_create(virt + done, size, flags);
+            if (!entry || size == PAGE_SIZE_4K ||
+                !(*entry & PTE_PRESENT) || (*entry & PTE_HUGE)) {
+                break;
+            }
+            size = (size == PAGE_SIZE_1G) ? PAGE_SIZE_2M : PAGE_SIZE_4K;
+        }
+
+        if (!entry) {
+            if (replaced) {
+                tlb_shootdown(tlb_context(virt), virt, done);
+            } else {
+                tlb_flush_local(tlb_context(virt), virt, done);
+            }
+            return false;
+        }
+
+        if (*entry & PTE_PRESENT) replaced = true;
+        *entry = ((phys + done) & PTE_ADDR_MASK) | leaf_flags(virt + done, flags) | PTE_PRESENT |
+                 (size != PAGE_SIZE_4K ? PTE_HUGE : 0);
+        done += size;
     }
 
-    // Get or create PT
-    page_table_t* pt;
-    if (pd->entries[pd_index] & PTE_PRESENT) {
-        pt = phys_to_virt(pd->entries[pd_index] & ~0xFFF);
+    // One flush for the whole batch
+    if (replaced) {
+        tlb_shootdown(tlb_context(virt), virt, len);
     } else {
-        pt = create_page_table();
-        if (!pt) return false;
-
-        pd->entries[pd_index] = virt_to_phys(pt) | flags | PTE_PRESENT;
+        tlb_flush_local(tlb_context(virt), virt, len);
     }
+    return true;
+}
 
-    // Map the actual page
-    pt->entries[pt_index] = phys | flags | PTE_PRESENT;
+void vmm_unmap_range(uint64_t virt, uint64_t len) {
+    len = PAGE_ALIGN(len);
+
+    uint64_t done = 0;
+    while (done < len) {
+        uint64_t size;
+        page_entry_t* entry = walk_lookup(virt + done, &size);
+        if (!entry) {
+            // Skip whole empty 2MB blocks of sparse ranges
+            uint64_t cur = virt + done;
+            if (!(cur & (PAGE_SIZE_2M - 1)) && len - done >= PAGE_SIZE_2M &&
+                vmm_is_unmapped(cur, PAGE_SIZE_2M)) {
+                done += PAGE_SIZE_2M;
+            } else {
+                done += PAGE_SIZE;
+            }
+            continue;
+        }
 
-    // Invalidate TLB for this page
-    asm volatile(
-        "invlpg [%0]"
-        :
-        : "r"(virt)
-        : "memory"
-    );
+        // Drop a huge page outright when the range covers it, otherwise split it
+        if (size != PAGE_SIZE_4K &&
+            (((virt + done) & (size - 1)) || len - done < size)) {
+            entry = walk_create(virt + done, PAGE_SIZE_4K, 0);
+            if (!entry) break;
+            size = PAGE_SIZE_4K;
+        }
 
-    return true;
+        *entry = 0;
+        done += size;
+    }
+
+    // One shootdown round for the whole range
+    tlb_shootdown(tlb_context(virt), virt, len);
 }
 
 void vmm_switch_pagemap(uint64_t pml4_phys) {
@@ -206,67 +494,315 @@ uint64_t vmm_get_cr3(void) {
 }
 
 bool vmm_unmap_page(uint64_t virt) {
-    uint64_t pml4_index, pdp_index, pd_index, pt_index;
-    get_page_indices(virt, &pml4_index, &pdp_index, &pd_index, &pt_index);
-
-    // Walk the page tables
-    if (!(current_pml4->entries[pml4_index] & PTE_PRESENT)) {
+    uint64_t size;
+    if (!walk_lookup(virt, &size)) {
         return false;
     }
 
-    page_table_t* pdp = phys_to_virt(current_pml4->entries[pml4_index] & ~0xFFF);
-    if (!(pdp->entries[pdp_index] & PTE_PRESENT)) {
+    // Huge mappings are split so only this page goes away
+    page_entry_t* entry = walk_create(virt, PAGE_SIZE_4K, 0);
+    if (!entry) {
         return false;
     }
 
-    page_table_t* pd = phys_to_virt(pdp->entries[pdp_index] & ~0xFFF);
-    if (!(pd->entries[pd_index] & PTE_PRESENT)) {
-        return false;
+    // Clear the page table entry
+    *entry = 0;
+
+    // Invalidate TLB for this page on every CPU that may cache it
+    tlb_shootdown(tlb_context(virt), virt, PAGE_SIZE);
+
+    return true;
+}
+
+uint64_t vmm_get_phys_addr(uint64_t virt) {
+    uint64_t size;
+    page_entry_t* entry = walk_lookup(virt, &size);
+    if (!entry) {
+        return 0;
     }
 
-    page_table_t* pt = phys_to_virt(pd->entries[pd_index] & ~0xFFF);
-    if (!(pt->entries[pt_index] & PTE_PRESENT)) {
-        return false;
+    // Get the physical address from the leaf entry
+    return (*entry & PTE_ADDR_MASK & ~(size - 1)) | (virt & (size - 1));
+}
+
+uint64_t vmm_share_user_page(uint64_t virt) {
+    uint64_t size;
+    page_entry_t* entry = walk_lookup(virt, &size);
+    if (!entry || !(*entry & PTE_USER)) return 0;
+
+    // Sharing is tracked per 4K frame, so a huge page is split first
+    uint64_t page = virt & ~(uint64_t)(PAGE_SIZE - 1);
+    if (size != PAGE_SIZE_4K) {
+        entry = walk_create(page, PAGE_SIZE_4K, 0);
+        if (!entry || !(*entry & PTE_PRESENT)) return 0;
     }
 
-    // Clear the page table entry
-    pt->entries[pt_index] = 0;
+    if ((*entry & PTE_WRITABLE) && !(*entry & PTE_SHARED)) {
+        *entry = (*entry & ~PTE_WRITABLE) | PTE_COW;
+        tlb_shootdown(tlb_context(page), page, PAGE_SIZE);
+    }
 
-    // Invalidate TLB for this page
-    asm volatile(
-        "invlpg [%0]"
-        :
-        : "r"(virt)
-        : "memory"
-    );
+    uint64_t frame = *entry & PTE_ADDR_MASK;
+    if (!pmm_page_try_get((void*)frame)) return 0;
+    return frame;
+}
+
+bool vmm_test_and_clear_dirty(uint64_t virt) {
+    uint64_t size;
+    page_entry_t* entry = walk_lookup(virt, &size);
+    if (!entry || !(*entry & PTE_DIRTY)) return false;
+
+    __atomic_and_fetch(entry, ~PTE_DIRTY, __ATOMIC_SEQ_CST);
 
+    // A CPU still caching the dirty translation would not set the bit again
+    uint64_t page = virt & ~(size - 1);
+    tlb_shootdown(tlb_context(page), page, size);
     return true;
 }
 
-uint64_t vmm_get_phys_addr(uint64_t virt) {
-    uint64_t pml4_index, pdp_index, pd_index, pt_index;
-    get_page_indices(virt, &pml4_index, &pdp_index, &pd_index, &pt_index);
+static uint64_t pcid_alloc(void) {
+    if (!pcid_enabled) return 0;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pcid_lock);
+    uint64_t pcid = 0;
+    for (uint64_t i = 1; i < VMM_MAX_PCID; i++) {
+        if (!(pcid_bitmap[i / 64] & (1ULL << (i % 64)))) {
+            pcid_bitmap[i / 64] |= 1ULL << (i % 64);
+            pcid = i;
+            break;
+        }
+    }
+    spinlock_release(&pcid_lock);
+    irq_restore(flags);
 
-    // Walk the page tables
-    if (!(current_pml4->entries[pml4_index] & PTE_PRESENT)) {
-        return 0;
+    // Out of PCIDs: fall back to the untagged context, flushed on every switch
+    return pcid;
+}
+
+static void pcid_free(uint64_t cr3) {
+    uint64_t pcid = cr3 & CR3_PCID_MASK;
+    if (!pcid) return;
+
+    // Drop whatever the old owner left in the TLB before the PCID is reused
+    tlb_flush_address_space(cr3);
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pcid_lock);
+    pcid_bitmap[pcid / 64] &= ~(1ULL << (pcid % 64));
+    spinlock_release(&pcid_lock);
+    irq_restore(flags);
+}
+
+// Lower-half slots not inherited from the kernel belong to the address space
+static inline bool is_private_slot(page_table_t* pml4, int index) {
+    return index < KERNEL_PML4_START && (pml4->entries[index] & PTE_PRESENT) &&
+           (pml4->entries[index] & PTE_ADDR_MASK) != (kernel_pml4->entries[index] & PTE_ADDR_MASK);
+}
+
+// Free a private table, the tables below it and the frames they map
+static void free_table(page_table_t* table, int level) {
+    for (int i = 0; i < 512; i++) {
+        page_entry_t entry = table->entries[i];
+        if (!(entry & PTE_PRESENT)) continue;
+
+        if (level == 1) {
+            pmm_page_put((void*)(entry & PTE_ADDR_MASK));
+        } else if (entry & PTE_HUGE) {
+            // Huge pages are split before they can be shared, so this is the only owner
+            uint64_t size = level_page_size(level);
+            pmm_free_pages((void*)(entry & PTE_ADDR_MASK & ~(size - 1)),
+                           pmm_order_for_pages(size / PAGE_SIZE));
+        } else {
+            free_table(phys_to_virt(entry & PTE_ADDR_MASK), level - 1);
+        }
     }
+    pmm_free_page((void*)virt_to_phys(table));
+}
 
-    page_table_t* pdp = phys_to_virt(current_pml4->entries[pml4_index] & ~0xFFF);
-    if (!(pdp->entries[pdp_index] & PTE_PRESENT)) {
-        return 0;
+// Share a private table with a new address space. Frames are referenced
+// rather than copied; writable pages turn read-only copy-on-write in both.
+static bool clone_table(page_table_t* dst, page_table_t* src, int level) {
+    for (int i = 0; i < 512; i++) {
+        page_entry_t entry = src->entries[i];
+        if (!(entry & PTE_PRESENT)) continue;
+
+        // Sharing is tracked per 4K frame, so huge pages are split first
+        if (level > 1 && (entry & PTE_HUGE)) {
+            if (!next_table(&src->entries[i], level_page_size(level - 1), 0, true)) {
+                return false;
+            }
+            entry = src->entries[i];
+        }
+
+        if (level == 1) {
+            if ((entry & PTE_WRITABLE) && !(entry & PTE_SHARED)) {
+                entry = (entry & ~PTE_WRITABLE) | PTE_COW;
+                src->entries[i] = entry;
+            }
+            pmm_page_get((void*)(entry & PTE_ADDR_MASK));
+            dst->entries[i] = entry;
+        } else {
+            page_table_t* table = create_page_table();
+            if (!table) return false;
+
+            dst->entries[i] = virt_to_phys(table) | (entry & ~PTE_ADDR_MASK);
+            if (!clone_table(table, phys_to_virt(entry & PTE_ADDR_MASK), level - 1)) {
+                return false;
+            }
+        }
     }
+    return true;
+}
 
-    page_table_t* pd = phys_to_virt(pdp->entries[pdp_index] & ~0xFFF);
-    if (!(pd->entries[pd_index] & PTE_PRESENT)) {
-        return 0;
+// Drop cached translations for an address space after its entries lost permissions
+uint64_t vmm_create_address_space(void) {
+    page_table_t* pml4 = create_page_table();
+    if (!pml4) return 0;
+
+    // Share the kernel half. The lower half starts empty so user mappings
+    // get tables of their own; the boot identity map is only needed by the
+    // AP trampoline, which runs on the kernel tables.
+    memcpy(&pml4->entries[KERNEL_PML4_START], &kernel_pml4->entries[KERNEL_PML4_START],
+           (512 - KERNEL_PML4_START) * sizeof(page_entry_t));
+
+    return virt_to_phys(pml4) | pcid_alloc();
+}
+
+uint64_t vmm_clone_address_space(uint64_t cr3) {
+    page_table_t* src = phys_to_virt(cr3 & PTE_ADDR_MASK);
+    if (!src) return 0;
+
+    uint64_t new_cr3 = vmm_create_address_space();
+    if (!new_cr3) return 0;
+
+    page_table_t* dst = phys_to_virt(new_cr3 & PTE_ADDR_MASK);
+    for (int i = 0; i < KERNEL_PML4_START; i++) {
+        if (!is_private_slot(src, i)) continue;
+
+        page_table_t* table = create_page_table();
+        if (!table) {
+            vmm_destroy_address_space(new_cr3);
+            return 0;
+        }
+
+        dst->entries[i] = virt_to_phys(table) | (src->entries[i] & ~PTE_ADDR_MASK);
+        if (!clone_table(table, phys_to_virt(src->entries[i] & PTE_ADDR_MASK), 3)) {
+            tlb_flush_address_space(cr3);
+            vmm_destroy_address_space(new_cr3);
+            return 0;
+        }
     }
 
-    page_table_t* pt = phys_to_virt(pd->entries[pd_index] & ~0xFFF);
-    if (!(pt->entries[pt_index] & PTE_PRESENT)) {
-        return 0;
+    // The parent may still cache writable translations for pages now marked COW
+    tlb_flush_address_space(cr3);
+    return new_cr3;
+}
+
+void vmm_destroy_address_space(uint64_t cr3) {
+    page_table_t* pml4 = phys_to_virt(cr3 & PTE_ADDR_MASK);
+    if (!pml4 || pml4 == kernel_pml4) return;
+    if (!pmm_page_unref((void*)virt_to_phys(pml4))) return;
+
+    if (pml4 == current_pml4()) {
+        vmm_switch_address_space(vmm_kernel_address_space());
+    }
+
+    for (int i = 0; i < KERNEL_PML4_START; i++) {
+        if (is_private_slot(pml4, i)) {
+            free_table(phys_to_virt(pml4->entries[i] & PTE_ADDR_MASK), 3);
+        }
     }
 
-    // Get the physical address from the page table entry
-    return (pt->entries[pt_index] & ~0xFFF) | (virt & 0xFFF);
-}
\ No newline at end of file
+    pmm_free_page((void*)virt_to_phys(pml4));
+    pcid_free(cr3);
+}
+
+void vmm_address_space_get(uint64_t cr3) {
+    pmm_page_get((void*)(cr3 & PTE_ADDR_MASK));
+}
+
+void vmm_switch_address_space(uint64_t cr3) {
+    if (!cr3) cr3 = vmm_kernel_address_space();
+
+    // A shootdown IPI must not land between recording the switch and loading
+    // CR3, nor a migration leave another CPU's pml4 pointing here
+    uint64_t irq = irq_save();
+    this_cpu()->pml4 = phys_to_virt(cr3 & PTE_ADDR_MASK);
+
+    // Entries tagged with a private PCID are still valid unless a shootdown
+    // happened while this CPU was running something else
+    bool stale = tlb_note_switch(cr3);
+    if (pcid_enabled && (cr3 & CR3_PCID_MASK) && !stale) {
+        cr3 |= CR3_NOFLUSH;
+    }
+    vmm_switch_pagemap(cr3);
+
+    irq_restore(irq);
+}
+
+uint64_t vmm_kernel_address_space(void) {
+    return virt_to_phys(kernel_pml4);
+}
+
+// Break copy-on-write sharing on the first write to a page. Several CPUs
+// may fault on the same page at once, so the new entry goes in with cmpxchg
+// and the loser drops its copy and retries the access.
+static bool handle_cow_fault(uint64_t addr) {
+    uint64_t size;
+    page_entry_t* entry = walk_lookup(addr, &size);
+    if (!entry || size != PAGE_SIZE_4K) return false;
+
+    uint64_t page = addr & ~(uint64_t)(PAGE_SIZE - 1);
+    page_entry_t old = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+    if (!(old & PTE_COW)) {
+        // Broken by another CPU since the caller looked
+        if (!(old & PTE_WRITABLE)) return false;
+        invlpg(page);
+        return true;
+    }
+
+    uint64_t frame = old & PTE_ADDR_MASK;
+    uint64_t flags = (old & ~PTE_ADDR_MASK & ~PTE_COW) | PTE_WRITABLE;
+
+    // The last sharer simply takes the page back
+    void* copy = NULL;
+    if (pmm_page_refcount((void*)frame) > 1) {
+        copy = pmm_alloc_page();
+        if (!copy) return false;
+        memcpy(phys_to_virt((uint64_t)copy), phys_to_virt(frame), PAGE_SIZE);
+    }
+
+    uint64_t new = (copy ? (uint64_t)copy : frame) | flags;
+    if (!__atomic_compare_exchange_n(entry, &old, new, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // Resolved elsewhere meanwhile, or the accessed bit changed
+        if (copy) pmm_free_page(copy);
+        return true;
+    }
+
+    if (!copy) {
+        invlpg(page);
+        return true;
+    }
+
+    // Other CPUs in this address space may still read the old frame; only
+    // the CPU that installed the copy gives it up, once none can
+    tlb_shootdown(tlb_context(page), page, PAGE_SIZE);
+    pmm_page_put((void*)frame);
+    return true;
+}
+
+bool vmm_handle_page_fault(uint64_t addr, uint64_t error_code) {
+    if ((error_code & PF_PRESENT) && (error_code & PF_WRITE)) {
+        // Another CPU already broke the sharing; only our TLB entry is stale
+        uint64_t size;
+        page_entry_t* entry = walk_lookup(addr, &size);
+        if (entry && (*entry & PTE_WRITABLE) &&
+            (!(error_code & PF_USER) || (*entry & PTE_USER))) {
+            invlpg(addr & ~(uint64_t)(PAGE_SIZE - 1));
+            return true;
+        }
+        return handle_cow_fault(addr);
+    }
+    return false;
+}
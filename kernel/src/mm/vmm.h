@@ -15,21 +15,69 @@
 #define PTE_DIRTY           (1ULL << 6)
 #define PTE_HUGE            (1ULL << 7)
 #define PTE_GLOBAL          (1ULL << 8)
+#define PTE_COW             (1ULL << 9)   // Software bit: read-only until the first write copies it
+#define PTE_SHARED          (1ULL << 10)  // Software bit: stays writable and shared across fork
 #define PTE_NX              (1ULL << 63)
 
+// PAT entry 1, which PWT alone selects at every page size, is programmed
+// as write-combining in place of write-through
+#define PTE_WRITECOMBINE    PTE_WRITETHROUGH
+#define PTE_ADDR_MASK       0x000FFFFFFFFFF000ULL
+
+// Page fault error code bits
+#define PF_PRESENT          (1ULL << 0)
+#define PF_WRITE            (1ULL << 1)
+#define PF_USER             (1ULL << 2)
+
 // Page sizes
 #define PAGE_SIZE_4K    0x1000
+#define PAGE_SIZE_2M    0x200000
+#define PAGE_SIZE_1G    0x40000000
 
 // Virtual memory regions
 #define KERNEL_VIRT_BASE     0xFFFFFFFF80000000ULL
 #define KERNEL_PHYS_BASE     0x0000000000100000ULL
+#define HEAP_VIRT_BASE       0xFFFFC00000000000ULL  // Small-object heap, grows upwards
+#define VMALLOC_BASE         0xFFFFD00000000000ULL  // Large virtually contiguous allocations
+#define VMALLOC_SIZE         0x0000010000000000ULL  // 1TB of address space
+#define KERNEL_HALF_BASE     0xFFFF800000000000ULL  // Shared by every address space
+
+// Address spaces are named by their CR3 value: PML4 physical address, PCID in the low bits
+#define CR3_PCID_MASK        0xFFFULL
+#define CR3_NOFLUSH          (1ULL << 63)
+#define VMM_MAX_PCID         4096
 
 // Function declarations
 void vmm_init(void);
+// Program this CPU's PAT; every CPU must match before touching WC mappings
+void vmm_init_cpu(void);
 bool vmm_map_page(uint64_t virt, uint64_t phys, uint64_t flags);
 bool vmm_unmap_page(uint64_t virt);
+bool vmm_map_range(uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags);
+void vmm_unmap_range(uint64_t virt, uint64_t len);
 void vmm_switch_pagemap(uint64_t pml4_phys);
 uint64_t vmm_get_cr3(void);
 uint64_t vmm_get_phys_addr(uint64_t virt);
+bool vmm_is_unmapped(uint64_t virt, uint64_t size);
+// Clear the dirty bit of the page holding virt; true if it was set
+bool vmm_test_and_clear_dirty(uint64_t virt);
+// Share the 4K frame behind user address virt as fork() does: a private
+// writable mapping turns copy-on-write. Returns the frame with a reference
+// for the caller to pmm_page_put(), or 0 if nothing is mapped there or
+// the frame has as many references as it may take.
+uint64_t vmm_share_user_page(uint64_t virt);
+
+// Per-process address spaces
+uint64_t vmm_create_address_space(void);
+uint64_t vmm_clone_address_space(uint64_t cr3);
+// Drop a reference to cr3, freeing it with the last
+void vmm_destroy_address_space(uint64_t cr3);
+// Another reference, for kernel threads that borrow a process's address space
+void vmm_address_space_get(uint64_t cr3);
+void vmm_switch_address_space(uint64_t cr3);
+uint64_t vmm_kernel_address_space(void);
+
+// Resolve a page fault; false means the fault is a real error
+bool vmm_handle_page_fault(uint64_t addr, uint64_t error_code);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,448 @@
+#include <net/arp.h>
+#include <net/pkbuf.h>
+#include <core/drivers/net/netdev.h>
+#include <core/drivers/net/ip.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <mm/slab.h>
+#include <utils/mem.h>
+
+#define ARP_HTYPE_ETHERNET  1
+#define ARP_OP_REQUEST      1
+#define ARP_OP_REPLY        2
+
+#define ARP_BUCKETS (1U << ARP_HASH_BITS)
+
+// Reachability, after RFC 4861's neighbor states
+#define ARP_INCOMPLETE      0   // Request out, frames queued
+#define ARP_REACHABLE       1   // Confirmed within ARP_REACHABLE_NS
+#define ARP_STALE           2   // Usable, to be confirmed when next used
+#define ARP_PROBE           3   // Used while stale; unicast requests out
+#define ARP_FAILED          4   // No answer; sends to it drop
+
+struct arp_packet {
+    uint16_t htype;
+    uint16_t ptype;
+    uint8_t hlen;
+    uint8_t plen;
+    uint16_t oper;
+    uint8_t sha[6];
+    uint32_t spa;
+    uint8_t tha[6];
+    uint32_t tpa;
+} __attribute__((packed));
+
+// A frame waiting for its neighbor to resolve
+struct arp_queued {
+    struct arp_queued* next;
+    uint8_t* frame;
+    uint32_t length;
+    bool has_offload;
+    struct netdev_tx_offload offload;
+};
+
+struct arp_entry {
+    uint32_t ip;
+    uint8_t mac[6];
+    uint8_t state;
+    uint8_t probes;             // Requests sent in this round
+    struct netdev* dev;
+    uint64_t confirmed;         // When last known good
+    uint64_t used;
+    uint64_t deadline;          // Next retransmit, or when FAILED ends
+    struct arp_queued* queue;
+    struct arp_queued* queue_tail;
+    uint32_t queued;
+    struct arp_entry* next;
+};
+
+static struct arp_entry* arp_buckets[ARP_BUCKETS];
+static uint32_t arp_count = 0;
+static struct kmem_cache* arp_cache = NULL;
+static spinlock_t arp_lock = SPINLOCK_INIT;
+static volatile uint64_t arp_next_timer = 0;    // Earliest deadline, roughly; 0 if none
+
+static const uint8_t arp_broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+static inline uint32_t arp_hash(uint32_t ip) {
+    return (uint32_t)(((uint64_t)ip * 0x9E3779B97F4A7C15ULL) >> (64 - ARP_HASH_BITS));
+}
+
+static inline void arp_arm(struct arp_entry* entry, uint64_t when) {
+    entry->deadline = when;
+    uint64_t next = arp_next_timer;
+    if (!next || when < next) arp_next_timer = when;
+}
+
+// arp_lock held
+static struct arp_entry* arp_find(uint32_t ip) {
+    for (struct arp_entry* entry = arp_buckets[arp_hash(ip)]; entry; entry = entry->next) {
+        if (entry->ip == ip) return entry;
+    }
+    return NULL;
+}
+
+// Unlink and free, handing back its queue. arp_lock held.
+static struct arp_queued* arp_remove(struct arp_entry* entry) {
+    struct arp_entry** link = &arp_buckets[arp_hash(entry->ip)];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+    arp_count--;
+
+    struct arp_queued* queue = entry->queue;
+    kmem_cache_free(arp_cache, entry);
+    return queue;
+}
+
+// Make room by dropping the longest unused resolved entry. arp_lock held.
+static struct arp_queued* arp_evict(void) {
+    struct arp_entry* victim = NULL;
+    for (uint32_t b = 0; b < ARP_BUCKETS; b++) {
+        for (struct arp_entry* entry = arp_buckets[b]; entry; entry = entry->next) {
+            if (entry->state == ARP_INCOMPLETE) continue;
+            if (!victim || entry->used < victim->used) victim = entry;
+        }
+    }
+    return victim ? arp_remove(victim) : NULL;
+}
+
+// A new entry, NULL if out of memory or every entry is mid-resolution.
+// arp_lock held; *dropped gets whatever eviction freed up.
+static struct arp_entry* arp_create(struct netdev* dev, uint32_t ip, uint64_t now, struct arp_queued** dropped) {
+    if (!arp_cache) {
+        arp_cache = kmem_cache_create("arp_entry", sizeof(struct arp_entry), 8, NULL);
+        if (!arp_cache) return NULL;
+    }
+    if (arp_count >= ARP_MAX_ENTRIES) {
+        *dropped = arp_evict();
+        if (arp_count >= ARP_MAX_ENTRIES) return NULL;
+    }
+
+    struct arp_entry* entry = kmem_cache_alloc(arp_cache);
+    if (!entry) return NULL;
+    memset(entry, 0, sizeof(struct arp_entry));
+    entry->ip = ip;
+    entry->dev = dev;
+    entry->used = now;
+
+    uint32_t bucket = arp_hash(ip);
+    entry->next = arp_buckets[bucket];
+    arp_buckets[bucket] = entry;
+    arp_count++;
+    return entry;
+}
+
+static void arp_free_queue(struct netdev* dev, struct arp_queued* queue) {
+    while (queue) {
+        struct arp_queued* next = queue->next;
+        if (dev) netdev_count(dev, NETDEV_TX_DROPPED, 1);
+        free(queue->frame);
+        free(queue);
+        queue = next;
+    }
+}
+
+// Address and send queued frames; called without arp_lock
+static void arp_flush_queue(struct netdev* dev, const uint8_t mac[6], struct arp_queued* queue) {
+    while (queue) {
+        struct arp_queued* next = queue->next;
+        memcpy(queue->frame, mac, 6);
+        netdev_transmit_offload(dev, queue->frame, queue->length, queue->has_offload ? &queue->offload : NULL);
+        free(queue->frame);
+        free(queue);
+        queue = next;
+    }
+}
+
+static void arp_send(struct netdev* dev, uint16_t op, uint32_t sender_ip, const uint8_t target_mac[6],
+                     uint32_t target_ip, const uint8_t* dest_mac) {
+    uint8_t frame[NETDEV_ETH_HLEN + sizeof(struct arp_packet)];
+    memcpy(frame, dest_mac, 6);
+    memcpy(frame + 6, dev->mac, 6);
+    frame[12] = NETDEV_ETH_P_ARP >> 8;
+    frame[13] = NETDEV_ETH_P_ARP & 0xFF;
+
+    struct arp_packet* arp = (struct arp_packet*)(frame + NETDEV_ETH_HLEN);
+    arp->htype = __builtin_bswap16(ARP_HTYPE_ETHERNET);
+    arp->ptype = __builtin_bswap16(NETDEV_ETH_P_IP);
+    arp->hlen = 6;
+    arp->plen = 4;
+    arp->oper = __builtin_bswap16(op);
+    memcpy(arp->sha, dev->mac, 6);
+    arp->spa = sender_ip;
+    memcpy(arp->tha, target_mac, 6);
+    arp->tpa = target_ip;
+    netdev_transmit_offload(dev, frame, sizeof(frame), NULL);
+}
+
+// Ask for ip: broadcast while unknown, unicast to confirm a stale address
+static void arp_request(struct netdev* dev, uint32_t ip, const uint8_t* unicast) {
+    static const uint8_t unknown[6] = { 0 };
+    arp_send(dev, ARP_OP_REQUEST, ip_source_address(ip), unicast ? unicast : unknown, ip,
+             unicast ? unicast : arp_broadcast);
+}
+
+int arp_output(struct netdev* dev, uint32_t next_hop, uint8_t* frame, uint32_t length,
+               const struct netdev_tx_offload* offload) {
+    if (!dev || !frame) {
+        free(frame);
+        return -1;
+    }
+    arp_timers_run();
+
+    memcpy(frame + 6, dev->mac, 6);
+    frame[12] = NETDEV_ETH_P_IP >> 8;
+    frame[13] = NETDEV_ETH_P_IP & 0xFF;
+    if (next_hop == ARP_BROADCAST) {
+        memcpy(frame, arp_broadcast, 6);
+        bool sent = netdev_transmit_offload(dev, frame, length, offload);
+        free(frame);
+        return sent ? 0 : -1;
+    }
+
+    uint64_t now = ktime_get_ns();
+    uint8_t mac[6];
+    bool resolved = false;
+    bool request = false;
+    bool probe = false;
+    struct arp_queued* dropped = NULL;
+
+    spinlock_acquire(&arp_lock);
+    struct arp_entry* entry = arp_find(next_hop);
+    if (!entry) {
+        entry = arp_create(dev, next_hop, now, &dropped);
+        if (entry) {
+            entry->state = ARP_INCOMPLETE;
+            entry->probes = 1;
+            arp_arm(entry, now + ARP_RETRANS_NS);
+            request = true;
+        }
+    }
+
+    if (entry) {
+        entry->used = now;
+        switch (entry->state) {
+            case ARP_STALE:
+                // Keep sending while a unicast request confirms it
+                entry->state = ARP_PROBE;
+                entry->probes = 1;
+                arp_arm(entry, now + ARP_RETRANS_NS);
+                probe = true;
+                // Fall through
+            case ARP_REACHABLE:
+            case ARP_PROBE:
+                memcpy(mac, entry->mac, 6);
+                resolved = true;
+                break;
+            case ARP_INCOMPLETE: {
+                struct arp_queued* queued = entry->queued < ARP_QUEUE_MAX ? malloc(sizeof(struct arp_queued)) : NULL;
+                if (queued) {
+                    queued->next = NULL;
+                    queued->frame = frame;
+                    queued->length = length;
+                    queued->has_offload = offload != NULL;
+                    if (offload) queued->offload = *offload;
+                    if (entry->queue_tail) entry->queue_tail->next = queued;
+                    else entry->queue = queued;
+                    entry->queue_tail = queued;
+                    entry->queued++;
+                    frame = NULL;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    spinlock_release(&arp_lock);
+
+    arp_free_queue(dev, dropped);
+    if (request) arp_request(dev, next_hop, NULL);
+    if (probe) arp_request(dev, next_hop, mac);
+    if (!frame) return 0;   // Queued
+
+    int result = -1;
+    if (resolved) {
+        memcpy(frame, mac, 6);
+        result = netdev_transmit_offload(dev, frame, length, offload) ? 0 : -1;
+    } else {
+        netdev_count(dev, NETDEV_TX_DROPPED, 1);
+    }
+    free(frame);
+    return result;
+}
+
+void arp_receive(struct netdev* dev, struct pkbuf* pb) {
+    if (!dev || pb->len < sizeof(struct arp_packet)) {
+        pkbuf_put(pb);
+        return;
+    }
+    struct arp_packet arp;
+    memcpy(&arp, pb->data, sizeof(arp));
+    pkbuf_put(pb);
+    if (arp.htype != __builtin_bswap16(ARP_HTYPE_ETHERNET) || arp.ptype != __builtin_bswap16(NETDEV_ETH_P_IP) ||
+        arp.hlen != 6 || arp.plen != 4 || !arp.spa || (arp.sha[0] & 1)) {
+        return;
+    }
+
+    uint16_t op = __builtin_bswap16(arp.oper);
+    bool for_us = ip_is_local(arp.tpa);
+    bool gratuitous = arp.spa == arp.tpa;
+    uint64_t now = ktime_get_ns();
+    struct arp_queued* ready = NULL;
+    struct arp_queued* dropped = NULL;
+
+    // Learn the sender (RFC 826): always update an entry we have, and make
+    // one when it talks to us or announces itself
+    spinlock_acquire(&arp_lock);
+    struct arp_entry* entry = arp_find(arp.spa);
+    if (!entry && (for_us || gratuitous)) {
+        entry = arp_create(dev, arp.spa, now, &dropped);
+        if (entry) entry->state = ARP_STALE;
+    }
+    if (entry) {
+        bool changed = memcmp(entry->mac, arp.sha, 6) != 0;
+        memcpy(entry->mac, arp.sha, 6);
+        entry->dev = dev;
+        if ((op == ARP_OP_REPLY && for_us) || entry->state == ARP_INCOMPLETE) {
+            // An answer to our request, or at least the address we wanted
+            entry->state = op == ARP_OP_REPLY && for_us ? ARP_REACHABLE : ARP_STALE;
+            entry->confirmed = now;
+            entry->probes = 0;
+            if (entry->state == ARP_REACHABLE) arp_arm(entry, now + ARP_REACHABLE_NS);
+            else entry->deadline = 0;
+        } else if (changed || entry->state == ARP_FAILED) {
+            // Moved, or back: usable, but unconfirmed
+            entry->state = ARP_STALE;
+            entry->deadline = 0;
+        }
+        ready = entry->queue;
+        entry->queue = NULL;
+        entry->queue_tail = NULL;
+        entry->queued = 0;
+    }
+    uint8_t mac[6];
+    memcpy(mac, arp.sha, 6);
+    spinlock_release(&arp_lock);
+
+    arp_free_queue(dev, dropped);
+    if (ready) arp_flush_queue(dev, mac, ready);
+    if (op == ARP_OP_REQUEST && for_us && !gratuitous) {
+        arp_send(dev, ARP_OP_REPLY, arp.tpa, arp.sha, arp.spa, arp.sha);
+    }
+}
+
+bool arp_lookup(uint32_t ip, uint8_t mac[6]) {
+    spinlock_acquire(&arp_lock);
+    struct arp_entry* entry = arp_find(ip);
+    bool found = entry && (entry->state == ARP_REACHABLE || entry->state == ARP_STALE || entry->state == ARP_PROBE);
+    if (found) memcpy(mac, entry->mac, 6);
+    spinlock_release(&arp_lock);
+    return found;
+}
+
+void arp_announce(struct netdev* dev, uint32_t ip) {
+    if (!dev || !ip) return;
+    arp_send(dev, ARP_OP_REQUEST, ip, arp_broadcast, ip, arp_broadcast);
+}
+
+// Timers due for one entry, saying whether a request is to go out and how.
+// false if the entry is to go. arp_lock held.
+static bool arp_entry_timers(struct arp_entry* entry, uint64_t now, bool* request, bool* unicast) {
+    *request = false;
+    *unicast = false;
+
+    switch (entry->state) {
+        case ARP_INCOMPLETE:
+        case ARP_PROBE:
+            if (!entry->deadline || now < entry->deadline) return true;
+            if (entry->probes >= ARP_MAX_PROBES) {
+                // Nobody home; hold it failed a while so sends fail fast
+                entry->state = ARP_FAILED;
+                arp_arm(entry, now + ARP_FAILED_NS);
+                return true;
+            }
+            entry->probes++;
+            arp_arm(entry, now + ARP_RETRANS_NS);
+            *request = true;
+            *unicast = entry->state == ARP_PROBE;
+            return true;
+        case ARP_REACHABLE:
+            if (now - entry->confirmed >= ARP_REACHABLE_NS) {
+                entry->state = ARP_STALE;
+                entry->deadline = 0;
+            }
+            return true;
+        case ARP_STALE:
+            return now - entry->used < ARP_GC_NS;
+        case ARP_FAILED:
+            return entry->deadline && now < entry->deadline;
+        default:
+            return true;
+    }
+}
+
+void arp_timers_run(void) {
+    uint64_t now = ktime_get_ns();
+    uint64_t due = arp_next_timer;
+    if (!due || now < due) return;
+
+    // Requests go out after the lock is dropped, a few per pass
+    struct { struct netdev* dev; uint32_t ip; uint8_t mac[6]; bool unicast; } requests[16];
+    uint32_t request_count = 0;
+    struct arp_queued* dropped = NULL;
+    struct netdev* dropped_dev = NULL;
+
+    spinlock_acquire(&arp_lock);
+    arp_next_timer = 0;
+    uint64_t next = 0;
+    for (uint32_t b = 0; b < ARP_BUCKETS; b++) {
+        struct arp_entry* entry = arp_buckets[b];
+        while (entry) {
+            struct arp_entry* following = entry->next;
+            bool request, unicast;
+            if (request_count == 16) {
+                // Leave the rest for the next pass
+                if (entry->deadline && (!next || entry->deadline < next)) next = entry->deadline;
+                entry = following;
+                continue;
+            }
+
+            uint8_t state = entry->state;
+            if (!arp_entry_timers(entry, now, &request, &unicast)) {
+                // arp_remove() frees the entry
+                struct netdev* dev = entry->dev;
+                arp_free_queue(dev, arp_remove(entry));
+            } else {
+                if (state == ARP_INCOMPLETE && entry->state == ARP_FAILED && entry->queue) {
+                    // The frames waited for nothing
+                    dropped_dev = entry->dev;
+                    entry->queue_tail->next = dropped;
+                    dropped = entry->queue;
+                    entry->queue = NULL;
+                    entry->queue_tail = NULL;
+                    entry->queued = 0;
+                }
+                if (request) {
+                    requests[request_count].dev = entry->dev;
+                    requests[request_count].ip = entry->ip;
+                    memcpy(requests[request_count].mac, entry->mac, 6);
+                    requests[request_count].unicast = unicast;
+                    request_count++;
+                }
+                uint64_t deadline = entry->state == ARP_REACHABLE ? entry->confirmed + ARP_REACHABLE_NS
+                                                                  : entry->deadline;
+                if (deadline && (!next || deadline < next)) next = deadline;
+            }
+            entry = following;
+        }
+    }
+    // Deadlines armed meanwhile went into arp_next_timer already
+    if (next && (!arp_next_timer || next < arp_next_timer)) arp_next_timer = next;
+    spinlock_release(&arp_lock);
+
+    arp_free_queue(dropped_dev, dropped);
+    for (uint32_t i = 0; i < request_count; i++) {
+        arp_request(requests[i].dev, requests[i].ip, requests[i].unicast ? requests[i].mac : NULL);
+    }
+}
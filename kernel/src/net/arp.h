@@ -0,0 +1,42 @@
+#ifndef ARP_H
+#define ARP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Neighbor cache for IPv4 over Ethernet. Entries are confirmed by replies,
+// go stale after ARP_REACHABLE_NS and are probed again when next used;
+// frames for an unresolved neighbor wait on it until the reply comes.
+#define ARP_HASH_BITS       6
+#define ARP_MAX_ENTRIES     512
+#define ARP_QUEUE_MAX       8                   // Frames held per unresolved neighbor
+#define ARP_MAX_PROBES      3
+#define ARP_RETRANS_NS      1000000000ULL       // Between requests
+#define ARP_REACHABLE_NS    30000000000ULL
+#define ARP_FAILED_NS       20000000000ULL      // Sends fail fast this long after
+#define ARP_GC_NS           120000000000ULL     // Unused stale entries go after this
+
+#define ARP_BROADCAST       0xFFFFFFFF          // Next hop for link broadcasts
+
+struct netdev;
+struct netdev_tx_offload;
+struct pkbuf;
+
+// Send an IPv4 packet to next_hop. frame is malloc'd with NETDEV_ETH_HLEN
+// bytes free at the front for the Ethernet header, and is taken over: sent,
+// queued until next_hop resolves, or freed. -1 if it was dropped.
+// ARP_BROADCAST goes to every station unresolved.
+int arp_output(struct netdev* dev, uint32_t next_hop, uint8_t* frame, uint32_t length,
+               const struct netdev_tx_offload* offload);
+// An ARP packet, Ethernet header stripped; takes the reference
+void arp_receive(struct netdev* dev, struct pkbuf* pb);
+// The cached hardware address, if the entry is usable
+bool arp_lookup(uint32_t ip, uint8_t mac[6]);
+// Announce our address so neighbors update their caches
+void arp_announce(struct netdev* dev, uint32_t ip);
+
+// Retransmit requests and age entries. Until there is a timer subsystem
+// the net worker and arp_output() drive this.
+void arp_timers_run(void);
+
+#endif // ARP_H
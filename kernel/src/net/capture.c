@@ -0,0 +1,505 @@
+#include <net/capture.h>
+#include <core/rcu.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <core/syscalls.h>
+#include <fs/vfs.h>
+#include <fs/file.h>
+#include <mm/pmm.h>
+#include <utils/mem.h>
+#include <utils/str.h>
+
+// Ring plus the filter it was started with; replaced only by start/stop
+struct capture {
+    struct net_capture_header* header;
+    void* phys;
+    size_t order;
+    uint64_t tail;              // The reader's next claim number
+    uint64_t lost;
+    uint32_t filter_length;
+    struct net_capture_insn filter[NET_CAPTURE_MAX_FILTER];
+};
+
+static struct capture* capture = NULL;
+static spinlock_t capture_lock = SPINLOCK_INIT;     // Start, stop and the reader
+
+#define CAPTURE_RING_MAX_ORDER PMM_MAX_ORDER
+#define CAPTURE_DEFAULT_SLOTS  1024   // For a "start" written to the control file
+
+// Classic BPF fields
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_SIZE(code)  ((code) & 0x18)
+#define BPF_MODE(code)  ((code) & 0xE0)
+#define BPF_OP(code)    ((code) & 0xF0)
+#define BPF_SRC(code)   ((code) & 0x08)
+#define BPF_RVAL(code)  ((code) & 0x18)
+
+#define BPF_LD   0x00
+#define BPF_LDX  0x01
+#define BPF_ST   0x02
+#define BPF_STX  0x03
+#define BPF_ALU  0x04
+#define BPF_JMP  0x05
+#define BPF_RET  0x06
+#define BPF_MISC 0x07
+
+#define BPF_W    0x00
+#define BPF_H    0x08
+#define BPF_B    0x10
+
+#define BPF_IMM  0x00
+#define BPF_ABS  0x20
+#define BPF_IND  0x40
+#define BPF_MEM  0x60
+#define BPF_LEN  0x80
+#define BPF_MSH  0xA0
+
+#define BPF_ADD  0x00
+#define BPF_SUB  0x10
+#define BPF_MUL  0x20
+#define BPF_DIV  0x30
+#define BPF_OR   0x40
+#define BPF_AND  0x50
+#define BPF_LSH  0x60
+#define BPF_RSH  0x70
+#define BPF_NEG  0x80
+#define BPF_MOD  0x90
+#define BPF_XOR  0xA0
+
+#define BPF_JA   0x00
+#define BPF_JEQ  0x10
+#define BPF_JGT  0x20
+#define BPF_JGE  0x30
+#define BPF_JSET 0x40
+
+#define BPF_K    0x00
+#define BPF_X    0x08
+#define BPF_A    0x10
+
+#define BPF_TAX  0x00
+#define BPF_TXA  0x80
+
+#define BPF_MEMWORDS 16
+
+bool net_capture_filter_check(const struct net_capture_insn* filter, uint32_t count) {
+    if (!filter || !count || count > NET_CAPTURE_MAX_FILTER) return false;
+
+    for (uint32_t pc = 0; pc < count; pc++) {
+        const struct net_capture_insn* insn = &filter[pc];
+        uint16_t code = insn->code;
+        switch (BPF_CLASS(code)) {
+            case BPF_LD:
+                if (BPF_MODE(code) == BPF_ABS || BPF_MODE(code) == BPF_IND) {
+                    if (BPF_SIZE(code) == 0x18) return false;
+                } else if (BPF_MODE(code) == BPF_MEM) {
+                    if (insn->k >= BPF_MEMWORDS) return false;
+                } else if (BPF_MODE(code) != BPF_IMM && BPF_MODE(code) != BPF_LEN) {
+                    return false;
+                }
+                break;
+            case BPF_LDX:
+                if (BPF_MODE(code) == BPF_MSH) {
+                    if (BPF_SIZE(code) != BPF_B) return false;
+                } else if (BPF_MODE(code) == BPF_MEM) {
+                    if (insn->k >= BPF_MEMWORDS) return false;
+                } else if (BPF_MODE(code) != BPF_IMM && BPF_MODE(code) != BPF_LEN) {
+                    return false;
+                }
+                break;
+            case BPF_ST:
+            case BPF_STX:
+                if (insn->k >= BPF_MEMWORDS) return false;
+                break;
+            case BPF_ALU:
+                if (BPF_OP(code) > BPF_XOR) return false;
+                if ((BPF_OP(code) == BPF_DIV || BPF_OP(code) == BPF_MOD) && BPF_SRC(code) == BPF_K && !insn->k) {
+                    return false;
+                }
+                break;
+            case BPF_JMP:
+                // Only forward, and never off the end
+                if (BPF_OP(code) == BPF_JA) {
+                    if (insn->k >= count - pc - 1) return false;
+                } else if (BPF_OP(code) > BPF_JSET || insn->jt >= count - pc - 1 || insn->jf >= count - pc - 1) {
+                    return false;
+                }
+                break;
+            case BPF_RET:
+                if (BPF_RVAL(code) == 0x18) return false;
+                break;
+            case BPF_MISC:
+                if ((code & 0xF8) != BPF_TAX && (code & 0xF8) != BPF_TXA) return false;
+                break;
+        }
+    }
+    return BPF_CLASS(filter[count - 1].code) == BPF_RET;
+}
+
+// A packet load, false past the end
+static bool bpf_load(const uint8_t* packet, uint32_t length, uint32_t offset, uint16_t size, uint32_t* value) {
+    uint32_t bytes = size == BPF_W ? 4 : size == BPF_H ? 2 : 1;
+    if (offset > length || bytes > length - offset) return false;
+    const uint8_t* p = packet + offset;
+    if (bytes == 4) *value = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    else if (bytes == 2) *value = (uint32_t)p[0] << 8 | p[1];
+    else *value = p[0];
+    return true;
+}
+
+uint32_t net_capture_filter_run(const struct net_capture_insn* filter, const uint8_t* packet, uint32_t length) {
+    uint32_t a = 0, x = 0;
+    uint32_t mem[BPF_MEMWORDS] = { 0 };
+
+    for (uint32_t pc = 0;; pc++) {
+        const struct net_capture_insn* insn = &filter[pc];
+        uint16_t code = insn->code;
+        uint32_t k = insn->k;
+        switch (BPF_CLASS(code)) {
+            case BPF_LD:
+                switch (BPF_MODE(code)) {
+                    case BPF_IMM: a = k; break;
+                    case BPF_LEN: a = length; break;
+                    case BPF_MEM: a = mem[k]; break;
+                    case BPF_ABS:
+                        if (!bpf_load(packet, length, k, BPF_SIZE(code), &a)) return 0;
+                        break;
+                    case BPF_IND:
+                        if (!bpf_load(packet, length, x + k, BPF_SIZE(code), &a)) return 0;
+                        break;
+                }
+                break;
+            case BPF_LDX:
+                switch (BPF_MODE(code)) {
+                    case BPF_IMM: x = k; break;
+                    case BPF_LEN: x = length; break;
+                    case BPF_MEM: x = mem[k]; break;
+                    case BPF_MSH: {
+                        // The IPv4 header length at k
+                        uint32_t byte;
+                        if (!bpf_load(packet, length, k, BPF_B, &byte)) return 0;
+                        x = (byte & 0x0F) * 4;
+                        break;
+                    }
+                    default: return 0;
+                }
+                break;
+            case BPF_ST: mem[k] = a; break;
+            case BPF_STX: mem[k] = x; break;
+            case BPF_ALU: {
+                uint32_t operand = BPF_SRC(code) == BPF_X ? x : k;
+                switch (BPF_OP(code)) {
+                    case BPF_ADD: a += operand; break;
+                    case BPF_SUB: a -= operand; break;
+                    case BPF_MUL: a *= operand; break;
+                    case BPF_DIV:
+                        if (!operand) return 0;
+                        a /= operand;
+                        break;
+                    case BPF_MOD:
+                        if (!operand) return 0;
+                        a %= operand;
+                        break;
+                    case BPF_OR: a |= operand; break;
+                    case BPF_AND: a &= operand; break;
+                    case BPF_LSH: a = operand < 32 ? a << operand : 0; break;
+                    case BPF_RSH: a = operand < 32 ? a >> operand : 0; break;
+                    case BPF_NEG: a = -a; break;
+                    case BPF_XOR: a ^= operand; break;
+                }
+                break;
+            }
+            case BPF_JMP: {
+                uint32_t operand = BPF_SRC(code) == BPF_X ? x : k;
+                bool taken;
+                switch (BPF_OP(code)) {
+                    case BPF_JA: pc += k; continue;
+                    case BPF_JEQ: taken = a == operand; break;
+                    case BPF_JGT: taken = a > operand; break;
+                    case BPF_JGE: taken = a >= operand; break;
+                    default: taken = (a & operand) != 0; break;
+                }
+                pc += taken ? insn->jt : insn->jf;
+                break;
+            }
+            case BPF_RET:
+                return BPF_RVAL(code) == BPF_A ? a : BPF_RVAL(code) == BPF_X ? x : k;
+            case BPF_MISC:
+                if ((code & 0xF8) == BPF_TAX) x = a;
+                else a = x;
+                break;
+        }
+    }
+}
+
+static inline struct net_capture_record* capture_slot(const struct net_capture_header* header, uint64_t n) {
+    return (struct net_capture_record*)((uint8_t*)header + header->data_offset +
+                                       (size_t)(n & (header->slots - 1)) * header->slot_size);
+}
+
+int net_capture_start(uint32_t slots, uint32_t snaplen, const struct net_capture_insn* filter,
+                      uint32_t filter_length) {
+    if (!slots || slots > NET_CAPTURE_MAX_SLOTS || !snaplen) return -1;
+    if (filter && !net_capture_filter_check(filter, filter_length)) return -1;
+    if (snaplen > NET_CAPTURE_MAX_SNAPLEN) snaplen = NET_CAPTURE_MAX_SNAPLEN;
+
+    // Slots are cache-line multiples and a power of two of them, as many as
+    // fit the largest block the page allocator has
+    uint32_t slot_size = (uint32_t)((sizeof(struct net_capture_record) + snaplen + 63) & ~63UL);
+    uint32_t count = 1;
+    while (count < slots) count <<= 1;
+    while (count > 1 && PAGE_SIZE + (size_t)count * slot_size > (size_t)PAGE_SIZE << CAPTURE_RING_MAX_ORDER) {
+        count >>= 1;
+    }
+    size_t bytes = PAGE_SIZE + (size_t)count * slot_size;
+    size_t order = pmm_order_for_pages((bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+
+    struct capture* state = malloc(sizeof(struct capture));
+    if (!state) return -1;
+    memset(state, 0, sizeof(struct capture));
+    state->phys = pmm_alloc_pages(order);
+    if (!state->phys) {
+        free(state);
+        return -1;
+    }
+    state->order = order;
+    state->header = pmm_phys_to_virt(state->phys);
+    memset(state->header, 0, (size_t)PAGE_SIZE << order);
+    state->header->slots = count;
+    state->header->slot_size = slot_size;
+    state->header->snaplen = snaplen;
+    state->header->data_offset = PAGE_SIZE;
+    if (filter) {
+        memcpy(state->filter, filter, filter_length * sizeof(struct net_capture_insn));
+        state->filter_length = filter_length;
+    }
+
+    spinlock_acquire(&capture_lock);
+    if (capture) {
+        spinlock_release(&capture_lock);
+        pmm_free_pages(state->phys, order);
+        free(state);
+        return -1;
+    }
+    rcu_assign_pointer(capture, state);
+    spinlock_release(&capture_lock);
+    return 0;
+}
+
+void net_capture_stop(void) {
+    spinlock_acquire(&capture_lock);
+    struct capture* state = capture;
+    rcu_assign_pointer(capture, NULL);
+    spinlock_release(&capture_lock);
+    if (!state) return;
+
+    // Producers write into the ring inside read sections
+    synchronize_rcu();
+    pmm_free_pages(state->phys, state->order);
+    free(state);
+}
+
+bool net_capture_active(void) {
+    return __atomic_load_n(&capture, __ATOMIC_RELAXED) != NULL;
+}
+
+void net_capture_packet(const char* device, uint8_t direction, const void* frame, uint32_t length) {
+    if (!__atomic_load_n(&capture, __ATOMIC_RELAXED) || !frame) return;
+
+    uint64_t flags = rcu_read_lock();
+    struct capture* state = rcu_dereference(capture);
+    if (!state) {
+        rcu_read_unlock(flags);
+        return;
+    }
+
+    struct net_capture_header* header = state->header;
+    uint32_t keep = state->filter_length ? net_capture_filter_run(state->filter, frame, length) : length;
+    if (!keep) {
+        __atomic_fetch_add(&header->filtered, 1, __ATOMIC_RELAXED);
+        rcu_read_unlock(flags);
+        return;
+    }
+    if (keep > length) keep = length;
+    if (keep > header->snaplen) keep = header->snaplen;
+
+    // Claim a slot, mark it in progress, fill it, then publish it
+    uint64_t n = __atomic_fetch_add(&header->head, 1, __ATOMIC_RELAXED);
+    struct net_capture_record* record = capture_slot(header, n);
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->timestamp_ns = ktime_get_ns();
+    record->length = length;
+    record->captured = (uint16_t)keep;
+    record->direction = direction;
+    memset(record->device, 0, sizeof(record->device));
+    for (int i = 0; device && device[i] && i < (int)sizeof(record->device) - 1; i++) record->device[i] = device[i];
+    memcpy(record->data, frame, keep);
+    __atomic_store_n(&record->sequence, n + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&header->matched, 1, __ATOMIC_RELAXED);
+    rcu_read_unlock(flags);
+}
+
+int net_capture_read(struct net_capture_record* out, uint32_t capacity) {
+    if (!out) return -1;
+
+    spinlock_acquire(&capture_lock);
+    struct capture* state = capture;
+    if (!state) {
+        spinlock_release(&capture_lock);
+        return -1;
+    }
+
+    struct net_capture_header* header = state->header;
+    int result = 0;
+    for (;;) {
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        if (state->tail >= head) break;
+
+        // Fell a lap behind: skip to the oldest slot still intact
+        if (head - state->tail > header->slots) {
+            state->lost += head - header->slots - state->tail;
+            state->tail = head - header->slots;
+        }
+
+        struct net_capture_record* record = capture_slot(header, state->tail);
+        uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        if (sequence != state->tail + 1) {
+            if (sequence < state->tail + 1) break;      // Claimed, still being written
+            state->lost++;                              // Already reused
+            state->tail++;
+            continue;
+        }
+
+        uint32_t size = sizeof(struct net_capture_record) + record->captured;
+        if (size > capacity) {
+            result = -1;
+            break;
+        }
+        memcpy(out, record, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        state->tail++;
+        if (__atomic_load_n(&record->sequence, __ATOMIC_RELAXED) != sequence) {
+            state->lost++;                              // Overwritten as it was copied
+            continue;
+        }
+        result = (int)size;
+        break;
+    }
+    spinlock_release(&capture_lock);
+    return result;
+}
+
+void net_capture_stats(uint64_t* matched, uint64_t* filtered, uint64_t* lost) {
+    spinlock_acquire(&capture_lock);
+    struct capture* state = capture;
+    if (matched) *matched = state ? __atomic_load_n(&state->header->matched, __ATOMIC_RELAXED) : 0;
+    if (filtered) *filtered = state ? __atomic_load_n(&state->header->filtered, __ATOMIC_RELAXED) : 0;
+    if (lost) *lost = state ? state->lost : 0;
+    spinlock_release(&capture_lock);
+}
+
+const struct net_capture_header* net_capture_ring(uint32_t* pages) {
+    spinlock_acquire(&capture_lock);
+    struct capture* state = capture;
+    if (pages) *pages = state ? 1U << state->order : 0;
+    spinlock_release(&capture_lock);
+    return state ? state->header : NULL;
+}
+
+// Records while the caller has room for a whole slot; those already
+// copied are returned if the next one cannot be
+static ssize_t capture_readv(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    (void)file; (void)offset;
+    size_t room = 0;
+    for (int i = 0; i < iovcnt; i++) room += iov[i].iov_len;
+
+    const struct net_capture_header* header = net_capture_ring(NULL);
+    if (!header) return -EINVAL;
+    uint32_t slot_size = header->slot_size;
+    if (room < slot_size) return -EINVAL;
+    struct net_capture_record* record = malloc(slot_size);
+    if (!record) return -ENOMEM;
+
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    size_t total = 0;
+    while (room - total >= slot_size) {
+        int size = net_capture_read(record, slot_size);
+        if (size <= 0) break;
+        total += iov_copy_to_iter(&iter, record, (size_t)size);
+    }
+    free(record);
+    return (ssize_t)total;
+}
+
+// A decimal number after *p, left at 0 if there is none; false on junk
+static bool capture_parse(const char** p, uint32_t* value) {
+    while (**p == ' ') (*p)++;
+    for (; **p && **p != ' '; (*p)++) {
+        if (**p < '0' || **p > '9') return false;
+        *value = *value * 10 + (uint32_t)(**p - '0');
+    }
+    return true;
+}
+
+static ssize_t capture_writev(struct file* file, const struct iovec* iov, int iovcnt, uint64_t offset) {
+    (void)file; (void)offset;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    char command[48];
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, iovcnt);
+    size_t len = iov_copy_from_iter(&iter, command, sizeof(command) - 1);
+    while (len && (command[len - 1] == '\n' || command[len - 1] == ' ')) len--;
+    command[len] = '\0';
+
+    if (memcmp(command, "start", 5) == 0 && (command[5] == '\0' || command[5] == ' ')) {
+        uint32_t slots = 0, snaplen = 0;
+        const char* p = command + 5;
+        if (!capture_parse(&p, &slots) || !capture_parse(&p, &snaplen) || *p) return -EINVAL;
+        if (net_capture_start(slots ? slots : CAPTURE_DEFAULT_SLOTS, snaplen ? snaplen : NET_CAPTURE_MAX_SNAPLEN, NULL, 0) < 0) {
+            return -EBUSY;
+        }
+    } else if (strcmp(command, "stop") == 0) {
+        net_capture_stop();
+    } else {
+        return -EINVAL;
+    }
+    return (ssize_t)total;
+}
+
+static uint64_t capture_size(struct file* file) {
+    (void)file;
+    return 0;
+}
+
+static const struct file_ops capture_file_ops = {
+    .readv = capture_readv,
+    .writev = capture_writev,
+    .size = capture_size,
+};
+
+static int capture_open(void* data, const char* path, int flags, mode_t mode, struct file* file) {
+    (void)data; (void)mode; (void)flags;
+    if (*path) return -ENOENT;
+
+    file->inode = 0;
+    file->private_data = NULL;
+    file->ops = &capture_file_ops;
+    return 0;
+}
+
+static int capture_unlink(void* data, const char* path) {
+    (void)data; (void)path;
+    return -EACCES;
+}
+
+static const struct vfs_ops capture_vfs_ops = {
+    .open = capture_open,
+    .unlink = capture_unlink,
+};
+
+bool net_capture_mount(const char* path) {
+    return vfs_mount(path, &capture_vfs_ops, NULL);
+}
@@ -0,0 +1,82 @@
+#ifndef NET_CAPTURE_H
+#define NET_CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Packet capture into a ring that producers fill without locks and without
+// waiting for the reader; a slow reader loses the oldest records instead.
+// The ring is page-aligned and self-describing (a header page, then
+// fixed-size slots), so it can be mapped read-only as is.
+
+#define NET_CAPTURE_RX 0
+#define NET_CAPTURE_TX 1
+
+#define NET_CAPTURE_MAX_SLOTS    65536
+#define NET_CAPTURE_MAX_SNAPLEN  2048
+#define NET_CAPTURE_MAX_FILTER   64      // Instructions
+
+// Classic BPF, as struct sock_filter, so existing compilers' output
+// (tcpdump -dd) loads unchanged. Supported: LD/LDX of immediates, lengths
+// and packet bytes (ABS, IND, MSH), scratch memory, ALU, JMP and RET.
+struct net_capture_insn {
+    uint16_t code;
+    uint8_t jt;
+    uint8_t jf;
+    uint32_t k;
+};
+
+// First page of the ring
+struct net_capture_header {
+    uint32_t slots;             // A power of two
+    uint32_t slot_size;         // Bytes, including struct net_capture_record
+    uint32_t snaplen;
+    uint32_t data_offset;       // Where slot 0 starts
+    uint64_t head;              // Records ever claimed; slot is head % slots
+    uint64_t matched;           // Passed the filter
+    uint64_t filtered;          // Rejected by it
+};
+
+// A slot is valid once sequence is its claim number plus one; the reader
+// copies it out and checks the sequence again to catch an overwrite
+struct net_capture_record {
+    uint64_t sequence;
+    uint64_t timestamp_ns;
+    uint32_t length;            // On the wire
+    uint16_t captured;          // Bytes in data
+    uint8_t direction;          // NET_CAPTURE_RX or NET_CAPTURE_TX
+    uint8_t reserved;
+    char device[16];
+    uint8_t data[];
+};
+
+// Start capturing with a ring of slots records of up to snaplen bytes;
+// filter may be NULL to take everything. -1 if one is already running or
+// the filter does not validate.
+int net_capture_start(uint32_t slots, uint32_t snaplen, const struct net_capture_insn* filter,
+                      uint32_t filter_length);
+void net_capture_stop(void);
+bool net_capture_active(void);
+
+// Producers: from the driver edge, any CPU, any context
+void net_capture_packet(const char* device, uint8_t direction, const void* frame, uint32_t length);
+
+// The next record into out, which should hold header.slot_size; its size,
+// 0 if there is none yet, -1 if capture is off. Records overwritten before
+// they could be read are counted in lost.
+int net_capture_read(struct net_capture_record* out, uint32_t capacity);
+void net_capture_stats(uint64_t* matched, uint64_t* filtered, uint64_t* lost);
+
+// The ring itself, for mapping; NULL when capture is off
+const struct net_capture_header* net_capture_ring(uint32_t* pages);
+
+// Control file at path: "start [slots [snaplen]]" or "stop" written to it,
+// without a filter; reads return whole records back to back, as
+// net_capture_read() gives them, and need room for one slot
+bool net_capture_mount(const char* path);
+
+// Run a validated filter; the bytes to keep, 0 to skip the packet
+uint32_t net_capture_filter_run(const struct net_capture_insn* filter, const uint8_t* packet, uint32_t length);
+bool net_capture_filter_check(const struct net_capture_insn* filter, uint32_t count);
+
+#endif // NET_CAPTURE_H
@@ -0,0 +1,52 @@
+#include <net/checksum.h>
+
+// The kernel is built without SSE, and the FPU registers belong to
+// whichever process last used them, so the sum stays in general-purpose
+// registers: eight bytes per add, the carries caught by a 128-bit
+// accumulator that compiles down to add/adc pairs.
+
+typedef uint64_t __attribute__((aligned(1), may_alias)) unaligned_u64;
+typedef uint32_t __attribute__((aligned(1), may_alias)) unaligned_u32;
+typedef uint16_t __attribute__((aligned(1), may_alias)) unaligned_u16;
+
+static inline uint32_t fold64(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    return (uint32_t)sum;
+}
+
+uint32_t csum_partial(const void* data, size_t len, uint32_t sum) {
+    const uint8_t* p = data;
+    unsigned __int128 acc = sum;
+
+    for (; len >= 32; p += 32, len -= 32) {
+        acc += *(const unaligned_u64*)p;
+        acc += *(const unaligned_u64*)(p + 8);
+        acc += *(const unaligned_u64*)(p + 16);
+        acc += *(const unaligned_u64*)(p + 24);
+    }
+    for (; len >= 8; p += 8, len -= 8) acc += *(const unaligned_u64*)p;
+
+    uint64_t tail = 0;
+    if (len & 4) {
+        tail += *(const unaligned_u32*)p;
+        p += 4;
+    }
+    if (len & 2) {
+        tail += *(const unaligned_u16*)p;
+        p += 2;
+    }
+    if (len & 1) tail += *p;    // The low byte of its word, little-endian
+    acc += tail;
+
+    uint64_t lo = (uint64_t)acc, hi = (uint64_t)(acc >> 64);
+    lo += hi;
+    lo += lo < hi;
+    return fold64(lo);
+}
+
+uint32_t csum_pseudo(uint32_t saddr, uint32_t daddr, uint16_t len, uint8_t proto, uint32_t sum) {
+    // Zero and proto, then the length, as big-endian words in memory
+    uint64_t acc = (uint64_t)sum + saddr + daddr + ((uint32_t)proto << 8) + __builtin_bswap16(len);
+    return fold64(acc);
+}
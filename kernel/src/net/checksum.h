@@ -0,0 +1,42 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Internet checksum (RFC 1071). Partial sums are 32-bit and taken over
+// memory in native order, so a folded result is stored as is.
+
+// Add len bytes at data to sum; any alignment and length
+uint32_t csum_partial(const void* data, size_t len, uint32_t sum);
+// Seed for a TCP or UDP checksum. Addresses as they sit in the IP header,
+// len the transport length in host order.
+uint32_t csum_pseudo(uint32_t saddr, uint32_t daddr, uint16_t len, uint8_t proto, uint32_t sum);
+
+static inline uint32_t csum_add(uint32_t sum, uint32_t addend) {
+    sum += addend;
+    return sum + (sum < addend);
+}
+
+// Down to 16 bits and complemented, ready for the header; 0 when checking
+// a sum that covered a correct checksum field
+static inline uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// Patch a checksum for one rewritten field without summing the rest (RFC 1624)
+static inline void csum_replace2(uint16_t* check, uint16_t from, uint16_t to) {
+    uint32_t sum = csum_add((uint16_t)~*check, (uint16_t)~from);
+    *check = csum_fold(csum_add(sum, to));
+}
+
+static inline void csum_replace4(uint16_t* check, uint32_t from, uint32_t to) {
+    uint32_t sum = csum_add((uint16_t)~*check, ~from & 0xFFFF);
+    sum = csum_add(sum, ~from >> 16);
+    sum = csum_add(sum, to & 0xFFFF);
+    *check = csum_fold(csum_add(sum, to >> 16));
+}
+
+#endif // CHECKSUM_H
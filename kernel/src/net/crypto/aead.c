@@ -0,0 +1,101 @@
+#include <net/crypto/aead.h>
+#include <core/fpu.h>
+#include <utils/mem.h>
+
+#define CPUID1_ECX_PCLMULQDQ    (1U << 1)
+#define CPUID1_ECX_SSSE3        (1U << 9)
+#define CPUID1_ECX_AES          (1U << 25)
+
+// -1 until the CPU has been asked
+static volatile int gcm_accelerated = -1;
+
+static bool gcm_use_aesni(void) {
+    if (gcm_accelerated < 0) {
+        uint32_t eax, ebx, ecx, edx;
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+        uint32_t needed = CPUID1_ECX_PCLMULQDQ | CPUID1_ECX_SSSE3 | CPUID1_ECX_AES;
+        gcm_accelerated = (ecx & needed) == needed && kernel_fpu_usable();
+    }
+    return gcm_accelerated;
+}
+
+uint32_t aead_key_length(uint32_t algorithm) {
+    switch (algorithm) {
+        case AEAD_AES_128_GCM: return 16;
+        case AEAD_AES_256_GCM: return 32;
+        case AEAD_CHACHA20_POLY1305: return 32;
+        default: return 0;
+    }
+}
+
+bool aead_init(struct aead_ctx* ctx, uint32_t algorithm, const uint8_t* key, uint32_t key_length) {
+    if (!ctx || !key || !key_length || key_length != aead_key_length(algorithm)) return false;
+
+    memset(ctx, 0, sizeof(struct aead_ctx));
+    ctx->algorithm = algorithm;
+    if (algorithm == AEAD_CHACHA20_POLY1305) {
+        memcpy(ctx->key, key, key_length);
+    } else {
+        gcm_init(ctx, key, key_length);
+    }
+    return true;
+}
+
+void aead_clear(struct aead_ctx* ctx) {
+    if (ctx) memset(ctx, 0, sizeof(struct aead_ctx));
+}
+
+void aead_seal(const struct aead_ctx* ctx, const uint8_t nonce[AEAD_NONCE_SIZE],
+               const uint8_t* aad, size_t aad_length, uint8_t* data, size_t length,
+               uint8_t tag[AEAD_TAG_SIZE]) {
+    if (ctx->algorithm == AEAD_CHACHA20_POLY1305) {
+        chacha20_xor(ctx->key, nonce, 1, data, length);
+        chacha20_poly1305_tag(ctx, nonce, aad, aad_length, data, length, tag);
+        return;
+    }
+
+    bool accelerated = gcm_use_aesni();
+    uint64_t flags = accelerated ? kernel_fpu_begin() : 0;
+    gcm_ctr(ctx, nonce, data, length, accelerated);
+    gcm_tag(ctx, nonce, aad, aad_length, data, length, tag, accelerated);
+    if (accelerated) kernel_fpu_end(flags);
+}
+
+bool aead_open(const struct aead_ctx* ctx, const uint8_t nonce[AEAD_NONCE_SIZE],
+               const uint8_t* aad, size_t aad_length, uint8_t* data, size_t length,
+               const uint8_t tag[AEAD_TAG_SIZE]) {
+    uint8_t expected[AEAD_TAG_SIZE];
+    bool accelerated = false;
+    uint64_t flags = 0;
+
+    if (ctx->algorithm == AEAD_CHACHA20_POLY1305) {
+        chacha20_poly1305_tag(ctx, nonce, aad, aad_length, data, length, expected);
+    } else {
+        accelerated = gcm_use_aesni();
+        if (accelerated) flags = kernel_fpu_begin();
+        gcm_tag(ctx, nonce, aad, aad_length, data, length, expected, accelerated);
+    }
+
+    // In constant time, so the comparison says nothing about the tag
+    uint8_t diff = 0;
+    for (int i = 0; i < AEAD_TAG_SIZE; i++) diff |= expected[i] ^ tag[i];
+
+    if (!diff) {
+        if (ctx->algorithm == AEAD_CHACHA20_POLY1305) chacha20_xor(ctx->key, nonce, 1, data, length);
+        else gcm_ctr(ctx, nonce, data, length, accelerated);
+    }
+    if (accelerated) kernel_fpu_end(flags);
+    return !diff;
+}
+
+const char* aead_implementation(uint32_t algorithm) {
+    switch (algorithm) {
+        case AEAD_AES_128_GCM:
+        case AEAD_AES_256_GCM:
+            return gcm_use_aesni() ? "aesni-pclmul" : "generic";
+        case AEAD_CHACHA20_POLY1305:
+            return "generic";
+        default:
+            return "none";
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef AEAD_H
+#define AEAD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Authenticated encryption for the TLS record layer. AES-GCM runs on
+// AES-NI and PCLMULQDQ where the CPU has them, and on portable code
+// otherwise; ChaCha20-Poly1305 is portable. Data is sealed and opened in
+// place.
+#define AEAD_AES_128_GCM        1
+#define AEAD_AES_256_GCM        2
+#define AEAD_CHACHA20_POLY1305  3
+
+#define AEAD_TAG_SIZE           16
+#define AEAD_NONCE_SIZE         12
+#define AEAD_MAX_KEY            32
+
+struct aead_ctx {
+    uint32_t algorithm;
+    uint32_t rounds;                // AES: 10 or 14
+    uint8_t round_keys[240];        // AES encryption schedule, as AES-NI loads it
+    uint8_t h[16];                  // GHASH key E(K, 0)
+    uint64_t hl[16];                // GHASH 4-bit tables for the portable path
+    uint64_t hh[16];
+    uint8_t key[AEAD_MAX_KEY];      // ChaCha20
+};
+
+bool aead_init(struct aead_ctx* ctx, uint32_t algorithm, const uint8_t* key, uint32_t key_length);
+void aead_clear(struct aead_ctx* ctx);
+uint32_t aead_key_length(uint32_t algorithm);
+
+// Encrypt data in place and produce its tag over aad and the ciphertext
+void aead_seal(const struct aead_ctx* ctx, const uint8_t nonce[AEAD_NONCE_SIZE],
+               const uint8_t* aad, size_t aad_length, uint8_t* data, size_t length,
+               uint8_t tag[AEAD_TAG_SIZE]);
+// Check the tag, then decrypt in place; data is untouched if it fails
+bool aead_open(const struct aead_ctx* ctx, const uint8_t nonce[AEAD_NONCE_SIZE],
+               const uint8_t* aad, size_t aad_length, uint8_t* data, size_t length,
+               const uint8_t tag[AEAD_TAG_SIZE]);
+
+// Which implementation aead_seal() uses for the algorithm
+const char* aead_implementation(uint32_t algorithm);
+
+// Per-algorithm back ends, for aead.c. Sealing encrypts then tags the
+// ciphertext; opening tags it first and decrypts only if that matches.
+void gcm_init(struct aead_ctx* ctx, const uint8_t* key, uint32_t key_length);
+void gcm_ctr(const struct aead_ctx* ctx, const uint8_t nonce[AEAD_NONCE_SIZE], uint8_t* data, size_t length,
+             bool accelerated);
+void gcm_tag(const struct aead_ctx* ctx, const uint8_t nonce[AEAD_NONCE_SIZE], const uint8_t* aad,
+             size_t aad_length, const uint8_t* data, size_t length, uint8_t tag[AEAD_TAG_SIZE],
+             bool accelerated);
+void chacha20_xor(const uint8_t key[32], const uint8_t nonce[AEAD_NONCE_SIZE], uint32_t counter,
+                  uint8_t* data, size_t length);
+void chacha20_poly1305_tag(const struct aead_ctx* ctx, const uint8_t nonce[AEAD_NONCE_SIZE],
+                           const uint8_t* aad, size_t aad_length, const uint8_t* data, size_t length,
+                           uint8_t tag[AEAD_TAG_SIZE]);
+
+#endif // AEAD_H
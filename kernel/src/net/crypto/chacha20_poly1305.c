@@ -0,0 +1,209 @@
+#include <net/crypto/aead.h>
+#include <utils/mem.h>
+
+// ChaCha20 and Poly1305 as RFC 8439 combines them
+
+static inline uint32_t load_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store_le32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint64_t load_le64(const uint8_t* p) {
+    return (uint64_t)load_le32(p) | (uint64_t)load_le32(p + 4) << 32;
+}
+
+static inline void store_le64(uint8_t* p, uint64_t v) {
+    store_le32(p, (uint32_t)v);
+    store_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint32_t rotl32(uint32_t x, int n) {
+    return x << n | x >> (32 - n);
+}
+
+#define QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = rotl32(d, 16); \
+    c += d; b ^= c; b = rotl32(b, 12); \
+    a += b; d ^= a; d = rotl32(d, 8); \
+    c += d; b ^= c; b = rotl32(b, 7)
+
+static void chacha20_block(const uint32_t input[16], uint8_t out[64]) {
+    uint32_t x[16];
+    memcpy(x, input, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) store_le32(out + 4 * i, x[i] + input[i]);
+    memset(x, 0, sizeof(x));
+}
+
+void chacha20_xor(const uint8_t key[32], const uint8_t nonce[AEAD_NONCE_SIZE], uint32_t counter,
+                  uint8_t* data, size_t length) {
+    uint32_t state[16] = { 0x61707865, 0x3320646E, 0x79622D32, 0x6B206574 };
+    for (int i = 0; i < 8; i++) state[4 + i] = load_le32(key + 4 * i);
+    state[12] = counter;
+    for (int i = 0; i < 3; i++) state[13 + i] = load_le32(nonce + 4 * i);
+
+    uint8_t stream[64];
+    while (length) {
+        chacha20_block(state, stream);
+        state[12]++;
+        size_t chunk = length < 64 ? length : 64;
+        for (size_t i = 0; i < chunk; i++) data[i] ^= stream[i];
+        data += chunk;
+        length -= chunk;
+    }
+    memset(stream, 0, sizeof(stream));
+    memset(state, 0, sizeof(state));
+}
+
+// Poly1305 in three 44/44/42-bit limbs, products in 128 bits
+struct poly1305 {
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+};
+
+#define MASK44 0xFFFFFFFFFFFULL
+#define MASK42 0x3FFFFFFFFFFULL
+
+static void poly1305_init(struct poly1305* st, const uint8_t key[32]) {
+    uint64_t t0 = load_le64(key);
+    uint64_t t1 = load_le64(key + 8);
+    // r is clamped as the RFC requires
+    st->r[0] = t0 & 0xFFC0FFFFFFFULL;
+    st->r[1] = (t0 >> 44 | t1 << 20) & 0xFFFFFC0FFFFULL;
+    st->r[2] = (t1 >> 24) & 0x00FFFFFFC0FULL;
+    st->h[0] = st->h[1] = st->h[2] = 0;
+    st->pad[0] = load_le64(key + 16);
+    st->pad[1] = load_le64(key + 24);
+}
+
+// Whole 16-byte blocks; the AEAD pads everything to them
+static void poly1305_blocks(struct poly1305* st, const uint8_t* m, size_t blocks) {
+    uint64_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2];
+    uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+
+    while (blocks--) {
+        uint64_t t0 = load_le64(m);
+        uint64_t t1 = load_le64(m + 8);
+        h0 += t0 & MASK44;
+        h1 += (t0 >> 44 | t1 << 20) & MASK44;
+        h2 += ((t1 >> 24) & MASK42) | (1ULL << 40);
+
+        unsigned __int128 d0 = (unsigned __int128)h0 * r0 + (unsigned __int128)h1 * s2 + (unsigned __int128)h2 * s1;
+        unsigned __int128 d1 = (unsigned __int128)h0 * r1 + (unsigned __int128)h1 * r0 + (unsigned __int128)h2 * s2;
+        unsigned __int128 d2 = (unsigned __int128)h0 * r2 + (unsigned __int128)h1 * r1 + (unsigned __int128)h2 * r0;
+
+        uint64_t c = (uint64_t)(d0 >> 44);
+        h0 = (uint64_t)d0 & MASK44;
+        d1 += c;
+        c = (uint64_t)(d1 >> 44);
+        h1 = (uint64_t)d1 & MASK44;
+        d2 += c;
+        c = (uint64_t)(d2 >> 42);
+        h2 = (uint64_t)d2 & MASK42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= MASK44;
+        h1 += c;
+        m += 16;
+    }
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+}
+
+static void poly1305_update_padded(struct poly1305* st, const uint8_t* m, size_t length) {
+    poly1305_blocks(st, m, length / 16);
+    if (length % 16) {
+        uint8_t block[16] = { 0 };
+        memcpy(block, m + length / 16 * 16, length % 16);
+        poly1305_blocks(st, block, 1);
+    }
+}
+
+static void poly1305_finish(struct poly1305* st, uint8_t tag[16]) {
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+
+    // Carry fully
+    uint64_t c = h1 >> 44;
+    h1 &= MASK44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= MASK42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= MASK44;
+    h1 += c;
+    c = h1 >> 44;
+    h1 &= MASK44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= MASK42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= MASK44;
+    h1 += c;
+
+    // h - p, kept if it did not go negative, without branching
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44;
+    g0 &= MASK44;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44;
+    g1 &= MASK44;
+    uint64_t g2 = h2 + c - (1ULL << 42);
+    uint64_t mask = (g2 >> 63) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+
+    // Plus the pad, modulo 2^128
+    uint64_t t0 = st->pad[0], t1 = st->pad[1];
+    h0 += t0 & MASK44;
+    c = h0 >> 44;
+    h0 &= MASK44;
+    h1 += ((t0 >> 44 | t1 << 20) & MASK44) + c;
+    c = h1 >> 44;
+    h1 &= MASK44;
+    h2 += ((t1 >> 24) & MASK42) + c;
+    h2 &= MASK42;
+
+    store_le64(tag, h0 | h1 << 44);
+    store_le64(tag + 8, h1 >> 20 | h2 << 24);
+    memset(st, 0, sizeof(*st));
+}
+
+void chacha20_poly1305_tag(const struct aead_ctx* ctx, const uint8_t nonce[AEAD_NONCE_SIZE],
+                           const uint8_t* aad, size_t aad_length, const uint8_t* data, size_t length,
+                           uint8_t tag[AEAD_TAG_SIZE]) {
+    // The one-time key is the start of block 0; data is encrypted from 1
+    uint8_t poly_key[64] = { 0 };
+    chacha20_xor(ctx->key, nonce, 0, poly_key, sizeof(poly_key));
+
+    struct poly1305 st;
+    poly1305_init(&st, poly_key);
+    poly1305_update_padded(&st, aad, aad_length);
+    poly1305_update_padded(&st, data, length);
+    uint8_t lengths[16];
+    store_le64(lengths, aad_length);
+    store_le64(lengths + 8, length);
+    poly1305_blocks(&st, lengths, 1);
+    poly1305_finish(&st, tag);
+    memset(poly_key, 0, sizeof(poly_key));
+}
@@ -0,0 +1,387 @@
+#include <net/crypto/aead.h>
+#include <utils/mem.h>
+
+// AES-GCM (NIST SP 800-38D). The AES-NI and PCLMULQDQ kernels are inline
+// asm, since the kernel is built without SSE; callers bracket them with
+// kernel_fpu_begin() and kernel_fpu_end().
+
+static uint8_t aes_sbox[256];
+static uint32_t aes_te[256];        // MixColumns of S-box outputs, one column
+static volatile bool aes_tables_ready = false;
+
+static const uint16_t ghash_last4[16] = {
+    0x0000, 0x1C20, 0x3840, 0x2460, 0x7080, 0x6CA0, 0x48C0, 0x54E0,
+    0xE100, 0xFD20, 0xD940, 0xC560, 0x9180, 0x8DA0, 0xA9C0, 0xB5E0
+};
+
+static const uint8_t bswap_mask[16] = { 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0 };
+
+static inline uint32_t load_be32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void store_be32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint64_t load_be64(const uint8_t* p) {
+    return (uint64_t)load_be32(p) << 32 | load_be32(p + 4);
+}
+
+static inline void store_be64(uint8_t* p, uint64_t v) {
+    store_be32(p, (uint32_t)(v >> 32));
+    store_be32(p + 4, (uint32_t)v);
+}
+
+static inline uint8_t rotl8(uint8_t x, int n) {
+    return (uint8_t)(x << n | x >> (8 - n));
+}
+
+static inline uint32_t ror32(uint32_t x, int n) {
+    return x >> n | x << (32 - n);
+}
+
+// The S-box from the multiplicative group: p walks it by powers of 3 while
+// q tracks p's inverse, which the affine map then turns into S(p). Every
+// caller computes the same values, so racing here is harmless.
+static void aes_tables(void) {
+    if (aes_tables_ready) return;
+    uint8_t p = 1, q = 1;
+    do {
+        p = (uint8_t)(p ^ (p << 1) ^ (p & 0x80 ? 0x1B : 0));
+        q ^= (uint8_t)(q << 1);
+        q ^= (uint8_t)(q << 2);
+        q ^= (uint8_t)(q << 4);
+        if (q & 0x80) q ^= 0x09;
+        aes_sbox[p] = (uint8_t)(q ^ rotl8(q, 1) ^ rotl8(q, 2) ^ rotl8(q, 3) ^ rotl8(q, 4) ^ 0x63);
+    } while (p != 1);
+    aes_sbox[0] = 0x63;
+
+    for (int i = 0; i < 256; i++) {
+        uint32_t s = aes_sbox[i];
+        uint32_t s2 = (s << 1 ^ (s & 0x80 ? 0x1B : 0)) & 0xFF;
+        aes_te[i] = s2 << 24 | s << 16 | s << 8 | (s2 ^ s);
+    }
+    aes_tables_ready = true;
+}
+
+static void aes_expand_key(struct aead_ctx* ctx, const uint8_t* key, uint32_t key_length) {
+    uint32_t nk = key_length / 4;
+    uint32_t words = 4 * (ctx->rounds + 1);
+    uint32_t w[60];
+    uint32_t rcon = 1;
+
+    for (uint32_t i = 0; i < nk; i++) w[i] = load_be32(key + 4 * i);
+    for (uint32_t i = nk; i < words; i++) {
+        uint32_t t = w[i - 1];
+        if (i % nk == 0) {
+            t = t << 8 | t >> 24;
+            t = (uint32_t)aes_sbox[t >> 24] << 24 | (uint32_t)aes_sbox[(t >> 16) & 0xFF] << 16 |
+                (uint32_t)aes_sbox[(t >> 8) & 0xFF] << 8 | aes_sbox[t & 0xFF];
+            t ^= rcon << 24;
+            rcon = (rcon << 1 ^ (rcon & 0x80 ? 0x1B : 0)) & 0xFF;
+        } else if (nk > 6 && i % nk == 4) {
+            t = (uint32_t)aes_sbox[t >> 24] << 24 | (uint32_t)aes_sbox[(t >> 16) & 0xFF] << 16 |
+                (uint32_t)aes_sbox[(t >> 8) & 0xFF] << 8 | aes_sbox[t & 0xFF];
+        }
+        w[i] = w[i - nk] ^ t;
+    }
+    for (uint32_t i = 0; i < words; i++) store_be32(ctx->round_keys + 4 * i, w[i]);
+    memset(w, 0, sizeof(w));
+}
+
+// One block on the portable path, through the column tables
+static void aes_encrypt_block(const struct aead_ctx* ctx, const uint8_t in[16], uint8_t out[16]) {
+    const uint8_t* rk = ctx->round_keys;
+    uint32_t s0 = load_be32(in) ^ load_be32(rk);
+    uint32_t s1 = load_be32(in + 4) ^ load_be32(rk + 4);
+    uint32_t s2 = load_be32(in + 8) ^ load_be32(rk + 8);
+    uint32_t s3 = load_be32(in + 12) ^ load_be32(rk + 12);
+
+    for (uint32_t round = 1; round < ctx->rounds; round++) {
+        rk += 16;
+        uint32_t t0 = aes_te[s0 >> 24] ^ ror32(aes_te[(s1 >> 16) & 0xFF], 8) ^
+                      ror32(aes_te[(s2 >> 8) & 0xFF], 16) ^ ror32(aes_te[s3 & 0xFF], 24) ^ load_be32(rk);
+        uint32_t t1 = aes_te[s1 >> 24] ^ ror32(aes_te[(s2 >> 16) & 0xFF], 8) ^
+                      ror32(aes_te[(s3 >> 8) & 0xFF], 16) ^ ror32(aes_te[s0 & 0xFF], 24) ^ load_be32(rk + 4);
+        uint32_t t2 = aes_te[s2 >> 24] ^ ror32(aes_te[(s3 >> 16) & 0xFF], 8) ^
+                      ror32(aes_te[(s0 >> 8) & 0xFF], 16) ^ ror32(aes_te[s1 & 0xFF], 24) ^ load_be32(rk + 8);
+        uint32_t t3 = aes_te[s3 >> 24] ^ ror32(aes_te[(s0 >> 16) & 0xFF], 8) ^
+                      ror32(aes_te[(s1 >> 8) & 0xFF], 16) ^ ror32(aes_te[s2 & 0xFF], 24) ^ load_be32(rk + 12);
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+
+    // The last round skips MixColumns
+    rk += 16;
+    uint32_t state[4] = { s0, s1, s2, s3 };
+    for (int c = 0; c < 4; c++) {
+        uint32_t t = (uint32_t)aes_sbox[state[c] >> 24] << 24 |
+                     (uint32_t)aes_sbox[(state[(c + 1) & 3] >> 16) & 0xFF] << 16 |
+                     (uint32_t)aes_sbox[(state[(c + 2) & 3] >> 8) & 0xFF] << 8 |
+                     aes_sbox[state[(c + 3) & 3] & 0xFF];
+        store_be32(out + 4 * c, t ^ load_be32(rk + 4 * c));
+    }
+}
+
+// Four counter blocks through AES-NI, XORed into in
+static void aesni_ctr4(const struct aead_ctx* ctx, const uint8_t counters[64], const uint8_t* in, uint8_t* out) {
+    const uint8_t* rk = ctx->round_keys;
+    uint64_t rounds = ctx->rounds - 1;
+    asm volatile(
+        "movdqu xmm4, [%[rk]]\n\t"
+        "movdqu xmm0, [%[ctr]]\n\t"
+        "movdqu xmm1, [%[ctr] + 16]\n\t"
+        "movdqu xmm2, [%[ctr] + 32]\n\t"
+        "movdqu xmm3, [%[ctr] + 48]\n\t"
+        "pxor xmm0, xmm4\n\t"
+        "pxor xmm1, xmm4\n\t"
+        "pxor xmm2, xmm4\n\t"
+        "pxor xmm3, xmm4\n\t"
+        "1:\n\t"
+        "add %[rk], 16\n\t"
+        "movdqu xmm4, [%[rk]]\n\t"
+        "aesenc xmm0, xmm4\n\t"
+        "aesenc xmm1, xmm4\n\t"
+        "aesenc xmm2, xmm4\n\t"
+        "aesenc xmm3, xmm4\n\t"
+        "dec %[rounds]\n\t"
+        "jnz 1b\n\t"
+        "movdqu xmm4, [%[rk] + 16]\n\t"
+        "aesenclast xmm0, xmm4\n\t"
+        "aesenclast xmm1, xmm4\n\t"
+        "aesenclast xmm2, xmm4\n\t"
+        "aesenclast xmm3, xmm4\n\t"
+        "movdqu xmm4, [%[in]]\n\t"
+        "movdqu xmm5, [%[in] + 16]\n\t"
+        "movdqu xmm6, [%[in] + 32]\n\t"
+        "movdqu xmm7, [%[in] + 48]\n\t"
+        "pxor xmm0, xmm4\n\t"
+        "pxor xmm1, xmm5\n\t"
+        "pxor xmm2, xmm6\n\t"
+        "pxor xmm3, xmm7\n\t"
+        "movdqu [%[out]], xmm0\n\t"
+        "movdqu [%[out] + 16], xmm1\n\t"
+        "movdqu [%[out] + 32], xmm2\n\t"
+        "movdqu [%[out] + 48], xmm3\n\t"
+        : [rk] "+r"(rk), [rounds] "+r"(rounds)
+        : [ctr] "r"(counters), [in] "r"(in), [out] "r"(out)
+        : "memory", "cc");
+}
+
+// x = (x ^ block) * H for each block, with PCLMULQDQ: the 256-bit product
+// of the byte-reflected operands, shifted left one bit and reduced modulo
+// x^128 + x^7 + x^2 + x + 1 (Intel's carry-less multiplication paper)
+static void pclmul_ghash(uint8_t x[16], const uint8_t h[16], const uint8_t* data, size_t blocks) {
+    asm volatile(
+        "movdqu xmm2, [%[mask]]\n\t"
+        "movdqu xmm0, [%[x]]\n\t"
+        "movdqu xmm1, [%[h]]\n\t"
+        "pshufb xmm0, xmm2\n\t"
+        "pshufb xmm1, xmm2\n\t"
+        "1:\n\t"
+        "movdqu xmm3, [%[data]]\n\t"
+        "pshufb xmm3, xmm2\n\t"
+        "pxor xmm0, xmm3\n\t"
+        "movdqa xmm3, xmm0\n\t"
+        "pclmulqdq xmm3, xmm1, 0x00\n\t"
+        "movdqa xmm4, xmm0\n\t"
+        "pclmulqdq xmm4, xmm1, 0x10\n\t"
+        "movdqa xmm5, xmm0\n\t"
+        "pclmulqdq xmm5, xmm1, 0x01\n\t"
+        "movdqa xmm6, xmm0\n\t"
+        "pclmulqdq xmm6, xmm1, 0x11\n\t"
+        "pxor xmm4, xmm5\n\t"
+        "movdqa xmm5, xmm4\n\t"
+        "psrldq xmm4, 8\n\t"
+        "pslldq xmm5, 8\n\t"
+        "pxor xmm3, xmm5\n\t"
+        "pxor xmm6, xmm4\n\t"
+        // Shift the product left a bit, for the reflected operands
+        "movdqa xmm7, xmm3\n\t"
+        "movdqa xmm8, xmm6\n\t"
+        "psrld xmm7, 31\n\t"
+        "psrld xmm8, 31\n\t"
+        "pslld xmm3, 1\n\t"
+        "pslld xmm6, 1\n\t"
+        "movdqa xmm9, xmm7\n\t"
+        "psrldq xmm9, 12\n\t"
+        "pslldq xmm8, 4\n\t"
+        "pslldq xmm7, 4\n\t"
+        "por xmm3, xmm7\n\t"
+        "por xmm6, xmm8\n\t"
+        "por xmm6, xmm9\n\t"
+        // Reduce
+        "movdqa xmm7, xmm3\n\t"
+        "movdqa xmm8, xmm3\n\t"
+        "movdqa xmm9, xmm3\n\t"
+        "pslld xmm7, 31\n\t"
+        "pslld xmm8, 30\n\t"
+        "pslld xmm9, 25\n\t"
+        "pxor xmm7, xmm8\n\t"
+        "pxor xmm7, xmm9\n\t"
+        "movdqa xmm8, xmm7\n\t"
+        "psrldq xmm8, 4\n\t"
+        "pslldq xmm7, 12\n\t"
+        "pxor xmm3, xmm7\n\t"
+        "movdqa xmm9, xmm3\n\t"
+        "movdqa xmm4, xmm3\n\t"
+        "movdqa xmm5, xmm3\n\t"
+        "psrld xmm9, 1\n\t"
+        "psrld xmm4, 2\n\t"
+        "psrld xmm5, 7\n\t"
+        "pxor xmm9, xmm4\n\t"
+        "pxor xmm9, xmm5\n\t"
+        "pxor xmm9, xmm8\n\t"
+        "pxor xmm3, xmm9\n\t"
+        "pxor xmm6, xmm3\n\t"
+        "movdqa xmm0, xmm6\n\t"
+        "add %[data], 16\n\t"
+        "dec %[blocks]\n\t"
+        "jnz 1b\n\t"
+        "pshufb xmm0, xmm2\n\t"
+        "movdqu [%[x]], xmm0\n\t"
+        : [data] "+r"(data), [blocks] "+r"(blocks)
+        : [x] "r"(x), [h] "r"(h), [mask] "r"(bswap_mask)
+        : "memory", "cc");
+}
+
+// The portable multiply, four bits at a time through tables of H's
+// multiples (Shoup's method)
+static void ghash_mult(const struct aead_ctx* ctx, uint8_t x[16]) {
+    uint8_t lo = x[15] & 0xF;
+    uint64_t zh = ctx->hh[lo];
+    uint64_t zl = ctx->hl[lo];
+
+    for (int i = 15; i >= 0; i--) {
+        lo = x[i] & 0xF;
+        uint8_t hi = x[i] >> 4;
+        if (i != 15) {
+            uint8_t rem = zl & 0xF;
+            zl = zh << 60 | zl >> 4;
+            zh = zh >> 4 ^ (uint64_t)ghash_last4[rem] << 48;
+            zh ^= ctx->hh[lo];
+            zl ^= ctx->hl[lo];
+        }
+        uint8_t rem = zl & 0xF;
+        zl = zh << 60 | zl >> 4;
+        zh = zh >> 4 ^ (uint64_t)ghash_last4[rem] << 48;
+        zh ^= ctx->hh[hi];
+        zl ^= ctx->hl[hi];
+    }
+    store_be64(x, zh);
+    store_be64(x + 8, zl);
+}
+
+// Absorb data, the last block zero-padded
+static void ghash_update(const struct aead_ctx* ctx, uint8_t x[16], const uint8_t* data, size_t length,
+                         bool accelerated) {
+    size_t blocks = length / 16;
+    if (blocks && accelerated) {
+        pclmul_ghash(x, ctx->h, data, blocks);
+    } else {
+        for (size_t b = 0; b < blocks; b++) {
+            for (int i = 0; i < 16; i++) x[i] ^= data[16 * b + i];
+            ghash_mult(ctx, x);
+        }
+    }
+
+    size_t tail = length % 16;
+    if (tail) {
+        uint8_t block[16] = { 0 };
+        memcpy(block, data + 16 * blocks, tail);
+        if (accelerated) {
+            pclmul_ghash(x, ctx->h, block, 1);
+        } else {
+            for (int i = 0; i < 16; i++) x[i] ^= block[i];
+            ghash_mult(ctx, x);
+        }
+    }
+}
+
+void gcm_init(struct aead_ctx* ctx, const uint8_t* key, uint32_t key_length) {
+    aes_tables();
+    ctx->rounds = key_length == 32 ? 14 : 10;
+    aes_expand_key(ctx, key, key_length);
+
+    uint8_t zero[16] = { 0 };
+    aes_encrypt_block(ctx, zero, ctx->h);
+
+    // hl/hh[i] hold i * H for 4-bit i, bit-reflected as GHASH orders them
+    uint64_t vh = load_be64(ctx->h);
+    uint64_t vl = load_be64(ctx->h + 8);
+    ctx->hh[0] = 0;
+    ctx->hl[0] = 0;
+    ctx->hh[8] = vh;
+    ctx->hl[8] = vl;
+    for (int i = 4; i > 0; i >>= 1) {
+        uint64_t carry = (vl & 1) ? 0xE100000000000000ULL : 0;
+        vl = vh << 63 | vl >> 1;
+        vh = vh >> 1 ^ carry;
+        ctx->hh[i] = vh;
+        ctx->hl[i] = vl;
+    }
+    for (int i = 2; i <= 8; i *= 2) {
+        for (int j = 1; j < i; j++) {
+            ctx->hh[i + j] = ctx->hh[i] ^ ctx->hh[j];
+            ctx->hl[i + j] = ctx->hl[i] ^ ctx->hl[j];
+        }
+    }
+}
+
+void gcm_ctr(const struct aead_ctx* ctx, const uint8_t nonce[AEAD_NONCE_SIZE], uint8_t* data, size_t length,
+             bool accelerated) {
+    // Block 1 of the counter is for the tag; data starts at 2
+    uint32_t counter = 2;
+    uint8_t counters[64];
+    uint8_t stream[64];
+    for (int i = 0; i < 4; i++) memcpy(counters + 16 * i, nonce, AEAD_NONCE_SIZE);
+
+    while (length) {
+        size_t chunk = length < 64 ? length : 64;
+        uint32_t blocks = (uint32_t)((chunk + 15) / 16);
+        for (uint32_t i = 0; i < 4; i++) store_be32(counters + 16 * i + 12, counter + i);
+        counter += blocks;
+
+        if (accelerated && chunk == 64) {
+            aesni_ctr4(ctx, counters, data, data);
+        } else {
+            // A short tail, or no AES-NI: make the key stream, then XOR
+            if (accelerated) {
+                uint8_t zero[64] = { 0 };
+                aesni_ctr4(ctx, counters, zero, stream);
+            } else {
+                for (uint32_t i = 0; i < blocks; i++) aes_encrypt_block(ctx, counters + 16 * i, stream + 16 * i);
+            }
+            for (size_t i = 0; i < chunk; i++) data[i] ^= stream[i];
+        }
+        data += chunk;
+        length -= chunk;
+    }
+    memset(stream, 0, sizeof(stream));
+}
+
+void gcm_tag(const struct aead_ctx* ctx, const uint8_t nonce[AEAD_NONCE_SIZE], const uint8_t* aad,
+             size_t aad_length, const uint8_t* data, size_t length, uint8_t tag[AEAD_TAG_SIZE],
+             bool accelerated) {
+    uint8_t x[16] = { 0 };
+    ghash_update(ctx, x, aad, aad_length, accelerated);
+    ghash_update(ctx, x, data, length, accelerated);
+
+    uint8_t lengths[16];
+    store_be64(lengths, (uint64_t)aad_length * 8);
+    store_be64(lengths + 8, (uint64_t)length * 8);
+    ghash_update(ctx, x, lengths, 16, accelerated);
+
+    // Masked with the encrypted first counter block
+    uint8_t j0[16];
+    memcpy(j0, nonce, AEAD_NONCE_SIZE);
+    store_be32(j0 + 12, 1);
+    aes_encrypt_block(ctx, j0, j0);
+    for (int i = 0; i < 16; i++) tag[i] = x[i] ^ j0[i];
+}
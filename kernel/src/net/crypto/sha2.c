@@ -0,0 +1,262 @@
+#include <net/crypto/sha2.h>
+#include <utils/mem.h>
+
+static const uint32_t k256[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static const uint64_t k512[80] = {
+    0x428A2F98D728AE22ULL, 0x7137449123EF65CDULL, 0xB5C0FBCFEC4D3B2FULL, 0xE9B5DBA58189DBBCULL,
+    0x3956C25BF348B538ULL, 0x59F111F1B605D019ULL, 0x923F82A4AF194F9BULL, 0xAB1C5ED5DA6D8118ULL,
+    0xD807AA98A3030242ULL, 0x12835B0145706FBEULL, 0x243185BE4EE4B28CULL, 0x550C7DC3D5FFB4E2ULL,
+    0x72BE5D74F27B896FULL, 0x80DEB1FE3B1696B1ULL, 0x9BDC06A725C71235ULL, 0xC19BF174CF692694ULL,
+    0xE49B69C19EF14AD2ULL, 0xEFBE4786384F25E3ULL, 0x0FC19DC68B8CD5B5ULL, 0x240CA1CC77AC9C65ULL,
+    0x2DE92C6F592B0275ULL, 0x4A7484AA6EA6E483ULL, 0x5CB0A9DCBD41FBD4ULL, 0x76F988DA831153B5ULL,
+    0x983E5152EE66DFABULL, 0xA831C66D2DB43210ULL, 0xB00327C898FB213FULL, 0xBF597FC7BEEF0EE4ULL,
+    0xC6E00BF33DA88FC2ULL, 0xD5A79147930AA725ULL, 0x06CA6351E003826FULL, 0x142929670A0E6E70ULL,
+    0x27B70A8546D22FFCULL, 0x2E1B21385C26C926ULL, 0x4D2C6DFC5AC42AEDULL, 0x53380D139D95B3DFULL,
+    0x650A73548BAF63DEULL, 0x766A0ABB3C77B2A8ULL, 0x81C2C92E47EDAEE6ULL, 0x92722C851482353BULL,
+    0xA2BFE8A14CF10364ULL, 0xA81A664BBC423001ULL, 0xC24B8B70D0F89791ULL, 0xC76C51A30654BE30ULL,
+    0xD192E819D6EF5218ULL, 0xD69906245565A910ULL, 0xF40E35855771202AULL, 0x106AA07032BBD1B8ULL,
+    0x19A4C116B8D2D0C8ULL, 0x1E376C085141AB53ULL, 0x2748774CDF8EEB99ULL, 0x34B0BCB5E19B48A8ULL,
+    0x391C0CB3C5C95A63ULL, 0x4ED8AA4AE3418ACBULL, 0x5B9CCA4F7763E373ULL, 0x682E6FF3D6B2B8A3ULL,
+    0x748F82EE5DEFB2FCULL, 0x78A5636F43172F60ULL, 0x84C87814A1F0AB72ULL, 0x8CC702081A6439ECULL,
+    0x90BEFFFA23631E28ULL, 0xA4506CEBDE82BDE9ULL, 0xBEF9A3F7B2C67915ULL, 0xC67178F2E372532BULL,
+    0xCA273ECEEA26619CULL, 0xD186B8C721C0C207ULL, 0xEADA7DD6CDE0EB1EULL, 0xF57D4F7FEE6ED178ULL,
+    0x06F067AA72176FBAULL, 0x0A637DC5A2C898A6ULL, 0x113F9804BEF90DAEULL, 0x1B710B35131C471BULL,
+    0x28DB77F523047D84ULL, 0x32CAAB7B40C72493ULL, 0x3C9EBE0A15C9BEBCULL, 0x431D67C49C100D4CULL,
+    0x4CC5D4BECB3E42B6ULL, 0x597F299CFC657E2AULL, 0x5FCB6FAB3AD6FAECULL, 0x6C44198C4A475817ULL
+};
+
+static inline uint32_t ror32(uint32_t x, int n) {
+    return x >> n | x << (32 - n);
+}
+
+static inline uint64_t ror64(uint64_t x, int n) {
+    return x >> n | x << (64 - n);
+}
+
+static void sha256_block(uint32_t state[8], const uint8_t* p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + k256[i] + w[i];
+        uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static void sha512_block(uint64_t state[8], const uint8_t* p) {
+    uint64_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = 0;
+        for (int j = 0; j < 8; j++) w[i] = w[i] << 8 | p[8 * i + j];
+    }
+    for (int i = 16; i < 80; i++) {
+        uint64_t s0 = ror64(w[i - 15], 1) ^ ror64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+        uint64_t s1 = ror64(w[i - 2], 19) ^ ror64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint64_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint64_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 80; i++) {
+        uint64_t t1 = h + (ror64(e, 14) ^ ror64(e, 18) ^ ror64(e, 41)) + ((e & f) ^ (~e & g)) + k512[i] + w[i];
+        uint64_t t2 = (ror64(a, 28) ^ ror64(a, 34) ^ ror64(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void sha256_init(struct sha256_ctx* ctx) {
+    static const uint32_t iv[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
+}
+
+void sha256_update(struct sha256_ctx* ctx, const void* data, size_t length) {
+    const uint8_t* p = data;
+    while (length) {
+        uint32_t used = ctx->length % 64;
+        if (!used && length >= 64) {
+            sha256_block(ctx->state, p);
+            ctx->length += 64;
+            p += 64;
+            length -= 64;
+            continue;
+        }
+        size_t chunk = 64 - used < length ? 64 - used : length;
+        memcpy(ctx->buffer + used, p, chunk);
+        ctx->length += chunk;
+        p += chunk;
+        length -= chunk;
+        if ((ctx->length % 64) == 0) sha256_block(ctx->state, ctx->buffer);
+    }
+}
+
+void sha256_final(struct sha256_ctx* ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad[72] = { 0x80 };
+    uint32_t used = ctx->length % 64;
+    size_t pad_length = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; i++) pad[pad_length + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256_update(ctx, pad, pad_length + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(ctx->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)ctx->state[i];
+    }
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void sha384_init(struct sha512_ctx* ctx) {
+    static const uint64_t iv[8] = {
+        0xCBBB9D5DC1059ED8ULL, 0x629A292A367CD507ULL, 0x9159015A3070DD17ULL, 0x152FECD8F70E5939ULL,
+        0x67332667FFC00B31ULL, 0x8EB44A8768581511ULL, 0xDB0C2E0D64F98FA7ULL, 0x47B5481DBEFA4FA4ULL
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
+}
+
+void sha384_update(struct sha512_ctx* ctx, const void* data, size_t length) {
+    const uint8_t* p = data;
+    while (length) {
+        uint32_t used = ctx->length % 128;
+        if (!used && length >= 128) {
+            sha512_block(ctx->state, p);
+            ctx->length += 128;
+            p += 128;
+            length -= 128;
+            continue;
+        }
+        size_t chunk = 128 - used < length ? 128 - used : length;
+        memcpy(ctx->buffer + used, p, chunk);
+        ctx->length += chunk;
+        p += chunk;
+        length -= chunk;
+        if ((ctx->length % 128) == 0) sha512_block(ctx->state, ctx->buffer);
+    }
+}
+
+void sha384_final(struct sha512_ctx* ctx, uint8_t digest[SHA384_DIGEST_SIZE]) {
+    // The length field is 128 bits; its upper half stays zero here
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad[144] = { 0x80 };
+    uint32_t used = ctx->length % 128;
+    size_t pad_length = (used < 112 ? 112 : 240) - used;
+    for (int i = 0; i < 8; i++) pad[pad_length + 8 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha384_update(ctx, pad, pad_length + 16);
+
+    for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < 8; j++) digest[8 * i + j] = (uint8_t)(ctx->state[i] >> (56 - 8 * j));
+    }
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+// One hash behind both digest sizes
+struct sha2_ctx {
+    uint32_t digest_size;
+    union {
+        struct sha256_ctx s256;
+        struct sha512_ctx s512;
+    };
+};
+
+static void sha2_init(struct sha2_ctx* ctx, uint32_t digest_size) {
+    ctx->digest_size = digest_size;
+    if (digest_size == SHA384_DIGEST_SIZE) sha384_init(&ctx->s512);
+    else sha256_init(&ctx->s256);
+}
+
+static void sha2_update(struct sha2_ctx* ctx, const void* data, size_t length) {
+    if (ctx->digest_size == SHA384_DIGEST_SIZE) sha384_update(&ctx->s512, data, length);
+    else sha256_update(&ctx->s256, data, length);
+}
+
+static void sha2_final(struct sha2_ctx* ctx, uint8_t* digest) {
+    if (ctx->digest_size == SHA384_DIGEST_SIZE) sha384_final(&ctx->s512, digest);
+    else sha256_final(&ctx->s256, digest);
+}
+
+void hmac_sha2(uint32_t digest_size, const uint8_t* key, size_t key_length,
+               const void* a, size_t a_length, const void* b, size_t b_length, uint8_t* out) {
+    uint32_t block_size = digest_size == SHA384_DIGEST_SIZE ? 128 : 64;
+    uint8_t pad[128] = { 0 };
+    struct sha2_ctx ctx;
+
+    // Keys longer than a block are hashed down first
+    if (key_length > block_size) {
+        sha2_init(&ctx, digest_size);
+        sha2_update(&ctx, key, key_length);
+        sha2_final(&ctx, pad);
+    } else {
+        memcpy(pad, key, key_length);
+    }
+
+    uint8_t inner[SHA2_MAX_DIGEST];
+    for (uint32_t i = 0; i < block_size; i++) pad[i] ^= 0x36;
+    sha2_init(&ctx, digest_size);
+    sha2_update(&ctx, pad, block_size);
+    if (a_length) sha2_update(&ctx, a, a_length);
+    if (b_length) sha2_update(&ctx, b, b_length);
+    sha2_final(&ctx, inner);
+
+    for (uint32_t i = 0; i < block_size; i++) pad[i] ^= 0x36 ^ 0x5C;
+    sha2_init(&ctx, digest_size);
+    sha2_update(&ctx, pad, block_size);
+    sha2_update(&ctx, inner, digest_size);
+    sha2_final(&ctx, out);
+
+    memset(pad, 0, sizeof(pad));
+    memset(inner, 0, sizeof(inner));
+}
@@ -0,0 +1,37 @@
+#ifndef SHA2_H
+#define SHA2_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// SHA-256 and SHA-384 (FIPS 180-4), and HMAC over them, for TLS key
+// derivation
+#define SHA256_DIGEST_SIZE  32
+#define SHA384_DIGEST_SIZE  48
+#define SHA2_MAX_DIGEST     SHA384_DIGEST_SIZE
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length;            // Bytes so far
+    uint8_t buffer[64];
+};
+
+struct sha512_ctx {
+    uint64_t state[8];
+    uint64_t length;
+    uint8_t buffer[128];
+};
+
+void sha256_init(struct sha256_ctx* ctx);
+void sha256_update(struct sha256_ctx* ctx, const void* data, size_t length);
+void sha256_final(struct sha256_ctx* ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+void sha384_init(struct sha512_ctx* ctx);
+void sha384_update(struct sha512_ctx* ctx, const void* data, size_t length);
+void sha384_final(struct sha512_ctx* ctx, uint8_t digest[SHA384_DIGEST_SIZE]);
+
+// HMAC of a || b, with SHA-256 or SHA-384 chosen by digest_size
+void hmac_sha2(uint32_t digest_size, const uint8_t* key, size_t key_length,
+               const void* a, size_t a_length, const void* b, size_t b_length, uint8_t* out);
+
+#endif // SHA2_H
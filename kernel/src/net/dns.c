@@ -2,6 +2,12 @@
 #include <net/net.h>
 #include <utils/mem.h>
 #include <utils/str.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <core/wait.h>
+#include <core/workqueue.h>
+#include <core/boot.h>
+#include <core/counter.h>
 
 // Default DNS servers (Google DNS and Cloudflare DNS)
 static const uint32_t default_dns_servers[] = {
@@ -12,12 +18,52 @@ static const uint32_t default_dns_servers[] = {
 };
 
 #define MAX_DNS_SERVERS 4
+#define DNS_TIMEOUT_NS  2000000000ULL   // Per server, before trying the next
 static uint32_t dns_servers[MAX_DNS_SERVERS];
 static size_t num_dns_servers = 0;
 static uint16_t dns_query_id = 0;
 
-// Statistics tracking
-static dns_stats_t dns_statistics = {0};
+// Statistics tracking, registered by dns_init()
+static struct {
+    struct counter queries_sent;
+    struct counter responses_received;
+    struct counter timeouts;
+    struct counter errors;
+    struct counter cache_hits;
+    struct counter cache_misses;
+} dns_counters = {
+    COUNTER_INIT("dns", "queries_sent"),
+    COUNTER_INIT("dns", "responses_received"),
+    COUNTER_INIT("dns", "timeouts"),
+    COUNTER_INIT("dns", "errors"),
+    COUNTER_INIT("dns", "cache_hits"),
+    COUNTER_INIT("dns", "cache_misses"),
+};
+
+// Resolver cache, by normalized hostname
+#define DNS_ENTRY_EMPTY     0
+#define DNS_ENTRY_PENDING   1   // A query is out; lookups wait on dns_wait
+#define DNS_ENTRY_READY     2   // ip is the answer, 0 for a negative one
+
+struct dns_cache_entry {
+    char name[DNS_MAX_NAME_LENGTH + 1];
+    uint32_t hash;
+    uint8_t state;
+    bool prefetch;              // Hit near expiry, to be refreshed
+    bool refreshing;            // The prefetcher is querying it
+    uint32_t ip;
+    uint64_t ttl_ns;
+    uint64_t expires;
+    uint64_t last_used;
+};
+
+static struct dns_cache_entry dns_cache[DNS_CACHE_SIZE];
+static spinlock_t dns_lock = SPINLOCK_INIT;
+static struct wait_queue dns_wait = WAIT_QUEUE_INIT;
+static volatile bool dns_prefetch_enabled = true;
+
+static void dns_prefetch_func(struct work* work);
+static struct work dns_prefetch_work = WORK_INIT(dns_prefetch_func);
 
 // Convert domain name to DNS format
 static int dns_encode_name(const char* domain, uint8_t* buffer) {
@@ -93,26 +139,45 @@ static int dns_build_query(const char* domain, uint8_t* buffer, size_t buffer_si
     return sizeof(struct dns_header) + name_length + sizeof(struct dns_question);
 }
 
-// Parse DNS response and extract IP address
-static uint32_t dns_parse_response(const uint8_t* response, size_t response_length) {
+// Past a possibly compressed name; NULL if it runs off the end
+static const uint8_t* dns_skip_name(const uint8_t* cur, const uint8_t* end) {
+    while (cur < end && *cur) {
+        if ((*cur & 0xC0) == 0xC0) {  // Compression pointer
+            return cur + 2 <= end ? cur + 2 : NULL;
+        }
+        cur += *cur + 1;
+    }
+    return cur < end ? cur + 1 : NULL;
+}
+
+static inline uint32_t dns_read32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Parse a response to query id. 1 with the first IPv4 address and the
+// lowest TTL on the way to it (CNAMEs included); 0 if the name or its A
+// record does not exist, with the SOA's negative TTL (RFC 2308); -1 if
+// the response is unusable and another server should be asked.
+static int dns_parse_response(const uint8_t* response, size_t response_length, uint16_t id,
+                              uint32_t* ip, uint32_t* ttl) {
     if (!response || response_length < sizeof(struct dns_header)) {
-        dns_statistics.errors++;
-        return 0;
+        counter_inc(&dns_counters.errors);
+        return -1;
     }
 
     struct dns_header* header = (struct dns_header*)response;
 
     // Check response flags
     uint16_t flags = ntohs(header->flags);
-    if (!(flags & DNS_FLAG_QR)) {  // Must be a response
-        dns_statistics.errors++;
-        return 0;
+    if (!(flags & DNS_FLAG_QR) || header->id != id) {  // Must be a response, to us
+        counter_inc(&dns_counters.errors);
+        return -1;
     }
 
     uint8_t rcode = flags & DNS_FLAG_RCODE;
-    if (rcode != DNS_RCODE_NOERROR) {
-        dns_statistics.errors++;
-        return 0;
+    if (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN) {
+        counter_inc(&dns_counters.errors);
+        return -1;
     }
 
     // Skip header
@@ -122,57 +187,60 @@ static uint32_t dns_parse_response(const uint8_t* response, size_t response_leng
     // Skip question section
     uint16_t qdcount = ntohs(header->qdcount);
     while (qdcount-- > 0) {
-        // Skip name
-        while (cur < end && *cur) {
-            if (*cur & 0xC0) {  // Compression pointer
-                cur += 2;
-                break;
-            }
-            cur += *cur + 1;
-        }
-        if (cur >= end || cur + sizeof(struct dns_question) > end) {
-            dns_statistics.errors++;
-            return 0;
+        cur = dns_skip_name(cur, end);
+        if (!cur || cur + sizeof(struct dns_question) > end) {
+            counter_inc(&dns_counters.errors);
+            return -1;
         }
         cur += sizeof(struct dns_question);
     }
 
-    // Parse answer section
-    uint16_t ancount = ntohs(header->ancount);
-    while (ancount-- > 0) {
-        // Skip name
-        while (cur < end && *cur) {
-            if (*cur & 0xC0) {  // Compression pointer
-                cur += 2;
-                break;
-            }
-            cur += *cur + 1;
-        }
-        if (cur >= end) {
-            dns_statistics.errors++;
-            return 0;
-        }
+    // Parse answer, then authority section
+    counter_inc(&dns_counters.responses_received);
+    uint32_t lowest = DNS_CACHE_MAX_TTL;
+    uint16_t ancount = rcode == DNS_RCODE_NOERROR ? ntohs(header->ancount) : 0;
+    uint16_t nscount = ntohs(header->nscount);
+    for (uint32_t record = 0; record < (uint32_t)ancount + nscount; record++) {
+        cur = dns_skip_name(cur, end);
+        if (!cur || cur + sizeof(struct dns_resource_record) > end) break;
 
         // Get resource record
         struct dns_resource_record* rr = (struct dns_resource_record*)cur;
-        if (cur + sizeof(struct dns_resource_record) > end) {
-            dns_statistics.errors++;
-            return 0;
-        }
+        uint16_t type = ntohs(rr->type);
+        uint16_t rdlength = ntohs(rr->rdlength);
+        uint32_t rr_ttl = dns_read32(cur + 4);
         cur += sizeof(struct dns_resource_record);
+        if (cur + rdlength > end) break;
 
-        // Check if this is an A record
-        if (ntohs(rr->type) == DNS_TYPE_A && ntohs(rr->rdlength) == 4) {
-            dns_statistics.responses_received++;
+        if (record < ancount) {
+            if (type == DNS_TYPE_A || type == DNS_TYPE_CNAME) {
+                if (rr_ttl < lowest) lowest = rr_ttl;
+            }
             // Return first IPv4 address found
-            return *(uint32_t*)cur;
+            if (type == DNS_TYPE_A && rdlength == 4) {
+                memcpy(ip, cur, 4);
+                *ttl = lowest;
+                return 1;
+            }
+        } else if (type == DNS_TYPE_SOA) {
+            // The negative TTL is the lower of the SOA's own and its minimum
+            const uint8_t* soa = dns_skip_name(cur, cur + rdlength);
+            soa = soa ? dns_skip_name(soa, cur + rdlength) : NULL;
+            if (soa && soa + 20 <= cur + rdlength) {
+                uint32_t minimum = dns_read32(soa + 16);
+                *ttl = minimum < rr_ttl ? minimum : rr_ttl;
+                if (*ttl > DNS_NEGATIVE_MAX_TTL) *ttl = DNS_NEGATIVE_MAX_TTL;
+                *ip = 0;
+                return 0;
+            }
         }
 
         // Skip record data
-        cur += ntohs(rr->rdlength);
+        cur += rdlength;
     }
 
-    dns_statistics.errors++;
+    *ip = 0;
+    *ttl = DNS_NEGATIVE_DEFAULT_TTL;
     return 0;
 }
 
@@ -186,22 +254,29 @@ void dns_init(void) {
         dns_servers[num_dns_servers++] = default_dns_servers[i];
     }
 
-    // Reset statistics
+    dns_cache_flush();
+
+    // Register the counters once, then just clear them
+    if (!dns_counters.queries_sent.slot) {
+        counter_register(&dns_counters.queries_sent);
+        counter_register(&dns_counters.responses_received);
+        counter_register(&dns_counters.timeouts);
+        counter_register(&dns_counters.errors);
+        counter_register(&dns_counters.cache_hits);
+        counter_register(&dns_counters.cache_misses);
+    }
     dns_reset_stats();
 }
 
-// Main DNS resolution function
-uint32_t net_resolve_dns(const char* hostname) {
-    // Check if hostname is already an IP address
-    uint32_t ip = net_string_to_ip(hostname);
-    if (ip != 0) {
-        return ip;
-    }
+// Ask the servers in turn. The address, 0 if there is none, and how long
+// the answer may be cached.
+static uint32_t dns_query(const char* hostname, uint32_t* ttl) {
+    *ttl = DNS_FAILURE_TTL;
 
     // Create UDP socket for DNS queries
     int sock = net_socket_create(SOCKET_UDP);
     if (sock < 0) {
-        dns_statistics.errors++;
+        counter_inc(&dns_counters.errors);
         return 0;
     }
 
@@ -210,14 +285,16 @@ uint32_t net_resolve_dns(const char* hostname) {
     int query_length = dns_build_query(hostname, query_buffer, sizeof(query_buffer));
     if (query_length < 0) {
         net_socket_close(sock);
-        dns_statistics.errors++;
+        counter_inc(&dns_counters.errors);
         return 0;
     }
+    uint16_t id = ((struct dns_header*)query_buffer)->id;
 
-    dns_statistics.queries_sent++;
+    counter_inc(&dns_counters.queries_sent);
 
     // Try each DNS server
     uint8_t response_buffer[512];
+    uint32_t ip = 0;
     for (size_t i = 0; i < num_dns_servers; i++) {
         // Connect to DNS server
         if (net_socket_connect(sock, dns_servers[i], DNS_PORT) < 0) {
@@ -229,16 +306,15 @@ uint32_t net_resolve_dns(const char* hostname) {
             continue;
         }
 
-        // Receive response
+        // Wait for the response
         uint16_t response_length = sizeof(response_buffer);
-        if (net_socket_receive(sock, response_buffer, &response_length) < 0) {
-            dns_statistics.timeouts++;
+        if (net_socket_receive_timeout(sock, response_buffer, &response_length, DNS_TIMEOUT_NS) < 0) {
+            counter_inc(&dns_counters.timeouts);
             continue;
         }
 
-        // Parse response
-        ip = dns_parse_response(response_buffer, response_length);
-        if (ip != 0) {
+        // Parse response; a definite answer either way ends the search
+        if (dns_parse_response(response_buffer, response_length, id, &ip, ttl) >= 0) {
             break;
         }
     }
@@ -247,14 +323,194 @@ uint32_t net_resolve_dns(const char* hostname) {
     return ip;
 }
 
+// Cache key: lower case, without a trailing dot; false if too long
+static bool dns_normalize(const char* hostname, char* name) {
+    size_t len = 0;
+    for (; hostname[len]; len++) {
+        if (len >= DNS_MAX_NAME_LENGTH) return false;
+        char c = hostname[len];
+        name[len] = (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+    }
+    if (len && name[len - 1] == '.') len--;
+    name[len] = '\0';
+    return len > 0;
+}
+
+static uint32_t dns_name_hash(const char* name) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (; *name; name++) hash = (hash ^ (uint8_t)*name) * 16777619u;
+    return hash;
+}
+
+// dns_lock held
+static struct dns_cache_entry* dns_cache_find(const char* name, uint32_t hash) {
+    for (size_t i = 0; i < DNS_CACHE_SIZE; i++) {
+        struct dns_cache_entry* entry = &dns_cache[i];
+        if (entry->state != DNS_ENTRY_EMPTY && entry->hash == hash && strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// An empty slot, else the least recently used one nobody is querying for.
+// dns_lock held.
+static struct dns_cache_entry* dns_cache_slot(void) {
+    struct dns_cache_entry* victim = NULL;
+    for (size_t i = 0; i < DNS_CACHE_SIZE; i++) {
+        struct dns_cache_entry* entry = &dns_cache[i];
+        if (entry->state == DNS_ENTRY_EMPTY) return entry;
+        if (entry->state == DNS_ENTRY_PENDING || entry->refreshing) continue;
+        if (!victim || entry->last_used < victim->last_used) victim = entry;
+    }
+    return victim;
+}
+
+// dns_lock held
+static void dns_cache_fill(struct dns_cache_entry* entry, uint32_t ip, uint32_t ttl, uint64_t now) {
+    if (ttl > DNS_CACHE_MAX_TTL) ttl = DNS_CACHE_MAX_TTL;
+    entry->ip = ip;
+    entry->ttl_ns = (uint64_t)ttl * 1000000000ULL;
+    entry->expires = now + entry->ttl_ns;
+    entry->state = DNS_ENTRY_READY;
+}
+
+// Whether waiters on a query for name can look again
+static bool dns_settled(const char* name, uint32_t hash) {
+    spinlock_acquire(&dns_lock);
+    struct dns_cache_entry* entry = dns_cache_find(name, hash);
+    bool settled = !entry || entry->state != DNS_ENTRY_PENDING;
+    spinlock_release(&dns_lock);
+    return settled;
+}
+
+// Refresh entries hit close to expiry, so busy names never go stale
+static void dns_prefetch_func(struct work* work) {
+    (void)work;
+    for (;;) {
+        char name[DNS_MAX_NAME_LENGTH + 1];
+        struct dns_cache_entry* entry = NULL;
+        spinlock_acquire(&dns_lock);
+        for (size_t i = 0; i < DNS_CACHE_SIZE && !entry; i++) {
+            if (dns_cache[i].state == DNS_ENTRY_READY && dns_cache[i].prefetch && !dns_cache[i].refreshing) {
+                entry = &dns_cache[i];
+            }
+        }
+        if (entry) {
+            entry->prefetch = false;
+            entry->refreshing = true;
+            memcpy(name, entry->name, sizeof(name));
+        }
+        spinlock_release(&dns_lock);
+        if (!entry) return;
+
+        // Served from the old answer meanwhile; refreshing keeps the slot
+        uint32_t ttl;
+        uint32_t ip = dns_query(name, &ttl);
+        spinlock_acquire(&dns_lock);
+        dns_cache_fill(entry, ip, ttl, ktime_get_ns());
+        entry->refreshing = false;
+        spinlock_release(&dns_lock);
+    }
+}
+
+// Main DNS resolution function. Answers are cached for their TTL, missing
+// names for their negative TTL and failures briefly; lookups of a name
+// already being queried wait for that query rather than sending another.
+uint32_t net_resolve_dns(const char* hostname) {
+    if (!hostname) return 0;
+    boot_require("dns");
+
+    // Check if hostname is already an IP address
+    uint32_t ip = net_string_to_ip(hostname);
+    if (ip != 0) {
+        return ip;
+    }
+
+    char name[DNS_MAX_NAME_LENGTH + 1];
+    if (!dns_normalize(hostname, name)) {
+        counter_inc(&dns_counters.errors);
+        return 0;
+    }
+    uint32_t hash = dns_name_hash(name);
+
+    for (;;) {
+        uint64_t now = ktime_get_ns();
+        spinlock_acquire(&dns_lock);
+        struct dns_cache_entry* entry = dns_cache_find(name, hash);
+
+        if (entry && entry->state == DNS_ENTRY_READY && now < entry->expires) {
+            entry->last_used = now;
+            ip = entry->ip;
+            // Within the last tenth of a long enough TTL, refresh early
+            bool prefetch = dns_prefetch_enabled && ip && !entry->refreshing &&
+                            entry->ttl_ns >= DNS_PREFETCH_MIN_TTL * 1000000000ULL &&
+                            (entry->expires - now) * 10 < entry->ttl_ns;
+            if (prefetch) entry->prefetch = true;
+            spinlock_release(&dns_lock);
+
+            counter_inc(&dns_counters.cache_hits);
+            if (prefetch) work_schedule(&dns_prefetch_work);
+            return ip;
+        }
+
+        if (entry && entry->state == DNS_ENTRY_PENDING) {
+            // Someone is asking already; share the answer
+            spinlock_release(&dns_lock);
+            wait_event(&dns_wait, dns_settled(name, hash));
+            continue;
+        }
+
+        // Query it ourselves, holding a pending entry for others to wait on
+        if (!entry) entry = dns_cache_slot();
+        if (entry) {
+            memcpy(entry->name, name, sizeof(name));
+            entry->hash = hash;
+            entry->state = DNS_ENTRY_PENDING;
+            entry->prefetch = false;
+            entry->last_used = now;
+        }
+        spinlock_release(&dns_lock);
+        counter_inc(&dns_counters.cache_misses);
+
+        uint32_t ttl;
+        ip = dns_query(hostname, &ttl);
+        if (entry) {
+            spinlock_acquire(&dns_lock);
+            dns_cache_fill(entry, ip, ttl, ktime_get_ns());
+            spinlock_release(&dns_lock);
+            wait_queue_wake_all(&dns_wait);
+        }
+        return ip;
+    }
+}
+
+void dns_cache_flush(void) {
+    spinlock_acquire(&dns_lock);
+    for (size_t i = 0; i < DNS_CACHE_SIZE; i++) {
+        // Queries in progress finish into their slots
+        struct dns_cache_entry* entry = &dns_cache[i];
+        if (entry->state == DNS_ENTRY_READY && !entry->refreshing) entry->state = DNS_ENTRY_EMPTY;
+    }
+    spinlock_release(&dns_lock);
+}
+
+void dns_set_prefetch(bool enabled) {
+    dns_prefetch_enabled = enabled;
+}
+
 // DNS configuration functions
 void dns_set_server(uint32_t server_ip) {
+    boot_require("dns");
     if (num_dns_servers < MAX_DNS_SERVERS) {
         dns_servers[num_dns_servers++] = server_ip;
     }
+    // Answers from the old servers no longer apply
+    dns_cache_flush();
 }
 
 void dns_reset_servers(void) {
+    boot_require("dns");
     num_dns_servers = 0;
     // Restore default servers
     for (size_t i = 0; i < sizeof(default_dns_servers) / sizeof(default_dns_servers[0]); i++) {
@@ -269,10 +525,20 @@ uint32_t dns_get_primary_server(void) {
 // Statistics functions
 void dns_get_stats(dns_stats_t* stats) {
     if (stats) {
-        *stats = dns_statistics;
+        stats->queries_sent = (uint32_t)counter_read(&dns_counters.queries_sent);
+        stats->responses_received = (uint32_t)counter_read(&dns_counters.responses_received);
+        stats->timeouts = (uint32_t)counter_read(&dns_counters.timeouts);
+        stats->errors = (uint32_t)counter_read(&dns_counters.errors);
+        stats->cache_hits = (uint32_t)counter_read(&dns_counters.cache_hits);
+        stats->cache_misses = (uint32_t)counter_read(&dns_counters.cache_misses);
     }
 }
 
 void dns_reset_stats(void) {
-    memset(&dns_statistics, 0, sizeof(dns_statistics));
+    counter_reset(&dns_counters.queries_sent);
+    counter_reset(&dns_counters.responses_received);
+    counter_reset(&dns_counters.timeouts);
+    counter_reset(&dns_counters.errors);
+    counter_reset(&dns_counters.cache_hits);
+    counter_reset(&dns_counters.cache_misses);
 }
\ No newline at end of file
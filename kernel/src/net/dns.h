@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 // DNS header structure
 struct dns_header {
@@ -35,6 +36,15 @@ struct dns_resource_record {
 #define DNS_TIMEOUT_MS 5000
 #define DNS_MAX_RETRIES 3
 
+// Resolver cache. TTLs are in seconds; negative answers get the zone's SOA
+// minimum, or the default without one.
+#define DNS_CACHE_SIZE 64
+#define DNS_CACHE_MAX_TTL 86400
+#define DNS_NEGATIVE_MAX_TTL 3600
+#define DNS_NEGATIVE_DEFAULT_TTL 60
+#define DNS_FAILURE_TTL 5            // No server answered
+#define DNS_PREFETCH_MIN_TTL 10      // Shorter TTLs just expire
+
 // DNS Query Types
 #define DNS_TYPE_A     1   // IPv4 address
 #define DNS_TYPE_NS    2   // Nameserver
@@ -61,7 +71,12 @@ struct dns_resource_record {
 
 // Public DNS functions
 void dns_init(void);
+// Cached by TTL; concurrent lookups of a name share one query. 0 if the
+// name does not resolve.
 uint32_t net_resolve_dns(const char* hostname);
+void dns_cache_flush(void);
+// Refresh names hit in the last tenth of their TTL in the background; on by default
+void dns_set_prefetch(bool enabled);
 
 // DNS configuration functions
 void dns_set_server(uint32_t server_ip);
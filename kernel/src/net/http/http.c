@@ -2,6 +2,11 @@
 #include <utils/mem.h>
 #include <utils/str.h>
 #include <mm/heap.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <fs/epoll.h>
+#include <core/syscalls.h>
+#include <core/boot.h>
 
 #define HTTP_MAX_HEADERS 32
 #define HTTP_BUFFER_SIZE 4096
@@ -10,15 +15,166 @@
 
 // Helper Function
 
-static void append_string(char** buffer, size_t* capacity, size_t* length, const char* str) {
-    size_t str_len = strlen(str);
-    if (*length + str_len + 1 > *capacity) {
-        *capacity = (*capacity + str_len) * 2;
-        *buffer = realloc(*buffer, *capacity);
+// Request heads are built in the client's arena, which never grows;
+// overflow marks a head that did not fit
+struct http_arena {
+    char* data;
+    uint32_t size;
+    uint32_t length;
+    bool overflow;
+};
+
+static void arena_put(struct http_arena* arena, const void* data, size_t size) {
+    if (arena->overflow || size > arena->size - arena->length) {
+        arena->overflow = true;
+        return;
+    }
+    memcpy(arena->data + arena->length, data, size);
+    arena->length += (uint32_t)size;
+}
+
+static void arena_puts(struct http_arena* arena, const char* str) {
+    arena_put(arena, str, strlen(str));
+}
+
+static void arena_decimal(struct http_arena* arena, uint32_t value) {
+    char digits[10];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    arena_put(arena, &digits[i], sizeof(digits) - i);
+}
+
+static inline char lower(char c) {
+    return c >= 'A' && c <= 'Z' ? (char)(c + 'a' - 'A') : c;
+}
+
+// Header names and tokens compare case-insensitively
+static bool name_equal(const char* a, const char* b, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (lower(a[i]) != lower(b[i])) return false;
+    }
+    return true;
+}
+
+static bool header_is(const char* name, const char* expected) {
+    size_t length = strlen(expected);
+    return (size_t)strlen(name) == length && name_equal(name, expected, length);
+}
+
+// Whether a comma-separated header value lists token
+static bool has_token(const char* value, const char* token) {
+    size_t token_length = strlen(token);
+    while (*value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') value++;
+        const char* start = value;
+        while (*value && *value != ',' && *value != ' ' && *value != '\t' && *value != ';') value++;
+        if ((size_t)(value - start) == token_length && name_equal(start, token, token_length)) return true;
+        while (*value && *value != ',') value++;
+    }
+    return false;
+}
+
+// Connection Pool
+// An idle keep-alive connection; host is NULL for a free slot
+struct http_idle {
+    char* host;
+    uint16_t port;
+    int fd;
+    uint64_t since;
+};
+
+static struct http_idle http_pool[HTTP_POOL_SIZE];
+static spinlock_t http_pool_lock = SPINLOCK_INIT;
+
+// Empty a slot, handing back its socket to close. http_pool_lock held.
+static int pool_release(struct http_idle* idle) {
+    int fd = idle->fd;
+    free(idle->host);
+    idle->host = NULL;
+    return fd;
+}
+
+// The most recently idled connection to host:port, -1 if none. Expired
+// connections are closed on the way.
+static int pool_take(const char* host, uint16_t port) {
+    int expired[HTTP_POOL_SIZE];
+    uint32_t expired_count = 0;
+    uint64_t now = ktime_get_ns();
+    struct http_idle* best = NULL;
+
+    spinlock_acquire(&http_pool_lock);
+    for (uint32_t i = 0; i < HTTP_POOL_SIZE; i++) {
+        struct http_idle* idle = &http_pool[i];
+        if (!idle->host) continue;
+        if (now - idle->since >= HTTP_IDLE_TIMEOUT_NS) {
+            expired[expired_count++] = pool_release(idle);
+        } else if (idle->port == port && !strcmp(idle->host, host) && (!best || idle->since > best->since)) {
+            best = idle;
+        }
+    }
+    int fd = best ? pool_release(best) : -1;
+    spinlock_release(&http_pool_lock);
+
+    for (uint32_t i = 0; i < expired_count; i++) net_socket_close(expired[i]);
+    return fd;
+}
+
+// Park a finished connection. The host's oldest makes way once it has
+// HTTP_POOL_PER_HOST, and the pool's oldest once the pool is full.
+static void pool_put(const char* host, uint16_t port, int fd) {
+    char* name = strdup(host);
+    if (!name) {
+        net_socket_close(fd);
+        return;
+    }
+
+    uint64_t now = ktime_get_ns();
+    struct http_idle* free_slot = NULL;
+    struct http_idle* oldest = NULL;
+    struct http_idle* oldest_here = NULL;
+    uint32_t here = 0;
+    int evicted = -1;
+
+    spinlock_acquire(&http_pool_lock);
+    for (uint32_t i = 0; i < HTTP_POOL_SIZE; i++) {
+        struct http_idle* idle = &http_pool[i];
+        if (!idle->host) {
+            if (!free_slot) free_slot = idle;
+            continue;
+        }
+        if (!oldest || idle->since < oldest->since) oldest = idle;
+        if (idle->port == port && !strcmp(idle->host, host)) {
+            here++;
+            if (!oldest_here || idle->since < oldest_here->since) oldest_here = idle;
+        }
+    }
+    struct http_idle* slot = free_slot;
+    if (here >= HTTP_POOL_PER_HOST) slot = oldest_here;
+    else if (!slot) slot = oldest;
+    if (slot->host) evicted = pool_release(slot);
+    slot->host = name;
+    slot->port = port;
+    slot->fd = fd;
+    slot->since = now;
+    spinlock_release(&http_pool_lock);
+
+    if (evicted >= 0) net_socket_close(evicted);
+}
+
+void http_pool_flush(void) {
+    int fds[HTTP_POOL_SIZE];
+    uint32_t count = 0;
+
+    spinlock_acquire(&http_pool_lock);
+    for (uint32_t i = 0; i < HTTP_POOL_SIZE; i++) {
+        if (http_pool[i].host) fds[count++] = pool_release(&http_pool[i]);
     }
-    memcpy(*buffer + *length, str, str_len);
-    *length += str_len;
-    (*buffer)[*length] = '\0';
+    spinlock_release(&http_pool_lock);
+
+    for (uint32_t i = 0; i < count; i++) net_socket_close(fds[i]);
 }
 
 static bool http_initialized = false;
@@ -49,18 +205,25 @@ void http_shutdown(void) {
         }
     }
 
+    http_pool_flush();
     client_count = 0;
     http_initialized = false;
 }
 
 // HTTP Client functions
 http_client_t* http_client_create(void) {
+    boot_require("http");
     if (!http_initialized || client_count >= HTTP_MAX_CLIENTS) {
         return NULL;
     }
 
     http_client_t* client = malloc(sizeof(http_client_t));
     if (!client) return NULL;
+    client->arena = malloc(HTTP_HEADER_ARENA);
+    if (!client->arena) {
+        free(client);
+        return NULL;
+    }
 
     // Add to active clients
     for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
@@ -75,6 +238,8 @@ http_client_t* http_client_create(void) {
     client->host = NULL;
     client->port = 0;
     client->connected = false;
+    client->keep_alive = false;
+    client->reused = false;
 
     return client;
 }
@@ -99,12 +264,12 @@ void http_client_destroy(http_client_t* client) {
         free(client->host);
     }
 
+    free(client->arena);
     free(client);
 }
 
-int http_client_connect(http_client_t* client, const char* host, uint16_t port) {
-    if (!client || !host) return -1;
-
+// Open a new connection, skipping the pool
+static int connect_new(const char* host, uint16_t port) {
     // Create TCP socket
     int sock_fd = net_socket_create(SOCKET_TCP);
     if (sock_fd < 0) return -1;
@@ -121,12 +286,32 @@ int http_client_connect(http_client_t* client, const char* host, uint16_t port)
         net_socket_close(sock_fd);
         return -1;
     }
+    return sock_fd;
+}
 
-    // Store connection info
+int http_client_connect(http_client_t* client, const char* host, uint16_t port) {
+    if (!client || !host) return -1;
+
+    // A pooled connection, unless the server has closed it or written to
+    // it while it idled
+    int sock_fd;
+    while ((sock_fd = pool_take(host, port)) >= 0) {
+        if (!(net_socket_poll(sock_fd) & (EPOLLIN | EPOLLHUP))) break;
+        net_socket_close(sock_fd);
+    }
+    bool reused = sock_fd >= 0;
+    if (!reused) sock_fd = connect_new(host, port);
+    if (sock_fd < 0) return -1;
+
+    // Store connection info; host may be client->host itself
+    char* name = strdup(host);
+    if (client->host) free(client->host);
     client->socket = net_socket_get(sock_fd);
-    client->host = strdup(host);
+    client->host = name;
     client->port = port;
     client->connected = true;
+    client->keep_alive = true;
+    client->reused = reused;
 
     return 0;
 }
@@ -134,12 +319,18 @@ int http_client_connect(http_client_t* client, const char* host, uint16_t port)
 void http_client_disconnect(http_client_t* client) {
     if (!client || !client->connected) return;
 
+    // A connection that can take another request goes back to the pool
     if (client->socket) {
-        net_socket_close(client->socket->fd);
+        if (client->keep_alive && client->host) {
+            pool_put(client->host, client->port, client->socket->fd);
+        } else {
+            net_socket_close(client->socket->fd);
+        }
         client->socket = NULL;
     }
 
     client->connected = false;
+    client->keep_alive = false;
 }
 
 // HTTP Request functions
@@ -184,104 +375,465 @@ void http_request_add_header(http_request_t* request, const char* name, const ch
 }
 
 // HTTP Response functions
-static http_response_t* parse_response(const char* response_data, size_t length) {
+static http_response_t* response_create(void) {
     http_response_t* response = malloc(sizeof(http_response_t));
     if (!response) return NULL;
 
-    // Initialize response structure
-    response->version = NULL;
-    response->status_text = NULL;
+    memset(response, 0, sizeof(http_response_t));
     response->headers = malloc(sizeof(http_header_t) * HTTP_MAX_HEADERS);
+    if (!response->headers) {
+        free(response);
+        return NULL;
+    }
+    return response;
+}
+
+static void response_clear_headers(http_response_t* response) {
+    for (uint32_t i = 0; i < response->header_count; i++) {
+        free(response->headers[i].name);
+        free(response->headers[i].value);
+    }
     response->header_count = 0;
-    response->body = NULL;
-    response->body_length = 0;
+}
 
-    // Parse status line
-    const char* status_end = strchr(response_data, '\r');
-    if (!status_end) {
-        http_response_destroy(response);
-        return NULL;
+// Response parser
+bool http_parser_init(http_parser_t* parser, http_method_t method) {
+    memset(parser, 0, sizeof(http_parser_t));
+    parser->head = method == HTTP_HEAD;
+    parser->response = response_create();
+    if (!parser->response) parser->state = HTTP_PARSE_ERROR;
+    return parser->response != NULL;
+}
+
+// "HTTP/1.x NNN Reason"
+static bool parse_status_line(http_parser_t* parser, const char* line) {
+    http_response_t* response = parser->response;
+    const char* space = strchr(line, ' ');
+    if (memcmp(line, "HTTP/1.", 7) != 0 || !space || space - line != 8) return false;
+
+    const char* code = space + 1;
+    uint32_t status = 0;
+    for (int i = 0; i < 3; i++) {
+        if (code[i] < '0' || code[i] > '9') return false;
+        status = status * 10 + (uint32_t)(code[i] - '0');
+    }
+    if (code[3] && code[3] != ' ') return false;
+
+    char* version = malloc(9);
+    char* text = strdup(code[3] ? code + 4 : "");
+    if (!version || !text) {
+        free(version);
+        free(text);
+        return false;
+    }
+    memcpy(version, line, 8);
+    version[8] = '\0';
+    if (response->version) free(response->version);
+    if (response->status_text) free(response->status_text);
+    response->version = version;
+    response->status_text = text;
+    response->status = (http_status_t)status;
+
+    // 1.1 connections persist unless told otherwise, 1.0 ones the reverse
+    parser->keep_alive = line[7] == '1';
+    parser->chunked = false;
+    parser->remaining = 0;
+    parser->has_length = false;
+    return true;
+}
+
+static bool parse_header_line(http_parser_t* parser, char* line) {
+    // Folded continuation lines are obsolete (RFC 9112); refuse them
+    if (line[0] == ' ' || line[0] == '\t') return false;
+    char* colon = (char*)strchr(line, ':');
+    if (!colon || colon == line) return false;
+    *colon = '\0';
+
+    char* value = colon + 1;
+    while (*value == ' ' || *value == '\t') value++;
+    size_t value_length = strlen(value);
+    while (value_length && (value[value_length - 1] == ' ' || value[value_length - 1] == '\t')) {
+        value[--value_length] = '\0';
     }
 
-    // Parse headers and body
-    const char* current = status_end + 2;
-    const char* headers_end = strstr(current, "\r\n\r\n");
-    if (!headers_end) {
-        http_response_destroy(response);
-        return NULL;
+    if (header_is(line, "Content-Length")) {
+        uint64_t length = 0;
+        if (!*value) return false;
+        for (const char* c = value; *c; c++) {
+            if (*c < '0' || *c > '9' || length > HTTP_MAX_STREAM) return false;
+            length = length * 10 + (uint64_t)(*c - '0');
+        }
+        // Conflicting lengths make the framing ambiguous
+        if (parser->has_length && parser->remaining != length) return false;
+        parser->remaining = length;
+        parser->has_length = true;
+    } else if (header_is(line, "Transfer-Encoding")) {
+        parser->chunked = has_token(value, "chunked");
+    } else if (header_is(line, "Connection")) {
+        if (has_token(value, "close")) parser->keep_alive = false;
+        else if (has_token(value, "keep-alive")) parser->keep_alive = true;
     }
 
-    // Parse body
-    const char* body_start = headers_end + 4;
-    size_t body_length = length - (body_start - response_data);
+    http_response_t* response = parser->response;
+    if (response->header_count < HTTP_MAX_HEADERS) {
+        http_header_t* header = &response->headers[response->header_count];
+        header->name = strdup(line);
+        header->value = strdup(value);
+        if (!header->name || !header->value) {
+            free(header->name);
+            free(header->value);
+            return false;
+        }
+        response->header_count++;
+    }
+    return true;
+}
+
+// The blank line after the headers: decide how the body is framed
+static bool headers_done(http_parser_t* parser) {
+    http_response_t* response = parser->response;
+    uint32_t status = response->status;
 
-    if (body_length > 0) {
-        response->body = malloc(body_length);
-        if (response->body) {
-            memcpy(response->body, body_start, body_length);
-            response->body_length = body_length;
+    // Interim responses come before the real one
+    if (status >= 100 && status < 200 && status != 101) {
+        response_clear_headers(response);
+        parser->state = HTTP_PARSE_STATUS;
+        return true;
+    }
+    if (status == 101) parser->keep_alive = false;
+    if (parser->head || status < 200 || status == 204 || status == 304) {
+        parser->state = HTTP_PARSE_DONE;
+        return true;
+    }
+
+    // Chunking overrides any length (RFC 9112 6.3)
+    if (parser->chunked) {
+        parser->state = HTTP_PARSE_CHUNK_SIZE;
+    } else if (parser->has_length) {
+        parser->state = parser->remaining ? HTTP_PARSE_BODY : HTTP_PARSE_DONE;
+        if (parser->remaining && !parser->on_body) {
+            // Known up front, so one allocation holds it
+            if (parser->remaining > HTTP_MAX_BODY) return false;
+            response->body = malloc((size_t)parser->remaining + 1);
+            if (!response->body) return false;
+            parser->body_capacity = (uint32_t)parser->remaining + 1;
         }
+    } else {
+        parser->until_close = true;
+        parser->keep_alive = false;
+        parser->state = HTTP_PARSE_BODY;
     }
+    return true;
+}
 
-    return response;
+static bool body_append(http_parser_t* parser, const uint8_t* data, uint32_t length) {
+    if (parser->on_body) return parser->on_body(parser->body_ctx, data, length);
+
+    http_response_t* response = parser->response;
+    if (response->body_length + length > HTTP_MAX_BODY) return false;
+
+    // Room for a terminator too, for callers treating it as text
+    uint32_t needed = response->body_length + length + 1;
+    if (needed > parser->body_capacity) {
+        uint32_t capacity = parser->body_capacity ? parser->body_capacity : HTTP_BUFFER_SIZE;
+        while (capacity < needed) capacity *= 2;
+        uint8_t* body = realloc(response->body, capacity);
+        if (!body) return false;
+        response->body = body;
+        parser->body_capacity = capacity;
+    }
+    memcpy(response->body + response->body_length, data, length);
+    response->body_length += length;
+    response->body[response->body_length] = '\0';
+    return true;
 }
 
-http_response_t* http_send_request(http_client_t* client, http_request_t* request) {
-    if (!client || !request || !client->connected) return NULL;
+// Hex size, then optional extensions after ';'
+static bool parse_chunk_size(http_parser_t* parser, const char* line) {
+    uint64_t size = 0;
+    const char* c = line;
+    for (; *c; c++) {
+        char digit = lower(*c);
+        uint32_t value;
+        if (digit >= '0' && digit <= '9') value = (uint32_t)(digit - '0');
+        else if (digit >= 'a' && digit <= 'f') value = (uint32_t)(digit - 'a' + 10);
+        else break;
+        if (size > HTTP_MAX_STREAM) return false;
+        size = size * 16 + value;
+    }
+    if (c == line) return false;
+    while (*c == ' ' || *c == '\t') c++;
+    if (*c && *c != ';') return false;
+
+    parser->remaining = size;
+    parser->state = size ? HTTP_PARSE_CHUNK_DATA : HTTP_PARSE_TRAILERS;
+    return true;
+}
+
+static bool parse_line(http_parser_t* parser, char* line) {
+    switch (parser->state) {
+        case HTTP_PARSE_STATUS:
+            // Stray blank lines before a response are tolerated
+            if (!line[0]) return true;
+            if (!parse_status_line(parser, line)) return false;
+            parser->state = HTTP_PARSE_HEADERS;
+            return true;
+        case HTTP_PARSE_HEADERS:
+            return line[0] ? parse_header_line(parser, line) : headers_done(parser);
+        case HTTP_PARSE_CHUNK_SIZE:
+            return parse_chunk_size(parser, line);
+        case HTTP_PARSE_CHUNK_END:
+            if (line[0]) return false;
+            parser->state = HTTP_PARSE_CHUNK_SIZE;
+            return true;
+        case HTTP_PARSE_TRAILERS:
+            // Trailer fields are read past, not kept
+            if (!line[0]) parser->state = HTTP_PARSE_DONE;
+            return true;
+        default:
+            return false;
+    }
+}
+
+int http_parser_feed(http_parser_t* parser, const uint8_t* data, uint32_t length) {
+    uint32_t used = 0;
+    while (used < length && parser->state < HTTP_PARSE_DONE) {
+        if (parser->state == HTTP_PARSE_BODY || parser->state == HTTP_PARSE_CHUNK_DATA) {
+            uint32_t take = length - used;
+            if (!parser->until_close && take > parser->remaining) take = (uint32_t)parser->remaining;
+            if (!body_append(parser, data + used, take)) {
+                parser->state = HTTP_PARSE_ERROR;
+                break;
+            }
+            used += take;
+            if (!parser->until_close) {
+                parser->remaining -= take;
+                if (!parser->remaining) {
+                    parser->state = parser->state == HTTP_PARSE_BODY ? HTTP_PARSE_DONE : HTTP_PARSE_CHUNK_END;
+                }
+            }
+            continue;
+        }
+
+        // Everything else comes in CRLF-terminated lines
+        char c = (char)data[used++];
+        if (c == '\n') {
+            if (parser->line_length && parser->line[parser->line_length - 1] == '\r') parser->line_length--;
+            parser->line[parser->line_length] = '\0';
+            parser->line_length = 0;
+            if (!parse_line(parser, parser->line)) parser->state = HTTP_PARSE_ERROR;
+            continue;
+        }
+        if (parser->line_length >= HTTP_MAX_LINE - 1) {
+            parser->state = HTTP_PARSE_ERROR;
+            break;
+        }
+        parser->line[parser->line_length++] = c;
+    }
+    return parser->state == HTTP_PARSE_ERROR ? -1 : (int)used;
+}
 
-    // Build request string
-    char* request_str = NULL;
-    size_t capacity = HTTP_BUFFER_SIZE;
-    size_t length = 0;
+bool http_parser_finish(http_parser_t* parser) {
+    if (parser->state == HTTP_PARSE_BODY && parser->until_close) parser->state = HTTP_PARSE_DONE;
+    else if (parser->state != HTTP_PARSE_DONE) parser->state = HTTP_PARSE_ERROR;
+    return parser->state == HTTP_PARSE_DONE;
+}
 
-    request_str = malloc(capacity);
-    if (!request_str) return NULL;
+http_response_t* http_parser_take(http_parser_t* parser) {
+    if (parser->state != HTTP_PARSE_DONE) return NULL;
+    http_response_t* response = parser->response;
+    parser->response = NULL;
+    return response;
+}
 
+void http_parser_destroy(http_parser_t* parser) {
+    http_response_destroy(parser->response);
+    parser->response = NULL;
+}
+
+const char* http_response_header(const http_response_t* response, const char* name) {
+    if (!response || !name) return NULL;
+    for (uint32_t i = 0; i < response->header_count; i++) {
+        if (header_is(response->headers[i].name, name)) return response->headers[i].value;
+    }
+    return NULL;
+}
+
+// Add one request head to the arena, filling in Host and Content-Length
+// when the caller has not; false if it does not fit
+static bool format_head(http_client_t* client, http_request_t* request, struct http_arena* arena) {
     // Add request line
-    append_string(&request_str, &capacity, &length, http_method_string(request->method));
-    append_string(&request_str, &capacity, &length, " ");
-    append_string(&request_str, &capacity, &length, request->url);
-    append_string(&request_str, &capacity, &length, " ");
-    append_string(&request_str, &capacity, &length, request->version);
-    append_string(&request_str, &capacity, &length, "\r\n");
+    arena_puts(arena, http_method_string(request->method));
+    arena_puts(arena, " ");
+    arena_puts(arena, request->url);
+    arena_puts(arena, " ");
+    arena_puts(arena, request->version);
+    arena_puts(arena, "\r\n");
 
     // Add headers
+    bool has_host = false;
+    bool has_length = false;
     for (uint32_t i = 0; i < request->header_count; i++) {
-        append_string(&request_str, &capacity, &length, request->headers[i].name);
-        append_string(&request_str, &capacity, &length, ": ");
-        append_string(&request_str, &capacity, &length, request->headers[i].value);
-        append_string(&request_str, &capacity, &length, "\r\n");
+        has_host |= header_is(request->headers[i].name, "Host");
+        has_length |= header_is(request->headers[i].name, "Content-Length");
+        arena_puts(arena, request->headers[i].name);
+        arena_puts(arena, ": ");
+        arena_puts(arena, request->headers[i].value);
+        arena_puts(arena, "\r\n");
+    }
+    if (!has_host && client->host) {
+        arena_puts(arena, "Host: ");
+        arena_puts(arena, client->host);
+        arena_puts(arena, "\r\n");
+    }
+    if (!has_length && request->body_length) {
+        arena_puts(arena, "Content-Length: ");
+        arena_decimal(arena, request->body_length);
+        arena_puts(arena, "\r\n");
     }
 
     // Add blank line to separate headers from body
-    append_string(&request_str, &capacity, &length, "\r\n");
+    arena_puts(arena, "\r\n");
+    return !arena->overflow;
+}
 
-    // Send request
-    if (net_socket_send(client->socket->fd, request_str, length) < 0) {
-        free(request_str);
-        return NULL;
+// A response being read straight out of the socket
+struct http_stream {
+    http_parser_t* parser;
+    bool received;          // Any of it arrived
+};
+
+static uint32_t stream_consume(void* ctx, const uint8_t* data, uint32_t length) {
+    struct http_stream* stream = ctx;
+    stream->received = true;
+    int used = http_parser_feed(stream->parser, data, length);
+    return used < 0 ? 0 : (uint32_t)used;
+}
+
+// Send as many requests as the arena holds heads for, heads and bodies
+// gathered into one write, then parse each response in turn off the
+// socket's buffer; what follows one response stays there for the next.
+// *batch gets the number sent.
+static uint32_t exchange(http_client_t* client, http_request_t** requests, uint32_t count,
+                         http_response_t** responses, http_body_cb on_body, void* ctx,
+                         uint32_t* batch, bool* received) {
+    int fd = client->socket->fd;
+    struct http_arena arena = { client->arena, HTTP_HEADER_ARENA, 0, false };
+    struct iovec iov[2 * HTTP_MAX_PIPELINE];
+    int segments = 0;
+
+    *batch = 0;
+    *received = false;
+    if (count > HTTP_MAX_PIPELINE) count = HTTP_MAX_PIPELINE;
+    while (*batch < count) {
+        http_request_t* request = requests[*batch];
+        uint32_t head = arena.length;
+        if (!format_head(client, request, &arena)) break;
+        iov[segments].iov_base = client->arena + head;
+        iov[segments++].iov_len = arena.length - head;
+        if (request->body && request->body_length) {
+            iov[segments].iov_base = request->body;
+            iov[segments++].iov_len = request->body_length;
+        }
+        (*batch)++;
     }
+    if (!*batch) return 0;
 
-    // Add body if present
-    if (request->body && request->body_length > 0) {
-        if (net_socket_send(client->socket->fd, request->body, request->body_length) < 0) {
-            free(request_str);
-            return NULL;
+    if (net_socket_sendv(fd, iov, segments) < 0) {
+        client->keep_alive = false;
+        return 0;
+    }
+
+    // Receive responses
+    http_parser_t* parser = malloc(sizeof(http_parser_t));
+    if (!parser) {
+        client->keep_alive = false;
+        return 0;
+    }
+
+    struct http_stream stream = { parser, false };
+    uint32_t done = 0;
+    bool closed = false;
+    bool keep_alive = true;
+    while (done < *batch && !closed && keep_alive) {
+        http_parser_init(parser, requests[done]->method);
+        parser->on_body = on_body;
+        parser->body_ctx = ctx;
+        while (parser->state < HTTP_PARSE_DONE) {
+            int used = net_socket_receive_direct(fd, stream_consume, &stream);
+            if (used < 0) {
+                parser->state = HTTP_PARSE_ERROR;
+                closed = true;
+            } else if (!used && parser->state != HTTP_PARSE_ERROR) {
+                // End of stream, which ends some bodies
+                http_parser_finish(parser);
+                closed = true;
+            }
         }
+
+        // Whatever was pipelined behind a closing response is lost with it
+        responses[done] = http_parser_take(parser);
+        keep_alive = parser->keep_alive;
+        http_parser_destroy(parser);
+        if (!responses[done]) break;
+        done++;
     }
+    free(parser);
+    *received = stream.received;
 
-    free(request_str);
+    if (done < *batch || closed || !keep_alive) client->keep_alive = false;
+    return done;
+}
 
-    // Receive response
-    char response_buffer[HTTP_BUFFER_SIZE];
-    uint16_t received = HTTP_BUFFER_SIZE;
+// Whole batches until one comes up short
+static uint32_t send_batches(http_client_t* client, http_request_t** requests, uint32_t count,
+                             http_response_t** responses, http_body_cb on_body, void* ctx) {
+    if (!client || !requests || !responses || !client->connected || !client->socket) return 0;
+    for (uint32_t i = 0; i < count; i++) responses[i] = NULL;
+
+    uint32_t done = 0;
+    while (done < count) {
+        // A connection that cannot take more is replaced
+        if (!client->keep_alive) {
+            http_client_disconnect(client);
+            if (http_client_connect(client, client->host, client->port) < 0) break;
+        }
 
-    if (net_socket_receive(client->socket->fd, response_buffer, &received) < 0) {
-        return NULL;
+        bool reused = client->reused;
+        uint32_t batch;
+        bool received;
+        uint32_t answered = exchange(client, requests + done, count - done, responses + done,
+                                     on_body, ctx, &batch, &received);
+        done += answered;
+
+        // A pooled connection the server closed just as it was reused gets
+        // the batch again on a fresh one; otherwise stop at the first loss
+        if (!received && reused && batch) {
+            client->reused = false;
+            continue;
+        }
+        if (!batch || answered < batch) break;
     }
+    return done;
+}
+
+http_response_t* http_send_request(http_client_t* client, http_request_t* request) {
+    http_response_t* response = NULL;
+    send_batches(client, &request, 1, &response, NULL, NULL);
+    return response;
+}
+
+uint32_t http_send_pipelined(http_client_t* client, http_request_t** requests, uint32_t count,
+                             http_response_t** responses) {
+    return send_batches(client, requests, count, responses, NULL, NULL);
+}
 
-    // Parse response
-    return parse_response(response_buffer, received);
+http_response_t* http_stream_request(http_client_t* client, http_request_t* request,
+                                     http_body_cb on_body, void* ctx) {
+    if (!on_body) return NULL;
+    http_response_t* response = NULL;
+    send_batches(client, &request, 1, &response, on_body, ctx);
+    return response;
 }
 
 void http_response_destroy(http_response_t* response) {
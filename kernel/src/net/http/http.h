@@ -57,14 +57,61 @@ typedef struct {
     uint32_t body_length;
 } http_response_t;
 
+// Connection reuse. Finished keep-alive connections wait in a pool for the
+// next client to connect to the same host, until they have idled too long.
+#define HTTP_POOL_SIZE          16
+#define HTTP_POOL_PER_HOST      4
+#define HTTP_IDLE_TIMEOUT_NS    30000000000ULL
+#define HTTP_MAX_PIPELINE       16      // Requests in flight on one connection
+#define HTTP_MAX_LINE           1024    // Status, header or chunk-size line
+#define HTTP_MAX_BODY           (16U << 20)     // Collected in memory
+#define HTTP_MAX_STREAM         (1ULL << 48)    // Streamed to a callback
+#define HTTP_HEADER_ARENA       8192            // Request heads of a batch
+
 // HTTP Client context
 typedef struct {
     net_socket* socket;
     char* host;
     uint16_t port;
     bool connected;
+    bool keep_alive;        // The server will take another request
+    bool reused;            // Came out of the pool
+    char* arena;            // HTTP_HEADER_ARENA bytes for request heads
 } http_client_t;
 
+// Body bytes as they arrive, straight from the socket's receive buffer;
+// false abandons the response
+typedef bool (*http_body_cb)(void* ctx, const uint8_t* data, uint32_t length);
+
+// Incremental response parser, fed whatever each receive returns
+typedef enum {
+    HTTP_PARSE_STATUS,
+    HTTP_PARSE_HEADERS,
+    HTTP_PARSE_BODY,
+    HTTP_PARSE_CHUNK_SIZE,
+    HTTP_PARSE_CHUNK_DATA,
+    HTTP_PARSE_CHUNK_END,
+    HTTP_PARSE_TRAILERS,
+    HTTP_PARSE_DONE,
+    HTTP_PARSE_ERROR
+} http_parse_state_t;
+
+typedef struct {
+    http_parse_state_t state;
+    http_response_t* response;
+    bool head;              // Answering a HEAD: never a body
+    bool chunked;
+    bool has_length;        // Content-Length seen
+    bool until_close;       // Body ends with the connection
+    bool keep_alive;
+    uint64_t remaining;     // Of the body or the current chunk
+    uint32_t body_capacity;
+    http_body_cb on_body;   // If set, the body goes here and is not kept
+    void* body_ctx;
+    uint32_t line_length;
+    char line[HTTP_MAX_LINE];
+} http_parser_t;
+
 // Function declarations
 bool http_init(void);
 void http_shutdown(void);
@@ -79,7 +126,31 @@ void http_request_destroy(http_request_t* request);
 void http_request_add_header(http_request_t* request, const char* name, const char* value);
 
 http_response_t* http_send_request(http_client_t* client, http_request_t* request);
+// Send count requests back to back and read their responses in order;
+// returns how many arrived. Only idempotent requests should share a batch.
+uint32_t http_send_pipelined(http_client_t* client, http_request_t** requests, uint32_t count,
+                             http_response_t** responses);
+// One request whose body, if any, is sent from where it lies, and whose
+// response body goes to on_body as it arrives instead of into memory; the
+// response returned has headers only
+http_response_t* http_stream_request(http_client_t* client, http_request_t* request,
+                                     http_body_cb on_body, void* ctx);
 void http_response_destroy(http_response_t* response);
+// A response header by name, case-insensitively; NULL if absent
+const char* http_response_header(const http_response_t* response, const char* name);
+
+// Parse a response out of a byte stream. feed returns the bytes used, which
+// stop short once the response is complete; the rest begin the next one.
+// finish is for the end of the stream and says whether that completed it.
+bool http_parser_init(http_parser_t* parser, http_method_t method);
+int http_parser_feed(http_parser_t* parser, const uint8_t* data, uint32_t length);
+bool http_parser_finish(http_parser_t* parser);
+// The parsed response, handed over; NULL unless parsing completed
+http_response_t* http_parser_take(http_parser_t* parser);
+void http_parser_destroy(http_parser_t* parser);
+
+// Close idle pooled connections
+void http_pool_flush(void);
 
 // Helper functions
 const char* http_status_text(http_status_t status);
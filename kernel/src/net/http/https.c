@@ -1,10 +1,14 @@
 #include <net/http/http.h>
 #include <net/http/https.h>
 #include <net/net.h>
+#include <net/crypto/sha2.h>
 #include <utils/mem.h>
 #include <utils/str.h>
 #include <utils/io.h>
 #include <mm/heap.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <core/boot.h>
 
 // Global TLS state
 static bool https_initialized = false;
@@ -56,17 +60,20 @@ static int sprintf(char* buffer, const char* format, ...) {
     return written;
 }
 
-// Supported cipher suites
+// Supported cipher suites, in order of preference
 static const uint16_t supported_ciphers[] = {
-    0x002F,  // TLS_RSA_WITH_AES_128_CBC_SHA
-    0xC02F   // TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256
+    TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256
 };
 
-// Utility function for XOR encryption (simplified)
-static void simple_xor_encrypt(uint8_t* data, size_t length, const uint8_t* key, size_t key_length) {
-    for (size_t i = 0; i < length; i++) {
-        data[i] ^= key[i % key_length];
-    }
+static inline void put_be16(uint8_t* p, uint16_t value) {
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+}
+
+static inline void put_be64(uint8_t* p, uint64_t value) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(value >> (56 - 8 * i));
 }
 
 // Global HTTPS state
@@ -151,6 +158,7 @@ bool tls_generate_random(uint8_t* random_bytes, size_t length) {
 
 // Create a TLS context
 tls_context_t* tls_create_context(void) {
+    boot_require("tls");
     if (!https_initialized) return NULL;
 
     tls_context_t* context = malloc(sizeof(tls_context_t));
@@ -197,6 +205,9 @@ void tls_destroy_context(tls_context_t* context) {
         memset(context->master_secret, 0, 48);
         free(context->master_secret);
     }
+    aead_clear(&context->tx.aead);
+    aead_clear(&context->rx.aead);
+    memset(&context->session, 0, sizeof(tls_session_t));
 
     free(context);
 }
@@ -219,74 +230,222 @@ void tls_cleanup(void) {
     }
 
     // Clean up any global TLS resources
+    tls_session_flush();
     https_initialized = false;
 }
 
-// Send a TLS record
-int tls_send_record(tls_context_t* context, uint8_t type, const void* data, size_t length) {
-    if (!context || !context->socket || !data) return -1;
+// Client session cache. Small enough that a scan beats a hash table;
+// when full, the least recently used entry goes.
+static tls_session_t session_cache[TLS_SESSION_CACHE_SIZE];
+static spinlock_t session_lock = SPINLOCK_INIT;
 
-    // Prepare TLS record header
-    tls_record_header_t header = {
-        .type = type,
-        .version = 0x0303,  // TLS 1.2
-        .length = (uint16_t)length
-    };
+static tls_session_t* session_find(const char* host, uint16_t port) {
+    for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+        tls_session_t* entry = &session_cache[i];
+        if (entry->valid && entry->port == port && strcmp(entry->host, host) == 0) return entry;
+    }
+    return NULL;
+}
+
+bool tls_session_lookup(const char* host, uint16_t port, tls_session_t* session) {
+    if (!host || !session) return false;
+
+    uint64_t now = ktime_get_ns();
+    bool found = false;
+    spinlock_acquire(&session_lock);
+    tls_session_t* entry = session_find(host, port);
+    if (entry && entry->expires <= now) {
+        memset(entry, 0, sizeof(tls_session_t));
+    } else if (entry) {
+        entry->last_used = now;
+        memcpy(session, entry, sizeof(tls_session_t));
+        found = true;
+    }
+    spinlock_release(&session_lock);
+    return found;
+}
+
+void tls_session_store(const tls_session_t* session) {
+    if (!session || !session->host[0]) return;
+
+    uint64_t now = ktime_get_ns();
+    spinlock_acquire(&session_lock);
+    tls_session_t* slot = session_find(session->host, session->port);
+    for (int i = 0; !slot && i < TLS_SESSION_CACHE_SIZE; i++) {
+        tls_session_t* entry = &session_cache[i];
+        if (!entry->valid || entry->expires <= now) slot = entry;
+    }
+    if (!slot) {
+        slot = &session_cache[0];
+        for (int i = 1; i < TLS_SESSION_CACHE_SIZE; i++) {
+            if (session_cache[i].last_used < slot->last_used) slot = &session_cache[i];
+        }
+    }
+    memcpy(slot, session, sizeof(tls_session_t));
+    slot->last_used = now;
+    slot->valid = true;
+    spinlock_release(&session_lock);
+}
+
+void tls_session_remove(const char* host, uint16_t port) {
+    if (!host) return;
+
+    spinlock_acquire(&session_lock);
+    tls_session_t* entry = session_find(host, port);
+    if (entry) memset(entry, 0, sizeof(tls_session_t));
+    spinlock_release(&session_lock);
+}
 
-    // Buffer to hold entire record
-    void* record_buffer = malloc(sizeof(header) + length);
-    if (!record_buffer) return -1;
+void tls_session_flush(void) {
+    spinlock_acquire(&session_lock);
+    memset(session_cache, 0, sizeof(session_cache));
+    spinlock_release(&session_lock);
+}
 
-    // Copy header and data
-    memcpy(record_buffer, &header, sizeof(header));
-    memcpy((uint8_t*)record_buffer + sizeof(header), data, length);
+// Bytes a protected record adds around its plaintext
+static size_t tls_record_overhead(const tls_cipher_state_t* state) {
+    if (!state->active) return 0;
+    if (state->aead.algorithm == AEAD_CHACHA20_POLY1305) return AEAD_TAG_SIZE;
+    return TLS_EXPLICIT_NONCE_SIZE + AEAD_TAG_SIZE;
+}
 
-    // Encrypt if handshake is complete
-    if (context->handshake_complete && context->session_key) {
-        simple_xor_encrypt((uint8_t*)record_buffer + sizeof(header), length,
-                            context->session_key, 32);
+// GCM sends salt || sequence explicitly; ChaCha20-Poly1305 XORs the
+// sequence into its IV (RFC 7905)
+static void tls_record_nonce(const tls_cipher_state_t* state, uint8_t nonce[AEAD_NONCE_SIZE]) {
+    if (state->aead.algorithm == AEAD_CHACHA20_POLY1305) {
+        memcpy(nonce, state->iv, AEAD_NONCE_SIZE);
+        for (int i = 0; i < 8; i++) nonce[4 + i] ^= (uint8_t)(state->sequence >> (56 - 8 * i));
+    } else {
+        memcpy(nonce, state->iv, 4);
+        put_be64(nonce + 4, state->sequence);
     }
+}
+
+// seq_num || type || version || plaintext length
+static void tls_additional_data(uint8_t aad[13], uint64_t sequence, uint8_t type, size_t length) {
+    put_be64(aad, sequence);
+    aad[8] = type;
+    aad[9] = 0x03;
+    aad[10] = 0x03;
+    put_be16(aad + 11, (uint16_t)length);
+}
+
+// Send a TLS record, split into as many records as the length needs.
+// All of them are sealed in place in one buffer and sent together.
+int tls_send_record(tls_context_t* context, uint8_t type, const void* data, size_t length) {
+    if (!context || !context->socket || (!data && length)) return -1;
+
+    tls_cipher_state_t* tx = &context->tx;
+    size_t overhead = TLS_RECORD_HEADER_SIZE + tls_record_overhead(tx);
+    size_t records = length ? (length + TLS_MAX_PLAINTEXT - 1) / TLS_MAX_PLAINTEXT : 1;
+    size_t total = length + records * overhead;
+    if (total > 0xFFFFFFFF) return -1;
+
+    uint8_t* out = malloc(total);
+    if (!out) return -1;
+
+    const uint8_t* in = data;
+    size_t left = length;
+    uint8_t* record = out;
+    do {
+        size_t chunk = left < TLS_MAX_PLAINTEXT ? left : TLS_MAX_PLAINTEXT;
+        uint8_t* payload = record + TLS_RECORD_HEADER_SIZE;
+        if (tx->active && tx->aead.algorithm != AEAD_CHACHA20_POLY1305) {
+            put_be64(payload, tx->sequence);
+            payload += TLS_EXPLICIT_NONCE_SIZE;
+        }
+        if (chunk) memcpy(payload, in, chunk);
+
+        size_t record_length = chunk + tls_record_overhead(tx);
+        record[0] = type;
+        record[1] = 0x03;  // TLS 1.2
+        record[2] = 0x03;
+        put_be16(record + 3, (uint16_t)record_length);
+
+        if (tx->active) {
+            uint8_t nonce[AEAD_NONCE_SIZE];
+            uint8_t aad[13];
+            tls_record_nonce(tx, nonce);
+            tls_additional_data(aad, tx->sequence, type, chunk);
+            aead_seal(&tx->aead, nonce, aad, sizeof(aad), payload, chunk, payload + chunk);
+            tx->sequence++;
+        }
+
+        record += TLS_RECORD_HEADER_SIZE + record_length;
+        in += chunk;
+        left -= chunk;
+    } while (left);
 
-    // Send record
-    int result = net_socket_send(context->socket->fd, record_buffer,
-                                  sizeof(header) + length);
+    int result = net_socket_send(context->socket->fd, out, (uint32_t)(record - out));
 
-    free(record_buffer);
-    return result;
+    free(out);
+    return result < 0 ? -1 : (int)length;
 }
 
-// Receive a TLS record
+// Read exactly length bytes of the stream
+static bool tls_read_full(tls_context_t* context, uint8_t* buffer, size_t length) {
+    while (length) {
+        uint16_t chunk = length > 0xFFFF ? 0xFFFF : (uint16_t)length;
+        if (net_socket_receive_wait(context->socket->fd, buffer, &chunk) < 0 || chunk == 0) {
+            return false;
+        }
+        buffer += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+// Receive a TLS record. A protected one is authenticated and then
+// decrypted in place in the caller's buffer.
 int tls_receive_record(tls_context_t* context, uint8_t* type, void* buffer, size_t* length) {
     if (!context || !context->socket || !type || !buffer || !length) return -1;
 
-    // Convert size_t length to uint16_t for net_socket_receive
-    uint16_t record_length = *length > 0xFFFF ? 0xFFFF : (uint16_t)*length;
+    uint8_t header[TLS_RECORD_HEADER_SIZE];
+    if (!tls_read_full(context, header, sizeof(header))) return -1;
 
-    // Receive record header first
-    tls_record_header_t header;
-    uint16_t header_len = sizeof(header);
-    if (net_socket_receive(context->socket->fd, &header, &header_len) < 0) {
-        return -1;
-    }
+    tls_cipher_state_t* rx = &context->rx;
+    size_t record_length = (size_t)header[3] << 8 | header[4];
+    size_t overhead = tls_record_overhead(rx);
+    if (record_length < overhead) return -1;
 
-    // Validate record
-    if (header.length > record_length) {
-        *length = header.length;
+    size_t plaintext = record_length - overhead;
+    if (plaintext > TLS_MAX_PLAINTEXT) return -1;
+    if (plaintext > *length) {
+        *length = plaintext;
         return -1;  // Buffer too small
     }
 
-    // Prepare length for receiving payload
-    record_length = header.length;
+    if (!rx->active) {
+        if (!tls_read_full(context, buffer, plaintext)) return -1;
+        *length = plaintext;
+        *type = header[0];
+        return 0;
+    }
 
-    // Receive record payload
-    if (net_socket_receive(context->socket->fd, buffer, &record_length) < 0) {
+    // Explicit nonce and tag land beside the caller's buffer, not in it
+    uint8_t explicit_nonce[TLS_EXPLICIT_NONCE_SIZE];
+    uint8_t tag[AEAD_TAG_SIZE];
+    uint8_t nonce[AEAD_NONCE_SIZE];
+    if (rx->aead.algorithm == AEAD_CHACHA20_POLY1305) {
+        tls_record_nonce(rx, nonce);
+    } else {
+        if (!tls_read_full(context, explicit_nonce, sizeof(explicit_nonce))) return -1;
+        memcpy(nonce, rx->iv, 4);
+        memcpy(nonce + 4, explicit_nonce, sizeof(explicit_nonce));
+    }
+    if (!tls_read_full(context, buffer, plaintext) || !tls_read_full(context, tag, sizeof(tag))) {
         return -1;
     }
 
-    // Update length with actual received bytes
-    *length = record_length;
-    *type = header.type;
+    uint8_t aad[13];
+    tls_additional_data(aad, rx->sequence, header[0], plaintext);
+    if (!aead_open(&rx->aead, nonce, aad, sizeof(aad), buffer, plaintext, tag)) {
+        return -1;  // bad_record_mac
+    }
+    rx->sequence++;
 
+    *length = plaintext;
+    *type = header[0];
     return 0;
 }
 
@@ -295,28 +454,19 @@ bool tls_client_hello(tls_context_t* context) {
     if (!context || !context->is_client) return false;
 
     // Allocate buffer for ClientHello message
-    uint8_t* hello_msg = malloc(512);  // Sufficient buffer for ClientHello
+    uint8_t* hello_msg = malloc(512 + TLS_SESSION_TICKET_MAX);  // Sufficient buffer for ClientHello
     if (!hello_msg) return false;
 
     // Prepare ClientHello
     size_t msg_pos = 0;
 
-    // TLS Record Header (placeholder)
-    tls_record_header_t record_header = {
-        .type = TLS_RECORD_HANDSHAKE,
-        .version = 0x0303,  // TLS 1.2
-        .length = 0
-    };
-
-    // Handshake Header
+    // Handshake Header; tls_send_record() adds the record header
     tls_handshake_header_t handshake_header = {
         .type = TLS_CLIENT_HELLO,
         .length = {0, 0, 0}
     };
 
-    // Copy headers with space to update later
-    memcpy(hello_msg, &record_header, sizeof(record_header));
-    msg_pos += sizeof(record_header);
+    // Copy header with space to update later
     memcpy(hello_msg + msg_pos, &handshake_header, sizeof(handshake_header));
     msg_pos += sizeof(handshake_header);
 
@@ -328,28 +478,45 @@ bool tls_client_hello(tls_context_t* context) {
     memcpy(hello_msg + msg_pos, context->client_random, 32);
     msg_pos += 32;
 
-    // Session ID (0 length)
-    hello_msg[msg_pos++] = 0x00;
+    // Session ID: the cached one, or with only a ticket a fresh one that a
+    // resuming server echoes back (RFC 5077 section 3.4)
+    tls_session_t* session = &context->session;
+    if (session->ticket_length && !session->session_id_length) {
+        tls_generate_random(session->session_id, TLS_SESSION_ID_MAX);
+        session->session_id_length = TLS_SESSION_ID_MAX;
+    }
+    hello_msg[msg_pos++] = session->session_id_length;
+    memcpy(hello_msg + msg_pos, session->session_id, session->session_id_length);
+    msg_pos += session->session_id_length;
 
     // Cipher suites
     hello_msg[msg_pos++] = 0x00;
     hello_msg[msg_pos++] = sizeof(supported_ciphers);
-    memcpy(hello_msg + msg_pos, supported_ciphers, sizeof(supported_ciphers));
-    msg_pos += sizeof(supported_ciphers);
+    for (size_t i = 0; i < sizeof(supported_ciphers) / sizeof(supported_ciphers[0]); i++) {
+        put_be16(hello_msg + msg_pos, supported_ciphers[i]);
+        msg_pos += 2;
+    }
 
     // Compression methods
     hello_msg[msg_pos++] = 0x01;  // Length
     hello_msg[msg_pos++] = 0x00;  // No compression
 
-    // Update lengths
-    record_header.length = msg_pos - sizeof(record_header);
-    handshake_header.length[0] = (record_header.length >> 16) & 0xFF;
-    handshake_header.length[1] = (record_header.length >> 8) & 0xFF;
-    handshake_header.length[2] = record_header.length & 0xFF;
+    // Extensions: the cached session ticket, or an empty one asking for it
+    put_be16(hello_msg + msg_pos, 4 + session->ticket_length);
+    put_be16(hello_msg + msg_pos + 2, TLS_EXT_SESSION_TICKET);
+    put_be16(hello_msg + msg_pos + 4, session->ticket_length);
+    msg_pos += 6;
+    memcpy(hello_msg + msg_pos, session->ticket, session->ticket_length);
+    msg_pos += session->ticket_length;
+
+    // Update length
+    size_t body_length = msg_pos - sizeof(handshake_header);
+    handshake_header.length[0] = (body_length >> 16) & 0xFF;
+    handshake_header.length[1] = (body_length >> 8) & 0xFF;
+    handshake_header.length[2] = body_length & 0xFF;
 
-    // Copy back updated headers
-    memcpy(hello_msg, &record_header, sizeof(record_header));
-    memcpy(hello_msg + sizeof(record_header), &handshake_header, sizeof(handshake_header));
+    // Copy back updated header
+    memcpy(hello_msg, &handshake_header, sizeof(handshake_header));
 
     // Send ClientHello message
     int result = tls_send_record(context, TLS_RECORD_HANDSHAKE, hello_msg, msg_pos);
@@ -360,17 +527,137 @@ bool tls_client_hello(tls_context_t* context) {
 
 // Parse Server Hello message
 bool tls_parse_server_hello(tls_context_t* context, const uint8_t* data, size_t length) {
-    if (!context || !data || length < 38) return false;
+    if (!context || !data || length < 39) return false;
 
     // Extract server random
     memcpy(context->server_random, data + 6, 32);
 
-    // Extract selected cipher suite
-    context->cipher_suite = (data[38] << 8) | data[39];
+    // An echo of the offered session ID means the server resumed it
+    tls_session_t* session = &context->session;
+    uint8_t id_length = data[38];
+    if (id_length > TLS_SESSION_ID_MAX || length < 39 + (size_t)id_length + 2) return false;
+    context->resumed = id_length && id_length == session->session_id_length &&
+                       memcmp(data + 39, session->session_id, id_length) == 0;
+    if (!context->resumed) {
+        memcpy(session->session_id, data + 39, id_length);
+        session->session_id_length = id_length;
+        session->ticket_length = 0;
+        session->lifetime = 0;
+    }
+
+    // Extract selected cipher suite, after the session ID
+    size_t offset = 39 + id_length;
+    context->cipher_suite = (data[offset] << 8) | data[offset + 1];
+
+    for (size_t i = 0; i < sizeof(supported_ciphers) / sizeof(supported_ciphers[0]); i++) {
+        if (supported_ciphers[i] == context->cipher_suite) return true;
+    }
+    return false;
+}
 
+// NewSessionTicket: lifetime hint, then the opaque ticket to offer later
+bool tls_parse_new_session_ticket(tls_context_t* context, const uint8_t* data, size_t length) {
+    if (!context || !data || length < 6) return false;
+
+    uint32_t lifetime = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+    size_t ticket_length = (size_t)data[4] << 8 | data[5];
+    if (!ticket_length || ticket_length > TLS_SESSION_TICKET_MAX || length < 6 + ticket_length) return false;
+
+    tls_session_t* session = &context->session;
+    memcpy(session->ticket, data + 6, ticket_length);
+    session->ticket_length = (uint16_t)ticket_length;
+    session->lifetime = lifetime && lifetime < TLS_SESSION_LIFETIME ? lifetime : TLS_SESSION_LIFETIME;
     return true;
 }
 
+// TLS 1.2 PRF (RFC 5246 section 5): P_hash(secret, label || seed)
+static void tls_prf(uint32_t digest_size, const uint8_t* secret, size_t secret_length, const char* label,
+                    const uint8_t* seed, size_t seed_length, uint8_t* out, size_t length) {
+    uint8_t label_seed[128];
+    size_t label_length = strlen(label);
+    memcpy(label_seed, label, label_length);
+    memcpy(label_seed + label_length, seed, seed_length);
+    size_t label_seed_length = label_length + seed_length;
+
+    uint8_t a[SHA2_MAX_DIGEST];
+    uint8_t block[SHA2_MAX_DIGEST];
+    hmac_sha2(digest_size, secret, secret_length, label_seed, label_seed_length, NULL, 0, a);
+    while (length) {
+        hmac_sha2(digest_size, secret, secret_length, a, digest_size, label_seed, label_seed_length, block);
+        size_t chunk = length < digest_size ? length : digest_size;
+        memcpy(out, block, chunk);
+        out += chunk;
+        length -= chunk;
+
+        hmac_sha2(digest_size, secret, secret_length, a, digest_size, NULL, 0, block);
+        memcpy(a, block, digest_size);
+    }
+    memset(a, 0, sizeof(a));
+    memset(block, 0, sizeof(block));
+}
+
+static bool tls_cipher_init(tls_cipher_state_t* state, uint32_t algorithm, const uint8_t* key,
+                            const uint8_t* iv, uint32_t iv_length) {
+    memset(state->iv, 0, sizeof(state->iv));
+    memcpy(state->iv, iv, iv_length);
+    state->sequence = 0;
+    state->active = aead_init(&state->aead, algorithm, key, aead_key_length(algorithm));
+    return state->active;
+}
+
+// Expand the master secret into write keys and IVs for both directions
+bool tls_generate_session_keys(tls_context_t* context) {
+    if (!context || !context->master_secret) return false;
+
+    uint32_t algorithm, digest_size, iv_length;
+    switch (context->cipher_suite) {
+        case TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256:
+            algorithm = AEAD_AES_128_GCM;
+            digest_size = SHA256_DIGEST_SIZE;
+            iv_length = 4;
+            break;
+        case TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384:
+            algorithm = AEAD_AES_256_GCM;
+            digest_size = SHA384_DIGEST_SIZE;
+            iv_length = 4;
+            break;
+        case TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256:
+            algorithm = AEAD_CHACHA20_POLY1305;
+            digest_size = SHA256_DIGEST_SIZE;
+            iv_length = AEAD_NONCE_SIZE;
+            break;
+        default:
+            return false;
+    }
+
+    uint8_t seed[64];
+    memcpy(seed, context->server_random, 32);
+    memcpy(seed + 32, context->client_random, 32);
+
+    // client_write_key, server_write_key, client_write_IV, server_write_IV
+    uint32_t key_length = aead_key_length(algorithm);
+    uint8_t key_block[2 * (AEAD_MAX_KEY + AEAD_NONCE_SIZE)];
+    tls_prf(digest_size, context->master_secret, 48, "key expansion", seed, sizeof(seed),
+            key_block, 2 * (key_length + iv_length));
+
+    const uint8_t* client_key = key_block;
+    const uint8_t* server_key = client_key + key_length;
+    const uint8_t* client_iv = server_key + key_length;
+    const uint8_t* server_iv = client_iv + iv_length;
+    bool client = context->is_client;
+    bool ok = tls_cipher_init(&context->tx, algorithm, client ? client_key : server_key,
+                              client ? client_iv : server_iv, iv_length) &&
+              tls_cipher_init(&context->rx, algorithm, client ? server_key : client_key,
+                              client ? server_iv : client_iv, iv_length);
+
+    memset(key_block, 0, sizeof(key_block));
+    if (!ok) {
+        context->tx.active = false;
+        context->rx.active = false;
+    }
+    return ok;
+}
+
 // Simplified TLS key derivation
 bool tls_derive_master_secret(tls_context_t* context) {
     if (!context || !context->client_random || !context->server_random) return false;
@@ -398,10 +685,18 @@ bool tls_derive_master_secret(tls_context_t* context) {
     return true;
 }
 
-// Perform TLS Handshake
+// Perform TLS Handshake, resuming the host's cached session if it has one
 bool tls_handshake(tls_context_t* context, const tls_config_t* config) {
     if (!context || !config) return false;
 
+    tls_session_t* session = &context->session;
+    context->resumed = false;
+    if (!config->hostname || !tls_session_lookup(config->hostname, config->port, session)) {
+        memset(session, 0, sizeof(tls_session_t));
+        if (config->hostname) strncpy(session->host, config->hostname, TLS_SESSION_HOST_MAX - 1);
+        session->port = config->port;
+    }
+
     // Send Client Hello
     if (!tls_client_hello(context)) {
         return false;
@@ -417,16 +712,54 @@ bool tls_handshake(tls_context_t* context, const tls_config_t* config) {
         return false;
     }
 
-    // Parse Server Hello
-    if (!tls_parse_server_hello(context, buffer, len)) {
+    // Walk the handshake messages in the record
+    bool saw_hello = false;
+    bool new_ticket = false;
+    size_t pos = 0;
+    while (pos + sizeof(tls_handshake_header_t) <= len) {
+        size_t msg_length = (size_t)buffer[pos + 1] << 16 | (size_t)buffer[pos + 2] << 8 | buffer[pos + 3];
+        size_t total = sizeof(tls_handshake_header_t) + msg_length;
+        if (pos + total > len) return false;
+
+        if (buffer[pos] == TLS_SERVER_HELLO) {
+            if (!tls_parse_server_hello(context, buffer + pos, total)) return false;
+            saw_hello = true;
+        } else if (buffer[pos] == TLS_NEW_SESSION_TICKET) {
+            new_ticket |= tls_parse_new_session_ticket(context, buffer + pos + sizeof(tls_handshake_header_t),
+                                                       msg_length);
+        }
+        pos += total;
+    }
+    if (!saw_hello) {
         return false;
     }
 
-    // Derive master secret and session keys
-    if (!tls_derive_master_secret(context)) {
+    // A resumed session keeps its master secret; a new one derives it
+    if (context->resumed) {
+        if (context->cipher_suite != session->cipher_suite) {
+            tls_session_remove(session->host, session->port);
+            return false;
+        }
+        memcpy(context->master_secret, session->master_secret, 48);
+    } else if (!tls_derive_master_secret(context)) {
         return false;
     }
 
+    if (!tls_generate_session_keys(context)) {
+        return false;
+    }
+
+    // Remember the session if there is a way to name it next time
+    if (session->host[0] && (session->session_id_length || session->ticket_length)) {
+        session->cipher_suite = context->cipher_suite;
+        memcpy(session->master_secret, context->master_secret, 48);
+        if (!context->resumed || new_ticket) {
+            uint32_t lifetime = session->lifetime ? session->lifetime : TLS_SESSION_LIFETIME;
+            session->expires = ktime_get_ns() + (uint64_t)lifetime * 1000000000ULL;
+        }
+        tls_session_store(session);
+    }
+
     // Mark handshake as complete
     context->handshake_complete = true;
     context->connected = true;
@@ -436,6 +769,7 @@ bool tls_handshake(tls_context_t* context, const tls_config_t* config) {
 
 // HTTPS Client Creation
 http_client_t* https_client_create(void) {
+    boot_require("https");
     if (!https_initialized) {
         return NULL;
     }
@@ -611,7 +945,7 @@ http_response_t* https_send_request(http_client_t* client, http_request_t* reque
     // Receive response
     uint8_t record_type;
     uint8_t resp_buffer[8192];
-    size_t resp_len = sizeof(resp_buffer);
+    size_t resp_len = sizeof(resp_buffer) - 1;
 
     // Receive TLS record
     if (tls_receive_record(tls_ctx, &record_type, resp_buffer, &resp_len) < 0 ||
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <net/http/http.h>
+#include <net/crypto/aead.h>
 #include <stddef.h>
 
 typedef __builtin_va_list va_list;
@@ -20,11 +21,54 @@ typedef __builtin_va_list va_list;
 // TLS Handshake Types
 #define TLS_CLIENT_HELLO           1
 #define TLS_SERVER_HELLO           2
+#define TLS_NEW_SESSION_TICKET     4
 #define TLS_CERTIFICATE            11
 #define TLS_SERVER_HELLO_DONE      14
 #define TLS_CLIENT_KEY_EXCHANGE    16
 #define TLS_FINISHED               20
 
+// TLS 1.2 AEAD cipher suites
+#define TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256        0xC02F
+#define TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384        0xC030
+#define TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256  0xCCA8
+
+#define TLS_RECORD_HEADER_SIZE   5
+#define TLS_MAX_PLAINTEXT        16384
+#define TLS_EXPLICIT_NONCE_SIZE  8       // GCM only (RFC 5288)
+
+#define TLS_EXT_SESSION_TICKET   0x0023  // RFC 5077
+
+// Client session cache, one entry per host and port
+#define TLS_SESSION_CACHE_SIZE   32
+#define TLS_SESSION_HOST_MAX     256
+#define TLS_SESSION_ID_MAX       32
+#define TLS_SESSION_TICKET_MAX   1024
+#define TLS_SESSION_LIFETIME     7200    // Seconds, unless the ticket says otherwise
+
+// What an abbreviated handshake needs to resume a session
+typedef struct {
+    char host[TLS_SESSION_HOST_MAX];
+    uint16_t port;
+    uint16_t cipher_suite;
+    uint8_t session_id[TLS_SESSION_ID_MAX];
+    uint8_t session_id_length;
+    uint8_t master_secret[48];
+    uint8_t ticket[TLS_SESSION_TICKET_MAX];
+    uint16_t ticket_length;
+    uint32_t lifetime;                  // Seconds
+    uint64_t expires;                   // ktime_get_ns() deadline
+    uint64_t last_used;
+    bool valid;
+} tls_session_t;
+
+// Protection for one direction of the record stream
+typedef struct {
+    struct aead_ctx aead;
+    uint8_t iv[AEAD_NONCE_SIZE];        // GCM uses the first 4 bytes as salt
+    uint64_t sequence;
+    bool active;
+} tls_cipher_state_t;
+
 // Basic TLS context
 typedef struct {
     http_client_t* http;
@@ -38,6 +82,12 @@ typedef struct {
     // Encryption
     uint8_t* session_key;
     uint8_t* master_secret;
+    tls_cipher_state_t tx;
+    tls_cipher_state_t rx;
+
+    // Session offered in the ClientHello, then the one negotiated
+    tls_session_t session;
+    bool resumed;
 
     // Connection state
     bool is_client;
@@ -80,6 +130,13 @@ bool tls_handshake(tls_context_t* context, const tls_config_t* config);
 bool tls_client_hello(tls_context_t* context);
 bool tls_parse_server_hello(tls_context_t* context, const uint8_t* data, size_t length);
 bool tls_generate_premaster_secret(tls_context_t* context);
+bool tls_parse_new_session_ticket(tls_context_t* context, const uint8_t* data, size_t length);
+
+// TLS Session Cache
+bool tls_session_lookup(const char* host, uint16_t port, tls_session_t* session);
+void tls_session_store(const tls_session_t* session);
+void tls_session_remove(const char* host, uint16_t port);
+void tls_session_flush(void);
 
 // TLS Record Layer Operations
 int tls_send_record(tls_context_t* context, uint8_t type, const void* data, size_t length);
@@ -4,19 +4,72 @@
 #include <utils/mem.h>
 #include <net/dns.h>
 #include <utils/str.h>
+#include <core/wait.h>
+#include <core/rcu.h>
+#include <fs/epoll.h>
+#include <net/pkbuf.h>
+#include <net/checksum.h>
+#include <net/tcp.h>
+#include <net/arp.h>
+#include <fs/file.h>
+#include <core/syscalls.h>
 
 // Internal data structures
 static net_socket socket_pool[NET_MAX_SOCKETS];
-static net_interface interfaces[NET_MAX_INTERFACES];
-static net_packet packet_queue[NET_MAX_SOCKETS];
-static uint32_t packet_queue_count = 0;
-
-// Protocol-specific data structures
-typedef struct {
-    uint32_t sequence_number;
-    uint32_t acknowledgement_number;
-    uint16_t window_size;
-} tcp_connection_data;
+// Slots are published with rcu_assign_pointer() and read without locks;
+// removed interfaces are freed after a grace period
+static net_interface* interfaces[NET_MAX_INTERFACES];
+static spinlock_t interfaces_lock = SPINLOCK_INIT;
+static uint32_t socket_generation[NET_MAX_SOCKETS];      // Bumped on close to release waiters
+static struct poll_head socket_poll[NET_MAX_SOCKETS];    // Epoll watchers per socket
+
+// Received IP packets, straight from the drivers
+static struct pkbuf* ingress_head = NULL;
+static struct pkbuf* ingress_tail = NULL;
+static uint32_t ingress_count = 0;
+static spinlock_t ingress_lock = SPINLOCK_INIT;
+
+// Each socket's received packets, oldest at head; filled from the net worker
+struct socket_rx {
+    spinlock_t lock;
+    net_packet ring[NET_SOCKET_QUEUE];
+    uint32_t head;
+    uint32_t count;
+    struct wait_queue wait;     // Receivers and acceptors of this socket
+};
+
+static struct socket_rx socket_rx[NET_MAX_SOCKETS];
+
+// Sockets by address for demultiplexing. Connected sockets are keyed by
+// both ends, bound and listening ones with the remote end zero.
+struct demux_key {
+    uint32_t local_ip;
+    uint32_t remote_ip;
+    uint16_t local_port;
+    uint16_t remote_port;
+};
+
+#define NET_DEMUX_BUCKETS (1U << NET_DEMUX_HASH_BITS)
+
+static struct demux_key demux_keys[NET_MAX_SOCKETS];
+static int16_t demux_buckets[NET_DEMUX_BUCKETS];     // First socket + 1, 0 if empty
+static int16_t demux_next[NET_MAX_SOCKETS];          // Next socket + 1 in the bucket
+static bool demux_hashed[NET_MAX_SOCKETS];
+static spinlock_t demux_lock = SPINLOCK_INIT;
+
+// Receive coalescing: in-order segments of a TCP flow are held back while
+// the ingress queue drains and handed to the connection as one train, for
+// a single lookup, lock and ACK decision. Pages stay separate; the TCP
+// engine copies each into its stream.
+struct gro_flow {
+    uint32_t count;
+    uint32_t next_seq;          // Where the flow's next segment must start
+    net_packet packets[NET_GRO_MAX_SEGS];
+};
+
+static struct gro_flow gro_flows[NET_GRO_FLOWS];
+static uint32_t gro_evict = 0;
+static spinlock_t gro_lock = SPINLOCK_INIT;    // The table, for whoever is draining
 
 // Static function prototypes
 static net_socket* get_socket(int fd);
@@ -64,13 +117,95 @@ static void fmt_interface_name(char* buffer, size_t buffer_size, const char* for
     buffer[pos] = '\0';
 }
 
+static inline uint32_t demux_hash(const struct demux_key* key) {
+    uint64_t mix = ((uint64_t)key->local_ip << 32 | key->remote_ip) ^
+                   ((uint64_t)key->local_port << 16 | key->remote_port) * 0xFF51AFD7ED558CCDULL;
+    return (uint32_t)((mix * 0x9E3779B97F4A7C15ULL) >> (64 - NET_DEMUX_HASH_BITS));
+}
+
+static inline bool demux_key_equal(const struct demux_key* a, const struct demux_key* b) {
+    return a->local_ip == b->local_ip && a->remote_ip == b->remote_ip &&
+           a->local_port == b->local_port && a->remote_port == b->remote_port;
+}
+
+// demux_lock held
+static void demux_unhash(int fd) {
+    if (!demux_hashed[fd]) return;
+    int16_t* link = &demux_buckets[demux_hash(&demux_keys[fd])];
+    while (*link != fd + 1) link = &demux_next[*link - 1];
+    *link = demux_next[fd];
+    demux_hashed[fd] = false;
+}
+
+// Key the socket by its current addresses, after bind, connect or accept
+static void demux_rehash(int fd) {
+    net_socket* sock = &socket_pool[fd];
+    spinlock_acquire(&demux_lock);
+    demux_unhash(fd);
+    demux_keys[fd] = (struct demux_key){
+        sock->local_addr.ip, sock->remote_addr.ip, sock->local_addr.port, sock->remote_addr.port,
+    };
+    uint32_t bucket = demux_hash(&demux_keys[fd]);
+    demux_next[fd] = demux_buckets[bucket];
+    demux_buckets[bucket] = (int16_t)(fd + 1);
+    demux_hashed[fd] = true;
+    spinlock_release(&demux_lock);
+}
+
+// demux_lock held
+static int demux_lookup(const struct demux_key* key) {
+    for (int16_t n = demux_buckets[demux_hash(key)]; n; n = demux_next[n - 1]) {
+        if (demux_key_equal(&demux_keys[n - 1], key)) return n - 1;
+    }
+    return -1;
+}
+
+// The connected socket first, then one bound to the address, then one
+// bound to the port on any address; -1 if nobody wants the packet.
+// demux_lock held.
+static int demux_find(const net_packet* packet) {
+    struct demux_key key = {
+        packet->destination.ip, packet->source.ip, packet->destination.port, packet->source.port,
+    };
+    int fd = demux_lookup(&key);
+    if (fd >= 0) return fd;
+
+    key.remote_ip = 0;
+    key.remote_port = 0;
+    if ((fd = demux_lookup(&key)) >= 0) return fd;
+
+    key.local_ip = 0;
+    return demux_lookup(&key);
+}
+
+// Take the socket's oldest packet; false if it has none
+static bool socket_rx_pop(int fd, net_packet* packet) {
+    struct socket_rx* rx = &socket_rx[fd];
+    spinlock_acquire(&rx->lock);
+    bool found = rx->count > 0;
+    if (found) {
+        *packet = rx->ring[rx->head];
+        rx->head = (rx->head + 1) % NET_SOCKET_QUEUE;
+        rx->count--;
+    }
+    spinlock_release(&rx->lock);
+    return found;
+}
+
+// Connection events, from the TCP engine without its locks held
+static void socket_tcp_notify(int fd, uint32_t events) {
+    uint32_t poll_events = 0;
+    if (events & TCP_EVENT_READABLE) poll_events |= EPOLLIN;
+    if (events & TCP_EVENT_WRITABLE) poll_events |= EPOLLOUT;
+    if (events & TCP_EVENT_HANGUP) poll_events |= EPOLLHUP;
+    wait_queue_wake_all(&socket_rx[fd].wait);
+    poll_notify(&socket_poll[fd], poll_events);
+}
+
 // Network initialization
 int net_init(void) {
     // Clear all data structures
     memset(socket_pool, 0, sizeof(socket_pool));
-    memset(interfaces, 0, sizeof(interfaces));
-    memset(packet_queue, 0, sizeof(packet_queue));
-    packet_queue_count = 0;
 
     // Initialize IP layer
     if (ip_init() < 0) {
@@ -81,26 +216,27 @@ int net_init(void) {
     struct pci_device* network_device = NULL;
     int interface_count = 0;
 
-    while ((network_device = pci_scan_for_class(PCI_CLASS_NETWORK, 0)) &&
+    while ((network_device = pci_next_for_class(PCI_CLASS_NETWORK, 0, network_device)) &&
            interface_count < NET_MAX_INTERFACES) {
-        net_interface* interface = &interfaces[interface_count];
+        net_interface interface;
+        memset(&interface, 0, sizeof(interface));
 
         // Generate interface name
-        fmt_interface_name(interface->name, sizeof(interface->name), "eth%d", interface_count);
+        fmt_interface_name(interface.name, sizeof(interface.name), "eth%d", interface_count);
 
         // Set default MAC address
-        interface->mac[0] = 0x02;
-        interface->mac[1] = 0x00;
-        interface->mac[2] = 0x00;
-        interface->mac[3] = network_device->bus;
-        interface->mac[4] = network_device->slot;
-        interface->mac[5] = network_device->func;
+        interface.mac[0] = 0x02;
+        interface.mac[1] = 0x00;
+        interface.mac[2] = 0x00;
+        interface.mac[3] = network_device->bus;
+        interface.mac[4] = network_device->slot;
+        interface.mac[5] = network_device->func;
 
         // Default IP configuration
-        interface->ip = ip_string_to_int("192.168.1.100") + interface_count;
-        interface->subnet = ip_string_to_int("255.255.255.0");
-        interface->gateway = ip_string_to_int("192.168.1.1");
-        interface->is_active = true;
+        interface.ip = ip_string_to_int("192.168.1.100") + interface_count;
+        interface.subnet = ip_string_to_int("255.255.255.0");
+        interface.gateway = ip_string_to_int("192.168.1.1");
+        if (net_interface_add(&interface) < 0) break;
 
         interface_count++;
     }
@@ -130,12 +266,11 @@ int net_socket_create(net_socket_type type) {
 
     // Allocate protocol-specific data
     if (type == SOCKET_TCP) {
-        sock->protocol_data = malloc(sizeof(tcp_connection_data));
+        sock->protocol_data = tcp_create(fd, socket_tcp_notify);
         if (!sock->protocol_data) {
             free_socket_fd(fd);
             return -1;
         }
-        memset(sock->protocol_data, 0, sizeof(tcp_connection_data));
     }
 
     return fd;
@@ -148,6 +283,7 @@ int net_socket_bind(int socket, uint32_t ip, uint16_t port) {
 
     sock->local_addr.ip = ip;
     sock->local_addr.port = port;
+    demux_rehash(socket);
 
     return 0;
 }
@@ -156,6 +292,7 @@ int net_socket_bind(int socket, uint32_t ip, uint16_t port) {
 int net_socket_listen(int socket, int backlog) {
     net_socket* sock = get_socket(socket);
     if (!sock || sock->type != SOCKET_TCP) return -1;
+    if (sock->state != SOCKET_STATE_LISTEN && ip_listen(sock->local_addr.ip, sock->local_addr.port) < 0) return -1;
 
     sock->state = SOCKET_STATE_LISTEN;
     return 0;
@@ -168,24 +305,11 @@ int net_socket_connect(int socket, uint32_t ip, uint16_t port) {
 
     sock->remote_addr.ip = ip;
     sock->remote_addr.port = port;
-    sock->state = SOCKET_STATE_SYN_SENT;
-
-    // Prepare TCP SYN packet
-    struct {
-        uint16_t source_port;
-        uint16_t dest_port;
-        uint32_t sequence;
-        uint32_t ack;
-        uint8_t flags;
-    } __attribute__((packed)) syn_packet;
+    if (tcp_connect(sock->protocol_data, &sock->local_addr, sock->remote_addr) < 0) return -1;
 
-    syn_packet.source_port = sock->local_addr.port;
-    syn_packet.dest_port = port;
-    syn_packet.sequence = 12345;  // Random initial sequence
-    syn_packet.flags = 0x02;  // SYN flag
-
-    // Send via IP layer
-    return ip_send_packet(ip, IP_PROTOCOL_TCP, &syn_packet, sizeof(syn_packet));
+    sock->state = SOCKET_STATE_SYN_SENT;
+    demux_rehash(socket);
+    return 0;
 }
 
 // Accept incoming connection
@@ -193,34 +317,36 @@ int net_socket_accept(int socket, net_address* client_addr) {
     net_socket* listen_sock = get_socket(socket);
     if (!listen_sock || listen_sock->state != SOCKET_STATE_LISTEN) return -1;
 
-    // Find incoming connection in packet queue
-    for (uint32_t i = 0; i < packet_queue_count; i++) {
-        net_packet* packet = &packet_queue[i];
-        // Check for TCP SYN packet
-        if (packet->destination.port == listen_sock->local_addr.port) {
-            // Create new socket for this connection
-            int new_socket = net_socket_create(SOCKET_TCP);
-            if (new_socket < 0) return -1;
-
-            net_socket* new_sock = get_socket(new_socket);
-            new_sock->local_addr = listen_sock->local_addr;
-            new_sock->remote_addr = packet->source;
-            new_sock->state = SOCKET_STATE_SYN_RECEIVED;
-
-            // Copy client address if requested
-            if (client_addr) {
-                *client_addr = packet->source;
-            }
+    // Each queued packet for a listener is a SYN; a retransmitted one
+    // finds its connection already made and is skipped
+    net_packet packet;
+    while (socket_rx_pop(socket, &packet)) {
+        int new_socket = net_socket_create(SOCKET_TCP);
+        if (new_socket < 0) {
+            pkbuf_put(packet.pkbuf);
+            return -1;
+        }
 
-            // Remove packet from queue
-            memmove(&packet_queue[i], &packet_queue[i+1],
-                    (packet_queue_count - i - 1) * sizeof(net_packet));
-            packet_queue_count--;
+        net_socket* new_sock = get_socket(new_socket);
+        new_sock->local_addr = listen_sock->local_addr;
+        new_sock->local_addr.ip = packet.destination.ip;
+        new_sock->remote_addr = packet.source;
+        if (tcp_accept(new_sock->protocol_data, new_sock->local_addr, &packet) < 0) {
+            pkbuf_put(packet.pkbuf);
+            net_socket_close(new_socket);
+            continue;
+        }
+        new_sock->state = SOCKET_STATE_SYN_RECEIVED;
+        demux_rehash(new_socket);
 
-            return new_socket;
+        // Copy client address if requested
+        if (client_addr) {
+            *client_addr = packet.source;
         }
-    }
 
+        pkbuf_put(packet.pkbuf);
+        return new_socket;
+    }
     return -1;
 }
 
@@ -233,15 +359,42 @@ net_socket* net_socket_get(int fd) {
     return get_socket(fd);
 }
 
-// Send data
-int net_socket_send(int socket, const void* data, uint16_t length) {
+// One attempt for net_socket_send() on TCP; true once it is done waiting
+static bool send_or_closed(int socket, uint32_t generation, const uint8_t* data,
+                           uint32_t length, uint32_t* sent, int* result) {
+    tcp_timers_run();
+    if (socket_generation[socket] != generation) {
+        *result = -1;
+        return true;
+    }
+    int taken = tcp_send(socket_pool[socket].protocol_data, data + *sent, length - *sent);
+    if (taken < 0) {
+        *result = -1;
+        return true;
+    }
+    *sent += (uint32_t)taken;
+    *result = 0;
+    return *sent == length;
+}
+
+// Send data. TCP queues it all on the connection, sleeping while the send
+// buffer is full.
+int net_socket_send(int socket, const void* data, uint32_t length) {
     net_socket* sock = get_socket(socket);
-    if (!sock || sock->state != SOCKET_STATE_ESTABLISHED) return -1;
+    if (!sock) return -1;
+
+    if (sock->type == SOCKET_TCP) {
+        if (!sock->protocol_data) return -1;
+        uint32_t generation = socket_generation[socket];
+        uint32_t sent = 0;
+        int result;
+        wait_event(&socket_rx[socket].wait, send_or_closed(socket, generation, data, length, &sent, &result));
+        return result;
+    }
+    if (sock->state != SOCKET_STATE_ESTABLISHED) return -1;
 
     // Send via IP layer based on socket type
     switch (sock->type) {
-        case SOCKET_TCP:
-            return ip_send_packet(sock->remote_addr.ip, IP_PROTOCOL_TCP, data, length);
         case SOCKET_UDP:
             return ip_send_packet(sock->remote_addr.ip, IP_PROTOCOL_UDP, data, length);
         case SOCKET_RAW:
@@ -251,35 +404,158 @@ int net_socket_send(int socket, const void* data, uint16_t length) {
     }
 }
 
+// One attempt for net_socket_sendv() on TCP; true once it is done waiting
+static bool sendv_or_closed(int socket, uint32_t generation, struct iov_iter* iter, int* result) {
+    tcp_timers_run();
+    if (socket_generation[socket] != generation) {
+        *result = -1;
+        return true;
+    }
+    *result = 0;
+    for (;;) {
+        size_t span;
+        const void* data = iov_iter_span(iter, &span);
+        if (!data) return true;
+        int taken = tcp_send(socket_pool[socket].protocol_data, data,
+                             span > 0x7FFFFFFF ? 0x7FFFFFFF : (uint32_t)span);
+        if (taken < 0) {
+            *result = -1;
+            return true;
+        }
+        iov_iter_advance(iter, (size_t)taken);
+        if ((size_t)taken < span) return false;     // Send buffer full
+    }
+}
+
+int net_socket_sendv(int socket, const struct iovec* iov, int count) {
+    net_socket* sock = get_socket(socket);
+    if (!sock || (!iov && count)) return -1;
+
+    struct iov_iter iter;
+    iov_iter_init(&iter, iov, count);
+    if (sock->type == SOCKET_TCP) {
+        if (!sock->protocol_data) return -1;
+        uint32_t generation = socket_generation[socket];
+        int result;
+        wait_event(&socket_rx[socket].wait, sendv_or_closed(socket, generation, &iter, &result));
+        return result;
+    }
+
+    // A datagram goes out whole, so gather it first
+    size_t total = 0;
+    for (int i = 0; i < count; i++) total += iov[i].iov_len;
+    if (total > 0xFFFF) return -1;
+    uint8_t* bounce = malloc(total ? total : 1);
+    if (!bounce) return -1;
+    iov_copy_from_iter(&iter, bounce, total);
+    int result = net_socket_send(socket, bounce, (uint32_t)total);
+    free(bounce);
+    return result;
+}
+
 // Receive data
 int net_socket_receive(int socket, void* buffer, uint16_t* length) {
     net_socket* sock = get_socket(socket);
     if (!sock || !buffer || !length) return -1;
 
-    // Search packet queue for matching socket
-    for (uint32_t i = 0; i < packet_queue_count; i++) {
-        net_packet* packet = &packet_queue[i];
+    if (sock->type == SOCKET_TCP && sock->state != SOCKET_STATE_LISTEN) {
+        // A byte stream; 0 bytes means the peer finished or reset it
+        tcp_timers_run();
+        int received = tcp_receive(sock->protocol_data, buffer, *length);
+        if (received < 0) return -1;
+        *length = (uint16_t)received;
+        return 0;
+    }
 
-        // Match destination port and IP
-        if (packet->destination.port == sock->local_addr.port &&
-            packet->destination.ip == sock->local_addr.ip) {
+    net_packet packet;
+    if (!socket_rx_pop(socket, &packet)) return -1;
 
-            // Copy data
-            uint16_t copy_length = (*length < packet->length) ? *length : packet->length;
-            memcpy(buffer, packet->data, copy_length);
-            *length = copy_length;
+    // Copy data
+    uint16_t copy_length = (*length < packet.length) ? *length : packet.length;
+    memcpy(buffer, packet.data, copy_length);
+    *length = copy_length;
 
-            // Remove packet from queue
-            free(packet->data);
-            memmove(&packet_queue[i], &packet_queue[i+1],
-                    (packet_queue_count - i - 1) * sizeof(net_packet));
-            packet_queue_count--;
+    pkbuf_put(packet.pkbuf);
+    return 0;
+}
 
-            return 0;
-        }
+// One attempt for net_socket_receive_wait(); true once it is done waiting
+static bool receive_or_closed(int socket, uint32_t generation, void* buffer,
+                              uint16_t capacity, uint16_t* length, int* result) {
+    *length = capacity;
+    *result = net_socket_receive(socket, buffer, length);
+    return *result == 0 || socket_generation[socket] != generation;
+}
+
+// Receive data, sleeping until a packet for the socket arrives or the
+// socket is closed
+int net_socket_receive_wait(int socket, void* buffer, uint16_t* length) {
+    net_socket* sock = get_socket(socket);
+    if (!sock || !buffer || !length) return -1;
+
+    uint32_t generation = socket_generation[socket];
+    uint16_t capacity = *length;
+    int result;
+    wait_event(&socket_rx[socket].wait, receive_or_closed(socket, generation, buffer, capacity, length, &result));
+    return result;
+}
+
+// As net_socket_receive_wait(), giving up with -1 after timeout_ns
+int net_socket_receive_timeout(int socket, void* buffer, uint16_t* length, uint64_t timeout_ns) {
+    net_socket* sock = get_socket(socket);
+    if (!sock || !buffer || !length) return -1;
+
+    uint32_t generation = socket_generation[socket];
+    uint16_t capacity = *length;
+    int result = -1;
+    if (!wait_event_deadline(&socket_rx[socket].wait,
+                             receive_or_closed(socket, generation, buffer, capacity, length, &result),
+                             ktime_get_ns() + timeout_ns)) {
+        return -1;
     }
+    return result;
+}
 
-    return -1;
+// One attempt for net_socket_receive_direct(); true once it is done waiting
+static bool direct_or_closed(int socket, uint32_t generation, net_consume_t consume, void* ctx, int* result) {
+    tcp_timers_run();
+    if (socket_generation[socket] != generation) {
+        *result = -1;
+        return true;
+    }
+    *result = tcp_receive_direct(socket_pool[socket].protocol_data, consume, ctx);
+    return *result >= 0;
+}
+
+int net_socket_receive_direct(int socket, net_consume_t consume, void* ctx) {
+    net_socket* sock = get_socket(socket);
+    if (!sock || !consume || sock->type != SOCKET_TCP || !sock->protocol_data ||
+        sock->state == SOCKET_STATE_LISTEN) {
+        return -1;
+    }
+
+    uint32_t generation = socket_generation[socket];
+    int result;
+    wait_event(&socket_rx[socket].wait, direct_or_closed(socket, generation, consume, ctx, &result));
+    return result;
+}
+
+// One attempt for net_socket_accept_wait(); true once it is done waiting
+static bool accept_or_closed(int socket, uint32_t generation, net_address* client_addr, int* result) {
+    *result = net_socket_accept(socket, client_addr);
+    return *result >= 0 || socket_generation[socket] != generation ||
+           socket_pool[socket].state != SOCKET_STATE_LISTEN;
+}
+
+// Accept a connection, sleeping until one arrives or the socket is closed
+int net_socket_accept_wait(int socket, net_address* client_addr) {
+    net_socket* sock = get_socket(socket);
+    if (!sock) return -1;
+
+    uint32_t generation = socket_generation[socket];
+    int result;
+    wait_event(&socket_rx[socket].wait, accept_or_closed(socket, generation, client_addr, &result));
+    return result;
 }
 
 // Close socket
@@ -287,48 +563,158 @@ void net_socket_close(int socket) {
     net_socket* sock = get_socket(socket);
     if (!sock) return;
 
-    // Send FIN if TCP
-    if (sock->type == SOCKET_TCP && sock->state == SOCKET_STATE_ESTABLISHED) {
-        struct {
-            uint16_t source_port;
-            uint16_t dest_port;
-            uint8_t flags;
-        } __attribute__((packed)) fin_packet;
+    if (sock->state == SOCKET_STATE_LISTEN) ip_unlisten(sock->local_addr.ip, sock->local_addr.port);
 
-        fin_packet.source_port = sock->local_addr.port;
-        fin_packet.dest_port = sock->remote_addr.port;
-        fin_packet.flags = 0x11;  // FIN-ACK
-
-        ip_send_packet(sock->remote_addr.ip, IP_PROTOCOL_TCP, &fin_packet, sizeof(fin_packet));
-    }
-
-    // Free protocol-specific data
-    if (sock->protocol_data) {
+    // The connection finishes the stream on its own and frees itself
+    if (sock->type == SOCKET_TCP) {
+        tcp_close(sock->protocol_data);
+        sock->protocol_data = NULL;
+    } else if (sock->protocol_data) {
         free(sock->protocol_data);
         sock->protocol_data = NULL;
     }
 
+    spinlock_acquire(&demux_lock);
+    demux_unhash(socket);
+    spinlock_release(&demux_lock);
+
+    // Drop whatever was never read
+    net_packet packet;
+    while (socket_rx_pop(socket, &packet)) {
+        pkbuf_put(packet.pkbuf);
+    }
+
     // Reset socket state
     memset(sock, 0, sizeof(net_socket));
+    socket_generation[socket]++;
+    wait_queue_wake_all(&socket_rx[socket].wait);
+    poll_notify(&socket_poll[socket], EPOLLHUP);
+}
+
+uint32_t net_socket_poll(int socket) {
+    net_socket* sock = get_socket(socket);
+    if (!sock) return EPOLLERR;
+    if (sock->type == SOCKET_TCP && sock->state != SOCKET_STATE_LISTEN) return tcp_poll(sock->protocol_data);
+
+    uint32_t events = sock->state == SOCKET_STATE_ESTABLISHED ? EPOLLOUT : 0;
+
+    if (socket_rx[socket].count > 0) events |= EPOLLIN;
+    return events;
+}
+
+struct poll_head* net_socket_poll_head(int socket) {
+    return socket >= 0 && socket < NET_MAX_SOCKETS ? &socket_poll[socket] : NULL;
+}
+
+static inline bool gro_same_flow(const net_packet* a, const net_packet* b) {
+    return a->source.ip == b->source.ip && a->destination.ip == b->destination.ip &&
+           a->source.port == b->source.port && a->destination.port == b->destination.port;
+}
+
+// Hand a held train to its connection. gro_lock held.
+static void gro_flush(struct gro_flow* flow) {
+    if (!flow->count) return;
+    tcp_input(flow->packets, flow->count);
+    for (uint32_t i = 0; i < flow->count; i++) pkbuf_put(flow->packets[i].pkbuf);
+    flow->count = 0;
+}
+
+// Hold a TCP segment back if it can join a train: nothing but ACK and PSH,
+// and following on from the flow's last. Otherwise whatever the flow held
+// goes up first, keeping its order; false if the caller is to deliver the
+// segment. gro_lock held.
+static bool gro_hold(const net_packet* packet) {
+    const struct tcp_header* th = (const struct tcp_header*)packet->data;
+    uint32_t hlen = packet->length >= sizeof(struct tcp_header) ? (uint32_t)(th->data_offset >> 4) * 4 : 0;
+    bool mergeable = hlen >= sizeof(struct tcp_header) && hlen <= packet->length &&
+                     (th->flags & ~(TCP_ACK | TCP_PSH)) == 0 && (th->flags & TCP_ACK);
+    uint32_t seq = mergeable ? __builtin_bswap32(th->sequence_number) : 0;
+
+    struct gro_flow* flow = NULL;
+    struct gro_flow* free_flow = NULL;
+    for (uint32_t i = 0; i < NET_GRO_FLOWS; i++) {
+        struct gro_flow* f = &gro_flows[i];
+        if (!f->count) {
+            if (!free_flow) free_flow = f;
+        } else if (gro_same_flow(&f->packets[0], packet)) {
+            flow = f;
+            break;
+        }
+    }
+
+    if (flow && (!mergeable || seq != flow->next_seq || flow->count == NET_GRO_MAX_SEGS)) gro_flush(flow);
+    if (!mergeable) return false;
+    if (!flow) {
+        flow = free_flow;
+        if (!flow) {
+            flow = &gro_flows[gro_evict++ % NET_GRO_FLOWS];
+            gro_flush(flow);
+        }
+    }
+
+    flow->packets[flow->count++] = *packet;
+    flow->next_seq = seq + (packet->length - hlen);
+    return true;
 }
 
 // Packet processing
 void net_process_packets(void) {
     net_packet packet;
+    spinlock_acquire(&gro_lock);
     while (net_receive_packet(&packet) == 0) {
-        // Add to packet queue
-        if (packet_queue_count < NET_MAX_SOCKETS) {
-            packet_queue[packet_queue_count++] = packet;
-        } else {
-            // Queue full, drop packet
-            free(packet.data);
+        // Connections take their own segments; only a new SYN goes on to
+        // a listener's queue
+        if (packet.protocol == IP_PROTOCOL_TCP) {
+            if (gro_hold(&packet)) continue;
+            if (tcp_input(&packet, 1)) {
+                pkbuf_put(packet.pkbuf);
+                continue;
+            }
         }
+
+        // Hand it to its socket; taking the ring lock under demux_lock keeps
+        // the socket from closing in between
+        spinlock_acquire(&demux_lock);
+        int fd = demux_find(&packet);
+        if (fd >= 0 && packet.protocol == IP_PROTOCOL_TCP && socket_pool[fd].state != SOCKET_STATE_LISTEN) fd = -1;
+        bool added = false;
+        if (fd >= 0) {
+            struct socket_rx* rx = &socket_rx[fd];
+            spinlock_acquire(&rx->lock);
+            added = rx->count < NET_SOCKET_QUEUE;
+            if (added) {
+                rx->ring[(rx->head + rx->count) % NET_SOCKET_QUEUE] = packet;
+                rx->count++;
+            }
+            spinlock_release(&rx->lock);
+        }
+        spinlock_release(&demux_lock);
+
+        if (!added) {
+            // Nobody bound, or the socket's queue is full: drop packet. A
+            // SYN nobody listens for is refused; a full backlog is left for
+            // the peer to retry.
+            if (fd < 0 && packet.protocol == IP_PROTOCOL_TCP) tcp_reject(&packet);
+            pkbuf_put(packet.pkbuf);
+            continue;
+        }
+
+        wait_queue_wake_all(&socket_rx[fd].wait);
+        poll_notify(&socket_poll[fd], EPOLLIN);
     }
+
+    // Nothing more queued, so nothing more to wait for
+    for (uint32_t i = 0; i < NET_GRO_FLOWS; i++) gro_flush(&gro_flows[i]);
+    spinlock_release(&gro_lock);
+
+    tcp_timers_run();
+    arp_timers_run();
 }
 
 static int allocate_socket_fd(void) {
     for (int i = 0; i < NET_MAX_SOCKETS; i++) {
-        if (socket_pool[i].state == SOCKET_STATE_CLOSED) {
+        // A TCP socket stays CLOSED until it connects, but holds its connection
+        if (socket_pool[i].state == SOCKET_STATE_CLOSED && !socket_pool[i].protocol_data) {
             return i;
         }
     }
@@ -343,86 +729,151 @@ static void free_socket_fd(int fd) {
 
 // Interface management
 int net_interface_add(const net_interface* interface) {
+    net_interface* copy = malloc(sizeof(net_interface));
+    if (!copy) return -1;
+    memcpy(copy, interface, sizeof(net_interface));
+    copy->is_active = true;
+
+    spinlock_acquire(&interfaces_lock);
     for (int i = 0; i < NET_MAX_INTERFACES; i++) {
-        if (!interfaces[i].is_active) {
-            memcpy(&interfaces[i], interface, sizeof(net_interface));
-            interfaces[i].is_active = true;
+        if (!interfaces[i]) {
+            // Fully initialized before readers can see it
+            rcu_assign_pointer(interfaces[i], copy);
+            spinlock_release(&interfaces_lock);
             return 0;
         }
     }
+    spinlock_release(&interfaces_lock);
+    free(copy);
     return -1;
 }
 
 int net_interface_remove(const char* name) {
+    spinlock_acquire(&interfaces_lock);
     for (int i = 0; i < NET_MAX_INTERFACES; i++) {
-        if (interfaces[i].is_active &&
-            strcmp(interfaces[i].name, name) == 0) {
-            interfaces[i].is_active = false;
+        net_interface* interface = interfaces[i];
+        if (interface && strcmp(interface->name, name) == 0) {
+            rcu_assign_pointer(interfaces[i], NULL);
+            spinlock_release(&interfaces_lock);
+
+            synchronize_rcu();
+            free(interface);
             return 0;
         }
     }
+    spinlock_release(&interfaces_lock);
     return -1;
 }
 
 net_interface* net_interface_get(const char* name) {
+    net_interface* found = NULL;
+    uint64_t flags = rcu_read_lock();
     for (int i = 0; i < NET_MAX_INTERFACES; i++) {
-        if (interfaces[i].is_active &&
-            strcmp(interfaces[i].name, name) == 0) {
-            return &interfaces[i];
+        net_interface* interface = rcu_dereference(interfaces[i]);
+        if (interface && strcmp(interface->name, name) == 0) {
+            found = interface;
+            break;
         }
     }
-    return NULL;
+    rcu_read_unlock(flags);
+    return found;
 }
 
 // Packet handling
 int net_send_packet(net_packet* packet) {
     // Find appropriate interface
-    net_interface* interface = find_interface_for_ip(packet->source.ip);
-    if (!interface) return -1;
+    uint64_t flags = rcu_read_lock();
+    bool routable = find_interface_for_ip(packet->source.ip) != NULL;
+    rcu_read_unlock(flags);
+    if (!routable) return -1;
 
     // Send via IP layer
     return ip_send_packet(packet->destination.ip, IP_PROTOCOL_TCP,
                            packet->data, packet->length);
 }
 
-int net_receive_packet(net_packet* packet) {
-    if (!packet) {
-        return -1;
+bool net_ingress(struct pkbuf* pb) {
+    pb->next = NULL;
+    spinlock_acquire(&ingress_lock);
+    bool added = ingress_count < NET_INGRESS_MAX;
+    if (added) {
+        if (ingress_tail) ingress_tail->next = pb;
+        else ingress_head = pb;
+        ingress_tail = pb;
+        ingress_count++;
     }
+    spinlock_release(&ingress_lock);
+    if (!added) pkbuf_put(pb);
+    return added;
+}
 
-    // Use a buffer size that fits within uint16_t
-    uint8_t buffer[NET_MAX_PACKET_SIZE];
-    uint16_t length = NET_MAX_PACKET_SIZE > UINT16_MAX ? UINT16_MAX : (uint16_t)NET_MAX_PACKET_SIZE;
+static struct pkbuf* ingress_pop(void) {
+    spinlock_acquire(&ingress_lock);
+    struct pkbuf* pb = ingress_head;
+    if (pb) {
+        ingress_head = pb->next;
+        if (!ingress_head) ingress_tail = NULL;
+        ingress_count--;
+    }
+    spinlock_release(&ingress_lock);
+    return pb;
+}
 
-    // Use IP layer to receive packet
-    int result = ip_receive_packet(buffer, length);
-    if (result < 0) {
-        return -1;
+// TCP and UDP checksums, unless the NIC checked them already
+static bool transport_checksum_ok(const struct pkbuf* pb, const struct ip_packet* ip, uint16_t length) {
+    if (pb->csum == PKBUF_CSUM_VERIFIED) return true;
+    if (ip->protocol == IP_PROTOCOL_UDP) {
+        // Zero means the sender left it out
+        if (length < 8) return false;
+        if (*(const uint16_t*)(ip->payload + 6) == 0) return true;
+    } else if (ip->protocol != IP_PROTOCOL_TCP) {
+        return true;
     }
 
-    // Only allocate as much as was actually received
-    packet->data = malloc(length);
-    if (!packet->data) {
+    uint32_t sum = csum_pseudo(ip->source_ip, ip->destination_ip, length, ip->protocol, 0);
+    return csum_fold(csum_partial(ip->payload, length, sum)) == 0;
+}
+
+// The next received packet the IP layer accepts, its payload left in the
+// driver's buffer
+int net_receive_packet(net_packet* packet) {
+    if (!packet) {
         return -1;
     }
 
-    memcpy(packet->data, buffer, length);
-    packet->length = length;
+    struct pkbuf* pb;
+    while ((pb = ingress_pop()) != NULL) {
+        if (pb->len < sizeof(struct ip_packet) + 4 || ip_receive_packet(pb->data, pb->len) < 0) {
+            pkbuf_put(pb);
+            continue;
+        }
 
-    // Populate source and destination
-    // This would typically be extracted from the IP packet header
-    packet->source.ip = 0;  // Placeholder
-    packet->source.port = 0;
-    packet->destination.ip = 0;  // Placeholder
-    packet->destination.port = 0;
+        const struct ip_packet* ip = (const struct ip_packet*)pb->data;
+        if (!transport_checksum_ok(pb, ip, pb->len - sizeof(struct ip_packet))) {
+            ip_stats_rx_error(ip->protocol);
+            pkbuf_put(pb);
+            continue;
+        }
 
-    return 0;
+        // Ports are the first two fields of both TCP and UDP headers
+        const uint16_t* ports = (const uint16_t*)ip->payload;
+        packet->pkbuf = pb;
+        packet->data = (uint8_t*)ip->payload;
+        packet->length = pb->len - sizeof(struct ip_packet);
+        packet->protocol = ip->protocol;
+        packet->source.ip = ip->source_ip;
+        packet->source.port = ports[0];
+        packet->destination.ip = ip->destination_ip;
+        packet->destination.port = ports[1];
+        return 0;
+    }
+    return -1;
 }
 
 // Network utility functions
 uint32_t net_resolve_hostname(const char* hostname) {
-    // Basic implementation - just convert string IP to integer
-    return net_string_to_ip(hostname);
+    // Literal addresses, else the resolver and its cache
+    return net_resolve_dns(hostname);
 }
 
 void net_ip_to_string(uint32_t ip, char* str) {
@@ -435,14 +886,15 @@ uint32_t net_string_to_ip(const char* str) {
     return ip_string_to_int(str);
 }
 
-// Helper to find interface for a given IP
+// Helper to find interface for a given IP, inside an RCU read section
 static net_interface* find_interface_for_ip(uint32_t ip) {
     for (int i = 0; i < NET_MAX_INTERFACES; i++) {
-        if (interfaces[i].is_active) {
+        net_interface* interface = rcu_dereference(interfaces[i]);
+        if (interface) {
             // Check if IP is in the same subnet
-            if ((ip & interfaces[i].subnet) ==
-                (interfaces[i].ip & interfaces[i].subnet)) {
-                return &interfaces[i];
+            if ((ip & interface->subnet) ==
+                (interface->ip & interface->subnet)) {
+                return interface;
             }
         }
     }
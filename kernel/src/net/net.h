@@ -8,6 +8,11 @@
 #define NET_MAX_INTERFACES 8
 #define NET_MAX_SOCKETS 128
 #define NET_MAX_PACKET_SIZE 65536
+#define NET_INGRESS_MAX 256     // Received packets awaiting net_process_packets()
+#define NET_SOCKET_QUEUE 32     // Received packets held per socket
+#define NET_DEMUX_HASH_BITS 8   // Sockets hashed by address, 2^bits buckets
+#define NET_GRO_FLOWS 8         // TCP flows coalesced at once on receive
+#define NET_GRO_MAX_SEGS 44     // Segments per flow handed up together, about 64K
 #define NET_MAX_HOSTNAME 256
 
 // Socket types
@@ -60,14 +65,24 @@ typedef struct {
     bool is_active;
 } net_interface;
 
-// Packet structure
+struct pkbuf;
+
+// Packet structure; data points into the buffer the packet holds a
+// reference to
 typedef struct {
+    struct pkbuf* pkbuf;
     uint8_t* data;
     uint16_t length;
+    uint8_t protocol;           // IP_PROTOCOL_*
     net_address source;
     net_address destination;
 } net_packet;
 
+// Takes bytes where they lie, returning how many it used
+typedef uint32_t (*net_consume_t)(void* ctx, const uint8_t* data, uint32_t length);
+
+struct iovec;
+
 // Main network stack functions
 int net_init(void);
 void net_shutdown(void);
@@ -79,12 +94,27 @@ int net_socket_bind(int socket, uint32_t ip, uint16_t port);
 int net_socket_listen(int socket, int backlog);
 int net_socket_connect(int socket, uint32_t ip, uint16_t port);
 int net_socket_accept(int socket, net_address* client_addr);
+int net_socket_accept_wait(int socket, net_address* client_addr);
 bool http_is_initialized(void);
 net_socket* net_socket_get(int fd);
-int net_socket_send(int socket, const void* data, uint16_t length);
+int net_socket_send(int socket, const void* data, uint32_t length);
+// Send the segments as one stream write, or one datagram
+int net_socket_sendv(int socket, const struct iovec* iov, int count);
 int net_socket_receive(int socket, void* buffer, uint16_t* length);
+int net_socket_receive_wait(int socket, void* buffer, uint16_t* length);
+int net_socket_receive_timeout(int socket, void* buffer, uint16_t* length, uint64_t timeout_ns);
+// Hand TCP data to consume() straight from the receive buffer, sleeping
+// until some arrives: bytes used, 0 at end of stream, -1 on error
+int net_socket_receive_direct(int socket, net_consume_t consume, void* ctx);
 void net_socket_close(int socket);
 
+// Readiness for epoll: EPOLLIN once data or a connection is waiting for
+// the socket, EPOLLOUT while it can send, EPOLLHUP once the peer is gone. Changes are announced on the
+// socket's poll head.
+struct poll_head;
+uint32_t net_socket_poll(int socket);
+struct poll_head* net_socket_poll_head(int socket);
+
 // Network utility functions
 uint32_t net_resolve_hostname(const char* hostname);
 void net_ip_to_string(uint32_t ip, char* str);
@@ -98,5 +128,8 @@ net_interface* net_interface_get(const char* name);
 // Packet handling
 int net_send_packet(net_packet* packet);
 int net_receive_packet(net_packet* packet);
+// Queue a received IP packet for net_process_packets(), taking the reference;
+// false if the queue was full and the packet dropped
+bool net_ingress(struct pkbuf* pb);
 
 #endif // NET_H
\ No newline at end of file
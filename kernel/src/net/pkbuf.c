@@ -0,0 +1,88 @@
+#include <net/pkbuf.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <core/smp.h>
+
+static struct kmem_cache* pkbuf_cache = NULL;
+static spinlock_t pool_lock = SPINLOCK_INIT;
+static struct pkbuf* pool = NULL;
+static uint32_t pool_count = 0;
+
+void pkbuf_init(void) {
+    if (!pkbuf_cache) pkbuf_cache = kmem_cache_create("pkbuf", sizeof(struct pkbuf), 8, NULL);
+}
+
+static void pkbuf_reset(struct pkbuf* pb) {
+    pb->data = pb->head + PKBUF_HEADROOM;
+    pb->len = 0;
+    pb->csum = PKBUF_CSUM_NONE;
+    pb->refcount = 1;
+    pb->next = NULL;
+}
+
+struct pkbuf* pkbuf_alloc(void) {
+    uint64_t flags = spinlock_acquire_irqsave(&pool_lock);
+    struct pkbuf* pb = pool;
+    if (pb) {
+        pool = pb->next;
+        pool_count--;
+    }
+    spinlock_release_irqrestore(&pool_lock, flags);
+
+    if (!pb) {
+        if (!pkbuf_cache || !(pb = kmem_cache_alloc(pkbuf_cache))) return NULL;
+        void* page = pmm_alloc_page();
+        if (!page) {
+            kmem_cache_free(pkbuf_cache, pb);
+            return NULL;
+        }
+        pb->head = pmm_phys_to_virt(page);
+    }
+
+    pkbuf_reset(pb);
+    return pb;
+}
+
+uint32_t pkbuf_alloc_bulk(struct pkbuf** out, uint32_t count) {
+    uint32_t got = 0;
+    uint64_t flags = spinlock_acquire_irqsave(&pool_lock);
+    while (got < count && pool) {
+        out[got++] = pool;
+        pool = pool->next;
+        pool_count--;
+    }
+    spinlock_release_irqrestore(&pool_lock, flags);
+
+    for (uint32_t i = 0; i < got; i++) pkbuf_reset(out[i]);
+
+    // The pool ran dry; the rest one at a time from the PMM
+    while (got < count && (out[got] = pkbuf_alloc())) got++;
+    return got;
+}
+
+struct pkbuf* pkbuf_get(struct pkbuf* pb) {
+    __atomic_add_fetch(&pb->refcount, 1, __ATOMIC_RELAXED);
+    return pb;
+}
+
+void pkbuf_put(struct pkbuf* pb) {
+    if (!pb || __atomic_sub_fetch(&pb->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&pool_lock);
+    if (pool_count < PKBUF_POOL_MAX) {
+        pb->next = pool;
+        pool = pb;
+        pool_count++;
+        pb = NULL;
+    }
+    spinlock_release_irqrestore(&pool_lock, flags);
+
+    if (pb) {
+        pmm_free_page(pmm_virt_to_phys(pb->head));
+        kmem_cache_free(pkbuf_cache, pb);
+    }
+}
+
+uint64_t pkbuf_phys(const struct pkbuf* pb) {
+    return (uint64_t)pmm_virt_to_phys(pb->head) + pkbuf_headroom(pb);
+}
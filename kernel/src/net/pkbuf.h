@@ -0,0 +1,73 @@
+#ifndef PKBUF_H
+#define PKBUF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Packet buffers: one page each, DMA'd into by the NIC and passed up the
+// stack by reference. Headers are stripped or prepended in place by moving
+// data within the page, so a packet is copied at most once, to its reader.
+#define PKBUF_SIZE      4096
+#define PKBUF_HEADROOM  128     // Room to prepend link and IP headers on TX
+#define PKBUF_POOL_MAX  256     // Free buffers kept rather than returned to the PMM
+
+// What the NIC established about a received packet's checksums
+#define PKBUF_CSUM_NONE      0  // Left to the stack
+#define PKBUF_CSUM_VERIFIED  1  // IP and TCP/UDP checksums checked good
+
+struct pkbuf {
+    uint8_t* head;              // Start of the page
+    uint8_t* data;              // Start of the packet
+    uint16_t len;
+    uint8_t csum;               // PKBUF_CSUM_*
+    volatile uint32_t refcount;
+    struct pkbuf* next;         // For whoever holds it on a queue
+};
+
+// Before any driver allocates
+void pkbuf_init(void);
+// A buffer with one reference, empty, data at PKBUF_HEADROOM; NULL if out of memory
+struct pkbuf* pkbuf_alloc(void);
+// Up to count buffers into out under one pool lock; how many were had
+uint32_t pkbuf_alloc_bulk(struct pkbuf** out, uint32_t count);
+struct pkbuf* pkbuf_get(struct pkbuf* pb);
+// Drop a reference; the last returns the buffer to the pool
+void pkbuf_put(struct pkbuf* pb);
+
+static inline uint32_t pkbuf_headroom(const struct pkbuf* pb) {
+    return (uint32_t)(pb->data - pb->head);
+}
+
+static inline uint32_t pkbuf_tailroom(const struct pkbuf* pb) {
+    return PKBUF_SIZE - pkbuf_headroom(pb) - pb->len;
+}
+
+// Grow the packet at the front; NULL without the headroom
+static inline uint8_t* pkbuf_push(struct pkbuf* pb, uint32_t len) {
+    if (pkbuf_headroom(pb) < len) return NULL;
+    pb->data -= len;
+    pb->len += (uint16_t)len;
+    return pb->data;
+}
+
+// Strip len bytes off the front; NULL if the packet is shorter
+static inline uint8_t* pkbuf_pull(struct pkbuf* pb, uint32_t len) {
+    if (pb->len < len) return NULL;
+    pb->data += len;
+    pb->len -= (uint16_t)len;
+    return pb->data;
+}
+
+// Grow the packet at the end, returning where the new bytes go
+static inline uint8_t* pkbuf_append(struct pkbuf* pb, uint32_t len) {
+    if (pkbuf_tailroom(pb) < len) return NULL;
+    uint8_t* tail = pb->data + pb->len;
+    pb->len += (uint16_t)len;
+    return tail;
+}
+
+// Physical address of data, for descriptors; the page is contiguous
+uint64_t pkbuf_phys(const struct pkbuf* pb);
+
+#endif // PKBUF_H
@@ -0,0 +1,1385 @@
+#include <net/tcp.h>
+#include <net/checksum.h>
+#include <core/drivers/net/ip.h>
+#include <core/smp.h>
+#include <core/time.h>
+#include <core/timer.h>
+#include <core/workqueue.h>
+#include <fs/epoll.h>
+#include <utils/mem.h>
+#include <utils/asm.h>
+
+#define TCP_MSS_DEFAULT     536
+#define TCP_HDR_LEN         20
+#define TCP_OPT_MAX         40
+
+#define TCP_RTO_INITIAL_NS  1000000000ULL
+#define TCP_RTO_MIN_NS      200000000ULL
+#define TCP_RTO_MAX_NS      60000000000ULL
+#define TCP_DELACK_NS       40000000ULL
+#define TCP_TIME_WAIT_NS    30000000000ULL     // 2 MSL
+// A closed socket's connection is dropped once the peer is silent this long
+#define TCP_ORPHAN_NS       60000000000ULL
+#define TCP_MAX_RETRIES     12
+#define TCP_DUPACK_THRESH   3
+#define TCP_EPHEMERAL_FIRST 49152
+// Largest segment handed to IP, cut to MSS by the NIC or at the driver
+#define TCP_GSO_MAX         (65535 - 20 - TCP_HDR_LEN - TCP_OPT_MAX)
+
+// Options
+#define TCP_OPT_EOL         0
+#define TCP_OPT_NOP         1
+#define TCP_OPT_MSS         2
+#define TCP_OPT_WSCALE      3
+#define TCP_OPT_SACK_PERM   4
+#define TCP_OPT_SACK        5
+
+// CUBIC: beta 0.7 in 1/1024ths, C 0.4 per second cubed
+#define CUBIC_BETA          717
+#define CUBIC_T_MAX_MS      100000      // Keeps (t - K)^3 in range
+
+#define SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
+#define TCP_BUCKETS (1U << TCP_HASH_BITS)
+
+struct tcp_ring {
+    uint8_t* data;
+    uint32_t head;              // Offset of the first byte
+    uint32_t len;
+};
+
+struct tcp_range {
+    uint32_t start;
+    uint32_t end;
+};
+
+struct tcp_cb {
+    spinlock_t lock;
+    int fd;                     // -1 once the socket has let go
+    tcp_notify_t notify;
+    volatile net_socket_state state;
+    uint32_t local_ip;
+    uint32_t remote_ip;
+    uint16_t local_port;
+    uint16_t remote_port;
+    bool hashed;
+    struct tcp_cb* hash_next;
+    struct tcp_cb* all_next;
+    struct tcp_cb* all_prev;
+
+    // Send side. snd_buf holds the bytes from snd_data on, unacknowledged
+    // and unsent; the FIN, once sent, sits at fin_seq after them.
+    struct tcp_ring snd_buf;
+    uint32_t iss;
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t snd_max;           // Highest sequence sent, snd_nxt falls back on timeout
+    uint32_t snd_data;
+    uint32_t snd_wnd;           // Scaled
+    uint32_t snd_wl1;
+    uint32_t snd_wl2;
+    uint8_t snd_wscale;
+    uint16_t mss;
+    bool fin_queued;            // Closed by the socket: FIN follows the data
+    bool fin_sent;
+    uint32_t fin_seq;
+    struct tcp_range sacked[TCP_MAX_SACK];  // Peer's scoreboard above snd_una, ascending
+    uint32_t sacked_count;
+    uint32_t retransmit_next;   // Recovery resends holes from here
+
+    // Receive side. rcv_buf holds readable bytes; out-of-order ones are
+    // copied in at their offset and tracked in ooo, most recent first.
+    struct tcp_ring rcv_buf;
+    uint32_t irs;
+    uint32_t rcv_nxt;
+    uint8_t rcv_wscale;
+    struct tcp_range ooo[TCP_MAX_SACK];
+    uint32_t ooo_count;
+    uint32_t unacked_segments;  // Received since our last ACK
+    bool input_pending;         // Segments processed, output and ACK not yet decided
+    bool ack_now;               // One of them wants an immediate ACK
+    volatile bool fin_received;
+    volatile bool reset;
+    bool wscale_ok;
+    bool sack_ok;
+
+    // Congestion control, in bytes
+    uint32_t cc;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t dupacks;
+    bool in_recovery;
+    uint32_t recover;
+    uint32_t w_max;             // CUBIC: window before the last reduction
+    uint32_t w_origin;
+    uint32_t w_est;             // CUBIC: what Reno would have by now
+    uint64_t epoch_start;
+    uint64_t k_ms;
+
+    // RTT estimation (RFC 6298) and timers; deadlines are 0 when off
+    uint64_t srtt;
+    uint64_t rttvar;
+    uint64_t rto;
+    bool rtt_timing;
+    uint32_t rtt_seq;
+    uint64_t rtt_start;
+    uint32_t retries;
+    uint64_t rto_deadline;
+    uint64_t delack_deadline;
+    uint64_t timewait_deadline;
+    uint64_t orphan_deadline;   // socket closed, peer not yet done
+};
+
+// Connections by 4-tuple, and all of them for the timers. Lock order is
+// tcp_lock, then a connection's lock.
+static struct tcp_cb* tcp_buckets[TCP_BUCKETS];
+static struct tcp_cb* tcp_all = NULL;
+static spinlock_t tcp_lock = SPINLOCK_INIT;
+static volatile uint64_t tcp_next_timer = 0;   // Earliest deadline, roughly; 0 if none
+static uint16_t tcp_next_port = 0;
+static uint32_t tcp_default_cc = TCP_CC_CUBIC;
+
+static inline uint16_t be16(uint16_t v) { return __builtin_bswap16(v); }
+static inline uint32_t be32(uint32_t v) { return __builtin_bswap32(v); }
+static inline uint32_t min_u32(uint32_t a, uint32_t b) { return a < b ? a : b; }
+static inline uint32_t max_u32(uint32_t a, uint32_t b) { return a > b ? a : b; }
+
+static inline uint32_t tcp_hash(uint32_t local_ip, uint32_t remote_ip, uint16_t local_port, uint16_t remote_port) {
+    uint64_t key = ((uint64_t)local_ip << 32 | remote_ip) ^ ((uint64_t)local_port << 16 | remote_port);
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - TCP_HASH_BITS));
+}
+
+// tcp_lock held
+static struct tcp_cb* tcp_lookup(uint32_t local_ip, uint32_t remote_ip, uint16_t local_port, uint16_t remote_port) {
+    struct tcp_cb* tcb = tcp_buckets[tcp_hash(local_ip, remote_ip, local_port, remote_port)];
+    for (; tcb; tcb = tcb->hash_next) {
+        if (tcb->local_ip == local_ip && tcb->remote_ip == remote_ip &&
+            tcb->local_port == local_port && tcb->remote_port == remote_port) {
+            return tcb;
+        }
+    }
+    return NULL;
+}
+
+// Key in place; false if another connection has the 4-tuple. tcp_lock held.
+static bool tcp_hash_insert(struct tcp_cb* tcb) {
+    if (tcp_lookup(tcb->local_ip, tcb->remote_ip, tcb->local_port, tcb->remote_port)) return false;
+    struct tcp_cb** bucket = &tcp_buckets[tcp_hash(tcb->local_ip, tcb->remote_ip, tcb->local_port, tcb->remote_port)];
+    tcb->hash_next = *bucket;
+    *bucket = tcb;
+    tcb->hashed = true;
+    return true;
+}
+
+// tcp_lock held
+static void tcp_unlink(struct tcp_cb* tcb) {
+    if (tcb->hashed) {
+        struct tcp_cb** link = &tcp_buckets[tcp_hash(tcb->local_ip, tcb->remote_ip, tcb->local_port, tcb->remote_port)];
+        while (*link != tcb) link = &(*link)->hash_next;
+        *link = tcb->hash_next;
+        tcb->hashed = false;
+    }
+    if (tcb->all_prev) tcb->all_prev->all_next = tcb->all_next;
+    else tcp_all = tcb->all_next;
+    if (tcb->all_next) tcb->all_next->all_prev = tcb->all_prev;
+}
+
+static void tcp_free(struct tcp_cb* tcb) {
+    free(tcb->snd_buf.data);
+    free(tcb->rcv_buf.data);
+    free(tcb);
+}
+
+// tcp_lock is taken with interrupts on, so the wheel timer only queues the scan
+static void tcp_timer_work_fn(struct work* work) {
+    (void)work;
+    tcp_timers_run();
+}
+
+static struct work tcp_timer_work = WORK_INIT(tcp_timer_work_fn);
+
+static void tcp_timer_fire(struct timer* timer) {
+    (void)timer;
+    work_schedule(&tcp_timer_work);
+}
+
+static struct timer tcp_timer = TIMER_INIT(tcp_timer_fire);
+
+static inline void tcp_arm(uint64_t* deadline, uint64_t when) {
+    *deadline = when;
+    uint64_t next = tcp_next_timer;
+    if (!next || when < next) {
+        tcp_next_timer = when;
+        mod_timer(&tcp_timer, when);
+    }
+}
+
+// Copy between a ring and flat memory, offset counted from the head
+static void ring_write(struct tcp_ring* ring, uint32_t size, uint32_t offset, const uint8_t* src, uint32_t len) {
+    uint32_t pos = (ring->head + offset) % size;
+    uint32_t first = min_u32(len, size - pos);
+    memcpy(ring->data + pos, src, first);
+    memcpy(ring->data, src + first, len - first);
+}
+
+static void ring_read(const struct tcp_ring* ring, uint32_t size, uint32_t offset, uint8_t* dst, uint32_t len) {
+    uint32_t pos = (ring->head + offset) % size;
+    uint32_t first = min_u32(len, size - pos);
+    memcpy(dst, ring->data + pos, first);
+    memcpy(dst + first, ring->data, len - first);
+}
+
+static inline uint32_t tcp_rcv_space(const struct tcp_cb* tcb) {
+    return TCP_RCVBUF - tcb->rcv_buf.len;
+}
+
+static uint32_t tcp_isn(const struct tcp_cb* tcb) {
+    // Clock-driven, offset per flow (RFC 6528 in spirit)
+    uint64_t mix = ((uint64_t)tcb->local_ip << 32 | tcb->remote_ip) ^
+                   ((uint64_t)tcb->local_port << 16 | tcb->remote_port) ^ rdtsc();
+    mix *= 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(ktime_get_ns() >> 2) + (uint32_t)(mix >> 32);
+}
+
+// Build one segment and hand it to IP. Payload comes from the send buffer
+// at seq. One longer than the MSS goes out as a GSO super-segment, its
+// checksum left for whoever cuts it up. Lock held.
+static void tcp_xmit(struct tcp_cb* tcb, uint32_t seq, uint8_t flags, uint32_t len) {
+    uint8_t* segment = malloc(TCP_HDR_LEN + TCP_OPT_MAX + len);
+    if (!segment) return;
+    struct tcp_header* th = (struct tcp_header*)segment;
+    uint8_t* opt = segment + TCP_HDR_LEN;
+
+    if (flags & TCP_SYN) {
+        *opt++ = TCP_OPT_MSS;
+        *opt++ = 4;
+        *opt++ = TCP_MSS >> 8;
+        *opt++ = TCP_MSS & 0xFF;
+        // On a SYN-ACK only what the peer offered
+        if (!(flags & TCP_ACK) || tcb->wscale_ok) {
+            *opt++ = TCP_OPT_NOP;
+            *opt++ = TCP_OPT_WSCALE;
+            *opt++ = 3;
+            *opt++ = TCP_WSCALE;
+        }
+        if (!(flags & TCP_ACK) || tcb->sack_ok) {
+            *opt++ = TCP_OPT_NOP;
+            *opt++ = TCP_OPT_NOP;
+            *opt++ = TCP_OPT_SACK_PERM;
+            *opt++ = 2;
+        }
+    } else if ((flags & TCP_ACK) && tcb->sack_ok && tcb->ooo_count) {
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_SACK;
+        *opt++ = (uint8_t)(2 + 8 * tcb->ooo_count);
+        for (uint32_t i = 0; i < tcb->ooo_count; i++) {
+            uint32_t edges[2] = { be32(tcb->ooo[i].start), be32(tcb->ooo[i].end) };
+            memcpy(opt, edges, sizeof(edges));
+            opt += sizeof(edges);
+        }
+    }
+    uint32_t hlen = (uint32_t)(opt - segment);
+
+    uint32_t window = tcp_rcv_space(tcb) >> ((flags & TCP_SYN) ? 0 : tcb->rcv_wscale);
+    th->source_port = tcb->local_port;
+    th->destination_port = tcb->remote_port;
+    th->sequence_number = be32(seq);
+    th->acknowledgement_number = (flags & TCP_ACK) ? be32(tcb->rcv_nxt) : 0;
+    th->data_offset = (uint8_t)((hlen / 4) << 4);
+    th->flags = flags;
+    th->window_size = be16((uint16_t)min_u32(window, 0xFFFF));
+    th->checksum = 0;
+    th->urgent_pointer = 0;
+    if (len) ring_read(&tcb->snd_buf, TCP_SNDBUF, seq - tcb->snd_data, segment + hlen, len);
+
+    uint32_t total = hlen + len;
+    uint32_t sum = csum_pseudo(tcb->local_ip, tcb->remote_ip, (uint16_t)total, IP_PROTOCOL_TCP, 0);
+    if (len > tcb->mss) {
+        th->checksum = (uint16_t)~csum_fold(sum);
+        ip_send_gso(tcb->remote_ip, IP_PROTOCOL_TCP, segment, (uint16_t)total, tcb->mss);
+    } else {
+        th->checksum = csum_fold(csum_partial(segment, total, sum));
+        ip_send_packet(tcb->remote_ip, IP_PROTOCOL_TCP, segment, (uint16_t)total);
+    }
+    free(segment);
+
+    if (flags & TCP_ACK) {
+        tcb->unacked_segments = 0;
+        tcb->delack_deadline = 0;
+    }
+}
+
+static inline void tcp_send_ack(struct tcp_cb* tcb) {
+    tcp_xmit(tcb, tcb->snd_nxt, TCP_ACK, 0);
+}
+
+// A reset for a segment, from its addresses alone
+static void tcp_send_reset(uint32_t local_ip, uint32_t remote_ip, uint16_t local_port, uint16_t remote_port,
+                           uint32_t seq, uint32_t ack, uint8_t flags) {
+    struct tcp_header th;
+    memset(&th, 0, sizeof(th));
+    th.source_port = local_port;
+    th.destination_port = remote_port;
+    th.sequence_number = be32(seq);
+    th.acknowledgement_number = be32(ack);
+    th.data_offset = (TCP_HDR_LEN / 4) << 4;
+    th.flags = flags;
+    uint32_t sum = csum_pseudo(local_ip, remote_ip, TCP_HDR_LEN, IP_PROTOCOL_TCP, 0);
+    th.checksum = csum_fold(csum_partial(&th, TCP_HDR_LEN, sum));
+    ip_send_packet(remote_ip, IP_PROTOCOL_TCP, &th, TCP_HDR_LEN);
+}
+
+// Congestion control. Slow start is shared; the algorithms differ in how
+// the window grows past ssthresh and how far it falls on loss.
+static void cc_slow_start(struct tcp_cb* tcb, uint32_t acked) {
+    tcb->cwnd += min_u32(acked, tcb->mss);
+}
+
+static void reno_on_ack(struct tcp_cb* tcb, uint32_t acked) {
+    if (tcb->cwnd < tcb->ssthresh) {
+        cc_slow_start(tcb, acked);
+        return;
+    }
+    // About one segment per window's worth of ACKs
+    tcb->cwnd += max_u32((uint32_t)((uint64_t)tcb->mss * min_u32(acked, tcb->mss) / tcb->cwnd), 1);
+}
+
+static void reno_on_loss(struct tcp_cb* tcb) {
+    tcb->ssthresh = max_u32((tcb->snd_max - tcb->snd_una) / 2, 2 * tcb->mss);
+}
+
+static uint64_t icbrt(uint64_t x) {
+    uint64_t y = 0;
+    for (int s = 63; s >= 0; s -= 3) {
+        y <<= 1;
+        uint64_t b = 3 * y * (y + 1) + 1;
+        if ((x >> s) >= b) {
+            x -= b << s;
+            y++;
+        }
+    }
+    return y;
+}
+
+// W(t) = C (t - K)^3 + W_origin, K the time back to W_max, in whole
+// segments and milliseconds since there is no floating point here
+static void cubic_on_ack(struct tcp_cb* tcb, uint32_t acked, uint64_t now) {
+    if (tcb->cwnd < tcb->ssthresh) {
+        cc_slow_start(tcb, acked);
+        return;
+    }
+
+    uint32_t mss = tcb->mss;
+    if (!tcb->epoch_start) {
+        tcb->epoch_start = now;
+        tcb->w_est = tcb->cwnd;
+        if (tcb->cwnd < tcb->w_max) {
+            // K = cbrt((W_max - cwnd) / C) seconds
+            tcb->k_ms = icbrt((uint64_t)((tcb->w_max - tcb->cwnd) / mss) * 2500000000ULL);
+            tcb->w_origin = tcb->w_max;
+        } else {
+            tcb->k_ms = 0;
+            tcb->w_origin = tcb->cwnd;
+        }
+    }
+
+    int64_t t = (int64_t)((now - tcb->epoch_start + tcb->srtt) / 1000000);
+    if (t > CUBIC_T_MAX_MS) t = CUBIC_T_MAX_MS;
+    int64_t d = t - (int64_t)tcb->k_ms;
+    int64_t target_segments = (int64_t)(tcb->w_origin / mss) + 4 * d * d * d / 10000000000LL;
+    uint64_t target = target_segments > 0 ? (uint64_t)target_segments * mss : mss;
+
+    uint32_t grow;
+    if (target > tcb->cwnd) {
+        grow = (uint32_t)((target - tcb->cwnd) * acked / tcb->cwnd);
+        grow = min_u32(grow, acked);
+    } else {
+        grow = (uint32_t)((uint64_t)acked * mss / (100ULL * tcb->cwnd));
+    }
+    tcb->cwnd += max_u32(grow, 1);
+
+    // Not slower than Reno would be with the same reductions (alpha 9/17)
+    tcb->w_est += max_u32((uint32_t)((uint64_t)acked * mss * 9 / (17ULL * tcb->cwnd)), 1);
+    if (tcb->w_est > tcb->cwnd) tcb->cwnd += min_u32(tcb->w_est - tcb->cwnd, acked);
+}
+
+static void cubic_on_loss(struct tcp_cb* tcb) {
+    // Fast convergence: give up more room when below the last maximum
+    if (tcb->cwnd < tcb->w_max) {
+        tcb->w_max = (uint32_t)((uint64_t)tcb->cwnd * (1024 + CUBIC_BETA) / 2048);
+    } else {
+        tcb->w_max = tcb->cwnd;
+    }
+    tcb->ssthresh = max_u32((uint32_t)((uint64_t)tcb->cwnd * CUBIC_BETA / 1024), 2 * tcb->mss);
+    tcb->epoch_start = 0;
+}
+
+static void cc_on_ack(struct tcp_cb* tcb, uint32_t acked, uint64_t now) {
+    if (tcb->cc == TCP_CC_CUBIC) cubic_on_ack(tcb, acked, now);
+    else reno_on_ack(tcb, acked);
+}
+
+static void cc_on_loss(struct tcp_cb* tcb) {
+    if (tcb->cc == TCP_CC_CUBIC) cubic_on_loss(tcb);
+    else reno_on_loss(tcb);
+}
+
+// One RTT sample, in ns
+static void tcp_rtt_sample(struct tcp_cb* tcb, uint64_t rtt) {
+    if (!tcb->srtt) {
+        tcb->srtt = rtt;
+        tcb->rttvar = rtt / 2;
+    } else {
+        uint64_t delta = tcb->srtt > rtt ? tcb->srtt - rtt : rtt - tcb->srtt;
+        tcb->rttvar = (3 * tcb->rttvar + delta) / 4;
+        tcb->srtt = (7 * tcb->srtt + rtt) / 8;
+    }
+    uint64_t rto = tcb->srtt + (4 * tcb->rttvar > 1000000 ? 4 * tcb->rttvar : 1000000);
+    if (rto < TCP_RTO_MIN_NS) rto = TCP_RTO_MIN_NS;
+    if (rto > TCP_RTO_MAX_NS) rto = TCP_RTO_MAX_NS;
+    tcb->rto = rto;
+}
+
+// Send new data as the windows allow, the FIN after it. Lock held.
+static void tcp_output(struct tcp_cb* tcb, uint64_t now) {
+    net_socket_state state = tcb->state;
+    if (state != SOCKET_STATE_ESTABLISHED && state != SOCKET_STATE_CLOSE_WAIT &&
+        state != SOCKET_STATE_FIN_WAIT_1 && state != SOCKET_STATE_CLOSING && state != SOCKET_STATE_LAST_ACK) {
+        return;
+    }
+
+    uint32_t window = min_u32(tcb->cwnd, tcb->snd_wnd);
+    for (;;) {
+        uint32_t sent = tcb->snd_nxt - tcb->snd_data;
+        uint32_t unsent = tcb->snd_buf.len > sent ? tcb->snd_buf.len - sent : 0;
+        bool fin_due = tcb->fin_queued && sent == tcb->snd_buf.len;
+        if (!unsent && !fin_due) break;
+
+        uint32_t flight = tcb->snd_nxt - tcb->snd_una;
+        uint32_t len = 0;
+        if (unsent) {
+            if (flight >= window) {
+                // A closed window is probed from the retransmit timer
+                if (!tcb->rto_deadline) tcp_arm(&tcb->rto_deadline, now + tcb->rto);
+                break;
+            }
+            // As much as the windows allow in one go, whole segments
+            // unless it is the end of the data
+            uint32_t gso_max = TCP_GSO_MAX / tcb->mss * tcb->mss;
+            len = min_u32(min_u32(unsent, gso_max), window - flight);
+            if (len > tcb->mss && len < unsent) len -= len % tcb->mss;
+        }
+
+        uint8_t flags = TCP_ACK;
+        if (len == unsent) {
+            flags |= TCP_PSH;
+            if (tcb->fin_queued) flags |= TCP_FIN;
+        }
+        if (!tcb->rtt_timing && SEQ_GEQ(tcb->snd_nxt, tcb->snd_max) && len) {
+            tcb->rtt_timing = true;
+            tcb->rtt_seq = tcb->snd_nxt + len;
+            tcb->rtt_start = now;
+        }
+        tcp_xmit(tcb, tcb->snd_nxt, flags, len);
+        if (flags & TCP_FIN) {
+            tcb->fin_sent = true;
+            tcb->fin_seq = tcb->snd_nxt + len;
+        }
+        tcb->snd_nxt += len + ((flags & TCP_FIN) ? 1 : 0);
+        if (SEQ_GT(tcb->snd_nxt, tcb->snd_max)) tcb->snd_max = tcb->snd_nxt;
+        if (!tcb->rto_deadline) tcp_arm(&tcb->rto_deadline, now + tcb->rto);
+        if (flags & TCP_FIN) break;
+    }
+}
+
+// Resend one segment at seq, or the FIN once the data runs out; the
+// sequence space it covered. Lock held.
+static uint32_t tcp_resend(struct tcp_cb* tcb, uint32_t seq, uint32_t limit) {
+    uint32_t data_end = tcb->snd_data + tcb->snd_buf.len;
+    if (SEQ_LT(seq, data_end)) {
+        uint32_t len = min_u32(min_u32(data_end - seq, tcb->mss), limit);
+        tcp_xmit(tcb, seq, TCP_ACK, len);
+        return len;
+    }
+    if (tcb->fin_sent) {
+        tcp_xmit(tcb, tcb->fin_seq, TCP_ACK | TCP_FIN, 0);
+        return 1;
+    }
+    return 0;
+}
+
+// During recovery: the next range the SACK scoreboard says is missing, or
+// snd_una alone without SACK information. Lock held.
+static void tcp_retransmit_hole(struct tcp_cb* tcb) {
+    uint32_t seq = SEQ_GT(tcb->retransmit_next, tcb->snd_una) ? tcb->retransmit_next : tcb->snd_una;
+    if (!tcb->sacked_count) {
+        if (seq != tcb->snd_una) return;
+        tcb->retransmit_next = seq + tcp_resend(tcb, seq, tcb->mss);
+        return;
+    }
+
+    uint32_t limit = 0;
+    for (uint32_t i = 0; i < tcb->sacked_count; i++) {
+        const struct tcp_range* r = &tcb->sacked[i];
+        if (SEQ_LEQ(r->start, seq) && SEQ_LT(seq, r->end)) seq = r->end;
+        else if (SEQ_GT(r->start, seq)) {
+            limit = r->start - seq;
+            break;
+        }
+    }
+    // Nothing past the highest SACKed byte is known to be lost
+    if (!limit) return;
+    tcb->retransmit_next = seq + tcp_resend(tcb, seq, limit);
+}
+
+// Merge the peer's SACK blocks into the scoreboard. Lock held.
+static void tcp_update_sacked(struct tcp_cb* tcb, const uint8_t* blocks, uint32_t count) {
+    for (uint32_t b = 0; b < count; b++) {
+        uint32_t edges[2];
+        memcpy(edges, blocks + 8 * b, sizeof(edges));
+        struct tcp_range r = { be32(edges[0]), be32(edges[1]) };
+        if (!SEQ_LT(r.start, r.end) || SEQ_LEQ(r.end, tcb->snd_una) || SEQ_GT(r.end, tcb->snd_max)) continue;
+
+        // Absorb whatever it overlaps, then insert in order
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < tcb->sacked_count; i++) {
+            struct tcp_range* s = &tcb->sacked[i];
+            if (SEQ_LEQ(s->start, r.end) && SEQ_GEQ(s->end, r.start)) {
+                if (SEQ_LT(s->start, r.start)) r.start = s->start;
+                if (SEQ_GT(s->end, r.end)) r.end = s->end;
+            } else {
+                tcb->sacked[kept++] = *s;
+            }
+        }
+        uint32_t at = 0;
+        while (at < kept && SEQ_LT(tcb->sacked[at].start, r.start)) at++;
+        if (kept == TCP_MAX_SACK) {
+            // Full: the highest range goes, as holes below matter more
+            if (at == kept) {
+                tcb->sacked_count = kept;
+                continue;
+            }
+            kept--;
+        }
+        memmove(&tcb->sacked[at + 1], &tcb->sacked[at], (kept - at) * sizeof(struct tcp_range));
+        tcb->sacked[at] = r;
+        tcb->sacked_count = kept + 1;
+    }
+}
+
+// Forget SACKed ranges the cumulative ACK has passed. Lock held.
+static void tcp_prune_sacked(struct tcp_cb* tcb) {
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < tcb->sacked_count; i++) {
+        struct tcp_range r = tcb->sacked[i];
+        if (SEQ_LEQ(r.end, tcb->snd_una)) continue;
+        if (SEQ_LT(r.start, tcb->snd_una)) r.start = tcb->snd_una;
+        tcb->sacked[kept++] = r;
+    }
+    tcb->sacked_count = kept;
+}
+
+// Options in a received segment. SACK blocks are only looked at after the
+// handshake, the rest only on a SYN.
+struct tcp_options {
+    uint16_t mss;
+    int wscale;                 // -1 if absent
+    bool sack_permitted;
+    const uint8_t* sack;
+    uint32_t sack_count;
+};
+
+static void tcp_parse_options(const uint8_t* opt, uint32_t len, struct tcp_options* out) {
+    out->mss = 0;
+    out->wscale = -1;
+    out->sack_permitted = false;
+    out->sack = NULL;
+    out->sack_count = 0;
+
+    uint32_t i = 0;
+    while (i < len) {
+        uint8_t kind = opt[i];
+        if (kind == TCP_OPT_EOL) break;
+        if (kind == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || opt[i + 1] < 2 || i + opt[i + 1] > len) break;
+        uint8_t size = opt[i + 1];
+        if (kind == TCP_OPT_MSS && size == 4) {
+            out->mss = (uint16_t)(opt[i + 2] << 8 | opt[i + 3]);
+        } else if (kind == TCP_OPT_WSCALE && size == 3) {
+            out->wscale = opt[i + 2] > 14 ? 14 : opt[i + 2];
+        } else if (kind == TCP_OPT_SACK_PERM && size == 2) {
+            out->sack_permitted = true;
+        } else if (kind == TCP_OPT_SACK && size >= 10 && (size - 2) % 8 == 0) {
+            out->sack = opt + i + 2;
+            out->sack_count = (uint32_t)(size - 2) / 8;
+        }
+        i += size;
+    }
+}
+
+// What the peer's SYN settles. Lock held.
+static void tcp_apply_syn_options(struct tcp_cb* tcb, const struct tcp_options* opts, bool ours_sent) {
+    tcb->mss = opts->mss ? (uint16_t)min_u32(opts->mss, TCP_MSS) : TCP_MSS_DEFAULT;
+    tcb->wscale_ok = ours_sent && opts->wscale >= 0;
+    tcb->snd_wscale = tcb->wscale_ok ? (uint8_t)opts->wscale : 0;
+    tcb->rcv_wscale = tcb->wscale_ok ? TCP_WSCALE : 0;
+    tcb->sack_ok = opts->sack_permitted;
+    tcb->cwnd = TCP_INIT_CWND * tcb->mss;
+}
+
+// Note an out-of-order range already copied into rcv_buf, most recent
+// first, merged with any it touches. Lock held.
+static void tcp_add_ooo(struct tcp_cb* tcb, uint32_t start, uint32_t end) {
+    struct tcp_range r = { start, end };
+    uint32_t kept = 0;
+    struct tcp_range others[TCP_MAX_SACK];
+    for (uint32_t i = 0; i < tcb->ooo_count; i++) {
+        struct tcp_range* o = &tcb->ooo[i];
+        if (SEQ_LEQ(o->start, r.end) && SEQ_GEQ(o->end, r.start)) {
+            if (SEQ_LT(o->start, r.start)) r.start = o->start;
+            if (SEQ_GT(o->end, r.end)) r.end = o->end;
+        } else {
+            others[kept++] = *o;
+        }
+    }
+    // A range pushed off the end is just data the peer sends again
+    tcb->ooo[0] = r;
+    uint32_t count = min_u32(kept, TCP_MAX_SACK - 1);
+    memcpy(&tcb->ooo[1], others, count * sizeof(struct tcp_range));
+    tcb->ooo_count = count + 1;
+}
+
+// Advance past out-of-order data that now joins up. Lock held.
+static void tcp_absorb_ooo(struct tcp_cb* tcb) {
+    bool moved = true;
+    while (moved) {
+        moved = false;
+        for (uint32_t i = 0; i < tcb->ooo_count; i++) {
+            struct tcp_range r = tcb->ooo[i];
+            if (SEQ_GT(r.start, tcb->rcv_nxt)) continue;
+            if (SEQ_GT(r.end, tcb->rcv_nxt)) {
+                tcb->rcv_buf.len += r.end - tcb->rcv_nxt;
+                tcb->rcv_nxt = r.end;
+            }
+            memmove(&tcb->ooo[i], &tcb->ooo[i + 1], (tcb->ooo_count - i - 1) * sizeof(struct tcp_range));
+            tcb->ooo_count--;
+            moved = true;
+            break;
+        }
+    }
+}
+
+// The ACK field of a segment on a synchronized connection; false if the
+// segment is to be dropped. Lock held.
+static bool tcp_process_ack(struct tcp_cb* tcb, uint32_t seq, uint32_t ack, uint32_t window,
+                            uint32_t data_len, const struct tcp_options* opts, uint64_t now, uint32_t* events) {
+    if (SEQ_GT(ack, tcb->snd_max)) {
+        // Acknowledges something never sent
+        tcp_send_ack(tcb);
+        return false;
+    }
+
+    if (tcb->state == SOCKET_STATE_SYN_RECEIVED) {
+        if (!SEQ_GT(ack, tcb->snd_una)) return false;
+        // Closed meanwhile: the FIN goes out now
+        tcb->state = tcb->fin_queued ? SOCKET_STATE_FIN_WAIT_1 : SOCKET_STATE_ESTABLISHED;
+        tcb->snd_wl1 = seq;
+        tcb->snd_wl2 = ack;
+        tcb->snd_wnd = window << tcb->snd_wscale;
+        *events |= TCP_EVENT_WRITABLE;
+    }
+
+    uint32_t scaled = window << tcb->snd_wscale;
+    if (tcb->sack_ok && opts->sack_count) tcp_update_sacked(tcb, opts->sack, opts->sack_count);
+
+    if (SEQ_GT(ack, tcb->snd_una)) {
+        uint32_t acked = ack - tcb->snd_una;
+
+        // Drop acknowledged data from the send buffer
+        uint32_t data_end = tcb->snd_data + tcb->snd_buf.len;
+        uint32_t upto = SEQ_LT(ack, data_end) ? ack : data_end;
+        if (SEQ_GT(upto, tcb->snd_data)) {
+            uint32_t done = upto - tcb->snd_data;
+            tcb->snd_buf.head = (tcb->snd_buf.head + done) % TCP_SNDBUF;
+            tcb->snd_buf.len -= done;
+            tcb->snd_data = upto;
+            *events |= TCP_EVENT_WRITABLE;
+        }
+        tcb->snd_una = ack;
+        if (SEQ_LT(tcb->snd_nxt, tcb->snd_una)) tcb->snd_nxt = tcb->snd_una;
+        tcp_prune_sacked(tcb);
+
+        if (tcb->rtt_timing && SEQ_GEQ(ack, tcb->rtt_seq)) {
+            tcp_rtt_sample(tcb, now - tcb->rtt_start);
+            tcb->rtt_timing = false;
+        }
+        tcb->retries = 0;
+
+        if (tcb->in_recovery) {
+            if (SEQ_GEQ(ack, tcb->recover)) {
+                tcb->in_recovery = false;
+                tcb->cwnd = tcb->ssthresh;
+            } else {
+                // Partial ACK: the next hole is lost too (RFC 6582)
+                tcp_retransmit_hole(tcb);
+                tcb->cwnd = (tcb->cwnd > acked ? tcb->cwnd - acked : 0) + tcb->mss;
+            }
+        } else {
+            cc_on_ack(tcb, acked, now);
+        }
+        tcb->dupacks = 0;
+
+        if (tcb->snd_una == tcb->snd_max) tcb->rto_deadline = 0;
+        else tcp_arm(&tcb->rto_deadline, now + tcb->rto);
+
+        // Our FIN reached the peer
+        if (tcb->fin_sent && SEQ_GT(ack, tcb->fin_seq)) {
+            if (tcb->state == SOCKET_STATE_FIN_WAIT_1) {
+                tcb->state = SOCKET_STATE_FIN_WAIT_2;
+            } else if (tcb->state == SOCKET_STATE_CLOSING) {
+                tcb->state = SOCKET_STATE_TIME_WAIT;
+                tcp_arm(&tcb->timewait_deadline, now + TCP_TIME_WAIT_NS);
+            } else if (tcb->state == SOCKET_STATE_LAST_ACK) {
+                tcb->state = SOCKET_STATE_CLOSED;
+                *events |= TCP_EVENT_HANGUP;
+            }
+        }
+    } else if (ack == tcb->snd_una && !data_len && scaled == tcb->snd_wnd && tcb->snd_max != tcb->snd_una) {
+        // Duplicate ACK
+        tcb->dupacks++;
+        if (!tcb->in_recovery && tcb->dupacks == TCP_DUPACK_THRESH) {
+            cc_on_loss(tcb);
+            tcb->in_recovery = true;
+            tcb->recover = tcb->snd_max;
+            tcb->retransmit_next = tcb->snd_una;
+            tcb->rtt_timing = false;
+            tcp_retransmit_hole(tcb);
+            tcb->cwnd = tcb->ssthresh + TCP_DUPACK_THRESH * tcb->mss;
+        } else if (tcb->in_recovery) {
+            // Each one means a segment left the network
+            tcb->cwnd += tcb->mss;
+            if (tcb->sack_ok) tcp_retransmit_hole(tcb);
+        }
+    }
+
+    if (SEQ_LT(tcb->snd_wl1, seq) || (tcb->snd_wl1 == seq && SEQ_LEQ(tcb->snd_wl2, ack))) {
+        if (scaled > tcb->snd_wnd) *events |= TCP_EVENT_WRITABLE;
+        tcb->snd_wnd = scaled;
+        tcb->snd_wl1 = seq;
+        tcb->snd_wl2 = ack;
+    }
+    return true;
+}
+
+// One segment for a connection; the events for its socket. Lock held.
+static uint32_t tcp_segment(struct tcp_cb* tcb, const struct tcp_header* th, uint32_t hlen,
+                            uint32_t length, uint64_t now) {
+    uint32_t events = 0;
+    uint8_t flags = th->flags;
+    uint32_t seq = be32(th->sequence_number);
+    uint32_t ack = be32(th->acknowledgement_number);
+    uint32_t window = be16(th->window_size);
+    const uint8_t* data = (const uint8_t*)th + hlen;
+    uint32_t data_len = length - hlen;
+    // Reset, or reaped and not yet unhashed
+    if (tcb->state == SOCKET_STATE_CLOSED) return 0;
+    // The peer is still talking, so the orphan lives on
+    if (tcb->orphan_deadline) tcp_arm(&tcb->orphan_deadline, now + TCP_ORPHAN_NS);
+
+    struct tcp_options opts;
+    tcp_parse_options((const uint8_t*)th + TCP_HDR_LEN, hlen - TCP_HDR_LEN, &opts);
+
+    if (tcb->state == SOCKET_STATE_SYN_SENT) {
+        if ((flags & TCP_ACK) && ack != tcb->snd_nxt) {
+            if (!(flags & TCP_RST)) {
+                tcp_send_reset(tcb->local_ip, tcb->remote_ip, tcb->local_port, tcb->remote_port, ack, 0, TCP_RST);
+            }
+            return 0;
+        }
+        if (flags & TCP_RST) {
+            if (!(flags & TCP_ACK)) return 0;
+            tcb->state = SOCKET_STATE_CLOSED;
+            tcb->reset = true;
+            tcb->rto_deadline = 0;
+            return TCP_EVENT_READABLE | TCP_EVENT_HANGUP;
+        }
+        if (!(flags & TCP_SYN) || !(flags & TCP_ACK)) return 0;
+
+        tcb->irs = seq;
+        tcb->rcv_nxt = seq + 1;
+        tcb->snd_una = ack;
+        tcp_apply_syn_options(tcb, &opts, true);
+        tcb->snd_wnd = window;      // Never scaled on a SYN
+        tcb->snd_wl1 = seq;
+        tcb->snd_wl2 = ack;
+        if (tcb->rtt_timing) {
+            tcp_rtt_sample(tcb, now - tcb->rtt_start);
+            tcb->rtt_timing = false;
+        }
+        tcb->retries = 0;
+        tcb->rto_deadline = 0;
+        tcb->state = SOCKET_STATE_ESTABLISHED;
+        tcp_send_ack(tcb);
+        tcp_output(tcb, now);
+        return TCP_EVENT_WRITABLE;
+    }
+
+    // Acceptable if any of it falls in the receive window (RFC 793)
+    uint32_t span = data_len + ((flags & TCP_FIN) ? 1 : 0);
+    uint32_t rcv_wnd = tcp_rcv_space(tcb);
+    bool acceptable;
+    if (!span) {
+        acceptable = seq == tcb->rcv_nxt ||
+                     (rcv_wnd && SEQ_GEQ(seq, tcb->rcv_nxt) && SEQ_LT(seq, tcb->rcv_nxt + rcv_wnd));
+    } else {
+        acceptable = rcv_wnd && SEQ_LT(seq, tcb->rcv_nxt + rcv_wnd) && SEQ_GT(seq + span, tcb->rcv_nxt);
+    }
+    if (tcb->state == SOCKET_STATE_SYN_RECEIVED && (flags & TCP_SYN) && !(flags & TCP_ACK) && seq == tcb->irs) {
+        // Our SYN-ACK was lost
+        tcp_xmit(tcb, tcb->iss, TCP_SYN | TCP_ACK, 0);
+        return 0;
+    }
+    if (!acceptable) {
+        if (!(flags & TCP_RST)) tcp_send_ack(tcb);
+        return 0;
+    }
+
+    if (flags & TCP_RST) {
+        tcb->state = SOCKET_STATE_CLOSED;
+        tcb->reset = true;
+        tcb->rto_deadline = 0;
+        tcb->delack_deadline = 0;
+        return TCP_EVENT_READABLE | TCP_EVENT_HANGUP;
+    }
+    if (flags & TCP_SYN) {
+        // Challenge ACK for a SYN on a synchronized connection (RFC 5961)
+        tcp_send_ack(tcb);
+        return 0;
+    }
+    if (!(flags & TCP_ACK)) return 0;
+    if (!tcp_process_ack(tcb, seq, ack, window, data_len, &opts, now, &events)) return events;
+
+    // Data, trimmed to what is new and fits
+    net_socket_state state = tcb->state;
+    bool receiving = state == SOCKET_STATE_ESTABLISHED || state == SOCKET_STATE_FIN_WAIT_1 ||
+                     state == SOCKET_STATE_FIN_WAIT_2;
+    bool ack_now = false;
+    bool fin_in_order = false;
+    if (receiving && data_len) {
+        uint32_t skip = SEQ_LT(seq, tcb->rcv_nxt) ? tcb->rcv_nxt - seq : 0;
+        if (skip < data_len) {
+            uint32_t offset = seq + skip - tcb->rcv_nxt;
+            uint32_t len = min_u32(data_len - skip, rcv_wnd > offset ? rcv_wnd - offset : 0);
+            if (len) {
+                ring_write(&tcb->rcv_buf, TCP_RCVBUF, tcb->rcv_buf.len + offset, data + skip, len);
+                if (!offset) {
+                    tcb->rcv_buf.len += len;
+                    tcb->rcv_nxt += len;
+                    if (tcb->ooo_count) {
+                        // Filled a hole: tell the peer at once
+                        tcp_absorb_ooo(tcb);
+                        ack_now = true;
+                    }
+                    tcb->unacked_segments++;
+                    events |= TCP_EVENT_READABLE;
+                    fin_in_order = skip + len == data_len;
+                } else {
+                    tcp_add_ooo(tcb, seq + skip, seq + skip + len);
+                    ack_now = true;
+                }
+            }
+        } else {
+            // All old: the peer missed our ACK
+            ack_now = true;
+            fin_in_order = skip == data_len && seq + skip == tcb->rcv_nxt;
+        }
+    } else if (receiving) {
+        fin_in_order = seq == tcb->rcv_nxt;
+    }
+
+    if ((flags & TCP_FIN) && receiving && fin_in_order && !tcb->fin_received) {
+        tcb->rcv_nxt++;
+        tcb->fin_received = true;
+        ack_now = true;
+        events |= TCP_EVENT_READABLE;
+        if (state == SOCKET_STATE_ESTABLISHED) {
+            tcb->state = SOCKET_STATE_CLOSE_WAIT;
+        } else if (state == SOCKET_STATE_FIN_WAIT_1) {
+            tcb->state = SOCKET_STATE_CLOSING;
+        } else {
+            tcb->state = SOCKET_STATE_TIME_WAIT;
+            tcb->rto_deadline = 0;
+            tcp_arm(&tcb->timewait_deadline, now + TCP_TIME_WAIT_NS);
+        }
+    } else if ((flags & TCP_FIN) && tcb->state == SOCKET_STATE_TIME_WAIT) {
+        // The peer lost our last ACK
+        ack_now = true;
+        tcp_arm(&tcb->timewait_deadline, now + TCP_TIME_WAIT_NS);
+    }
+
+    tcb->input_pending = true;
+    tcb->ack_now |= ack_now;
+    return events;
+}
+
+// Once a segment, or a train of them, is in: send what the ACKs allowed,
+// then ACK unless that can wait. Every second segment is acknowledged at
+// once, others within TCP_DELACK_NS. Lock held.
+static void tcp_input_finish(struct tcp_cb* tcb, uint64_t now) {
+    if (!tcb->input_pending) return;
+    tcb->input_pending = false;
+    tcp_output(tcb, now);
+
+    if (tcb->ack_now || tcb->unacked_segments >= 2) {
+        tcp_send_ack(tcb);
+    } else if (tcb->unacked_segments && !tcb->delack_deadline) {
+        tcp_arm(&tcb->delack_deadline, now + TCP_DELACK_NS);
+    }
+    tcb->ack_now = false;
+}
+
+static struct tcp_cb* tcp_alloc(int fd, tcp_notify_t notify) {
+    struct tcp_cb* tcb = malloc(sizeof(struct tcp_cb));
+    if (!tcb) return NULL;
+    memset(tcb, 0, sizeof(struct tcp_cb));
+    tcb->snd_buf.data = malloc(TCP_SNDBUF);
+    tcb->rcv_buf.data = malloc(TCP_RCVBUF);
+    if (!tcb->snd_buf.data || !tcb->rcv_buf.data) {
+        tcp_free(tcb);
+        return NULL;
+    }
+
+    tcb->fd = fd;
+    tcb->notify = notify;
+    tcb->state = SOCKET_STATE_CLOSED;
+    tcb->mss = TCP_MSS_DEFAULT;
+    tcb->cc = tcp_default_cc;
+    tcb->cwnd = TCP_INIT_CWND * TCP_MSS_DEFAULT;
+    tcb->ssthresh = 0xFFFFFFFF;
+    tcb->rto = TCP_RTO_INITIAL_NS;
+    return tcb;
+}
+
+struct tcp_cb* tcp_create(int fd, tcp_notify_t notify) {
+    struct tcp_cb* tcb = tcp_alloc(fd, notify);
+    if (!tcb) return NULL;
+
+    spinlock_acquire(&tcp_lock);
+    tcb->all_next = tcp_all;
+    if (tcp_all) tcp_all->all_prev = tcb;
+    tcp_all = tcb;
+    spinlock_release(&tcp_lock);
+    return tcb;
+}
+
+// Ephemeral ports, taken in turn. tcp_lock held.
+static uint16_t tcp_pick_port(uint32_t local_ip, uint32_t remote_ip, uint16_t remote_port) {
+    for (uint32_t tries = 0; tries < 65536 - TCP_EPHEMERAL_FIRST; tries++) {
+        uint16_t port = (uint16_t)(TCP_EPHEMERAL_FIRST + tcp_next_port++ % (65536 - TCP_EPHEMERAL_FIRST));
+        uint16_t wire = be16(port);
+        if (!tcp_lookup(local_ip, remote_ip, wire, remote_port)) return wire;
+    }
+    return 0;
+}
+
+int tcp_connect(struct tcp_cb* tcb, net_address* local, net_address remote) {
+    if (!tcb || !local) return -1;
+    if (!local->ip) local->ip = ip_source_address(remote.ip);
+
+    spinlock_acquire(&tcp_lock);
+    spinlock_acquire(&tcb->lock);
+    if (tcb->state != SOCKET_STATE_CLOSED || tcb->hashed) {
+        spinlock_release(&tcb->lock);
+        spinlock_release(&tcp_lock);
+        return -1;
+    }
+    if (!local->port) local->port = tcp_pick_port(local->ip, remote.ip, remote.port);
+    tcb->local_ip = local->ip;
+    tcb->local_port = local->port;
+    tcb->remote_ip = remote.ip;
+    tcb->remote_port = remote.port;
+    if (!local->port || !tcp_hash_insert(tcb)) {
+        spinlock_release(&tcb->lock);
+        spinlock_release(&tcp_lock);
+        return -1;
+    }
+    spinlock_release(&tcp_lock);
+
+    uint64_t now = ktime_get_ns();
+    tcb->iss = tcp_isn(tcb);
+    tcb->snd_una = tcb->iss;
+    tcb->snd_nxt = tcb->iss + 1;
+    tcb->snd_max = tcb->snd_nxt;
+    tcb->snd_data = tcb->snd_nxt;
+    tcb->state = SOCKET_STATE_SYN_SENT;
+    tcb->rtt_timing = true;
+    tcb->rtt_start = now;
+    tcp_xmit(tcb, tcb->iss, TCP_SYN, 0);
+    tcp_arm(&tcb->rto_deadline, now + tcb->rto);
+    spinlock_release(&tcb->lock);
+    return 0;
+}
+
+int tcp_accept(struct tcp_cb* tcb, net_address local, const net_packet* syn) {
+    if (!tcb || !syn || syn->length < TCP_HDR_LEN) return -1;
+    const struct tcp_header* th = (const struct tcp_header*)syn->data;
+    uint32_t hlen = (uint32_t)(th->data_offset >> 4) * 4;
+    if (hlen < TCP_HDR_LEN || hlen > syn->length) return -1;
+
+    spinlock_acquire(&tcp_lock);
+    spinlock_acquire(&tcb->lock);
+    tcb->local_ip = local.ip;
+    tcb->local_port = local.port;
+    tcb->remote_ip = syn->source.ip;
+    tcb->remote_port = syn->source.port;
+    if (tcb->state != SOCKET_STATE_CLOSED || tcb->hashed || !tcp_hash_insert(tcb)) {
+        spinlock_release(&tcb->lock);
+        spinlock_release(&tcp_lock);
+        return -1;
+    }
+    spinlock_release(&tcp_lock);
+
+    struct tcp_options opts;
+    tcp_parse_options((const uint8_t*)th + TCP_HDR_LEN, hlen - TCP_HDR_LEN, &opts);
+    tcp_apply_syn_options(tcb, &opts, true);
+
+    uint64_t now = ktime_get_ns();
+    tcb->irs = be32(th->sequence_number);
+    tcb->rcv_nxt = tcb->irs + 1;
+    tcb->snd_wnd = be16(th->window_size);
+    tcb->iss = tcp_isn(tcb);
+    tcb->snd_una = tcb->iss;
+    tcb->snd_nxt = tcb->iss + 1;
+    tcb->snd_max = tcb->snd_nxt;
+    tcb->snd_data = tcb->snd_nxt;
+    tcb->state = SOCKET_STATE_SYN_RECEIVED;
+    tcb->rtt_timing = true;
+    tcb->rtt_seq = tcb->snd_nxt;
+    tcb->rtt_start = now;
+    tcp_xmit(tcb, tcb->iss, TCP_SYN | TCP_ACK, 0);
+    tcp_arm(&tcb->rto_deadline, now + tcb->rto);
+    spinlock_release(&tcb->lock);
+    return 0;
+}
+
+// The header length of a well-formed segment, 0 otherwise
+static uint32_t tcp_header_length(const net_packet* packet) {
+    if (packet->length < TCP_HDR_LEN) return 0;
+    const struct tcp_header* th = (const struct tcp_header*)packet->data;
+    uint32_t hlen = (uint32_t)(th->data_offset >> 4) * 4;
+    return hlen >= TCP_HDR_LEN && hlen <= packet->length ? hlen : 0;
+}
+
+bool tcp_input(const net_packet* packets, uint32_t count) {
+    const net_packet* first = &packets[0];
+    spinlock_acquire(&tcp_lock);
+    struct tcp_cb* tcb = tcp_lookup(first->destination.ip, first->source.ip,
+                                    first->destination.port, first->source.port);
+    if (tcb) spinlock_acquire(&tcb->lock);
+    spinlock_release(&tcp_lock);
+
+    if (!tcb) {
+        const struct tcp_header* th = (const struct tcp_header*)first->data;
+        if (count == 1 && tcp_header_length(first) &&
+            (th->flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (tcp_header_length(&packets[i])) tcp_reject(&packets[i]);
+        }
+        return true;
+    }
+
+    // One lookup, one lock and one ACK decision for the lot
+    uint64_t now = ktime_get_ns();
+    uint32_t events = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t hlen = tcp_header_length(&packets[i]);
+        if (!hlen) continue;
+        events |= tcp_segment(tcb, (const struct tcp_header*)packets[i].data, hlen, packets[i].length, now);
+    }
+    tcp_input_finish(tcb, now);
+    int fd = tcb->fd;
+    // Finished with the socket gone: the timers reap it
+    if (fd < 0 && tcb->state == SOCKET_STATE_CLOSED) tcp_arm(&tcb->timewait_deadline, now);
+    tcp_notify_t notify = tcb->notify;
+    spinlock_release(&tcb->lock);
+
+    if (events && fd >= 0 && notify) notify(fd, events);
+    return true;
+}
+
+void tcp_reject(const net_packet* packet) {
+    if (packet->length < TCP_HDR_LEN) return;
+    const struct tcp_header* th = (const struct tcp_header*)packet->data;
+    if (th->flags & TCP_RST) return;
+
+    // RFC 793: take the sequence from their ACK, else acknowledge the segment
+    uint32_t hlen = (uint32_t)(th->data_offset >> 4) * 4;
+    uint32_t span = (packet->length > hlen ? packet->length - hlen : 0) +
+                    ((th->flags & TCP_SYN) ? 1 : 0) + ((th->flags & TCP_FIN) ? 1 : 0);
+    if (th->flags & TCP_ACK) {
+        tcp_send_reset(packet->destination.ip, packet->source.ip, packet->destination.port, packet->source.port,
+                       be32(th->acknowledgement_number), 0, TCP_RST);
+    } else {
+        tcp_send_reset(packet->destination.ip, packet->source.ip, packet->destination.port, packet->source.port,
+                       0, be32(th->sequence_number) + span, TCP_RST | TCP_ACK);
+    }
+}
+
+int tcp_send(struct tcp_cb* tcb, const void* data, uint32_t length) {
+    if (!tcb) return -1;
+    spinlock_acquire(&tcb->lock);
+    net_socket_state state = tcb->state;
+    bool open = !tcb->fin_queued && (state == SOCKET_STATE_SYN_SENT || state == SOCKET_STATE_SYN_RECEIVED ||
+                                     state == SOCKET_STATE_ESTABLISHED || state == SOCKET_STATE_CLOSE_WAIT);
+    if (!open) {
+        spinlock_release(&tcb->lock);
+        return -1;
+    }
+
+    uint32_t len = min_u32(length, TCP_SNDBUF - tcb->snd_buf.len);
+    if (len) {
+        ring_write(&tcb->snd_buf, TCP_SNDBUF, tcb->snd_buf.len, data, len);
+        tcb->snd_buf.len += len;
+        tcp_output(tcb, ktime_get_ns());
+    }
+    spinlock_release(&tcb->lock);
+    return (int)len;
+}
+
+// Drop len read bytes off the receive buffer. Lock held.
+static void tcp_rcv_consume(struct tcp_cb* tcb, uint32_t len) {
+    uint32_t before = tcp_rcv_space(tcb);
+    tcb->rcv_buf.head = (tcb->rcv_buf.head + len) % TCP_RCVBUF;
+    tcb->rcv_buf.len -= len;
+    // Announce a window that opened by a segment or more, or from zero
+    uint32_t after = tcp_rcv_space(tcb);
+    if (tcb->state != SOCKET_STATE_CLOSED && (before < tcb->mss || after - before >= TCP_RCVBUF / 2)) {
+        tcp_send_ack(tcb);
+    }
+}
+
+int tcp_receive(struct tcp_cb* tcb, void* buffer, uint32_t length) {
+    if (!tcb) return -1;
+    spinlock_acquire(&tcb->lock);
+    uint32_t len = min_u32(length, tcb->rcv_buf.len);
+    int result;
+    if (len) {
+        ring_read(&tcb->rcv_buf, TCP_RCVBUF, 0, buffer, len);
+        tcp_rcv_consume(tcb, len);
+        result = (int)len;
+    } else {
+        result = tcb->fin_received || tcb->reset ? 0 : -1;
+    }
+    spinlock_release(&tcb->lock);
+    return result;
+}
+
+int tcp_receive_direct(struct tcp_cb* tcb, net_consume_t consume, void* ctx) {
+    if (!tcb || !consume) return -1;
+    spinlock_acquire(&tcb->lock);
+    uint32_t head = tcb->rcv_buf.head;
+    uint32_t len = tcb->rcv_buf.len;
+    bool finished = tcb->fin_received || tcb->reset;
+    spinlock_release(&tcb->lock);
+    if (!len) return finished ? 0 : -1;
+
+    // Only the reader moves head and input only writes past len, so the
+    // spans hold still while consume() works on them unlocked
+    uint32_t first = min_u32(len, TCP_RCVBUF - head);
+    uint32_t used = min_u32(consume(ctx, tcb->rcv_buf.data + head, first), first);
+    if (used == first && first < len) {
+        used += min_u32(consume(ctx, tcb->rcv_buf.data, len - first), len - first);
+    }
+
+    if (used) {
+        spinlock_acquire(&tcb->lock);
+        tcp_rcv_consume(tcb, min_u32(used, tcb->rcv_buf.len));
+        spinlock_release(&tcb->lock);
+    }
+    return (int)used;
+}
+
+uint32_t tcp_poll(struct tcp_cb* tcb) {
+    if (!tcb) return EPOLLERR;
+    uint32_t events = 0;
+    net_socket_state state = tcb->state;
+    if (tcb->rcv_buf.len || tcb->fin_received || tcb->reset) events |= EPOLLIN;
+    if ((state == SOCKET_STATE_ESTABLISHED || state == SOCKET_STATE_CLOSE_WAIT) &&
+        tcb->snd_buf.len < TCP_SNDBUF) {
+        events |= EPOLLOUT;
+    }
+    if (tcb->reset || (tcb->fin_received && tcb->fin_queued)) events |= EPOLLHUP;
+    return events;
+}
+
+net_socket_state tcp_state(struct tcp_cb* tcb) {
+    return tcb ? tcb->state : SOCKET_STATE_CLOSED;
+}
+
+void tcp_set_congestion(struct tcp_cb* tcb, uint32_t algorithm) {
+    if (!tcb || (algorithm != TCP_CC_NEWRENO && algorithm != TCP_CC_CUBIC)) return;
+    spinlock_acquire(&tcb->lock);
+    tcb->cc = algorithm;
+    tcb->epoch_start = 0;
+    spinlock_release(&tcb->lock);
+}
+
+void tcp_close(struct tcp_cb* tcb) {
+    if (!tcb) return;
+    // tcp_lock throughout, so the timers cannot reap it under us
+    spinlock_acquire(&tcp_lock);
+    spinlock_acquire(&tcb->lock);
+    tcb->fd = -1;
+    tcb->notify = NULL;
+
+    net_socket_state state = tcb->state;
+    if (tcb->rcv_buf.len && state != SOCKET_STATE_CLOSED) {
+        // Unread data is lost, so say so (RFC 2525)
+        tcp_send_reset(tcb->local_ip, tcb->remote_ip, tcb->local_port, tcb->remote_port, tcb->snd_nxt, 0, TCP_RST);
+        tcb->state = SOCKET_STATE_CLOSED;
+    } else if (state == SOCKET_STATE_SYN_SENT) {
+        tcb->state = SOCKET_STATE_CLOSED;
+    } else if (state == SOCKET_STATE_SYN_RECEIVED) {
+        // The FIN follows once the handshake completes
+        tcb->fin_queued = true;
+    } else if (state == SOCKET_STATE_ESTABLISHED) {
+        tcb->fin_queued = true;
+        tcb->state = SOCKET_STATE_FIN_WAIT_1;
+    } else if (state == SOCKET_STATE_CLOSE_WAIT) {
+        tcb->fin_queued = true;
+        tcb->state = SOCKET_STATE_LAST_ACK;
+    }
+    uint64_t now = ktime_get_ns();
+    if (tcb->fin_queued) tcp_output(tcb, now);
+    bool done = tcb->state == SOCKET_STATE_CLOSED;
+    // FIN_WAIT_2 and LAST_ACK wait on the peer, which may never answer
+    if (!done && tcb->state != SOCKET_STATE_TIME_WAIT) tcp_arm(&tcb->orphan_deadline, now + TCP_ORPHAN_NS);
+    // Input finds connections under tcp_lock, so none can be waiting on it
+    if (done) tcp_unlink(tcb);
+    spinlock_release(&tcb->lock);
+    spinlock_release(&tcp_lock);
+
+    if (done) tcp_free(tcb);
+}
+
+// One connection's due timers; the events for its socket. Lock held.
+static uint32_t tcp_timers(struct tcp_cb* tcb, uint64_t now) {
+    uint32_t events = 0;
+
+    if (tcb->timewait_deadline && now >= tcb->timewait_deadline) {
+        tcb->timewait_deadline = 0;
+        tcb->state = SOCKET_STATE_CLOSED;
+    }
+
+    if (tcb->orphan_deadline && now >= tcb->orphan_deadline) {
+        tcb->orphan_deadline = 0;
+        if (tcb->state != SOCKET_STATE_CLOSED && tcb->state != SOCKET_STATE_TIME_WAIT) {
+            tcp_send_reset(tcb->local_ip, tcb->remote_ip, tcb->local_port, tcb->remote_port, tcb->snd_nxt, 0, TCP_RST);
+            tcb->state = SOCKET_STATE_CLOSED;
+            return 0;
+        }
+    }
+
+    if (tcb->delack_deadline && now >= tcb->delack_deadline) tcp_send_ack(tcb);
+
+    if (tcb->rto_deadline && now >= tcb->rto_deadline) {
+        tcb->rto_deadline = 0;
+        uint32_t flight = tcb->snd_max - tcb->snd_una;
+        uint32_t unsent = tcb->snd_data + tcb->snd_buf.len - tcb->snd_nxt;
+        // A closed window with data to go is probed a byte at a time,
+        // however long the peer takes to open it
+        bool probe = !tcb->snd_wnd && flight <= 1 && SEQ_LT(tcb->snd_una, tcb->snd_data + tcb->snd_buf.len) &&
+                     (flight || (int32_t)unsent > 0);
+
+        if (!probe && ++tcb->retries > TCP_MAX_RETRIES) {
+            tcp_send_reset(tcb->local_ip, tcb->remote_ip, tcb->local_port, tcb->remote_port, tcb->snd_nxt, 0, TCP_RST);
+            tcb->state = SOCKET_STATE_CLOSED;
+            tcb->reset = true;
+            return TCP_EVENT_READABLE | TCP_EVENT_HANGUP;
+        }
+
+        if (tcb->state == SOCKET_STATE_SYN_SENT) {
+            tcb->rtt_timing = false;
+            tcp_xmit(tcb, tcb->iss, TCP_SYN, 0);
+        } else if (tcb->state == SOCKET_STATE_SYN_RECEIVED) {
+            tcb->rtt_timing = false;
+            tcp_xmit(tcb, tcb->iss, TCP_SYN | TCP_ACK, 0);
+        } else if (probe) {
+            tcp_xmit(tcb, tcb->snd_una, TCP_ACK, 1);
+            if (!flight) {
+                tcb->snd_nxt = tcb->snd_una + 1;
+                tcb->snd_max = tcb->snd_nxt;
+            }
+        } else if (flight) {
+            // Loss: back to one segment and go again from snd_una
+            cc_on_loss(tcb);
+            tcb->cwnd = tcb->mss;
+            tcb->in_recovery = false;
+            tcb->dupacks = 0;
+            tcb->sacked_count = 0;
+            tcb->rtt_timing = false;
+            tcb->snd_nxt = tcb->snd_una;
+            tcb->retransmit_next = tcb->snd_una;
+            tcp_output(tcb, now);
+            if (tcb->snd_nxt == tcb->snd_una) tcb->snd_nxt += tcp_resend(tcb, tcb->snd_una, tcb->mss);
+        }
+
+        if (tcb->state != SOCKET_STATE_CLOSED && (flight || probe || tcb->state == SOCKET_STATE_SYN_SENT ||
+                                                  tcb->state == SOCKET_STATE_SYN_RECEIVED)) {
+            tcb->rto = tcb->rto * 2 > TCP_RTO_MAX_NS ? TCP_RTO_MAX_NS : tcb->rto * 2;
+            tcb->rto_deadline = now + tcb->rto;
+        }
+    }
+    return events;
+}
+
+static inline void tcp_note_deadline(uint64_t* next, uint64_t deadline) {
+    if (deadline && (!*next || deadline < *next)) *next = deadline;
+}
+
+void tcp_timers_run(void) {
+    uint64_t now = ktime_get_ns();
+    uint64_t due = tcp_next_timer;
+    if (!due || now < due) return;
+
+    spinlock_acquire(&tcp_lock);
+    tcp_next_timer = 0;
+    uint64_t next = 0;
+    struct tcp_cb* tcb = tcp_all;
+    while (tcb) {
+        struct tcp_cb* following = tcb->all_next;
+        spinlock_acquire(&tcb->lock);
+        uint32_t events = tcp_timers(tcb, now);
+        int fd = tcb->fd;
+        tcp_notify_t notify = tcb->notify;
+        bool orphaned = fd < 0 && tcb->state == SOCKET_STATE_CLOSED;
+        tcp_note_deadline(&next, tcb->rto_deadline);
+        tcp_note_deadline(&next, tcb->delack_deadline);
+        tcp_note_deadline(&next, tcb->timewait_deadline);
+        tcp_note_deadline(&next, tcb->orphan_deadline);
+        spinlock_release(&tcb->lock);
+
+        if (orphaned) {
+            // Nobody else can reach it: the socket let go and input finds
+            // connections only under tcp_lock
+            tcp_unlink(tcb);
+            tcp_free(tcb);
+        } else if (events && fd >= 0 && notify) {
+            notify(fd, events);
+        }
+        tcb = following;
+    }
+    // Deadlines armed meanwhile went into tcp_next_timer already
+    if (next && (!tcp_next_timer || next < tcp_next_timer)) tcp_next_timer = next;
+    if (tcp_next_timer) mod_timer(&tcp_timer, tcp_next_timer);
+    spinlock_release(&tcp_lock);
+}
@@ -0,0 +1,71 @@
+#ifndef TCP_H
+#define TCP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/net.h>
+
+// TCP over the IP layer: sliding windows with window scaling and SACK,
+// NewReno or CUBIC congestion control, delayed ACKs and RTT-based
+// retransmission. Addresses and ports are kept as sockets hold them.
+#define TCP_MSS             1460    // Advertised; peers without the option get 536
+#define TCP_SNDBUF          131072
+#define TCP_RCVBUF          131072
+#define TCP_WSCALE          2       // Our window shift, so TCP_RCVBUF fits 16 bits
+#define TCP_INIT_CWND       10      // Segments (RFC 6928)
+#define TCP_MAX_SACK        4       // Ranges tracked either way
+#define TCP_HASH_BITS       8
+
+// Header flags
+#define TCP_FIN             0x01
+#define TCP_SYN             0x02
+#define TCP_RST             0x04
+#define TCP_PSH             0x08
+#define TCP_ACK             0x10
+
+// Congestion control
+#define TCP_CC_NEWRENO      0
+#define TCP_CC_CUBIC        1
+
+// What a connection tells its socket about
+#define TCP_EVENT_READABLE  1       // Data, end of stream or a reset
+#define TCP_EVENT_WRITABLE  2       // Connected, or send buffer space freed
+#define TCP_EVENT_HANGUP    4
+
+struct tcp_cb;
+
+// Called without the connection's lock held
+typedef void (*tcp_notify_t)(int fd, uint32_t events);
+
+struct tcp_cb* tcp_create(int fd, tcp_notify_t notify);
+// Send the SYN. A zero local port or address is filled in.
+int tcp_connect(struct tcp_cb* tcb, net_address* local, net_address remote);
+// Answer a SYN taken off a listener's queue; -1 if the flow already exists
+int tcp_accept(struct tcp_cb* tcb, net_address local, const net_packet* syn);
+// Hand received segments of one flow, in order, to their connection.
+// False only for a lone SYN no connection owns, left for a listener.
+bool tcp_input(const net_packet* packets, uint32_t count);
+// Answer a segment nobody wants with a reset
+void tcp_reject(const net_packet* packet);
+
+// Queue what fits in the send buffer: bytes taken, -1 once it cannot send
+int tcp_send(struct tcp_cb* tcb, const void* data, uint32_t length);
+// Bytes read, 0 at end of stream or after a reset, -1 if nothing yet
+int tcp_receive(struct tcp_cb* tcb, void* buffer, uint32_t length);
+// Pass received bytes to consume() where they lie in the receive buffer,
+// in up to two spans as it wraps; what it uses is consumed. For the one
+// reader of the connection. Returns as tcp_receive() does.
+int tcp_receive_direct(struct tcp_cb* tcb, net_consume_t consume, void* ctx);
+// EPOLLIN/EPOLLOUT/EPOLLHUP, without locking
+uint32_t tcp_poll(struct tcp_cb* tcb);
+net_socket_state tcp_state(struct tcp_cb* tcb);
+void tcp_set_congestion(struct tcp_cb* tcb, uint32_t algorithm);
+// Detach from the socket and finish the stream; the connection frees
+// itself once done
+void tcp_close(struct tcp_cb* tcb);
+
+// Fire due retransmit, delayed ACK and TIME-WAIT timers. Until there is a
+// timer subsystem the net worker and socket calls drive this.
+void tcp_timers_run(void);
+
+#endif // TCP_H
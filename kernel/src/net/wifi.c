@@ -6,6 +6,21 @@
 #include <mm/heap.h>
 #include <utils/io.h>
 #include <utils/mem.h>
+#include <core/drivers/net/netdev.h>
+#include <net/net.h>
+
+const uint8_t broadcast_addr[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// RFC 1042 encapsulation, ahead of the ethertype
+static const uint8_t llc_snap[6] = {0xAA, 0xAA, 0x03, 0x00, 0x00, 0x00};
+
+// RX/TX frames before an interrupt, and the timer in us, per level
+static const struct {
+    uint8_t frames;
+    uint16_t usecs;
+} coal_levels[WIFI_COAL_LEVELS] = {
+    {4, 10}, {16, 50}, {32, 100}, {64, 250},
+};
 
 // Register access helpers
 static inline uint32_t wifi_read32(struct wifi_device* dev, uint32_t reg) {
@@ -16,6 +31,30 @@ static inline void wifi_write32(struct wifi_device* dev, uint32_t reg, uint32_t
     *(volatile uint32_t*)((uint8_t*)dev->mmio_base + reg) = val;
 }
 
+// Point the device at the rings, all TX slots free and all RX slots its
+// own; after a reset the buffers already there are reused
+static void program_dma_rings(struct wifi_device* dev) {
+    for (int i = 0; i < TX_RING_SIZE; i++) {
+        dev->tx_ring[i].status = 0;
+        dev->tx_ring[i].flags = DESC_FLAG_INT;
+    }
+    for (int i = 0; i < RX_RING_SIZE; i++) {
+        dev->rx_ring[i].buffer_len = RX_BUFFER_SIZE;
+        dev->rx_ring[i].status = 0;
+        dev->rx_ring[i].flags = DESC_FLAG_OWN | DESC_FLAG_INT;
+    }
+
+    // Program DMA registers
+    wifi_write32(dev, WIFI_REG_TX_BASE, (uint32_t)(uint64_t)dev->tx_ring);
+    wifi_write32(dev, WIFI_REG_TX_SIZE, TX_RING_SIZE);
+    wifi_write32(dev, WIFI_REG_RX_BASE, (uint32_t)(uint64_t)dev->rx_ring);
+    wifi_write32(dev, WIFI_REG_RX_SIZE, RX_RING_SIZE);
+
+    // Reset ring pointers
+    dev->tx_head = dev->tx_tail = 0;
+    dev->rx_head = dev->rx_tail = 0;
+}
+
 // Initialize DMA rings
 static bool setup_dma_rings(struct wifi_device* dev) {
     // Allocate TX ring
@@ -52,40 +91,32 @@ static bool setup_dma_rings(struct wifi_device* dev) {
         desc->next = &dev->tx_ring[(i + 1) % TX_RING_SIZE];
     }
 
-    // Allocate RX buffers
-    for (int i = 0; i < RX_RING_SIZE; i++) {
-        dev->rx_buffers[i] = pmm_alloc_page();
-        if (!dev->rx_buffers[i]) {
-            // Cleanup on failure
-            for (int j = 0; j < i; j++) {
-                pmm_free_page(dev->rx_buffers[j]);
-            }
-            for (int j = 0; j < TX_RING_SIZE; j++) {
-                pmm_free_page(dev->tx_buffers[j]);
-            }
-            pmm_free_page(dev->tx_ring);
-            pmm_free_page(dev->rx_ring);
-            return false;
+    // Allocate RX buffers, in one go from the packet buffer pool
+    uint32_t got = pkbuf_alloc_bulk(dev->rx_pkbufs, RX_RING_SIZE);
+    if (got < RX_RING_SIZE) {
+        // Cleanup on failure
+        for (uint32_t i = 0; i < got; i++) {
+            pkbuf_put(dev->rx_pkbufs[i]);
+            dev->rx_pkbufs[i] = NULL;
+        }
+        for (int i = 0; i < TX_RING_SIZE; i++) {
+            pmm_free_page(dev->tx_buffers[i]);
         }
+        pmm_free_page(dev->tx_ring);
+        pmm_free_page(dev->rx_ring);
+        return false;
+    }
 
-        // Initialize RX descriptor
+    // Initialize RX descriptors
+    for (int i = 0; i < RX_RING_SIZE; i++) {
         struct wifi_dma_desc* desc = &dev->rx_ring[i];
-        desc->buffer_addr = (uint64_t)dev->rx_buffers[i];
+        desc->buffer_addr = pkbuf_phys(dev->rx_pkbufs[i]);
         desc->buffer_len = RX_BUFFER_SIZE;
         desc->flags = DESC_FLAG_OWN | DESC_FLAG_INT;  // Give to hardware
         desc->next = &dev->rx_ring[(i + 1) % RX_RING_SIZE];
     }
 
-    // Program DMA registers
-    wifi_write32(dev, WIFI_REG_TX_BASE, (uint32_t)(uint64_t)dev->tx_ring);
-    wifi_write32(dev, WIFI_REG_TX_SIZE, TX_RING_SIZE);
-    wifi_write32(dev, WIFI_REG_RX_BASE, (uint32_t)(uint64_t)dev->rx_ring);
-    wifi_write32(dev, WIFI_REG_RX_SIZE, RX_RING_SIZE);
-
-    // Reset ring pointers
-    dev->tx_head = dev->tx_tail = 0;
-    dev->rx_head = dev->rx_tail = 0;
-
+    program_dma_rings(dev);
     return true;
 }
 
@@ -300,87 +331,171 @@ static bool read_mac_address(struct wifi_device* dev) {
     return true;
 }
 
-// Handle hardware interrupt
-void wifi_handle_interrupt(struct wifi_device* dev) {
-    uint32_t status = wifi_read32(dev, WIFI_REG_INT_STATUS);
+// Return sent descriptors to the driver, oldest first. TX lock held.
+static void wifi_tx_reclaim(struct wifi_device* dev) {
+    while (dev->tx_head != dev->tx_tail) {
+        struct wifi_dma_desc* desc = &dev->tx_ring[dev->tx_head];
+        if (desc->flags & DESC_FLAG_OWN) {
+            break;  // Hardware still owns this descriptor
+        }
 
-    // Handle TX completions
-    if (status & WIFI_INT_TX_DONE) {
-        while (dev->tx_head != dev->tx_tail) {
-            struct wifi_dma_desc* desc = &dev->tx_ring[dev->tx_head];
-            if (desc->flags & DESC_FLAG_OWN) {
-                break;  // Hardware still owns this descriptor
-            }
+        // Process TX completion
+        if (desc->status & DESC_STATUS_OK) {
+            dev->tx_packets++;
+        } else {
+            dev->tx_errors++;
+        }
 
-            // Process TX completion
-            if (desc->status & 0x1) { // Success bit
-                dev->tx_packets++;
-            } else {
-                dev->tx_errors++;
-            }
+        // Clear descriptor for reuse
+        desc->status = 0;
+        desc->flags = DESC_FLAG_INT;
 
-            // Clear descriptor for reuse
-            desc->status = 0;
-            desc->flags = DESC_FLAG_INT;
+        dev->tx_head = (dev->tx_head + 1) % TX_RING_SIZE;
+    }
+}
+
+// Rewrite a received 802.11 data frame as the Ethernet frame the stack
+// expects, in place: DA and SA over the tail of the 802.11 header, just
+// ahead of the ethertype that ends the LLC/SNAP header
+static bool wifi_rx_to_ethernet(struct wifi_device* dev, struct pkbuf* pb) {
+    if (pb->len < sizeof(struct wifi_80211_header)) return false;
+
+    struct wifi_80211_header* hdr = (struct wifi_80211_header*)pb->data;
+    uint16_t fc = hdr->frame_control;
+    if ((fc & WIFI_FC_TYPE_MASK) != WIFI_FC_TYPE_DATA) return false;
+
+    // Check if packet is for us
+    if (memcmp(hdr->addr1, dev->mac_addr, 6) != 0 && memcmp(hdr->addr1, broadcast_addr, 6) != 0) {
+        return false;
+    }
+
+    uint32_t hdr_len = sizeof(struct wifi_80211_header) + ((fc & WIFI_FC_SUBTYPE_QOS) ? WIFI_QOS_CTRL_SIZE : 0);
+    if (pb->len < hdr_len + WIFI_LLC_SNAP_SIZE || memcmp(pb->data + hdr_len, llc_snap, sizeof(llc_snap)) != 0) {
+        return false;
+    }
+
+    uint8_t dst[6], src[6];
+    memcpy(dst, hdr->addr1, 6);
+    memcpy(src, (fc & WIFI_FC_FROM_DS) ? hdr->addr3 : hdr->addr2, 6);
+
+    uint8_t* eth = pkbuf_pull(pb, hdr_len + WIFI_LLC_SNAP_SIZE - NETDEV_ETH_HLEN);
+    memcpy(eth, dst, 6);
+    memcpy(eth + 6, src, 6);
+    return true;
+}
 
-            dev->tx_head = (dev->tx_head + 1) % TX_RING_SIZE;
+// Step the coalescing level by how much one RX pass found: a full budget
+// means the interrupt rate is the bottleneck, a trickle means latency is
+static void wifi_adapt_coalescing(struct wifi_device* dev, uint32_t frames) {
+    uint8_t level = dev->coal_level;
+    if (frames >= WIFI_RX_BUDGET / 2 && level < WIFI_COAL_LEVELS - 1) level++;
+    else if (frames < coal_levels[level].frames / 4 && level > 0) level--;
+    if (level == dev->coal_level) return;
+
+    dev->coal_level = level;
+    wifi_write32(dev, WIFI_REG_INT_COAL,
+        (coal_levels[level].frames << 0) |  // RX max coalesce
+        (coal_levels[level].frames << 8) |  // TX max coalesce
+        (coal_levels[level].usecs << 16)    // Timeout in μs
+    );
+}
+
+// Take up to a budget of frames off the RX ring, then refill every slot
+// that gave its buffer up in one pass from the pool and hand the ring back
+// with one doorbell; true if frames may remain
+static bool wifi_rx_poll(struct wifi_device* dev) {
+    struct pkbuf* frames[WIFI_RX_BUDGET];
+    struct pkbuf* fresh[WIFI_RX_BUDGET];
+    uint32_t slots[WIFI_RX_BUDGET];
+    uint32_t done = 0, count = 0;
+
+    uint64_t flags = spinlock_acquire_irqsave(&dev->rx_lock);
+    uint32_t start = dev->rx_head;
+    while (done < WIFI_RX_BUDGET) {
+        uint32_t index = (start + done) % RX_RING_SIZE;
+        struct wifi_dma_desc* desc = &dev->rx_ring[index];
+        if (desc->flags & DESC_FLAG_OWN) {
+            break;  // No more packets
+        }
+
+        uint32_t length = desc->buffer_len;
+        if ((desc->status & DESC_STATUS_OK) && length && length <= RX_BUFFER_SIZE) {
+            frames[count] = dev->rx_pkbufs[index];
+            frames[count]->len = length;
+            slots[count++] = index;
+        } else {
+            dev->rx_errors++;
         }
+        done++;
     }
 
-    // Handle RX packets
-    if (status & WIFI_INT_RX_DONE) {
-        while (1) {
-            struct wifi_dma_desc* desc = &dev->rx_ring[dev->rx_head];
-            if (desc->flags & DESC_FLAG_OWN) {
-                break;  // No more packets
-            }
+    // Fresh buffers for the taken slots; short of those, the newest frames
+    // are dropped and their buffers stay where they are
+    uint32_t got = count ? pkbuf_alloc_bulk(fresh, count) : 0;
+    dev->rx_dropped += count - got;
+    count = got;
+    for (uint32_t i = 0; i < count; i++) {
+        dev->rx_pkbufs[slots[i]] = fresh[i];
+        dev->rx_ring[slots[i]].buffer_addr = pkbuf_phys(fresh[i]);
+    }
 
-            // Process received packet
-            if (desc->status & 0x1) { // Success bit
-                // Create network packet
-                uint8_t* packet_data = dev->rx_buffers[dev->rx_head];
-                uint16_t packet_len = desc->buffer_len;
-
-                // Process 802.11 header
-                struct wifi_80211_header* hdr = (struct wifi_80211_header*)packet_data;
-
-                // Check if packet is for us
-                if (memcmp(hdr->addr1, dev->mac_addr, 6) == 0 ||
-                    memcmp(hdr->addr1, broadcast_addr, 6) == 0) {
-
-                    // Extract payload
-                    uint8_t* payload = packet_data + sizeof(struct wifi_80211_header);
-                    uint16_t payload_len = packet_len - sizeof(struct wifi_80211_header);
-
-                    if (payload_len > 0) {
-                        // Pass to network stack
-                        struct net_packet pkt;
-                        pkt.data = malloc(payload_len);
-                        if (pkt.data) {
-                            memcpy(pkt.data, payload, payload_len);
-                            pkt.length = payload_len;
-                            pkt.source.ip = 0;  // Filled by upper layer
-                            pkt.destination.ip = 0;  // Filled by upper layer
-
-                            // Add packet to RX queue
-                            if (netdev_receive(dev->netdev, &pkt)) {
-                                dev->rx_packets++;
-                            } else {
-                                free(pkt.data);
-                                dev->rx_dropped++;
-                            }
-                        }
-                    }
-                }
-            } else {
-                dev->rx_errors++;
-            }
+    for (uint32_t i = 0; i < done; i++) {
+        struct wifi_dma_desc* desc = &dev->rx_ring[(start + i) % RX_RING_SIZE];
+        desc->buffer_len = RX_BUFFER_SIZE;
+        desc->status = 0;
+        __atomic_store_n(&desc->flags, DESC_FLAG_OWN | DESC_FLAG_INT, __ATOMIC_RELEASE);
+    }
+    dev->rx_head = (start + done) % RX_RING_SIZE;
+
+    // One head write for the whole batch
+    if (done) {
+        wifi_write32(dev, WIFI_REG_RX_HEAD, dev->rx_head);
+        dev->rx_batches++;
+    }
+    spinlock_release_irqrestore(&dev->rx_lock, flags);
+
+    // Up the stack outside the lock
+    for (uint32_t i = 0; i < count; i++) {
+        if (dev->netdev && wifi_rx_to_ethernet(dev, frames[i])) {
+            dev->rx_packets++;
+            netdev_receive_pkbuf(dev->netdev, frames[i]);
+        } else {
+            dev->rx_dropped++;
+            pkbuf_put(frames[i]);
+        }
+    }
+    if (count && dev->netdev) net_process_packets();
 
-            // Reset descriptor and give back to hardware
-            desc->status = 0;
-            desc->flags = DESC_FLAG_OWN | DESC_FLAG_INT;
+    wifi_adapt_coalescing(dev, done);
+    return done == WIFI_RX_BUDGET;
+}
 
-            dev->rx_head = (dev->rx_head + 1) % RX_RING_SIZE;
+// Bottom half: everything the device asked for since the last run. RX
+// stays masked until the ring has been drained.
+static void wifi_interrupt_work(struct work* work) {
+    struct wifi_device* dev = container_of(work, struct wifi_device, irq_work);
+    uint32_t status = __atomic_exchange_n(&dev->pending_status, 0, __ATOMIC_ACQ_REL);
+
+    // Handle TX completions; one interrupt covers a whole batch
+    if (status & WIFI_INT_TX_DONE) {
+        uint64_t flags = spinlock_acquire_irqsave(&dev->tx_lock);
+        wifi_tx_reclaim(dev);
+        spinlock_release_irqrestore(&dev->tx_lock, flags);
+    }
+
+    // Handle RX packets
+    if (status & WIFI_INT_RX_DONE) {
+        bool more = wifi_rx_poll(dev);
+        if (!more) {
+            // A frame landing after the last look would raise no interrupt
+            // while masked, so look once more after unmasking
+            wifi_write32(dev, WIFI_REG_INT_ENABLE, dev->int_mask);
+            more = !(dev->rx_ring[dev->rx_head].flags & DESC_FLAG_OWN);
+            if (more) wifi_write32(dev, WIFI_REG_INT_ENABLE, dev->int_mask & ~WIFI_INT_RX_DONE);
+        }
+        if (more) {
+            __atomic_or_fetch(&dev->pending_status, WIFI_INT_RX_DONE, __ATOMIC_ACQ_REL);
+            work_schedule(&dev->irq_work);
         }
     }
 
@@ -391,63 +506,53 @@ void wifi_handle_interrupt(struct wifi_device* dev) {
 
     // Handle errors
     if (status & (WIFI_INT_TX_ERR | WIFI_INT_RX_ERR)) {
-        // Reset DMA rings
+        // Reset DMA rings, keeping the buffers
+        uint64_t tx_flags = spinlock_acquire_irqsave(&dev->tx_lock);
+        uint64_t rx_flags = spinlock_acquire_irqsave(&dev->rx_lock);
         reset_device(dev);
-        setup_dma_rings(dev);
+        program_dma_rings(dev);
+        spinlock_release_irqrestore(&dev->rx_lock, rx_flags);
+        spinlock_release_irqrestore(&dev->tx_lock, tx_flags);
     }
+}
+
+// Handle hardware interrupt: acknowledge and defer the work, masking RX
+// until the bottom half has drained the ring
+void wifi_handle_interrupt(struct wifi_device* dev) {
+    uint32_t status = wifi_read32(dev, WIFI_REG_INT_STATUS);
+    if (!status) return;
 
-    // Clear handled interrupts
     wifi_write32(dev, WIFI_REG_INT_STATUS, status);
+    if (status & WIFI_INT_RX_DONE) {
+        wifi_write32(dev, WIFI_REG_INT_ENABLE, dev->int_mask & ~WIFI_INT_RX_DONE);
+    }
+    __atomic_or_fetch(&dev->pending_status, status, __ATOMIC_ACQ_REL);
+    work_schedule(&dev->irq_work);
 }
 
-// Initialize the WiFi subsystem
-bool wifi_init(void) {
-    // Initialize hardware detection
-    struct pci_device* pci_dev = NULL;
-
-    // Scan for supported WiFi cards
-    while ((pci_dev = pci_scan_for_class(PCI_CLASS_NETWORK, 0x80)) != NULL) {
-        // Check vendor/device IDs for supported cards
-        switch (pci_dev->vendor_id) {
-            case 0x8086:  // Intel
-                switch (pci_dev->device_id) {
-                    case 0x0082:  // Intel WiFi 6 AX200
-                    case 0x2723:  // Intel WiFi 6E AX211
-                    case 0x0085:  // Intel WiFi 6E AX210
-                        if (wifi_probe(pci_dev)) {
-                            return true;
-                        }
-                        break;
-                }
-                break;
-
-            case 0x168C:  // Atheros/Qualcomm
-                switch (pci_dev->device_id) {
-                    case 0x003E:  // QCA6174
-                    case 0x0042:  // QCA9377
-                    case 0x0046:  // QCA6164
-                        if (wifi_probe(pci_dev)) {
-                            return true;
-                        }
-                        break;
-                }
-                break;
+static const struct pci_device_id wifi_ids[] = {
+    PCI_DEVICE(0x8086, 0x0082),     // Intel WiFi 6 AX200
+    PCI_DEVICE(0x8086, 0x2723),     // Intel WiFi 6E AX211
+    PCI_DEVICE(0x8086, 0x0085),     // Intel WiFi 6E AX210
+    PCI_DEVICE(0x168C, 0x003E),     // QCA6174
+    PCI_DEVICE(0x168C, 0x0042),     // QCA9377
+    PCI_DEVICE(0x168C, 0x0046),     // QCA6164
+    PCI_DEVICE(0x14E4, 0x43B1),     // BCM4352
+    PCI_DEVICE(0x14E4, 0x43DC),     // BCM4355
+    PCI_DEVICE(0x14E4, 0x4365),     // BCM43142
+    { 0 }
+};
+
+static bool wifi_pci_probe(struct pci_device* pci_dev, const struct pci_device_id* id) {
+    (void)id;
+    return wifi_probe(pci_dev) != NULL;
+}
 
-            case 0x14E4:  // Broadcom
-                switch (pci_dev->device_id) {
-                    case 0x43B1:  // BCM4352
-                    case 0x43DC:  // BCM4355
-                    case 0x4365:  // BCM43142
-                        if (wifi_probe(pci_dev)) {
-                            return true;
-                        }
-                        break;
-                }
-                break;
-        }
-    }
+static struct pci_driver wifi_driver = { "wifi", wifi_ids, wifi_pci_probe };
 
-    return false;
+// Initialize the WiFi subsystem
+bool wifi_init(void) {
+    return pci_register_driver(&wifi_driver) > 0;
 }
 
 // Probe and initialize a WiFi device
@@ -458,6 +563,9 @@ struct wifi_device* wifi_probe(struct pci_device* pci_dev) {
     struct wifi_device* dev = malloc(sizeof(struct wifi_device));
     if (!dev) return NULL;
     memset(dev, 0, sizeof(struct wifi_device));
+    work_init(&dev->irq_work, wifi_interrupt_work);
+    spinlock_init(&dev->tx_lock);
+    spinlock_init(&dev->rx_lock);
 
     // Store PCI device info
     dev->pci_dev = pci_dev;
@@ -520,11 +628,12 @@ struct wifi_device* wifi_probe(struct pci_device* pci_dev) {
         (3 << 2)       // Power save level
     );
 
-    // 8. Configure interrupt coalescing
+    // 8. Configure interrupt coalescing; adjusted with load from here on
+    dev->coal_level = WIFI_COAL_DEFAULT;
     wifi_write32(dev, WIFI_REG_INT_COAL,
-        (16 << 0) |    // RX max coalesce
-        (16 << 8) |    // TX max coalesce
-        (50 << 16)     // Timeout in μs
+        (coal_levels[WIFI_COAL_DEFAULT].frames << 0) |  // RX max coalesce
+        (coal_levels[WIFI_COAL_DEFAULT].frames << 8) |  // TX max coalesce
+        (coal_levels[WIFI_COAL_DEFAULT].usecs << 16)    // Timeout in μs
     );
 
     // 9. Set regulatory domain
@@ -552,7 +661,7 @@ struct wifi_device* wifi_probe(struct pci_device* pci_dev) {
             if (dev->tx_buffers[i]) pmm_free_page(dev->tx_buffers[i]);
         }
         for (int i = 0; i < RX_RING_SIZE; i++) {
-            if (dev->rx_buffers[i]) pmm_free_page(dev->rx_buffers[i]);
+            if (dev->rx_pkbufs[i]) pkbuf_put(dev->rx_pkbufs[i]);
         }
         if (dev->tx_ring) pmm_free_page(dev->tx_ring);
         if (dev->rx_ring) pmm_free_page(dev->rx_ring);
@@ -573,10 +682,10 @@ bool wifi_start(struct wifi_device* dev) {
     if (!dev) return false;
 
     // Enable interrupts
-    wifi_write32(dev, WIFI_REG_INT_ENABLE,
-        WIFI_INT_TX_DONE | WIFI_INT_RX_DONE | WIFI_INT_FW_READY |
-        WIFI_INT_TX_ERR | WIFI_INT_RX_ERR | WIFI_INT_TEMP_WARNING |
-        WIFI_INT_RF_KILL | WIFI_INT_BEACON);
+    dev->int_mask = WIFI_INT_TX_DONE | WIFI_INT_RX_DONE | WIFI_INT_FW_READY |
+                    WIFI_INT_TX_ERR | WIFI_INT_RX_ERR | WIFI_INT_TEMP_WARNING |
+                    WIFI_INT_RF_KILL | WIFI_INT_BEACON;
+    wifi_write32(dev, WIFI_REG_INT_ENABLE, dev->int_mask);
 
     // Enable DMA
     wifi_write32(dev, WIFI_REG_CSR, wifi_read32(dev, WIFI_REG_CSR) | 0x3); // TX/RX enable
@@ -592,6 +701,7 @@ void wifi_stop(struct wifi_device* dev) {
     if (!dev) return;
 
     // Disable interrupts
+    dev->int_mask = 0;
     wifi_write32(dev, WIFI_REG_INT_ENABLE, 0);
 
     // Disable DMA
@@ -601,59 +711,142 @@ void wifi_stop(struct wifi_device* dev) {
     wifi_write32(dev, WIFI_REG_POWER_CTRL, 0x1); // Power save mode
 }
 
-// Transmit a packet
-bool wifi_transmit_packet(struct wifi_device* dev, const void* data, size_t length) {
-    if (!dev || !data || length > TX_BUFFER_SIZE) return false;
+// TID of a QoS data frame that may go out in an A-MPDU, -1 otherwise
+static int wifi_ampdu_tid(struct wifi_device* dev, const uint8_t* frame, size_t length) {
+    if (length < sizeof(struct wifi_80211_header) + WIFI_QOS_CTRL_SIZE) return -1;
 
-    // Check if TX ring is full
-    if (((dev->tx_tail + 1) % TX_RING_SIZE) == dev->tx_head) {
-        return false;
+    const struct wifi_80211_header* hdr = (const struct wifi_80211_header*)frame;
+    uint16_t fc = hdr->frame_control;
+    if ((fc & WIFI_FC_TYPE_MASK) != WIFI_FC_TYPE_DATA || !(fc & WIFI_FC_SUBTYPE_QOS)) return -1;
+    if (hdr->addr1[0] & 1) return -1;  // Group addressed frames are never acknowledged
+
+    uint16_t qos;
+    memcpy(&qos, frame + sizeof(struct wifi_80211_header), sizeof(qos));
+    int tid = qos & WIFI_QOS_TID_MASK;
+    return tid < WIFI_MAX_TID && (dev->ampdu_tids & (1 << tid)) ? tid : -1;
+}
+
+// Close the aggregate of frames subframes starting at ring slot start: a
+// lone subframe goes out as a plain MPDU. The device reads no further than
+// the tail, so the descriptors can still change. TX lock held.
+static void wifi_ampdu_close(struct wifi_device* dev, uint32_t start, uint32_t frames) {
+    if (!frames) return;
+
+    if (frames == 1) {
+        dev->tx_ring[start].flags &= ~DESC_FLAG_AMPDU;
+    } else {
+        dev->tx_ring[(start + frames - 1) % TX_RING_SIZE].flags |= DESC_FLAG_AMPDU_END;
+        dev->tx_ampdus++;
     }
+}
 
-    // Get next TX descriptor
-    struct wifi_dma_desc* desc = &dev->tx_ring[dev->tx_tail];
+uint32_t wifi_transmit_batch(struct wifi_device* dev, const void* const* frames, const size_t* lengths,
+                             uint32_t count) {
+    if (!dev || !frames || !lengths || !count) return 0;
 
-    // Copy packet data to DMA buffer
-    memcpy(dev->tx_buffers[dev->tx_tail], data, length);
+    uint64_t flags = spinlock_acquire_irqsave(&dev->tx_lock);
 
-    // Setup descriptor
-    desc->buffer_len = length;
-    desc->status = 0;
-    desc->flags = DESC_FLAG_OWN | DESC_FLAG_INT | DESC_FLAG_FIRST |
-                 DESC_FLAG_LAST | DESC_FLAG_EOP;
+    // One slot always stays empty so a full ring differs from an empty one
+    uint32_t space = (dev->tx_head + TX_RING_SIZE - dev->tx_tail - 1) % TX_RING_SIZE;
+    if (space < count) {
+        wifi_tx_reclaim(dev);
+        space = (dev->tx_head + TX_RING_SIZE - dev->tx_tail - 1) % TX_RING_SIZE;
+    }
 
-    // Advance tail pointer
-    dev->tx_tail = (dev->tx_tail + 1) % TX_RING_SIZE;
+    uint32_t tail = dev->tx_tail;
+    uint32_t queued = 0;
+    int run_tid = -1;
+    uint32_t run_first = 0, run_start = 0, run_frames = 0, run_bytes = 0;
+    for (; queued < count && queued < space; queued++) {
+        const uint8_t* frame = frames[queued];
+        size_t length = lengths[queued];
+        if (!frame || !length || length > TX_BUFFER_SIZE) break;
+
+        // Consecutive frames to the same receiver and TID share an aggregate
+        int tid = wifi_ampdu_tid(dev, frame, length);
+        bool extends = tid >= 0 && tid == run_tid && run_frames < WIFI_AMPDU_MAX_FRAMES &&
+                       run_bytes + length <= WIFI_AMPDU_MAX_BYTES &&
+                       memcmp(frame + offsetof(struct wifi_80211_header, addr1),
+                              (const uint8_t*)frames[run_first] + offsetof(struct wifi_80211_header, addr1), 6) == 0;
+        if (!extends) {
+            wifi_ampdu_close(dev, run_start, run_frames);
+            run_tid = tid;
+            run_first = queued;
+            run_start = tail;
+            run_frames = run_bytes = 0;
+        }
 
-    // Notify hardware of new packet
-    wifi_write32(dev, WIFI_REG_TX_TAIL, dev->tx_tail);
+        // Copy packet data to DMA buffer
+        memcpy(dev->tx_buffers[tail], frame, length);
+
+        struct wifi_dma_desc* desc = &dev->tx_ring[tail];
+        desc->buffer_len = length;
+        desc->status = 0;
+        desc->flags = DESC_FLAG_OWN | DESC_FLAG_FIRST | DESC_FLAG_LAST | DESC_FLAG_EOP |
+                      (tid >= 0 ? DESC_FLAG_AMPDU : 0);
+        if (tid >= 0) {
+            run_frames++;
+            run_bytes += length;
+        }
+        tail = (tail + 1) % TX_RING_SIZE;
+    }
+    wifi_ampdu_close(dev, run_start, run_frames);
+
+    if (queued) {
+        // One completion interrupt and one doorbell for the whole batch
+        dev->tx_ring[(tail + TX_RING_SIZE - 1) % TX_RING_SIZE].flags |= DESC_FLAG_INT;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        dev->tx_tail = tail;
+        wifi_write32(dev, WIFI_REG_TX_TAIL, dev->tx_tail);
+        dev->tx_doorbells++;
+    }
+    spinlock_release_irqrestore(&dev->tx_lock, flags);
+    return queued;
+}
 
-    return true;
+// Transmit a packet
+bool wifi_transmit_packet(struct wifi_device* dev, const void* data, size_t length) {
+    if (!dev || !data || length > TX_BUFFER_SIZE) return false;
+    return wifi_transmit_batch(dev, &data, &length, 1) == 1;
+}
+
+void wifi_set_aggregation(struct wifi_device* dev, uint8_t tid, bool enable) {
+    if (!dev || tid >= WIFI_MAX_TID) return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&dev->tx_lock);
+    if (enable) dev->ampdu_tids |= (1 << tid);
+    else dev->ampdu_tids &= ~(1 << tid);
+    spinlock_release_irqrestore(&dev->tx_lock, flags);
 }
 
 // Receive a packet
 bool wifi_receive_packet(struct wifi_device* dev, void* buffer, size_t* length) {
     if (!dev || !buffer || !length) return false;
 
+    uint64_t flags = spinlock_acquire_irqsave(&dev->rx_lock);
+
     // Check if packet available
     struct wifi_dma_desc* desc = &dev->rx_ring[dev->rx_head];
     if (desc->flags & DESC_FLAG_OWN) {
+        spinlock_release_irqrestore(&dev->rx_lock, flags);
         return false;
     }
 
     // Get packet length and validate
     size_t packet_len = desc->buffer_len;
-    if (packet_len > *length) {
+    if (packet_len > *length || packet_len > RX_BUFFER_SIZE) {
+        spinlock_release_irqrestore(&dev->rx_lock, flags);
         return false;
     }
 
     // Copy packet data
-    memcpy(buffer, dev->rx_buffers[dev->rx_head], packet_len);
+    memcpy(buffer, dev->rx_pkbufs[dev->rx_head]->data, packet_len);
     *length = packet_len;
 
     // Reset descriptor and return to hardware
+    desc->buffer_len = RX_BUFFER_SIZE;
     desc->status = 0;
-    desc->flags = DESC_FLAG_OWN | DESC_FLAG_INT;
+    __atomic_store_n(&desc->flags, DESC_FLAG_OWN | DESC_FLAG_INT, __ATOMIC_RELEASE);
 
     // Advance head pointer
     dev->rx_head = (dev->rx_head + 1) % RX_RING_SIZE;
@@ -661,5 +854,6 @@ bool wifi_receive_packet(struct wifi_device* dev, void* buffer, size_t* length)
     // Update hardware head pointer
     wifi_write32(dev, WIFI_REG_RX_HEAD, dev->rx_head);
 
+    spinlock_release_irqrestore(&dev->rx_lock, flags);
     return true;
-}
\ No newline at end of file
+}
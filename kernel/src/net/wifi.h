@@ -5,6 +5,9 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <core/drivers/pci.h>
+#include <core/workqueue.h>
+#include <core/smp.h>
+#include <net/pkbuf.h>
 
 // Hardware Registers
 #define WIFI_REG_CSR             0x0000  // Control and Status
@@ -65,6 +68,11 @@
 #define DESC_FLAG_FIRST          (1 << 29)  // First segment
 #define DESC_FLAG_LAST           (1 << 28)  // Last segment
 #define DESC_FLAG_EOP            (1 << 27)  // End of packet
+#define DESC_FLAG_AMPDU          (1 << 26)  // Subframe of an A-MPDU
+#define DESC_FLAG_AMPDU_END      (1 << 25)  // Last subframe of it
+
+// Descriptor status bits
+#define DESC_STATUS_OK           (1 << 0)
 
 // Ring sizes and buffer sizes
 #define TX_RING_SIZE             256
@@ -72,6 +80,18 @@
 #define TX_BUFFER_SIZE           2048
 #define RX_BUFFER_SIZE           2048
 
+// Frames per bottom-half pass
+#define WIFI_RX_BUDGET           64
+
+// A-MPDU limits (802.11n, 64 KB aggregate)
+#define WIFI_AMPDU_MAX_FRAMES    32
+#define WIFI_AMPDU_MAX_BYTES     65535
+#define WIFI_MAX_TID             8
+
+// Interrupt coalescing levels, stepped by how full each RX pass is
+#define WIFI_COAL_LEVELS         4
+#define WIFI_COAL_DEFAULT        1
+
 // Firmware constants
 #define FW_CHUNK_SIZE            4096
 #define FW_MAX_UCODE_SIZE        (128*1024)
@@ -87,6 +107,16 @@ struct wifi_dma_desc {
     struct wifi_dma_desc* next;  // Next descriptor
 } __attribute__((packed));
 
+// 802.11 frame control
+#define WIFI_FC_TYPE_MASK        0x000C
+#define WIFI_FC_TYPE_DATA        0x0008
+#define WIFI_FC_SUBTYPE_QOS      0x0080
+#define WIFI_FC_TO_DS            0x0100
+#define WIFI_FC_FROM_DS          0x0200
+#define WIFI_QOS_CTRL_SIZE       2
+#define WIFI_QOS_TID_MASK        0x000F
+#define WIFI_LLC_SNAP_SIZE       8
+
 // 802.11 frame header
 struct wifi_80211_header {
     uint16_t frame_control;
@@ -124,11 +154,13 @@ struct wifi_device {
     struct wifi_dma_desc* tx_ring;
     struct wifi_dma_desc* rx_ring;
     void* tx_buffers[TX_RING_SIZE];
-    void* rx_buffers[RX_RING_SIZE];
+    struct pkbuf* rx_pkbufs[RX_RING_SIZE];     // The device DMAs into these
     uint32_t tx_head;
     uint32_t tx_tail;
     uint32_t rx_head;
     uint32_t rx_tail;
+    spinlock_t tx_lock;
+    spinlock_t rx_lock;
 
     // Device state
     uint8_t mac_addr[6];
@@ -136,12 +168,24 @@ struct wifi_device {
     bool fw_loaded;
     struct netdev* netdev;
 
+    // Causes acknowledged by the interrupt, handled by irq_work
+    struct work irq_work;
+    volatile uint32_t pending_status;
+    uint32_t int_mask;          // Enabled causes; RX_DONE is off while polling
+    uint8_t coal_level;
+
+    // TIDs with a Block Ack agreement, whose frames may be aggregated
+    uint8_t ampdu_tids;
+
     // Statistics
     uint32_t tx_packets;
     uint32_t rx_packets;
     uint32_t tx_errors;
     uint32_t rx_errors;
     uint32_t rx_dropped;
+    uint32_t tx_doorbells;
+    uint32_t tx_ampdus;
+    uint32_t rx_batches;
 };
 
 // Core function declarations
@@ -153,6 +197,12 @@ void wifi_stop(struct wifi_device* dev);
 // Packet handling functions
 void wifi_handle_interrupt(struct wifi_device* dev);
 bool wifi_transmit_packet(struct wifi_device* dev, const void* data, size_t length);
+// Queue up to count 802.11 frames behind one doorbell, aggregating runs of
+// QoS data to the same receiver and TID; how many were queued
+uint32_t wifi_transmit_batch(struct wifi_device* dev, const void* const* frames, const size_t* lengths,
+                             uint32_t count);
+// Allow or stop A-MPDU for a TID, once its Block Ack agreement is up or torn down
+void wifi_set_aggregation(struct wifi_device* dev, uint8_t tid, bool enable);
 bool wifi_receive_packet(struct wifi_device* dev, void* buffer, size_t* length);
 
 // Firmware and configuration functions
@@ -167,7 +217,4 @@ static bool init_baseband(struct wifi_device* dev);
 static bool configure_antenna(struct wifi_device* dev, const uint16_t* cal_data);
 static bool read_mac_address(struct wifi_device* dev);
 
-// Network integration
-bool netdev_receive(struct netdev* dev, struct net_packet* packet);
-
 #endif // WIFI_H
\ No newline at end of file
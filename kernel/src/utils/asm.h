@@ -1,6 +1,8 @@
 #ifndef ASM_H
 #define ASM_H
 
+#include <stdint.h>
+
 static inline void cli(void) {
     asm volatile ("cli" ::: "memory");
 }
@@ -13,4 +15,32 @@ static inline void hlt(void) {
     asm volatile ("hlt" ::: "memory");
 }
 
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile ("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+// Disable interrupts and return the previous RFLAGS
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    asm volatile ("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+// Re-enable interrupts if they were enabled before irq_save()
+static inline void irq_restore(uint64_t flags) {
+    if (flags & (1 << 9)) sti();
+}
+
 #endif
\ No newline at end of file
@@ -1,7 +1,54 @@
 #include <utils/log.h>
 #include <core/drivers/serial/serial.h>
+#include <core/smp.h>
+#include <core/time.h>
 #include <stdarg.h>
 #include <utils/str.h>
+#include <utils/mem.h>
+
+// Messages go into per-CPU rings and reach the UART from its THRE
+// interrupt, a FIFO's worth at a time, so logging costs a copy rather
+// than a millisecond of polling per line. Until log_enable_async(), and
+// after log_panic(), they are written out on the spot as before.
+#define LOG_RINGS           8       // CPUs share a ring past this
+#define LOG_RING_SIZE       256     // Cells, a power of two
+#define LOG_RING_MASK       (LOG_RING_SIZE - 1)
+#define LOG_CELL_TEXT       108
+#define LOG_MESSAGE_MAX     1024
+#define LOG_LINE_MAX        (LOG_MESSAGE_MAX + 32)
+#define LOG_PANIC_SPINS     1000000 // Before a panic stops waiting for the drain
+
+// A message takes consecutive cells, its header on the first. A cell at
+// position pos is free while its sequence is pos and full while it is
+// pos + 1; sequences are stored less the cell index, so the zeroed rings
+// start out free.
+struct log_cell {
+    uint64_t sequence;
+    uint64_t timestamp_ns;
+    uint8_t level;
+    uint8_t parts;              // Cells in the message, on its first
+    uint16_t length;            // Text in this cell
+    char text[LOG_CELL_TEXT];
+};
+
+struct log_ring {
+    struct log_cell cells[LOG_RING_SIZE];
+    uint64_t enqueue_pos;
+    uint64_t dequeue_pos;       // The drain's alone
+    uint64_t dropped;
+    uint64_t dropped_reported;
+} __attribute__((aligned(64)));
+
+static struct log_ring rings[LOG_RINGS];
+
+// The drain: one at a time, from the THRE interrupt or a synchronous flush
+static spinlock_t drain_lock = SPINLOCK_INIT;
+static char line[LOG_LINE_MAX];
+static uint32_t line_pos;
+static uint32_t line_length;
+
+static volatile bool async_enabled = false;
+static volatile bool panicking = false;
 
 static const char* level_strings[] = {
     [LOG_LEVEL_DEBUG] = "[DEBUG] ",
@@ -15,50 +62,266 @@ void log_init(void) {
     serial_init(COM1);
 }
 
-static void write_serial(const char* str) {
-    while (*str) {
-        serial_write_char(COM1, *str++);
+static inline uint64_t cell_sequence(struct log_ring* ring, uint64_t pos) {
+    return __atomic_load_n(&ring->cells[pos & LOG_RING_MASK].sequence, __ATOMIC_ACQUIRE) + (pos & LOG_RING_MASK);
+}
+
+static inline void cell_publish(struct log_ring* ring, uint64_t pos, uint64_t sequence) {
+    __atomic_store_n(&ring->cells[pos & LOG_RING_MASK].sequence, sequence - (pos & LOG_RING_MASK), __ATOMIC_RELEASE);
+}
+
+// Claim parts cells at once and fill them; false if the ring is full. The
+// drain frees cells in order, so the last being free means all are.
+static bool log_enqueue(struct log_ring* ring, uint64_t timestamp, log_level_t level,
+                        const char* text, size_t length, uint32_t parts) {
+    uint64_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        int64_t diff = (int64_t)(cell_sequence(ring, pos + parts - 1) - (pos + parts - 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + parts, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+        }
     }
+
+    for (uint32_t i = 0; i < parts; i++) {
+        struct log_cell* cell = &ring->cells[(pos + i) & LOG_RING_MASK];
+        size_t chunk = length < LOG_CELL_TEXT ? length : LOG_CELL_TEXT;
+        cell->timestamp_ns = timestamp;
+        cell->level = (uint8_t)level;
+        cell->parts = i ? 0 : (uint8_t)parts;
+        cell->length = (uint16_t)chunk;
+        memcpy(cell->text, text, chunk);
+        text += chunk;
+        length -= chunk;
+        // In order, so the last part published means the whole message is
+        cell_publish(ring, pos + i, pos + i + 1);
+    }
+    return true;
 }
 
-void log_char(log_level_t level, char c) {
-    write_serial(level_strings[level]);
-    serial_write_char(COM1, c);
-    serial_write_char(COM1, '\r');
-    serial_write_char(COM1, '\n');
+static char* append(char* p, const char* str) {
+    while (*str) *p++ = *str++;
+    return p;
 }
 
-void log_string(log_level_t level, const char* str) {
-    write_serial(level_strings[level]);
-    write_serial(str);
-    if (str[strlen(str) - 1] != '\n') {
-        serial_write_char(COM1, '\r');
-        serial_write_char(COM1, '\n');
-    } else {
-        serial_write_char(COM1, '\r');
+static char* append_decimal(char* p, uint64_t value, int width, char pad) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (width-- > n) *p++ = pad;
+    while (n) *p++ = digits[--n];
+    return p;
+}
+
+// "[seconds.micros] [LEVEL] " at p; the text follows at the result
+static char* format_prefix(char* p, uint64_t timestamp, uint8_t level) {
+    if (level == LOG_LEVEL_RAW) return p;
+    *p++ = '[';
+    p = append_decimal(p, timestamp / 1000000000ULL, 5, ' ');
+    *p++ = '.';
+    p = append_decimal(p, (timestamp / 1000) % 1000000, 6, '0');
+    p = append(p, "] ");
+    return append(p, level_strings[level <= LOG_LEVEL_FATAL ? level : LOG_LEVEL_FATAL]);
+}
+
+static void format_end(char* p) {
+    p = append(p, "\r\n");
+    line_pos = 0;
+    line_length = (uint32_t)(p - line);
+}
+
+static void format_line(uint64_t timestamp, uint8_t level, const char* text, size_t length) {
+    char* p = format_prefix(line, timestamp, level);
+    memcpy(p, text, length);
+    format_end(p + length);
+}
+
+// Stage the oldest complete message of any ring as the next line; false
+// if there is none. Drain lock held.
+static bool log_next_line(void) {
+    struct log_ring* oldest = NULL;
+    uint64_t oldest_time = 0;
+
+    for (uint32_t r = 0; r < LOG_RINGS; r++) {
+        struct log_ring* ring = &rings[r];
+
+        // Losses are owned up to where they happened
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_reported) {
+            char note[48];
+            char* p = append_decimal(note, dropped - ring->dropped_reported, 0, ' ');
+            p = append(p, " log messages dropped");
+            ring->dropped_reported = dropped;
+            format_line(ktime_get_ns(), LOG_LEVEL_WARN, note, p - note);
+            return true;
+        }
+
+        uint64_t pos = ring->dequeue_pos;
+        if (cell_sequence(ring, pos) != pos + 1) continue;
+        struct log_cell* first = &ring->cells[pos & LOG_RING_MASK];
+        if (cell_sequence(ring, pos + first->parts - 1) != pos + first->parts) continue;
+        if (!oldest || first->timestamp_ns < oldest_time) {
+            oldest = ring;
+            oldest_time = first->timestamp_ns;
+        }
+    }
+    if (!oldest) return false;
+
+    uint64_t pos = oldest->dequeue_pos;
+    struct log_cell* first = &oldest->cells[pos & LOG_RING_MASK];
+    uint32_t parts = first->parts;
+
+    char* p = format_prefix(line, first->timestamp_ns, first->level);
+    for (uint32_t i = 0; i < parts; i++) {
+        struct log_cell* cell = &oldest->cells[(pos + i) & LOG_RING_MASK];
+        memcpy(p, cell->text, cell->length);
+        p += cell->length;
+    }
+    format_end(p);
+
+    for (uint32_t i = 0; i < parts; i++) {
+        cell_publish(oldest, pos + i, pos + i + LOG_RING_SIZE);
     }
+    oldest->dequeue_pos = pos + parts;
+    return true;
 }
 
-static void print_num(uint64_t num, int base) {
-    char buffer[65];
-    char* ptr = &buffer[64];
-    *ptr = '\0';
+// THRE interrupt: the next bytes of the staged line, staging more as it
+// runs out. A busy drain, or a panic, hands the transmitter back.
+static uint32_t log_tx_fill(uint8_t* buffer, uint32_t room) {
+    if (panicking || !spinlock_try_acquire(&drain_lock)) return 0;
+
+    uint32_t count = 0;
+    while (count < room) {
+        if (line_pos == line_length && !log_next_line()) break;
+        uint32_t chunk = line_length - line_pos;
+        if (chunk > room - count) chunk = room - count;
+        memcpy(buffer + count, line + line_pos, chunk);
+        line_pos += chunk;
+        count += chunk;
+    }
+    spinlock_release(&drain_lock);
+    return count;
+}
+
+// A panic may have stopped another CPU inside the serial driver's lock
+static inline void log_putc(char c) {
+    if (panicking) {
+        serial_write_char_unlocked(COM1, c);
+    } else {
+        serial_write_char(COM1, c);
+    }
+}
 
+// Write out everything queued by polling the UART; drain lock held
+static void log_drain_polled(void) {
     do {
-        ptr--;
-        *ptr = "0123456789abcdef"[num % base];
-        num /= base;
-    } while (num > 0);
+        while (line_pos < line_length) {
+            log_putc(line[line_pos++]);
+        }
+    } while (log_next_line());
+}
 
-    write_serial(ptr);
+// The THRE interrupt disarms itself if it finds the drain busy, so hand
+// the transmitter back for anything queued meanwhile
+static void log_drain_unlock(void) {
+    spinlock_release(&drain_lock);
+    if (async_enabled && !panicking) serial_tx_kick(COM1);
+}
+
+static void log_drain_sync(void) {
+    if (!spinlock_try_acquire(&drain_lock)) return;
+    log_drain_polled();
+    log_drain_unlock();
+}
+
+static void log_write(log_level_t level, const char* text, size_t length) {
+    // Trailing line ends come back as one \r\n on the way out
+    while (length && (text[length - 1] == '\n' || text[length - 1] == '\r')) length--;
+    if (length > LOG_MESSAGE_MAX) length = LOG_MESSAGE_MAX;
+    uint64_t timestamp = ktime_get_ns();
+
+    if (panicking) {
+        // Straight out from the stack; the drain may have died with its
+        // lock held and the staged line half written
+        char out[LOG_LINE_MAX];
+        char* p = format_prefix(out, timestamp, level);
+        memcpy(p, text, length);
+        p = append(p + length, "\r\n");
+        for (char* c = out; c < p; c++) serial_write_char_unlocked(COM1, *c);
+        return;
+    }
+
+    uint32_t parts = length ? (uint32_t)((length + LOG_CELL_TEXT - 1) / LOG_CELL_TEXT) : 1;
+    struct log_ring* ring = &rings[smp_get_current_cpu() % LOG_RINGS];
+    if (!log_enqueue(ring, timestamp, level, text, length, parts)) {
+        // The interrupt cannot keep up, or is not running yet: make room
+        log_drain_sync();
+        if (!log_enqueue(ring, timestamp, level, text, length, parts)) {
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    if (async_enabled) {
+        serial_tx_kick(COM1);
+    } else {
+        log_drain_sync();
+    }
+}
+
+void log_enable_async(void) {
+    log_drain_sync();
+    if (serial_enable_tx_interrupt(COM1, log_tx_fill)) async_enabled = true;
+}
+
+void log_panic(void) {
+    if (__atomic_exchange_n(&panicking, true, __ATOMIC_ACQ_REL)) return;
+
+    // Whatever is queued comes out ahead of the panic's own messages. A
+    // drain that does not let go in time is presumed dead.
+    bool locked = false;
+    for (uint32_t i = 0; i < LOG_PANIC_SPINS && !(locked = spinlock_try_acquire(&drain_lock)); i++) {
+        __asm__ volatile("pause");
+    }
+    log_drain_polled();
+    if (locked) spinlock_release(&drain_lock);
+}
+
+void log_flush(void) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&drain_lock);
+    log_drain_polled();
+    log_drain_unlock();
+    irq_restore(flags);
+}
+
+void log_char(log_level_t level, char c) {
+    log_write(level, &c, 1);
+}
+
+void log_string(log_level_t level, const char* str) {
+    log_write(level, str, strlen(str));
 }
 
 void log_hex(log_level_t level, uint64_t value) {
-    write_serial(level_strings[level]);
-    write_serial("0x");
-    print_num(value, 16);
-    serial_write_char(COM1, '\r');
-    serial_write_char(COM1, '\n');
+    char buffer[20] = "0x";
+    char* ptr = &buffer[2];
+    int shift = 60;
+    while (shift > 0 && !((value >> shift) & 0xF)) shift -= 4;
+    for (; shift >= 0; shift -= 4) {
+        *ptr++ = "0123456789abcdef"[(value >> shift) & 0xF];
+    }
+    log_write(level, buffer, ptr - buffer);
 }
 
 void log_printf(log_level_t level, const char* format, ...) {
@@ -128,5 +391,5 @@ void log_printf(log_level_t level, const char* format, ...) {
     *ptr = '\0';
 
     va_end(args);
-    log_string(level, buffer);
+    log_write(level, buffer, ptr - buffer);
 }
\ No newline at end of file
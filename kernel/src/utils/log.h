@@ -10,7 +10,8 @@ typedef enum {
     LOG_LEVEL_INFO,
     LOG_LEVEL_WARN,
     LOG_LEVEL_ERROR,
-    LOG_LEVEL_FATAL
+    LOG_LEVEL_FATAL,
+    LOG_LEVEL_RAW       // Written as is, for dumps meant for other tools
 } log_level_t;
 
 struct log_state {
@@ -23,6 +24,18 @@ struct log_state {
 // Initialize logging system
 void log_init(void);
 
+// From here on messages are queued in per-CPU rings and sent by the
+// serial THRE interrupt; until then they are written out synchronously
+void log_enable_async(void);
+
+// Write out everything still queued and log synchronously from now on,
+// for the exception path; safe even if the drain died holding its lock
+void log_panic(void);
+
+// Write out everything queued so far by polling the UART, for callers
+// about to stop the machine
+void log_flush(void);
+
 // Core logging functions
 void log_printf(log_level_t level, const char* format, ...);
 void log_string(log_level_t level, const char* str);
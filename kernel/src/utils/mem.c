@@ -1,13 +1,184 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <mm/pmm.h>
 #include <mm/heap.h>
+#include <utils/mem.h>
 
+// Copies at least this large bypass the cache with non-temporal stores
+#define MEM_NT_THRESHOLD  (1024 * 1024)
+// Below this, rep movs start-up costs more than a word loop unless FSRM is present
+#define MEM_REP_THRESHOLD 64
+
+// The kernel is built without SSE, and syscalls and context switches do not
+// save vector state, so only string instructions and general purpose
+// registers are used here
+
+// Unaligned word access that may alias anything
+typedef uint64_t __attribute__((may_alias, aligned(1))) mem_word_t;
+
+// Keep the compiler from turning the loops below back into calls to these functions
+#define MEM_NO_BUILTIN __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+// Filled in by mem_init(); until then the baseline paths are used
+static bool has_erms = false;    // Enhanced rep movsb/stosb
+static bool has_fsrm = false;    // Fast short rep movsb
+static bool has_movnti = false;  // Non-temporal integer stores (SSE2)
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+void mem_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    has_movnti = (edx & (1 << 26)) != 0;
+
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpuid(7, &eax, &ebx, &ecx, &edx);
+        has_erms = (ebx & (1 << 9)) != 0;
+        has_fsrm = (edx & (1 << 4)) != 0;
+    }
+}
+
+static inline void rep_movsb(void *dest, const void *src, size_t n) {
+    asm volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) :: "memory");
+}
+
+static inline void rep_movsq(void *dest, const void *src, size_t n) {
+    asm volatile("rep movsq" : "+D"(dest), "+S"(src), "+c"(n) :: "memory");
+}
+
+static inline void rep_stosb(void *dest, uint8_t c, size_t n) {
+    asm volatile("rep stosb" : "+D"(dest), "+c"(n) : "a"(c) : "memory");
+}
+
+static inline void rep_stosq(void *dest, uint64_t pattern, size_t n) {
+    asm volatile("rep stosq" : "+D"(dest), "+c"(n) : "a"(pattern) : "memory");
+}
+
+static inline void movnti(void *dest, uint64_t value) {
+    asm volatile("movnti [%0], %1" :: "r"(dest), "r"(value) : "memory");
+}
+
+MEM_NO_BUILTIN
+static void copy_small(uint8_t *pdest, const uint8_t *psrc, size_t n) {
+    while (n >= 8) {
+        *(mem_word_t *)pdest = *(const mem_word_t *)psrc;
+        pdest += 8;
+        psrc += 8;
+        n -= 8;
+    }
+    while (n--) {
+        *pdest++ = *psrc++;
+    }
+}
+
+// Large copies stream past the cache so they do not evict the working set
+MEM_NO_BUILTIN
+static void copy_nt(uint8_t *pdest, const uint8_t *psrc, size_t n) {
+    size_t head = (-(uintptr_t)pdest) & 7;
+    copy_small(pdest, psrc, head);
+    pdest += head;
+    psrc += head;
+    n -= head;
+
+    while (n >= 32) {
+        uint64_t a = ((const mem_word_t *)psrc)[0];
+        uint64_t b = ((const mem_word_t *)psrc)[1];
+        uint64_t c = ((const mem_word_t *)psrc)[2];
+        uint64_t d = ((const mem_word_t *)psrc)[3];
+        movnti(pdest, a);
+        movnti(pdest + 8, b);
+        movnti(pdest + 16, c);
+        movnti(pdest + 24, d);
+        pdest += 32;
+        psrc += 32;
+        n -= 32;
+    }
+    asm volatile("sfence" ::: "memory");
+
+    copy_small(pdest, psrc, n);
+}
+
+// Front to back; also correct for overlapping buffers with dest below src
+static void copy_forward(uint8_t *pdest, const uint8_t *psrc, size_t n) {
+    if (n < MEM_REP_THRESHOLD && !has_fsrm) {
+        copy_small(pdest, psrc, n);
+    } else if (n >= MEM_NT_THRESHOLD && has_movnti) {
+        copy_nt(pdest, psrc, n);
+    } else if (has_erms || has_fsrm) {
+        rep_movsb(pdest, psrc, n);
+    } else {
+        rep_movsq(pdest, psrc, n / 8);
+        rep_movsb(pdest + (n & ~(size_t)7), psrc + (n & ~(size_t)7), n & 7);
+    }
+}
+
+// Back to front for overlapping buffers with dest above src
+MEM_NO_BUILTIN
+static void copy_backward(uint8_t *pdest, const uint8_t *psrc, size_t n) {
+    if (n < MEM_REP_THRESHOLD) {
+        while (n >= 8) {
+            n -= 8;
+            *(mem_word_t *)(pdest + n) = *(const mem_word_t *)(psrc + n);
+        }
+        while (n--) {
+            pdest[n] = psrc[n];
+        }
+        return;
+    }
+
+    // Backward string moves have no fast path, so move words and then the
+    // leftover head bytes. Interrupt entry clears DF again.
+    size_t words = n / 8;
+    size_t bytes = n & 7;
+    void *d = pdest + n - 8;
+    const void *s = psrc + n - 8;
+    asm volatile("std\n\trep movsq\n\tcld" : "+D"(d), "+S"(s), "+c"(words) :: "memory");
+
+    d = pdest + bytes - 1;
+    s = psrc + bytes - 1;
+    asm volatile("std\n\trep movsb\n\tcld" : "+D"(d), "+S"(s), "+c"(bytes) :: "memory");
+}
+
+MEM_NO_BUILTIN
 void *memset(void *s, int c, size_t n) {
     uint8_t *p = (uint8_t *)s;
+    uint64_t pattern = 0x0101010101010101ULL * (uint8_t)c;
 
-    for (size_t i = 0; i < n; i++) {
-        p[i] = (uint8_t)c;
+    if (n < MEM_REP_THRESHOLD && !has_fsrm) {
+        while (n >= 8) {
+            *(mem_word_t *)p = pattern;
+            p += 8;
+            n -= 8;
+        }
+        while (n--) {
+            *p++ = (uint8_t)c;
+        }
+    } else if (n >= MEM_NT_THRESHOLD && has_movnti) {
+        size_t head = (-(uintptr_t)p) & 7;
+        rep_stosb(p, (uint8_t)c, head);
+        p += head;
+        n -= head;
+
+        while (n >= 32) {
+            movnti(p, pattern);
+            movnti(p + 8, pattern);
+            movnti(p + 16, pattern);
+            movnti(p + 24, pattern);
+            p += 32;
+            n -= 32;
+        }
+        asm volatile("sfence" ::: "memory");
+        rep_stosb(p, (uint8_t)c, n);
+    } else if (has_erms || has_fsrm) {
+        rep_stosb(p, (uint8_t)c, n);
+    } else {
+        rep_stosq(p, pattern, n / 8);
+        rep_stosb(p + (n & ~(size_t)7), (uint8_t)c, n & 7);
     }
 
     return s;
@@ -17,23 +188,30 @@ void *memmove(void *dest, const void *src, size_t n) {
     uint8_t *pdest = (uint8_t *)dest;
     const uint8_t *psrc = (const uint8_t *)src;
 
-    if (src > dest) {
-        for (size_t i = 0; i < n; i++) {
-            pdest[i] = psrc[i];
-        }
-    } else if (src < dest) {
-        for (size_t i = n; i > 0; i--) {
-            pdest[i-1] = psrc[i-1];
-        }
+    if (pdest == psrc || n == 0) return dest;
+
+    // Unsigned distance: forward unless dest starts inside the source
+    if ((uintptr_t)pdest - (uintptr_t)psrc >= n) {
+        copy_forward(pdest, psrc, n);
+    } else {
+        copy_backward(pdest, psrc, n);
     }
 
     return dest;
 }
 
+MEM_NO_BUILTIN
 int memcmp(const void *s1, const void *s2, size_t n) {
     const uint8_t *p1 = (const uint8_t *)s1;
     const uint8_t *p2 = (const uint8_t *)s2;
 
+    // Skip equal words, then find the first differing byte
+    while (n >= 8 && *(const mem_word_t *)p1 == *(const mem_word_t *)p2) {
+        p1 += 8;
+        p2 += 8;
+        n -= 8;
+    }
+
     for (size_t i = 0; i < n; i++) {
         if (p1[i] != p2[i]) {
             return p1[i] < p2[i] ? -1 : 1;
@@ -44,18 +222,13 @@ int memcmp(const void *s1, const void *s2, size_t n) {
 }
 
 void *memcpy(void *dest, const void *src, size_t n) {
-    uint8_t *pdest = (uint8_t *)dest;
-    const uint8_t *psrc = (const uint8_t *)src;
-
-    for (size_t i = 0; i < n; i++) {
-        pdest[i] = psrc[i];
-    }
-
+    copy_forward((uint8_t *)dest, (const uint8_t *)src, n);
     return dest;
 }
 
+// Charged to whoever called these, see heap_track()
 void* malloc(size_t size) {
-    return heap_alloc(size);
+    return heap_alloc_from(size, (uintptr_t)__builtin_return_address(0));
 }
 
 void free(void* ptr) {
@@ -63,5 +236,5 @@ void free(void* ptr) {
 }
 
 void* realloc(void* ptr, size_t size) {
-    return heap_realloc(ptr, size);
+    return heap_realloc_from(ptr, size, (uintptr_t)__builtin_return_address(0));
 }
\ No newline at end of file
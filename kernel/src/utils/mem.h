@@ -4,7 +4,8 @@
 #include <stdint.h>
 #include <stddef.h>
 
-// Memory functions
+// Memory functions, dispatched on CPU features once mem_init() has run
+void mem_init(void);
 void *memset(void *s, int c, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
 int memcmp(const void *s1, const void *s2, size_t n);
@@ -15,4 +16,7 @@ void* malloc(size_t size);
 void free(void* ptr);
 void* realloc(void* ptr, size_t size);
 
+// Logs timings for a sweep of sizes and alignments
+void mem_benchmark(void);
+
 #endif // MEM_H
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <utils/mem.h>
+#include <utils/asm.h>
+#include <utils/log.h>
+#include <mm/vmalloc.h>
+
+// Sweeps memcpy/memset/memmove over sizes and alignments and logs the
+// average cycles per call, next to a byte loop for reference
+
+#define BENCH_MAX_SIZE  (4 * 1024 * 1024)
+#define BENCH_BYTES     (64 * 1024 * 1024)   // Bytes moved per measurement
+#define BENCH_MAX_ITERS 100000
+
+static const size_t bench_sizes[] = { 8, 64, 256, 1024, 4096, 65536, 1024 * 1024, BENCH_MAX_SIZE };
+static const size_t bench_aligns[] = { 0, 1, 8, 63 };
+
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void byte_copy(uint8_t* dest, const uint8_t* src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dest[i] = src[i];
+    }
+}
+
+static uint64_t bench_iters(size_t size) {
+    uint64_t iters = BENCH_BYTES / size;
+    if (iters > BENCH_MAX_ITERS) iters = BENCH_MAX_ITERS;
+    return iters ? iters : 1;
+}
+
+void mem_benchmark(void) {
+    // Room for the largest size plus misalignment, twice
+    uint8_t* src = vmalloc(BENCH_MAX_SIZE + 64);
+    uint8_t* dest = vmalloc(BENCH_MAX_SIZE * 2 + 64);
+    if (!src || !dest) {
+        log_error("membench: out of memory");
+        if (src) vfree(src);
+        if (dest) vfree(dest);
+        return;
+    }
+    memset(src, 0x5A, BENCH_MAX_SIZE + 64);
+    memset(dest, 0, BENCH_MAX_SIZE * 2 + 64);
+
+    for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        size_t size = bench_sizes[s];
+        uint64_t iters = bench_iters(size);
+
+        for (size_t a = 0; a < sizeof(bench_aligns) / sizeof(bench_aligns[0]); a++) {
+            size_t align = bench_aligns[a];
+            uint64_t start;
+
+            start = rdtsc();
+            for (uint64_t i = 0; i < iters; i++) memcpy(dest + align, src, size);
+            uint64_t copy = (rdtsc() - start) / iters;
+
+            start = rdtsc();
+            for (uint64_t i = 0; i < iters; i++) byte_copy(dest + align, src, size);
+            uint64_t bytes = (rdtsc() - start) / iters;
+
+            start = rdtsc();
+            for (uint64_t i = 0; i < iters; i++) memset(dest + align, (int)i, size);
+            uint64_t set = (rdtsc() - start) / iters;
+
+            // Overlapping, so half of these take the backward path
+            start = rdtsc();
+            for (uint64_t i = 0; i < iters; i++) {
+                if (i & 1) memmove(dest, dest + align + 1, size);
+                else memmove(dest + align + 1, dest, size);
+            }
+            uint64_t move = (rdtsc() - start) / iters;
+
+            log_info("membench: size %d align %d: memcpy %d, byte loop %d, memset %d, memmove %d cycles",
+                     (int)size, (int)align, (int)copy, (int)bytes, (int)set, (int)move);
+        }
+    }
+
+    vfree(src);
+    vfree(dest);
+}